@@ -12,6 +12,7 @@
 #include <onyx/arm64/mmu.h>
 #include <onyx/cpu.h>
 #include <onyx/intrinsics.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -638,12 +639,12 @@ void vm_free_arch_mmu(struct arch_mm_address_space *mm)
     free_page(phys_to_page((unsigned long) mm->top_pt));
 }
 
-/**
- * @brief Loads a new address space.
- *
- * @param mm The to-be-loaded address space.
- */
-void vm_load_arch_mmu(struct arch_mm_address_space *mm)
+unsigned int arch_nr_asids(void)
+{
+    return 1;
+}
+
+void arch_switch_mm(struct arch_mm_address_space *mm, unsigned int asid, bool flush)
 {
     paging_load_top_pt((PML *) mm->top_pt);
 }
@@ -975,6 +976,7 @@ struct mm_shootdown_info
     unsigned long addr;
     size_t pages;
     mm_address_space *mm;
+    u64 gen;
 };
 
 void arm64_invalidate_tlb(void *context)
@@ -982,16 +984,12 @@ void arm64_invalidate_tlb(void *context)
     auto info = (mm_shootdown_info *) context;
     auto addr = info->addr;
     auto pages = info->pages;
-    auto addr_space = info->mm;
-
-    auto curr_thread = get_current_thread();
 
-    if (is_higher_half(addr) ||
-        (curr_thread->owner && curr_thread->owner->get_aspace() == addr_space))
-    {
+    if (is_higher_half(addr))
         paging_invalidate((void *) addr, pages);
-        add_per_cpu(tlb_nr_invals, 1);
-    }
+    else
+        tlb_flush_mm_local(info->mm, addr, pages, info->gen);
+    add_per_cpu(tlb_nr_invals, 1);
 }
 
 /**
@@ -1004,7 +1002,7 @@ void arm64_invalidate_tlb(void *context)
 void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
 {
     add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
+    mm_shootdown_info info{addr, pages, mm, 0};
 
     auto our_cpu = get_cpu_nr();
     cpumask mask;
@@ -1015,6 +1013,7 @@ void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm
     }
     else
     {
+        info.gen = tlb_inc_gen(mm);
         mask = mm->active_mask;
         mask.remove_cpu(our_cpu);
     }
@@ -37,6 +37,16 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     UNIMPLEMENTED;
 }
 
+int platform_allocate_msi_vector(unsigned int cpu, struct pci_msi_data *data)
+{
+    UNIMPLEMENTED;
+}
+
+void platform_free_msi_vector(const struct pci_msi_data *data)
+{
+    UNIMPLEMENTED;
+}
+
 thread *sched_create_thread(thread_callback_t callback, uint32_t flags, void *args)
 {
     UNIMPLEMENTED;
@@ -132,7 +142,8 @@ int arch_transform_into_user_thread(thread *thread)
 
 } // namespace native
 
-thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx)
+struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx,
+                                   const struct fork_thread_args *args)
 {
     UNIMPLEMENTED;
 }
@@ -10,6 +10,7 @@
 #include <stdio.h>
 
 #include <onyx/cpu.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -19,7 +20,11 @@
 #include <onyx/smp.h>
 #include <onyx/vm.h>
 
+#include <onyx/utility.hpp>
+
 #define RISCV_SATP_4LEVEL_MMU (9UL << 60)
+#define RISCV_SATP_ASID_SHIFT 44
+#define RISCV_SATP_ASID_MASK  (0xffffUL << RISCV_SATP_ASID_SHIFT)
 
 static const unsigned int riscv_paging_levels = 4;
 static const unsigned int riscv_max_paging_levels = 5;
@@ -161,6 +166,7 @@ unsigned long placement_mappings_start = 0xffffffffffc00000;
 
 void __native_tlb_invalidate_all(void)
 {
+    __asm__ __volatile__("sfence.vma zero, zero" ::: "memory");
 }
 
 #define RISCV_SATP_ROOT_PT_MASK ((1UL << 44) - 1)
@@ -380,14 +386,39 @@ void vm_free_arch_mmu(struct arch_mm_address_space *mm)
     free_page(phys_to_page((unsigned long) mm->top_pt));
 }
 
-/**
- * @brief Loads a new address space.
- *
- * @param mm The to-be-loaded address space.
- */
-void vm_load_arch_mmu(struct arch_mm_address_space *mm)
+static unsigned int riscv_nr_asids;
+
+static unsigned int riscv_probe_asids()
+{
+    /* ASIDLEN is implementation defined (and may be 0). Find it by writing every ASID bit and
+     * seeing which ones stick. */
+    unsigned long satp = riscv_read_csr(RISCV_SATP);
+    riscv_write_csr(RISCV_SATP, satp | RISCV_SATP_ASID_MASK);
+    unsigned long asid_bits = (riscv_read_csr(RISCV_SATP) & RISCV_SATP_ASID_MASK);
+    riscv_write_csr(RISCV_SATP, satp);
+    __native_tlb_invalidate_all();
+
+    unsigned int asidlen = __builtin_popcountl(asid_bits);
+    /* ASID 0 is only used at boot */
+    return asidlen ? cul::min(TLB_NR_ASIDS, (1 << asidlen) - 1) : 1;
+}
+
+unsigned int arch_nr_asids(void)
 {
-    paging_load_top_pt((PML *) mm->top_pt);
+    if (!riscv_nr_asids) [[unlikely]]
+        riscv_nr_asids = riscv_probe_asids();
+    return riscv_nr_asids;
+}
+
+void arch_switch_mm(struct arch_mm_address_space *mm, unsigned int asid, bool flush)
+{
+    unsigned long hw_asid = arch_nr_asids() > 1 ? asid + 1 : 0;
+    unsigned long satp = RISCV_SATP_4LEVEL_MMU | hw_asid << RISCV_SATP_ASID_SHIFT |
+                         (unsigned long) mm->top_pt >> PAGE_SHIFT;
+
+    riscv_write_csr(RISCV_SATP, satp);
+    if (flush)
+        __asm__ __volatile__("sfence.vma zero, %0" ::"r"(hw_asid) : "memory");
 }
 
 /**
@@ -443,6 +474,7 @@ struct mm_shootdown_info
     unsigned long addr;
     size_t pages;
     mm_address_space *mm;
+    u64 gen;
 };
 
 void riscv_invalidate_tlb(void *context)
@@ -450,16 +482,13 @@ void riscv_invalidate_tlb(void *context)
     auto info = (mm_shootdown_info *) context;
     auto addr = info->addr;
     auto pages = info->pages;
-    auto addr_space = info->mm;
 
-    auto curr_thread = get_current_thread();
-
-    if (is_higher_half(addr) ||
-        (curr_thread->owner && curr_thread->owner->get_aspace() == addr_space))
-    {
+    /* sfence.vma with rs2 = zero flushes every ASID */
+    if (is_higher_half(addr))
         paging_invalidate((void *) addr, pages);
-        add_per_cpu(tlb_nr_invals, 1);
-    }
+    else
+        tlb_flush_mm_local(info->mm, addr, pages, info->gen);
+    add_per_cpu(tlb_nr_invals, 1);
 }
 
 /**
@@ -472,7 +501,7 @@ void riscv_invalidate_tlb(void *context)
 void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
 {
     add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
+    mm_shootdown_info info{addr, pages, mm, 0};
 
     auto our_cpu = get_cpu_nr();
     cpumask mask;
@@ -483,6 +512,7 @@ void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm
     }
     else
     {
+        info.gen = tlb_inc_gen(mm);
         mask = mm->active_mask;
         mask.remove_cpu(our_cpu);
     }
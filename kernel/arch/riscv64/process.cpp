@@ -12,16 +12,26 @@
 #include <onyx/scheduler.h>
 #include <onyx/thread.h>
 
-struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx)
+struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx,
+                                   const struct fork_thread_args *args)
 {
     registers_t regs;
+    void *tp = src->tp;
 
     /* Setup the registers on the stack */
     memcpy(&regs, &ctx->regs, sizeof(regs));
     regs.a0 = 0;   // fork returns 0
     regs.epc += 4; // Skip the "ecall"
 
-    thread_t *thread = sched_spawn_thread(&regs, 0, src->tp);
+    if (args && args->stack)
+        regs.sp = args->stack;
+    if (args && args->set_tls)
+    {
+        tp = (void *) args->tls;
+        regs.tp = args->tls;
+    }
+
+    thread_t *thread = sched_spawn_thread(&regs, 0, tp);
     if (!thread)
         return nullptr;
 
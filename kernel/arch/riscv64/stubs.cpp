@@ -24,6 +24,16 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     UNIMPLEMENTED;
 }
 
+int platform_allocate_msi_vector(unsigned int cpu, struct pci_msi_data *data)
+{
+    UNIMPLEMENTED;
+}
+
+void platform_free_msi_vector(const struct pci_msi_data *data)
+{
+    UNIMPLEMENTED;
+}
+
 void arch_vm_init()
 {
 }
@@ -13,6 +13,7 @@
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
 #include <onyx/gen/syscall.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/proc_event.h>
 
 #include <platform/syscall.h>
@@ -32,6 +33,10 @@ long do_syscall64(registers_t *frame)
     if (frame->a7 == SYS_sigaltstack)
         frame->a0 = (unsigned long) frame;
 
+    /* clone3's implementation requires the syscall frame as the 3rd argument */
+    if (frame->a7 == SYS_clone3)
+        frame->a2 = (unsigned long) frame;
+
     unsigned long syscall_nr = frame->a7;
     long ret = 0;
 
@@ -50,6 +55,7 @@ long do_syscall64(registers_t *frame)
     printk("Doing syscall %ld = %ld\n", syscall_nr, ret);
 #endif
     proc_event_exit_syscall(ret, syscall_nr);
+    mem_cgroup_handle_over_high();
 
     context_tracking_exit_kernel();
 
@@ -129,3 +129,30 @@ fault:
     CLEAR_USER_MEMORY_ACCESS;
     return -EFAULT;
 }
+
+long cmpxchg_user32(unsigned int *uaddr, unsigned int old, unsigned int new_val,
+                    unsigned int *curr)
+{
+    DO_USER_POINTER_CHECKS(uaddr, sizeof(uint32_t));
+    ALLOW_USER_MEMORY_ACCESS;
+    // Same output constraint caveat as get_user32, so curr is stored to from inside the asm
+    __asm__ goto("%=: lr.w.aqrl t1, 0(%1)\n\t"
+                 "    bne t1, %2, 3%=f\n\t"
+                 "2%=: sc.w.aqrl t2, %3, 0(%1)\n\t"
+                 "    bnez t2, %=b\n\t"
+                 "3%=: sw t1, %0\n\t"
+                 ".pushsection .ehtable\n\t"
+                 ".dword %=b\n\t"
+                 ".dword %l4\n\t"
+                 ".dword 2%=b\n\t"
+                 ".dword %l4\n\t"
+                 ".popsection\n\t" ::"m"(*curr),
+                 "r"(uaddr), "r"((long) (int) old), "r"(new_val)
+                 : "t1", "t2", "memory"
+                 : fault);
+    CLEAR_USER_MEMORY_ACCESS;
+    return 0;
+fault:
+    CLEAR_USER_MEMORY_ACCESS;
+    return -EFAULT;
+}
@@ -272,6 +272,13 @@ void x86_setup_standard_control_registers(void)
         cr4 |= CR4_LA57;
     }
 
+    if (x86_has_cap(X86_FEATURE_PCID))
+    {
+        /* Note: The current PCID (CR3[11:0]) must be 0 here, else we #GP. We only load non-zero
+         * PCIDs after every CPU is set up. */
+        cr4 |= CR4_PCIDE;
+    }
+
     /* Note that CR4_PGE could only be set at this point in time since Intel
      * strongly recommends for it to be set after enabling paging
      */
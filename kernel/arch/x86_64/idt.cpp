@@ -65,6 +65,12 @@ int x86_allocate_vectors(int nr)
     return -1;
 }
 
+void x86_free_vectors(int vector, int nr)
+{
+    assert(vector + nr <= 256);
+    memset(&idt_entries[vector], 0, sizeof(idt_entry_t) * nr);
+}
+
 extern unsigned long x86_isr_table[];
 
 #include <stdio.h>
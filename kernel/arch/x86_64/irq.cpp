@@ -77,23 +77,15 @@ unsigned long irq_handler(struct registers *regs)
     return (unsigned long) context.registers;
 }
 
-int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
-                                     struct pci_msi_data *data)
+static int x86_allocate_msi_vectors(unsigned int num_vectors, unsigned int cpu,
+                                    struct pci_msi_data *data)
 {
-    /* TODO: Balance IRQs between processors, since it's not ok to assume
-     * the current CPU, since then, IRQs become unbalanced
-     *
-     * TODO: Magenta hardcodes some of this stuff. Is it dangerous that things
-     * are hardcoded like that?
-     */
     int vecs = x86_allocate_vectors(num_vectors);
     if (vecs < 0)
         return -1;
     /* See section 10.11.1 of the intel software developer manuals */
     uint32_t address = PCI_MSI_BASE_ADDRESS;
-    address |= (cpu2lapicid(get_cpu_nr())) << PCI_MSI_APIC_ID_SHIFT;
-
-    printf("x86/msi: Routing %u vectors to cpu%u\n", num_vectors, get_cpu_nr());
+    address |= (cpu2lapicid(cpu)) << PCI_MSI_APIC_ID_SHIFT;
 
     /* See section 10.11.2 of the intel software developer manuals */
     uint32_t data_val = vecs;
@@ -119,6 +111,31 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     return 0;
 }
 
+int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
+                                     struct pci_msi_data *data)
+{
+    /* TODO: Balance IRQs between processors, since it's not ok to assume
+     * the current CPU, since then, IRQs become unbalanced
+     *
+     * TODO: Magenta hardcodes some of this stuff. Is it dangerous that things
+     * are hardcoded like that?
+     */
+    printf("x86/msi: Routing %u vectors to cpu%u\n", num_vectors, get_cpu_nr());
+    return x86_allocate_msi_vectors(num_vectors, get_cpu_nr(), data);
+}
+
+int platform_allocate_msi_vector(unsigned int cpu, struct pci_msi_data *data)
+{
+    /* Each MSI-X vector has its own address, so we can route it to whatever cpu the driver
+     * wants. The IDT is shared between all cpus, so the vector itself can be anything. */
+    return x86_allocate_msi_vectors(1, cpu, data);
+}
+
+void platform_free_msi_vector(const struct pci_msi_data *data)
+{
+    x86_free_vectors(data->vector_start, 1);
+}
+
 void platform_send_eoi(uint64_t irq)
 {
     /* Note: MSI interrupts also require EOIs */
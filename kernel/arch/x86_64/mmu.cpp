@@ -11,6 +11,7 @@
 #include <stdio.h>
 
 #include <onyx/cpu.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -440,17 +441,6 @@ int paging_clone_as(mm_address_space *addr_space, mm_address_space *original)
     return 0;
 }
 
-void paging_load_cr3(PML *pml)
-{
-    assert(pml != NULL);
-    PML *oldpml;
-
-    __asm__ __volatile__("movq %%cr3, %0" : "=r"(oldpml));
-    if (oldpml == pml)
-        return;
-    __asm__ __volatile__("movq %0, %%cr3" ::"r"(pml));
-}
-
 int is_invalid_arch_range(void *address, size_t pages)
 {
     unsigned long addr = (unsigned long) address;
@@ -607,14 +597,24 @@ void vm_free_arch_mmu(struct arch_mm_address_space *mm)
     free_page(phys_to_page((unsigned long) mm->cr3));
 }
 
-/**
- * @brief Loads a new address space.
- *
- * @param mm The to-be-loaded address space.
- */
-void vm_load_arch_mmu(struct arch_mm_address_space *mm)
+unsigned int arch_nr_asids(void)
 {
-    paging_load_cr3((PML *) mm->cr3);
+    return x86_has_cap(X86_FEATURE_PCID) ? TLB_NR_ASIDS : 1;
+}
+
+void arch_switch_mm(struct arch_mm_address_space *mm, unsigned int asid, bool flush)
+{
+    unsigned long cr3 = (unsigned long) mm->cr3;
+
+    if (x86_has_cap(X86_FEATURE_PCID))
+    {
+        /* PCID 0 is only used at boot */
+        cr3 |= asid + 1;
+        if (!flush)
+            cr3 |= CR3_NOFLUSH;
+    }
+
+    x86_write_cr3(cr3);
 }
 
 /**
@@ -671,6 +671,7 @@ struct mm_shootdown_info
     unsigned long addr;
     size_t pages;
     mm_address_space *mm;
+    u64 gen;
 };
 
 void x86_invalidate_tlb(void *context)
@@ -678,15 +679,13 @@ void x86_invalidate_tlb(void *context)
     auto info = (mm_shootdown_info *) context;
     auto addr = info->addr;
     auto pages = info->pages;
-    auto addr_space = info->mm;
 
-    auto curr_thread = get_current_thread();
-
-    if (is_higher_half(addr) || (curr_thread->owner && curr_thread->get_aspace() == addr_space))
-    {
+    /* Kernel mappings are global, invlpg flushes them for every PCID */
+    if (is_higher_half(addr))
         paging_invalidate((void *) addr, pages);
-        add_per_cpu(tlb_nr_invals, 1);
-    }
+    else
+        tlb_flush_mm_local(info->mm, addr, pages, info->gen);
+    add_per_cpu(tlb_nr_invals, 1);
 }
 
 /**
@@ -725,7 +724,7 @@ void tlbi_handle_spurious_fault_pte(struct mm_address_space *mm, unsigned long v
 void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
 {
     add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
+    mm_shootdown_info info{addr, pages, mm, 0};
 
     auto our_cpu = get_cpu_nr();
     cpumask mask;
@@ -736,6 +735,9 @@ void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm
     }
     else
     {
+        /* Only cpus that have the address space loaded. The rest catch up when they switch back
+         * to it, see kernel/mm/tlb.cpp. */
+        info.gen = tlb_inc_gen(mm);
         mask = mm->active_mask;
         mask.remove_cpu(our_cpu);
     }
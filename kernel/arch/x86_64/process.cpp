@@ -31,12 +31,18 @@ struct thread *process_create_thread(struct process *proc, thread_callback_t cal
     return thread;
 }
 
-struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx)
+struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx,
+                                   const struct fork_thread_args *args)
 {
     registers_t regs;
     unsigned long rsp, rflags, ip;
+    void *fs = src->fs;
 
     rsp = ctx->user_sp;
+    if (args && args->stack)
+        rsp = args->stack;
+    if (args && args->set_tls)
+        fs = (void *) args->tls;
     rflags = ctx->rflags;
     ip = ctx->rip;
 
@@ -60,7 +66,7 @@ struct thread *process_fork_thread(thread_t *src, struct process *dest, struct s
     regs.r15 = ctx->r15;
     regs.rflags = rflags;
 
-    thread_t *thread = sched_spawn_thread(&regs, 0, src->fs);
+    thread_t *thread = sched_spawn_thread(&regs, 0, fs);
     if (!thread)
         return nullptr;
 
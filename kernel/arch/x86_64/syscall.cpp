@@ -13,6 +13,7 @@
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
 #include <onyx/gen/syscall.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/proc_event.h>
 
 #include <platform/syscall.h>
@@ -30,8 +31,8 @@ extern "C" long do_syscall64(struct syscall_frame *frame)
     if (frame->rax == SYS_fork || frame->rax == SYS_sigreturn || frame->rax == SYS_vfork)
         frame->rdi = (unsigned long) frame;
 
-    /* sigaltstack's implementation requires the syscall frame as the 3rd argument */
-    if (frame->rax == SYS_sigaltstack)
+    /* sigaltstack's and clone3's implementations require the syscall frame as the 3rd argument */
+    if (frame->rax == SYS_sigaltstack || frame->rax == SYS_clone3)
         frame->rdx = (unsigned long) frame;
 
     unsigned long syscall_nr = frame->rax;
@@ -52,6 +53,7 @@ extern "C" long do_syscall64(struct syscall_frame *frame)
         printk("Error doing syscall %ld = %ld (%s)\n", syscall_nr, ret, strerror(-ret));
 #endif
     proc_event_exit_syscall(ret, syscall_nr);
+    mem_cgroup_handle_over_high();
 
     context_tracking_exit_kernel();
 
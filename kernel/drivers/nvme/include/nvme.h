@@ -56,6 +56,8 @@ private:
         uint32_t sq_head_{0};
         uint16_t index_;
         bool phase{true};
+        /* Polled queues are created without interrupts, and are reaped by poll() */
+        bool polled_{false};
         cul::vector<nvmecmd *> queued_commands_{};
         Bitmap<0> queued_bitmap_;
 
@@ -101,6 +103,7 @@ private:
             sq_tail_ = q.sq_tail_;
             index_ = q.index_;
             phase = q.phase;
+            polled_ = q.polled_;
             queued_commands_ = cul::move(q.queued_commands_);
             queued_bitmap_ = cul::move(q.queued_bitmap_);
             return *this;
@@ -125,6 +128,7 @@ private:
             sq_tail_ = q.sq_tail_;
             index_ = q.index_;
             phase = q.phase;
+            polled_ = q.polled_;
             queued_commands_ = cul::move(q.queued_commands_);
             queued_bitmap_ = cul::move(q.queued_bitmap_);
         }
@@ -154,6 +158,23 @@ private:
          */
         bool handle_cq();
 
+        /**
+         * @brief Poll the completion queue
+         *
+         * @return True if we reaped any completion, else false
+         */
+        bool poll() override;
+
+        void set_polled(bool polled)
+        {
+            polled_ = polled;
+        }
+
+        bool is_polled() const
+        {
+            return polled_;
+        }
+
         /**
          * @brief Allocates a CID
          *
@@ -225,7 +246,44 @@ private:
     };
     page *identify_page_;
 
+    /* queues_[0] is the admin queue, followed by nr_io_queues_ interrupt-driven IO queues and
+     * nr_poll_queues_ polled IO queues. */
     cul::vector<unique_ptr<nvme_queue>> queues_;
+    uint16_t nr_io_queues_{0};
+    uint16_t nr_poll_queues_{0};
+
+    struct nvme_vector
+    {
+        nvme_device *dev;
+        uint16_t index;
+    };
+
+    /* MSI-X vectors. Vector 0 belongs to the admin queue, the rest are spread over the IO queues
+     * and routed to the cpus that submit to them. Empty if we're not using MSI-X. */
+    cul::vector<nvme_vector> vectors_;
+
+    /**
+     * @brief Set up the device's interrupts (MSI-X, falling back to MSI or INTx)
+     *
+     * @return 0 on success, negative error codes
+     */
+    int setup_irqs();
+
+    /**
+     * @brief Get the MSI-X vector for an IO queue
+     *
+     * @param queue_index The queue's index (ignoring the admin queue)
+     * @return Interrupt vector
+     */
+    uint16_t io_queue_to_vector(uint16_t queue_index) const;
+
+    /**
+     * @brief Handle an MSI-X vector's IRQ
+     *
+     * @param vector Vector that got triggered
+     * @return Valid irqstatus_t
+     */
+    irqstatus_t handle_vector_irq(uint16_t vector);
 
     /**
      * @brief Identify and list namespaces
@@ -275,9 +333,10 @@ private:
      * @brief Create an IO queue
      *
      * @param queue_index The queue's index (ignoring the admin queue)
+     * @param polled If true, the queue is created without interrupts
      * @return 0 on success, negative error codes
      */
-    int create_io_queue(uint16_t queue_index);
+    int create_io_queue(uint16_t queue_index, bool polled);
 
     /**
      * @brief Do a CREATE_IO_SUBMISSION_QUEUE command
@@ -298,10 +357,11 @@ private:
      * @param queue_address Queue's address
      * @param queue_size Queue size
      * @param interrupt_vector Interrupt vector to use for the queue
+     * @param polled If true, disable interrupts for the queue
      * @return 0 on success, negative error codes
      */
     int cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_address, uint16_t queue_size,
-                                       uint16_t interrupt_vector);
+                                       uint16_t interrupt_vector, bool polled);
 
     /**
      * @brief Setup a PRP for a bio request
@@ -374,6 +434,26 @@ public:
      * @return IO queue
      */
     static struct io_queue *pick_queue(blockdev *bdev);
+
+    /**
+     * @brief Iterate every interrupt-driven IO queue
+     * Note that queues are shared between namespaces.
+     *
+     * @param bdev Block device
+     * @param cb Callback
+     * @param ctx Context for the callback
+     * @return 0 on success, or the first error returned by cb
+     */
+    static int for_each_queue(blockdev *bdev, int (*cb)(struct io_queue *queue, void *ctx),
+                              void *ctx);
+
+    /**
+     * @brief Pick a polled IO queue for a BIO_REQ_POLLED request
+     *
+     * @param bdev Block device
+     * @return IO queue, or nullptr if we have no polled queues
+     */
+    static struct io_queue *pick_poll_queue(blockdev *bdev);
 };
 
 // List of NVMe registers
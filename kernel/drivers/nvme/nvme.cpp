@@ -197,6 +197,63 @@ int nvme_device::probe()
 
     printf("Doorbell stride: %u\n", NVME_CAP_DSTRD(caps));
 
+    if (int st = setup_irqs(); st < 0)
+        return st;
+
+    if (int st = identify(); st < 0)
+        return st;
+
+    if (int st = init_io_queues(); st < 0)
+        return st;
+
+    if (int st = identify_namespaces(); st < 0)
+        return st;
+
+    return 0;
+}
+
+/**
+ * @brief Set up the device's interrupts (MSI-X, falling back to MSI or INTx)
+ *
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::setup_irqs()
+{
+    /* Try to get a vector for the admin queue + a vector per cpu, so every IO queue can complete on
+     * the cpu that submits to it. */
+    const unsigned int nr_vecs = cul::min(dev_->msix_nr_vectors(), get_nr_cpus() + 1);
+
+    cul::vector<void *> cookies;
+    cul::vector<unsigned int> cpus;
+
+    if (nr_vecs > 0 && vectors_.resize(nr_vecs) && cookies.resize(nr_vecs) &&
+        cpus.resize(nr_vecs))
+    {
+        for (unsigned int i = 0; i < nr_vecs; i++)
+        {
+            vectors_[i] = nvme_vector{this, (uint16_t) i};
+            cookies[i] = &vectors_[i];
+            /* Admin commands are rare, keep them on the boot cpu */
+            cpus[i] = i == 0 ? get_cpu_nr() : i - 1;
+        }
+
+        const auto handler = [](irq_context *ctx, void *cookie) -> irqstatus_t {
+            nvme_vector *vec = (nvme_vector *) cookie;
+            return vec->dev->handle_vector_irq(vec->index);
+        };
+
+        int st = dev_->enable_msix(nr_vecs, handler, cookies.get_buf(), cpus.get_buf());
+        if (st == 0)
+        {
+            pr_info("nvme%u: Using %u MSI-X vectors\n", device_index_, nr_vecs);
+            return 0;
+        }
+
+        pr_warn("nvme%u: Failed to enable MSI-X (error %d), falling back to MSI\n",
+                device_index_, st);
+        vectors_.clear();
+    }
+
     const auto handler = [](irq_context *ctx, void *cookie) -> irqstatus_t {
         return ((nvme_device *) cookie)->handle_irq(ctx);
     };
@@ -211,15 +268,6 @@ int nvme_device::probe()
         }
     }
 
-    if (int st = identify(); st < 0)
-        return st;
-
-    if (int st = init_io_queues(); st < 0)
-        return st;
-
-    if (int st = identify_namespaces(); st < 0)
-        return st;
-
     return 0;
 }
 
@@ -281,7 +329,11 @@ void nvme_device::set_queue_properties(blockdev *bdev)
     qp.request_cache = request_cache;
 }
 
-static const struct blk_mq_ops nvme_mq_ops = {.pick_queue = nvme_device::pick_queue};
+static const struct blk_mq_ops nvme_mq_ops = {
+    .pick_queue = nvme_device::pick_queue,
+    .pick_poll_queue = nvme_device::pick_poll_queue,
+    .for_each_queue = nvme_device::for_each_queue,
+};
 
 /**
  * @brief Initialise a new "drive" (namespace)
@@ -453,11 +505,48 @@ int nvme_device::setup_prp(struct request *breq, nvme_namespace *ns)
 struct io_queue *nvme_device::pick_queue(blockdev *bdev)
 {
     nvme_device *dev = ((nvme_namespace *) bdev->device_info)->nvme_dev_;
-    // Primitive algo: Use the cpu nr as an index
-    u16 index = (get_cpu_nr() % (dev->queues_.size() - 1)) + 1;
+    /* IO queue N is routed to cpu N (see setup_irqs), so completions land where we submit */
+    u16 index = (get_cpu_nr() % dev->nr_io_queues_) + 1;
+    return dev->queues_[index].get();
+}
+
+/**
+ * @brief Pick a polled IO queue for a BIO_REQ_POLLED request
+ *
+ * @param bdev Block device
+ * @return IO queue, or nullptr if we have no polled queues
+ */
+struct io_queue *nvme_device::pick_poll_queue(blockdev *bdev)
+{
+    nvme_device *dev = ((nvme_namespace *) bdev->device_info)->nvme_dev_;
+    if (!dev->nr_poll_queues_)
+        return nullptr;
+    u16 index = (get_cpu_nr() % dev->nr_poll_queues_) + dev->nr_io_queues_ + 1;
     return dev->queues_[index].get();
 }
 
+/**
+ * @brief Iterate every interrupt-driven IO queue
+ * Note that queues are shared between namespaces.
+ *
+ * @param bdev Block device
+ * @param cb Callback
+ * @param ctx Context for the callback
+ * @return 0 on success, or the first error returned by cb
+ */
+int nvme_device::for_each_queue(blockdev *bdev, int (*cb)(struct io_queue *queue, void *ctx),
+                                void *ctx)
+{
+    nvme_device *dev = ((nvme_namespace *) bdev->device_info)->nvme_dev_;
+    for (u16 i = 1; i <= dev->nr_io_queues_; i++)
+    {
+        if (int st = cb(dev->queues_[i].get(), ctx); st < 0)
+            return st;
+    }
+
+    return 0;
+}
+
 #define NVME_DEFAULT_SQ_SIZE 128UL
 #define NVME_DEFAULT_CQ_SIZE PAGE_SIZE / 16
 
@@ -509,10 +598,12 @@ int nvme_device::cmd_create_io_submission_queue(uint16_t queue, uint64_t queue_a
  * @param queue_address Queue's address
  * @param queue_size Queue size
  * @param interrupt_vector Interrupt vector to use for the queue
+ * @param polled If true, disable interrupts for the queue
  * @return 0 on success, negative error codes
  */
 int nvme_device::cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_address,
-                                                uint16_t queue_size, uint16_t interrupt_vector)
+                                                uint16_t queue_size, uint16_t interrupt_vector,
+                                                bool polled)
 {
     nvmecmd cmd;
     memset(&cmd, 0, sizeof(cmd));
@@ -521,7 +612,7 @@ int nvme_device::cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_a
     cmd.cmd.nsid = 0;
     cmd.cmd.dptr.prp[0] = queue_address;
     cmd.cmd.cdw10 = (queue_size - 1U) << 16 | queue;
-    cmd.cmd.cdw11 = (unsigned int) interrupt_vector << 16 | NVME_CREATE_IOCQ_IEN |
+    cmd.cmd.cdw11 = (unsigned int) interrupt_vector << 16 | (polled ? 0 : NVME_CREATE_IOCQ_IEN) |
                     NVME_CREATE_IOCQ_PHYS_CONTIG; // Set bit0 (physically contiguous)
     cmd.cmd.cdw12 = 0;
     cmd.req = nullptr;
@@ -543,13 +634,28 @@ int nvme_device::cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_a
     return 0;
 }
 
+/**
+ * @brief Get the MSI-X vector for an IO queue
+ *
+ * @param queue_index The queue's index (ignoring the admin queue)
+ * @return Interrupt vector
+ */
+uint16_t nvme_device::io_queue_to_vector(uint16_t queue_index) const
+{
+    /* Without MSI-X (or with a single vector), everything shares vector 0 */
+    if (vectors_.size() <= 1)
+        return 0;
+    return (queue_index % (vectors_.size() - 1)) + 1;
+}
+
 /**
  * @brief Create an IO queue
  *
  * @param queue_index The queue's index (ignoring the admin queue)
+ * @param polled If true, the queue is created without interrupts
  * @return 0 on success, negative error codes
  */
-int nvme_device::create_io_queue(uint16_t queue_index)
+int nvme_device::create_io_queue(uint16_t queue_index, bool polled)
 {
     const auto caps = read_caps();
     bool needs_contiguous = caps & NVME_CAP_CQR;
@@ -560,11 +666,12 @@ int nvme_device::create_io_queue(uint16_t queue_index)
     if (!q->init(needs_contiguous))
         return -ENOMEM;
 
-    // TODO: Proper MSI and MSI-X multi-vector support
-    const uint16_t interrupt_vector = 0;
+    q->set_polled(polled);
+
+    const uint16_t interrupt_vector = polled ? 0 : io_queue_to_vector(queue_index);
     if (int st = cmd_create_io_completion_queue(queue_index + 1,
                                                 (uint64_t) page_to_phys(q->get_cq_pages()),
-                                                q->get_cq_queue_size(), interrupt_vector);
+                                                q->get_cq_queue_size(), interrupt_vector, polled);
         st < 0)
     {
         printf("nvme%u: create io completion queue: error %d\n", device_index_, st);
@@ -608,7 +715,8 @@ int nvme_device::create_io_queue(uint16_t queue_index)
 int nvme_device::init_io_queues()
 {
     // Note: We clamp the number of queues to the max NVME queues (UINT16_MAX)
-    const uint16_t desired_nr_queues = cul::clamp(get_nr_cpus(), (unsigned int) NVME_MAX_QUEUES);
+    const uint16_t desired_nr_queues =
+        cul::clamp(get_nr_cpus() + CONFIG_NVME_POLL_QUEUES, (unsigned int) NVME_MAX_QUEUES);
 
     // Do set features to see if we can get the desired number of IO queues
     nvmecmd cmd;
@@ -643,17 +751,26 @@ int nvme_device::init_io_queues()
     const uint16_t allocated_queues =
         cul::min(desired_nr_queues, cul::min(allocated_cq, allocated_sq));
 
-    printf("nvme%u: Allocated %u queues\n", device_index_, allocated_queues);
+    // Interrupt-driven queues take priority over polled ones, and we always want at least one
+    const uint16_t nr_poll = cul::min((uint16_t) CONFIG_NVME_POLL_QUEUES,
+                                      (uint16_t) (allocated_queues > 1 ? allocated_queues - 1 : 0));
+    const uint16_t nr_io =
+        cul::min((uint16_t) (allocated_queues - nr_poll), (uint16_t) get_nr_cpus());
+
+    printf("nvme%u: Allocated %u queues (%u polled)\n", device_index_, nr_io + nr_poll, nr_poll);
 
-    for (uint16_t i = 0; i < allocated_queues; i++)
+    for (uint16_t i = 0; i < nr_io + nr_poll; i++)
     {
-        if (int st = create_io_queue(i); st < 0)
+        if (int st = create_io_queue(i, i >= nr_io); st < 0)
         {
             printf("nvme%u: create_io_queue: error %d\n", device_index_, st);
             return st;
         }
     }
 
+    nr_io_queues_ = nr_io;
+    nr_poll_queues_ = nr_poll;
+
     return 0;
 }
 
@@ -914,6 +1031,16 @@ int nvme_device::prepare_nvme_request(u8 bio_command, nvmecmd *cmd, struct reque
     return 0;
 }
 
+/**
+ * @brief Poll the completion queue
+ *
+ * @return True if we reaped any completion, else false
+ */
+bool nvme_device::nvme_queue::poll()
+{
+    return handle_cq();
+}
+
 /**
  * @brief Submits IO to a device
  *
@@ -1003,6 +1130,39 @@ irqstatus_t nvme_device::handle_irq(const irq_context *ctx)
     return handled ? IRQ_HANDLED : IRQ_UNHANDLED;
 }
 
+/**
+ * @brief Handle an MSI-X vector's IRQ
+ *
+ * @param vector Vector that got triggered
+ * @return Valid irqstatus_t
+ */
+irqstatus_t nvme_device::handle_vector_irq(uint16_t vector)
+{
+    bool handled = false;
+    const size_t nr_io_vecs = vectors_.size() - 1;
+
+    if (vector == 0)
+    {
+        handled = queues_[0]->handle_cq();
+        /* With a single vector, the admin queue's vector also serves every IO queue */
+        if (nr_io_vecs > 0)
+            return handled ? IRQ_HANDLED : IRQ_UNHANDLED;
+    }
+
+    /* IO queue N uses vector (N % nr_io_vecs) + 1 (see io_queue_to_vector). Note that queues_ can
+     * grow under us, but that only happens with IRQs disabled on every cpu (see create_io_queue).
+     */
+    const size_t stride = nr_io_vecs ?: 1;
+    for (size_t i = vector ?: 1; i < queues_.size(); i += stride)
+    {
+        if (queues_[i]->is_polled())
+            break;
+        handled |= queues_[i]->handle_cq();
+    }
+
+    return handled ? IRQ_HANDLED : IRQ_UNHANDLED;
+}
+
 /**
  * @brief Initialise the admin queue of the controller
  *
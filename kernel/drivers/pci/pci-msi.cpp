@@ -11,8 +11,10 @@
 #include <stdio.h>
 
 #include <onyx/acpi.h>
+#include <onyx/cpu.h>
 #include <onyx/page.h>
 #include <onyx/platform.h>
+#include <onyx/vector.h>
 
 #include <pci/pci-msi.h>
 #include <pci/pci.h>
@@ -71,4 +73,104 @@ int pci_device::enable_msi(irq_t handler, void *cookie)
     return 0;
 }
 
+unsigned int pci_device::msix_nr_vectors()
+{
+    size_t offset = find_capability(PCI_CAP_ID_MSI_X, 0);
+    if (offset == 0)
+        return 0;
+
+    uint16_t message_control = read(offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+    return PCI_MSIX_MSGCTRL_TABLE_SIZE(message_control);
+}
+
+int pci_device::enable_msix(unsigned int nr_vecs, irq_t handler, void *const *cookies,
+                            const unsigned int *cpus)
+{
+    if (!platform_has_msi())
+        return -EIO;
+
+    size_t offset = find_capability(PCI_CAP_ID_MSI_X, 0);
+    if (offset == 0)
+        return -ENODEV;
+
+    uint16_t message_control = read(offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+    if (nr_vecs == 0 || nr_vecs > PCI_MSIX_MSGCTRL_TABLE_SIZE(message_control))
+        return -EINVAL;
+
+    uint32_t table_reg = read(offset + PCI_MSIX_TABLE_OFF, sizeof(uint32_t));
+
+    /* Remember every vector we set up, so we can tear them down if a later one fails */
+    cul::vector<pci_msi_data> vecs;
+    if (!vecs.resize(nr_vecs))
+        return -ENOMEM;
+
+    if (!msix_table_)
+    {
+        volatile u8 *bar = (volatile u8 *) map_bar(PCI_MSIX_BIR(table_reg), VM_NOCACHE);
+        if (!bar)
+            return -ENOMEM;
+        msix_table_ = bar + PCI_MSIX_OFFSET(table_reg);
+    }
+
+    /* Mask the whole function while we set up the table, as recommended by the spec */
+    message_control |= PCI_MSIX_MSGCTRL_ENABLE | PCI_MSIX_MSGCTRL_FUNCTION_MASK;
+    write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    const unsigned int nr_cpus = get_nr_cpus();
+
+    unsigned int i;
+    int st = 0;
+
+    for (i = 0; i < nr_vecs; i++)
+    {
+        volatile u8 *entry = msix_table_ + i * PCI_MSIX_ENTRY_SIZE;
+        unsigned int cpu = cpus ? cpus[i] : i % nr_cpus;
+        struct pci_msi_data &data = vecs[i];
+
+        if (platform_allocate_msi_vector(cpu, &data) < 0)
+        {
+            st = -ENOSPC;
+            break;
+        }
+
+        if (install_irq(data.irq_offset, handler, this, IRQ_FLAG_REGULAR, cookies[i]) < 0)
+        {
+            platform_free_msi_vector(&data);
+            st = -ENOMEM;
+            break;
+        }
+
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_ADDR_LO) = data.address;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_ADDR_HI) = data.address_high;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_DATA) = data.data;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_VECTOR_CTRL) = 0;
+    }
+
+    if (st < 0)
+    {
+        message_control &= ~(PCI_MSIX_MSGCTRL_ENABLE | PCI_MSIX_MSGCTRL_FUNCTION_MASK);
+        write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+        /* MSI-X is off, so none of these can fire anymore. The caller is free to release the
+         * cookies once we return. */
+        while (i-- > 0)
+        {
+            volatile u8 *entry = msix_table_ + i * PCI_MSIX_ENTRY_SIZE;
+            *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_VECTOR_CTRL) =
+                PCI_MSIX_ENTRY_CTRL_MASKED;
+            free_irq(vecs[i].irq_offset, this);
+            platform_free_msi_vector(&vecs[i]);
+        }
+
+        return st;
+    }
+
+    /* MSI-X is on, so make sure legacy INTx is off */
+    disable_irq();
+    message_control &= ~PCI_MSIX_MSGCTRL_FUNCTION_MASK;
+    write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    return 0;
+}
+
 } // namespace pci
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2021 - 2022 Pedro Falcato
+ * Copyright (c) 2021 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  *
@@ -8,124 +8,155 @@
 
 #include "blk.hpp"
 
+#include <onyx/cpu.h>
 #include <onyx/id.h>
 #include <onyx/log.h>
+#include <onyx/mm/slab.h>
+#include <onyx/new.h>
 
 namespace virtio
 {
 
-static blk_features supported_features[] = {blk_features::size_max, blk_features::seg_max,
-                                            blk_features::geometry, blk_features::ro,
-                                            blk_features::blk_size, blk_features::topology,
-                                            blk_features::discard,  blk_features::write_zeroes};
+static blk_features supported_features[] = {
+    blk_features::size_max,     blk_features::seg_max,  blk_features::geometry,
+    blk_features::ro,           blk_features::blk_size, blk_features::topology,
+    blk_features::mq,           blk_features::discard,  blk_features::write_zeroes};
 
 static uint32_t bio_req_to_virtio_blk_type(uint8_t op)
 {
     switch (op)
     {
-    // TODO: Add support for the others
     case BIO_REQ_READ_OP:
         return VIRTIO_BLK_T_IN;
     case BIO_REQ_WRITE_OP:
         return VIRTIO_BLK_T_OUT;
+    case BIO_REQ_DISCARD_OP:
+        return VIRTIO_BLK_T_DISCARD;
+    case BIO_REQ_WRITE_ZEROES_OP:
+        return VIRTIO_BLK_T_WRITE_ZEROES;
     default:
         return (uint32_t) -1;
     }
 }
 
-int blk_vdev::submit_request(struct bio_req *req)
+static bool op_has_data(uint8_t op)
 {
-    uint8_t op = req->flags & BIO_REQ_OP_MASK;
-
-    // We allocate a meta page that will hold the header and status
-    // Yes, it's a bit wasteful, but much faster than walking page tables for stack
-    // variables' physical addresses
-    struct page *meta_page = alloc_page(PAGE_ALLOC_NO_ZERO);
-    if (!meta_page)
-        return -ENOMEM;
+    return op == BIO_REQ_READ_OP || op == BIO_REQ_WRITE_OP;
+}
 
-    virtio_blk_request *breq = (virtio_blk_request *) PAGE_TO_VIRT(meta_page);
-    virtio_blk_tail *btail = (virtio_blk_tail *) (breq + 1);
+/**
+ * @brief Describe a piece of a pdu as a page_iov
+ * pdus come from a non-vmalloc slab cache, so they're in the direct map and physically contiguous.
+ *
+ * @param ptr Pointer into the pdu
+ * @param length Length of the piece
+ * @return page_iov describing it
+ */
+static page_iov pdu_to_iov(void *ptr, size_t length)
+{
+    unsigned long phys = (unsigned long) ptr - PHYS_BASE;
+    return page_iov{phys_to_page(phys & -PAGE_SIZE), (unsigned int) length,
+                    (unsigned int) (phys & (PAGE_SIZE - 1))};
+}
 
-    breq->type = bio_req_to_virtio_blk_type(op);
+struct blk_fill_context
+{
+    struct request *req;
+    /* Current bio and vec index, for walking the request's data */
+    struct bio_req *bio;
+    size_t vec;
+};
 
-    if (breq->type == (uint32_t) -1)
+static virtio_desc_info blk_fill_desc(size_t vec_nr, virtio_allocation_info &info)
+{
+    blk_fill_context *ctx = (blk_fill_context *) info.context;
+    struct request *req = ctx->req;
+    virtio_blk_pdu *pdu = request_to_pdu(req);
+    uint8_t op = req->r_flags & BIO_REQ_OP_MASK;
+
+    // The header goes first, the status byte goes last. Data or the discard range goes in between
+    if (vec_nr == 0)
+        return {pdu_to_iov(&pdu->header, sizeof(pdu->header)), 0};
+    if (vec_nr == info.nr_vecs - 1)
+        return {pdu_to_iov(&pdu->tail, sizeof(pdu->tail)), VIRTIO_ALLOCATION_FLAG_WRITE};
+    if (!op_has_data(op))
+        return {pdu_to_iov(&pdu->range, sizeof(pdu->range)), 0};
+
+    while (ctx->vec == ctx->bio->nr_vecs)
     {
-        free_page(meta_page);
-        return -EIO;
+        ctx->bio = container_of(ctx->bio->list_node.next, struct bio_req, list_node);
+        ctx->vec = 0;
     }
 
-    breq->sector = req->sector_number;
-    breq->reserved = 0;
-    btail->status = 0;
-
-    const auto &requestq = get_vq(0);
-
-    virtio_allocation_info alloc_info;
-    virtio_completion completion;
+    return {ctx->bio->vec[ctx->vec++], op == BIO_REQ_READ_OP ? VIRTIO_ALLOCATION_FLAG_WRITE : 0U};
+}
 
-    alloc_info.nr_vecs = req->nr_vecs + 2;
-    alloc_info.vec = req->vec;
-    alloc_info.context = meta_page;
-    alloc_info.alloc_flags = VIRTIO_ALLOCATION_FLAG_WRITE;
+/**
+ * @brief Submits IO to a device
+ *
+ * @param req struct request to submit
+ * @return 0 on sucess, negative error codes
+ */
+int virtio_blk_queue::device_io_submit(struct request *req)
+{
+    uint8_t op = req->r_flags & BIO_REQ_OP_MASK;
+    uint32_t type = bio_req_to_virtio_blk_type(op);
+    virtio_blk_pdu *pdu = request_to_pdu(req);
 
-    alloc_info.fill_function = [](size_t vec_nr,
-                                  virtio_allocation_info &context) -> virtio_desc_info {
-        page_iov v;
-        auto meta_page = (page *) context.context;
-        virtio_blk_request *req = (virtio_blk_request *) PAGE_TO_VIRT(meta_page);
-        bool write = req->type == VIRTIO_BLK_T_IN;
+    if (type == (uint32_t) -1)
+    {
+        req->r_flags |= BIO_REQ_NOT_SUPP;
+        complete_request(req);
+        return 0;
+    }
 
-        if (vec_nr == 0)
-        {
-            // First descriptor
-            v.length = sizeof(virtio_blk_request);
-            v.page_off = 0;
-            v.page = meta_page;
-            write = false;
-        }
-        else if (vec_nr == (context.nr_vecs - 1))
-        {
-            // Last descriptor
-            v.length = sizeof(virtio_blk_tail);
-            v.page = meta_page;
-            v.page_off = sizeof(virtio_blk_request);
-            write = true;
-        }
-        else
-        {
-            v = *(context.vec + vec_nr - 1);
-        }
+    pdu->header.type = type;
+    pdu->header.reserved = 0;
+    // The sector field is only used by reads and writes
+    pdu->header.sector = op_has_data(op) ? req->r_sector : 0;
+    pdu->tail.status = VIRTIO_BLK_S_IOERR;
 
-        uint32_t alloc_flags = write ? VIRTIO_ALLOCATION_FLAG_WRITE : 0;
+    if (!op_has_data(op))
+    {
+        pdu->range.sector = req->r_sector;
+        pdu->range.num_sectors = (uint32_t) req->r_nsectors;
+        pdu->range.flags = 0;
+    }
 
-        return {v, alloc_flags};
-    };
+    new (&pdu->completion) virtio_blk_completion{req};
 
-    alloc_info.completion = &completion;
+    blk_fill_context ctx;
+    ctx.req = req;
+    ctx.bio = op_has_data(op)
+                  ? container_of(list_first_element(&req->r_bio_list), struct bio_req, list_node)
+                  : nullptr;
+    ctx.vec = 0;
 
-    requestq->allocate_descriptors(alloc_info, false);
+    virtio_allocation_info alloc_info;
+    alloc_info.nr_vecs = (op_has_data(op) ? req->r_nr_sgls : 1) + 2;
+    alloc_info.context = &ctx;
+    alloc_info.fill_function = blk_fill_desc;
+    alloc_info.completion = &pdu->completion;
 
-    requestq->put_buffer(alloc_info, true);
+    // We're called with the queue lock held, so we can't wait for descriptors. The io_queue will
+    // retry when something completes.
+    if (!vq_->try_allocate_descriptors(alloc_info))
+        return -EAGAIN;
 
-    completion.wait();
+    vq_->put_buffer(alloc_info, true);
+    return 0;
+}
 
-    if (btail->status == VIRTIO_BLK_S_OK)
-    {
-        req->flags |= BIO_REQ_DONE;
-    }
-    else if (btail->status == VIRTIO_BLK_S_UNSUPP)
-    {
-        req->flags |= BIO_REQ_NOT_SUPP;
-    }
-    else if (btail->status == VIRTIO_BLK_S_IOERR)
-    {
-        req->flags |= BIO_REQ_EIO;
-    }
+void virtio_blk_completion::wake()
+{
+    virtio_blk_pdu *pdu = request_to_pdu(req);
 
-    free_page(meta_page);
+    if (pdu->tail.status == VIRTIO_BLK_S_UNSUPP)
+        req->r_flags |= BIO_REQ_NOT_SUPP;
+    else if (pdu->tail.status != VIRTIO_BLK_S_OK)
+        req->r_flags |= BIO_REQ_EIO;
 
-    return 0;
+    req->r_queue->complete_request(req);
 }
 
 void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
@@ -136,18 +167,124 @@ void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
     completion->wake();
 }
 
-namespace blk
+/**
+ * @brief Pick an IO queue for a request
+ *
+ * @param bdev Block device
+ * @return IO queue
+ */
+struct io_queue *blk_vdev::pick_queue(struct blockdev *bdev)
+{
+    blk_vdev *dev = (blk_vdev *) bdev->device_info;
+    // Queue N's vector is routed to cpu N (see setup_queues), so completions land where we submit
+    return dev->queues_[get_cpu_nr() % dev->queues_.size()].get();
+}
+
+/**
+ * @brief Iterate every IO queue
+ *
+ * @param bdev Block device
+ * @param cb Callback
+ * @param ctx Context for the callback
+ * @return 0 on success, or the first error returned by cb
+ */
+int blk_vdev::for_each_queue(struct blockdev *bdev, int (*cb)(struct io_queue *queue, void *ctx),
+                             void *ctx)
 {
+    blk_vdev *dev = (blk_vdev *) bdev->device_info;
+    for (auto &queue : dev->queues_)
+    {
+        if (int st = cb(queue.get(), ctx); st < 0)
+            return st;
+    }
+
+    return 0;
+}
 
-int blk_submit_request(struct blockdev *dev, struct bio_req *req)
+static const struct blk_mq_ops virtio_blk_mq_ops = {
+    .pick_queue = blk_vdev::pick_queue,
+    .for_each_queue = blk_vdev::for_each_queue,
+};
+
+/**
+ * @brief Set up the request virtqueues (one per cpu, if the device supports it) and their
+ * MSI-X vectors.
+ *
+ * @return Number of queues created, 0 on failure
+ */
+unsigned int blk_vdev::setup_queues()
 {
-    auto blkdev = reinterpret_cast<virtio::blk_vdev *>(dev->device_info);
+    unsigned int nr_queues = 1;
+
+    if (has_feature(static_cast<unsigned long>(blk_features::mq)))
+        nr_queues = read<uint16_t>(static_cast<unsigned long>(blk_registers::num_queues));
+    nr_queues = cul::max(cul::min(nr_queues, get_nr_cpus()), 1U);
+
+    if (unsigned int nr_vecs = msix_nr_vectors(); nr_vecs > 0)
+    {
+        // Without a vector per queue, just use fewer queues
+        nr_queues = cul::min(nr_queues, nr_vecs);
+
+        cul::vector<unsigned int> cpus;
+        if (cpus.resize(nr_queues))
+        {
+            for (unsigned int i = 0; i < nr_queues; i++)
+                cpus[i] = i;
+
+            if (int st = enable_msix(nr_queues, cpus.get_buf()); st < 0)
+                MPRINTF("blk: Failed to enable MSI-X (error %d), using INTx\n", st);
+        }
+    }
+
+    if (!queues_.resize(nr_queues))
+        return 0;
+
+    for (unsigned int i = 0; i < nr_queues; i++)
+    {
+        if (!create_virtqueue(i, get_max_virtq_size(i)))
+            return 0;
 
-    req->sector_number += dev->offset / 512;
-    return blkdev->submit_request(req);
+        const auto &vq = get_vq(i);
+        queues_[i] = make_unique<virtio_blk_queue>(vq.get(), vq->get_queue_size() / 2);
+        if (!queues_[i])
+            return 0;
+    }
+
+    MPRINTF("blk: Using %u request queue%s%s\n", nr_queues, nr_queues > 1 ? "s" : "",
+            has_msix() ? " with MSI-X" : "");
+    return nr_queues;
 }
 
-} // namespace blk
+void blk_vdev::set_queue_properties(struct queue_properties &qp, unsigned int vq_size)
+{
+    static slab_cache *request_cache = kmem_cache_create(
+        "virtio-blk-request", sizeof(struct request) + sizeof(virtio_blk_pdu), 0, 0, nullptr);
+    CHECK(request_cache != nullptr);
+
+    qp.request_cache = request_cache;
+    // Every request needs a descriptor for the header and another for the status
+    qp.max_sgls_per_request = vq_size - 2;
+
+    if (has_feature(static_cast<unsigned long>(blk_features::seg_max)))
+    {
+        seg_max = read<uint32_t>(static_cast<unsigned long>(blk_registers::seg_max));
+        qp.max_sgls_per_request = cul::min(qp.max_sgls_per_request, (unsigned long) seg_max);
+    }
+
+    if (has_feature(static_cast<unsigned long>(blk_features::size_max)))
+    {
+        size_max = read<uint32_t>(static_cast<unsigned long>(blk_registers::size_max));
+        qp.max_sgl_desc_length = size_max;
+    }
+
+    if (has_feature(static_cast<unsigned long>(blk_features::discard)))
+        qp.max_discard_sectors =
+            read<uint32_t>(static_cast<unsigned long>(blk_registers::max_discard_sectors));
+
+    if (has_feature(static_cast<unsigned long>(blk_features::write_zeroes)))
+        qp.max_write_zeroes_sectors =
+            read<uint32_t>(static_cast<unsigned long>(blk_registers::max_write_zeroes_sectors));
+}
 
 bool blk_vdev::perform_subsystem_initialization()
 {
@@ -163,8 +300,7 @@ bool blk_vdev::perform_subsystem_initialization()
         return false;
     }
 
-    // Create the requestq queue
-    if (!create_virtqueue(0, get_max_virtq_size(0)))
+    if (setup_queues() == 0)
     {
         set_failure();
         return false;
@@ -177,8 +313,18 @@ bool blk_vdev::perform_subsystem_initialization()
     if (!dev)
         return false;
 
-    dev->submit_request = blk::blk_submit_request;
+    // The capacity is a 64-bit field, but we might be talking to the device through IO ports
+    uint64_t capacity = read<uint32_t>(static_cast<unsigned long>(blk_registers::capacity)) |
+                        (uint64_t) read<uint32_t>(
+                            static_cast<unsigned long>(blk_registers::capacity) + 4)
+                            << 32;
+
+    dev->device_info = this;
+    dev->submit_request = blk_mq_submit_request;
+    dev->mq_ops = &virtio_blk_mq_ops;
     dev->sector_size = 512;
+    dev->nr_sectors = capacity;
+    set_queue_properties(dev->bdev_queue_properties, get_vq(0)->get_queue_size());
 
     if (blkdev_init(dev.get()) < 0)
         return false;
@@ -10,6 +10,8 @@
 #include <stdint.h>
 
 #include <onyx/block.h>
+#include <onyx/block/io-queue.h>
+#include <onyx/block/multiqueue.h>
 
 #include "../virtio.hpp"
 #include <onyx/memory.hpp>
@@ -29,10 +31,11 @@ enum class blk_registers
     blk_size = 20,
     topo_physical_block_exp = 24,
     topo_alignment_offset = 25,
-    topo_min_io_size = 27,
+    topo_min_io_size = 26,
     topo_opt_io_size = 28,
     writeback = 32,
     unused0 = 33,
+    num_queues = 34,
     max_discard_sectors = 36,
     max_discard_seg = 40,
     discard_sector_alignment = 44,
@@ -52,16 +55,98 @@ enum class blk_features
     flush = 9,
     topology = 10,
     wce = 11,
-    discard = 12,
+    mq = 12,
+    discard = 13,
     write_zeroes = 14
 };
 
+struct virtio_blk_request
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+/* Payload for VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES */
+struct virtio_blk_discard_write_zeroes
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1 << 0)
+
+struct virtio_blk_tail
+{
+    uint8_t status;
+};
+
+class blk_vdev;
+
+/**
+ * @brief Completes a request when the device hands its descriptor chain back
+ *
+ */
+struct virtio_blk_completion : public virtio_completion
+{
+    struct request *req;
+
+    virtio_blk_completion(struct request *req) : req{req}
+    {
+    }
+
+    void wake() override;
+};
+
+/**
+ * @brief Per-request driver data, allocated inline after struct request. The request cache is not
+ * vmalloc'd, so this lives in the direct map and can be handed to the device as-is.
+ *
+ */
+struct virtio_blk_pdu
+{
+    virtio_blk_request header;
+    virtio_blk_discard_write_zeroes range;
+    virtio_blk_tail tail;
+    virtio_blk_completion completion;
+};
+
+static inline virtio_blk_pdu *request_to_pdu(struct request *req)
+{
+    return (virtio_blk_pdu *) b_request_to_data(req);
+}
+
+class virtio_blk_queue final : public io_queue
+{
+private:
+    virtq *vq_;
+
+protected:
+    /**
+     * @brief Submits IO to a device
+     *
+     * @param req struct request to submit
+     * @return 0 on sucess, negative error codes
+     */
+    int device_io_submit(struct request *req) override;
+
+public:
+    virtio_blk_queue(virtq *vq, unsigned int nr_entries) : io_queue{nr_entries}, vq_{vq}
+    {
+    }
+};
+
 class blk_vdev : public vdev
 {
 private:
     size_t block_size;
     size_t disk_size;
     size_t size_max, seg_max;
+    cul::vector<unique_ptr<virtio_blk_queue>> queues_;
+
+    unsigned int setup_queues();
+    void set_queue_properties(struct queue_properties &qp, unsigned int vq_size);
 
 public:
     blk_vdev(pci::pci_device *d) : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}
@@ -72,19 +157,25 @@ public:
     bool perform_subsystem_initialization() override;
 
     void handle_used_buffer(const virtq_used_elem &elem, virtq *vq) override;
-    int submit_request(struct bio_req *req);
-};
 
-struct virtio_blk_request
-{
-    uint32_t type;
-    uint32_t reserved;
-    uint64_t sector;
-};
-
-struct virtio_blk_tail
-{
-    uint8_t status;
+    /**
+     * @brief Pick an IO queue for a request
+     *
+     * @param bdev Block device
+     * @return IO queue
+     */
+    static struct io_queue *pick_queue(struct blockdev *bdev);
+
+    /**
+     * @brief Iterate every IO queue
+     *
+     * @param bdev Block device
+     * @param cb Callback
+     * @param ctx Context for the callback
+     * @return 0 on success, or the first error returned by cb
+     */
+    static int for_each_queue(struct blockdev *bdev, int (*cb)(struct io_queue *queue, void *ctx),
+                              void *ctx);
 };
 
 #define VIRTIO_BLK_T_IN           0
@@ -301,6 +301,14 @@ bool virtq_split::init()
     eff_queue_notify_off =
         (multiplier * device->read_config<uint16_t>(pci_common_cfg::queue_notify_off));
 
+    if (device->has_msix())
+    {
+        /* The device may fail to allocate a vector, in which case it reads back NO_VECTOR */
+        device->write_config<uint16_t>(pci_common_cfg::queue_msix_vector, nr);
+        if (device->read_config<uint16_t>(pci_common_cfg::queue_msix_vector) != nr)
+            return false;
+    }
+
     device->write_config<uint16_t>(pci_common_cfg::queue_enable, 1);
 
     descs = reinterpret_cast<virtq_desc *>(PHYS_TO_VIRT(_descs));
@@ -342,6 +350,17 @@ void virtq::allocate_descriptors(virtio_allocation_info &info, bool irq_context)
     irq_restore(flags);
 }
 
+bool virtq::try_allocate_descriptors(virtio_allocation_info &info)
+{
+    scoped_lock<spinlock, true> g{desc_alloc_lock};
+
+    if (!has_available_descriptors(info.nr_vecs))
+        return false;
+
+    allocate_buffer_list(info);
+    return true;
+}
+
 unsigned int virtq::alloc_descriptor_internal()
 {
     unsigned long desc;
@@ -500,6 +519,65 @@ void vdev::handle_vq_irq()
     }
 }
 
+/**
+ * @brief Enable MSI-X, with a vector per virtqueue
+ * Must be called before creating the virtqueues.
+ *
+ * @param nr_vqs Number of virtqueues (and thus vectors)
+ * @param cpus Array of nr_vqs cpus, one per vector (may be null)
+ * @return 0 on success, negative error codes
+ */
+int vdev::enable_msix(unsigned int nr_vqs, const unsigned int *cpus)
+{
+    cul::vector<void *> cookies;
+
+    if (nr_vqs > dev->msix_nr_vectors())
+        return -ENOSPC;
+
+    if (!msix_vectors.resize(nr_vqs) || !cookies.resize(nr_vqs))
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < nr_vqs; i++)
+    {
+        msix_vectors[i] = vq_vector{this, i};
+        cookies[i] = &msix_vectors[i];
+    }
+
+    const auto handler = [](irq_context *ctx, void *cookie) -> irqstatus_t {
+        vq_vector *vec = (vq_vector *) cookie;
+        return vec->dev->handle_vector_irq(vec->vq);
+    };
+
+    int st = dev->enable_msix(nr_vqs, handler, cookies.get_buf(), cpus);
+    if (st < 0)
+    {
+        msix_vectors.clear();
+        return st;
+    }
+
+    /* We don't care about config change interrupts */
+    write_config<uint16_t>(pci_common_cfg::msix_config, VIRTIO_MSI_NO_VECTOR);
+    msix_enabled = true;
+    return 0;
+}
+
+/**
+ * @brief Handle an MSI-X vector's IRQ
+ *
+ * @param vq Virtqueue the vector serves
+ * @return Valid irqstatus_t
+ */
+irqstatus_t vdev::handle_vector_irq(unsigned int vq)
+{
+    /* MSI-X vectors are not shared, and don't touch the ISR status */
+    if (vq >= virtqueue_list.size() || !virtqueue_list[vq])
+        return IRQ_HANDLED;
+
+    if (driver_handle_vq_irq(vq) == handle_vq_irq_result::HANDLE)
+        virtqueue_list[vq]->handle_irq();
+    return IRQ_HANDLED;
+}
+
 static bool our_irq(uint32_t status)
 {
     /* Automatically tests bit 0 and 1 */
@@ -508,8 +586,6 @@ static bool our_irq(uint32_t status)
 
 irqstatus_t vdev::handle_irq()
 {
-    /* TODO: Handle MSI-X interrupts */
-
     /* The spec states that reading this automatically clears
      * the isr status register and de-asserts the interrupt.
      */
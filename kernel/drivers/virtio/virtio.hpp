@@ -176,6 +176,14 @@ protected:
 public:
     void allocate_descriptors(virtio_allocation_info &info, bool irq_context);
 
+    /**
+     * @brief Try to allocate descriptors, without waiting for them to become available
+     *
+     * @param info Allocation info [in and out parameter]
+     * @return True if allocated, false if there are not enough free descriptors
+     */
+    bool try_allocate_descriptors(virtio_allocation_info &info);
+
     virtual unsigned int get_queue_size() = 0;
     virtq(vdev *dev, unsigned int nr)
         : device{dev}, nr{nr}, desc_bitmap{}, avail_descs(), desc_alloc_lock{}
@@ -373,6 +381,14 @@ enum class handle_vq_irq_result
     DELAY
 };
 
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+struct vq_vector
+{
+    vdev *dev;
+    unsigned int vq;
+};
+
 /* TODO: Hide pci::pci_device (since it may or may not be a pci::pci_device) with a virtual class */
 class vdev
 {
@@ -381,6 +397,9 @@ protected:
     void *bars[PCI_NR_BARS];
     virtio_structure structures[5];
     cul::vector<unique_ptr<virtq>> virtqueue_list;
+    /* If MSI-X is enabled, vector N serves virtqueue N */
+    cul::vector<vq_vector> msix_vectors;
+    bool msix_enabled{false};
 
     virtual bool supports_legacy()
     {
@@ -486,6 +505,39 @@ public:
 
     irqstatus_t handle_irq();
 
+    /**
+     * @brief Enable MSI-X, with a vector per virtqueue
+     * Must be called before creating the virtqueues.
+     *
+     * @param nr_vqs Number of virtqueues (and thus vectors)
+     * @param cpus Array of nr_vqs cpus, one per vector (may be null)
+     * @return 0 on success, negative error codes
+     */
+    int enable_msix(unsigned int nr_vqs, const unsigned int *cpus);
+
+    /**
+     * @brief Get the number of available MSI-X vectors
+     *
+     * @return Number of vectors, or 0 if MSI-X is not supported
+     */
+    unsigned int msix_nr_vectors() const
+    {
+        return dev->msix_nr_vectors();
+    }
+
+    bool has_msix() const
+    {
+        return msix_enabled;
+    }
+
+    /**
+     * @brief Handle an MSI-X vector's IRQ
+     *
+     * @param vq Virtqueue the vector serves
+     * @return Valid irqstatus_t
+     */
+    irqstatus_t handle_vector_irq(unsigned int vq);
+
     void handle_vq_irq();
 
     virtual void handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
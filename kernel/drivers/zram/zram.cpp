@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/bio.h>
+#include <onyx/block.h>
+#include <onyx/compression.h>
+#include <onyx/cpu.h>
+#include <onyx/driver.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/zsmalloc.h>
+#include <onyx/mutex.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+#include <uapi/memstat.h>
+
+#include <onyx/memory.hpp>
+
+/**
+ * zram is a RAM-backed block device that stores its pages compressed (with zstd), in a zsmalloc
+ * pool. Its main use is as a swap device, but it works for anything else. Every PAGE_SIZE chunk of
+ * the device is a slot, that's either unwritten (reads as zeroes), same-filled (stored inline in
+ * the slot), compressed, or incompressible (stored raw). IO is done synchronously, in the
+ * submitter's context.
+ */
+
+#define ZRAM_COMPRESSION_LEVEL 1
+/* Slots are locked by hashing them into one of these */
+#define ZRAM_NR_LOCKS 64
+
+/* The slot is same-filled, value holds the pattern */
+#define ZRAM_SAME (1U << 0)
+
+struct zram_slot
+{
+    unsigned long handle;
+    unsigned long value;
+    unsigned int length;
+    unsigned int flags;
+};
+
+struct zram_stream
+{
+    struct mutex lock;
+    compression::context *ctx;
+    u8 *buffer;
+};
+
+struct zram_stats
+{
+    unsigned long pages_stored;
+    unsigned long same_pages;
+    unsigned long huge_pages;
+    unsigned long compr_data_size;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long failed_writes;
+};
+
+struct zram
+{
+    struct blockdev *bdev;
+    struct zram_slot *slots;
+    unsigned long nr_pages;
+    struct zs_pool *pool;
+    struct zram_stream *streams;
+    unsigned int nr_streams;
+    struct mutex locks[ZRAM_NR_LOCKS];
+    struct zram_stats stats;
+    struct sysfs_object mm_stat;
+};
+
+static struct zram zram;
+
+#define zram_stat_add(name, val) __atomic_add_fetch(&zram.stats.name, val, __ATOMIC_RELAXED)
+#define zram_stat_inc(name)      zram_stat_add(name, 1)
+#define zram_stat_dec(name)      zram_stat_add(name, -1UL)
+
+static struct mutex *zram_slot_lock(unsigned long index)
+{
+    return &zram.locks[index % ZRAM_NR_LOCKS];
+}
+
+static bool zram_page_same_filled(const unsigned long *data, unsigned long *value)
+{
+    unsigned long val = data[0];
+
+    for (unsigned int i = 1; i < PAGE_SIZE / sizeof(unsigned long); i++)
+    {
+        if (data[i] != val)
+            return false;
+    }
+
+    *value = val;
+    return true;
+}
+
+static void zram_fill_page(unsigned long *data, unsigned long value)
+{
+    for (unsigned int i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++)
+        data[i] = value;
+}
+
+/**
+ * @brief Free a slot's data
+ * Called with the slot lock held.
+ *
+ * @param slot Slot to free
+ */
+static void zram_free_slot(struct zram_slot *slot)
+{
+    if (slot->flags & ZRAM_SAME)
+        zram_stat_dec(same_pages);
+    else if (slot->handle)
+    {
+        if (slot->length == PAGE_SIZE)
+            zram_stat_dec(huge_pages);
+        zram_stat_add(compr_data_size, -(unsigned long) slot->length);
+        zs_free(zram.pool, slot->handle);
+    }
+    else
+        return;
+
+    zram_stat_dec(pages_stored);
+    slot->handle = 0;
+    slot->value = 0;
+    slot->length = 0;
+    slot->flags = 0;
+}
+
+static struct zram_stream *zram_get_stream()
+{
+    /* We might get migrated to another CPU, but it doesn't matter, the lock protects the stream */
+    struct zram_stream *stream = &zram.streams[get_cpu_nr() % zram.nr_streams];
+    mutex_lock(&stream->lock);
+    return stream;
+}
+
+static void zram_put_stream(struct zram_stream *stream)
+{
+    mutex_unlock(&stream->lock);
+}
+
+static int zram_read_page(unsigned long index, void *dst)
+{
+    struct zram_slot *slot = &zram.slots[index];
+    struct mutex *lock = zram_slot_lock(index);
+    int err = 0;
+
+    mutex_lock(lock);
+
+    if (slot->flags & ZRAM_SAME)
+        zram_fill_page((unsigned long *) dst, slot->value);
+    else if (!slot->handle)
+        memset(dst, 0, PAGE_SIZE);
+    else if (slot->length == PAGE_SIZE)
+        memcpy(dst, zs_map_object(zram.pool, slot->handle), PAGE_SIZE);
+    else
+    {
+        cul::slice<unsigned char> src{(unsigned char *) zs_map_object(zram.pool, slot->handle),
+                                      slot->length};
+        struct zram_stream *stream = zram_get_stream();
+        auto ex = stream->ctx->decompress(dst, PAGE_SIZE, src);
+        zram_put_stream(stream);
+
+        if (ex.has_error() || ex.value() != PAGE_SIZE)
+        {
+            pr_err("zram: Failed to decompress slot %lu\n", index);
+            err = -EIO;
+        }
+    }
+
+    mutex_unlock(lock);
+    return err;
+}
+
+static int zram_write_page(unsigned long index, void *src)
+{
+    struct zram_slot *slot = &zram.slots[index];
+    struct mutex *lock = zram_slot_lock(index);
+    struct zram_slot new_slot = {};
+
+    if (zram_page_same_filled((const unsigned long *) src, &new_slot.value))
+        new_slot.flags = ZRAM_SAME;
+    else
+    {
+        struct zram_stream *stream = zram_get_stream();
+        auto ex = stream->ctx->compress(stream->buffer, PAGE_SIZE,
+                                        cul::slice<unsigned char>{(unsigned char *) src, PAGE_SIZE});
+        /* Store incompressible pages as-is, it's cheaper to read them back */
+        const void *data = src;
+        new_slot.length = PAGE_SIZE;
+        if (!ex.has_error() && ex.value() < PAGE_SIZE)
+        {
+            data = stream->buffer;
+            new_slot.length = ex.value();
+        }
+
+        new_slot.handle = zs_malloc(zram.pool, new_slot.length, GFP_NOIO);
+        if (!new_slot.handle)
+        {
+            zram_put_stream(stream);
+            zram_stat_inc(failed_writes);
+            return -ENOMEM;
+        }
+
+        memcpy(zs_map_object(zram.pool, new_slot.handle), data, new_slot.length);
+        zram_put_stream(stream);
+
+        zram_stat_add(compr_data_size, new_slot.length);
+        if (new_slot.length == PAGE_SIZE)
+            zram_stat_inc(huge_pages);
+    }
+
+    if (new_slot.flags & ZRAM_SAME)
+        zram_stat_inc(same_pages);
+    zram_stat_inc(pages_stored);
+
+    mutex_lock(lock);
+    zram_free_slot(slot);
+    *slot = new_slot;
+    mutex_unlock(lock);
+    return 0;
+}
+
+static void zram_discard_page(unsigned long index)
+{
+    struct mutex *lock = zram_slot_lock(index);
+    mutex_lock(lock);
+    zram_free_slot(&zram.slots[index]);
+    mutex_unlock(lock);
+}
+
+/**
+ * @brief Do IO on (part of) a single slot
+ *
+ * @param op BIO_REQ_READ_OP, BIO_REQ_WRITE_OP or BIO_REQ_WRITE_ZEROES_OP
+ * @param pos Byte offset in the device
+ * @param buf Buffer to read into/write from (unused for write zeroes)
+ * @param len Length of the IO, must not cross a slot boundary
+ * @return 0 on success, negative error codes
+ */
+static int zram_do_io(u8 op, u64 pos, u8 *buf, size_t len)
+{
+    unsigned long index = pos >> PAGE_SHIFT;
+    unsigned int off = pos & (PAGE_SIZE - 1);
+    int err;
+
+    if (off == 0 && len == PAGE_SIZE)
+    {
+        if (op == BIO_REQ_READ_OP)
+            return zram_read_page(index, buf);
+        if (op == BIO_REQ_WRITE_ZEROES_OP)
+        {
+            zram_discard_page(index);
+            return 0;
+        }
+        return zram_write_page(index, buf);
+    }
+
+    /* Partial slot IO, go through a bounce page (and read-modify-write, for writes) */
+    u8 *bounce = (u8 *) kmalloc(PAGE_SIZE, GFP_NOIO);
+    if (!bounce)
+        return -ENOMEM;
+
+    /* Note: RMW is not atomic wrt concurrent partial writes to the same slot. Like with real
+     * disks, it's up to the upper layers to not do that. */
+    err = zram_read_page(index, bounce);
+    if (err < 0)
+        goto out;
+
+    if (op == BIO_REQ_READ_OP)
+    {
+        memcpy(buf, bounce + off, len);
+        goto out;
+    }
+
+    if (op == BIO_REQ_WRITE_ZEROES_OP)
+        memset(bounce + off, 0, len);
+    else
+        memcpy(bounce + off, buf, len);
+    err = zram_write_page(index, bounce);
+out:
+    kfree(bounce);
+    return err;
+}
+
+static int zram_do_discard(struct bio_req *bio, u8 op)
+{
+    u64 pos = bio->sector_number * zram.bdev->sector_size;
+    u64 end = pos + bio->b_nr_sectors * zram.bdev->sector_size;
+
+    while (pos < end)
+    {
+        size_t len = cul::min(end - pos, (u64) PAGE_SIZE - (pos & (PAGE_SIZE - 1)));
+
+        if (len == PAGE_SIZE)
+            zram_discard_page(pos >> PAGE_SHIFT);
+        else if (op == BIO_REQ_WRITE_ZEROES_OP)
+        {
+            /* Discard is advisory and can skip partial slots, write zeroes can't */
+            if (int err = zram_do_io(op, pos, nullptr, len); err < 0)
+                return err;
+        }
+
+        pos += len;
+    }
+
+    return 0;
+}
+
+static int zram_do_bio(struct bio_req *bio)
+{
+    u8 op = bio->flags & BIO_REQ_OP_MASK;
+    u64 pos = bio->sector_number * zram.bdev->sector_size;
+
+    if (op == BIO_REQ_DISCARD_OP || op == BIO_REQ_WRITE_ZEROES_OP)
+    {
+        if (bio->sector_number + bio->b_nr_sectors > zram.bdev->nr_sectors)
+            return -EIO;
+        return zram_do_discard(bio, op);
+    }
+
+    if (op != BIO_REQ_READ_OP && op != BIO_REQ_WRITE_OP)
+        return -EOPNOTSUPP;
+
+    for (size_t i = 0; i < bio->nr_vecs; i++)
+    {
+        const struct page_iov *iov = &bio->vec[i];
+        u8 *buf = (u8 *) PAGE_TO_VIRT(iov->page) + iov->page_off;
+        size_t len = iov->length;
+
+        if (pos + len > zram.nr_pages << PAGE_SHIFT)
+            return -EIO;
+
+        while (len > 0)
+        {
+            size_t chunk = cul::min(len, PAGE_SIZE - (size_t) (pos & (PAGE_SIZE - 1)));
+            if (int err = zram_do_io(op, pos, buf, chunk); err < 0)
+                return err;
+            pos += chunk;
+            buf += chunk;
+            len -= chunk;
+        }
+    }
+
+    if (op == BIO_REQ_READ_OP)
+        zram_stat_inc(reads);
+    else
+        zram_stat_inc(writes);
+    return 0;
+}
+
+static int zram_submit_request(struct blockdev *dev, struct bio_req *bio)
+{
+    int err = zram_do_bio(bio);
+    if (err == -EOPNOTSUPP)
+        bio->flags |= BIO_REQ_NOT_SUPP;
+    else if (err < 0)
+        bio->flags |= BIO_REQ_EIO;
+
+    /* bio_do_complete drops a reference, and the submitter still holds its own */
+    bio_get(bio);
+    bio_do_complete(bio);
+    return 0;
+}
+
+static ssize_t zram_mm_stat_show(struct sysfs_object *obj, void *buffer, size_t size, off_t off)
+{
+    char buf[384];
+    int len = snprintf(
+        buf, sizeof(buf),
+        "disksize %lu\npages_stored %lu\nsame_pages %lu\nhuge_pages %lu\ncompr_data_size "
+        "%lu\nmem_used_total %lu\nreads %lu\nwrites %lu\nfailed_writes %lu\n",
+        zram.nr_pages << PAGE_SHIFT, READ_ONCE(zram.stats.pages_stored),
+        READ_ONCE(zram.stats.same_pages), READ_ONCE(zram.stats.huge_pages),
+        READ_ONCE(zram.stats.compr_data_size), zs_get_total_pages(zram.pool) << PAGE_SHIFT,
+        READ_ONCE(zram.stats.reads), READ_ONCE(zram.stats.writes),
+        READ_ONCE(zram.stats.failed_writes));
+
+    if ((size_t) off >= (size_t) len)
+        return 0;
+    size = cul::min(size, (size_t) len - off);
+    if (copy_to_user(buffer, buf + off, size) < 0)
+        return -EFAULT;
+    return size;
+}
+
+static int zram_init_streams()
+{
+    zram.nr_streams = get_nr_cpus();
+    zram.streams = (struct zram_stream *) kcalloc(zram.nr_streams, sizeof(struct zram_stream),
+                                                  GFP_KERNEL);
+    if (!zram.streams)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < zram.nr_streams; i++)
+    {
+        struct zram_stream *stream = &zram.streams[i];
+        mutex_init(&stream->lock);
+
+        stream->buffer = (u8 *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if (!stream->buffer)
+            return -ENOMEM;
+
+        auto ex = compression::create_context("zstd", ZRAM_COMPRESSION_LEVEL);
+        if (ex.has_error())
+            return ex.error();
+        stream->ctx = ex.value().release();
+    }
+
+    return 0;
+}
+
+static void zram_free_streams()
+{
+    if (!zram.streams)
+        return;
+
+    for (unsigned int i = 0; i < zram.nr_streams; i++)
+    {
+        delete zram.streams[i].ctx;
+        kfree(zram.streams[i].buffer);
+    }
+
+    kfree(zram.streams);
+    zram.streams = nullptr;
+}
+
+static int zram_init()
+{
+    struct memstat ms;
+    int err;
+
+    page_get_stats(&ms);
+    zram.nr_pages = ms.total_pages * CONFIG_ZRAM_SIZE_PERCENT / 100;
+    if (!zram.nr_pages)
+        return -EINVAL;
+
+    for (unsigned int i = 0; i < ZRAM_NR_LOCKS; i++)
+        mutex_init(&zram.locks[i]);
+
+    if (err = zram_init_streams(); err < 0)
+    {
+        pr_err("zram: Failed to create compression streams: %d\n", err);
+        goto err;
+    }
+
+    zram.pool = zs_create_pool("zram0");
+    if (!zram.pool)
+    {
+        err = -ENOMEM;
+        goto err;
+    }
+
+    zram.slots = (struct zram_slot *) vmalloc(
+        vm_size_to_pages(zram.nr_pages * sizeof(struct zram_slot)), VM_TYPE_REGULAR,
+        VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!zram.slots)
+    {
+        err = -ENOMEM;
+        goto err;
+    }
+
+    {
+        unique_ptr<blockdev> dev = make_unique<blockdev>();
+        if (!dev)
+        {
+            err = -ENOMEM;
+            goto err;
+        }
+
+        dev->name = "zram0";
+        if (!dev->name)
+        {
+            err = -ENOMEM;
+            goto err;
+        }
+
+        dev->sector_size = 512;
+        dev->nr_sectors = (zram.nr_pages << PAGE_SHIFT) / dev->sector_size;
+        dev->device_info = &zram;
+        dev->submit_request = zram_submit_request;
+        dev->bdev_queue_properties.max_discard_sectors = dev->nr_sectors;
+        dev->bdev_queue_properties.max_write_zeroes_sectors = dev->nr_sectors;
+
+        if (err = blkdev_init(dev.get()); err < 0)
+            goto err;
+
+        zram.bdev = dev.release();
+    }
+
+    if (sysfs_init_and_add("mm_stat", &zram.mm_stat, &zram.bdev->bdev_sysfs) == 0)
+    {
+        zram.mm_stat.show = zram_mm_stat_show;
+        zram.mm_stat.perms = 0444 | S_IFREG;
+    }
+
+    pr_info("zram: zram0 created, %lu KiB\n", (zram.nr_pages << PAGE_SHIFT) / 1024);
+    return 0;
+err:
+    if (zram.slots)
+        vfree(zram.slots, vm_size_to_pages(zram.nr_pages * sizeof(struct zram_slot)));
+    if (zram.pool)
+        zs_destroy_pool(zram.pool);
+    zram_free_streams();
+    zram.slots = nullptr;
+    zram.pool = nullptr;
+    return err;
+}
+
+DRIVER_INIT(zram_init);
@@ -12,6 +12,8 @@
 #include <onyx/page_iov.h>
 #include <onyx/types.h>
 
+#include <lib/binary_search_tree.h>
+
 /* Keep basic bdev types that are universally used and exported to consumers here. Do not keep
  * blockdev nor io_queue here.
  */
@@ -25,6 +27,9 @@ typedef u64 sector_t;
 #define BIO_REQ_READ_OP         0
 #define BIO_REQ_WRITE_OP        1
 #define BIO_REQ_DEVICE_SPECIFIC 2
+/* Data-less operations. These carry no pages, and cover b_nr_sectors sectors */
+#define BIO_REQ_DISCARD_OP      3
+#define BIO_REQ_WRITE_ZEROES_OP 4
 
 /* BIO flags start at bit 8 since bits 0 - 7 are reserved for operations */
 /* Note that we still have 24 bits for flags, which should be More Than Enough(tm) */
@@ -34,6 +39,8 @@ typedef u64 sector_t;
 #define BIO_REQ_NOT_SUPP     (1 << 11)
 #define BIO_REQ_PINNED_PAGES (1 << 12)
 #define BIO_REQ_CLONED       (1 << 13)
+/* Reap the completion by polling the hardware queue instead of waiting for an IRQ */
+#define BIO_REQ_POLLED       (1 << 14)
 
 #define BIO_STATUS_MASK (BIO_REQ_DONE | BIO_REQ_EIO | BIO_REQ_TIMEOUT | BIO_REQ_NOT_SUPP)
 
@@ -49,6 +56,10 @@ struct bio_req
     struct list_head list_node;
     void (*b_end_io)(struct bio_req *req);
     void *b_private;
+    /* Queue a BIO_REQ_POLLED bio was submitted to, and that needs to be polled */
+    struct io_queue *b_poll_queue;
+    /* Length of data-less bios (BIO_REQ_DISCARD_OP, BIO_REQ_WRITE_ZEROES_OP), in sectors */
+    sector_t b_nr_sectors;
     struct page_iov b_inline_vec[];
 };
 
@@ -80,6 +91,10 @@ struct request
     struct list_head r_bio_list;
     struct list_head r_queue_list_node;
     size_t r_nr_sgls;
+    /* IO scheduler state. Only valid while the request is queued (i.e not yet submitted). */
+    struct bst_node r_sort_node;
+    /* Expiry time, in ns (see clocksource_get_time()) */
+    u64 r_deadline;
     /* Anything can come after this. Block devices specify their request's sizes, and data is
      * allocated inline. */
 };
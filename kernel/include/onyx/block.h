@@ -19,6 +19,7 @@
 #include <onyx/list.h>
 #include <onyx/mm/flush.h>
 #include <onyx/page.h>
+#include <onyx/sysfs.h>
 #include <onyx/types.h>
 
 #include <onyx/slice.hpp>
@@ -55,6 +56,9 @@ struct queue_properties
     /* Individual SGL descriptors can't cross this boundary. AKA start & ~dma_boundary == end &
      * ~dma_boundary. */
     unsigned long dma_boundary;
+    /* Max sectors per discard/write zeroes request. 0 if not supported. */
+    sector_t max_discard_sectors;
+    sector_t max_write_zeroes_sectors;
 };
 
 constexpr void bdev_set_default_queue_properties(struct queue_properties &props)
@@ -68,6 +72,8 @@ constexpr void bdev_set_default_queue_properties(struct queue_properties &props)
     props.max_sgl_desc_length = -1UL;
     props.bounce_highmem = false;
     props.dma_boundary = -1UL;
+    props.max_discard_sectors = 0;
+    props.max_write_zeroes_sectors = 0;
 }
 
 struct io_queue;
@@ -76,6 +82,13 @@ struct request;
 struct blk_mq_ops
 {
     struct io_queue *(*pick_queue)(struct blockdev *bdev);
+    /* Optional. Pick a queue for BIO_REQ_POLLED IO. These queues may not raise IRQs at all, and
+     * their completions are reaped by io_queue::poll(). */
+    struct io_queue *(*pick_poll_queue)(struct blockdev *bdev);
+    /* Optional. Call cb for every (non-polled) IO queue of the device, stopping at the first error.
+     * Devices that don't implement this have a single queue, given by pick_queue. */
+    int (*for_each_queue)(struct blockdev *bdev, int (*cb)(struct io_queue *queue, void *ctx),
+                          void *ctx);
 };
 
 struct blockdev
@@ -111,6 +124,9 @@ struct blockdev
     struct mutex bdev_lock;
     unsigned int nr_open_partitions;
     unsigned int nr_busy;
+    /* /sys/block/<name>, for whole disks */
+    struct sysfs_object bdev_sysfs{};
+    struct sysfs_object bdev_sched_sysfs{};
 
     /* A block device cannot be a partition and be partitioned */
     union {
@@ -143,6 +159,30 @@ static inline struct blockdev *blkdev_get_dev(struct file *f)
  */
 int blkdev_init(struct blockdev *dev);
 
+struct io_scheduler;
+
+/**
+ * @brief Set a block device's IO scheduler
+ * This switches every IO queue of the device. Note that a device might share queues with other
+ * devices (e.g NVMe namespaces).
+ *
+ * @param bdev Block device
+ * @param sched IO scheduler (nullptr for none)
+ * @return 0 on success, negative error codes
+ */
+int blk_set_scheduler(struct blockdev *bdev, const struct io_scheduler *sched);
+
+/**
+ * @brief Discard or zero out a range of sectors
+ *
+ * @param bdev Block device
+ * @param sector First sector
+ * @param nr_sectors Number of sectors
+ * @param op BIO_REQ_DISCARD_OP or BIO_REQ_WRITE_ZEROES_OP
+ * @return 0 on success, negative error codes
+ */
+int bdev_discard(struct blockdev *bdev, sector_t sector, sector_t nr_sectors, u8 op);
+
 static inline bool block_get_device_letter_from_id(unsigned int id, cul::slice<char> buffer)
 {
     if (id > 26)
@@ -9,7 +9,9 @@
 #ifndef _ONYX_BLOCK_IO_QUEUE_H
 #define _ONYX_BLOCK_IO_QUEUE_H
 
+#include <onyx/atomic.h>
 #include <onyx/bio.h>
+#include <onyx/block/io-sched.h>
 #include <onyx/block/request.h>
 #include <onyx/list.h>
 #include <onyx/spinlock.h>
@@ -31,6 +33,9 @@ protected:
     spinlock lock_;
     unsigned int flags_{0};
     struct list_head req_list_;
+    /* IO scheduler, if any. If NULL, req_list_ is used as a FIFO */
+    const struct io_scheduler *sched_{nullptr};
+    void *sched_data_{nullptr};
 
     /**
      * @brief Submits IO to a device
@@ -61,6 +66,38 @@ protected:
      */
     void __restart_queue();
 
+    /**
+     * @brief Queue a request, for later dispatch.
+     * The lock must be held.
+     *
+     * @param req Request to queue
+     */
+    void queue_request(struct request *req);
+
+    /**
+     * @brief Dequeue the next request to dispatch.
+     * The lock must be held.
+     *
+     * @return The next request, or nullptr if there are none
+     */
+    struct request *dequeue_request();
+
+    /**
+     * @brief Put back a request that could not be dispatched.
+     * The lock must be held.
+     *
+     * @param req Request to requeue
+     */
+    void requeue_request(struct request *req);
+
+    /**
+     * @brief Check if we have queued requests.
+     * The lock must be held.
+     *
+     * @return True if there are requests to dispatch, else false
+     */
+    bool has_queued_requests();
+
 public:
     list_head_cpp<io_queue> pending_node_{this};
 
@@ -124,6 +161,17 @@ public:
         return -ENOSYS;
     }
 
+    /**
+     * @brief Poll the hardware queue for completions
+     * Used by BIO_REQ_POLLED IO, where the submitter spins on the queue instead of sleeping.
+     *
+     * @return True if we reaped any completion, else false
+     */
+    virtual bool poll()
+    {
+        return false;
+    }
+
     /**
      * @brief "Pull" a submission queue entry from req_list_
      *
@@ -131,13 +179,9 @@ public:
      */
     struct request *pull_sqe()
     {
-        if (list_is_empty(&req_list_))
-            return nullptr;
-
-        struct request *req =
-            container_of(list_first_element(&req_list_), struct request, r_queue_list_node);
-        list_remove(&req->r_queue_list_node);
-        used_entries_++;
+        struct request *req = dequeue_request();
+        if (req)
+            used_entries_++;
         return req;
     }
 
@@ -148,7 +192,7 @@ public:
      */
     void unpull_seq(struct request *req)
     {
-        list_add(&req->r_queue_list_node, &req_list_);
+        requeue_request(req);
         used_entries_--;
     }
 
@@ -159,6 +203,33 @@ public:
      * @param nr_reqs Number of requests
      */
     void submit_batch(struct list_head *req_list, u32 nr_reqs);
+
+    /**
+     * @brief Try to merge a bio into a queued request
+     *
+     * @param bio Bio to merge
+     * @return True if merged, else false
+     */
+    bool try_merge_bio(struct bio_req *bio);
+
+    /**
+     * @brief Set the queue's IO scheduler
+     * Requests already queued are moved over to the new scheduler.
+     *
+     * @param sched New scheduler (nullptr for none)
+     * @return 0 on success, negative error codes
+     */
+    int set_scheduler(const struct io_scheduler *sched);
+
+    /**
+     * @brief Get the queue's IO scheduler
+     *
+     * @return The current scheduler, or nullptr for none
+     */
+    const struct io_scheduler *get_scheduler() const
+    {
+        return READ_ONCE(sched_);
+    }
 };
 
 #endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_BLOCK_IO_SCHED_H
+#define _ONYX_BLOCK_IO_SCHED_H
+
+#include <onyx/bdev_base_types.h>
+
+struct io_queue;
+
+/**
+ * @brief An IO scheduler (elevator). Sits between blk_mq_submit_request and the hardware queue,
+ * holding requests the device can't take yet and picking which one to dispatch next.
+ * Every callback but init_queue and exit_queue is called with the io_queue's lock held. The
+ * "none" scheduler is represented by a NULL io_scheduler, and is a plain FIFO.
+ */
+struct io_scheduler
+{
+    const char *name;
+    /* Allocate per-queue data. Returns NULL on OOM */
+    void *(*init_queue)(struct io_queue *queue);
+    /* Free per-queue data. The scheduler holds no requests at this point */
+    void (*exit_queue)(void *data);
+    /* Optional. Try to merge a bio into an already queued request */
+    bool (*merge_bio)(void *data, struct bio_req *bio);
+    void (*insert_request)(void *data, struct request *req);
+    /* Put back a request that was dispatched but that the device could not take */
+    void (*requeue_request)(void *data, struct request *req);
+    /* Pick the next request to dispatch. Returns NULL if there's nothing queued */
+    struct request *(*dispatch_request)(void *data);
+    bool (*has_work)(void *data);
+};
+
+/**
+ * @brief Find an IO scheduler by name
+ *
+ * @param name Name of the scheduler
+ * @param sched Pointer to the result (NULL for "none")
+ * @return 0 on success, -EINVAL if it does not exist
+ */
+int io_sched_find(const char *name, const struct io_scheduler **sched);
+
+/**
+ * @brief Print the list of available schedulers to buf, with the current one between brackets
+ * (e.g "none [mq-deadline]\n")
+ *
+ * @param current Current scheduler
+ * @param buf Buffer
+ * @param len Length of the buffer
+ * @return Number of characters written
+ */
+size_t io_sched_print(const struct io_scheduler *current, char *buf, size_t len);
+
+extern const struct io_scheduler mq_deadline_sched;
+
+#endif
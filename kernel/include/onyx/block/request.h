@@ -26,6 +26,15 @@ struct request *bio_req_to_request(struct bio_req *bio);
  */
 void block_request_free(struct request *req);
 
+/**
+ * @brief Try to merge a bio into a request that has not been submitted yet
+ *
+ * @param req Request to merge into
+ * @param bio Bio to merge
+ * @return True if merged, else false
+ */
+bool block_try_merge(struct request *req, struct bio_req *bio);
+
 #define list_head_to_request(l) (container_of(l, struct request, r_queue_list_node))
 
 #ifdef __cplusplus
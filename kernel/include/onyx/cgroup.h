@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_CGROUP_H
+#define _ONYX_CGROUP_H
+
+#include <onyx/compiler.h>
+#include <onyx/list.h>
+#include <onyx/rcupdate.h>
+#include <onyx/types.h>
+
+#include <uapi/posix-types.h>
+
+struct cgroup;
+struct file;
+struct process;
+
+#define CGROUP_NAME_MAX 64
+
+enum cgroup_subsys_id
+{
+#ifdef CONFIG_CGROUP_SCHED
+    CGROUP_CPU_SUBSYS,
+#endif
+#ifdef CONFIG_MEMCG
+    CGROUP_MEMORY_SUBSYS,
+#endif
+    CGROUP_NR_SUBSYS
+};
+
+/* Per-cgroup state of a controller. Controllers embed it in their own structure. */
+struct cgroup_subsys_state
+{
+    struct cgroup *cgroup;
+};
+
+/* Don't create the file in the root cgroup */
+#define CGROUP_FILE_NOT_ON_ROOT (1 << 0)
+
+struct cgroup_file
+{
+    const char *name;
+    mode_t mode;
+    unsigned int flags;
+    /**
+     * @brief Format the file's contents
+     *
+     * @param cg cgroup the file belongs to
+     * @param buf Buffer to format into
+     * @param len Length of the buffer
+     * @return Length of the contents, or negative error codes
+     */
+    ssize_t (*show)(struct cgroup *cg, char *buf, size_t len);
+    /**
+     * @brief Handle a write to the file
+     *
+     * @param cg cgroup the file belongs to
+     * @param buf Written data, NUL terminated and stripped of trailing whitespace
+     * @param len Length of buf
+     * @return 0 on success, negative error codes
+     */
+    int (*write)(struct cgroup *cg, char *buf, size_t len);
+};
+
+struct cgroup_subsys
+{
+    const char *name;
+    /**
+     * @brief Create the controller's state for a new cgroup
+     * Called with the hierarchy lock held, with the parent's state already set up.
+     *
+     * @param cg New cgroup
+     * @return The new state, NULL if the controller doesn't track cg (only allowed for the root),
+     * or an ERR_PTR
+     */
+    struct cgroup_subsys_state *(*css_alloc)(struct cgroup *cg);
+    /**
+     * @brief The cgroup was removed (rmdir). There may still be references to it.
+     */
+    void (*css_offline)(struct cgroup_subsys_state *css);
+    /**
+     * @brief Release the controller's state. Called once the cgroup's last reference is gone.
+     */
+    void (*css_free)(struct cgroup_subsys_state *css);
+    /**
+     * @brief A process was moved between cgroups. Called with the hierarchy lock held.
+     */
+    void (*attach)(struct process *p, struct cgroup *from, struct cgroup *to);
+    /* Control files, terminated by an entry with a NULL name */
+    const struct cgroup_file *files;
+};
+
+#define CGROUP_DEAD (1 << 0)
+
+struct cgroup
+{
+    char name[CGROUP_NAME_MAX];
+    struct cgroup *parent;
+    /* Children, protected by the hierarchy lock */
+    struct list_head children;
+    struct list_head sibling;
+    unsigned long refcount;
+    unsigned long id;
+    /* Number of (live) processes directly in this cgroup */
+    unsigned int nr_procs;
+    unsigned int flags;
+    struct cgroup_subsys_state *subsys[CGROUP_NR_SUBSYS];
+    struct rcu_head rcu;
+};
+
+__BEGIN_CDECLS
+
+extern struct cgroup cgroup_root;
+extern const struct cgroup_subsys *const cgroup_subsystems[CGROUP_NR_SUBSYS];
+/* Control files every cgroup has (cgroup.*) */
+extern const struct cgroup_file cgroup_core_files[];
+
+static inline void cgroup_get(struct cgroup *cg)
+{
+    __atomic_add_fetch(&cg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drop a reference to a cgroup
+ * The cgroup (and its controller state) is freed after an RCU grace period.
+ *
+ * @param cg cgroup
+ */
+void cgroup_put(struct cgroup *cg);
+
+/**
+ * @brief Get the controller state of a cgroup
+ *
+ * @param cg cgroup
+ * @param id Controller
+ * @return The controller's state, or NULL
+ */
+static inline struct cgroup_subsys_state *cgroup_css(struct cgroup *cg, enum cgroup_subsys_id id)
+{
+    return cg->subsys[id];
+}
+
+/**
+ * @brief Get the current process' cgroup
+ * Must be called under rcu_read_lock(). Kernel threads belong to the root cgroup.
+ *
+ * @return The current cgroup, valid until rcu_read_unlock()
+ */
+struct cgroup *cgroup_current(void);
+
+/**
+ * @brief Create a new cgroup
+ *
+ * @param parent Parent cgroup
+ * @param name Name of the new cgroup
+ * @return The new cgroup (with a reference held by the hierarchy), or an ERR_PTR
+ */
+struct cgroup *cgroup_create(struct cgroup *parent, const char *name);
+
+/**
+ * @brief Remove a cgroup from the hierarchy
+ *
+ * @param cg cgroup to remove
+ * @return 0 on success, -EBUSY if it still has processes or children
+ */
+int cgroup_destroy(struct cgroup *cg);
+
+/**
+ * @brief Look up a child cgroup by name
+ *
+ * @param parent Parent cgroup
+ * @param name Name of the child
+ * @return The child, with a reference, or NULL
+ */
+struct cgroup *cgroup_lookup_child(struct cgroup *parent, const char *name);
+
+/**
+ * @brief Get the nth child of a cgroup (for readdir)
+ *
+ * @param parent Parent cgroup
+ * @param n Index of the child
+ * @return The child, with a reference, or NULL
+ */
+struct cgroup *cgroup_nth_child(struct cgroup *parent, unsigned long n);
+
+/**
+ * @brief Move a process to a cgroup
+ *
+ * @param cg Destination cgroup
+ * @param p Process to move
+ * @return 0 on success, negative error codes
+ */
+int cgroup_attach_process(struct cgroup *cg, struct process *p);
+
+/**
+ * @brief Set up a new process' cgroup (the parent's, or the root for init)
+ *
+ * @param child New process
+ * @param parent Parent process, or NULL
+ */
+void cgroup_fork(struct process *child, struct process *parent);
+
+/**
+ * @brief Take an exiting process out of its cgroup's process count
+ * The process keeps its reference to the cgroup until it's freed.
+ *
+ * @param p Exiting process
+ */
+void cgroup_exit(struct process *p);
+
+/**
+ * @brief Get the cgroup a cgroup2 directory refers to
+ *
+ * @param f Open directory
+ * @return The cgroup, with a reference, or NULL if f isn't a cgroup directory
+ */
+struct cgroup *cgroupfs_file_to_cgroup(struct file *f);
+
+/**
+ * @brief Parse a memory size ("max", or a number with an optional K/M/G suffix)
+ *
+ * @param buf String to parse
+ * @param out Parsed value, ULONG_MAX for "max"
+ * @return 0 on success, -EINVAL
+ */
+int cgroup_parse_size(const char *buf, unsigned long *out);
+
+__END_CDECLS
+
+#endif
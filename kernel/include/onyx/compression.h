@@ -40,6 +40,40 @@ public:
     virtual ~decompression_stream() = default;
 };
 
+/**
+ * @brief Compression context
+ * Holds the state a codec needs to (de)compress buffers (work memory, tables), so frequent callers
+ * don't set it up again on every call. Contexts are not thread-safe.
+ *
+ */
+class context
+{
+public:
+    virtual ~context() = default;
+
+    /**
+     * @brief Compress a buffer onto dst
+     *
+     * @param dst Pointer to destination
+     * @param dst_capacity Capacity of the destination buffer
+     * @param src Slice for the source data
+     * @return Number of bytes compressed, or unexpected (-ENOSPC if it didn't fit)
+     */
+    virtual expected<size_t, int> compress(void *dst, size_t dst_capacity,
+                                           cul::slice<unsigned char> src) = 0;
+
+    /**
+     * @brief Decompress a buffer onto dst
+     *
+     * @param dst Pointer to destination
+     * @param dst_capacity Capacity of the destination buffer
+     * @param src Slice for the source data
+     * @return Number of bytes decompressed, or unexpected
+     */
+    virtual expected<size_t, int> decompress(void *dst, size_t dst_capacity,
+                                             cul::slice<unsigned char> src) = 0;
+};
+
 class module
 {
 private:
@@ -53,6 +87,20 @@ public:
 
     virtual ~module() = default;
 
+    const char *name() const
+    {
+        return name_;
+    }
+
+    /**
+     * @brief Create a compression context
+     * Modules that can only decompress don't need to implement this.
+     *
+     * @param level Compression level (module-specific)
+     * @return The new context, or unexpected
+     */
+    virtual expected<unique_ptr<context>, int> create_context(int level);
+
     /**
      * @brief Checks if the given compressed blob is supported by this module
      *
@@ -88,6 +136,15 @@ expected<size_t, int> decompress(void *dst, size_t dst_capacity, cul::slice<unsi
 expected<unique_ptr<decompression_stream>, int> create_decompression_stream(
     cul::slice<unsigned char> src_hint);
 
+/**
+ * @brief Create a compression context for a given module
+ *
+ * @param name Name of the module (e.g "zstd")
+ * @param level Compression level (module-specific)
+ * @return The new context, or unexpected (-ENOENT if there's no such module)
+ */
+expected<unique_ptr<context>, int> create_context(const char *name, int level);
+
 /**
  * @brief Decompression bytestream
  *
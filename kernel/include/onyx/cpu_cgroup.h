@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_CPU_CGROUP_H
+#define _ONYX_CPU_CGROUP_H
+
+#include <onyx/cgroup.h>
+#include <onyx/clock.h>
+#include <onyx/compiler.h>
+
+struct thread;
+
+#ifdef CONFIG_CGROUP_SCHED
+
+__BEGIN_CDECLS
+
+extern const struct cgroup_subsys cpu_cgrp_subsys;
+
+/**
+ * @brief Pick the next thread to run out of a run queue
+ * Threads are picked according to their cgroups' weights (the group that got the least CPU
+ * time relative to its weight goes first), skipping threads whose cgroup ran out of its
+ * cpu.max quota. Called with the CPU's scheduler lock held.
+ *
+ * @param queue Head of the run queue (a single priority level)
+ * @param cpu CPU we're picking for
+ * @return The thread to run, or NULL if every thread in the queue is throttled
+ */
+struct thread *cpu_cgroup_pick(struct thread *queue, unsigned int cpu);
+
+/**
+ * @brief Charge CPU time to the current thread's cgroup (from the scheduler tick)
+ * If the cgroup (or any of its ancestors) runs out of quota, it gets throttled, and the current
+ * thread is asked to reschedule.
+ *
+ * @param curr Current thread
+ * @param delta Time it ran for, in ns
+ * @param system True if the time was spent in the kernel
+ */
+void cpu_cgroup_account(struct thread *curr, hrtime_t delta, bool system);
+
+__END_CDECLS
+
+#else
+
+static inline struct thread *cpu_cgroup_pick(struct thread *queue, unsigned int cpu)
+{
+    return queue;
+}
+
+static inline void cpu_cgroup_account(struct thread *curr, hrtime_t delta, bool system)
+{
+}
+
+#endif
+
+#endif
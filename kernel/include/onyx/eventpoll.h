@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_EVENTPOLL_H
+#define _ONYX_EVENTPOLL_H
+
+struct file;
+
+/**
+ * @brief Remove a file from every epoll instance watching it
+ * Called when the file's last reference goes away.
+ *
+ * @param filp File
+ */
+void eventpoll_release_file(struct file *filp);
+
+#endif
@@ -44,6 +44,22 @@ ssize_t filemap_read_iter(struct file *filp, size_t off, struct iovec_iter *iter
 ssize_t filemap_write_iter(struct file *filp, size_t off, struct iovec_iter *iter,
                            unsigned int flags);
 
+struct pipe;
+
+/**
+ * @brief Splice page cache pages into a pipe. The pipe gets references to the pages, no data is
+ * copied.
+ *
+ * @param filp File pointer
+ * @param off Offset
+ * @param pipe Pipe
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t filemap_splice_read(struct file *filp, size_t off, struct pipe *pipe, size_t len,
+                            unsigned int flags);
+
 #define FILEMAP_MARK_DIRTY RA_MARK_0
 
 #define FIND_PAGE_NO_CREATE   (1 << 0)
@@ -30,4 +30,14 @@
 
 int futex_wake(int *uaddr, int nr_waiters);
 
+/**
+ * @brief Release an exiting thread's PI futexes
+ *
+ * @param thread Exiting thread (the current thread)
+ */
+void futex_exit_pi(struct thread *thread);
+
+struct futex_hash;
+void futex_hash_free(struct futex_hash *hash);
+
 #endif
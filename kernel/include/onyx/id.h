@@ -18,6 +18,26 @@ struct ids
 
 struct ids *idm_add(const char *name, uintmax_t min_id, uintmax_t upper_limit);
 uintmax_t idm_get_id(struct ids *id);
+
+/**
+ * @brief Reserve a specific id, that has never been handed out
+ * Every id below it that hasn't been handed out yet is skipped.
+ *
+ * @param ids ID manager
+ * @param id ID to reserve
+ * @return True on success, false if the ID was already handed out or is out of range
+ */
+bool idm_reserve_id(struct ids *ids, uintmax_t id);
+
+/**
+ * @brief Give back the last id that was handed out or reserved
+ * IDs aren't recycled, so this only works if no other id was handed out since. Otherwise, the id
+ * stays used.
+ *
+ * @param ids ID manager
+ * @param id ID to give back
+ */
+void idm_release_id(struct ids *ids, uintmax_t id);
 uintmax_t idm_get_id_from_name(const char *name);
 const char *idm_get_device_letter(struct ids *ids);
 
@@ -22,6 +22,7 @@ struct file;
 struct iovec_iter;
 struct readpages_state;
 struct page;
+struct pipe;
 struct vm_area_struct;
 
 typedef size_t (*__read)(size_t offset, size_t sizeofread, void *buffer, struct file *file);
@@ -83,10 +84,19 @@ struct file_ops
     int (*readpages)(struct readpages_state *state, struct inode *ino);
     int (*rename)(struct dentry *src_parent, struct dentry *src, struct dentry *dst_dir,
                   struct dentry *dst);
+    /* Move data into a pipe without copying it (e.g page cache pages). See filemap_splice_read */
+    ssize_t (*splice_read)(struct file *filp, size_t off, struct pipe *pipe, size_t len,
+                           unsigned int flags);
+    /* Copy a range to another file in the same filesystem, by sharing (or reflinking) blocks.
+     * Returns -EOPNOTSUPP if it can't, and we fall back to copying. */
+    ssize_t (*copy_file_range)(struct file *in, size_t off_in, struct file *out, size_t off_out,
+                               size_t len, unsigned int flags);
 };
 
 /* For directio's flags */
-#define DIRECT_IO_OP(op) ((op) << 0)
+#define DIRECT_IO_OP(op) ((op) & 0xff)
+/* Poll for the IO's completion instead of sleeping (RWF_HIPRI). Also valid for read/write_iter. */
+#define DIRECT_IO_HIPRI  (1 << 8)
 
 enum
 {
@@ -135,6 +145,8 @@ struct inode
     blkcnt_t i_blocks;
     struct list_head i_sb_list_node;
     struct flock_info *i_flock;
+    /* ELF loader's cached program headers (see kernel/binfmt/elf.cpp), freed with free() */
+    void *i_phdr_cache;
 
     /* Write-frequently fields */
     unsigned long i_refc;
@@ -142,6 +154,8 @@ struct inode
     time_t i_atime;
     time_t i_ctime;
     time_t i_mtime;
+    /* Bumped on every mtime/ctime update, for caches of the inode's contents */
+    unsigned long i_version;
     struct list_head i_dirty_inode_node;
     void *i_flush_dev;
 
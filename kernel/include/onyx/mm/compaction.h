@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_COMPACTION_H
+#define _ONYX_MM_COMPACTION_H
+
+#include <onyx/compiler.h>
+#include <onyx/types.h>
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Read every zone's fragmentation index, for each order
+ * An index close to 0 means an allocation of that order would fail for lack of memory, close to 1
+ * means it would fail because of fragmentation. -1 means it would succeed.
+ */
+ssize_t page_fragmentation_index_read(void *buffer, size_t size, off_t off);
+
+#ifdef CONFIG_COMPACTION
+
+/**
+ * @brief Read compaction statistics
+ */
+ssize_t compact_memory_read(void *buffer, size_t size, off_t off);
+
+/**
+ * @brief Compact every zone, when '1' is written
+ */
+ssize_t compact_memory_write(void *buffer, size_t size, off_t off);
+
+#endif
+
+__END_CDECLS
+
+#endif
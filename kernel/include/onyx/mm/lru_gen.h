@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_LRU_GEN_H
+#define _ONYX_MM_LRU_GEN_H
+
+#include <onyx/compiler.h>
+#include <onyx/types.h>
+
+struct mm_address_space;
+struct page;
+struct page_lru;
+
+/* Number of PTEs on each side of a young PTE that the rmap walk harvests as well */
+#define LRU_GEN_LOOK_AROUND 32
+
+__BEGIN_CDECLS
+
+#ifdef CONFIG_LRU_GEN
+
+/**
+ * @brief Add a new address space to the list aging walks
+ *
+ * @param mm Address space
+ */
+void lru_gen_add_mm(struct mm_address_space *mm);
+
+/**
+ * @brief Remove an address space from the list aging walks
+ * Called on destruction. mm may have never been added.
+ *
+ * @param mm Address space
+ */
+void lru_gen_del_mm(struct mm_address_space *mm);
+
+/**
+ * @brief Mark a page as young, after finding its accessed bit set
+ * Called with the page table lock held.
+ *
+ * @param page Page
+ */
+void lru_gen_page_young(struct page *page);
+
+/**
+ * @brief Age the LRU, creating a new generation in every zone
+ * Harvests accessed bits from every address space first (if walk_mm is on). If someone else aged
+ * the LRU while we waited for our turn, we don't age it again.
+ *
+ * @param lru page_lru the caller wants to age
+ * @param max_seq lru's max_seq when the caller decided to age
+ */
+void lru_gen_age(struct page_lru *lru, unsigned long max_seq);
+
+ssize_t lru_gen_enabled_read(void *buffer, size_t size, off_t off);
+ssize_t lru_gen_enabled_write(void *buffer, size_t size, off_t off);
+ssize_t lru_gen_walk_mm_read(void *buffer, size_t size, off_t off);
+ssize_t lru_gen_walk_mm_write(void *buffer, size_t size, off_t off);
+ssize_t lru_gen_stats_read(void *buffer, size_t size, off_t off);
+
+#else
+
+static inline void lru_gen_add_mm(struct mm_address_space *mm)
+{
+}
+
+static inline void lru_gen_del_mm(struct mm_address_space *mm)
+{
+}
+
+#endif
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_MEMCONTROL_H
+#define _ONYX_MM_MEMCONTROL_H
+
+#include <onyx/cgroup.h>
+#include <onyx/compiler.h>
+#include <onyx/list.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/page.h>
+
+struct page_zone;
+
+enum memcg_event
+{
+    /* Usage went over memory.high, and the charger got throttled */
+    MEMCG_HIGH = 0,
+    /* Usage hit memory.max, and we had to reclaim */
+    MEMCG_MAX,
+    /* Reclaim couldn't get us under memory.max, the charge failed */
+    MEMCG_OOM,
+    MEMCG_NR_EVENTS
+};
+
+#ifdef CONFIG_MEMCG
+
+/**
+ * A memory cgroup. The root cgroup doesn't have one: its pages have a NULL page->memcg, and live
+ * on the zones' own LRUs. A mem_cgroup outlives its cgroup while it still has pages charged to it
+ * (every charged page holds a reference).
+ */
+struct mem_cgroup
+{
+    struct cgroup_subsys_state css;
+    struct mem_cgroup *parent;
+    unsigned long refcount;
+    /* Pages charged to this memcg and its descendants */
+    unsigned long usage;
+    /* Limits, in pages */
+    unsigned long max;
+    unsigned long high;
+    /* Stats of the pages charged to this memcg only (not hierarchical) */
+    long stat[PAGE_STATS_MAX];
+    unsigned long events[MEMCG_NR_EVENTS];
+    /* Pages reclaimed from this memcg's LRUs */
+    unsigned long nr_reclaimed;
+    bool online;
+    /* Node in the list of every memcg, protected by memcg_list_lock */
+    struct list_head list_node;
+    struct rcu_head rcu;
+    struct page_lru lrus[NR_ZONES];
+};
+
+__BEGIN_CDECLS
+
+extern const struct cgroup_subsys memory_cgrp_subsys;
+
+/**
+ * @brief Charge a new page to the current process' memcg
+ * If the memcg (or any of its ancestors) is over memory.max, we reclaim from it before giving up.
+ * If it's over memory.high, the caller gets throttled on its way back to user space. Must be called
+ * before the page is visible to anyone else, and before any page stat is accounted to it.
+ *
+ * @param page Page to charge
+ * @param gfp GFP flags (for reclaim)
+ * @return 0 on success, -ENOMEM if we couldn't get under memory.max
+ */
+int mem_cgroup_charge(struct page *page, unsigned int gfp);
+
+/**
+ * @brief Throttle the current thread if it charged pages over memory.high
+ * Reclaims from the memcgs that are over, and sleeps if that wasn't enough. Called on the way back
+ * to user space (syscall exit, user page faults), with no locks held.
+ */
+void mem_cgroup_handle_over_high(void);
+
+/**
+ * @brief Uncharge a page that's being freed
+ *
+ * @param page Page
+ */
+void __mem_cgroup_uncharge(struct page *page);
+
+static inline void mem_cgroup_uncharge(struct page *page)
+{
+    if (page->memcg)
+        __mem_cgroup_uncharge(page);
+}
+
+/**
+ * @brief Charge a migration target page to the memcg of the page it replaces
+ * The charge can't fail, as it's undone when the old page is freed.
+ *
+ * @param page Page being migrated
+ * @param newpage Its replacement (uncharged)
+ */
+void mem_cgroup_migrate(struct page *page, struct page *newpage);
+
+/**
+ * @brief Account a page stat change to the page's memcg
+ *
+ * @param page Page
+ * @param stat Stat
+ * @param delta Delta
+ */
+static inline void mem_cgroup_mod_stat(struct page *page, enum page_stat stat, long delta)
+{
+    if (page->memcg)
+        __atomic_add_fetch(&page->memcg->stat[stat], delta, __ATOMIC_RELAXED);
+}
+
+static inline void mem_cgroup_note_reclaimed(struct mem_cgroup *memcg, unsigned long nr)
+{
+    if (memcg)
+        __atomic_add_fetch(&memcg->nr_reclaimed, nr, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Iterate over every memcg (including offline ones that still have pages)
+ * Returns the next memcg with a reference, and drops prev's reference.
+ *
+ * @param prev Previous memcg, or NULL to start
+ * @return The next memcg, or NULL at the end
+ */
+struct mem_cgroup *mem_cgroup_iter(struct mem_cgroup *prev);
+
+/**
+ * @brief Stop an iteration early
+ *
+ * @param memcg Current memcg of the iteration
+ */
+void mem_cgroup_iter_break(struct mem_cgroup *memcg);
+
+/**
+ * @brief Check if a memcg is (or descends from) another
+ *
+ * @param memcg Memcg to test
+ * @param root Ancestor
+ * @return True if memcg is in root's subtree
+ */
+bool mem_cgroup_is_descendant(struct mem_cgroup *memcg, struct mem_cgroup *root);
+
+/**
+ * @brief Get a memcg's LRU for a zone
+ *
+ * @param memcg Memcg
+ * @param zone Zone
+ * @return The page_lru
+ */
+struct page_lru *mem_cgroup_lru(struct mem_cgroup *memcg, struct page_zone *zone);
+
+/**
+ * @brief Get a memcg's own page stats, for reclaim
+ *
+ * @param memcg Memcg
+ * @param stats Stats to fill
+ */
+void mem_cgroup_get_stats(struct mem_cgroup *memcg, unsigned long stats[PAGE_STATS_MAX]);
+
+__END_CDECLS
+
+#else
+
+struct mem_cgroup;
+
+static inline int mem_cgroup_charge(struct page *page, unsigned int gfp)
+{
+    return 0;
+}
+
+static inline void mem_cgroup_handle_over_high(void)
+{
+}
+
+static inline void mem_cgroup_uncharge(struct page *page)
+{
+}
+
+static inline void mem_cgroup_migrate(struct page *page, struct page *newpage)
+{
+}
+
+static inline void mem_cgroup_mod_stat(struct page *page, enum page_stat stat, long delta)
+{
+}
+
+static inline void mem_cgroup_note_reclaimed(struct mem_cgroup *memcg, unsigned long nr)
+{
+}
+
+static inline struct mem_cgroup *mem_cgroup_iter(struct mem_cgroup *prev)
+{
+    return NULL;
+}
+
+static inline void mem_cgroup_iter_break(struct mem_cgroup *memcg)
+{
+}
+
+static inline bool mem_cgroup_is_descendant(struct mem_cgroup *memcg, struct mem_cgroup *root)
+{
+    return false;
+}
+
+static inline struct page_lru *mem_cgroup_lru(struct mem_cgroup *memcg, struct page_zone *zone)
+{
+    return NULL;
+}
+
+static inline void mem_cgroup_get_stats(struct mem_cgroup *memcg,
+                                        unsigned long stats[PAGE_STATS_MAX])
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_MM_MEMFD_H
+#define _ONYX_MM_MEMFD_H
+
+#include <stdbool.h>
+
+struct file;
+struct inode;
+
+/**
+ * @brief fcntl handler for shmem files (F_ADD_SEALS, F_GET_SEALS)
+ *
+ * @param filp File
+ * @param cmd fcntl command
+ * @param arg Argument
+ * @return Command-specific return value, or negative error code
+ */
+int memfd_fcntl(struct file *filp, int cmd, unsigned long arg);
+
+/**
+ * @brief Check if new writable shared mappings of a file are forbidden by its seals
+ *
+ * @param ino Inode
+ * @return True if F_SEAL_WRITE or F_SEAL_FUTURE_WRITE is set
+ */
+bool memfd_write_sealed(struct inode *ino);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_MIGRATE_H
+#define _ONYX_MM_MIGRATE_H
+
+#include <onyx/compiler.h>
+
+struct page;
+
+/* migrate_page succeeded, but the old page is still mapped (and should go back to the LRU) */
+#define MIGRATE_OLD_MAPPED 1
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Migrate a page's contents, mappings and page cache slot to a new page
+ * Only anon and page cache pages can be migrated. Pages under writeback, in the swap cache, with
+ * private data, or with references we can't account for are skipped. On success, newpage is
+ * returned to the caller like an isolated page (off the LRU, with the caller's reference), and the
+ * caller keeps its reference to the old page, which it should drop to free it.
+ *
+ * @param page Page to migrate (isolated from the LRU, referenced by the caller)
+ * @param newpage Freshly allocated page to migrate to (with a single reference)
+ * @return 0 on success, MIGRATE_OLD_MAPPED if the old page got mapped again while we migrated
+ * (both pages are then valid, read-only copies), or a negative error code (-EAGAIN if the page is
+ * locked, -EBUSY if it can't be migrated). On failure, newpage is left untouched.
+ */
+int migrate_page(struct page *page, struct page *newpage);
+
+__END_CDECLS
+
+#endif
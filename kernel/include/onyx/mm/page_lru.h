@@ -9,8 +9,10 @@
 #ifndef _ONYX_MM_PAGE_LRU_H
 #define _ONYX_MM_PAGE_LRU_H
 
+#include <onyx/atomic.h>
 #include <onyx/list.h>
 #include <onyx/spinlock.h>
+#include <onyx/types.h>
 
 struct page;
 
@@ -26,26 +28,188 @@ enum lru_state
     NR_LRU_LISTS
 };
 
+#ifdef CONFIG_LRU_GEN
+
+#define MAX_NR_GENS 4
+/* We always keep at least two generations around, so there's something to age pages into */
+#define MIN_NR_GENS 2
+
+#define LRU_GEN_FILE     0
+#define LRU_GEN_ANON     1
+#define NR_LRU_GEN_TYPES 2
+
+struct lru_gen
+{
+    /* Sequence number of the youngest generation */
+    unsigned long max_seq;
+    /* Sequence number of the oldest generation, per type. Anon and file age together, but get
+     * evicted at different rates. */
+    unsigned long min_seq[NR_LRU_GEN_TYPES];
+    /* Creation time of each generation, in ns */
+    unsigned long birth[MAX_NR_GENS];
+    /* Generation lists, indexed by seq % MAX_NR_GENS. Oldest pages are at the head. */
+    struct list_head lists[MAX_NR_GENS][NR_LRU_GEN_TYPES];
+    unsigned long nr_pages[MAX_NR_GENS][NR_LRU_GEN_TYPES];
+};
+
+#endif
+
 struct page_lru
 {
     /* LRU lists for the LRU-2Q + CLOCK algorithm */
     struct list_head lru_lists[NR_LRU_LISTS];
+#ifdef CONFIG_LRU_GEN
+    struct lru_gen lrugen;
+#endif
     struct spinlock lock;
+    /* Lock statistics, see page_lru_lock */
+    unsigned long nr_lock_acquired;
+    unsigned long nr_lock_contended;
 };
 
 CONSTEXPR static inline void page_lru_init(struct page_lru *lru)
 {
     for (int i = 0; i < NR_LRU_LISTS; i++)
         INIT_LIST_HEAD(&lru->lru_lists[i]);
+#ifdef CONFIG_LRU_GEN
+    lru->lrugen.max_seq = MIN_NR_GENS - 1;
+    for (int type = 0; type < NR_LRU_GEN_TYPES; type++)
+    {
+        lru->lrugen.min_seq[type] = 0;
+        for (int gen = 0; gen < MAX_NR_GENS; gen++)
+        {
+            INIT_LIST_HEAD(&lru->lrugen.lists[gen][type]);
+            lru->lrugen.nr_pages[gen][type] = 0;
+        }
+    }
+
+    for (int gen = 0; gen < MAX_NR_GENS; gen++)
+        lru->lrugen.birth[gen] = 0;
+#endif
     spinlock_init(&lru->lock);
+    lru->nr_lock_acquired = 0;
+    lru->nr_lock_contended = 0;
+}
+
+static inline void page_lru_lock(struct page_lru *lru)
+{
+    if (spin_try_lock(&lru->lock))
+    {
+        __atomic_add_fetch(&lru->nr_lock_contended, 1, __ATOMIC_RELAXED);
+        spin_lock(&lru->lock);
+    }
+
+    lru->nr_lock_acquired++;
 }
 
+static inline void page_lru_unlock(struct page_lru *lru)
+{
+    spin_unlock(&lru->lock);
+}
+
+/* Maximum (and default) number of pages in a per-cpu LRU batch, see page_lru.c */
+#define PAGE_LRU_BATCH 15
+
 __BEGIN_CDECLS
 
 void page_add_lru(struct page *page);
 void page_remove_lru(struct page *page);
 void page_lru_demote_reclaim(struct page *page);
 
+/**
+ * @brief Drain every cpu's LRU batches
+ * Called before reclaim goes through the LRU lists, so batched pages become visible to it.
+ */
+void page_lru_drain_all(void);
+
+ssize_t page_lru_stats_read(void *buffer, size_t size, off_t off);
+ssize_t page_lru_batch_read(void *buffer, size_t size, off_t off);
+ssize_t page_lru_batch_write(void *buffer, size_t size, off_t off);
+
+/**
+ * @brief Put an isolated page back on the LRU
+ * Must be called with the lru lock held. The caller's page reference is not dropped.
+ *
+ * @param lru page_lru the page belongs to
+ * @param page Page to put back
+ * @param activate If true, the page was found to be active and gets promoted
+ */
+void page_lru_putback(struct page_lru *lru, struct page *page, bool activate);
+
+/**
+ * @brief Isolate a page we found by pfn from its LRU (for page migration)
+ * On success, the page is off the LRU and the caller holds a reference to it. It goes back with
+ * page_lru_putback.
+ *
+ * @param page Page to isolate
+ * @param active Set to true if the page was active
+ * @return True if isolated, false if the page wasn't on an LRU or is being freed
+ */
+bool page_lru_isolate(struct page *page, bool *active);
+
+#ifdef CONFIG_LRU_GEN
+
+extern bool lru_gen_on;
+
+static inline bool lru_gen_enabled(void)
+{
+    return READ_ONCE(lru_gen_on);
+}
+
+/* lru_gen_isolate looks at no more than nr_pages * LRU_GEN_SCAN_RATIO pages per call */
+#define LRU_GEN_SCAN_RATIO 4
+
+/**
+ * @brief Isolate pages from the oldest generation
+ * Referenced pages get promoted to the youngest generation instead. Must be called with the lru
+ * lock held. The scan is bounded, so the lock isn't held for long when most pages are referenced.
+ *
+ * @param lru page_lru to isolate from
+ * @param type LRU_GEN_FILE or LRU_GEN_ANON
+ * @param page_list List to add isolated pages to
+ * @param nr_pages Maximum number of pages to isolate
+ * @param nr_scanned Incremented by the number of pages looked at
+ * @return Number of isolated pages
+ */
+unsigned long lru_gen_isolate(struct page_lru *lru, int type, struct list_head *page_list,
+                              unsigned long nr_pages, unsigned long *nr_scanned);
+
+/**
+ * @brief Retire the oldest generation, if it's empty
+ * Must be called with the lru lock held.
+ *
+ * @param lru page_lru
+ * @param type LRU_GEN_FILE or LRU_GEN_ANON
+ * @return True if min_seq was incremented, else false
+ */
+bool lru_gen_try_inc_min_seq(struct page_lru *lru, int type);
+
+/**
+ * @brief Create a new (youngest) generation
+ * If we're at MAX_NR_GENS, the oldest generation is folded into the next one. Must be called with
+ * the lru lock held.
+ *
+ * @param lru page_lru
+ */
+void lru_gen_inc_max_seq(struct page_lru *lru);
+
+/**
+ * @brief Switch the multi-generational LRU on or off
+ * Pages get moved between the classic and generation lists.
+ *
+ * @param enabled New state
+ */
+void lru_gen_set_enabled(bool enabled);
+
+#else
+
+static inline bool lru_gen_enabled(void)
+{
+    return false;
+}
+
+#endif
+
 __END_CDECLS
 
 #endif
@@ -78,6 +78,16 @@ struct page_zone
     unsigned long low_watermark;
     unsigned long high_watermark;
     struct list_head pages[PAGEALLOC_NR_ORDERS];
+    /* Number of free blocks in each order's list */
+    unsigned long nr_free[PAGEALLOC_NR_ORDERS];
+    /* Span of the zone's pages, in pfns (end is exclusive). It may have holes. */
+    unsigned long start_pfn;
+    unsigned long end_pfn;
+#ifdef CONFIG_COMPACTION
+    /* After failing, compaction is skipped for the next 1 << compact_defer_shift attempts */
+    unsigned int compact_defer_shift;
+    unsigned int compact_considered;
+#endif
     unsigned long total_pages;
     long used_pages;
     unsigned long splits;
@@ -101,6 +111,15 @@ constexpr void page_zone_init(page_zone *zone, const char *name, unsigned long s
         INIT_LIST_HEAD(&order);
     }
 
+    for (auto &nr : zone->nr_free)
+        nr = 0;
+
+    zone->start_pfn = -1UL;
+    zone->end_pfn = 0;
+#ifdef CONFIG_COMPACTION
+    zone->compact_defer_shift = zone->compact_considered = 0;
+#endif
+
     zone->total_pages = 0;
     zone->used_pages = 0;
     zone->merges = zone->splits = 0;
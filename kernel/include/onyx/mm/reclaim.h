@@ -33,6 +33,19 @@ __BEGIN_CDECLS
  */
 int page_do_reclaim(struct reclaim_data *data);
 
+struct mem_cgroup;
+
+/**
+ * @brief Reclaim pages charged to a memcg's subtree (memcg limit enforcement)
+ *
+ * @param memcg Memcg to reclaim from
+ * @param nr_pages Number of pages we want freed
+ * @param gfp_flags GFP flags of the charge that triggered the reclaim
+ * @return Number of pages reclaimed
+ */
+unsigned long page_reclaim_memcg(struct mem_cgroup *memcg, unsigned long nr_pages,
+                                 unsigned int gfp_flags);
+
 __END_CDECLS
 
 #endif
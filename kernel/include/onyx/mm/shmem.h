@@ -21,4 +21,13 @@ struct file;
  */
 struct file *anon_get_shmem(size_t len);
 
+/**
+ * @brief Create a new, unlinked shmem file
+ *
+ * @param name Name of the file's dentry, only used for display purposes
+ * @param size Initial size, in bytes
+ * @return Opened struct file, or NULL
+ */
+struct file *shmem_file_setup(const char *name, size_t size);
+
 #endif
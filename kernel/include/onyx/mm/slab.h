@@ -8,17 +8,34 @@
 #ifndef _ONYX_MM_SLAB_H
 #define _ONYX_MM_SLAB_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #include <onyx/list.h>
 #include <onyx/mm/kasan.h>
 #include <onyx/spinlock.h>
+#include <onyx/types.h>
 
 #ifndef CONFIG_SMP_NR_CPUS
 #define CONFIG_SMP_NR_CPUS 64
 #endif
 
 #define SLAB_CACHE_PERCPU_MAGAZINE_SIZE 128
+/* Number of magazine batches the cache-wide depot can hold */
+#define SLAB_CACHE_DEPOT_SIZE           16
+
+struct slab_cache_stats
+{
+    /* Allocations and frees that went through the pcpu path */
+    unsigned long nr_alloc;
+    unsigned long nr_free;
+    /* Magazine refills/flushes that were served by the depot (no cache lock) */
+    unsigned long nr_refill_depot;
+    unsigned long nr_flush_depot;
+    /* Magazine refills/flushes that had to go to the slabs (cache lock) */
+    unsigned long nr_refill_slab;
+    unsigned long nr_flush_slab;
+};
 
 struct slab_cache_percpu_context
 {
@@ -26,6 +43,7 @@ struct slab_cache_percpu_context
     int size;
     int touched;
     unsigned long active_objs;
+    struct slab_cache_stats stats;
 } __align_cache;
 
 #undef ATOMIC_TYPE
@@ -51,6 +69,16 @@ struct slab_cache
     struct spinlock lock;
     int mag_limit;
     void (*ctor)(void *);
+    /* Depot of full magazine batches, exchanged between CPUs with cmpxchg. Each slot holds a chain
+     * of mag_limit / 2 free objects, linked through their bufctls. */
+    void *depot[SLAB_CACHE_DEPOT_SIZE];
+    /* Active defragmentation (see kmem_cache_set_defrag) */
+    unsigned long (*defrag)(struct slab_cache *cache);
+    /* Odd while a defrag pass is running. Slabs marked with the current sequence are candidates. */
+    unsigned long defrag_seq;
+    unsigned long nr_defrag_runs;
+    unsigned long nr_defrag_evicted;
+    unsigned long nr_defrag_freed_pages;
     // TODO: This is horrible. We need a way to allocate percpu memory,
     // and then either trim it or grow it when CPUs come online.
     struct slab_cache_percpu_context pcpu[CONFIG_SMP_NR_CPUS] __align_cache;
@@ -186,6 +214,37 @@ size_t kmem_cache_alloc_bulk(struct slab_cache *cache, unsigned int gfp_flags, s
  */
 void kmem_cache_free_bulk(struct slab_cache *cache, size_t size, void **ptrs);
 
+/**
+ * @brief Opt a cache into active defragmentation
+ * The defrag callback gets called (with no slab locks held) after the cache's sparse partial slabs
+ * have been marked. It should walk its own objects and evict (or migrate) every object it safely
+ * can for which kmem_defrag_candidate() returns true, and return how many it got rid of.
+ *
+ * @param cache Slab cache
+ * @param defrag Defrag callback
+ */
+void kmem_cache_set_defrag(struct slab_cache *cache, unsigned long (*defrag)(struct slab_cache *));
+
+/**
+ * @brief Check if an object lives in a slab that's being defragmented
+ * Only meaningful from a defrag callback. The caller must guarantee the object is allocated.
+ *
+ * @param obj Object
+ * @return True if the object should be evicted
+ */
+bool kmem_defrag_candidate(void *obj);
+
+/**
+ * @brief Defragment every cache that opted in
+ * Evicts objects out of mostly-empty slabs, and releases the slabs that end up free.
+ *
+ * @return Number of pages released
+ */
+unsigned long slab_defrag_caches(void);
+
+ssize_t kmem_slabinfo_read(void *buffer, size_t size, off_t off);
+ssize_t kmem_defrag_write(void *buffer, size_t size, off_t off);
+
 __END_CDECLS
 
 #endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_TLB_H
+#define _ONYX_MM_TLB_H
+
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+#include <onyx/types.h>
+
+struct mm_address_space;
+struct arch_mm_address_space;
+
+/* Number of address spaces each cpu keeps TLB entries around for (if the arch has ASIDs) */
+#define TLB_NR_ASIDS 6
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Switch this cpu to an address space
+ * Must be called with irqs disabled. Switching to the loaded address space is a no-op.
+ *
+ * @param next Address space to switch to
+ * @param cpu This cpu
+ */
+void tlb_switch_mm(struct mm_address_space *next, unsigned int cpu);
+
+/**
+ * @brief Get the address space this cpu has loaded
+ * Kernel threads run on whatever address space was loaded before them (lazy TLB mode).
+ *
+ * @return The loaded address space, or NULL if none was loaded yet
+ */
+struct mm_address_space *tlb_loaded_mm(void);
+
+/**
+ * @brief Start a shootdown of an address space's user range
+ * Must be called after the page tables are changed, and before looking at the active mask.
+ *
+ * @param mm Address space
+ * @return The shootdown's generation, to pass to tlb_flush_mm_local
+ */
+u64 tlb_inc_gen(struct mm_address_space *mm);
+
+/**
+ * @brief Handle a shootdown of an address space's user range on this cpu
+ * Lazy cpus switch out of the address space instead of flushing, so they stop getting
+ * shootdowns for it.
+ *
+ * @param mm Address space
+ * @param addr Start of the range
+ * @param pages Size of the range, in pages
+ * @param gen Generation returned by tlb_inc_gen
+ */
+void tlb_flush_mm_local(struct mm_address_space *mm, unsigned long addr, size_t pages, u64 gen);
+
+/**
+ * @brief Get the number of ASIDs the arch can use for user address spaces
+ * 1 means there are no ASIDs, and every switch flushes the TLB.
+ */
+unsigned int arch_nr_asids(void);
+
+/**
+ * @brief Load an address space's page tables
+ *
+ * @param mm Address space to load
+ * @param asid ASID slot to use (< arch_nr_asids())
+ * @param flush If true, the TLB entries tagged with asid are stale and must be flushed
+ */
+void arch_switch_mm(struct arch_mm_address_space *mm, unsigned int asid, bool flush);
+
+/**
+ * @brief Invalidate a range in this cpu's TLB (for the loaded ASID, and global mappings)
+ *
+ * @param page Start of the range
+ * @param pages Size of the range, in pages
+ */
+void paging_invalidate(void *page, size_t pages);
+
+__END_CDECLS
+
+#endif
@@ -286,6 +286,17 @@ void vm_obj_reassign_mapping(struct vm_object *vm_obj, struct vm_area_struct *vm
 
 bool vm_obj_remove_page(struct vm_object *obj, struct page *page);
 
+/**
+ * @brief Replace a page in the object with a new copy of it, for page migration
+ * Fails if the page has unexpected references.
+ *
+ * @param obj Object the page belongs to
+ * @param page Page (locked)
+ * @param newpage Its replacement (locked, with the same contents)
+ * @return True if replaced, else false
+ */
+bool vm_obj_replace_page(struct vm_object *obj, struct page *page, struct page *newpage);
+
 long vm_obj_get_page_references(struct vm_object *obj, struct page *page, unsigned int *vm_flags);
 
 /**
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_ZSMALLOC_H
+#define _ONYX_MM_ZSMALLOC_H
+
+#include <stddef.h>
+
+#include <onyx/compiler.h>
+#include <onyx/page.h>
+
+/* Largest object zs_malloc can hand out */
+#define ZS_MAX_ALLOC_SIZE PAGE_SIZE
+
+struct zs_pool;
+
+struct zs_pool_stats
+{
+    /* Pages backing the pool */
+    unsigned long pages;
+    /* Number of live objects */
+    unsigned long objects;
+    /* Bytes taken up by live objects (rounded up to their size class) */
+    unsigned long bytes;
+};
+
+__BEGIN_CDECLS
+
+/**
+ * @brief Create a zsmalloc pool
+ *
+ * @param name Name of the pool
+ * @return The new pool, or NULL
+ */
+struct zs_pool *zs_create_pool(const char *name);
+
+/**
+ * @brief Destroy a zsmalloc pool
+ * Every object must have been freed before this.
+ *
+ * @param pool Pool to destroy
+ */
+void zs_destroy_pool(struct zs_pool *pool);
+
+/**
+ * @brief Allocate an object from a pool
+ *
+ * @param pool Pool to allocate from
+ * @param size Size of the object, up to ZS_MAX_ALLOC_SIZE
+ * @param gfp GFP flags, for when the pool needs to grow
+ * @return Handle to the object, or 0
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, unsigned int gfp);
+
+/**
+ * @brief Free an object
+ *
+ * @param pool Pool the object belongs to
+ * @param handle Handle to the object, as returned by zs_malloc
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+/**
+ * @brief Get a pointer to an object
+ * The pointer stays valid until the object is freed.
+ *
+ * @param pool Pool the object belongs to
+ * @param handle Handle to the object
+ * @return Pointer to the object's memory
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle);
+
+/**
+ * @brief Get a pool's usage statistics
+ *
+ * @param pool Pool
+ * @param stats Stats to fill
+ */
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
+/**
+ * @brief Get the number of pages backing a pool
+ *
+ * @param pool Pool
+ * @return Number of pages
+ */
+unsigned long zs_get_total_pages(struct zs_pool *pool);
+
+__END_CDECLS
+
+#endif
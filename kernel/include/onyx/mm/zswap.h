@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_MM_ZSWAP_H
+#define _ONYX_MM_ZSWAP_H
+
+#include <stdbool.h>
+
+#include <onyx/compiler.h>
+#include <onyx/pgtable.h>
+#include <onyx/types.h>
+
+#include <uapi/errno.h>
+
+struct page;
+struct zswap_entry;
+
+__BEGIN_CDECLS
+
+#ifdef CONFIG_ZSWAP
+
+/**
+ * @brief Set up zswap for a new swap area
+ * Called on swapon. Allocates the compression contexts on first use.
+ *
+ * @return 0 on success, negative error codes (zswap stays disabled)
+ */
+int zswap_swapon(void);
+
+/**
+ * @brief Compress a page into zswap
+ *
+ * @param swp Swap entry the page is being written to
+ * @param page Page to store (locked)
+ * @return True if stored (and no IO is needed), else false
+ */
+bool zswap_store(swp_entry_t swp, struct page *page);
+
+/**
+ * @brief Load a page from zswap
+ *
+ * @param swp Swap entry
+ * @param page Page to decompress into (locked)
+ * @return 0 on success, -ENOENT if not in zswap, negative error codes
+ */
+int zswap_load(swp_entry_t swp, struct page *page);
+
+/**
+ * @brief Drop a swap entry's compressed copy
+ * Called (under the swap map lock) when a swap slot is freed.
+ *
+ * @param swp Swap entry
+ */
+void zswap_invalidate(swp_entry_t swp);
+
+/**
+ * @brief Mark an entry as under writeback, if it's still current
+ * Called by swap_zswap_pin, under the swap map lock.
+ *
+ * @param swp Swap entry
+ * @param entry zswap entry we're about to write back
+ * @return True if entry is still swp's compressed copy, else false
+ */
+bool zswap_start_writeback(swp_entry_t swp, struct zswap_entry *entry);
+
+ssize_t zswap_stats_read(void *buffer, size_t size, off_t off);
+ssize_t zswap_max_pool_read(void *buffer, size_t size, off_t off);
+ssize_t zswap_max_pool_write(void *buffer, size_t size, off_t off);
+
+#else
+
+static inline int zswap_swapon(void)
+{
+    return 0;
+}
+
+static inline bool zswap_store(swp_entry_t swp, struct page *page)
+{
+    return false;
+}
+
+static inline int zswap_load(swp_entry_t swp, struct page *page)
+{
+    return -ENOENT;
+}
+
+static inline void zswap_invalidate(swp_entry_t swp)
+{
+}
+
+static inline bool zswap_start_writeback(swp_entry_t swp, struct zswap_entry *entry)
+{
+    return false;
+}
+
+#endif
+
+__END_CDECLS
+
+#endif
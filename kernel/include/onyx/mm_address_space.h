@@ -67,8 +67,21 @@ struct mm_address_space
     // limit the shootdowns to CPUs where the address space is active instead of every CPU.
     struct cpumask active_mask CPP_DFLINIT;
 
+    /* Unique id, for the per-cpu ASID caches (assigned on first load, never reused) */
+    u64 ctx_id CPP_DFLINIT;
+    /* TLB generation, bumped on every shootdown. See kernel/mm/tlb.cpp. */
+    u64 tlb_gen CPP_DFLINIT;
+
     struct spinlock page_table_lock CPP_DFLINIT;
 
+    /* Hash table for private futexes, allocated on first use */
+    struct futex_hash *futex_hash CPP_DFLINIT;
+
+#ifdef CONFIG_LRU_GEN
+    /* Node in the list of address spaces that MGLRU aging walks */
+    struct list_head lru_gen_node CPP_DFLINIT;
+#endif
+
 #ifdef __cplusplus
     mm_address_space &operator=(mm_address_space &&as)
     {
@@ -77,6 +77,11 @@ __BEGIN_CDECLS
 #define PAGE_FLAG_SWAP        (1 << 14)
 #define PAGE_FLAG_RECLAIM     (1 << 15)
 
+/* Multi-generational LRU: generation + 1 of the list the page sits on, 0 if it's not on one. Only
+ * changed under the page_lru lock. */
+#define PAGE_LRU_GEN_SHIFT 16
+#define PAGE_LRU_GEN_MASK  (7UL << PAGE_LRU_GEN_SHIFT)
+
 #define PAGEFLAG_OPS(lowercase, uppercase)                                          \
     static inline void page_clear_##lowercase(struct page *page)                    \
     {                                                                               \
@@ -101,6 +106,7 @@ __BEGIN_CDECLS
     }
 
 struct vm_object;
+struct mem_cgroup;
 
 /* struct page - Represents every usable page on the system
  * Careful adding fields in - they may increase the memory use exponentially
@@ -134,6 +140,10 @@ struct CAPABILITY("page") page
     };
 
     unsigned long priv;
+#ifdef CONFIG_MEMCG
+    /* Memory cgroup the page is charged to, NULL if none */
+    struct mem_cgroup *memcg;
+#endif
 #ifdef CONFIG_PAGE_OWNER
     u32 last_owner, last_lock, last_unlock, last_free;
 #endif
@@ -272,6 +282,25 @@ static inline unsigned long page_ref_many(struct page *p, unsigned long c)
     return __atomic_add_fetch(&p->ref, c, __ATOMIC_ACQUIRE);
 }
 
+/**
+ * @brief Try to grab a reference to a page we don't hold a reference to
+ * Fails if the page is being freed (its refcount already dropped to 0).
+ *
+ * @param p Page
+ * @return True if we got a reference, else false
+ */
+static inline bool page_try_get(struct page *p)
+{
+    unsigned int ref = __atomic_load_n(&p->ref, __ATOMIC_RELAXED);
+    do
+    {
+        if (ref == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&p->ref, &ref, ref + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
 static inline unsigned long __page_unref(struct page *p)
 {
     return __atomic_sub_fetch(&p->ref, 1, __ATOMIC_RELEASE);
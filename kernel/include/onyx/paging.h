@@ -137,7 +137,33 @@ unsigned long __get_mapping_info(void *addr, struct mm_address_space *as);
 struct vm_pf_context;
 struct page;
 unsigned int mmu_get_clear_referenced(struct mm_address_space *mm, void *addr, struct page *page);
+unsigned long mmu_harvest_accessed(struct mm_address_space *mm, unsigned long start,
+                                   unsigned long end, void (*cb)(struct page *page));
 int try_to_unmap_one(struct page *page, struct vm_area_struct *vma, unsigned long addr);
+
+/**
+ * @brief Write-protect a vma's mapping of a page (used by page migration)
+ * The pte's dirty bit is transferred to the page. The page must be locked.
+ *
+ * @param page Page
+ * @param vma VMA that may map the page
+ * @param addr Address the page would be mapped at
+ * @return 0
+ */
+int try_to_wrprotect_one(struct page *page, struct vm_area_struct *vma, unsigned long addr);
+
+/**
+ * @brief Point a vma's (write-protected) mapping of a page to a new page
+ * The mapcount is moved over from page to newpage. Used by page migration.
+ *
+ * @param page Old page
+ * @param newpage New page
+ * @param vma VMA that may map the page
+ * @param addr Address the page would be mapped at
+ * @return 0
+ */
+int try_to_remap_one(struct page *page, struct page *newpage, struct vm_area_struct *vma,
+                     unsigned long addr);
 int do_wp_page(struct vm_pf_context *context);
 
 __END_CDECLS
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_PIDFD_H
+#define _ONYX_PIDFD_H
+
+struct file;
+struct process;
+
+/**
+ * @brief Open a pidfd for a process
+ *
+ * @param proc Process, a reference is taken
+ * @param flags open flags (O_CLOEXEC, O_NONBLOCK)
+ * @return The new fd, or negative error code
+ */
+int pidfd_create(struct process *proc, unsigned int flags);
+
+/**
+ * @brief Get the process a pidfd refers to
+ *
+ * @param filp File
+ * @return The process (without a new reference), or nullptr if filp is not a pidfd
+ */
+struct process *pidfd_to_process(struct file *filp);
+
+#endif
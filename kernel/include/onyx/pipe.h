@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_PIPE_H
+#define _ONYX_PIPE_H
+
+#include <onyx/types.h>
+
+struct file;
+struct pipe;
+struct page_iov;
+
+/* Pipe interfaces for splice and friends. Every flags argument takes SPLICE_F_* flags. */
+
+typedef ssize_t (*pipe_splice_actor_t)(const struct page_iov *vec, void *ctx);
+
+/**
+ * @brief Get the pipe behind a file
+ *
+ * @param filp File
+ * @return The pipe, or nullptr if filp is not a pipe
+ */
+struct pipe *file_to_pipe(struct file *filp);
+
+/**
+ * @brief Add references to pages to the pipe, without copying their contents
+ *
+ * @param pipe Pipe
+ * @param vec Pages to add (the pipe grabs its own references)
+ * @param nr Number of pages
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes added, or negative error code
+ */
+ssize_t pipe_splice_pages(struct pipe *pipe, const struct page_iov *vec, size_t nr,
+                          unsigned int flags);
+
+/**
+ * @brief Hand the pipe's pages over to an actor, consuming whatever it takes
+ *
+ * @param pipe Pipe
+ * @param len Maximum length to consume
+ * @param flags SPLICE_F_* flags
+ * @param actor Actor, returns the number of bytes it consumed (or negative error code)
+ * @param ctx Context for the actor
+ * @return Number of bytes consumed, 0 on EOF, or negative error code
+ */
+ssize_t pipe_splice_out(struct pipe *pipe, size_t len, unsigned int flags,
+                        pipe_splice_actor_t actor, void *ctx);
+
+/**
+ * @brief Wait for space in the pipe, for splice
+ *
+ * @param pipe Pipe
+ * @param flags SPLICE_F_* flags
+ * @return Available space, or negative error code
+ */
+ssize_t pipe_splice_space(struct pipe *pipe, unsigned int flags);
+
+/**
+ * @brief Move data from one pipe to another, without copying
+ *
+ * @param in Pipe to read from
+ * @param out Pipe to write to
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes moved, 0 on EOF, or negative error code
+ */
+ssize_t pipe_splice_pipe(struct pipe *in, struct pipe *out, size_t len, unsigned int flags);
+
+/**
+ * @brief Duplicate data from one pipe into another, without consuming it or copying it
+ *
+ * @param in Pipe to read from
+ * @param out Pipe to write to
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes duplicated, 0 on EOF, or negative error code
+ */
+ssize_t pipe_tee(struct pipe *in, struct pipe *out, size_t len, unsigned int flags);
+
+/**
+ * @brief Allocate a pipe for internal use (e.g sendfile), not backed by any file
+ *
+ * @return The pipe, or nullptr
+ */
+struct pipe *pipe_alloc_internal();
+
+/**
+ * @brief Free a pipe allocated with pipe_alloc_internal
+ *
+ * @param pipe Pipe
+ */
+void pipe_free_internal(struct pipe *pipe);
+
+#endif
@@ -17,6 +17,22 @@
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
                                      struct pci_msi_data *data);
 
+/**
+ * @brief Allocate a single MSI(-X) vector, routed to a specific cpu
+ *
+ * @param cpu CPU that should receive the interrupt
+ * @param data Pointer to pci_msi_data, filled with the message address/data
+ * @return 0 on success, negative on error
+ */
+int platform_allocate_msi_vector(unsigned int cpu, struct pci_msi_data *data);
+
+/**
+ * @brief Free a vector allocated by platform_allocate_msi_vector
+ *
+ * @param data Pointer to the vector's pci_msi_data
+ */
+void platform_free_msi_vector(const struct pci_msi_data *data);
+
 int platform_install_irq(unsigned int irqn, struct interrupt_handler *h);
 void platform_mask_irq(unsigned int irq);
 
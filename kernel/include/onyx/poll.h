@@ -170,6 +170,11 @@ public:
         return upoll;
     }
 
+    poll_table *get_table() const
+    {
+        return pt;
+    }
+
     short get_event_mask() const
     {
         return events;
@@ -217,8 +222,20 @@ private:
      */
     bool is_queueing;
 
+    /* If set, our wait queue registrations are persistent (WQ_TOKEN_PERSISTENT) and wakeups are
+     * reported through this callback instead of signal(). Used by epoll. */
+    void (*wake_fn)(poll_file *pf);
+    unsigned short token_flags;
+
 public:
-    constexpr poll_table() : poll_table_array{}, signaled{false}, is_queueing{true}
+    constexpr poll_table()
+        : poll_table_array{}, signaled{false}, is_queueing{true}, wake_fn{nullptr}, token_flags{0}
+    {
+    }
+
+    constexpr poll_table(void (*wake_fn)(poll_file *pf), unsigned short extra_token_flags)
+        : poll_table_array{}, signaled{false}, is_queueing{true}, wake_fn{wake_fn},
+          token_flags{(unsigned short) (WQ_TOKEN_PERSISTENT | extra_token_flags)}
     {
     }
     ~poll_table()
@@ -235,6 +252,16 @@ public:
         signaled = true;
     }
 
+    void (*get_wake_fn() const)(poll_file *pf)
+    {
+        return wake_fn;
+    }
+
+    unsigned short get_token_flags() const
+    {
+        return token_flags;
+    }
+
     bool may_queue() const
     {
         return is_queueing;
@@ -256,6 +283,48 @@ public:
 
 void poll_wait_helper(void *poll_file, struct wait_queue *q);
 
+/* Temporarily replaces the thread's signal mask (for ppoll, pselect and epoll_pwait) */
+class auto_signal_mask
+{
+private:
+    bool sigmask_valid;
+    sigset_t &temp_sigmask;
+    bool disable_{false};
+
+public:
+    auto_signal_mask(bool valid, sigset_t &set) : sigmask_valid{valid}, temp_sigmask{set}
+    {
+        if (!sigmask_valid)
+            return;
+        auto thread = get_current_thread();
+        thread->sinfo.original_sigset = thread->sinfo.set_blocked(&temp_sigmask);
+        thread->sinfo.flags |= THREAD_SIGNAL_ORIGINAL_SIGSET;
+    }
+
+    ~auto_signal_mask()
+    {
+        if (!sigmask_valid || disable_)
+            return;
+        auto thread = get_current_thread();
+        thread->sinfo.set_blocked(&thread->sinfo.original_sigset);
+        thread->sinfo.flags &= ~THREAD_SIGNAL_ORIGINAL_SIGSET;
+    }
+
+    void disable()
+    {
+        disable_ = true;
+    }
+};
+
+/**
+ * @brief Wait until a single file has any of the given events pending
+ *
+ * @param filp File to poll
+ * @param events Events to wait for (POLLHUP and POLLERR are implicit)
+ * @return Returned events, or -EINTR if interrupted by a signal
+ */
+int poll_one_file(struct file *filp, short events);
+
 struct pselect_arg
 {
     const sigset_t *mask;
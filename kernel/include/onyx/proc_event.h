@@ -8,8 +8,27 @@
 
 #include <onyx/process.h>
 #include <onyx/scheduler.h>
+#include <onyx/mutex.h>
 #include <onyx/semaphore.h>
+#include <onyx/spinlock.h>
 #include <onyx/syscall.h>
+#include <onyx/wait_queue.h>
+
+/* Must be a power of 2 */
+#define PROC_EVENT_RING_SIZE 64
+
+/* Event ring, for PROC_EVENT_RING subscriptions. Producers (the target's threads) hold lock,
+ * the consumer holds read_lock. */
+struct proc_event_ring
+{
+    struct spinlock lock;
+    struct mutex read_lock;
+    unsigned int head;
+    unsigned int tail;
+    unsigned long nr_lost;
+    struct wait_queue wq;
+    struct proc_event events[PROC_EVENT_RING_SIZE];
+};
 
 struct proc_event_sub
 {
@@ -20,8 +39,16 @@ struct proc_event_sub
     struct semaphore event_semaphore;
     struct process *target_process;
     struct proc_event event_buf;
+    struct proc_event_ring *ring;
     struct proc_event_sub *next;
 };
 
 void proc_event_enter_syscall(struct syscall_frame *regs, uintptr_t rax);
 void proc_event_exit_syscall(long retval, long syscall_nr);
+
+/**
+ * @brief Notify the subscribers that the current process is exiting
+ *
+ * @param exit_code wait(2)-style exit status
+ */
+void proc_event_exit(unsigned int exit_code);
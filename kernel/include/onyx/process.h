@@ -46,6 +46,7 @@
 
 #define TASK_COMM_LEN 16
 
+struct cgroup;
 struct proc_event_sub;
 struct tty;
 struct pid;
@@ -55,6 +56,8 @@ static void process_put(struct process *process);
 
 #define PROCESS_FORKED (1 << 0)
 #define PROCESS_SECURE (1 << 1)
+/* Exited, and no longer counted in its cgroup */
+#define PROCESS_CGROUP_EXITED (1 << 2)
 
 struct vfork_completion;
 
@@ -120,7 +123,13 @@ struct process
     struct k_sigaction sigtable[_NSIG];
     unsigned int signal_group_flags;
     struct wait_queue wait_child_event;
+    /* signalfd readers, woken up when a signal is queued to any of our threads */
+    struct wait_queue signalfd_wq;
+    /* pidfd pollers, woken up when we exit */
+    struct wait_queue pidfd_wq;
     unsigned int exit_code;
+    /* Signal sent to the parent on exit (SIGCHLD, unless set by clone3), or 0 for none */
+    int exit_signal;
 
     /* Process personality */
     unsigned long personality;
@@ -128,6 +137,9 @@ struct process
     /* This process' parent */
     struct process *parent;
 
+    /* cgroup the process belongs to (RCU protected, see cgroup.cpp) */
+    struct cgroup *cgroup;
+
     /* User time and system time consumed by the process */
     hrtime_t user_time;
     hrtime_t system_time;
@@ -288,13 +300,25 @@ struct thread *process_create_main_thread(struct process *proc, thread_callback_
                                           void *sp);
 
 struct process *get_process_from_pid(pid_t pid);
-struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx);
+/* Overrides for the forked thread's registers, as given to clone3 */
+struct fork_thread_args
+{
+    /* New stack pointer, or 0 to keep the parent's */
+    unsigned long stack;
+    /* New TLS pointer, if set_tls */
+    unsigned long tls;
+    bool set_tls;
+};
+
+struct thread *process_fork_thread(thread_t *src, struct process *dest, struct syscall_frame *ctx,
+                                   const struct fork_thread_args *args);
 void process_destroy_aspace();
 int process_attach(struct process *tracer, struct process *tracee);
 struct process *process_find_tracee(struct process *tracer, pid_t pid);
 
 void process_end(struct process *p);
 void process_add_thread(struct process *process, thread_t *thread);
+void process_copy_current_sigmask(struct thread *dest);
 
 struct envarg_res
 {
@@ -375,8 +399,17 @@ void process_for_every_thread(process *p, Callable cb)
 
 [[noreturn]] void process_exit_from_signal(int signum);
 
+/**
+ * @brief Create a new process
+ *
+ * @param cmd_line Command line
+ * @param ctx IO context to inherit, or nullptr
+ * @param parent Parent process, or nullptr
+ * @param pid Specific PID to use, or 0 for a new one
+ * @return The new process, or nullptr with errno set
+ */
 struct process *process_create(const std::string_view &cmd_line, struct ioctx *ctx,
-                               struct process *parent);
+                               struct process *parent, pid_t pid = 0);
 
 static inline mm_address_space *get_current_address_space()
 {
@@ -9,6 +9,7 @@
 #define _ONYX_READAHEAD_H
 
 #include <onyx/compiler.h>
+#include <onyx/types.h>
 
 __BEGIN_CDECLS
 
@@ -16,7 +17,10 @@ int filemap_do_readahead_async(struct inode *inode, struct readahead_state *ra_s
                                unsigned long pgoff);
 
 int filemap_do_readahead_sync(struct inode *inode, struct readahead_state *ra_state,
-                              unsigned long pgoff);
+                              unsigned long pgoff, struct page *page);
+
+ssize_t readahead_stats_read(void *buffer, size_t size, off_t off);
+ssize_t readahead_files_read(void *buffer, size_t size, off_t off);
 
 __END_CDECLS
 #endif
@@ -94,6 +94,26 @@ public:
         return was_deleted;
     }
 
+    /**
+     * @brief Try to grab a reference, unless the object is already dying
+     *
+     * @return True if we got a reference, false if the refcount was 0
+     */
+    bool try_ref()
+    {
+        unsigned long old = __refcount.load(mem_order::relaxed);
+
+        do
+        {
+            if (old == 0)
+                return false;
+        } while (!__refcount.compare_exchange_weak(old, old + 1, mem_order::acquire,
+                                                   mem_order::relaxed));
+
+        TRACE_REFC_REF;
+        return true;
+    }
+
     unsigned long __get_refcount() const
     {
         return __refcount.load();
@@ -373,6 +373,13 @@ static inline pte_t pte_wrprotect(pte_t pte)
     return __pte(pte_val(pte) & ~_PAGE_WRITE);
 }
 
+/* Point a pte at a different page, keeping every other bit (the PPN lives in bits 10-53) */
+static inline pte_t pte_set_addr(pte_t pte, u64 phys)
+{
+    const pteval_t ppn_mask = ((1UL << 44) - 1) << 10;
+    return __pte((pte_val(pte) & ~ppn_mask) | ((phys >> PAGE_SHIFT) << 10));
+}
+
 static inline pgprot_t calc_pgprot(u64 phys, u64 prots)
 {
     bool special_mapping = phys == (u64) page_to_phys(vm_get_zero_page());
@@ -11,6 +11,7 @@
 #include <onyx/list.h>
 #include <onyx/spinlock.h>
 
+struct page;
 struct vm_area_struct;
 
 struct anon_vma
@@ -18,6 +19,13 @@ struct anon_vma
     struct spinlock lock;
     struct list_head vma_list;
 };
+
+struct rmap_walk_info
+{
+    int (*walk_one)(struct vm_area_struct *vma, struct page *page, unsigned long addr,
+                    void *context);
+    void *context;
+};
 __BEGIN_CDECLS
 
 struct anon_vma *anon_vma_alloc(void);
@@ -31,5 +39,16 @@ long rmap_get_page_references(struct page *page, unsigned int *vm_flags);
 
 int rmap_try_to_unmap(struct page *page);
 
+/**
+ * @brief Walk every mapping of a page
+ * walk_one is called for every vma that may map the page, with the address the page would be
+ * mapped at. A non-zero return from walk_one stops the walk.
+ *
+ * @param info Walk callback and context
+ * @param page Page to walk (locked, or otherwise stable)
+ * @return 0, or the first non-zero walk_one return
+ */
+int rmap_walk(struct rmap_walk_info *info, struct page *page);
+
 __END_CDECLS
 #endif
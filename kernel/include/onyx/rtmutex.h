@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#ifndef _ONYX_RTMUTEX_H
+#define _ONYX_RTMUTEX_H
+
+#include <stdbool.h>
+
+#include <onyx/clock.h>
+#include <onyx/list.h>
+#include <onyx/lock_annotations.h>
+#include <onyx/spinlock.h>
+#include <onyx/utils.h>
+
+/* rt_mutex: a sleeping lock with priority inheritance. Waiters are queued by priority, and the
+ * owner runs at (at least) the priority of its highest priority waiter, transitively through the
+ * chain of owners that are themselves blocked on rt_mutexes. Unlocking hands the lock over to the
+ * top waiter directly, so there's no lock stealing. Unlike struct mutex, there's no optimistic
+ * spinning; use this where priority inversion matters.
+ */
+
+#define RT_MUTEX_HAS_WAITERS (1UL << 0)
+
+struct rt_mutex;
+CONSTEXPR static inline void rt_mutex_init(struct rt_mutex *lock);
+
+struct CAPABILITY("mutex") rt_mutex
+{
+    /* Owner thread | RT_MUTEX_HAS_WAITERS */
+    unsigned long owner;
+    struct spinlock wait_lock;
+    /* Sorted by priority (highest first), FIFO within the same priority */
+    struct list_head waiters;
+
+#ifdef __cplusplus
+    constexpr rt_mutex() : owner{}, wait_lock{}, waiters{}
+    {
+        rt_mutex_init(this);
+    }
+
+    rt_mutex(const rt_mutex &) = delete;
+    rt_mutex(rt_mutex &&m) = delete;
+    rt_mutex &operator=(const rt_mutex &) = delete;
+    rt_mutex &operator=(rt_mutex &&) = delete;
+#endif
+};
+
+struct rt_mutex_waiter
+{
+    struct thread *thread;
+    struct rt_mutex *lock;
+    /* Node in lock->waiters */
+    struct list_head list_node;
+    /* Node in the owner's pi_waiters, if we're the lock's top waiter */
+    struct list_head pi_node;
+    int prio;
+    /* Set when the lock gets handed over to us */
+    bool granted;
+};
+
+CONSTEXPR static inline void rt_mutex_init(struct rt_mutex *lock)
+{
+    lock->owner = 0;
+    spinlock_init(&lock->wait_lock);
+    INIT_LIST_HEAD(&lock->waiters);
+}
+
+__BEGIN_CDECLS
+
+void rt_mutex_lock(struct rt_mutex *lock) ACQUIRE(lock);
+int rt_mutex_lock_interruptible(struct rt_mutex *lock) TRY_ACQUIRE(0, lock);
+bool rt_mutex_trylock(struct rt_mutex *lock) TRY_ACQUIRE(true, lock);
+void rt_mutex_unlock(struct rt_mutex *lock) RELEASE(lock);
+struct thread *rt_mutex_owner(struct rt_mutex *lock);
+bool rt_mutex_holds_lock(struct rt_mutex *lock);
+
+/* Proxy locking, used by PI futexes, where the lock is set up and waited on on behalf of other
+ * threads. The caller serializes these against each other (futex bucket lock).
+ */
+
+/**
+ * @brief Initialize an rt_mutex that's locked by another thread
+ *
+ * @param lock Lock
+ * @param owner Owner
+ */
+void rt_mutex_init_proxy_locked(struct rt_mutex *lock, struct thread *owner);
+
+/**
+ * @brief Start a lock operation on behalf of a thread, queueing it and boosting the owner
+ * Does not sleep.
+ *
+ * @param lock Lock
+ * @param waiter Waiter to queue, must stay alive until rt_mutex_cleanup_proxy_lock
+ * @param thread Thread that's going to wait
+ * @return 1 if the thread acquired the lock, 0 if it got queued, -EDEADLK if it already owns it
+ */
+int rt_mutex_start_proxy_lock(struct rt_mutex *lock, struct rt_mutex_waiter *waiter,
+                              struct thread *thread);
+
+/**
+ * @brief Wait for a queued waiter to get the lock (interruptible)
+ *
+ * @param waiter Waiter, queued by rt_mutex_start_proxy_lock on the current thread
+ * @param timeout Timeout in ns, or 0 for none
+ * @return 0 if we got the lock, -EINTR or -ETIMEDOUT
+ */
+int rt_mutex_wait_proxy_lock(struct rt_mutex_waiter *waiter, hrtime_t timeout);
+
+/**
+ * @brief Dequeue a waiter after an interrupted or timed out wait
+ *
+ * @param lock Lock
+ * @param waiter Waiter
+ * @return True if the lock was handed over to the waiter in the meanwhile, else false
+ */
+bool rt_mutex_cleanup_proxy_lock(struct rt_mutex *lock, struct rt_mutex_waiter *waiter);
+
+/**
+ * @brief Get the thread that's going to get the lock on unlock
+ *
+ * @param lock Lock
+ * @return The top waiter's thread, or NULL if there are no waiters
+ */
+struct thread *rt_mutex_next_owner(struct rt_mutex *lock);
+
+/**
+ * @brief Hand the lock over to a specific waiter
+ * The current thread must own the lock.
+ *
+ * @param lock Lock
+ * @param new_owner Thread to hand the lock over to (as returned by rt_mutex_next_owner)
+ */
+void rt_mutex_handover(struct rt_mutex *lock, struct thread *new_owner) RELEASE(lock);
+
+__END_CDECLS
+
+#define MUST_HOLD_RT_MUTEX(m) assert(rt_mutex_holds_lock(m) == true)
+
+#endif
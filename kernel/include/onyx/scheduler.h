@@ -39,6 +39,7 @@ struct mm_address_space;
 struct kcov_data;
 struct blk_plug;
 struct registers;
+struct rt_mutex_waiter;
 
 #define THREAD_STRUCT_CANARY 0xcacacacafdfddead
 #define THREAD_DEAD_CANARY   0xdeadbeefbeefdead
@@ -82,9 +83,25 @@ typedef struct thread
 
     struct registers *regs;
 
+    /* Priority inheritance (see kernel/sched/rtmutex.cpp). priority is the effective priority,
+     * which may be boosted above normal_prio by the waiters of rt_mutexes we own.
+     */
+    int normal_prio;
+    struct spinlock pi_lock;
+    /* Top waiters of the rt_mutexes we own */
+    struct list_head pi_waiters;
+    /* The rt_mutex we're blocked on, if any */
+    struct rt_mutex_waiter *pi_blocked_on;
+    /* PI futexes we own */
+    struct list_head pi_state_list;
+
 #ifdef CONFIG_KCOV
     struct kcov_data *kcov_data{nullptr};
 #endif
+#ifdef CONFIG_MEMCG
+    /* Pages charged over memory.high, see mem_cgroup_handle_over_high */
+    unsigned long memcg_nr_pages_over_high;
+#endif
 #ifdef CONFIG_KCSAN
     struct kcsan_ctx kcsan_ctx;
 #endif
@@ -101,12 +118,19 @@ typedef struct thread
         : refcount{}, canary{}, kernel_stack{}, kernel_stack_top{}, owner{}, entry{}, flags{}, id{},
           status{}, priority{}, cpu{}, next{}, prev_prio{}, next_prio{}, prev_wait{}, next_wait{},
           fpu_area{}, sem_prev{}, sem_next{}, lock{}, errno_val{}, thread_list_head{}, addr_limit{},
-          wait_list_head{}, ctid{}, cputime_info{}, aspace{}, plug{}
+          wait_list_head{}, ctid{}, cputime_info{}, aspace{}, plug{}, regs{}, normal_prio{},
+          pi_lock{}, pi_blocked_on{}
+#ifdef CONFIG_MEMCG
+          ,
+          memcg_nr_pages_over_high{}
+#endif
 #ifdef __x86_64__
           ,
           fs{}, gs{}
 #endif
     {
+        INIT_LIST_HEAD(&pi_waiters);
+        INIT_LIST_HEAD(&pi_state_list);
     }
 
     /**
@@ -136,6 +160,8 @@ typedef struct thread
 #define THREAD_SHOULD_DIE    (1 << 3)
 #define THREAD_ACTIVE        (1 << 4)
 #define THREAD_RUNNING       (1 << 5)
+/* The thread has released its PI futexes and can't take new ones */
+#define THREAD_PI_EXITED     (1 << 6)
 
 int sched_init(void);
 
@@ -165,6 +191,15 @@ void thread_set_state(thread_t *thread, int state);
 
 void thread_wake_up(thread_t *thread);
 
+/**
+ * @brief Set a thread's effective priority, requeueing it if it's runnable
+ * Used by priority inheritance; the thread's normal_prio is left alone.
+ *
+ * @param thread Thread
+ * @param prio New priority
+ */
+void sched_set_effective_priority(struct thread *thread, int prio);
+
 void sched_sleep_until_wake(void);
 
 void thread_wake_up_ftx(thread_t *thread);
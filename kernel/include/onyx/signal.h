@@ -304,6 +304,8 @@ int signal_kill_pg(int sig, int flags, siginfo_t *info, pid_t pid);
 void signal_context_init(struct thread *new_thread);
 void signal_do_execve(struct process *proc);
 int may_kill(int signum, struct process *target, siginfo_t *info);
+int signal_dequeue_set(const sigset_t *set, siginfo_t *info);
+bool signal_set_is_pending(const sigset_t *set);
 
 static inline bool signal_is_stopping(int sig)
 {
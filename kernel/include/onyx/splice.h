@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef _ONYX_SPLICE_H
+#define _ONYX_SPLICE_H
+
+#include <onyx/types.h>
+
+struct file;
+struct pipe;
+
+/**
+ * @brief Splice data into a pipe by reading it into new pages.
+ * Used for files that can't lend us their pages.
+ *
+ * @param filp File pointer
+ * @param off Offset
+ * @param pipe Pipe
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t default_splice_read(struct file *filp, size_t off, struct pipe *pipe, size_t len,
+                            unsigned int flags);
+
+#endif
@@ -12,6 +12,11 @@
 
 #include <onyx/compiler.h>
 #include <onyx/pgtable.h>
+#include <onyx/types.h>
+
+#define MAX_SWAP_AREAS 16
+
+struct zswap_entry;
 
 __BEGIN_CDECLS
 /**
@@ -43,6 +48,30 @@ void swap_inc_map(struct page *page);
 void swap_unset_swapcache(swp_entry_t swp);
 bool swap_put(swp_entry_t entry);
 
+/**
+ * @brief Pin a swap slot for zswap writeback
+ * Takes a reference on the slot if (and only if) entry is still zswap's copy of it, so the slot can't
+ * be freed and reused while we write it back. Drop the reference with swap_put.
+ *
+ * @param swp Swap entry
+ * @param entry zswap entry
+ * @return True if pinned, else false
+ */
+bool swap_zswap_pin(swp_entry_t swp, struct zswap_entry *entry);
+
+/**
+ * @brief Write a page to its swap slot, synchronously
+ *
+ * @param swp Swap entry
+ * @param page Page to write
+ * @return 0 on success, negative error codes
+ */
+int swap_write_sync(swp_entry_t swp, struct page *page);
+
+ssize_t swap_ra_stats_read(void *buffer, size_t size, off_t off);
+ssize_t swap_ra_pages_read(void *buffer, size_t size, off_t off);
+ssize_t swap_ra_pages_write(void *buffer, size_t size, off_t off);
+
 __END_CDECLS
 
 #endif
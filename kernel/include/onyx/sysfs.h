@@ -11,6 +11,7 @@
 
 #include <stdbool.h>
 
+#include <onyx/compiler.h>
 #include <onyx/list.h>
 #include <onyx/object.h>
 
@@ -37,6 +38,10 @@ struct sysfs_object
     void *priv;
     ssize_t (*write)(void *buffer, size_t size, off_t off);
     ssize_t (*read)(void *buffer, size_t size, off_t off);
+    /* Same as read/write, but get passed the sysfs object (and thus priv). Take precedence over
+     * read/write if set. */
+    ssize_t (*show)(struct sysfs_object *obj, void *buffer, size_t size, off_t off);
+    ssize_t (*store)(struct sysfs_object *obj, void *buffer, size_t size, off_t off);
 };
 
 void sysfs_init(void);
@@ -45,4 +50,20 @@ void sysfs_add(struct sysfs_object *obj, struct sysfs_object *parent);
 int sysfs_init_and_add(const char *name, struct sysfs_object *obj, struct sysfs_object *parent);
 void sysfs_mount(void);
 
+__BEGIN_CDECLS
+
+/**
+ * @brief Copy (part of) a read handler's output buffer to user space
+ *
+ * @param buffer User buffer
+ * @param size Size of the user buffer
+ * @param off Offset into the output
+ * @param buf Output
+ * @param len Length of the output
+ * @return Number of bytes copied, 0 past the end, or -EFAULT
+ */
+ssize_t sysfs_copy_out(void *buffer, size_t size, off_t off, const char *buf, size_t len);
+
+__END_CDECLS
+
 #endif
@@ -20,6 +20,8 @@ struct tmpfs_inode : public inode
 {
     /* Used to store the symlink, if it is one */
     const char *link;
+    /* F_SEAL_* (see F_ADD_SEALS), protected by i_rwlock. Only memfds can be sealed. */
+    unsigned int seals;
 };
 
 extern const file_ops tmpfs_fops;
@@ -22,6 +22,31 @@ ssize_t strlen_user(const char *user);
 long get_user32(unsigned int *uaddr, unsigned int *dest);
 long get_user64(unsigned long *uaddr, unsigned long *dest);
 
+/**
+ * @brief Copy an extensible struct from user space
+ * If the user's struct is smaller than ours, the rest of ours is zeroed. If it's larger, the
+ * fields we don't know about must be zero.
+ *
+ * @param dst Kernel struct
+ * @param ksize Size of the kernel struct
+ * @param src User struct
+ * @param usize Size of the user struct
+ * @return 0 on success, -EFAULT, or -E2BIG if unknown fields are set
+ */
+int copy_struct_from_user(void *dst, size_t ksize, const void *src, size_t usize);
+
+/**
+ * @brief Atomically compare and exchange a 32-bit user space value
+ *
+ * @param uaddr User address
+ * @param old Expected value
+ * @param new_val Value to write if *uaddr == old
+ * @param curr Where to store the value found at uaddr (the exchange happened if it's == old)
+ * @return 0 on success, -EFAULT if we faulted
+ */
+long cmpxchg_user32(unsigned int *uaddr, unsigned int old, unsigned int new_val,
+                    unsigned int *curr);
+
 #ifdef __cplusplus
 }
 #endif
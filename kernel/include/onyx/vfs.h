@@ -38,22 +38,63 @@ __BEGIN_CDECLS
 
 struct dentry;
 
-struct readahead_state
+/* A single sequential stream of accesses on a file. Multiple readers interleaving on the same file
+ * (or the same reader jumping between regions) get one stream each. */
+struct ra_stream
 {
     /* All values below are in pages, not bytes */
+    /* First page of the last readahead */
     unsigned long ra_start;
+    /* First page after the last readahead (where the next async readahead starts) */
+    unsigned long ra_next;
+    /* Current window size. Grows on marker hits, collapses when thrashing */
     unsigned long ra_window;
     unsigned long ra_mark;
+    /* Last time (in ra_clock ticks) this stream was used, for replacement */
+    unsigned long ra_stamp;
+};
+
+struct ra_stats
+{
+    /* Synchronous readaheads (we found a !UPTODATE page) */
+    unsigned long nr_sync;
+    /* Asynchronous readaheads (we hit a marker) */
+    unsigned long nr_async;
+    /* Accesses that did not belong to any stream */
+    unsigned long nr_random;
+    /* Read ahead pages that got evicted before being used */
+    unsigned long nr_thrash;
+    /* Pages submitted for readahead */
+    unsigned long nr_pages;
+};
+
+#define RA_MAX_STREAMS 4
+
+/* Flags for ra_flags, mostly set by posix_fadvise */
+#define RA_FLAG_RANDOM     (1 << 0)
+#define RA_FLAG_SEQUENTIAL (1 << 1)
+
+struct readahead_state
+{
+    struct ra_stream ra_streams[RA_MAX_STREAMS];
+    /* Page offset of the last access that went through the readahead logic */
+    unsigned long ra_prev;
+    unsigned long ra_clock;
+    unsigned int ra_flags;
+    struct ra_stats ra_stats;
 };
 
 static inline void ra_state_init(struct readahead_state *ra)
 {
-    ra->ra_start = ra->ra_mark = ra->ra_window = 0;
+    memset(ra, 0, sizeof(*ra));
+    ra->ra_prev = -1UL;
 }
 
 /* Our max readahead window will be 512KiB (in however many pages). The window cannot grow from
- * there. */
-#define RA_MAX_WINDOW (0x80000 / PAGE_SIZE)
+ * there, unless the file was marked as POSIX_FADV_SEQUENTIAL, in which case it can grow up to
+ * RA_MAX_WINDOW_SEQ. */
+#define RA_MAX_WINDOW     (0x80000 / PAGE_SIZE)
+#define RA_MAX_WINDOW_SEQ (RA_MAX_WINDOW * 4)
 
 struct file
 {
@@ -70,6 +111,9 @@ struct file
     unsigned int f_flags;
     struct readahead_state f_ra_state;
     struct flock_file_info *f_flock;
+    /* epoll items watching this file, protected by f_ep_lock */
+    struct list_head f_ep;
+    struct spinlock f_ep_lock;
 };
 
 static inline bool file_needs_unlock(struct file *filp)
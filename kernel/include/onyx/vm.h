@@ -58,6 +58,8 @@ __BEGIN_CDECLS
 #define VM_DONT_MAP_OVER (1 << 8)
 #define VM_NOFLUSH       (1 << 9)
 #define VM_SHARED        (1 << 10)
+/* Map page cache pages around the faulting address, on read faults */
+#define VM_FAULTAROUND   (1 << 11)
 
 /* Internal flags used by the mm code */
 #define __VM_CACHE_TYPE_REGULAR     0
@@ -471,6 +473,24 @@ struct file;
  */
 void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file, off_t off);
 
+/**
+ * @brief Enable fault-around on the file mapping that contains \p addr.
+ * Read faults on the mapping then map the surrounding pages that are already in the page cache.
+ *
+ * @param addr Address inside the mapping.
+ */
+void vm_set_fault_around(void *addr);
+
+/**
+ * @brief Fault in a range of the current address space, as if user space read it.
+ * This is best-effort, errors are ignored.
+ *
+ * @param start Start of the range.
+ * @param end End of the range.
+ * @param exec True if the range is going to be executed.
+ */
+void vm_prefault(unsigned long start, unsigned long end, bool exec);
+
 struct tlb_shootdown
 {
     unsigned long addr;
@@ -514,13 +534,6 @@ int vm_create_address_space(struct mm_address_space *mm);
  */
 void vm_free_arch_mmu(struct arch_mm_address_space *mm);
 
-/**
- * @brief Loads a new address space.
- *
- * @param mm The to-be-loaded address space.
- */
-void vm_load_arch_mmu(struct arch_mm_address_space *mm);
-
 /**
  * @brief Saves the current address space in \p mm
  *
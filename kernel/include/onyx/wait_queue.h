@@ -19,6 +19,10 @@
 #include <onyx/task_switching.h>
 
 #define WQ_TOKEN_EXCLUSIVE (1u << 0)
+/* Persistent tokens are not dequeued on wakeup and have no thread to wake up: only their callback
+ * is called (with their own context). Used by epoll to keep its registrations around. Amongst
+ * persistent tokens, only the first WQ_TOKEN_EXCLUSIVE one is notified per wakeup. */
+#define WQ_TOKEN_PERSISTENT (1u << 1)
 
 /* Return values for wait_queue_token::wake */
 #define WQ_WAKE_DO_NOT_WAKE    -1
@@ -111,19 +115,27 @@ static inline bool __wait_queue_is_empty(const struct wait_queue *queue)
 void wait_queue_wait(struct wait_queue *queue);
 void wait_queue_wake(struct wait_queue *queue);
 void wait_queue_wake_all(struct wait_queue *queue);
+
+/**
+ * @brief Wake up every non-exclusive waiter, and a single exclusive one
+ *
+ * @param queue Queue to wake up
+ */
+void wait_queue_wake_exclusive(struct wait_queue *queue);
 void wait_queue_add(struct wait_queue *queue, struct wait_queue_token *token);
 void wait_queue_remove(struct wait_queue *queue, struct wait_queue_token *token);
 bool wait_queue_may_delete(struct wait_queue *queue);
 
 bool signal_is_pending();
 
-#define __wait_for_event(wq, cond, state, cmd)                        \
+#define ___wait_for_event(wq, cond, state, tflags, cmd)               \
     ({                                                                \
         long __ret = 0;                                               \
         struct wait_queue_token token;                                \
         if (cond)                                                     \
             goto out_final;                                           \
         init_wq_token(&token);                                        \
+        token.flags = tflags;                                         \
                                                                       \
         set_current_state(state);                                     \
         while (true)                                                  \
@@ -147,6 +159,8 @@ bool signal_is_pending();
         __ret;                                                        \
     })
 
+#define __wait_for_event(wq, cond, state, cmd) ___wait_for_event(wq, cond, state, 0, cmd)
+
 #define __wait_for_event_with_timeout(wq, cond, state, timeout_ns, cmd) \
     ({                                                                  \
         hrtime_t ____timeout = timeout_ns;                              \
@@ -223,6 +237,13 @@ bool signal_is_pending();
     __wait_for_event(wq, cond, THREAD_INTERRUPTIBLE, socket_lock.unlock_sock(this); sched_yield(); \
                      socket_lock.lock())
 
+/* Exclusive waiters get woken up one at a time by wait_queue_wake_exclusive(), which avoids
+ * thundering herds when only one of the waiters can make progress (e.g accept()).
+ */
+#define wait_for_event_socklocked_interruptible_exclusive(wq, cond)                        \
+    ___wait_for_event(wq, cond, THREAD_INTERRUPTIBLE, WQ_TOKEN_EXCLUSIVE,                  \
+                      socket_lock.unlock_sock(this); sched_yield(); socket_lock.lock())
+
 #define wait_for_event_socklocked_interruptible_2(wq, cond, sock)                           \
     __wait_for_event(wq, cond, THREAD_INTERRUPTIBLE, (sock)->socket_lock.unlock_sock(sock); \
                      sched_yield(); (sock)->socket_lock.lock())
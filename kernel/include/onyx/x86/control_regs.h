@@ -32,6 +32,9 @@
 /* Paging */
 #define CR0_PG  (1U << 31)
 
+/* Don't flush the PCID's TLB entries when loading CR3 (with CR4.PCIDE) */
+#define CR3_NOFLUSH (1UL << 63)
+
 /* Virtual-8086 mode extensions */
 #define CR4_VME        (1 << 0)
 /* Protected mode virtual interrupts */
@@ -411,6 +411,12 @@ static inline pte_t pte_wrprotect(pte_t pte)
     return __pte(pte_val(pte) & ~_PAGE_WRITE);
 }
 
+/* Point a pte at a different page, keeping every other bit */
+static inline pte_t pte_set_addr(pte_t pte, u64 phys)
+{
+    return __pte((pte_val(pte) & ~X86_ADDR_MASK) | phys);
+}
+
 #define X86_CACHING_BITS(index) ((((index) &0x3) << 3) | (((index >> 2) & 1) << 7))
 
 static inline pgprot_t calc_pgprot(u64 phys, u64 prot)
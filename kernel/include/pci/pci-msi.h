@@ -26,6 +26,25 @@
 #define PCI_MSI_16_VECTORS 0x0004
 #define PCI_MSI_32_VECTORS 0x0005
 
+#define PCI_MSIX_MESSAGE_CONTROL_OFF 2
+#define PCI_MSIX_TABLE_OFF           4
+#define PCI_MSIX_PBA_OFF             8
+
+#define PCI_MSIX_MSGCTRL_TABLE_SIZE(ctrl) (((ctrl) & 0x7ffU) + 1)
+#define PCI_MSIX_MSGCTRL_FUNCTION_MASK    (1 << 14)
+#define PCI_MSIX_MSGCTRL_ENABLE           (1 << 15)
+
+#define PCI_MSIX_BIR(reg)    ((reg) & 0x7)
+#define PCI_MSIX_OFFSET(reg) ((reg) & ~0x7U)
+
+/* MSI-X table entry layout */
+#define PCI_MSIX_ENTRY_SIZE          16
+#define PCI_MSIX_ENTRY_ADDR_LO       0
+#define PCI_MSIX_ENTRY_ADDR_HI       4
+#define PCI_MSIX_ENTRY_DATA          8
+#define PCI_MSIX_ENTRY_VECTOR_CTRL   12
+#define PCI_MSIX_ENTRY_CTRL_MASKED   (1 << 0)
+
 struct pci_msi_data
 {
     uint32_t address;
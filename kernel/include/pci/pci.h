@@ -184,6 +184,7 @@ protected:
     struct pci_irq pin_to_gsi[4];
     void *driver_data;
     pcie_allocation *alloc;
+    volatile u8 *msix_table_;
 
     void find_supported_capabilities();
     int wait_for_tp(off_t cap_start);
@@ -197,7 +198,7 @@ public:
         : device{name, b, parent}, device_id{did_}, vendor_id{vid_}, address{addr}, pci_class_{},
           sub_class_{}, prog_if_{}, type{}, has_power_management{}, pm_cap_off{},
           supported_power_states{}, current_power_state{}, next{}, pin_to_gsi{},
-          driver_data{}, alloc{}
+          driver_data{}, alloc{}, msix_table_{}
     {
     }
 
@@ -262,6 +263,25 @@ public:
     void disable_irq();
     size_t find_capability(uint8_t cap, int instance = 0);
     int enable_msi(irq_t handler, void *cookie);
+
+    /**
+     * @brief Get the number of MSI-X vectors the device supports
+     *
+     * @return Number of vectors, or 0 if MSI-X is not supported
+     */
+    unsigned int msix_nr_vectors();
+
+    /**
+     * @brief Enable MSI-X, routing each vector to a specific cpu
+     *
+     * @param nr_vecs Number of vectors to enable (must be <= msix_nr_vectors())
+     * @param handler IRQ handler
+     * @param cookies Array of nr_vecs cookies, one per vector
+     * @param cpus Array of nr_vecs cpus, one per vector. If null, vectors are spread over every cpu
+     * @return 0 on success, negative error codes
+     */
+    int enable_msix(unsigned int nr_vecs, irq_t handler, void *const *cookies,
+                    const unsigned int *cpus);
     expected<pci_bar, int> get_bar(unsigned int index);
     void *map_bar(unsigned int index, unsigned int caching);
     void set_bar(const pci_bar &bar, unsigned int index);
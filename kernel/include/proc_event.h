@@ -10,11 +10,19 @@
 #include <onyx/types.h>
 #include <sys/user.h>
 #define PROC_EVENT_LISTEN_SYSCALLS (1 << 0)
+/* Queue events to a ring buffer, instead of stopping the process until every event is acked.
+ * read() returns as many events as fit in the buffer, and the fd can be polled. */
+#define PROC_EVENT_RING            (1 << 1)
+/* Get a PROC_EVENT_EXIT when the process exits. Requires PROC_EVENT_RING. */
+#define PROC_EVENT_LISTEN_EXIT     (1 << 2)
 
 #define PROCEVENT_ACK 0
 
 #define PROC_EVENT_SYSCALL_ENTER 0
 #define PROC_EVENT_SYSCALL_EXIT  1
+#define PROC_EVENT_EXIT          2
+/* Events were dropped because the ring was full */
+#define PROC_EVENT_LOST          3
 
 struct syscall_exit
 {
@@ -22,6 +30,17 @@ struct syscall_exit
     long syscall_nr;
 };
 
+struct proc_exit
+{
+    /* wait(2)-style status */
+    int wstatus;
+};
+
+struct proc_lost
+{
+    unsigned long nr_lost;
+};
+
 struct proc_event
 {
     int type;
@@ -31,6 +50,8 @@ struct proc_event
     union {
         struct user_regs_struct syscall;
         struct syscall_exit syscall_exit;
+        struct proc_exit exit;
+        struct proc_lost lost;
     } e_un;
 };
 
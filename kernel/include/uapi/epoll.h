@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_EPOLL_H
+#define _UAPI_EPOLL_H
+
+#include <onyx/types.h>
+
+#include <uapi/fcntl.h>
+
+/* Values match Linux's */
+
+#define EPOLL_CLOEXEC O_CLOEXEC
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLLIN     0x001
+#define EPOLLPRI    0x002
+#define EPOLLOUT    0x004
+#define EPOLLERR    0x008
+#define EPOLLHUP    0x010
+#define EPOLLNVAL   0x020
+#define EPOLLRDNORM 0x040
+#define EPOLLRDBAND 0x080
+#define EPOLLWRNORM 0x100
+#define EPOLLWRBAND 0x200
+#define EPOLLMSG    0x400
+#define EPOLLRDHUP  0x2000
+
+#define EPOLLEXCLUSIVE (1U << 28)
+#define EPOLLWAKEUP    (1U << 29)
+#define EPOLLONESHOT   (1U << 30)
+#define EPOLLET        (1U << 31)
+
+#ifdef __x86_64__
+#define __EPOLL_PACKED __attribute__((packed))
+#else
+#define __EPOLL_PACKED
+#endif
+
+struct epoll_event
+{
+    __u32 events;
+    __u64 data;
+} __EPOLL_PACKED;
+
+#endif
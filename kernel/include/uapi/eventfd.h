@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_EVENTFD_H
+#define _UAPI_EVENTFD_H
+
+#include <uapi/fcntl.h>
+
+/* Values match Linux's */
+
+#define EFD_SEMAPHORE 1
+#define EFD_CLOEXEC   O_CLOEXEC
+#define EFD_NONBLOCK  O_NONBLOCK
+
+#endif
@@ -168,6 +168,13 @@
 #define RWH_WRITE_LIFE_LONG    4
 #define RWH_WRITE_LIFE_EXTREME 5
 
+/* Flags for preadv2/pwritev2 */
+#define RWF_HIPRI  0x00000001
+#define RWF_DSYNC  0x00000002
+#define RWF_SYNC   0x00000004
+#define RWF_NOWAIT 0x00000008
+#define RWF_APPEND 0x00000010
+
 #define DN_ACCESS    0x00000001
 #define DN_MODIFY    0x00000002
 #define DN_CREATE    0x00000004
@@ -10,6 +10,8 @@
 #ifndef _UAPI_FUTEX_H
 #define _UAPI_FUTEX_H
 
+#include <onyx/types.h>
+
 #define FUTEX_WAIT            0
 #define FUTEX_WAKE            1
 #define FUTEX_FD              2
@@ -28,4 +30,21 @@
 #define FUTEX_CLOCK_REALTIME 256
 #define FUTEX_OP_MASK        ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
+/* PI futex word bits, the rest is the owner's TID */
+#define FUTEX_WAITERS    0x80000000
+#define FUTEX_OWNER_DIED 0x40000000
+#define FUTEX_TID_MASK   0x3fffffff
+
+/* futex_waitv */
+#define FUTEX_32        2
+#define FUTEX_WAITV_MAX 128
+
+struct futex_waitv
+{
+    __u64 val;
+    __u64 uaddr;
+    __u32 flags;
+    __u32 __reserved;
+};
+
 #endif
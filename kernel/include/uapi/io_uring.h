@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_IO_URING_H
+#define _UAPI_IO_URING_H
+
+#include <onyx/types.h>
+
+/* Shared-memory submission/completion rings. The layout and constants match Linux's io_uring, for
+ * the subset of it that we implement. */
+
+struct io_uring_sqe
+{
+    __u8 opcode;
+    __u8 flags;
+    __u16 ioprio;
+    __s32 fd;
+    union {
+        __u64 off;
+        __u64 addr2;
+    };
+    __u64 addr;
+    __u32 len;
+    union {
+        __u32 rw_flags;
+        __u32 fsync_flags;
+        __u16 poll_events;
+        __u32 msg_flags;
+        __u32 accept_flags;
+    };
+    __u64 user_data;
+    __u64 __pad2[3];
+};
+
+/* sqe->opcode */
+#define IORING_OP_NOP      0
+#define IORING_OP_READV    1
+#define IORING_OP_WRITEV   2
+#define IORING_OP_FSYNC    3
+#define IORING_OP_POLL_ADD 6
+#define IORING_OP_SENDMSG  9
+#define IORING_OP_RECVMSG  10
+#define IORING_OP_ACCEPT   13
+#define IORING_OP_READ     22
+#define IORING_OP_WRITE    23
+#define IORING_OP_SEND     26
+#define IORING_OP_RECV     27
+
+/* sqe->flags */
+#define IOSQE_FIXED_FILE (1U << 0)
+#define IOSQE_IO_DRAIN   (1U << 1)
+#define IOSQE_IO_LINK    (1U << 2)
+
+/* sqe->fsync_flags */
+#define IORING_FSYNC_DATASYNC (1U << 0)
+
+struct io_uring_cqe
+{
+    __u64 user_data;
+    __s32 res;
+    __u32 flags;
+};
+
+/* mmap offsets */
+#define IORING_OFF_SQ_RING 0ULL
+#define IORING_OFF_CQ_RING 0x8000000ULL
+#define IORING_OFF_SQES    0x10000000ULL
+
+struct io_sqring_offsets
+{
+    __u32 head;
+    __u32 tail;
+    __u32 ring_mask;
+    __u32 ring_entries;
+    __u32 flags;
+    __u32 dropped;
+    __u32 array;
+    __u32 resv1;
+    __u64 resv2;
+};
+
+/* sq_ring->flags */
+#define IORING_SQ_NEED_WAKEUP (1U << 0)
+
+struct io_cqring_offsets
+{
+    __u32 head;
+    __u32 tail;
+    __u32 ring_mask;
+    __u32 ring_entries;
+    __u32 overflow;
+    __u32 cqes;
+    __u32 flags;
+    __u32 resv1;
+    __u64 resv2;
+};
+
+/* io_uring_params->flags */
+#define IORING_SETUP_IOPOLL (1U << 0)
+#define IORING_SETUP_SQPOLL (1U << 1)
+#define IORING_SETUP_SQ_AFF (1U << 2)
+#define IORING_SETUP_CQSIZE (1U << 3)
+
+/* io_uring_params->features */
+#define IORING_FEAT_SINGLE_MMAP   (1U << 0)
+#define IORING_FEAT_NODROP        (1U << 1)
+#define IORING_FEAT_SUBMIT_STABLE (1U << 2)
+
+struct io_uring_params
+{
+    __u32 sq_entries;
+    __u32 cq_entries;
+    __u32 flags;
+    __u32 sq_thread_cpu;
+    __u32 sq_thread_idle;
+    __u32 features;
+    __u32 wq_fd;
+    __u32 resv[3];
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+};
+
+/* io_uring_enter(2) flags */
+#define IORING_ENTER_GETEVENTS (1U << 0)
+#define IORING_ENTER_SQ_WAKEUP (1U << 1)
+#define IORING_ENTER_SQ_WAIT   (1U << 2)
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_PIDFD_H
+#define _UAPI_PIDFD_H
+
+#include <uapi/fcntl.h>
+
+/* Values match Linux's */
+
+/* Flags for pidfd_open */
+#define PIDFD_NONBLOCK O_NONBLOCK
+
+#endif
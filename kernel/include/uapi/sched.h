@@ -11,7 +11,46 @@
 #ifndef _UAPI_SCHED_H
 #define _UAPI_SCHED_H
 
+#include <onyx/types.h>
+
 #define CLONE_FORK        (1 << 0)
 #define CLONE_SPAWNTHREAD (1 << 1)
 
+/* clone3 flags. Values match Linux's */
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_PIDFD          0x00001000
+#define CLONE_VFORK          0x00004000
+#define CLONE_PARENT         0x00008000
+#define CLONE_THREAD         0x00010000
+#define CLONE_SETTLS         0x00080000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_CHILD_SETTID   0x01000000
+#define CLONE_CLEAR_SIGHAND  0x100000000ULL
+#define CLONE_INTO_CGROUP    0x200000000ULL
+
+struct clone_args
+{
+    __u64 flags;
+    __u64 pidfd;
+    __u64 child_tid;
+    __u64 parent_tid;
+    __u64 exit_signal;
+    __u64 stack;
+    __u64 stack_size;
+    __u64 tls;
+    __u64 set_tid;
+    __u64 set_tid_size;
+    __u64 cgroup;
+};
+
+/* Sizes of the previous versions of struct clone_args. Newer fields get appended at the end, and
+ * the kernel accepts any size >= VER0, as long as the fields it doesn't know about are zero. */
+#define CLONE_ARGS_SIZE_VER0 64
+#define CLONE_ARGS_SIZE_VER1 80
+#define CLONE_ARGS_SIZE_VER2 88
+
 #endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_SPAWN_H
+#define _UAPI_SPAWN_H
+
+#include <onyx/types.h>
+
+/* spawn(2): create a child process that execs straight away, without copying (or running on) the
+ * parent's address space. Meant as the backend for posix_spawn. */
+
+/* Flags, values match musl's POSIX_SPAWN_* */
+#define SPAWN_RESETIDS   0x01
+#define SPAWN_SETPGROUP  0x02
+#define SPAWN_SETSIGDEF  0x04
+#define SPAWN_SETSIGMASK 0x08
+#define SPAWN_SETSID     0x80
+/* Onyx-specific: return a pidfd for the child in spawn_args::pidfd */
+#define SPAWN_PIDFD      0x100
+
+/* File actions, done in order, in the child */
+#define SPAWN_FA_CLOSE  0
+#define SPAWN_FA_DUP2   1
+#define SPAWN_FA_OPEN   2
+#define SPAWN_FA_CHDIR  3
+#define SPAWN_FA_FCHDIR 4
+
+struct spawn_file_action
+{
+    __u32 type;
+    __s32 fd;
+    /* Source fd for SPAWN_FA_DUP2 */
+    __s32 srcfd;
+    __u32 oflag;
+    __u32 mode;
+    __u32 __reserved;
+    /* Path for SPAWN_FA_OPEN and SPAWN_FA_CHDIR */
+    __u64 path;
+};
+
+struct spawn_args
+{
+    __u64 flags;
+    __s64 pgroup;
+    __u64 sigmask;
+    __u64 sigdefault;
+    /* Array of struct spawn_file_action */
+    __u64 file_actions;
+    __u64 nr_file_actions;
+    /* Pointer to an int where the pidfd is stored, if SPAWN_PIDFD */
+    __u64 pidfd;
+};
+
+#define SPAWN_ARGS_SIZE_VER0 56
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_TIMERFD_H
+#define _UAPI_TIMERFD_H
+
+#include <uapi/fcntl.h>
+
+/* Values match Linux's */
+
+#define TFD_CLOEXEC  O_CLOEXEC
+#define TFD_NONBLOCK O_NONBLOCK
+
+/* timerfd_settime flags */
+#define TFD_TIMER_ABSTIME       (1 << 0)
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+
+#endif
@@ -15,7 +15,8 @@ typedef enum
 {
     P_ALL = 0,
     P_PID = 1,
-    P_PGID = 2
+    P_PGID = 2,
+    P_PIDFD = 3
 } idtype_t;
 
 #define WNOHANG   1
@@ -8,12 +8,15 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <onyx/binfmt.h>
 #include <onyx/err.h>
 #include <onyx/exec.h>
+#include <onyx/inode.h>
 #include <onyx/kunit.h>
 #include <onyx/process.h>
+#include <onyx/spinlock.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 
@@ -139,6 +142,113 @@ bool elf_phdrs_valid(const elf_phdr *phdrs, size_t nr_phdrs)
     return true;
 }
 
+/* Parsed program headers, cached per inode. Exec'ing the same binaries over and over is very
+ * common (shells, build systems), and this saves us from reading and validating the program
+ * headers every time. The cache hangs off the inode (and dies with it), and is checked against
+ * the inode's version, its size and the ELF header, so rewritten binaries get reparsed. Cached
+ * phdrs were validated when inserted.
+ */
+/* Don't bother caching binaries with absurd numbers of phdrs */
+#define ELF_PHDR_CACHE_MAX 64
+
+struct elf_phdr_cache_entry
+{
+    unsigned long version;
+    size_t size;
+    elf_ehdr ehdr;
+    elf_phdr phdrs[];
+};
+
+static bool elf_phdr_cache_matches(struct elf_phdr_cache_entry *e, struct inode *ino,
+                                   const elf_ehdr *header)
+{
+    /* Note: elf32 and elf64 share i_phdr_cache, but e_ident[EI_CLASS] tells them apart */
+    return e->version == __atomic_load_n(&ino->i_version, __ATOMIC_ACQUIRE) &&
+           e->size == ino->i_size && !memcmp(&e->ehdr, header, sizeof(elf_ehdr));
+}
+
+/**
+ * @brief Look up the program headers for an inode in its phdr cache
+ *
+ * @param ino Inode of the executable
+ * @param header ELF header, as read from the file
+ * @param phdrs Buffer for the program headers (e_phnum entries)
+ * @return True if found (and copied to phdrs), else false
+ */
+static bool elf_phdr_cache_lookup(struct inode *ino, const elf_ehdr *header, elf_phdr *phdrs)
+{
+    scoped_lock g{ino->i_lock};
+    struct elf_phdr_cache_entry *e = (struct elf_phdr_cache_entry *) ino->i_phdr_cache;
+
+    if (!e || !elf_phdr_cache_matches(e, ino, header))
+        return false;
+
+    memcpy(phdrs, e->phdrs, header->e_phnum * sizeof(elf_phdr));
+    return true;
+}
+
+/**
+ * @brief Insert (validated) program headers in an inode's phdr cache
+ *
+ * @param ino Inode of the executable
+ * @param header ELF header, as read from the file
+ * @param phdrs Program headers
+ * @param version Inode version sampled before reading the headers
+ */
+static void elf_phdr_cache_insert(struct inode *ino, const elf_ehdr *header,
+                                  const elf_phdr *phdrs, unsigned long version)
+{
+    if (header->e_phnum > ELF_PHDR_CACHE_MAX)
+        return;
+
+    size_t phdrs_size = header->e_phnum * sizeof(elf_phdr);
+    struct elf_phdr_cache_entry *e =
+        (struct elf_phdr_cache_entry *) malloc(sizeof(struct elf_phdr_cache_entry) + phdrs_size);
+    if (!e)
+        return;
+
+    e->version = version;
+    e->size = ino->i_size;
+    memcpy(&e->ehdr, header, sizeof(elf_ehdr));
+    memcpy(e->phdrs, phdrs, phdrs_size);
+
+    void *old;
+
+    {
+        scoped_lock g{ino->i_lock};
+        old = ino->i_phdr_cache;
+        ino->i_phdr_cache = e;
+    }
+
+    free(old);
+}
+
+/* Pages to prefault at the start of the text and at the entry point. Fault-around maps the cached
+ * pages around those, so this mostly serves to get the IO going before user space starts.
+ */
+#define ELF_PREFAULT_PAGES 2
+
+/**
+ * @brief Set up an executable segment, after mapping it
+ *
+ * @param start Start of the segment's mapping
+ * @param end End of the segment's mapping
+ * @param entry Entry point of the program
+ */
+static void elf_setup_text(unsigned long start, unsigned long end, unsigned long entry)
+{
+    /* Text is faulted in all the time, so map it in bigger chunks */
+    vm_set_fault_around((void *) start);
+
+    vm_prefault(start, cul::min(end, start + (ELF_PREFAULT_PAGES << PAGE_SHIFT)), true);
+
+    if (entry >= start && entry < end)
+    {
+        entry &= -PAGE_SIZE;
+        vm_prefault(entry, cul::min(end, entry + (ELF_PREFAULT_PAGES << PAGE_SHIFT)), true);
+    }
+}
+
 static void *elf_load(struct binfmt_args *args, elf_ehdr *header)
 {
     bool is_interp = args->needs_interp;
@@ -169,18 +279,26 @@ static void *elf_load(struct binfmt_args *args, elf_ehdr *header)
         goto error0;
     }
 
-    /* Read the program headers */
-    if (read_vfs(header->e_phoff, program_headers_size, phdrs, args->file) !=
-        (ssize_t) program_headers_size)
+    if (!elf_phdr_cache_lookup(fd->f_ino, header, phdrs))
     {
-        errno = EIO;
-        goto error1;
-    }
+        /* Sample the version first, so a write that races with us invalidates what we insert */
+        unsigned long version = __atomic_load_n(&fd->f_ino->i_version, __ATOMIC_ACQUIRE);
 
-    if (!elf_phdrs_valid(phdrs, header->e_phnum))
-    {
-        errno = ENOEXEC;
-        goto error1;
+        /* Read the program headers */
+        if (read_vfs(header->e_phoff, program_headers_size, phdrs, args->file) !=
+            (ssize_t) program_headers_size)
+        {
+            errno = EIO;
+            goto error1;
+        }
+
+        if (!elf_phdrs_valid(phdrs, header->e_phnum))
+        {
+            errno = ENOEXEC;
+            goto error1;
+        }
+
+        elf_phdr_cache_insert(fd->f_ino, header, phdrs, version);
     }
 
     needed_size = elf_calculate_map_size(phdrs, header->e_phnum);
@@ -340,6 +458,9 @@ static void *elf_load(struct binfmt_args *args, elf_ehdr *header)
                     }
                 }
             }
+
+            if (prot & PROT_EXEC)
+                elf_setup_text(addr, addr + (pages << PAGE_SHIFT), header->e_entry);
         }
     }
 
@@ -497,6 +618,38 @@ TEST(elfldr, test_bad_phdrs)
     EXPECT_TRUE(ELF_NAMESPACE::elf_phdrs_valid(phdrs, 3));
 }
 
+TEST(elfldr, phdr_cache_works)
+{
+    struct inode ino{};
+    spinlock_init(&ino.i_lock);
+    ino.i_size = 0x10000;
+
+    elf_ehdr eh;
+    memset(&eh, 0, sizeof(eh));
+    eh.e_phnum = 2;
+
+    elf_phdr phdrs[2], phdrs2[2];
+    memset(phdrs, 0, sizeof(phdrs));
+    phdrs[0].p_type = PT_LOAD;
+    phdrs[0].p_vaddr = 0x400000;
+    phdrs[1].p_type = PT_DYNAMIC;
+
+    ELF_NAMESPACE::elf_phdr_cache_insert(&ino, &eh, phdrs, ino.i_version);
+    ASSERT_TRUE(ELF_NAMESPACE::elf_phdr_cache_lookup(&ino, &eh, phdrs2));
+    EXPECT_EQ(memcmp(phdrs, phdrs2, sizeof(phdrs)), 0);
+
+    // A different ELF header must not hit the cache
+    eh.e_entry = 0x1000;
+    EXPECT_FALSE(ELF_NAMESPACE::elf_phdr_cache_lookup(&ino, &eh, phdrs2));
+    eh.e_entry = 0;
+
+    // Neither must a rewritten binary, even if the timestamps didn't change
+    ino.i_version++;
+    EXPECT_FALSE(ELF_NAMESPACE::elf_phdr_cache_lookup(&ino, &eh, phdrs2));
+
+    free(ino.i_phdr_cache);
+}
+
 TEST(elfldr, test_no_gap_regression)
 {
     // Regression test for issue loading segments with no gap in between.
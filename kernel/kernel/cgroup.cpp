@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/cgroup.h>
+#include <onyx/cpu_cgroup.h>
+#include <onyx/err.h>
+#include <onyx/init.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mutex.h>
+#include <onyx/process.h>
+#include <onyx/scoped_lock.h>
+
+/**
+ * cgroup core. We have a single (cgroup v2 style) hierarchy, exposed through cgroupfs. Every
+ * controller is enabled in every cgroup; there's no subtree_control. Processes belong to exactly
+ * one cgroup, and move around as a whole.
+ *
+ * The hierarchy (children lists, process moves, creation and removal) is protected by
+ * cgroup_lock. process->cgroup is RCU protected: it's only changed under cgroup_lock, and cgroups
+ * are freed after a grace period.
+ */
+
+const struct cgroup_subsys *const cgroup_subsystems[CGROUP_NR_SUBSYS] = {
+#ifdef CONFIG_CGROUP_SCHED
+    &cpu_cgrp_subsys,
+#endif
+#ifdef CONFIG_MEMCG
+    &memory_cgrp_subsys,
+#endif
+};
+
+struct cgroup cgroup_root = {
+    .name = "",
+    .parent = nullptr,
+    .children = LIST_HEAD_INIT(cgroup_root.children),
+    .sibling = {},
+    .refcount = 1,
+    .id = 1,
+    .nr_procs = 0,
+    .flags = 0,
+    .subsys = {},
+    .rcu = {},
+};
+
+static DECLARE_MUTEX(cgroup_lock);
+static unsigned long cgroup_next_id = 2;
+
+static void cgroup_free_rcu(struct rcu_head *head)
+{
+    struct cgroup *cg = container_of(head, struct cgroup, rcu);
+
+    for (int i = 0; i < CGROUP_NR_SUBSYS; i++)
+    {
+        if (cg->subsys[i])
+            cgroup_subsystems[i]->css_free(cg->subsys[i]);
+    }
+
+    if (cg->parent)
+        cgroup_put(cg->parent);
+    kfree(cg);
+}
+
+void cgroup_put(struct cgroup *cg)
+{
+    if (__atomic_sub_fetch(&cg->refcount, 1, __ATOMIC_RELEASE) == 0)
+    {
+        DCHECK(cg != &cgroup_root);
+        call_rcu(&cg->rcu, cgroup_free_rcu);
+    }
+}
+
+struct cgroup *cgroup_current(void)
+{
+    struct process *p = get_current_process();
+    struct cgroup *cg;
+
+    if (!p)
+        return &cgroup_root;
+    cg = rcu_dereference(p->cgroup);
+    return cg ?: &cgroup_root;
+}
+
+static bool cgroup_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len >= CGROUP_NAME_MAX)
+        return false;
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+        return false;
+
+    /* Names with dots would clash with control files (e.g memory.max) */
+    return strchr(name, '.') == nullptr;
+}
+
+static struct cgroup *cgroup_find_child(struct cgroup *parent, const char *name)
+    REQUIRES(cgroup_lock)
+{
+    list_for_every (&parent->children)
+    {
+        struct cgroup *child = container_of(l, struct cgroup, sibling);
+        if (!strcmp(child->name, name))
+            return child;
+    }
+
+    return nullptr;
+}
+
+struct cgroup *cgroup_create(struct cgroup *parent, const char *name)
+{
+    struct cgroup *cg;
+    int i;
+
+    if (!cgroup_name_valid(name))
+        return (struct cgroup *) ERR_PTR(-EINVAL);
+
+    cg = (struct cgroup *) kmalloc(sizeof(*cg), GFP_KERNEL);
+    if (!cg)
+        return (struct cgroup *) ERR_PTR(-ENOMEM);
+
+    memset(cg, 0, sizeof(*cg));
+    strlcpy(cg->name, name, CGROUP_NAME_MAX);
+    INIT_LIST_HEAD(&cg->children);
+    /* One reference for the hierarchy */
+    cg->refcount = 1;
+    cg->parent = parent;
+
+    scoped_mutex g{cgroup_lock};
+
+    if (parent->flags & CGROUP_DEAD)
+    {
+        kfree(cg);
+        return (struct cgroup *) ERR_PTR(-ENOENT);
+    }
+
+    if (cgroup_find_child(parent, name))
+    {
+        kfree(cg);
+        return (struct cgroup *) ERR_PTR(-EEXIST);
+    }
+
+    for (i = 0; i < CGROUP_NR_SUBSYS; i++)
+    {
+        struct cgroup_subsys_state *css = cgroup_subsystems[i]->css_alloc(cg);
+        if (IS_ERR_OR_NULL(css))
+        {
+            while (i-- > 0)
+                cgroup_subsystems[i]->css_free(cg->subsys[i]);
+            kfree(cg);
+            return (struct cgroup *) (css ? css : ERR_PTR(-ENOMEM));
+        }
+
+        css->cgroup = cg;
+        cg->subsys[i] = css;
+    }
+
+    cg->id = cgroup_next_id++;
+    cgroup_get(parent);
+    list_add_tail(&cg->sibling, &parent->children);
+    return cg;
+}
+
+int cgroup_destroy(struct cgroup *cg)
+{
+    scoped_mutex g{cgroup_lock};
+
+    if (cg == &cgroup_root || cg->flags & CGROUP_DEAD)
+        return -ENOENT;
+    if (cg->nr_procs || !list_is_empty(&cg->children))
+        return -EBUSY;
+
+    cg->flags |= CGROUP_DEAD;
+    list_remove(&cg->sibling);
+
+    for (int i = 0; i < CGROUP_NR_SUBSYS; i++)
+    {
+        if (cg->subsys[i] && cgroup_subsystems[i]->css_offline)
+            cgroup_subsystems[i]->css_offline(cg->subsys[i]);
+    }
+
+    /* Drop the hierarchy's reference */
+    cgroup_put(cg);
+    return 0;
+}
+
+struct cgroup *cgroup_lookup_child(struct cgroup *parent, const char *name)
+{
+    scoped_mutex g{cgroup_lock};
+    struct cgroup *cg = cgroup_find_child(parent, name);
+    if (cg)
+        cgroup_get(cg);
+    return cg;
+}
+
+struct cgroup *cgroup_nth_child(struct cgroup *parent, unsigned long n)
+{
+    scoped_mutex g{cgroup_lock};
+
+    list_for_every (&parent->children)
+    {
+        if (n-- == 0)
+        {
+            struct cgroup *cg = container_of(l, struct cgroup, sibling);
+            cgroup_get(cg);
+            return cg;
+        }
+    }
+
+    return nullptr;
+}
+
+int cgroup_attach_process(struct cgroup *cg, struct process *p)
+{
+    scoped_mutex g{cgroup_lock};
+    struct cgroup *old = p->cgroup;
+
+    if (cg->flags & CGROUP_DEAD)
+        return -ENOENT;
+    if (p->flags & PROCESS_CGROUP_EXITED)
+        return -ESRCH;
+    if (old == cg)
+        return 0;
+
+    for (int i = 0; i < CGROUP_NR_SUBSYS; i++)
+    {
+        if (cgroup_subsystems[i]->attach)
+            cgroup_subsystems[i]->attach(p, old, cg);
+    }
+
+    cgroup_get(cg);
+    old->nr_procs--;
+    cg->nr_procs++;
+    rcu_assign_pointer(p->cgroup, cg);
+    /* Readers may still be looking at old, but it's only freed after a grace period */
+    cgroup_put(old);
+    return 0;
+}
+
+void cgroup_fork(struct process *child, struct process *parent)
+{
+    scoped_mutex g{cgroup_lock};
+    struct cgroup *cg = parent ? parent->cgroup : &cgroup_root;
+
+    cgroup_get(cg);
+    cg->nr_procs++;
+    child->cgroup = cg;
+}
+
+void cgroup_exit(struct process *p)
+{
+    scoped_mutex g{cgroup_lock};
+    p->cgroup->nr_procs--;
+    p->flags |= PROCESS_CGROUP_EXITED;
+}
+
+int cgroup_parse_size(const char *buf, unsigned long *out)
+{
+    unsigned long val = 0;
+    const char *s = buf;
+
+    if (!strcmp(buf, "max"))
+    {
+        *out = ULONG_MAX;
+        return 0;
+    }
+
+    if (*s < '0' || *s > '9')
+        return -EINVAL;
+
+    for (; *s >= '0' && *s <= '9'; s++)
+    {
+        if (__builtin_mul_overflow(val, 10, &val) || __builtin_add_overflow(val, *s - '0', &val))
+            return -EINVAL;
+    }
+
+    unsigned int shift = 0;
+    switch (*s)
+    {
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        case '\0':
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (shift && *++s != '\0')
+        return -EINVAL;
+    if (val > (ULONG_MAX >> shift))
+        return -EINVAL;
+
+    *out = val << shift;
+    return 0;
+}
+
+struct cgroup_procs_ctx
+{
+    struct cgroup *cg;
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+
+static bool cgroup_procs_visit(struct process *p, void *arg)
+{
+    struct cgroup_procs_ctx *ctx = (struct cgroup_procs_ctx *) arg;
+
+    if (READ_ONCE(p->cgroup) != ctx->cg || READ_ONCE(p->flags) & PROCESS_CGROUP_EXITED)
+        return true;
+
+    int len = snprintf(ctx->buf + ctx->pos, ctx->len - ctx->pos, "%d\n", p->get_pid());
+    if (ctx->pos + len >= ctx->len)
+        return false;
+    ctx->pos += len;
+    return true;
+}
+
+static ssize_t cgroup_procs_show(struct cgroup *cg, char *buf, size_t len)
+{
+    struct cgroup_procs_ctx ctx = {cg, buf, len, 0};
+    for_every_process(cgroup_procs_visit, &ctx);
+    return ctx.pos;
+}
+
+static int cgroup_procs_write(struct cgroup *cg, char *buf, size_t len)
+{
+    struct process *p;
+    unsigned long pid = 0;
+    int err;
+
+    if (len == 0)
+        return -EINVAL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (buf[i] < '0' || buf[i] > '9')
+            return -EINVAL;
+        pid = pid * 10 + (buf[i] - '0');
+        if (pid > INT_MAX)
+            return -EINVAL;
+    }
+
+    /* 0 means the writer itself */
+    if (pid == 0)
+    {
+        p = get_current_process();
+        process_get(p);
+    }
+    else
+    {
+        p = get_process_from_pid(pid);
+        if (!p)
+            return -ESRCH;
+    }
+
+    err = cgroup_attach_process(cg, p);
+    process_put(p);
+    return err;
+}
+
+static ssize_t cgroup_controllers_show(struct cgroup *cg, char *buf, size_t len)
+{
+    size_t pos = 0;
+
+    for (int i = 0; i < CGROUP_NR_SUBSYS; i++)
+    {
+        int st = snprintf(buf + pos, len - pos, "%s%s", pos ? " " : "", cgroup_subsystems[i]->name);
+        if (pos + st >= len)
+            return -E2BIG;
+        pos += st;
+    }
+
+    if (pos + 1 >= len)
+        return -E2BIG;
+    buf[pos++] = '\n';
+    return pos;
+}
+
+const struct cgroup_file cgroup_core_files[] = {
+    {
+        .name = "cgroup.procs",
+        .mode = 0644,
+        .flags = 0,
+        .show = cgroup_procs_show,
+        .write = cgroup_procs_write,
+    },
+    {
+        .name = "cgroup.controllers",
+        .mode = 0444,
+        .flags = 0,
+        .show = cgroup_controllers_show,
+        .write = nullptr,
+    },
+    {},
+};
+
+static void cgroup_init()
+{
+    for (int i = 0; i < CGROUP_NR_SUBSYS; i++)
+    {
+        struct cgroup_subsys_state *css = cgroup_subsystems[i]->css_alloc(&cgroup_root);
+        CHECK(!IS_ERR(css));
+        if (css)
+            css->cgroup = &cgroup_root;
+        cgroup_root.subsys[i] = css;
+    }
+}
+
+INIT_LEVEL_EARLY_CORE_KERNEL_ENTRY(cgroup_init);
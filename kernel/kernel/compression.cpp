@@ -6,6 +6,7 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 #include <errno.h>
+#include <string.h>
 
 #include <onyx/compression.h>
 #include <onyx/vector.h>
@@ -58,6 +59,29 @@ expected<unique_ptr<decompression_stream>, int> create_decompression_stream(
     return unexpected<int>{-ENOTSUP};
 }
 
+expected<unique_ptr<context>, int> module::create_context(int level)
+{
+    return unexpected<int>{-ENOTSUP};
+}
+
+/**
+ * @brief Create a compression context for a given module
+ *
+ * @param name Name of the module (e.g "zstd")
+ * @param level Compression level (module-specific)
+ * @return The new context, or unexpected (-ENOENT if there's no such module)
+ */
+expected<unique_ptr<context>, int> create_context(const char *name, int level)
+{
+    for (auto mod : modules)
+    {
+        if (!strcmp(mod->name(), name))
+            return mod->create_context(level);
+    }
+
+    return unexpected<int>{-ENOENT};
+}
+
 bool decompress_bytestream::init(size_t len)
 {
     buf = vmalloc(vm_size_to_pages(len), VM_TYPE_REGULAR, VM_WRITE | VM_READ, GFP_KERNEL);
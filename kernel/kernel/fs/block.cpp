@@ -16,6 +16,7 @@
 #include <onyx/block.h>
 #include <onyx/block/blk_plug.h>
 #include <onyx/block/io-queue.h>
+#include <onyx/block/io-sched.h>
 #include <onyx/buffer.h>
 #include <onyx/filemap.h>
 #include <onyx/init.h>
@@ -30,6 +31,8 @@
 #include <uapi/fcntl.h>
 
 #define HDIO_GETGEO 0x0301
+#define BLKDISCARD  _IO(0x12, 119)
+#define BLKZEROOUT  _IO(0x12, 127)
 struct hd_geometry
 {
     unsigned char heads;
@@ -66,6 +69,20 @@ unsigned int blkdev_ioctl(int request, void *argp, struct file *f)
             return copy_to_user(argp, &d->sector_size, sizeof(unsigned int));
         }
 
+        case BLKDISCARD:
+        case BLKZEROOUT: {
+            u64 range[2];
+            if ((f->f_flags & O_ACCMODE) == O_RDONLY)
+                return -EBADF;
+            if (copy_from_user(range, argp, sizeof(range)) < 0)
+                return -EFAULT;
+            if (range[0] % d->sector_size || range[1] % d->sector_size)
+                return -EINVAL;
+            return bdev_discard(d, range[0] / d->sector_size, range[1] / d->sector_size,
+                                request == BLKDISCARD ? BIO_REQ_DISCARD_OP
+                                                      : BIO_REQ_WRITE_ZEROES_OP);
+        }
+
         default:
             return -EINVAL;
     }
@@ -135,6 +152,91 @@ __init static void bdev_setup_fs()
 
 extern struct file_ops buffer_ops;
 
+static struct sysfs_object block_sysfs_obj;
+
+static int blk_set_queue_sched(struct io_queue *queue, void *ctx)
+{
+    const struct io_scheduler *sched = (const struct io_scheduler *) ctx;
+    if (queue->get_scheduler() == sched)
+        return 0;
+    return queue->set_scheduler(sched);
+}
+
+/**
+ * @brief Set a block device's IO scheduler
+ * This switches every IO queue of the device. Note that a device might share queues with other
+ * devices (e.g NVMe namespaces).
+ *
+ * @param bdev Block device
+ * @param sched IO scheduler (nullptr for none)
+ * @return 0 on success, negative error codes
+ */
+int blk_set_scheduler(struct blockdev *bdev, const struct io_scheduler *sched)
+{
+    if (!bdev->mq_ops)
+        return -EOPNOTSUPP;
+    if (bdev->mq_ops->for_each_queue)
+        return bdev->mq_ops->for_each_queue(bdev, blk_set_queue_sched, (void *) sched);
+    return blk_set_queue_sched(bdev->mq_ops->pick_queue(bdev), (void *) sched);
+}
+
+static ssize_t blk_sched_show(struct sysfs_object *obj, void *buffer, size_t size, off_t off)
+{
+    struct blockdev *bdev = (struct blockdev *) obj->priv;
+    char buf[128];
+    size_t len = io_sched_print(bdev->mq_ops->pick_queue(bdev)->get_scheduler(), buf, sizeof(buf));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+static ssize_t blk_sched_store(struct sysfs_object *obj, void *buffer, size_t size, off_t off)
+{
+    struct blockdev *bdev = (struct blockdev *) obj->priv;
+    const struct io_scheduler *sched;
+    char buf[32];
+
+    if (off != 0 || size >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+
+    buf[size] = '\0';
+    if (size > 0 && buf[size - 1] == '\n')
+        buf[size - 1] = '\0';
+
+    int st = io_sched_find(buf, &sched);
+    if (st < 0)
+        return st;
+
+    st = blk_set_scheduler(bdev, sched);
+    return st < 0 ? st : (ssize_t) size;
+}
+
+static void blkdev_sysfs_add(struct blockdev *blk)
+{
+    if (sysfs_object_init(blk->name.c_str(), &blk->bdev_sysfs) < 0)
+        return;
+    blk->bdev_sysfs.perms = 0755 | S_IFDIR;
+
+    if (blk->mq_ops &&
+        sysfs_init_and_add("scheduler", &blk->bdev_sched_sysfs, &blk->bdev_sysfs) == 0)
+    {
+        blk->bdev_sched_sysfs.priv = blk;
+        blk->bdev_sched_sysfs.show = blk_sched_show;
+        blk->bdev_sched_sysfs.store = blk_sched_store;
+        blk->bdev_sched_sysfs.perms = 0644 | S_IFREG;
+    }
+
+    sysfs_add(&blk->bdev_sysfs, &block_sysfs_obj);
+}
+
+static void block_sysfs_init()
+{
+    CHECK(sysfs_init_and_add("block", &block_sysfs_obj, nullptr) == 0);
+    block_sysfs_obj.perms = 0755 | S_IFDIR;
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(block_sysfs_init);
+
 int blkdev_init(struct blockdev *blk)
 {
     blk->block_size = blk->sector_size;
@@ -169,6 +271,15 @@ int blkdev_init(struct blockdev *blk)
     ino->b_inode.i_helper = (void *) blk;
     blk->b_ino = (struct inode *) ino.release();
 
+    if (!blkdev_is_partition(blk))
+    {
+        /* Single-queue devices (AHCI, IDE) get mq-deadline by default, so deep writeback queues
+         * don't starve reads. Multiqueue devices are fast enough to go without. */
+        if (blk->mq_ops && !blk->mq_ops->for_each_queue)
+            blk_set_scheduler(blk, &mq_deadline_sched);
+        blkdev_sysfs_add(blk);
+    }
+
     mutex_lock(&blk->bdev_lock);
     if (!blkdev_is_partition(blk))
         partition_setup_disk(blk);
@@ -199,6 +310,8 @@ int bio_submit_request(struct blockdev *dev, struct bio_req *req)
         return -EIO;
     else if (unlikely(result == BIO_NEEDS_BOUNCE))
     {
+        /* The submitter would be polling for the original bio, not the bounce. Just sleep. */
+        req->flags &= ~BIO_REQ_POLLED;
         req = bio_bounce(req, GFP_NOIO);
         if (!req)
             return NULL;
@@ -233,19 +346,81 @@ int bio_submit_req_wait(struct blockdev *dev, struct bio_req *req)
     if (st < 0)
         return st;
 
-    wait_for(
-        &flags,
-        [](void *pflags) -> bool {
-            u32 fl = *(u32 *) pflags;
-            return fl & BIO_REQ_DONE;
-        },
-        WAIT_FOR_FOREVER, 0);
+    if (req->b_poll_queue)
+    {
+        /* Polled IO: spin on the queue until our completion shows up. Completions get run in
+         * softirq context, which happens as soon as poll() drops its lock. */
+        while (!(READ_ONCE(flags) & BIO_REQ_DONE))
+        {
+            if (!req->b_poll_queue->poll())
+                cpu_relax();
+            if (sched_needs_resched(get_current_thread()))
+                sched_yield();
+        }
+    }
+    else
+        wait_for(
+            &flags,
+            [](void *pflags) -> bool {
+                u32 fl = *(u32 *) pflags;
+                return fl & BIO_REQ_DONE;
+            },
+            WAIT_FOR_FOREVER, 0);
 
     if (flags & (BIO_REQ_EIO | BIO_REQ_NOT_SUPP))
         return -EIO;
     return 0;
 }
 
+/**
+ * @brief Discard or zero out a range of sectors
+ *
+ * @param bdev Block device
+ * @param sector First sector
+ * @param nr_sectors Number of sectors
+ * @param op BIO_REQ_DISCARD_OP or BIO_REQ_WRITE_ZEROES_OP
+ * @return 0 on success, negative error codes
+ */
+int bdev_discard(struct blockdev *bdev, sector_t sector, sector_t nr_sectors, u8 op)
+{
+    const struct queue_properties *qp = &bdev->bdev_queue_properties;
+    sector_t max_sectors =
+        op == BIO_REQ_DISCARD_OP ? qp->max_discard_sectors : qp->max_write_zeroes_sectors;
+
+    if (!max_sectors)
+        return -EOPNOTSUPP;
+    if (sector + nr_sectors < sector || sector + nr_sectors > bdev->nr_sectors)
+        return -EINVAL;
+
+    /* Get rid of whatever we have cached for this range, so it's not written back on top of it or
+     * read back later. */
+    if (int st = inode_truncate_range(bdev->b_ino, sector * bdev->sector_size,
+                                      (sector + nr_sectors) * bdev->sector_size);
+        st < 0)
+        return st;
+
+    while (nr_sectors > 0)
+    {
+        sector_t len = cul::min(nr_sectors, max_sectors);
+        struct bio_req *bio = bio_alloc(GFP_NOIO, 0);
+        if (!bio)
+            return -ENOMEM;
+
+        bio->flags = op;
+        bio->sector_number = sector;
+        bio->b_nr_sectors = len;
+        int st = bio_submit_req_wait(bdev, bio);
+        bio_put(bio);
+        if (st < 0)
+            return st;
+
+        sector += len;
+        nr_sectors -= len;
+    }
+
+    return 0;
+}
+
 atomic<unsigned int> next_scsi_dev_num = 0;
 /**
  * @brief Create a SCSI-like(sdX) block device
@@ -333,7 +508,7 @@ __init static void bio_cache_init()
 
 static struct slab_cache *bio_pick_cache(size_t nr_vecs)
 {
-    DCHECK(nr_vecs != 0);
+    /* Note: Data-less bios (nr_vecs = 0) also get the smallest cache */
     if (nr_vecs < 2)
         return bio_cache_inline[0];
     size_t order = ilog2(nr_vecs - 1) + 1;
@@ -30,16 +30,95 @@ int io_queue::submit_request(struct request *req)
     scoped_lock<spinlock, true> g{lock_};
     req->r_queue = this;
 
+    if (sched_)
+    {
+        /* Let the scheduler pick what goes out first */
+        queue_request(req);
+        if (used_entries_ < nr_entries_)
+            __restart_queue();
+        return 0;
+    }
+
     if (used_entries_ < nr_entries_ && list_is_empty(&req_list_))
     {
         used_entries_++;
-        return device_io_submit(req);
+        int st = device_io_submit(req);
+        if (st == -EAGAIN)
+        {
+            /* The device ran out of resources. Queue it up, it'll get restarted when something
+             * completes. */
+            used_entries_--;
+            list_add_tail(&req->r_queue_list_node, &req_list_);
+            st = 0;
+        }
+
+        return st;
     }
 
     list_add_tail(&req->r_queue_list_node, &req_list_);
     return 0;
 }
 
+/**
+ * @brief Queue a request, for later dispatch.
+ * The lock must be held.
+ *
+ * @param req Request to queue
+ */
+void io_queue::queue_request(struct request *req)
+{
+    if (sched_)
+        sched_->insert_request(sched_data_, req);
+    else
+        list_add_tail(&req->r_queue_list_node, &req_list_);
+}
+
+/**
+ * @brief Dequeue the next request to dispatch.
+ * The lock must be held.
+ *
+ * @return The next request, or nullptr if there are none
+ */
+struct request *io_queue::dequeue_request()
+{
+    if (sched_)
+        return sched_->dispatch_request(sched_data_);
+
+    if (list_is_empty(&req_list_))
+        return nullptr;
+
+    struct request *req = list_head_to_request(list_first_element(&req_list_));
+    list_remove(&req->r_queue_list_node);
+    return req;
+}
+
+/**
+ * @brief Put back a request that could not be dispatched.
+ * The lock must be held.
+ *
+ * @param req Request to requeue
+ */
+void io_queue::requeue_request(struct request *req)
+{
+    if (sched_)
+        sched_->requeue_request(sched_data_, req);
+    else
+        list_add(&req->r_queue_list_node, &req_list_);
+}
+
+/**
+ * @brief Check if we have queued requests.
+ * The lock must be held.
+ *
+ * @return True if there are requests to dispatch, else false
+ */
+bool io_queue::has_queued_requests()
+{
+    if (sched_)
+        return sched_->has_work(sched_data_);
+    return !list_is_empty(&req_list_);
+}
+
 /**
  * @brief Set an io_queue as holding pending completed requests.
  * This queues it in a percpu queue and raises a softirq, if needed.
@@ -87,19 +166,17 @@ void io_queue::__restart_queue()
 
     for (u32 i = 0; i < free_entries; i++)
     {
-        if (list_is_empty(&req_list_))
+        struct request *req = dequeue_request();
+        if (!req)
             break;
 
-        struct request *req =
-            container_of(list_first_element(&req_list_), request, r_queue_list_node);
-        list_remove(&req->r_queue_list_node);
         used_entries_++;
         int st = device_io_submit(req);
         if (st < 0)
         {
             DCHECK(st == -EAGAIN);
             /* TODO: Try again later? Is this even a good idea? */
-            list_add(&req->r_queue_list_node, &req_list_);
+            requeue_request(req);
             used_entries_--;
             return;
         }
@@ -115,7 +192,82 @@ void io_queue::__restart_queue()
 void io_queue::submit_batch(struct list_head *req_list, u32 nr_reqs)
 {
     scoped_lock<spinlock, true> g{lock_};
-    list_splice_tail(req_list, &req_list_);
+    if (sched_)
+    {
+        list_for_every_safe (req_list)
+        {
+            struct request *req = list_head_to_request(l);
+            list_remove(&req->r_queue_list_node);
+            queue_request(req);
+        }
+    }
+    else
+        list_splice_tail(req_list, &req_list_);
+
     if (nr_entries_ - used_entries_ > 0)
         __restart_queue();
 }
+
+/**
+ * @brief Try to merge a bio into a queued request
+ *
+ * @param bio Bio to merge
+ * @return True if merged, else false
+ */
+bool io_queue::try_merge_bio(struct bio_req *bio)
+{
+    /* Unlocked peek, we don't want to contend on the lock if there's no scheduler */
+    if (!READ_ONCE(sched_))
+        return false;
+
+    scoped_lock<spinlock, true> g{lock_};
+    if (!sched_ || !sched_->merge_bio)
+        return false;
+    return sched_->merge_bio(sched_data_, bio);
+}
+
+/**
+ * @brief Set the queue's IO scheduler
+ * Requests already queued are moved over to the new scheduler.
+ *
+ * @param sched New scheduler (nullptr for none)
+ * @return 0 on success, negative error codes
+ */
+int io_queue::set_scheduler(const struct io_scheduler *sched)
+{
+    void *data = nullptr;
+    if (sched)
+    {
+        data = sched->init_queue(this);
+        if (!data)
+            return -ENOMEM;
+    }
+
+    const struct io_scheduler *old;
+    void *old_data;
+    DEFINE_LIST(queued);
+
+    {
+        scoped_lock<spinlock, true> g{lock_};
+        /* Drain the old scheduler and feed everything into the new one */
+        struct request *req;
+        while ((req = dequeue_request()))
+            list_add_tail(&req->r_queue_list_node, &queued);
+
+        old = sched_;
+        old_data = sched_data_;
+        sched_ = sched;
+        sched_data_ = data;
+
+        list_for_every_safe (&queued)
+        {
+            req = list_head_to_request(l);
+            list_remove(&req->r_queue_list_node);
+            queue_request(req);
+        }
+    }
+
+    if (old)
+        old->exit_queue(old_data);
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/block/io-queue.h>
+#include <onyx/block/io-sched.h>
+#include <onyx/block/request.h>
+#include <onyx/clock.h>
+#include <onyx/mm/slab.h>
+
+/* mq-deadline: requests are kept in two sector-sorted trees and two FIFOs (one of each per
+ * direction). We dispatch in sector order, in batches of fifo_batch requests, unless the head of a
+ * FIFO has expired. Reads are preferred over writes, but writes can only be passed over
+ * writes_starved times in a row. Anything that's not a read or a write goes to a dispatch list
+ * that is served before everything else.
+ */
+
+#define DD_READ  0
+#define DD_WRITE 1
+
+/* In ns */
+#define DD_READ_EXPIRE    (500 * NS_PER_MS)
+#define DD_WRITE_EXPIRE   (5000 * NS_PER_MS)
+#define DD_FIFO_BATCH     16
+#define DD_WRITES_STARVED 2
+
+struct deadline_data
+{
+    struct bst_root sort[2];
+    struct list_head fifo[2];
+    struct list_head dispatch;
+    /* Next request in sector order, for the current batch */
+    struct request *next_rq[2];
+    unsigned int batching;
+    unsigned int starved;
+    unsigned int nr_queued;
+};
+
+static int dd_dir(struct request *req)
+{
+    switch (req->r_flags & BIO_REQ_OP_MASK)
+    {
+        case BIO_REQ_READ_OP:
+            return DD_READ;
+        case BIO_REQ_WRITE_OP:
+            return DD_WRITE;
+        default:
+            return -1;
+    }
+}
+
+static int dd_compare(struct bst_node *lhs_, struct bst_node *rhs_)
+{
+    struct request *lhs = container_of(lhs_, struct request, r_sort_node);
+    struct request *rhs = container_of(rhs_, struct request, r_sort_node);
+
+    if (lhs->r_sector != rhs->r_sector)
+        return lhs->r_sector < rhs->r_sector ? 1 : -1;
+    /* Sort requests for the same sector by address, since the tree does not take duplicates */
+    if (lhs == rhs)
+        return 0;
+    return (unsigned long) lhs < (unsigned long) rhs ? 1 : -1;
+}
+
+static void *dd_init_queue(struct io_queue *queue)
+{
+    struct deadline_data *dd = (struct deadline_data *) kmalloc(sizeof(*dd), GFP_KERNEL);
+    if (!dd)
+        return nullptr;
+
+    for (int i = 0; i < 2; i++)
+    {
+        bst_root_initialize(&dd->sort[i]);
+        INIT_LIST_HEAD(&dd->fifo[i]);
+        dd->next_rq[i] = nullptr;
+    }
+
+    INIT_LIST_HEAD(&dd->dispatch);
+    dd->batching = 0;
+    dd->starved = 0;
+    dd->nr_queued = 0;
+    return dd;
+}
+
+static void dd_exit_queue(void *data)
+{
+    struct deadline_data *dd = (struct deadline_data *) data;
+    DCHECK(dd->nr_queued == 0);
+    kfree(dd);
+}
+
+static void dd_remove_request(struct deadline_data *dd, struct request *req, int dir)
+{
+    if (dd->next_rq[dir] == req)
+        dd->next_rq[dir] = bst_next_type(&dd->sort[dir], &req->r_sort_node, struct request,
+                                         r_sort_node);
+    bst_delete(&dd->sort[dir], &req->r_sort_node);
+    bst_node_initialize(&req->r_sort_node);
+    list_remove(&req->r_queue_list_node);
+    dd->nr_queued--;
+}
+
+static void dd_insert_request(void *data, struct request *req)
+{
+    struct deadline_data *dd = (struct deadline_data *) data;
+    int dir = dd_dir(req);
+
+    dd->nr_queued++;
+
+    if (dir < 0)
+    {
+        /* Not something we can sort. Send it out ASAP */
+        list_add_tail(&req->r_queue_list_node, &dd->dispatch);
+        return;
+    }
+
+    req->r_deadline =
+        clocksource_get_time() + (dir == DD_READ ? DD_READ_EXPIRE : DD_WRITE_EXPIRE);
+    bst_node_initialize(&req->r_sort_node);
+    CHECK(bst_insert(&dd->sort[dir], &req->r_sort_node, dd_compare));
+    list_add_tail(&req->r_queue_list_node, &dd->fifo[dir]);
+}
+
+static void dd_requeue_request(void *data, struct request *req)
+{
+    struct deadline_data *dd = (struct deadline_data *) data;
+    /* The device already had it in its hands, so don't make it wait again */
+    list_add(&req->r_queue_list_node, &dd->dispatch);
+    dd->nr_queued++;
+}
+
+static bool dd_merge_bio(void *data, struct bio_req *bio)
+{
+    struct deadline_data *dd = (struct deadline_data *) data;
+    int dir;
+
+    switch (bio->flags & BIO_REQ_OP_MASK)
+    {
+        case BIO_REQ_READ_OP:
+            dir = DD_READ;
+            break;
+        case BIO_REQ_WRITE_OP:
+            dir = DD_WRITE;
+            break;
+        default:
+            return false;
+    }
+
+    /* Look for a back-merge candidate: the request with the largest start sector <= the bio's.
+     * Back merges don't change the request's start sector, so the tree stays sorted. */
+    struct bst_node *node = dd->sort[dir].root;
+    struct request *candidate = nullptr;
+    while (node)
+    {
+        struct request *req = container_of(node, struct request, r_sort_node);
+        if (req->r_sector <= bio->sector_number)
+        {
+            candidate = req;
+            node = node->child[1];
+        }
+        else
+            node = node->child[0];
+    }
+
+    if (!candidate || candidate->r_sector + candidate->r_nsectors != bio->sector_number)
+        return false;
+    return block_try_merge(candidate, bio);
+}
+
+static struct request *dd_fifo_head(struct deadline_data *dd, int dir)
+{
+    if (list_is_empty(&dd->fifo[dir]))
+        return nullptr;
+    return list_head_to_request(list_first_element(&dd->fifo[dir]));
+}
+
+static bool dd_fifo_expired(struct deadline_data *dd, int dir)
+{
+    struct request *req = dd_fifo_head(dd, dir);
+    return req && req->r_deadline <= clocksource_get_time();
+}
+
+static struct request *dd_dispatch_request(void *data)
+{
+    struct deadline_data *dd = (struct deadline_data *) data;
+    struct request *req;
+    int dir;
+
+    if (!list_is_empty(&dd->dispatch))
+    {
+        req = list_head_to_request(list_first_element(&dd->dispatch));
+        list_remove(&req->r_queue_list_node);
+        dd->nr_queued--;
+        return req;
+    }
+
+    /* Keep going with the current batch, if we can */
+    req = dd->next_rq[DD_READ] ? dd->next_rq[DD_READ] : dd->next_rq[DD_WRITE];
+    if (req && dd->batching < DD_FIFO_BATCH)
+        goto dispatch;
+
+    {
+        bool reads = !list_is_empty(&dd->fifo[DD_READ]);
+        bool writes = !list_is_empty(&dd->fifo[DD_WRITE]);
+
+        if (reads)
+        {
+            if (writes && dd->starved++ >= DD_WRITES_STARVED)
+                dir = DD_WRITE;
+            else
+                dir = DD_READ;
+        }
+        else if (writes)
+            dir = DD_WRITE;
+        else
+            return nullptr;
+
+        if (dir == DD_WRITE)
+            dd->starved = 0;
+
+        /* If the oldest request expired (or we have nothing sorted to continue from), go back to
+         * the FIFO's head. Else, keep sweeping forward. */
+        if (dd_fifo_expired(dd, dir) || !dd->next_rq[dir])
+            req = dd_fifo_head(dd, dir);
+        else
+            req = dd->next_rq[dir];
+        dd->batching = 0;
+    }
+
+dispatch:
+    dir = dd_dir(req);
+    /* We only track one batch at a time */
+    dd->next_rq[dir ^ 1] = nullptr;
+    /* dd_remove_request moves next_rq along to the next request in sector order */
+    dd->next_rq[dir] = req;
+    dd_remove_request(dd, req, dir);
+    dd->batching++;
+    return req;
+}
+
+static bool dd_has_work(void *data)
+{
+    struct deadline_data *dd = (struct deadline_data *) data;
+    return dd->nr_queued > 0;
+}
+
+const struct io_scheduler mq_deadline_sched = {
+    .name = "mq-deadline",
+    .init_queue = dd_init_queue,
+    .exit_queue = dd_exit_queue,
+    .merge_bio = dd_merge_bio,
+    .insert_request = dd_insert_request,
+    .requeue_request = dd_requeue_request,
+    .dispatch_request = dd_dispatch_request,
+    .has_work = dd_has_work,
+};
+
+static const struct io_scheduler *const io_schedulers[] = {
+    &mq_deadline_sched,
+};
+
+/**
+ * @brief Find an IO scheduler by name
+ *
+ * @param name Name of the scheduler
+ * @param sched Pointer to the result (NULL for "none")
+ * @return 0 on success, -EINVAL if it does not exist
+ */
+int io_sched_find(const char *name, const struct io_scheduler **sched)
+{
+    if (!strcmp(name, "none"))
+    {
+        *sched = nullptr;
+        return 0;
+    }
+
+    for (const struct io_scheduler *s : io_schedulers)
+    {
+        if (!strcmp(name, s->name))
+        {
+            *sched = s;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+/**
+ * @brief Print the list of available schedulers to buf, with the current one between brackets
+ * (e.g "none [mq-deadline]\n")
+ *
+ * @param current Current scheduler
+ * @param buf Buffer
+ * @param len Length of the buffer
+ * @return Number of characters written
+ */
+size_t io_sched_print(const struct io_scheduler *current, char *buf, size_t len)
+{
+    size_t off = 0;
+    int st = snprintf(buf, len, current ? "none" : "[none]");
+
+    for (const struct io_scheduler *s : io_schedulers)
+    {
+        off += st;
+        if (off >= len)
+            return len - 1;
+        st = snprintf(buf + off, len - off, s == current ? " [%s]" : " %s", s->name);
+    }
+
+    off += st;
+    if (off >= len)
+        return len - 1;
+    st = snprintf(buf + off, len - off, "\n");
+    off += st;
+    return off >= len ? len - 1 : off;
+}
+
+#ifdef CONFIG_KUNIT
+#include <onyx/kunit.h>
+
+static void dd_test_init_request(struct request *req, u32 op, sector_t sector)
+{
+    bio_request_init(req);
+    req->r_flags = op;
+    req->r_sector = sector;
+    req->r_nsectors = 8;
+}
+
+TEST(mq_deadline, reads_go_first)
+{
+    struct request reqs[3];
+    void *dd = dd_init_queue(nullptr);
+    ASSERT_NONNULL(dd);
+
+    dd_test_init_request(&reqs[0], BIO_REQ_WRITE_OP, 100);
+    dd_test_init_request(&reqs[1], BIO_REQ_WRITE_OP, 200);
+    dd_test_init_request(&reqs[2], BIO_REQ_READ_OP, 300);
+
+    for (auto &req : reqs)
+        dd_insert_request(dd, &req);
+
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[2]);
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[0]);
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[1]);
+    EXPECT_NULL(dd_dispatch_request(dd));
+    EXPECT_FALSE(dd_has_work(dd));
+    dd_exit_queue(dd);
+}
+
+TEST(mq_deadline, sorted_dispatch)
+{
+    struct request reqs[4];
+    void *dd = dd_init_queue(nullptr);
+    ASSERT_NONNULL(dd);
+
+    dd_test_init_request(&reqs[0], BIO_REQ_READ_OP, 10);
+    dd_test_init_request(&reqs[1], BIO_REQ_READ_OP, 40);
+    dd_test_init_request(&reqs[2], BIO_REQ_READ_OP, 20);
+    dd_test_init_request(&reqs[3], BIO_REQ_READ_OP, 30);
+
+    for (auto &req : reqs)
+        dd_insert_request(dd, &req);
+
+    /* The first one comes from the FIFO, then we sweep forward in sector order */
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[0]);
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[2]);
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[3]);
+    EXPECT_EQ(dd_dispatch_request(dd), &reqs[1]);
+    EXPECT_NULL(dd_dispatch_request(dd));
+    dd_exit_queue(dd);
+}
+
+#endif
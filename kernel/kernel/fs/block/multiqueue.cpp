@@ -11,6 +11,26 @@
 #include <onyx/block/request.h>
 
 int plug_merges = 0;
+int sched_merges = 0;
+
+static int blk_mq_submit_polled(struct io_queue *ioq, struct bio_req *bio)
+{
+    struct request *req = bio_req_to_request(bio);
+    if (!req)
+        return -ENOMEM;
+
+    /* Set up before submitting, since the bio may complete (and be polled for) right away */
+    bio_get(bio);
+    bio->b_poll_queue = ioq;
+    int st = ioq->submit_request(req);
+    if (st < 0)
+    {
+        bio->b_poll_queue = nullptr;
+        bio_put(bio);
+    }
+
+    return st;
+}
 
 int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio)
 {
@@ -23,6 +43,17 @@ int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio)
 
     DCHECK(dev->mq_ops && dev->mq_ops->pick_queue);
 
+    if (bio->flags & BIO_REQ_POLLED)
+    {
+        /* Polled IO skips the plug, since the submitter is about to spin on this bio */
+        struct io_queue *ioq =
+            dev->mq_ops->pick_poll_queue ? dev->mq_ops->pick_poll_queue(dev) : nullptr;
+        if (ioq)
+            return blk_mq_submit_polled(ioq, bio);
+        /* No polled queues, fall back to regular IRQ-driven IO */
+        bio->flags &= ~BIO_REQ_POLLED;
+    }
+
     struct blk_plug *plug = blk_get_current_plug();
     if (plug)
     {
@@ -38,6 +69,14 @@ int blk_mq_submit_request(struct blockdev *dev, struct bio_req *bio)
     struct io_queue *ioq = dev->mq_ops->pick_queue(dev);
     DCHECK(ioq != nullptr);
 
+    /* Try to merge with a request the IO scheduler is holding on to */
+    if (ioq->try_merge_bio(bio))
+    {
+        sched_merges++;
+        bio_get(bio);
+        return 0;
+    }
+
     struct request *req = bio_req_to_request(bio);
     if (!req)
         return -ENOMEM;
@@ -76,7 +76,7 @@ struct request *bio_req_to_request(struct bio_req *bio)
         for (size_t i = 0; i < bio->nr_vecs; i++)
             len += bio->vec[i].length;
 
-        req->r_nsectors = len / 512;
+        req->r_nsectors = bio->nr_vecs ? len / 512 : bio->b_nr_sectors;
     }
 
     return req;
@@ -157,7 +157,7 @@ static int block_do_merge(struct request *req, struct bio_req *bio, size_t bio_s
         /* back merge: check for the tail of the old tail bio, and the head of the
          * new bio. */
         old = request_get_tail(req);
-        struct page_iov *v = &old->vec[bio->nr_vecs - 1];
+        struct page_iov *v = &old->vec[old->nr_vecs - 1];
         u64 address = (u64) (page_to_phys(v->page)) + v->page_off + v->length;
         if (address & qp->inter_sgl_boundary_mask)
             return -EIO;
@@ -225,6 +225,10 @@ static bool block_may_merge(struct request *req, struct bio_req *bio, size_t bio
 
     if ((req->r_flags & BIO_REQ_OP_MASK) != (bio->flags & BIO_REQ_OP_MASK))
         return false;
+    /* Only merge requests that carry data */
+    if ((bio->flags & BIO_REQ_OP_MASK) != BIO_REQ_READ_OP &&
+        (bio->flags & BIO_REQ_OP_MASK) != BIO_REQ_WRITE_OP)
+        return false;
     return true;
 }
 
@@ -239,6 +243,19 @@ static size_t bio_calc_size(struct bio_req *bio)
     return len;
 }
 
+/**
+ * @brief Try to merge a bio into a request that has not been submitted yet
+ *
+ * @param req Request to merge into
+ * @param bio Bio to merge
+ * @return True if merged, else false
+ */
+bool block_try_merge(struct request *req, struct bio_req *bio)
+{
+    size_t bio_size = bio_calc_size(bio);
+    return block_may_merge(req, bio, bio_size) && !block_attempt_merge(req, bio, bio_size);
+}
+
 /**
  * @brief Attempt to merge a bio with a plug
  *
@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/cgroup.h>
+#include <onyx/clock.h>
+#include <onyx/dentry.h>
+#include <onyx/dev.h>
+#include <onyx/err.h>
+#include <onyx/file.h>
+#include <onyx/fs_mount.h>
+#include <onyx/libfs.h>
+#include <onyx/mm/slab.h>
+#include <onyx/panic.h>
+#include <onyx/superblock.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+
+#include <onyx/memory.hpp>
+
+/**
+ * cgroupfs (cgroup2) exposes the cgroup hierarchy. Directories are cgroups, and each one has the
+ * core cgroup.* files plus every controller's files. mkdir creates a cgroup, rmdir removes it.
+ * The hierarchy lives in cgroup.cpp; we create inodes on lookup. Directory dentries are pinned
+ * (like in tmpfs), so a directory's inode only goes away when the cgroup gets removed. Control
+ * file inodes have no links, and die with their dentry. Both hold a reference to their cgroup.
+ */
+
+struct cgroupfs_node
+{
+    struct cgroup *cg;
+    /* nullptr for directories */
+    const struct cgroup_file *cft;
+};
+
+extern struct file_ops cgroupfs_ops;
+
+/* Bits of the inode number reserved for the control file's index */
+#define CGROUPFS_INO_FILE_BITS 8
+
+/**
+ * @brief Get a cgroup's nth control file
+ *
+ * @param cg cgroup
+ * @param n Index of the file
+ * @return The control file, or nullptr
+ */
+static const struct cgroup_file *cgroupfs_nth_file(struct cgroup *cg, unsigned long n)
+{
+    const struct cgroup_file *files;
+    bool root = cg == &cgroup_root;
+
+    for (int i = -1; i < CGROUP_NR_SUBSYS; i++)
+    {
+        files = i < 0 ? cgroup_core_files : cgroup_subsystems[i]->files;
+        for (; files && files->name; files++)
+        {
+            if (root && files->flags & CGROUP_FILE_NOT_ON_ROOT)
+                continue;
+            if (n-- == 0)
+                return files;
+        }
+    }
+
+    return nullptr;
+}
+
+static const struct cgroup_file *cgroupfs_find_file(struct cgroup *cg, const char *name,
+                                                    unsigned long *index)
+{
+    const struct cgroup_file *cft;
+
+    for (unsigned long i = 0; (cft = cgroupfs_nth_file(cg, i)); i++)
+    {
+        if (!strcmp(cft->name, name))
+        {
+            *index = i;
+            return cft;
+        }
+    }
+
+    return nullptr;
+}
+
+static nlink_t cgroupfs_dir_nlink(struct cgroup *cg)
+{
+    nlink_t nlink = 2;
+    struct cgroup *child;
+
+    while ((child = cgroup_nth_child(cg, nlink - 2)))
+    {
+        cgroup_put(child);
+        nlink++;
+    }
+
+    return nlink;
+}
+
+/**
+ * @brief Create an inode for a cgroup directory or control file
+ * Consumes the caller's reference to cg on success.
+ *
+ * @param sb Superblock
+ * @param cg cgroup
+ * @param cft Control file, or nullptr for the directory itself
+ * @param index Index of the control file
+ * @return The new inode, or nullptr
+ */
+static struct inode *cgroupfs_create_inode(struct superblock *sb, struct cgroup *cg,
+                                           const struct cgroup_file *cft, unsigned long index)
+{
+    struct cgroupfs_node *node = (struct cgroupfs_node *) kmalloc(sizeof(*node), GFP_KERNEL);
+    if (!node)
+        return nullptr;
+
+    struct inode *inode = inode_create(false);
+    if (!inode)
+    {
+        kfree(node);
+        return nullptr;
+    }
+
+    node->cg = cg;
+    node->cft = cft;
+
+    inode->i_atime = inode->i_mtime = inode->i_ctime = clock_get_posix_time();
+    inode->i_inode = (cg->id << CGROUPFS_INO_FILE_BITS) | (cft ? index + 1 : 0);
+    inode->i_dev = sb->s_devnr;
+    inode->i_sb = sb;
+    inode->i_fops = &cgroupfs_ops;
+    inode->i_helper = node;
+    inode->i_flags = INODE_FLAG_DONT_CACHE;
+    inode->i_mode = cft ? (cft->mode | S_IFREG) : (0755 | S_IFDIR);
+    inode->i_nlink = cft ? 0 : cgroupfs_dir_nlink(cg);
+    return inode;
+}
+
+static struct cgroupfs_node *cgroupfs_node(struct inode *inode)
+{
+    return (struct cgroupfs_node *) inode->i_helper;
+}
+
+static int cgroupfs_open(struct dentry *dir, const char *name, struct dentry *dentry)
+{
+    struct cgroup *cg = cgroupfs_node(dir->d_inode)->cg;
+    const struct cgroup_file *cft;
+    struct cgroup *child = nullptr;
+    unsigned long index = 0;
+    struct inode *inode;
+
+    cft = cgroupfs_find_file(cg, name, &index);
+    if (!cft)
+    {
+        child = cgroup_lookup_child(cg, name);
+        if (!child)
+            return -ENOENT;
+    }
+    else
+        cgroup_get(cg);
+
+    inode = cgroupfs_create_inode(dir->d_inode->i_sb, child ?: cg, cft, index);
+    if (!inode)
+    {
+        cgroup_put(child ?: cg);
+        return -ENOMEM;
+    }
+
+    d_finish_lookup(dentry, inode);
+    /* Pin directories, see the comment at the top */
+    if (child)
+        dget(dentry);
+    return 0;
+}
+
+static void cgroupfs_fill_dirent(struct dirent *buf, const char *name, ino_t ino,
+                                 unsigned char type)
+{
+    size_t len = strlen(name);
+    buf->d_ino = ino;
+    memcpy(buf->d_name, name, len);
+    buf->d_name[len] = '\0';
+    buf->d_reclen = sizeof(struct dirent) - (256 - (len + 1));
+    buf->d_type = type;
+}
+
+static off_t cgroupfs_getdirent(struct dirent *buf, off_t off, struct file *file)
+{
+    struct dentry *dent = file->f_dentry;
+    struct cgroup *cg = cgroupfs_node(file->f_ino)->cg;
+    const struct cgroup_file *cft;
+    unsigned long nr_files;
+
+    buf->d_off = off;
+
+    if (off == 0)
+    {
+        put_dentry_to_dirent(buf, dent, ".");
+        return off + 1;
+    }
+
+    if (off == 1)
+    {
+        auto parent = dentry_parent(dent);
+        put_dentry_to_dirent(buf, parent, "..");
+        dput(parent);
+        return off + 1;
+    }
+
+    for (nr_files = 0; (cft = cgroupfs_nth_file(cg, nr_files)); nr_files++)
+    {
+        if ((unsigned long) off - 2 == nr_files)
+        {
+            cgroupfs_fill_dirent(buf, cft->name,
+                                 (cg->id << CGROUPFS_INO_FILE_BITS) | (nr_files + 1), DT_REG);
+            return off + 1;
+        }
+    }
+
+    struct cgroup *child = cgroup_nth_child(cg, off - 2 - nr_files);
+    if (!child)
+        return 0;
+
+    cgroupfs_fill_dirent(buf, child->name, child->id << CGROUPFS_INO_FILE_BITS, DT_DIR);
+    cgroup_put(child);
+    return off + 1;
+}
+
+static struct inode *cgroupfs_mkdir(struct dentry *dentry, mode_t mode, struct dentry *dir)
+{
+    struct cgroup *cg = cgroup_create(cgroupfs_node(dir->d_inode)->cg, dentry->d_name);
+    struct inode *inode;
+
+    if (IS_ERR(cg))
+    {
+        errno = -PTR_ERR(cg);
+        return nullptr;
+    }
+
+    /* The hierarchy's reference is dropped on rmdir, get one for the inode */
+    cgroup_get(cg);
+    inode = cgroupfs_create_inode(dir->d_inode->i_sb, cg, nullptr, 0);
+    if (!inode)
+    {
+        cgroup_put(cg);
+        cgroup_destroy(cg);
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    inode_inc_nlink(dir->d_inode);
+    dget(dentry);
+    return inode;
+}
+
+static int cgroupfs_unlink(const char *name, int flags, struct dentry *dir)
+{
+    struct cgroup *cg = cgroupfs_node(dir->d_inode)->cg;
+    unsigned long index;
+    int st;
+
+    if (cgroupfs_find_file(cg, name, &index))
+        return -EPERM;
+    if (!(flags & AT_REMOVEDIR))
+        return -EISDIR;
+
+    struct cgroup *child = cgroup_lookup_child(cg, name);
+    if (!child)
+        return -ENOENT;
+
+    st = cgroup_destroy(child);
+    cgroup_put(child);
+    if (st < 0)
+        return st;
+
+    /* Unpin the directory. The VFS holds a reference to it while we're here. */
+    struct dentry *dentry = dentry_lookup_internal(name, dir, 0);
+    CHECK(dentry != nullptr);
+    dput(dentry);
+    dput(dentry);
+    return 0;
+}
+
+static size_t cgroupfs_read(size_t offset, size_t size, void *buffer, struct file *file)
+{
+    struct cgroupfs_node *node = cgroupfs_node(file->f_ino);
+    ssize_t len;
+    char *buf;
+
+    if (!node->cft || !node->cft->show)
+        return -EINVAL;
+
+    buf = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    len = node->cft->show(node->cg, buf, PAGE_SIZE);
+    if (len < 0)
+        goto out;
+
+    if (offset >= (size_t) len)
+    {
+        len = 0;
+        goto out;
+    }
+
+    if (size > len - offset)
+        size = len - offset;
+    len = copy_to_user(buffer, buf + offset, size) < 0 ? -EFAULT : (ssize_t) size;
+out:
+    kfree(buf);
+    return len;
+}
+
+static size_t cgroupfs_write(size_t offset, size_t size, void *buffer, struct file *file)
+{
+    struct cgroupfs_node *node = cgroupfs_node(file->f_ino);
+    size_t len = size;
+    char *buf;
+    int st;
+
+    if (!node->cft || !node->cft->write)
+        return -EINVAL;
+    if (size >= PAGE_SIZE)
+        return -E2BIG;
+
+    buf = (char *) kmalloc(size + 1, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    if (copy_from_user(buf, buffer, size) < 0)
+    {
+        kfree(buf);
+        return -EFAULT;
+    }
+
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' ' || buf[len - 1] == '\t'))
+        len--;
+    buf[len] = '\0';
+
+    st = node->cft->write(node->cg, buf, len);
+    kfree(buf);
+    return st < 0 ? st : size;
+}
+
+static void cgroupfs_close(struct inode *inode)
+{
+    struct cgroupfs_node *node = cgroupfs_node(inode);
+    cgroup_put(node->cg);
+    kfree(node);
+}
+
+struct file_ops cgroupfs_ops = {
+    .read = cgroupfs_read,
+    .write = cgroupfs_write,
+    .open = cgroupfs_open,
+    .close = cgroupfs_close,
+    .getdirent = cgroupfs_getdirent,
+    .creat = libfs_no_creat,
+    .link = libfs_no_link,
+    .symlink = libfs_no_symlink,
+    .ftruncate = libfs_no_ftruncate,
+    .mkdir = cgroupfs_mkdir,
+    .mknod = libfs_no_mknod,
+    .readlink = libfs_no_readlink,
+    .unlink = cgroupfs_unlink,
+    .fallocate = libfs_no_fallocate,
+};
+
+struct cgroup *cgroupfs_file_to_cgroup(struct file *f)
+{
+    struct inode *inode = f->f_ino;
+    if (inode->i_fops != &cgroupfs_ops || !S_ISDIR(inode->i_mode))
+        return nullptr;
+
+    struct cgroup *cg = cgroupfs_node(inode)->cg;
+    cgroup_get(cg);
+    return cg;
+}
+
+/**
+ * @brief Mount a cgroup2 instance
+ * Every instance shows the same (single) hierarchy.
+ *
+ * @param info Mount info
+ * @return The new superblock, or an ERR_PTR
+ */
+static struct superblock *cgroupfs_mount(struct vfs_mount_info *info)
+{
+    auto ex = dev_register_blockdevs(0, 1, 0, nullptr, "cgroup2");
+    if (ex.has_error())
+        return (struct superblock *) ERR_PTR(ex.error());
+
+    auto new_fs = make_unique<superblock>();
+    if (!new_fs)
+    {
+        dev_unregister_dev(ex.value(), true);
+        return (struct superblock *) ERR_PTR(-ENOMEM);
+    }
+
+    superblock_init(new_fs.get());
+    new_fs->s_devnr = ex.value()->dev();
+    new_fs->s_flags |= SB_FLAG_NODIRTY;
+
+    cgroup_get(&cgroup_root);
+    struct inode *root = cgroupfs_create_inode(new_fs.get(), &cgroup_root, nullptr, 0);
+    if (!root)
+    {
+        cgroup_put(&cgroup_root);
+        dev_unregister_dev(ex.value(), true);
+        return (struct superblock *) ERR_PTR(-ENOMEM);
+    }
+
+    d_positiveize(info->root_dir, root);
+    return new_fs.release();
+}
+
+__init static void cgroupfs_init()
+{
+    if (fs_mount_add(cgroupfs_mount, FS_MOUNT_PSEUDO_FS, "cgroup2") < 0)
+        panic("Could not register cgroup2");
+}
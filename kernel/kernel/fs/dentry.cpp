@@ -680,10 +680,13 @@ dentry *dentry_lookup_internal(std::string_view v, dentry *dir, dentry_lookup_fl
     return dent;
 }
 
+static unsigned long dentry_defrag(struct slab_cache *cache);
+
 void dentry_init()
 {
     dentry_cache = kmem_cache_create("dentry", sizeof(dentry), 0, KMEM_CACHE_HWALIGN, nullptr);
     CHECK(dentry_cache != nullptr);
+    kmem_cache_set_defrag(dentry_cache, dentry_defrag);
 }
 
 struct path_element
@@ -1310,6 +1313,53 @@ void dentry_unref_subtree(struct dentry *dentry)
         unref_list(&data);
 }
 
+/**
+ * @brief Evict the unused dentries that live in sparse slabs
+ * Slab defrag callback for the dentry cache.
+ *
+ * @param cache Dentry cache
+ * @return Number of dentries we tried to evict
+ */
+static unsigned long dentry_defrag(struct slab_cache *cache)
+{
+    struct shrink_data data;
+    unsigned long nr = 0;
+    INIT_LIST_HEAD(&data.shrink_list);
+
+    for (size_t i = 0; i < sizeof(dentry_ht_locks) / sizeof(dentry_ht_locks[0]); i++)
+    {
+        spin_lock(&dentry_ht_locks[i]);
+        list_for_every (dentry_ht.get_hashtable(i))
+        {
+            struct dentry *dentry = container_of(l, struct dentry, d_cache_node);
+            if (!kmem_defrag_candidate(dentry))
+                continue;
+
+            /* d_lock nests outside of the hashtable locks, so we can only trylock */
+            if (spin_try_lock(&dentry->d_lock))
+                continue;
+
+            if (d_refs(dentry) == 0 && !(dentry->d_flags & DENTRY_FLAG_SHRINK))
+            {
+                if (dentry->d_flags & DENTRY_FLAG_LRU)
+                    d_remove_lru(dentry);
+                list_add_tail(&dentry->d_lru, &data.shrink_list);
+                dentry->d_flags |= DENTRY_FLAG_SHRINK | DENTRY_FLAG_LRU;
+                nr++;
+            }
+
+            spin_unlock(&dentry->d_lock);
+        }
+
+        spin_unlock(&dentry_ht_locks[i]);
+    }
+
+    /* kill_one rechecks the refs with the refs frozen, so dentries that got referenced in the
+     * meanwhile survive. */
+    shrink_list(&data);
+    return nr;
+}
+
 enum lru_walk_ret scan_dcache_lru_one(struct lru_list *lru, struct list_head *object, void *data)
 {
     struct dentry *dentry = container_of(object, struct dentry, d_lru);
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/atomic.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/kunit.h>
+#include <onyx/poll.h>
+#include <onyx/spinlock.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/eventfd.h>
+
+/* eventfd: a 64-bit counter that can be waited on. Writes add to the counter, reads return it and
+ * reset it to 0 (or, in semaphore mode, return 1 and decrement it). Reads block while the counter
+ * is 0, writes block if they would make the counter overflow. */
+
+#define EVENTFD_MAX (ULLONG_MAX - 1)
+
+#define EFD_VALID_FLAGS (EFD_SEMAPHORE | EFD_CLOEXEC | EFD_NONBLOCK)
+
+struct eventfd_ctx
+{
+    struct spinlock lock;
+    u64 count;
+    unsigned int flags;
+    /* Readers and writers */
+    struct wait_queue wq;
+
+    eventfd_ctx(u64 initval, unsigned int flags) : count{initval}, flags{flags}
+    {
+        spinlock_init(&lock);
+        init_wait_queue_head(&wq);
+    }
+};
+
+static long eventfd_wait_read(struct eventfd_ctx *ctx)
+{
+    return wait_for_event_locked_interruptible(&ctx->wq, ctx->count > 0, &ctx->lock);
+}
+
+static long eventfd_wait_write(struct eventfd_ctx *ctx, u64 val)
+{
+    return wait_for_event_locked_interruptible(&ctx->wq, EVENTFD_MAX - ctx->count >= val,
+                                               &ctx->lock);
+}
+
+/**
+ * @brief Read (and reset, or decrement) an eventfd's counter
+ *
+ * @param ctx eventfd
+ * @param val Pointer to where to store the value read
+ * @param nonblock If true, don't wait for the counter to be non-zero
+ * @return 0 on success, negative error code (-EAGAIN, -EINTR)
+ */
+static int eventfd_do_read(struct eventfd_ctx *ctx, u64 *val, bool nonblock)
+{
+    scoped_lock g{ctx->lock};
+
+    if (ctx->count == 0)
+    {
+        if (nonblock)
+            return -EAGAIN;
+        if (eventfd_wait_read(ctx) == -EINTR)
+            return -EINTR;
+    }
+
+    if (ctx->flags & EFD_SEMAPHORE)
+    {
+        *val = 1;
+        ctx->count--;
+    }
+    else
+    {
+        *val = ctx->count;
+        ctx->count = 0;
+    }
+
+    /* Wake up blocked writers (and POLLOUT waiters) */
+    wait_queue_wake_all(&ctx->wq);
+    return 0;
+}
+
+/**
+ * @brief Add to an eventfd's counter
+ *
+ * @param ctx eventfd
+ * @param val Value to add
+ * @param nonblock If true, don't wait for space in the counter
+ * @return 0 on success, negative error code (-EINVAL, -EAGAIN, -EINTR)
+ */
+static int eventfd_do_write(struct eventfd_ctx *ctx, u64 val, bool nonblock)
+{
+    if (val == ULLONG_MAX)
+        return -EINVAL;
+
+    scoped_lock g{ctx->lock};
+
+    if (EVENTFD_MAX - ctx->count < val)
+    {
+        if (nonblock)
+            return -EAGAIN;
+        if (eventfd_wait_write(ctx, val) == -EINTR)
+            return -EINTR;
+    }
+
+    ctx->count += val;
+
+    if (ctx->count > 0)
+        wait_queue_wake_all(&ctx->wq);
+    return 0;
+}
+
+static ssize_t eventfd_read_iter(struct file *filp, size_t off, struct iovec_iter *iter,
+                                 unsigned int flags)
+{
+    struct eventfd_ctx *ctx = (struct eventfd_ctx *) filp->private_data;
+    u64 val;
+
+    if (iter->bytes < sizeof(val))
+        return -EINVAL;
+
+    int st = eventfd_do_read(ctx, &val, filp->f_flags & O_NONBLOCK);
+    if (st < 0)
+        return st;
+
+    return copy_to_iter(iter, &val, sizeof(val));
+}
+
+static ssize_t eventfd_write_iter(struct file *filp, size_t off, struct iovec_iter *iter,
+                                  unsigned int flags)
+{
+    struct eventfd_ctx *ctx = (struct eventfd_ctx *) filp->private_data;
+    u64 val;
+
+    if (iter->bytes < sizeof(val))
+        return -EINVAL;
+
+    ssize_t st = copy_from_iter(iter, &val, sizeof(val));
+    if (st < 0)
+        return st;
+
+    st = eventfd_do_write(ctx, val, filp->f_flags & O_NONBLOCK);
+    if (st < 0)
+        return st;
+    return sizeof(val);
+}
+
+static short eventfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct eventfd_ctx *ctx = (struct eventfd_ctx *) filp->private_data;
+    short revents = 0;
+
+    poll_wait_helper(poll_file, &ctx->wq);
+
+    u64 count = READ_ONCE(ctx->count);
+
+    if (count > 0)
+        revents |= POLLIN | POLLRDNORM;
+    if (count < EVENTFD_MAX)
+        revents |= POLLOUT | POLLWRNORM;
+
+    return revents & events;
+}
+
+static void eventfd_release(struct file *filp)
+{
+    delete (struct eventfd_ctx *) filp->private_data;
+}
+
+static struct file_ops eventfd_fops = {
+    .poll = eventfd_poll,
+    .release = eventfd_release,
+    .read_iter = eventfd_read_iter,
+    .write_iter = eventfd_write_iter,
+};
+
+int sys_eventfd2(unsigned int initval, int flags)
+{
+    if (flags & ~EFD_VALID_FLAGS)
+        return -EINVAL;
+
+    struct eventfd_ctx *ctx = new eventfd_ctx{initval, (unsigned int) flags};
+    if (!ctx)
+        return -ENOMEM;
+
+    struct file *filp = anon_inode_open(S_IFREG, &eventfd_fops, "[eventfd]");
+    if (!filp)
+    {
+        delete ctx;
+        return -ENOMEM;
+    }
+
+    filp->private_data = ctx;
+
+    int fd = open_with_vnode(filp, O_RDWR | (flags & (EFD_CLOEXEC | EFD_NONBLOCK)));
+    fd_put(filp);
+    return fd;
+}
+
+#ifdef CONFIG_KUNIT
+
+TEST(eventfd, counter_works)
+{
+    eventfd_ctx ctx{2, 0};
+    u64 val;
+
+    ASSERT_EQ(eventfd_do_write(&ctx, 3, true), 0);
+    ASSERT_EQ(eventfd_do_read(&ctx, &val, true), 0);
+    EXPECT_EQ(val, 5UL);
+    EXPECT_EQ(eventfd_do_read(&ctx, &val, true), -EAGAIN);
+
+    /* The counter can't go past ULLONG_MAX - 1 */
+    EXPECT_EQ(eventfd_do_write(&ctx, ULLONG_MAX, true), -EINVAL);
+    ASSERT_EQ(eventfd_do_write(&ctx, EVENTFD_MAX, true), 0);
+    EXPECT_EQ(eventfd_do_write(&ctx, 1, true), -EAGAIN);
+}
+
+TEST(eventfd, semaphore_works)
+{
+    eventfd_ctx ctx{0, EFD_SEMAPHORE};
+    u64 val;
+
+    ASSERT_EQ(eventfd_do_write(&ctx, 2, true), 0);
+    ASSERT_EQ(eventfd_do_read(&ctx, &val, true), 0);
+    EXPECT_EQ(val, 1UL);
+    ASSERT_EQ(eventfd_do_read(&ctx, &val, true), 0);
+    EXPECT_EQ(val, 1UL);
+    EXPECT_EQ(eventfd_do_read(&ctx, &val, true), -EAGAIN);
+}
+
+#endif
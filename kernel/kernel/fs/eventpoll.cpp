@@ -0,0 +1,711 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/clock.h>
+#include <onyx/eventpoll.h>
+#include <onyx/file.h>
+#include <onyx/mutex.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+#include <onyx/signal.h>
+#include <onyx/spinlock.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <onyx/utility.hpp>
+
+#include <uapi/epoll.h>
+
+#include <lib/binary_search_tree.h>
+
+/* epoll: each watched (file, fd) pair gets an epitem, which stays registered on the file's wait
+ * queues for as long as it exists (see WQ_TOKEN_PERSISTENT). When one of those wait queues is
+ * woken up, the item is put on the ready list. epoll_wait then only has to look at the ready list,
+ * instead of polling every file like poll(2) does. Items are re-polled before being reported, so a
+ * spurious wakeup costs us a ->poll() call, but never a bogus event.
+ *
+ * We don't hold references to watched files. Instead, a file tells every epoll instance watching
+ * it to drop its items when its last reference goes away (eventpoll_release_file).
+ *
+ * Locking: ep->mtx protects the item tree and the items themselves. ep->lock protects the ready
+ * list and is taken from the wakeup callback, with the file's wait queue lock held. The lock order
+ * is ep->mtx -> file->f_ep_lock.
+ *
+ * Epoll instances may watch each other. Wakeups then recurse through the nesting, so adding an
+ * epoll instance to another one must not create a loop, or nest more than EP_MAX_NESTS deep (see
+ * ep_loop_check). epnested_mutex serializes those additions, so the check sees a stable graph. It
+ * nests outside every ep->mtx.
+ */
+
+/* Flags that aren't events */
+#define EP_PRIVATE_BITS (EPOLLWAKEUP | EPOLLONESHOT | EPOLLET | EPOLLEXCLUSIVE)
+
+#define EPOLLEXCLUSIVE_OK_BITS \
+    (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLWAKEUP | EPOLLET | EPOLLEXCLUSIVE)
+
+#define EP_MAX_EVENTS (INT_MAX / sizeof(struct epoll_event))
+
+/* Max number of epoll instances watching each other in a chain, not counting the first one */
+#define EP_MAX_NESTS 4
+
+struct eventpoll
+{
+    unsigned long refcount;
+    struct mutex mtx;
+    struct spinlock lock;
+    /* Items that may have events pending, protected by lock */
+    struct list_head rdllist;
+    /* Every item, keyed by (file, fd) */
+    struct bst_root items;
+    /* epoll_wait callers and poll(2)ers of the epoll fd */
+    struct wait_queue wq;
+    /* Our own file. Not a reference, the file owns us. */
+    struct file *file;
+    /* Loop check state, protected by epnested_mutex */
+    u64 loop_check_gen;
+    int loop_check_depth;
+};
+
+struct epitem
+{
+    struct bst_node node;
+    /* On ep->rdllist, if on_rdlist */
+    struct list_head rdllink;
+    /* On file->f_ep */
+    struct list_head fllink;
+    bool on_rdlist;
+    /* Set (under ep->lock) once we start tearing the item down */
+    bool dead;
+    struct eventpoll *ep;
+    struct file *file;
+    int fd;
+    struct epoll_event event;
+    /* Our persistent wait queue registrations. The poll_file does not own a file reference. */
+    poll_table pt;
+    poll_file pf;
+
+    epitem(struct eventpoll *ep, struct file *file, int fd, const struct epoll_event &ev,
+           void (*wake_fn)(poll_file *), unsigned short token_flags)
+        : on_rdlist{false}, dead{false}, ep{ep}, file{file}, fd{fd}, event(ev),
+          pt{wake_fn, token_flags}, pf{fd, &pt, nullptr, (short) ev.events, nullptr}
+    {
+        bst_node_initialize(&node);
+        INIT_LIST_HEAD(&rdllink);
+        INIT_LIST_HEAD(&fllink);
+    }
+};
+
+static void ep_get(struct eventpoll *ep)
+{
+    __atomic_add_fetch(&ep->refcount, 1, __ATOMIC_ACQUIRE);
+}
+
+static void ep_put(struct eventpoll *ep)
+{
+    if (__atomic_sub_fetch(&ep->refcount, 1, __ATOMIC_RELEASE) == 0)
+    {
+        DCHECK(ep->items.root == nullptr);
+        delete ep;
+    }
+}
+
+static int ep_compare(struct bst_node *lhs_, struct bst_node *rhs_)
+{
+    struct epitem *lhs = container_of(lhs_, struct epitem, node);
+    struct epitem *rhs = container_of(rhs_, struct epitem, node);
+
+    if (lhs->file != rhs->file)
+        return (unsigned long) lhs->file < (unsigned long) rhs->file ? 1 : -1;
+    if (lhs->fd != rhs->fd)
+        return lhs->fd < rhs->fd ? 1 : -1;
+    return 0;
+}
+
+static struct epitem *ep_find(struct eventpoll *ep, struct file *file, int fd)
+{
+    MUST_HOLD_MUTEX(&ep->mtx);
+    struct bst_node *node = ep->items.root;
+
+    while (node)
+    {
+        struct epitem *epi = container_of(node, struct epitem, node);
+        if (epi->file == file && epi->fd == fd)
+            return epi;
+
+        if ((unsigned long) file < (unsigned long) epi->file ||
+            (file == epi->file && fd < epi->fd))
+            node = node->child[0];
+        else
+            node = node->child[1];
+    }
+
+    return nullptr;
+}
+
+static bool ep_events_available(struct eventpoll *ep)
+{
+    return !list_is_empty(&ep->rdllist);
+}
+
+/**
+ * @brief Put an item on the ready list, if it isn't already there
+ *
+ * @param ep Eventpoll
+ * @param epi Item
+ * @return True if it was added
+ */
+static bool ep_ready(struct eventpoll *ep, struct epitem *epi)
+{
+    bool added = false;
+    unsigned long flags = spin_lock_irqsave(&ep->lock);
+
+    /* Disarmed (EPOLLONESHOT) items stay off the list until EPOLL_CTL_MOD */
+    if (!epi->dead && !epi->on_rdlist && epi->event.events & ~EP_PRIVATE_BITS)
+    {
+        list_add_tail(&epi->rdllink, &ep->rdllist);
+        epi->on_rdlist = true;
+        added = true;
+    }
+
+    spin_unlock_irqrestore(&ep->lock, flags);
+    return added;
+}
+
+/* Called with the watched file's wait queue lock held, possibly from IRQ context */
+static void ep_poll_callback(poll_file *pf)
+{
+    struct epitem *epi = container_of(pf, struct epitem, pf);
+    struct eventpoll *ep = epi->ep;
+
+    if (ep_ready(ep, epi))
+        wait_queue_wake_all(&ep->wq);
+}
+
+static short ep_poll_item(struct epitem *epi)
+{
+    short events = (short) (epi->event.events & ~EP_PRIVATE_BITS);
+    /* POLLHUP and POLLERR are implicit */
+    return poll_vfs(&epi->pf, events | POLLHUP | POLLERR, epi->file) & (events | POLLHUP | POLLERR);
+}
+
+/**
+ * @brief Tear down an item
+ *
+ * @param ep Eventpoll
+ * @param epi Item
+ */
+static void ep_remove(struct eventpoll *ep, struct epitem *epi)
+{
+    MUST_HOLD_MUTEX(&ep->mtx);
+
+    spin_lock(&epi->file->f_ep_lock);
+    list_remove(&epi->fllink);
+    spin_unlock(&epi->file->f_ep_lock);
+
+    bst_delete(&ep->items, &epi->node);
+
+    unsigned long flags = spin_lock_irqsave(&ep->lock);
+    epi->dead = true;
+    if (epi->on_rdlist)
+        list_remove(&epi->rdllink);
+    epi->on_rdlist = false;
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    /* Destroying the poll_file takes us off the wait queues. Once that's done, no callback can be
+     * running on this item anymore. */
+    delete epi;
+}
+
+static int ep_insert(struct eventpoll *ep, struct file *file, int fd,
+                     const struct epoll_event &ev)
+{
+    MUST_HOLD_MUTEX(&ep->mtx);
+    unsigned short token_flags = ev.events & EPOLLEXCLUSIVE ? WQ_TOKEN_EXCLUSIVE : 0;
+
+    struct epitem *epi = new epitem{ep, file, fd, ev, ep_poll_callback, token_flags};
+    if (!epi)
+        return -ENOMEM;
+
+    CHECK(bst_insert(&ep->items, &epi->node, ep_compare));
+
+    spin_lock(&file->f_ep_lock);
+    list_add_tail(&epi->fllink, &file->f_ep);
+    spin_unlock(&file->f_ep_lock);
+
+    /* The first poll registers us on the file's wait queues, for good */
+    short revents = ep_poll_item(epi);
+    epi->pt.dont_queue();
+
+    if (revents && ep_ready(ep, epi))
+        wait_queue_wake_all(&ep->wq);
+    return 0;
+}
+
+static int ep_modify(struct eventpoll *ep, struct epitem *epi, const struct epoll_event &ev)
+{
+    MUST_HOLD_MUTEX(&ep->mtx);
+
+    unsigned long flags = spin_lock_irqsave(&ep->lock);
+    epi->event = ev;
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    /* Check if the new event mask is already satisfied. This also rearms EPOLLONESHOT items. */
+    if (ep_poll_item(epi) && ep_ready(ep, epi))
+        wait_queue_wake_all(&ep->wq);
+    return 0;
+}
+
+/**
+ * @brief Report ready events to userspace
+ *
+ * @param ep Eventpoll
+ * @param uevents User array of events
+ * @param maxevents Size of the array
+ * @return Number of events reported, or negative error code
+ */
+static int ep_send_events(struct eventpoll *ep, struct epoll_event *uevents, int maxevents)
+{
+    DEFINE_LIST(txlist);
+    int nr = 0;
+    int st = 0;
+
+    mutex_lock(&ep->mtx);
+
+    unsigned long flags = spin_lock_irqsave(&ep->lock);
+    list_move(&txlist, &ep->rdllist);
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    while (!list_is_empty(&txlist) && nr < maxevents)
+    {
+        struct epitem *epi = container_of(list_first_element(&txlist), struct epitem, rdllink);
+
+        /* Wakeups from now on put the item back on the ready list. Since we poll it afterwards,
+         * nothing gets lost. */
+        flags = spin_lock_irqsave(&ep->lock);
+        list_remove(&epi->rdllink);
+        epi->on_rdlist = false;
+        spin_unlock_irqrestore(&ep->lock, flags);
+
+        short revents = ep_poll_item(epi);
+        if (!revents)
+            continue;
+
+        struct epoll_event ev;
+        ev.events = (u16) revents;
+        ev.data = epi->event.data;
+        if (copy_to_user(uevents + nr, &ev, sizeof(ev)) < 0)
+        {
+            ep_ready(ep, epi);
+            st = -EFAULT;
+            break;
+        }
+
+        nr++;
+
+        if (epi->event.events & EPOLLONESHOT)
+        {
+            flags = spin_lock_irqsave(&ep->lock);
+            epi->event.events &= EP_PRIVATE_BITS;
+            spin_unlock_irqrestore(&ep->lock, flags);
+        }
+        else if (!(epi->event.events & EPOLLET))
+        {
+            /* Level-triggered items get checked again on the next epoll_wait */
+            ep_ready(ep, epi);
+        }
+    }
+
+    /* Whatever we didn't get to goes back to the front of the list */
+    flags = spin_lock_irqsave(&ep->lock);
+    list_splice(&txlist, &ep->rdllist);
+    spin_unlock_irqrestore(&ep->lock, flags);
+
+    mutex_unlock(&ep->mtx);
+    return nr ?: st;
+}
+
+static long ep_wait(struct eventpoll *ep)
+{
+    return wait_for_event_interruptible(&ep->wq, ep_events_available(ep));
+}
+
+static long ep_wait_timeout(struct eventpoll *ep, hrtime_t timeout)
+{
+    return wait_for_event_timeout_interruptible(&ep->wq, ep_events_available(ep), timeout);
+}
+
+static short ep_eventpoll_poll(void *poll_file, short events, struct file *filp)
+{
+    struct eventpoll *ep = (struct eventpoll *) filp->private_data;
+
+    poll_wait_helper(poll_file, &ep->wq);
+
+    if (ep_events_available(ep))
+        return (POLLIN | POLLRDNORM) & events;
+    return 0;
+}
+
+static void ep_free(struct eventpoll *ep)
+{
+    struct epitem *epi;
+
+    mutex_lock(&ep->mtx);
+    bst_for_every_entry(&ep->items, epi, struct epitem, node)
+    {
+        ep_remove(ep, epi);
+    }
+    mutex_unlock(&ep->mtx);
+
+    ep_put(ep);
+}
+
+static void ep_eventpoll_release(struct file *filp)
+{
+    ep_free((struct eventpoll *) filp->private_data);
+}
+
+static struct file_ops eventpoll_fops = {
+    .poll = ep_eventpoll_poll,
+    .release = ep_eventpoll_release,
+};
+
+static bool is_file_epoll(struct file *filp)
+{
+    return filp->f_ino->i_fops == &eventpoll_fops;
+}
+
+static DECLARE_MUTEX(epnested_mutex);
+static u64 ep_loop_check_gen;
+static struct eventpoll *ep_inserting_into;
+
+/**
+ * @brief Get the depth of the epoll instances nested under ep
+ * Must be called with epnested_mutex held.
+ *
+ * @param ep Eventpoll
+ * @return Depth (0 if ep doesn't watch any epoll instance), or EP_MAX_NESTS + 1 if
+ * ep_inserting_into is under ep
+ */
+static int ep_loop_check_proc(struct eventpoll *ep)
+{
+    struct epitem *epi;
+    int depth = 0;
+
+    /* Already visited, through another path */
+    if (ep->loop_check_gen == ep_loop_check_gen)
+        return ep->loop_check_depth;
+    ep->loop_check_gen = ep_loop_check_gen;
+
+    mutex_lock(&ep->mtx);
+    bst_for_every_entry(&ep->items, epi, struct epitem, node)
+    {
+        if (!is_file_epoll(epi->file))
+            continue;
+
+        struct eventpoll *nested = (struct eventpoll *) epi->file->private_data;
+        if (nested == ep_inserting_into)
+            depth = EP_MAX_NESTS + 1;
+        else
+            depth = cul::max(depth, ep_loop_check_proc(nested) + 1);
+
+        if (depth > EP_MAX_NESTS)
+            break;
+    }
+    mutex_unlock(&ep->mtx);
+
+    ep->loop_check_depth = depth;
+    return depth;
+}
+
+/**
+ * @brief Get the depth of the epoll instances watching ep
+ * Must be called with epnested_mutex held.
+ *
+ * @param ep Eventpoll
+ * @return Depth (0 if no epoll instance watches ep)
+ */
+static int ep_get_upwards_depth_proc(struct eventpoll *ep)
+{
+    struct file *filp = ep->file;
+    int depth = 0;
+
+    if (ep->loop_check_gen == ep_loop_check_gen)
+        return ep->loop_check_depth;
+    ep->loop_check_gen = ep_loop_check_gen;
+
+    /* Items are removed from f_ep before the watching epoll instance goes away, so holding
+     * f_ep_lock keeps the instances above us alive */
+    spin_lock(&filp->f_ep_lock);
+    list_for_every (&filp->f_ep)
+    {
+        struct epitem *epi = container_of(l, struct epitem, fllink);
+        depth = cul::max(depth, ep_get_upwards_depth_proc(epi->ep) + 1);
+        if (depth > EP_MAX_NESTS)
+            break;
+    }
+    spin_unlock(&filp->f_ep_lock);
+
+    ep->loop_check_depth = depth;
+    return depth;
+}
+
+/**
+ * @brief Check if ep may watch the epoll instance to
+ * Fails if to (or an instance under it) watches ep, which would make wakeups recurse forever,
+ * or if the chain of instances watching each other would get longer than EP_MAX_NESTS.
+ * Must be called with epnested_mutex held.
+ *
+ * @param ep Eventpoll being added to
+ * @param to Eventpoll being added
+ * @return 0 if it's fine, -ELOOP otherwise
+ */
+static int ep_loop_check(struct eventpoll *ep, struct eventpoll *to)
+{
+    MUST_HOLD_MUTEX(&epnested_mutex);
+
+    ep_loop_check_gen++;
+    int depth = ep_get_upwards_depth_proc(ep);
+
+    /* Start a new walk, so the instances above ep aren't skipped as visited */
+    ep_loop_check_gen++;
+    ep_inserting_into = ep;
+    depth += ep_loop_check_proc(to) + 1;
+    ep_inserting_into = nullptr;
+
+    return depth > EP_MAX_NESTS ? -ELOOP : 0;
+}
+
+/**
+ * @brief Remove a file from every epoll instance watching it
+ * Called when the file's last reference goes away.
+ *
+ * @param filp File
+ */
+void eventpoll_release_file(struct file *filp)
+{
+    for (;;)
+    {
+        spin_lock(&filp->f_ep_lock);
+        if (list_is_empty(&filp->f_ep))
+        {
+            spin_unlock(&filp->f_ep_lock);
+            return;
+        }
+
+        struct eventpoll *ep =
+            container_of(list_first_element(&filp->f_ep), struct epitem, fllink)->ep;
+        /* Keep the eventpoll alive while we go and grab its mutex */
+        ep_get(ep);
+        spin_unlock(&filp->f_ep_lock);
+
+        mutex_lock(&ep->mtx);
+
+        /* The file may be watched through more than one fd. Remove every one of this ep's items,
+         * if someone else didn't already. */
+        for (;;)
+        {
+            struct epitem *found = nullptr;
+            spin_lock(&filp->f_ep_lock);
+            list_for_every (&filp->f_ep)
+            {
+                struct epitem *epi = container_of(l, struct epitem, fllink);
+                if (epi->ep == ep)
+                {
+                    found = epi;
+                    break;
+                }
+            }
+            spin_unlock(&filp->f_ep_lock);
+
+            if (!found)
+                break;
+            ep_remove(ep, found);
+        }
+
+        mutex_unlock(&ep->mtx);
+        ep_put(ep);
+    }
+}
+
+int sys_epoll_create1(int flags)
+{
+    if (flags & ~EPOLL_CLOEXEC)
+        return -EINVAL;
+
+    struct eventpoll *ep = new eventpoll;
+    if (!ep)
+        return -ENOMEM;
+
+    ep->refcount = 1;
+    mutex_init(&ep->mtx);
+    spinlock_init(&ep->lock);
+    INIT_LIST_HEAD(&ep->rdllist);
+    bst_root_initialize(&ep->items);
+    init_wait_queue_head(&ep->wq);
+    ep->loop_check_gen = 0;
+    ep->loop_check_depth = 0;
+
+    struct file *filp = anon_inode_open(S_IFREG, &eventpoll_fops, "[eventpoll]");
+    if (!filp)
+    {
+        delete ep;
+        return -ENOMEM;
+    }
+
+    /* From now on, the file owns our reference */
+    filp->private_data = ep;
+    ep->file = filp;
+
+    int fd = open_with_vnode(filp, O_RDWR | (flags & EPOLL_CLOEXEC));
+    fd_put(filp);
+    return fd;
+}
+
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *uevent)
+{
+    struct epoll_event ev = {};
+    int st;
+
+    if (op != EPOLL_CTL_DEL && copy_from_user(&ev, uevent, sizeof(ev)) < 0)
+        return -EFAULT;
+
+    auto_file epf = get_file_description(epfd);
+    if (!epf)
+        return -EBADF;
+
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -EBADF;
+
+    struct file *filp = f.get_file();
+
+    if (!is_file_epoll(epf.get_file()) || epf.get_file() == filp)
+        return -EINVAL;
+    /* epoll only makes sense for files that can tell us when they're ready */
+    if (!filp->f_ino->i_fops->poll)
+        return -EPERM;
+
+    if (ev.events & EPOLLEXCLUSIVE)
+    {
+        /* Exclusive wakeups can't be changed later on, and can't be combined with ONESHOT */
+        if (op == EPOLL_CTL_MOD)
+            return -EINVAL;
+        if (op == EPOLL_CTL_ADD &&
+            (is_file_epoll(filp) || ev.events & ~EPOLLEXCLUSIVE_OK_BITS))
+            return -EINVAL;
+    }
+
+    struct eventpoll *ep = (struct eventpoll *) epf.get_file()->private_data;
+
+    /* Adding an epoll instance may create a loop, which we must check for. Keep every other
+     * nested addition out until we're done. */
+    bool nested = op == EPOLL_CTL_ADD && is_file_epoll(filp);
+    if (nested)
+    {
+        mutex_lock(&epnested_mutex);
+        if (st = ep_loop_check(ep, (struct eventpoll *) filp->private_data); st < 0)
+        {
+            mutex_unlock(&epnested_mutex);
+            return st;
+        }
+    }
+
+    mutex_lock(&ep->mtx);
+    struct epitem *epi = ep_find(ep, filp, fd);
+
+    switch (op)
+    {
+        case EPOLL_CTL_ADD:
+            st = epi ? -EEXIST : ep_insert(ep, filp, fd, ev);
+            break;
+        case EPOLL_CTL_DEL:
+            st = -ENOENT;
+            if (epi)
+            {
+                ep_remove(ep, epi);
+                st = 0;
+            }
+            break;
+        case EPOLL_CTL_MOD:
+            st = -ENOENT;
+            if (epi)
+                st = epi->event.events & EPOLLEXCLUSIVE ? -EINVAL : ep_modify(ep, epi, ev);
+            break;
+        default:
+            st = -EINVAL;
+    }
+
+    mutex_unlock(&ep->mtx);
+    if (nested)
+        mutex_unlock(&epnested_mutex);
+    return st;
+}
+
+int sys_epoll_pwait(int epfd, struct epoll_event *uevents, int maxevents, int timeout,
+                    const sigset_t *usigmask, size_t sigsetsize)
+{
+    bool valid_sigmask = false;
+    sigset_t set = {};
+    hrtime_t deadline = 0;
+
+    if (maxevents <= 0 || (unsigned long) maxevents > EP_MAX_EVENTS)
+        return -EINVAL;
+
+    if (usigmask)
+    {
+        if (sigsetsize != sizeof(sigset_t))
+            return -EINVAL;
+        valid_sigmask = true;
+        if (copy_from_user(&set, usigmask, sizeof(set)) < 0)
+            return -EFAULT;
+    }
+
+    auto_file f = get_file_description(epfd);
+    if (!f)
+        return -EBADF;
+
+    if (!is_file_epoll(f.get_file()))
+        return -EINVAL;
+
+    struct eventpoll *ep = (struct eventpoll *) f.get_file()->private_data;
+
+    if (timeout > 0)
+        deadline = clocksource_get_time() + (hrtime_t) timeout * NS_PER_MS;
+
+    auto_signal_mask mask_guard{valid_sigmask, set};
+
+    for (;;)
+    {
+        int nr = ep_send_events(ep, uevents, maxevents);
+        if (nr != 0 || timeout == 0)
+            return nr;
+
+        long st;
+        if (timeout < 0)
+            st = ep_wait(ep);
+        else
+        {
+            hrtime_t now = clocksource_get_time();
+            if (now >= deadline)
+                return 0;
+            st = ep_wait_timeout(ep, deadline - now);
+        }
+
+        if (st == -ETIMEDOUT)
+            return 0;
+
+        if (st == -EINTR)
+        {
+            /* Let the signal be delivered with the temporary mask */
+            mask_guard.disable();
+            return -EINTR;
+        }
+    }
+}
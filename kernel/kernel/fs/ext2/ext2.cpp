@@ -75,6 +75,7 @@ struct file_ops ext2_ops = {
     .fsyncdata = ext2_fsyncdata,
     .readpages = ext2_readpages,
     .rename = ext2_rename,
+    .splice_read = filemap_splice_read,
 };
 
 void ext2_delete_inode(struct inode *inode_, uint32_t inum, struct ext2_superblock *fs)
@@ -17,6 +17,7 @@
 
 #include <onyx/compiler.h>
 #include <onyx/dentry.h>
+#include <onyx/eventpoll.h>
 #include <onyx/file.h>
 #include <onyx/fs_mount.h>
 #include <onyx/limits.h>
@@ -87,6 +88,10 @@ void fd_put(struct file *fd)
 {
     if (__atomic_sub_fetch(&fd->f_refcount, 1, __ATOMIC_RELEASE) == 0)
     {
+        /* Stop epoll from looking at us before we start tearing things down */
+        if (!list_is_empty(&fd->f_ep))
+            eventpoll_release_file(fd);
+
         if (fd->f_flock)
             flock_release(fd);
 
@@ -1009,7 +1014,7 @@ static ssize_t fetch_iovec(const struct iovec *uvec, int count, iovec_guard &gua
     return guard.len;
 }
 
-ssize_t sys_readv(int fd, const struct iovec *vec, int veccnt)
+static ssize_t do_readv(int fd, const struct iovec *vec, int veccnt, unsigned int flags)
 {
     iovec_guard guard;
     ssize_t st = -EBADF;
@@ -1025,14 +1030,19 @@ ssize_t sys_readv(int fd, const struct iovec *vec, int veccnt)
 
     iovec_iter iter = guard.to_iter(veccnt);
 
-    st = read_iter_vfs(f.get_file(), f.get_file()->f_seek, &iter, 0);
+    st = read_iter_vfs(f.get_file(), f.get_file()->f_seek, &iter, flags);
 
     if (st > 0)
         f.get_file()->f_seek += st;
     return st;
 }
 
-ssize_t sys_writev(int fd, const struct iovec *vec, int veccnt)
+ssize_t sys_readv(int fd, const struct iovec *vec, int veccnt)
+{
+    return do_readv(fd, vec, veccnt, 0);
+}
+
+static ssize_t do_writev(int fd, const struct iovec *vec, int veccnt, unsigned int flags)
 {
     iovec_guard guard;
     ssize_t st = -EBADF;
@@ -1053,14 +1063,20 @@ ssize_t sys_writev(int fd, const struct iovec *vec, int veccnt)
     if (filp->f_flags & O_APPEND)
         filp->f_seek = filp->f_ino->i_size;
 
-    st = write_iter_vfs(filp, filp->f_seek, &iter, 0);
+    st = write_iter_vfs(filp, filp->f_seek, &iter, flags);
 
     if (st > 0)
         filp->f_seek += st;
     return st;
 }
 
-ssize_t sys_preadv(int fd, const struct iovec *vec, int veccnt, off_t offset)
+ssize_t sys_writev(int fd, const struct iovec *vec, int veccnt)
+{
+    return do_writev(fd, vec, veccnt, 0);
+}
+
+static ssize_t do_preadv(int fd, const struct iovec *vec, int veccnt, off_t offset,
+                         unsigned int flags)
 {
     iovec_guard guard;
     ssize_t st = -EBADF;
@@ -1076,10 +1092,16 @@ ssize_t sys_preadv(int fd, const struct iovec *vec, int veccnt, off_t offset)
 
     iovec_iter iter = guard.to_iter(veccnt);
 
-    return read_iter_vfs(f.get_file(), offset, &iter, 0);
+    return read_iter_vfs(f.get_file(), offset, &iter, flags);
 }
 
-ssize_t sys_pwritev(int fd, const struct iovec *vec, int veccnt, off_t offset)
+ssize_t sys_preadv(int fd, const struct iovec *vec, int veccnt, off_t offset)
+{
+    return do_preadv(fd, vec, veccnt, offset, 0);
+}
+
+static ssize_t do_pwritev(int fd, const struct iovec *vec, int veccnt, off_t offset,
+                          unsigned int flags)
 {
     iovec_guard guard;
     ssize_t st = -EBADF;
@@ -1095,7 +1117,49 @@ ssize_t sys_pwritev(int fd, const struct iovec *vec, int veccnt, off_t offset)
 
     iovec_iter iter = guard.to_iter(veccnt);
 
-    return write_iter_vfs(f.get_file(), offset, &iter, 0);
+    return write_iter_vfs(f.get_file(), offset, &iter, flags);
+}
+
+ssize_t sys_pwritev(int fd, const struct iovec *vec, int veccnt, off_t offset)
+{
+    return do_pwritev(fd, vec, veccnt, offset, 0);
+}
+
+#define RWF_SUPPORTED RWF_HIPRI
+
+static int rwf_to_iter_flags(int rwf, unsigned int *flags)
+{
+    if (rwf & ~RWF_SUPPORTED)
+        return -EOPNOTSUPP;
+    *flags = rwf & RWF_HIPRI ? DIRECT_IO_HIPRI : 0;
+    return 0;
+}
+
+ssize_t sys_preadv2(int fd, const struct iovec *vec, int veccnt, off_t offset,
+                    unsigned long offset_hi, int rwf)
+{
+    /* offset_hi is only used by 32-bit ABIs */
+    (void) offset_hi;
+    unsigned int flags;
+    if (int st = rwf_to_iter_flags(rwf, &flags); st < 0)
+        return st;
+
+    if (offset == -1)
+        return do_readv(fd, vec, veccnt, flags);
+    return do_preadv(fd, vec, veccnt, offset, flags);
+}
+
+ssize_t sys_pwritev2(int fd, const struct iovec *vec, int veccnt, off_t offset,
+                     unsigned long offset_hi, int rwf)
+{
+    (void) offset_hi;
+    unsigned int flags;
+    if (int st = rwf_to_iter_flags(rwf, &flags); st < 0)
+        return st;
+
+    if (offset == -1)
+        return do_writev(fd, vec, veccnt, flags);
+    return do_pwritev(fd, vec, veccnt, offset, flags);
 }
 
 unsigned int putdir(struct dirent *buf, struct dirent *ubuf, unsigned int count);
@@ -10,11 +10,15 @@
 #include <onyx/block/blk_plug.h>
 #include <onyx/filemap.h>
 #include <onyx/gen/trace_filemap.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/page.h>
+#include <onyx/page_iov.h>
 #include <onyx/pagecache.h>
+#include <onyx/pipe.h>
 #include <onyx/readahead.h>
 #include <onyx/rmap.h>
+#include <onyx/splice.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 #include <onyx/vm_fault.h>
@@ -51,6 +55,11 @@ int filemap_find_page(struct inode *ino, size_t pgoff, unsigned int flags, struc
         p = alloc_page(GFP_KERNEL);
         if (!p)
             return -ENOMEM;
+        if (mem_cgroup_charge(p, GFP_KERNEL) < 0)
+        {
+            page_unref(p);
+            return -ENOMEM;
+        }
         p->owner = ino->i_pages;
         p->pageoff = pgoff;
         /* Add it in... */
@@ -93,10 +102,12 @@ int filemap_find_page(struct inode *ino, size_t pgoff, unsigned int flags, struc
         {
             /* Page is not up to date, kick off "synchronous" readahead. The code below will take
              * care of waiting for the IO, or kicking it off if required. */
-            filemap_do_readahead_sync(ino, ra_state, pgoff);
+            filemap_do_readahead_sync(ino, ra_state, pgoff, p);
             DCHECK(!(flags & FIND_PAGE_NO_READPAGE));
         }
         rw_unlock_read(&ino->i_pages->truncate_lock);
+        /* Record the access for sequential stream detection */
+        WRITE_ONCE(ra_state->ra_prev, pgoff);
     }
 
     /* If the page is not up to date, read it in, but first lock the page. All pages under IO have
@@ -126,7 +137,17 @@ int filemap_find_page(struct inode *ino, size_t pgoff, unsigned int flags, struc
     }
 
     if (flags & FIND_PAGE_LOCK)
+    {
         lock_page(p);
+        /* The page may have been migrated while we waited for the lock. If so, look up its
+         * replacement. */
+        if (p->owner != ino->i_pages) [[unlikely]]
+        {
+            unlock_page(p);
+            page_unref(p);
+            return filemap_find_page(ino, pgoff, flags, outp, ra_state);
+        }
+    }
 
 out:
     if (st == 0)
@@ -261,6 +282,65 @@ ssize_t filemap_read_iter(struct file *filp, size_t off, iovec_iter *iter, unsig
     return st;
 }
 
+/**
+ * @brief Splice page cache pages into a pipe. The pipe gets references to the pages, no data is
+ * copied.
+ *
+ * @param filp File pointer
+ * @param off Offset
+ * @param pipe Pipe
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t filemap_splice_read(struct file *filp, size_t off, struct pipe *pipe, size_t len,
+                            unsigned int flags)
+{
+    struct inode *ino = filp->f_ino;
+    size_t size = ino->i_size;
+    ssize_t st = 0;
+
+    if (S_ISBLK(ino->i_mode))
+    {
+        struct blockdev *bdev = (struct blockdev *) ino->i_helper;
+        size = bdev->nr_sectors * bdev->sector_size;
+    }
+
+    /* O_DIRECT does not go through the page cache, so we have nothing to lend */
+    if (filp->f_flags & O_DIRECT)
+        return default_splice_read(filp, off, pipe, len, flags);
+
+    while (len > 0 && off < size)
+    {
+        struct page *page = nullptr;
+        int st2 = filemap_find_page(ino, off >> PAGE_SHIFT, FIND_PAGE_ACTIVATE, &page,
+                                    &filp->f_ra_state);
+        if (st2 < 0)
+            return st ?: st2;
+
+        struct page_iov v;
+        v.page = page;
+        v.page_off = off % PAGE_SIZE;
+        v.length = min(min(PAGE_SIZE - v.page_off, len), size - off);
+
+        /* Only block if we haven't spliced anything yet */
+        ssize_t spliced = pipe_splice_pages(pipe, &v, 1, st ? flags | SPLICE_F_NONBLOCK : flags);
+        page_unpin(page);
+
+        if (spliced <= 0)
+            return st ?: spliced;
+
+        off += spliced;
+        len -= spliced;
+        st += spliced;
+
+        if ((size_t) spliced < v.length)
+            break;
+    }
+
+    return st;
+}
+
 /* Spinlocks are not capabilities, yet... */
 #undef EXCLUDES
 #define EXCLUDES(...)
@@ -390,7 +470,7 @@ ssize_t filemap_write_iter(struct file *filp, size_t off, iovec_iter *iter, unsi
     struct inode *ino = filp->f_ino;
 
     if (filp->f_flags & O_DIRECT)
-        return filemap_do_direct(filp, off, iter, DIRECT_IO_WRITE);
+        return filemap_do_direct(filp, off, iter, DIRECT_IO_WRITE | (flags & DIRECT_IO_HIPRI));
 
     scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
 
@@ -636,6 +716,11 @@ static int filemap_mkwrite_private(struct vm_pf_context *ctx,
     newp = alloc_page(PAGE_ALLOC_NO_ZERO | GFP_KERNEL);
     if (!newp)
         return -ENOMEM;
+    if (mem_cgroup_charge(newp, GFP_KERNEL) < 0)
+    {
+        page_unref(newp);
+        return -ENOMEM;
+    }
     page_set_anon(newp);
     newp->owner = (struct vm_object *) anon;
     newp->pageoff = ctx->vpage;
@@ -673,6 +758,58 @@ static int filemap_mkwrite_shared(struct vm_pf_context *ctx,
     return vm_prepare_write(vma->vm_file->f_ino, page);
 }
 
+/* Size of the fault-around window, in pages. Must be a power of 2. */
+#define FAULT_AROUND_PAGES 16
+
+/**
+ * @brief Map the page cache pages around a read fault (VM_FAULTAROUND).
+ * Only pages that are already cached and up to date are mapped, this never does IO.
+ *
+ * @param ctx Fault context, after the faulting page was mapped
+ */
+static void filemap_fault_around(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct vm_area_struct *region = ctx->entry;
+    struct inode *ino = region->vm_file->f_ino;
+    unsigned long start = ctx->vpage & -(FAULT_AROUND_PAGES << PAGE_SHIFT);
+    unsigned long end = start + (FAULT_AROUND_PAGES << PAGE_SHIFT);
+    struct page *page;
+
+    start = cul::max(start, region->vm_start);
+    end = cul::min(end, region->vm_end);
+
+    for (unsigned long addr = start; addr < end; addr += PAGE_SIZE)
+    {
+        if (addr == ctx->vpage)
+            continue;
+
+        unsigned long fileoff = (region->vm_offset + (addr - region->vm_start)) >> PAGE_SHIFT;
+        if (ino->i_size <= (fileoff << PAGE_SHIFT))
+            break;
+
+        if (!pte_none(pte_get(region->vm_mm, addr)))
+            continue;
+
+        if (filemap_find_page(ino, fileoff, FIND_PAGE_NO_CREATE | FIND_PAGE_NO_READPAGE, &page,
+                              nullptr) < 0)
+            continue;
+
+        /* Don't wait on pages under IO or otherwise busy */
+        if (!page_flag_set(page, PAGE_FLAG_UPTODATE) || !try_lock_page(page))
+        {
+            page_unref(page);
+            continue;
+        }
+
+        /* Recheck under the lock, the page may have been truncated */
+        if (page->owner == ino->i_pages && page_flag_set(page, PAGE_FLAG_UPTODATE))
+            vm_map_page(region->vm_mm, addr, (u64) page_to_phys(page), ctx->page_rwx, region);
+
+        unlock_page(page);
+        page_unref(page);
+    }
+}
+
 static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
 {
     struct vm_area_struct *region = ctx->entry;
@@ -755,6 +892,9 @@ static int filemap_fault(struct vm_pf_context *ctx) NO_THREAD_SAFETY_ANALYSIS
     if (needs_invalidate)
         vm_invalidate_range(ctx->vpage, 1);
 
+    if (!info->write && region->vm_flags & VM_FAULTAROUND)
+        filemap_fault_around(ctx);
+
     /* Only unref if this page is not new. When we allocate a new page - because of CoW,
      * amap_add 'adopts' our reference. This works because amaps are inherently region-specific,
      * and we have the address_space locked.
@@ -50,10 +50,13 @@ int pipe_do_fifo(inode *ino);
 
 struct slab_cache *inode_cache;
 
+static unsigned long inode_defrag(struct slab_cache *cache);
+
 __init static void inode_cache_init()
 {
     inode_cache = kmem_cache_create("inode", sizeof(struct inode), 0, KMEM_CACHE_HWALIGN, nullptr);
     CHECK(inode_cache != nullptr);
+    kmem_cache_set_defrag(inode_cache, inode_defrag);
 }
 
 struct inode *inode_create(bool is_cached)
@@ -243,6 +246,8 @@ void inode_release(struct inode *inode)
     if (inode->i_flock)
         flock_destroy_info(inode->i_flock);
 
+    free(inode->i_phdr_cache);
+
     /* Note: We use kfree here, and not kmem_cache_free, because <inode> in some filesystems is not
      * allocated by inode_create.
      */
@@ -509,6 +514,60 @@ void inode_trim_cache()
     }
 }
 
+/**
+ * @brief Evict the unused inodes that live in sparse slabs
+ * Slab defrag callback for the inode cache. Inodes are pinned by their dentries, so this mostly
+ * catches inodes that lost their last dentry (e.g to dentry defrag).
+ *
+ * @param cache Inode cache
+ * @return Number of evicted inodes
+ */
+static unsigned long inode_defrag(struct slab_cache *cache)
+{
+    struct list_head to_evict = LIST_HEAD_INIT(to_evict);
+    unsigned long nr = 0;
+
+    for (size_t i = 0; i < inode_hashtable_size; i++)
+    {
+        scoped_lock g{inode_hashtable_locks[i]};
+        auto ht = inode_hashtable.get_hashtable(i);
+
+        list_for_every_safe (ht)
+        {
+            auto ino = container_of(l, inode, i_hash_list_node);
+
+            if (!kmem_defrag_candidate(ino))
+                continue;
+
+            {
+                /* New references are only handed out under the hashtable lock, and the
+                 * lookup backs off on I_FREEING. */
+                scoped_lock g2{ino->i_lock};
+                if (ino->i_refc != 0 || ino->i_flags & I_FREEING)
+                    continue;
+                ino->i_flags |= I_FREEING;
+            }
+
+            {
+                scoped_lock g3{ino->i_sb->s_ilock};
+                list_remove(&ino->i_sb_list_node);
+            }
+
+            list_add_tail(&ino->i_sb_list_node, &to_evict);
+            nr++;
+        }
+    }
+
+    list_for_every_safe (&to_evict)
+    {
+        auto ino = container_of(l, inode, i_sb_list_node);
+        evicted_inodes++;
+        inode_release(ino);
+    }
+
+    return nr;
+}
+
 void inode::set_evicting()
 {
     scoped_lock g{i_lock};
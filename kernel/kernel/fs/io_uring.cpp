@@ -0,0 +1,1231 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <limits.h>
+#include <string.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/block/blk_plug.h>
+#include <onyx/clock.h>
+#include <onyx/file.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/mutex.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+#include <onyx/scheduler.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/fcntl.h>
+#include <uapi/io_uring.h>
+#include <uapi/socket.h>
+
+/* io_uring: userspace fills submission queue entries (SQEs) in a shared ring, and we post
+ * completion queue entries (CQEs) to another. Ops are executed in submission order, either by the
+ * thread calling io_uring_enter(2) or, with IORING_SETUP_SQPOLL, by a kernel thread that polls the
+ * SQ on the process' behalf. A batch of SQEs is submitted under a single block plug, so block IO
+ * from the batch reaches the device together.
+ *
+ * Ops that wait for a file to become ready (poll, socket send/recv, accept) would stall the whole
+ * ring, so we try them without blocking first. If they'd block, they're armed on the file's wait
+ * queues (like an epoll item), and the ring's async worker retries them when they are woken up.
+ * The worker runs on the process' behalf, like the SQ thread does.
+ *
+ * Locking: uring_lock serializes submitters. cq_lock serializes CQE posting between submitters and
+ * the async worker. async_lock protects the async request lists and is taken from wakeup
+ * callbacks, with the file's wait queue lock held.
+ */
+
+#define IORING_MAX_ENTRIES    4096
+#define IORING_MAX_CQ_ENTRIES (2 * IORING_MAX_ENTRIES)
+
+/* Default SQ thread idle time, in ms, before it goes to sleep */
+#define IORING_SQ_IDLE_DEFAULT 1000
+
+#define IORING_SETUP_VALID \
+    (IORING_SETUP_IOPOLL | IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF | IORING_SETUP_CQSIZE)
+#define IORING_ENTER_VALID \
+    (IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP | IORING_ENTER_SQ_WAIT)
+#define IOSQE_VALID (IOSQE_FIXED_FILE | IOSQE_IO_DRAIN | IOSQE_IO_LINK)
+
+/* Socket ops we reuse. They take user pointers, which is what SQEs carry */
+struct socket;
+bool file_is_socket(struct file *f);
+struct socket *file_to_socket(struct file *f);
+ssize_t socket_sendto(struct file *f, const void *buf, size_t len, int flags, struct sockaddr *addr,
+                      socklen_t addrlen);
+ssize_t socket_recvfrom(struct file *f, void *buf, size_t len, int flags, struct sockaddr *src_addr,
+                        socklen_t *paddrlen);
+ssize_t socket_sendmsg(struct socket *sock, struct msghdr *umsg, int flags);
+ssize_t socket_recvmsg(struct socket *sock, struct msghdr *umsg, int flags);
+int socket_accept4(struct file *f, struct sockaddr *addr, socklen_t *slen, int flags,
+                   bool nonblock);
+int sys_fsync(int fd);
+int sys_fdatasync(int fd);
+
+struct io_uring_idx
+{
+    u32 head;
+    u32 tail __align_cache;
+};
+
+/* Shared with userspace, at IORING_OFF_SQ_RING/IORING_OFF_CQ_RING. The SQ index array follows the
+ * CQEs. */
+struct io_rings
+{
+    struct io_uring_idx sq __align_cache;
+    struct io_uring_idx cq __align_cache;
+    u32 sq_ring_mask;
+    u32 cq_ring_mask;
+    u32 sq_ring_entries;
+    u32 cq_ring_entries;
+    u32 sq_dropped;
+    u32 sq_flags;
+    u32 cq_flags;
+    u32 cq_overflow;
+    struct io_uring_cqe cqes[] __align_cache;
+};
+
+struct io_ring_ctx
+{
+    unsigned long refcount;
+    u32 flags;
+    u32 sq_entries;
+    u32 cq_entries;
+    /* Our own copy of the SQ head, so userspace can't mess with it */
+    u32 cached_sq_head;
+
+    struct io_rings *rings;
+    size_t rings_pages;
+    u32 *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_pages;
+    struct vm_object *rings_vmo;
+    struct vm_object *sqes_vmo;
+
+    /* Serializes submitters */
+    struct mutex uring_lock;
+    /* Serializes CQE posting */
+    struct spinlock cq_lock;
+    /* Woken up when CQEs are posted or SQEs are consumed */
+    struct wait_queue ring_wait;
+    /* Async requests that haven't posted their CQE yet */
+    u32 nr_inflight;
+
+    /* SQPOLL state */
+    struct thread *sq_thread;
+    struct process *sq_proc;
+    struct mm_address_space *sq_mm;
+    struct wait_queue sq_wait;
+    hrtime_t sq_idle;
+    bool sq_wake;
+    bool sq_stop;
+    bool sq_dead;
+
+    /* Async worker state */
+    struct spinlock async_lock;
+    /* Every armed request, protected by async_lock */
+    struct list_head async_reqs;
+    /* Armed requests that were woken up, protected by async_lock */
+    struct list_head async_ready;
+    struct thread *async_thread;
+    struct process *async_proc;
+    struct mm_address_space *async_mm;
+    struct wait_queue async_wait;
+    bool async_stop;
+    /* Set (under async_lock) once the worker stops taking requests */
+    bool async_dead;
+};
+
+static void io_async_wake(poll_file *pf);
+
+/* An op that would block, armed on its file's wait queues */
+struct io_async_req
+{
+    /* On ctx->async_reqs */
+    struct list_head node;
+    /* On ctx->async_ready, if on_ready */
+    struct list_head ready_node;
+    bool on_ready;
+    /* Set (under async_lock) once we start tearing the request down */
+    bool dead;
+    struct io_ring_ctx *ctx;
+    /* We hold a reference to the file, so our wait queue registrations stay valid */
+    struct file *file;
+    struct io_uring_sqe sqe;
+    poll_table pt;
+    poll_file pf;
+
+    io_async_req(struct io_ring_ctx *ctx, struct file *file, const struct io_uring_sqe *sqe,
+                 short events)
+        : on_ready{false}, dead{false}, ctx{ctx}, file{file}, sqe(*sqe), pt{io_async_wake, 0},
+          pf{-1, &pt, nullptr, events, nullptr}
+    {
+        INIT_LIST_HEAD(&node);
+        INIT_LIST_HEAD(&ready_node);
+    }
+};
+
+static void io_ring_ctx_get(struct io_ring_ctx *ctx)
+{
+    __atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_ACQUIRE);
+}
+
+static void io_ring_ctx_free(struct io_ring_ctx *ctx)
+{
+    if (ctx->rings)
+        vfree(ctx->rings, ctx->rings_pages);
+    if (ctx->sqes)
+        vfree(ctx->sqes, ctx->sqes_pages);
+    if (ctx->rings_vmo)
+        vmo_unref(ctx->rings_vmo);
+    if (ctx->sqes_vmo)
+        vmo_unref(ctx->sqes_vmo);
+    delete ctx;
+}
+
+static void io_ring_ctx_put(struct io_ring_ctx *ctx)
+{
+    if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_RELEASE) == 0)
+        io_ring_ctx_free(ctx);
+}
+
+static u32 io_sq_pending(struct io_ring_ctx *ctx)
+{
+    return __atomic_load_n(&ctx->rings->sq.tail, __ATOMIC_ACQUIRE) - ctx->cached_sq_head;
+}
+
+static u32 io_cq_ready(struct io_ring_ctx *ctx)
+{
+    return READ_ONCE(ctx->rings->cq.tail) - __atomic_load_n(&ctx->rings->cq.head, __ATOMIC_ACQUIRE);
+}
+
+static void io_post_cqe(struct io_ring_ctx *ctx, u64 user_data, s32 res)
+{
+    struct io_rings *rings = ctx->rings;
+
+    spin_lock(&ctx->cq_lock);
+    u32 tail = rings->cq.tail;
+    struct io_uring_cqe *cqe = &rings->cqes[tail & rings->cq_ring_mask];
+
+    cqe->user_data = user_data;
+    cqe->res = res;
+    cqe->flags = 0;
+    /* Publish the CQE before the tail */
+    __atomic_store_n(&rings->cq.tail, tail + 1, __ATOMIC_RELEASE);
+    spin_unlock(&ctx->cq_lock);
+}
+
+/**
+ * @brief Fetch a read/write SQE's iovecs
+ *
+ * @param sqe SQE
+ * @param vec Pointer to the iovec array. Replaced with a kmalloc'd array if *nr is too small
+ * @param nr On entry, the number of inline iovecs. On return, the number of iovecs
+ * @return Total length, or negative error code
+ */
+static ssize_t io_import_iovec(const struct io_uring_sqe *sqe, struct iovec **vec, size_t *nr)
+{
+    struct iovec *iov = *vec;
+
+    if (sqe->opcode == IORING_OP_READ || sqe->opcode == IORING_OP_WRITE)
+    {
+        iov->iov_base = (void *) sqe->addr;
+        iov->iov_len = sqe->len;
+        *nr = 1;
+        return sqe->len;
+    }
+
+    if (sqe->len > IOV_MAX)
+        return -EINVAL;
+
+    if (sqe->len > *nr)
+    {
+        iov = (struct iovec *) kcalloc(sqe->len, sizeof(struct iovec), GFP_KERNEL);
+        if (!iov)
+            return -ENOMEM;
+        *vec = iov;
+    }
+
+    *nr = sqe->len;
+    if (copy_from_user(iov, (const void *) sqe->addr, sqe->len * sizeof(struct iovec)) < 0)
+        return -EFAULT;
+
+    return iovec_count_length(iov, sqe->len);
+}
+
+#define IO_FAST_IOV 8
+
+static ssize_t io_rw(struct io_ring_ctx *ctx, const struct io_uring_sqe *sqe, bool write)
+{
+    struct iovec fast_iov[IO_FAST_IOV];
+    struct iovec *iov = fast_iov;
+    size_t nr_iov = IO_FAST_IOV;
+    unsigned int flags = 0;
+    ssize_t st;
+
+    if (sqe->rw_flags & ~RWF_HIPRI)
+        return -EOPNOTSUPP;
+    /* IOPOLL rings spin on the device's poll queues instead of waiting for an interrupt */
+    if (sqe->rw_flags & RWF_HIPRI || ctx->flags & IORING_SETUP_IOPOLL)
+        flags |= DIRECT_IO_HIPRI;
+
+    auto_file f = get_file_description(sqe->fd);
+    if (!f)
+        return -EBADF;
+
+    struct file *filp = f.get_file();
+    if (!fd_may_access(filp, write ? FILE_ACCESS_WRITE : FILE_ACCESS_READ))
+        return -EBADF;
+
+    st = io_import_iovec(sqe, &iov, &nr_iov);
+    if (st < 0)
+        goto out;
+
+    {
+        iovec_iter iter{{iov, nr_iov}, (size_t) st, IOVEC_USER};
+        /* An offset of -1 means "use (and advance) the file position" */
+        bool use_seek = sqe->off == (u64) -1;
+
+        if (use_seek)
+        {
+            mutex_lock(&filp->f_seeklock);
+            if (write && filp->f_flags & O_APPEND)
+                filp->f_seek = filp->f_ino->i_size;
+        }
+
+        size_t off = use_seek ? filp->f_seek : sqe->off;
+        st = write ? write_iter_vfs(filp, off, &iter, flags)
+                   : read_iter_vfs(filp, off, &iter, flags);
+
+        if (use_seek)
+        {
+            if (st > 0)
+                filp->f_seek += st;
+            mutex_unlock(&filp->f_seeklock);
+        }
+    }
+
+out:
+    if (iov != fast_iov)
+        kfree(iov);
+    return st;
+}
+
+static bool io_op_pollable(const struct io_uring_sqe *sqe)
+{
+    switch (sqe->opcode)
+    {
+        case IORING_OP_POLL_ADD:
+        case IORING_OP_SEND:
+        case IORING_OP_RECV:
+        case IORING_OP_SENDMSG:
+        case IORING_OP_RECVMSG:
+        case IORING_OP_ACCEPT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Events that a pollable op waits for */
+static short io_op_poll_events(const struct io_uring_sqe *sqe)
+{
+    switch (sqe->opcode)
+    {
+        case IORING_OP_POLL_ADD:
+            return (short) sqe->poll_events;
+        case IORING_OP_SEND:
+        case IORING_OP_SENDMSG:
+            return POLLOUT;
+        default:
+            return POLLIN;
+    }
+}
+
+static short io_poll_file(poll_file *pf, struct file *filp, short events)
+{
+    /* POLLHUP and POLLERR are implicit */
+    events |= POLLHUP | POLLERR;
+    return poll_vfs(pf, events, filp) & events;
+}
+
+/**
+ * @brief Issue a pollable op without blocking
+ *
+ * @param sqe SQE
+ * @param filp The SQE's file
+ * @return Result, or -EAGAIN if the op would block
+ */
+static ssize_t io_issue_nowait(const struct io_uring_sqe *sqe, struct file *filp)
+{
+    switch (sqe->opcode)
+    {
+        case IORING_OP_POLL_ADD: {
+            poll_table pt;
+            poll_file pf{-1, &pt, nullptr, (short) sqe->poll_events, nullptr};
+            pt.dont_queue();
+            short revents = io_poll_file(&pf, filp, (short) sqe->poll_events);
+            return revents ?: -EAGAIN;
+        }
+        case IORING_OP_SEND:
+            return socket_sendto(filp, (const void *) sqe->addr, sqe->len,
+                                 sqe->msg_flags | MSG_DONTWAIT, nullptr, 0);
+        case IORING_OP_RECV:
+            return socket_recvfrom(filp, (void *) sqe->addr, sqe->len,
+                                   sqe->msg_flags | MSG_DONTWAIT, nullptr, nullptr);
+        case IORING_OP_SENDMSG:
+            return socket_sendmsg(file_to_socket(filp), (struct msghdr *) sqe->addr,
+                                  sqe->msg_flags | MSG_DONTWAIT);
+        case IORING_OP_RECVMSG:
+            return socket_recvmsg(file_to_socket(filp), (struct msghdr *) sqe->addr,
+                                  sqe->msg_flags | MSG_DONTWAIT);
+        case IORING_OP_ACCEPT:
+            return socket_accept4(filp, (struct sockaddr *) sqe->addr, (socklen_t *) sqe->addr2,
+                                  sqe->accept_flags, true);
+        default:
+            return -EINVAL;
+    }
+}
+
+/* Issue a pollable op the way the syscall would, blocking if needed */
+static ssize_t io_issue_wait(const struct io_uring_sqe *sqe, struct file *filp)
+{
+    switch (sqe->opcode)
+    {
+        case IORING_OP_POLL_ADD:
+            return poll_one_file(filp, (short) sqe->poll_events);
+        case IORING_OP_SEND:
+            return socket_sendto(filp, (const void *) sqe->addr, sqe->len, sqe->msg_flags, nullptr,
+                                 0);
+        case IORING_OP_RECV:
+            return socket_recvfrom(filp, (void *) sqe->addr, sqe->len, sqe->msg_flags, nullptr,
+                                   nullptr);
+        case IORING_OP_SENDMSG:
+            return socket_sendmsg(file_to_socket(filp), (struct msghdr *) sqe->addr,
+                                  sqe->msg_flags);
+        case IORING_OP_RECVMSG:
+            return socket_recvmsg(file_to_socket(filp), (struct msghdr *) sqe->addr,
+                                  sqe->msg_flags);
+        case IORING_OP_ACCEPT:
+            return socket_accept4(filp, (struct sockaddr *) sqe->addr, (socklen_t *) sqe->addr2,
+                                  sqe->accept_flags, false);
+        default:
+            return -EINVAL;
+    }
+}
+
+/**
+ * @brief Put an async request on the ready list, if it isn't already there
+ *
+ * @param ctx Ring
+ * @param req Request
+ * @return True if it was added
+ */
+static bool io_async_ready(struct io_ring_ctx *ctx, struct io_async_req *req)
+{
+    bool added = false;
+    unsigned long flags = spin_lock_irqsave(&ctx->async_lock);
+
+    if (!req->dead && !req->on_ready)
+    {
+        list_add_tail(&req->ready_node, &ctx->async_ready);
+        req->on_ready = true;
+        added = true;
+    }
+
+    spin_unlock_irqrestore(&ctx->async_lock, flags);
+    return added;
+}
+
+/* Called with the file's wait queue lock held, possibly from IRQ context */
+static void io_async_wake(poll_file *pf)
+{
+    struct io_async_req *req = container_of(pf, struct io_async_req, pf);
+    struct io_ring_ctx *ctx = req->ctx;
+
+    if (io_async_ready(ctx, req))
+        wait_queue_wake_all(&ctx->async_wait);
+}
+
+/**
+ * @brief Tear down an async request and post its CQE
+ *
+ * @param ctx Ring
+ * @param req Request
+ * @param res Result
+ */
+static void io_async_complete(struct io_ring_ctx *ctx, struct io_async_req *req, ssize_t res)
+{
+    struct file *filp = req->file;
+    u64 user_data = req->sqe.user_data;
+
+    unsigned long flags = spin_lock_irqsave(&ctx->async_lock);
+    req->dead = true;
+    list_remove(&req->node);
+    if (req->on_ready)
+        list_remove(&req->ready_node);
+    req->on_ready = false;
+    spin_unlock_irqrestore(&ctx->async_lock, flags);
+
+    /* Destroying the poll_file takes us off the wait queues. Once that's done, no callback can be
+     * running on this request anymore, and we can let go of the file. */
+    delete req;
+    fd_put(filp);
+
+    /* Post the CQE before dropping nr_inflight, so submitters never see more CQ space than
+     * there is */
+    io_post_cqe(ctx, user_data, (s32) res);
+    __atomic_sub_fetch(&ctx->nr_inflight, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ctx->ring_wait);
+}
+
+static bool io_async_has_ready(struct io_ring_ctx *ctx)
+{
+    return !list_is_empty(&ctx->async_ready);
+}
+
+static void io_async_run_ready(struct io_ring_ctx *ctx)
+{
+    for (;;)
+    {
+        unsigned long flags = spin_lock_irqsave(&ctx->async_lock);
+        if (list_is_empty(&ctx->async_ready))
+        {
+            spin_unlock_irqrestore(&ctx->async_lock, flags);
+            break;
+        }
+
+        struct io_async_req *req =
+            container_of(list_first_element(&ctx->async_ready), struct io_async_req, ready_node);
+        /* Wakeups from now on put the request back on the ready list. Since we retry it
+         * afterwards, nothing gets lost. */
+        list_remove(&req->ready_node);
+        req->on_ready = false;
+        spin_unlock_irqrestore(&ctx->async_lock, flags);
+
+        ssize_t res = io_issue_nowait(&req->sqe, req->file);
+        if (res != -EAGAIN)
+            io_async_complete(ctx, req, res);
+    }
+}
+
+static void io_async_worker_exit(struct io_ring_ctx *ctx)
+{
+    struct thread *current = get_current_thread();
+    DEFINE_LIST(reqs);
+
+    unsigned long flags = spin_lock_irqsave(&ctx->async_lock);
+    ctx->async_dead = true;
+    list_move(&reqs, &ctx->async_reqs);
+    spin_unlock_irqrestore(&ctx->async_lock, flags);
+
+    /* Nobody is going to retry these anymore */
+    list_for_every_safe (&reqs)
+        io_async_complete(ctx, container_of(l, struct io_async_req, node), -ECANCELED);
+
+    vm_set_aspace(&kernel_address_space);
+    current->owner = nullptr;
+    ctx->async_mm->unref();
+    process_put(ctx->async_proc);
+
+    io_ring_ctx_put(ctx);
+    thread_exit();
+}
+
+static void io_async_worker(void *arg)
+{
+    struct io_ring_ctx *ctx = (struct io_ring_ctx *) arg;
+
+    while (!READ_ONCE(ctx->async_stop))
+    {
+        /* Like the SQ thread, stop if our owner's address space is gone */
+        if (ctx->async_proc->get_aspace() != ctx->async_mm)
+            break;
+
+        io_async_run_ready(ctx);
+
+        /* Periodically wake up to check if our owner is still around */
+        (void) wait_for_event_timeout(
+            &ctx->async_wait, io_async_has_ready(ctx) || READ_ONCE(ctx->async_stop), NS_PER_SEC);
+    }
+
+    io_async_worker_exit(ctx);
+}
+
+/**
+ * @brief Create a kernel thread that works on behalf of the current process
+ * It gets the process' fds, creds and address space, and a reference to the ring.
+ *
+ * @param ctx Ring
+ * @param fn Thread entry point
+ * @param pproc Set to the process, which the thread holds a reference to
+ * @param pmm Set to the address space, which the thread holds a reference to
+ * @return The thread (not started yet), or nullptr
+ */
+static struct thread *io_create_thread(struct io_ring_ctx *ctx, thread_callback_t fn,
+                                       struct process **pproc, struct mm_address_space **pmm)
+{
+    struct process *proc = get_current_process();
+    struct thread *thread = sched_create_thread(fn, THREAD_KERNEL, ctx);
+    if (!thread)
+        return nullptr;
+
+    process_get(proc);
+    *pproc = proc;
+    *pmm = proc->get_aspace();
+    (*pmm)->ref();
+    thread->owner = proc;
+    thread->set_aspace(*pmm);
+    io_ring_ctx_get(ctx);
+    return thread;
+}
+
+/**
+ * @brief Arm a pollable op that would block, so the async worker completes it
+ * Must be called with uring_lock held.
+ *
+ * @param ctx Ring
+ * @param sqe SQE
+ * @param filp The SQE's file
+ * @return 0 on success, negative error code if the op can't go async
+ */
+static int io_arm_async(struct io_ring_ctx *ctx, const struct io_uring_sqe *sqe, struct file *filp)
+{
+    MUST_HOLD_MUTEX(&ctx->uring_lock);
+    short events = io_op_poll_events(sqe);
+
+    if (READ_ONCE(ctx->async_stop))
+        return -ECANCELED;
+
+    if (!ctx->async_thread)
+    {
+        ctx->async_thread =
+            io_create_thread(ctx, io_async_worker, &ctx->async_proc, &ctx->async_mm);
+        if (!ctx->async_thread)
+            return -ENOMEM;
+        sched_start_thread(ctx->async_thread);
+    }
+
+    /* The worker retries ops in its owner's address space, where their buffers live */
+    if (get_current_address_space() != ctx->async_mm)
+        return -EXDEV;
+
+    struct io_async_req *req = new io_async_req{ctx, filp, sqe, events};
+    if (!req)
+        return -ENOMEM;
+
+    unsigned long flags = spin_lock_irqsave(&ctx->async_lock);
+    if (ctx->async_dead)
+    {
+        spin_unlock_irqrestore(&ctx->async_lock, flags);
+        delete req;
+        return -ECANCELED;
+    }
+
+    fd_get(filp);
+    __atomic_add_fetch(&ctx->nr_inflight, 1, __ATOMIC_RELAXED);
+    list_add_tail(&req->node, &ctx->async_reqs);
+    spin_unlock_irqrestore(&ctx->async_lock, flags);
+
+    /* The first poll registers us on the file's wait queues, for good. If the file became ready
+     * after we tried the op, the worker retries it right away. */
+    short revents = io_poll_file(&req->pf, filp, events);
+    req->pt.dont_queue();
+
+    if (revents && io_async_ready(ctx, req))
+        wait_queue_wake_all(&ctx->async_wait);
+    return 0;
+}
+
+/**
+ * @brief Issue a pollable op
+ *
+ * @param ctx Ring
+ * @param sqe SQE
+ * @param may_arm If false, block instead of going async
+ * @param queued Set to true if the op went async, and will post its CQE later
+ * @return Result
+ */
+static ssize_t io_issue_pollable(struct io_ring_ctx *ctx, const struct io_uring_sqe *sqe,
+                                 bool may_arm, bool *queued)
+{
+    auto_file f = get_file_description(sqe->fd);
+    if (!f)
+        return -EBADF;
+
+    struct file *filp = f.get_file();
+    if (sqe->opcode != IORING_OP_POLL_ADD && !file_is_socket(filp))
+        return -ENOTSOCK;
+
+    ssize_t res = io_issue_nowait(sqe, filp);
+    if (res != -EAGAIN)
+        return res;
+
+    /* If userspace asked for non-blocking behavior, -EAGAIN is what it gets */
+    if (sqe->opcode != IORING_OP_POLL_ADD &&
+        (sqe->msg_flags & MSG_DONTWAIT || filp->f_flags & O_NONBLOCK))
+        return res;
+
+    if (may_arm && io_arm_async(ctx, sqe, filp) == 0)
+    {
+        *queued = true;
+        return 0;
+    }
+
+    return io_issue_wait(sqe, filp);
+}
+
+/**
+ * @brief Issue an SQE
+ *
+ * @param ctx Ring
+ * @param sqe SQE
+ * @param may_arm If false, ops that would block do so, instead of going async
+ * @param queued Set to true if the op went async, and will post its CQE later
+ * @return Result
+ */
+static ssize_t io_issue_sqe(struct io_ring_ctx *ctx, const struct io_uring_sqe *sqe, bool may_arm,
+                            bool *queued)
+{
+    if (sqe->flags & ~IOSQE_VALID)
+        return -EINVAL;
+    /* We don't support registered files */
+    if (sqe->flags & IOSQE_FIXED_FILE)
+        return -EBADF;
+
+    if (io_op_pollable(sqe))
+        return io_issue_pollable(ctx, sqe, may_arm, queued);
+
+    switch (sqe->opcode)
+    {
+        case IORING_OP_NOP:
+            return 0;
+        case IORING_OP_READ:
+        case IORING_OP_READV:
+            return io_rw(ctx, sqe, false);
+        case IORING_OP_WRITE:
+        case IORING_OP_WRITEV:
+            return io_rw(ctx, sqe, true);
+        case IORING_OP_FSYNC:
+            if (sqe->fsync_flags & ~IORING_FSYNC_DATASYNC)
+                return -EINVAL;
+            return sqe->fsync_flags & IORING_FSYNC_DATASYNC ? sys_fdatasync(sqe->fd)
+                                                            : sys_fsync(sqe->fd);
+        default:
+            return -EINVAL;
+    }
+}
+
+static long io_wait_inflight(struct io_ring_ctx *ctx)
+{
+    return wait_for_event_interruptible(&ctx->ring_wait,
+                                        __atomic_load_n(&ctx->nr_inflight, __ATOMIC_ACQUIRE) == 0);
+}
+
+/**
+ * @brief Consume and execute SQEs
+ * Must be called with uring_lock held.
+ *
+ * @param ctx Ring
+ * @param to_submit Maximum number of SQEs to consume
+ * @return Number of SQEs consumed, or -EBUSY if the CQ is full
+ */
+static int io_submit_sqes(struct io_ring_ctx *ctx, u32 to_submit)
+{
+    struct io_rings *rings = ctx->rings;
+    struct io_uring_sqe sqe;
+    bool link_failed = false;
+    bool in_link = false;
+    u32 submitted = 0;
+
+    MUST_HOLD_MUTEX(&ctx->uring_lock);
+    to_submit = cul::min(to_submit, io_sq_pending(ctx));
+
+    if (to_submit == 0)
+        return 0;
+
+    blk_plug_guard plug;
+
+    while (submitted < to_submit)
+    {
+        /* Every SQE posts exactly one CQE, so we never overflow the CQ. Stop if it's full, or
+         * if async ops will fill it. */
+        if (io_cq_ready(ctx) + READ_ONCE(ctx->nr_inflight) >= ctx->cq_entries)
+            break;
+
+        u32 idx = READ_ONCE(ctx->sq_array[ctx->cached_sq_head & rings->sq_ring_mask]);
+        ctx->cached_sq_head++;
+        submitted++;
+
+        if (idx >= ctx->sq_entries)
+        {
+            WRITE_ONCE(rings->sq_dropped, rings->sq_dropped + 1);
+            continue;
+        }
+
+        /* Copy the SQE, so userspace may reuse the slot as soon as we move the head */
+        memcpy(&sqe, &ctx->sqes[idx], sizeof(sqe));
+        __atomic_store_n(&rings->sq.head, ctx->cached_sq_head, __ATOMIC_RELEASE);
+
+        /* Ops run in order, except for the ones that go async. IOSQE_IO_DRAIN waits for those
+         * to complete, and chains never go async, so IOSQE_IO_LINK ordering is implicit. We
+         * only need to cancel the rest of a chain if one of its links failed. */
+        bool queued = false;
+        bool linked = in_link || sqe.flags & IOSQE_IO_LINK;
+        ssize_t res;
+
+        if (link_failed)
+            res = -ECANCELED;
+        else if (sqe.flags & IOSQE_IO_DRAIN && io_wait_inflight(ctx) < 0)
+            res = -EINTR;
+        else
+            res = io_issue_sqe(ctx, &sqe, !linked, &queued);
+
+        in_link = sqe.flags & IOSQE_IO_LINK;
+        if (in_link)
+            link_failed = link_failed || res < 0;
+        else
+            link_failed = false;
+
+        if (!queued)
+            io_post_cqe(ctx, sqe.user_data, (s32) res);
+    }
+
+    __atomic_store_n(&rings->sq.head, ctx->cached_sq_head, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ctx->ring_wait);
+    return submitted ? (int) submitted : -EBUSY;
+}
+
+static void io_sq_thread_exit(struct io_ring_ctx *ctx)
+{
+    struct thread *current = get_current_thread();
+
+    /* Give the process' context back before dying */
+    vm_set_aspace(&kernel_address_space);
+    current->owner = nullptr;
+    ctx->sq_mm->unref();
+    process_put(ctx->sq_proc);
+
+    __atomic_store_n(&ctx->sq_dead, true, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ctx->ring_wait);
+    io_ring_ctx_put(ctx);
+    thread_exit();
+}
+
+static void io_sq_thread(void *arg)
+{
+    struct io_ring_ctx *ctx = (struct io_ring_ctx *) arg;
+    hrtime_t idle_until = clocksource_get_time() + ctx->sq_idle;
+
+    while (!READ_ONCE(ctx->sq_stop))
+    {
+        /* If the owner exited or exec'd, its address space is gone from under us. Stop, else
+         * we'd keep the mm (and the mm keeps our ring mapped) alive forever. */
+        if (ctx->sq_proc->get_aspace() != ctx->sq_mm)
+            break;
+
+        if (io_sq_pending(ctx) > 0)
+        {
+            mutex_lock(&ctx->uring_lock);
+            io_submit_sqes(ctx, UINT_MAX);
+            mutex_unlock(&ctx->uring_lock);
+            idle_until = clocksource_get_time() + ctx->sq_idle;
+            sched_yield();
+            continue;
+        }
+
+        if (clocksource_get_time() < idle_until)
+        {
+            cpu_relax();
+            sched_yield();
+            continue;
+        }
+
+        /* Go to sleep. Userspace must now kick us with IORING_ENTER_SQ_WAKEUP */
+        __atomic_or_fetch(&ctx->rings->sq_flags, IORING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        if (io_sq_pending(ctx) == 0)
+        {
+            /* Periodically wake up to check if our owner is still around */
+            (void) wait_for_event_timeout(
+                &ctx->sq_wait, READ_ONCE(ctx->sq_wake) || READ_ONCE(ctx->sq_stop), NS_PER_SEC);
+        }
+
+        WRITE_ONCE(ctx->sq_wake, false);
+        __atomic_and_fetch(&ctx->rings->sq_flags, ~IORING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+        idle_until = clocksource_get_time() + ctx->sq_idle;
+    }
+
+    io_sq_thread_exit(ctx);
+}
+
+static int io_sq_thread_start(struct io_ring_ctx *ctx, const struct io_uring_params *p)
+{
+    if (p->flags & IORING_SETUP_SQ_AFF && p->sq_thread_cpu >= get_nr_cpus())
+        return -EINVAL;
+
+    ctx->sq_idle = (p->sq_thread_idle ?: IORING_SQ_IDLE_DEFAULT) * NS_PER_MS;
+    ctx->sq_thread = io_create_thread(ctx, io_sq_thread, &ctx->sq_proc, &ctx->sq_mm);
+    if (!ctx->sq_thread)
+        return -ENOMEM;
+
+    if (p->flags & IORING_SETUP_SQ_AFF)
+        sched_start_thread_for_cpu(ctx->sq_thread, p->sq_thread_cpu);
+    else
+        sched_start_thread(ctx->sq_thread);
+    return 0;
+}
+
+// Our VMO ops are a noop, since we fill the VMOs out with every page upfront
+const static struct vm_object_ops io_uring_vmo_ops = {};
+
+static void *io_uring_alloc_shared(size_t pages, struct vm_object **pvmo)
+{
+    void *buf = vmalloc(pages, VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!buf)
+        return nullptr;
+
+    memset(buf, 0, pages << PAGE_SHIFT);
+
+    size_t off;
+    struct vm_object *vmo = vmo_create(pages << PAGE_SHIFT, nullptr);
+    if (!vmo)
+        goto err;
+
+    vmo->ops = &io_uring_vmo_ops;
+
+    off = 0;
+    for (struct page *p = vmalloc_to_pages(buf); p; p = p->next_un.next_allocation)
+    {
+        page_ref(p);
+        if (vmo_add_page(off, p, vmo) < 0)
+        {
+            page_unref(p);
+            goto err_vmo;
+        }
+        off += PAGE_SIZE;
+    }
+
+    *pvmo = vmo;
+    return buf;
+err_vmo:
+    /* Drops the references the VMO holds on the pages we already added */
+    vmo_unref(vmo);
+err:
+    vfree(buf, pages);
+    return nullptr;
+}
+
+static int io_ring_ctx_alloc_rings(struct io_ring_ctx *ctx)
+{
+    size_t sq_array_off =
+        ALIGN_TO(sizeof(struct io_rings) + ctx->cq_entries * sizeof(struct io_uring_cqe), 64);
+    size_t rings_size = sq_array_off + ctx->sq_entries * sizeof(u32);
+
+    ctx->rings_pages = vm_size_to_pages(rings_size);
+    ctx->rings = (struct io_rings *) io_uring_alloc_shared(ctx->rings_pages, &ctx->rings_vmo);
+    if (!ctx->rings)
+        return -ENOMEM;
+
+    ctx->sqes_pages = vm_size_to_pages(ctx->sq_entries * sizeof(struct io_uring_sqe));
+    ctx->sqes = (struct io_uring_sqe *) io_uring_alloc_shared(ctx->sqes_pages, &ctx->sqes_vmo);
+    if (!ctx->sqes)
+        return -ENOMEM;
+
+    ctx->sq_array = (u32 *) ((char *) ctx->rings + sq_array_off);
+    ctx->rings->sq_ring_mask = ctx->sq_entries - 1;
+    ctx->rings->cq_ring_mask = ctx->cq_entries - 1;
+    ctx->rings->sq_ring_entries = ctx->sq_entries;
+    ctx->rings->cq_ring_entries = ctx->cq_entries;
+    return 0;
+}
+
+static void io_fill_offsets(struct io_ring_ctx *ctx, struct io_uring_params *p)
+{
+    memset(&p->sq_off, 0, sizeof(p->sq_off));
+    p->sq_off.head = offsetof(struct io_rings, sq.head);
+    p->sq_off.tail = offsetof(struct io_rings, sq.tail);
+    p->sq_off.ring_mask = offsetof(struct io_rings, sq_ring_mask);
+    p->sq_off.ring_entries = offsetof(struct io_rings, sq_ring_entries);
+    p->sq_off.flags = offsetof(struct io_rings, sq_flags);
+    p->sq_off.dropped = offsetof(struct io_rings, sq_dropped);
+    p->sq_off.array = (u32) ((char *) ctx->sq_array - (char *) ctx->rings);
+
+    memset(&p->cq_off, 0, sizeof(p->cq_off));
+    p->cq_off.head = offsetof(struct io_rings, cq.head);
+    p->cq_off.tail = offsetof(struct io_rings, cq.tail);
+    p->cq_off.ring_mask = offsetof(struct io_rings, cq_ring_mask);
+    p->cq_off.ring_entries = offsetof(struct io_rings, cq_ring_entries);
+    p->cq_off.overflow = offsetof(struct io_rings, cq_overflow);
+    p->cq_off.cqes = offsetof(struct io_rings, cqes);
+    p->cq_off.flags = offsetof(struct io_rings, cq_flags);
+}
+
+static void *io_uring_mmap(struct vm_area_struct *area, struct file *filp)
+{
+    struct io_ring_ctx *ctx = (struct io_ring_ctx *) filp->private_data;
+    struct vm_object *vmo;
+
+    if (!vma_shared(area))
+        return errno = EINVAL, nullptr;
+
+    switch (area->vm_offset)
+    {
+        case IORING_OFF_SQ_RING:
+        case IORING_OFF_CQ_RING:
+            vmo = ctx->rings_vmo;
+            break;
+        case IORING_OFF_SQES:
+            vmo = ctx->sqes_vmo;
+            break;
+        default:
+            return errno = EINVAL, nullptr;
+    }
+
+    if (vma_pages(area) > vmo->size >> PAGE_SHIFT)
+        return errno = EINVAL, nullptr;
+
+    /* The offset only selects the object, each of them starts at 0 */
+    area->vm_offset = 0;
+    area->vm_obj = vmo;
+    vmo_ref(vmo);
+    vmo_assign_mapping(vmo, area);
+    return (void *) area->vm_start;
+}
+
+static short io_uring_poll(void *poll_file, short events, struct file *filp)
+{
+    struct io_ring_ctx *ctx = (struct io_ring_ctx *) filp->private_data;
+    short revents = 0;
+
+    poll_wait_helper(poll_file, &ctx->ring_wait);
+
+    if (io_cq_ready(ctx) > 0)
+        revents |= POLLIN | POLLRDNORM;
+    if (io_sq_pending(ctx) < ctx->sq_entries)
+        revents |= POLLOUT | POLLWRNORM;
+    return revents & events;
+}
+
+static void io_uring_release(struct file *filp)
+{
+    struct io_ring_ctx *ctx = (struct io_ring_ctx *) filp->private_data;
+
+    if (ctx->sq_thread)
+    {
+        /* The SQ thread drops its own reference when it exits */
+        WRITE_ONCE(ctx->sq_stop, true);
+        wait_queue_wake_all(&ctx->sq_wait);
+    }
+
+    /* The SQ thread may still be submitting, so serialize against io_arm_async. The async worker
+     * cancels whatever is still armed, and drops its own reference when it exits. */
+    mutex_lock(&ctx->uring_lock);
+    WRITE_ONCE(ctx->async_stop, true);
+    if (ctx->async_thread)
+        wait_queue_wake_all(&ctx->async_wait);
+    mutex_unlock(&ctx->uring_lock);
+
+    io_ring_ctx_put(ctx);
+}
+
+static struct file_ops io_uring_fops = {
+    .mmap = io_uring_mmap,
+    .poll = io_uring_poll,
+    .release = io_uring_release,
+};
+
+static u32 io_roundup_pow2(u32 n)
+{
+    return n <= 1 ? 1 : 1U << (ilog2(n - 1) + 1);
+}
+
+int sys_io_uring_setup(u32 entries, struct io_uring_params *uparams)
+{
+    struct io_uring_params p;
+    struct io_ring_ctx *ctx;
+    struct file *filp;
+    int st, fd;
+
+    if (copy_from_user(&p, uparams, sizeof(p)) < 0)
+        return -EFAULT;
+
+    for (u32 resv : p.resv)
+    {
+        if (resv)
+            return -EINVAL;
+    }
+
+    if (p.flags & ~IORING_SETUP_VALID)
+        return -EINVAL;
+    if (p.flags & IORING_SETUP_SQ_AFF && !(p.flags & IORING_SETUP_SQPOLL))
+        return -EINVAL;
+    if (entries == 0 || entries > IORING_MAX_ENTRIES)
+        return -EINVAL;
+
+    entries = io_roundup_pow2(entries);
+    p.sq_entries = entries;
+
+    if (p.flags & IORING_SETUP_CQSIZE)
+    {
+        if (p.cq_entries < entries || p.cq_entries > IORING_MAX_CQ_ENTRIES)
+            return -EINVAL;
+        p.cq_entries = io_roundup_pow2(p.cq_entries);
+    }
+    else
+        p.cq_entries = entries * 2;
+
+    ctx = new io_ring_ctx{};
+    if (!ctx)
+        return -ENOMEM;
+
+    ctx->refcount = 1;
+    ctx->flags = p.flags;
+    ctx->sq_entries = p.sq_entries;
+    ctx->cq_entries = p.cq_entries;
+    mutex_init(&ctx->uring_lock);
+    spinlock_init(&ctx->cq_lock);
+    init_wait_queue_head(&ctx->ring_wait);
+    init_wait_queue_head(&ctx->sq_wait);
+    spinlock_init(&ctx->async_lock);
+    INIT_LIST_HEAD(&ctx->async_reqs);
+    INIT_LIST_HEAD(&ctx->async_ready);
+    init_wait_queue_head(&ctx->async_wait);
+
+    if (st = io_ring_ctx_alloc_rings(ctx); st < 0)
+        goto err;
+
+    io_fill_offsets(ctx, &p);
+    p.features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE;
+
+    if (copy_to_user(uparams, &p, sizeof(p)) < 0)
+    {
+        st = -EFAULT;
+        goto err;
+    }
+
+    filp = anon_inode_open(S_IFREG, &io_uring_fops, "[io_uring]");
+    if (!filp)
+    {
+        st = -ENOMEM;
+        goto err;
+    }
+
+    /* From now on, the file owns our reference */
+    filp->private_data = ctx;
+
+    if (p.flags & IORING_SETUP_SQPOLL)
+    {
+        if (st = io_sq_thread_start(ctx, &p); st < 0)
+        {
+            fd_put(filp);
+            return st;
+        }
+    }
+
+    fd = open_with_vnode(filp, O_RDWR | O_CLOEXEC);
+    fd_put(filp);
+    return fd;
+err:
+    io_ring_ctx_free(ctx);
+    return st;
+}
+
+static long io_wait_sq_space(struct io_ring_ctx *ctx)
+{
+    return wait_for_event_interruptible(&ctx->ring_wait, io_sq_pending(ctx) < ctx->sq_entries);
+}
+
+/* Check if anyone may still post CQEs for what was submitted */
+static bool io_cqes_pending(struct io_ring_ctx *ctx)
+{
+    if (ctx->flags & IORING_SETUP_SQPOLL)
+        return !__atomic_load_n(&ctx->sq_dead, __ATOMIC_ACQUIRE);
+    /* Without an SQ thread, only async ops complete after io_uring_enter(2) returns */
+    return __atomic_load_n(&ctx->nr_inflight, __ATOMIC_ACQUIRE) > 0;
+}
+
+static long io_wait_cqes(struct io_ring_ctx *ctx, u32 min_complete)
+{
+    return wait_for_event_interruptible(
+        &ctx->ring_wait, io_cq_ready(ctx) >= min_complete || !io_cqes_pending(ctx));
+}
+
+int sys_io_uring_enter(unsigned int fd, u32 to_submit, u32 min_complete, u32 flags,
+                       const void *sig, size_t sigsz)
+{
+    int submitted = 0;
+    bool valid_sigmask = false;
+    sigset_t set;
+
+    if (flags & ~IORING_ENTER_VALID)
+        return -EINVAL;
+
+    if (sig && flags & IORING_ENTER_GETEVENTS)
+    {
+        if (sigsz != sizeof(sigset_t))
+            return -EINVAL;
+        valid_sigmask = true;
+        if (copy_from_user(&set, sig, sizeof(set)) < 0)
+            return -EFAULT;
+    }
+
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -EBADF;
+
+    if (f.get_file()->f_ino->i_fops != &io_uring_fops)
+        return -EOPNOTSUPP;
+
+    struct io_ring_ctx *ctx = (struct io_ring_ctx *) f.get_file()->private_data;
+
+    if (ctx->flags & IORING_SETUP_SQPOLL)
+    {
+        if (__atomic_load_n(&ctx->sq_dead, __ATOMIC_ACQUIRE))
+            return -EOWNERDEAD;
+
+        if (flags & IORING_ENTER_SQ_WAKEUP)
+        {
+            WRITE_ONCE(ctx->sq_wake, true);
+            wait_queue_wake_all(&ctx->sq_wait);
+        }
+
+        if (flags & IORING_ENTER_SQ_WAIT)
+        {
+            if (long st = io_wait_sq_space(ctx); st < 0)
+                return st;
+        }
+
+        submitted = to_submit;
+    }
+    else if (to_submit > 0)
+    {
+        mutex_lock(&ctx->uring_lock);
+        submitted = io_submit_sqes(ctx, to_submit);
+        mutex_unlock(&ctx->uring_lock);
+        if (submitted < 0)
+            return submitted;
+    }
+
+    if (flags & IORING_ENTER_GETEVENTS)
+    {
+        auto_signal_mask mask_guard{valid_sigmask, set};
+        long st = io_wait_cqes(ctx, cul::min(min_complete, ctx->cq_entries));
+        if (st == -EINTR)
+        {
+            /* Let the signal be delivered with the temporary mask */
+            mask_guard.disable();
+        }
+
+        if (st < 0 && submitted == 0)
+            return st;
+    }
+
+    return submitted;
+}
@@ -19,7 +19,9 @@
 #include <onyx/kunit.h>
 #include <onyx/limits.h>
 #include <onyx/mm/slab.h>
+#include <onyx/page_iov.h>
 #include <onyx/panic.h>
+#include <onyx/pipe.h>
 #include <onyx/poll.h>
 #include <onyx/process.h>
 #include <onyx/scoped_lock.h>
@@ -49,6 +51,9 @@ struct pipe_buffer
     struct list_head list_node;
     unsigned int len_;
     unsigned int offset_{0};
+    /* The page may be referenced by someone else (the page cache, another pipe, vmsplice'd user
+     * memory), so it's read-only for us and can't be recycled */
+    bool shared_{false};
 
     pipe_buffer(struct page *page, unsigned int len) : page_{page}, len_{len}
     {
@@ -70,7 +75,8 @@ struct pipe_buffer
     {
         if (page_)
         {
-            DCHECK_PAGE(page_->ref == 1, page_);
+            if (!shared_)
+                DCHECK_PAGE(page_->ref == 1, page_);
             page_unref(page_);
         }
     }
@@ -126,6 +132,9 @@ private:
     }
 
     ssize_t append_iter(iovec_iter *iter, bool atomic);
+    void consume(pipe_buffer *pbf, size_t len) REQUIRES(pipe_lock);
+    long wait_for_data(unsigned int flags) REQUIRES(pipe_lock);
+    long wait_for_space(unsigned int flags) REQUIRES(pipe_lock);
 
 public:
     size_t reader_count{1};
@@ -141,6 +150,10 @@ public:
     short poll(struct file *filp, void *poll_file, short events);
     ssize_t read_iter(iovec_iter *iter, unsigned int flags);
     ssize_t write_iter(iovec_iter *iter, int flags);
+    ssize_t splice_in(const struct page_iov *vec, size_t nr, unsigned int flags);
+    ssize_t splice_out(size_t len, unsigned int flags, pipe_splice_actor_t actor, void *ctx);
+    ssize_t space_for_splice(unsigned int flags);
+    static ssize_t transfer(pipe *in, pipe *out, size_t len, unsigned int flags, bool move);
 
     void wake_all(wait_queue *wq)
     {
@@ -229,7 +242,8 @@ ssize_t pipe::append_iter(iovec_iter *iter, bool atomic)
     {
         auto last_buf = container_of(list_last_element(&pipe_buffers), pipe_buffer, list_node);
         unsigned int buf_tail = last_buf->len_ + last_buf->offset_;
-        unsigned int avail_buf = min(PAGE_SIZE - buf_tail, avail);
+        /* We can't write to pages we don't own */
+        unsigned int avail_buf = last_buf->shared_ ? 0 : min(PAGE_SIZE - buf_tail, avail);
 
         // See if we have space in this pipe buffer
         // TODO: Idea to test: memmove data back if we have offset != 0
@@ -558,7 +572,7 @@ ssize_t pipe::read_iter(iovec_iter *iter, unsigned int flags)
             list_remove(&pbf->list_node);
 
             // Check if we have a cached page. If not, cache this one, else let it go.
-            if (!cached_page)
+            if (!cached_page && !pbf->shared_)
             {
                 cached_page = pbf->steal_page();
             }
@@ -672,6 +686,304 @@ ssize_t pipe_write_iter(struct file *filp, size_t off, iovec_iter *iter, unsigne
     return p->write_iter(iter, filp->f_flags);
 }
 
+/**
+ * @brief Consume len bytes from a pipe buffer, and free it if it's now empty
+ *
+ * @param pbf Pipe buffer
+ * @param len Length to consume
+ */
+void pipe::consume(pipe_buffer *pbf, size_t len)
+{
+    pbf->offset_ += len;
+    pbf->len_ -= len;
+    curr_len -= len;
+
+    if (pbf->len_ == 0)
+    {
+        list_remove(&pbf->list_node);
+        if (!cached_page && !pbf->shared_)
+            cached_page = pbf->steal_page();
+        delete pbf;
+    }
+}
+
+/**
+ * @brief Wait for data to show up in the pipe
+ *
+ * @param flags SPLICE_F_* flags
+ * @return 1 if there's data, 0 on EOF, or negative error code
+ */
+long pipe::wait_for_data(unsigned int flags)
+{
+    if (can_read())
+        return 1;
+    if (writer_count == 0)
+        return 0;
+    if (flags & SPLICE_F_NONBLOCK)
+        return -EAGAIN;
+
+    long st = wait_for_event_mutex_interruptible(&read_queue, can_read_or_eof(), &pipe_lock);
+    if (st < 0)
+        return st;
+    return can_read() ? 1 : 0;
+}
+
+/**
+ * @brief Wait for space in the pipe
+ *
+ * @param flags SPLICE_F_* flags
+ * @return 1 if there's space, or negative error code
+ */
+long pipe::wait_for_space(unsigned int flags)
+{
+    if (reader_count != 0 && available_space() == 0)
+    {
+        if (flags & SPLICE_F_NONBLOCK)
+            return -EAGAIN;
+
+        long st = wait_for_event_mutex_interruptible(
+            &write_queue, available_space() > 0 || reader_count == 0, &pipe_lock);
+        if (st < 0)
+            return st;
+    }
+
+    if (reader_count == 0)
+    {
+        CALL_KUNIT_MOCKABLE(kernel_raise_signal, SIGPIPE, get_current_process(), 0, nullptr);
+        return -EPIPE;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Add references to pages to the pipe, without copying their contents
+ *
+ * @param vec Pages to add (we grab our own references)
+ * @param nr Number of pages
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes added, or negative error code
+ */
+ssize_t pipe::splice_in(const struct page_iov *vec, size_t nr, unsigned int flags)
+{
+    ssize_t ret = 0;
+
+    scoped_mutex g{pipe_lock};
+
+    bool wasempty = !can_read();
+
+    for (size_t i = 0; i < nr; i++)
+    {
+        /* Only block if we haven't done anything yet */
+        long st = wait_for_space(ret ? flags | SPLICE_F_NONBLOCK : flags);
+        if (st < 0)
+        {
+            if (!ret)
+                ret = st;
+            break;
+        }
+
+        unsigned int len = min((size_t) vec[i].length, available_space());
+        auto pbf = new pipe_buffer{vec[i].page, len};
+        if (!pbf)
+        {
+            if (!ret)
+                ret = -ENOMEM;
+            break;
+        }
+
+        page_ref(vec[i].page);
+        pbf->offset_ = vec[i].page_off;
+        pbf->shared_ = true;
+        list_add_tail(&pbf->list_node, &pipe_buffers);
+        curr_len += len;
+        ret += len;
+
+        if (len < vec[i].length)
+            break;
+    }
+
+    g.unlock();
+
+    if (wasempty && ret > 0)
+        wake_all(&read_queue);
+
+    return ret;
+}
+
+/**
+ * @brief Hand the pipe's pages over to an actor, consuming whatever it takes
+ *
+ * @param len Maximum length to consume
+ * @param flags SPLICE_F_* flags
+ * @param actor Actor, returns the number of bytes it consumed (or negative error code)
+ * @param ctx Context for the actor
+ * @return Number of bytes consumed, 0 on EOF, or negative error code
+ */
+ssize_t pipe::splice_out(size_t len, unsigned int flags, pipe_splice_actor_t actor, void *ctx)
+{
+    ssize_t ret = 0;
+
+    scoped_mutex g{pipe_lock};
+
+    if (long st = wait_for_data(flags); st <= 0)
+        return st;
+
+    bool wasfull = available_space() < PIPE_BUF;
+
+    while (len > 0 && can_read())
+    {
+        auto pbf = first_buf();
+        struct page_iov v;
+        v.page = pbf->page_;
+        v.page_off = pbf->offset_;
+        v.length = min((size_t) pbf->len_, len);
+
+        ssize_t st = actor(&v, ctx);
+        if (st <= 0)
+        {
+            if (!ret)
+                ret = st;
+            break;
+        }
+
+        consume(pbf, st);
+        len -= st;
+        ret += st;
+
+        if ((size_t) st < v.length)
+            break;
+    }
+
+    g.unlock();
+
+    if (wasfull && ret > 0)
+        wake_all(&write_queue);
+
+    return ret;
+}
+
+/**
+ * @brief Wait for space in the pipe, for splice
+ *
+ * @param flags SPLICE_F_* flags
+ * @return Available space, or negative error code
+ */
+ssize_t pipe::space_for_splice(unsigned int flags)
+{
+    scoped_mutex g{pipe_lock};
+
+    if (long st = wait_for_space(flags); st < 0)
+        return st;
+    return available_space();
+}
+
+/**
+ * @brief Transfer data between two pipes, without copying
+ *
+ * @param in Pipe to read from
+ * @param out Pipe to write to
+ * @param len Maximum length to transfer
+ * @param flags SPLICE_F_* flags
+ * @param move If true, consume the data from in (splice). Else, leave it there (tee).
+ * @return Number of bytes transferred, 0 on EOF, or negative error code
+ */
+ssize_t pipe::transfer(pipe *in, pipe *out, size_t len, unsigned int flags, bool move)
+    NO_THREAD_SAFETY_ANALYSIS
+{
+    ssize_t ret = 0;
+    /* Lock ordering is by address */
+    pipe *first = in < out ? in : out;
+    pipe *second = in < out ? out : in;
+
+    DCHECK(in != out);
+
+    if (len == 0)
+        return 0;
+
+    for (;;)
+    {
+        /* Wait for both ends with a single lock held, then check again with both of them */
+        {
+            scoped_mutex g{in->pipe_lock};
+            if (long st = in->wait_for_data(flags); st <= 0)
+                return st;
+        }
+
+        {
+            scoped_mutex g{out->pipe_lock};
+            if (long st = out->wait_for_space(flags); st < 0)
+                return st;
+        }
+
+        mutex_lock(&first->pipe_lock);
+        mutex_lock(&second->pipe_lock);
+
+        if (in->can_read() && out->available_space() > 0 && out->reader_count > 0)
+            break;
+
+        mutex_unlock(&second->pipe_lock);
+        mutex_unlock(&first->pipe_lock);
+    }
+
+    bool out_wasempty = !out->can_read();
+    bool in_wasfull = in->available_space() < PIPE_BUF;
+
+    list_for_every_safe (&in->pipe_buffers)
+    {
+        auto pbf = container_of(l, pipe_buffer, list_node);
+        size_t avail = out->available_space();
+        if (len == 0 || avail == 0)
+            break;
+
+        size_t this_len = min(min(len, avail), (size_t) pbf->len_);
+
+        if (move && this_len == pbf->len_)
+        {
+            /* Just steal the whole buffer */
+            list_remove(&pbf->list_node);
+            in->curr_len -= this_len;
+            list_add_tail(&pbf->list_node, &out->pipe_buffers);
+        }
+        else
+        {
+            auto nbuf = new pipe_buffer{pbf->page_, (unsigned int) this_len};
+            if (!nbuf)
+            {
+                if (!ret)
+                    ret = -ENOMEM;
+                break;
+            }
+
+            page_ref(pbf->page_);
+            nbuf->offset_ = pbf->offset_;
+            nbuf->shared_ = true;
+            pbf->shared_ = true;
+            list_add_tail(&nbuf->list_node, &out->pipe_buffers);
+
+            if (move)
+                in->consume(pbf, this_len);
+        }
+
+        out->curr_len += this_len;
+        len -= this_len;
+        ret += this_len;
+    }
+
+    mutex_unlock(&second->pipe_lock);
+    mutex_unlock(&first->pipe_lock);
+
+    if (ret > 0)
+    {
+        if (out_wasempty)
+            out->wake_all(&out->read_queue);
+        if (move && in_wasfull)
+            in->wake_all(&in->write_queue);
+    }
+
+    return ret;
+}
+
 const struct file_ops pipe_ops = {
     .read = pipe_read,
     .write = pipe_write,
@@ -976,6 +1288,111 @@ int pipe_do_fifo(inode *ino)
     return 0;
 }
 
+/**
+ * @brief Get the pipe behind a file
+ *
+ * @param filp File
+ * @return The pipe, or nullptr if filp is not a pipe
+ */
+struct pipe *file_to_pipe(struct file *filp)
+{
+    const struct file_ops *fops = filp->f_ino->i_fops;
+    if (fops != &pipe_ops && fops != &named_pipe_ops)
+        return nullptr;
+    return get_pipe(filp->f_ino->i_pipe);
+}
+
+/**
+ * @brief Add references to pages to the pipe, without copying their contents
+ *
+ * @param pipe Pipe
+ * @param vec Pages to add (the pipe grabs its own references)
+ * @param nr Number of pages
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes added, or negative error code
+ */
+ssize_t pipe_splice_pages(struct pipe *pipe, const struct page_iov *vec, size_t nr,
+                          unsigned int flags)
+{
+    return pipe->splice_in(vec, nr, flags);
+}
+
+/**
+ * @brief Hand the pipe's pages over to an actor, consuming whatever it takes
+ *
+ * @param pipe Pipe
+ * @param len Maximum length to consume
+ * @param flags SPLICE_F_* flags
+ * @param actor Actor, returns the number of bytes it consumed (or negative error code)
+ * @param ctx Context for the actor
+ * @return Number of bytes consumed, 0 on EOF, or negative error code
+ */
+ssize_t pipe_splice_out(struct pipe *pipe, size_t len, unsigned int flags,
+                        pipe_splice_actor_t actor, void *ctx)
+{
+    return pipe->splice_out(len, flags, actor, ctx);
+}
+
+/**
+ * @brief Wait for space in the pipe, for splice
+ *
+ * @param pipe Pipe
+ * @param flags SPLICE_F_* flags
+ * @return Available space, or negative error code
+ */
+ssize_t pipe_splice_space(struct pipe *pipe, unsigned int flags)
+{
+    return pipe->space_for_splice(flags);
+}
+
+/**
+ * @brief Move data from one pipe to another, without copying
+ *
+ * @param in Pipe to read from
+ * @param out Pipe to write to
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes moved, 0 on EOF, or negative error code
+ */
+ssize_t pipe_splice_pipe(struct pipe *in, struct pipe *out, size_t len, unsigned int flags)
+{
+    return pipe::transfer(in, out, len, flags, true);
+}
+
+/**
+ * @brief Duplicate data from one pipe into another, without consuming it or copying it
+ *
+ * @param in Pipe to read from
+ * @param out Pipe to write to
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Number of bytes duplicated, 0 on EOF, or negative error code
+ */
+ssize_t pipe_tee(struct pipe *in, struct pipe *out, size_t len, unsigned int flags)
+{
+    return pipe::transfer(in, out, len, flags, false);
+}
+
+/**
+ * @brief Allocate a pipe for internal use (e.g sendfile), not backed by any file
+ *
+ * @return The pipe, or nullptr
+ */
+struct pipe *pipe_alloc_internal()
+{
+    return new pipe{};
+}
+
+/**
+ * @brief Free a pipe allocated with pipe_alloc_internal
+ *
+ * @param pipe Pipe
+ */
+void pipe_free_internal(struct pipe *pipe)
+{
+    pipe->unref();
+}
+
 #ifdef CONFIG_KUNIT
 
 TEST(pipe, rw_works)
@@ -1083,4 +1500,50 @@ TEST(pipe, readv_works)
     EXPECT_EQ(total_read, 2);
 }
 
+TEST(pipe, splice_pages_works)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+    auto p = make_refc<pipe>();
+
+    struct page *page = alloc_page(GFP_KERNEL);
+    ASSERT_NONNULL(page);
+    memcpy(PAGE_TO_VIRT(page), "Hello", 6);
+
+    struct page_iov v;
+    v.page = page;
+    v.page_off = 0;
+    v.length = 6;
+    ASSERT_EQ(p->splice_in(&v, 1, 0), 6);
+    EXPECT_EQ(page->ref, 2U);
+
+    /* Writes must not go to a page we don't own */
+    EXPECT_EQ(p->write(0, 1, "A"), 1);
+    EXPECT_EQ(((char *) PAGE_TO_VIRT(page))[6], 0);
+
+    char buf[7];
+    ASSERT_EQ(p->read(0, 7, buf), 7);
+    EXPECT_EQ(memcmp(buf, "Hello\0A", 7), 0);
+    EXPECT_EQ(page->ref, 1U);
+    page_unref(page);
+}
+
+TEST(pipe, tee_works)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+    auto in = make_refc<pipe>();
+    auto out = make_refc<pipe>();
+
+    ASSERT_EQ(in->write(0, 4, "abcd"), 4);
+    ASSERT_EQ(pipe::transfer(in.get(), out.get(), 2, 0, false), 2);
+    EXPECT_EQ(in->get_unread_len(), 4U);
+    EXPECT_EQ(out->get_unread_len(), 2U);
+
+    ASSERT_EQ(pipe::transfer(in.get(), out.get(), 4, 0, true), 4);
+    EXPECT_EQ(in->get_unread_len(), 0U);
+
+    char buf[6];
+    ASSERT_EQ(out->read(0, 6, buf), 6);
+    EXPECT_EQ(memcmp(buf, "ababcd", 6), 0);
+}
+
 #endif
@@ -20,6 +20,8 @@ void poll_file_entry::wake_callback(void *context, struct wait_queue_token *tkn)
 
 void poll_file_entry::wait_on()
 {
+    /* Persistent tokens never wake up the thread, it's only here to mark us as queued */
+    wait_token.flags = f->get_table()->get_token_flags();
     wait_token.thread = get_current_thread();
     wait_token.context = f;
     wait_token.callback = wake_callback;
@@ -85,7 +87,10 @@ sleep_result poll_table::sleep_poll(hrtime_t timeout, bool timeout_valid) const
 
 void poll_file::signal()
 {
-    pt->signal();
+    if (auto wake_fn = pt->get_wake_fn())
+        wake_fn(this);
+    else
+        pt->signal();
 }
 
 constexpr short default_poll_return = (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM);
@@ -95,38 +100,6 @@ short default_poll(void *pf, short events, struct file *f)
     return default_poll_return & events;
 }
 
-class auto_signal_mask
-{
-private:
-    bool sigmask_valid;
-    sigset_t &temp_sigmask;
-    bool disable_{false};
-
-public:
-    auto_signal_mask(bool valid, sigset_t &set) : sigmask_valid{valid}, temp_sigmask{set}
-    {
-        if (!sigmask_valid)
-            return;
-        auto thread = get_current_thread();
-        thread->sinfo.original_sigset = thread->sinfo.set_blocked(&temp_sigmask);
-        thread->sinfo.flags |= THREAD_SIGNAL_ORIGINAL_SIGSET;
-    }
-
-    ~auto_signal_mask()
-    {
-        if (!sigmask_valid || disable_)
-            return;
-        auto thread = get_current_thread();
-        thread->sinfo.set_blocked(&thread->sinfo.original_sigset);
-        thread->sinfo.flags &= ~THREAD_SIGNAL_ORIGINAL_SIGSET;
-    }
-
-    void disable()
-    {
-        disable_ = true;
-    }
-};
-
 int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
               const sigset_t *usigmask, size_t sigsetsize)
 {
@@ -272,6 +245,33 @@ void poll_wait_helper(void *__poll_file, struct wait_queue *q)
     pf->wait(q);
 }
 
+/**
+ * @brief Wait until a single file has any of the given events pending
+ *
+ * @param filp File to poll
+ * @param events Events to wait for (POLLHUP and POLLERR are implicit)
+ * @return Returned events, or -EINTR if interrupted by a signal
+ */
+int poll_one_file(struct file *filp, short events)
+{
+    poll_table pt;
+    /* poll_file drops a reference when it goes away */
+    fd_get(filp);
+    poll_file pf{-1, &pt, filp, events, nullptr};
+
+    for (;;)
+    {
+        short revents = poll_vfs(&pf, pf.get_efective_event_mask(), filp);
+        if (revents != 0)
+            return revents;
+
+        pt.dont_queue();
+
+        if (pt.sleep_poll(0, false) == sleep_result::signal)
+            return -EINTR;
+    }
+}
+
 #define POLLIN_SET  (POLLRDNORM | POLLRDBAND | POLLIN | POLLHUP | POLLERR)
 #define POLLOUT_SET (POLLWRBAND | POLLWRNORM | POLLOUT | POLLERR)
 #define POLLEX_SET  (POLLPRI)
@@ -10,19 +10,49 @@
 #include <stdio.h>
 
 #include <onyx/block/blk_plug.h>
+#include <onyx/file.h>
 #include <onyx/filemap.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/slab.h>
+#include <onyx/process.h>
+#include <onyx/readahead.h>
+#include <onyx/sysfs.h>
 #include <onyx/vfs.h>
 
-/* We implement a very simple readahead scheme. We maintain a readahead window (min 64KiB). When
- * doing readahead synchronously (we found a page !UPTODATE), we start reading that same page + the
- * readahead window, completely async. We set a marker (PAGE_FLAG_READAHEAD) in the middle of the RA
- * window. If (and when) we hit the marker, we double the RA window (up to 512KiB).
+#include <uapi/fcntl.h>
+
+/* Readahead works on "streams". Each struct file keeps up to RA_MAX_STREAMS sequential streams,
+ * so multiple readers interleaving on the same file (or a single reader alternating between a few
+ * regions) don't destroy each other's readahead state.
+ *
+ * When we find a page !UPTODATE (synchronous readahead), we look for a stream that covers the page.
+ * If there is none, and the access doesn't look sequential, we consider it a random access: we
+ * allocate (or recycle) a stream with an empty window and do not read ahead at all. If a subsequent
+ * access then hits the page right after it, the stream is considered sequential and we start
+ * reading ahead with a window of RA_MIN_WINDOW pages.
+ *
+ * Every readahead sets a marker (PAGE_FLAG_READAHEAD) in the window. When (and if) we hit the
+ * marker, we double the window (up to RA_MAX_WINDOW) and asynchronously read the next window,
+ * placing the marker on its first page. This keeps a full window of I/O in flight ahead of the
+ * reader. If we find pages in the stream's window that were read and then thrown out before being
+ * used (i.e the page is gone again), we are thrashing, and the window collapses.
  *
- * Known limitations: We have no "random access" penalty, we only have readahead state in the struct
- * file (multiple mmaps of the same file will share RA state), block devices can't do readahead.
+ * Known limitations: we only have readahead state in the struct file (multiple mmaps of the same
+ * file will share RA state), block devices can't do readahead.
  * */
 #define RA_MIN_WINDOW (0x10000 / PAGE_SIZE)
 
+static struct ra_stats ra_global_stats;
+
+/* Per-file stats are best-effort (multiple threads can race on the same struct file), the global
+ * ones are not. */
+#define RA_STAT_ADD(ra, stat, val)                                                    \
+    do                                                                                \
+    {                                                                                 \
+        WRITE_ONCE((ra)->ra_stats.stat, READ_ONCE((ra)->ra_stats.stat) + (val));      \
+        __atomic_add_fetch(&ra_global_stats.stat, (val), __ATOMIC_RELAXED);           \
+    } while (0)
+
 /**
  * @brief Get the next page out of the readpages state
  * The page will be returned locked.
@@ -68,13 +98,116 @@ static void readpages_finish(struct readpages_state *state) NO_THREAD_SAFETY_ANA
     }
 }
 
-static int filemap_do_readahead(struct inode *inode, struct readahead_state *ra_state,
-                                unsigned long pgoff) NO_THREAD_SAFETY_ANALYSIS
+static unsigned long ra_max_window(struct readahead_state *ra)
+{
+    return READ_ONCE(ra->ra_flags) & RA_FLAG_SEQUENTIAL ? RA_MAX_WINDOW_SEQ : RA_MAX_WINDOW;
+}
+
+static unsigned long ra_ramp_up(struct readahead_state *ra, unsigned long window)
+{
+    unsigned long max = ra_max_window(ra);
+    if (window < RA_MIN_WINDOW)
+        return RA_MIN_WINDOW;
+    return window * 2 > max ? max : window * 2;
+}
+
+/**
+ * @brief Find the stream a page belongs to
+ * A page belongs to a stream if it's inside the stream's last readahead, or right after it.
+ *
+ * @param ra Readahead state
+ * @param pgoff Page offset
+ * @return The stream, or NULL
+ */
+static struct ra_stream *ra_find_stream(struct readahead_state *ra, unsigned long pgoff)
+{
+    for (int i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        struct ra_stream *stream = &ra->ra_streams[i];
+        unsigned long next = READ_ONCE(stream->ra_next);
+        if (!next)
+            continue;
+        if (pgoff >= READ_ONCE(stream->ra_start) && pgoff <= next)
+            return stream;
+    }
+
+    return NULL;
+}
+
+static struct ra_stream *ra_find_stream_by_mark(struct readahead_state *ra, unsigned long pgoff)
+{
+    for (int i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        struct ra_stream *stream = &ra->ra_streams[i];
+        if (READ_ONCE(stream->ra_next) && READ_ONCE(stream->ra_mark) == pgoff)
+            return stream;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Grab a new stream, recycling the least recently used one
+ *
+ * @param ra Readahead state
+ * @param pgoff Page offset the stream starts at
+ * @return The new stream, with an empty window
+ */
+static struct ra_stream *ra_new_stream(struct readahead_state *ra, unsigned long pgoff)
+{
+    struct ra_stream *victim = &ra->ra_streams[0];
+    for (int i = 0; i < RA_MAX_STREAMS; i++)
+    {
+        struct ra_stream *stream = &ra->ra_streams[i];
+        if (!READ_ONCE(stream->ra_next))
+        {
+            victim = stream;
+            break;
+        }
+
+        if (READ_ONCE(stream->ra_stamp) < READ_ONCE(victim->ra_stamp))
+            victim = stream;
+    }
+
+    WRITE_ONCE(victim->ra_start, pgoff);
+    WRITE_ONCE(victim->ra_next, pgoff + 1);
+    WRITE_ONCE(victim->ra_window, 0);
+    WRITE_ONCE(victim->ra_mark, -1UL);
+    return victim;
+}
+
+static void ra_touch_stream(struct readahead_state *ra, struct ra_stream *stream)
+{
+    unsigned long clock = READ_ONCE(ra->ra_clock) + 1;
+    WRITE_ONCE(ra->ra_clock, clock);
+    WRITE_ONCE(stream->ra_stamp, clock);
+}
+
+/**
+ * @brief Read ahead a window of pages
+ * Leading pages that are already up to date are skipped, and the window is cut short at the first
+ * up to date page after that.
+ *
+ * @param inode Inode to read from
+ * @param ra Readahead state
+ * @param stream Stream we're reading for
+ * @param pgoff First page of the window
+ * @param window Size of the window, in pages
+ * @param mark Page to set PAGE_FLAG_READAHEAD on (or -1UL, for no marker)
+ * @return 0 on success, negative error codes
+ */
+static int filemap_do_readahead(struct inode *inode, struct readahead_state *ra,
+                                struct ra_stream *stream, unsigned long pgoff, unsigned long window,
+                                unsigned long mark) NO_THREAD_SAFETY_ANALYSIS
 {
     int st = 0;
     size_t size = inode->i_size;
     size_t endpg;
     struct blk_plug plug;
+    unsigned long start = pgoff;
+    unsigned long nr = 0;
+    struct page *last = NULL;
+    bool marked = false;
 
     /* Do basic bounds checks on our readahead window */
     if (!size)
@@ -85,21 +218,12 @@ static int filemap_do_readahead(struct inode *inode, struct readahead_state *ra_
         return 0;
 
     endpg = (size - 1) >> PAGE_SHIFT;
-    if (endpg <= pgoff)
+    if (endpg < pgoff)
         return 0;
 
-    unsigned long window = READ_ONCE(ra_state->ra_window);
-    unsigned long start = pgoff;
-    unsigned long mark;
-
-    if (!window)
-        window = RA_MIN_WINDOW;
-
     /* We must be careful not to get a window beyond the inode size */
-    if (pgoff + window > endpg)
-        window = endpg - pgoff;
-
-    mark = pgoff + window / 2;
+    if (window > endpg - pgoff + 1)
+        window = endpg - pgoff + 1;
 
     /* For all pages after (including) pgoff, allocate pages (if required!) and later kick off IO */
     for (unsigned long i = 0; i < window; i++)
@@ -111,64 +235,361 @@ static int filemap_do_readahead(struct inode *inode, struct readahead_state *ra_
                                NULL);
         if (st < 0)
         {
-            /* Oh no, lets backtrack */
-            for (unsigned long j = 0; j < i; j++)
+            /* Read whatever we have locked so far */
+            st = 0;
+            break;
+        }
+
+        DCHECK(page_locked(page));
+
+        if (page_flag_set(page, PAGE_FLAG_UPTODATE))
+        {
+            /* Skip leading pages that are already cached, stop at the first cached page after
+             * that. readpages needs a contiguous range. */
+            if (pgoff + i == mark)
+            {
+                page_set_flag(page, PAGE_FLAG_READAHEAD);
+                marked = true;
+            }
+
+            unlock_page(page);
+            page_unref(page);
+            if (nr == 0)
             {
-                int st2 = filemap_find_page(
-                    inode, pgoff + j, FIND_PAGE_NO_CREATE | FIND_PAGE_NO_READPAGE | FIND_PAGE_NO_RA,
-                    &page, NULL);
-                CHECK(st2 == 0);
-                /* Unlock the page and unref */
-                DCHECK(page_locked(page));
-                unlock_page(page);
-                page_unref(page);
+                start++;
+                continue;
             }
 
-            goto out;
+            break;
         }
 
         if (pgoff + i == mark)
-            page->flags |= PAGE_FLAG_READAHEAD;
-        DCHECK(page_locked(page));
+        {
+            page_set_flag(page, PAGE_FLAG_READAHEAD);
+            marked = true;
+        }
 
+        /* The page is locked and in the page cache, so it cannot go away under us */
+        last = page;
         page_unref(page);
+        nr++;
+    }
+
+    if (nr == 0)
+    {
+        /* Everything was cached. Keep the stream going from where the window ends. */
+        WRITE_ONCE(stream->ra_next, pgoff + window);
+        WRITE_ONCE(stream->ra_mark, marked ? mark : -1UL);
+        return st;
+    }
+
+    if (!marked && mark != -1UL)
+    {
+        /* We never got to the marker (the window got cut short). Mark the last page we're going to
+         * read, so the stream keeps going. */
+        mark = start + nr - 1;
+        page_set_flag(last, PAGE_FLAG_READAHEAD);
     }
 
     blk_start_plug(&plug);
-    struct readpages_state state = {inode, pgoff, window};
+    struct readpages_state state = {inode, start, nr};
     st = inode->i_fops->readpages(&state, inode);
     readpages_finish(&state);
+    blk_end_plug(&plug);
+
     if (likely(st == 0))
     {
-        WRITE_ONCE(ra_state->ra_start, start);
-        WRITE_ONCE(ra_state->ra_window, window);
-        WRITE_ONCE(ra_state->ra_mark, mark);
+        WRITE_ONCE(stream->ra_next, start + nr);
+        WRITE_ONCE(stream->ra_mark, mark);
+        RA_STAT_ADD(ra, nr_pages, nr);
     }
 
-out:
-    blk_end_plug(&plug);
     return st;
 }
 
 int filemap_do_readahead_sync(struct inode *inode, struct readahead_state *ra_state,
-                              unsigned long pgoff)
+                              unsigned long pgoff, struct page *page)
 {
-    return filemap_do_readahead(inode, ra_state, pgoff);
+    unsigned long window;
+    struct ra_stream *stream;
+    unsigned long prev = READ_ONCE(ra_state->ra_prev);
+
+    if (READ_ONCE(ra_state->ra_flags) & RA_FLAG_RANDOM)
+        return 0;
+
+    /* If the page is locked, I/O is (most likely) in flight. The reader just caught up with
+     * readahead, there's nothing for us to do but wait. */
+    if (page_locked(page))
+        return 0;
+
+    stream = ra_find_stream(ra_state, pgoff);
+    if (!stream)
+    {
+        /* We consider the access sequential if it's at the start of the file, or right after the
+         * last access. Everything else is a random access, that gets no readahead (for now). */
+        bool sequential = pgoff == 0 || pgoff == prev + 1 || pgoff == prev ||
+                          READ_ONCE(ra_state->ra_flags) & RA_FLAG_SEQUENTIAL;
+        stream = ra_new_stream(ra_state, pgoff);
+        ra_touch_stream(ra_state, stream);
+        if (!sequential)
+        {
+            RA_STAT_ADD(ra_state, nr_random, 1);
+            return 0;
+        }
+
+        window = RA_MIN_WINDOW;
+    }
+    else
+    {
+        window = READ_ONCE(stream->ra_window);
+        ra_touch_stream(ra_state, stream);
+
+        if (pgoff < READ_ONCE(stream->ra_next) && window)
+        {
+            /* We read this page ahead already, but it's gone. We're reading ahead more than
+             * memory can hold, so collapse the window. */
+            RA_STAT_ADD(ra_state, nr_thrash, 1);
+            window /= 2;
+            if (window < RA_MIN_WINDOW)
+                window = RA_MIN_WINDOW;
+        }
+        else
+        {
+            /* The reader outran our readahead (or this is the second access of a new stream) */
+            window = ra_ramp_up(ra_state, window);
+        }
+    }
+
+    WRITE_ONCE(stream->ra_start, pgoff);
+    WRITE_ONCE(stream->ra_window, window);
+    RA_STAT_ADD(ra_state, nr_sync, 1);
+    return filemap_do_readahead(inode, ra_state, stream, pgoff, window, pgoff + window / 2);
 }
 
 int filemap_do_readahead_async(struct inode *inode, struct readahead_state *ra_state,
                                unsigned long pgoff)
 {
     /* Okay, we found the PAGE_FLAG_READAHEAD page, time to kick off more IO */
-    if (READ_ONCE(ra_state->ra_mark) != pgoff)
+    struct ra_stream *stream = ra_find_stream_by_mark(ra_state, pgoff);
+    if (!stream)
     {
         /* We must've found some other READAHEAD page, do not kick off IO */
         return 1;
     }
 
-    unsigned long window = READ_ONCE(ra_state->ra_window);
+    unsigned long window = ra_ramp_up(ra_state, READ_ONCE(stream->ra_window));
+    unsigned long next = READ_ONCE(stream->ra_next);
+
+    /* The stream now covers everything from the reader's current position up to the end of the
+     * new window */
+    WRITE_ONCE(stream->ra_start, pgoff);
+    WRITE_ONCE(stream->ra_window, window);
+    ra_touch_stream(ra_state, stream);
+    RA_STAT_ADD(ra_state, nr_async, 1);
+
+    /* Pipeline the next window: put the marker on its first page, so by the time the reader gets
+     * there, we kick off the window after that. */
+    return filemap_do_readahead(inode, ra_state, stream, next, window, next);
+}
+
+static int filemap_force_readahead(struct file *filp, unsigned long start, unsigned long end)
+{
+    struct inode *inode = filp->f_ino;
+    /* Forced readahead (WILLNEED, readahead(2)) does not touch the file's streams, and does not
+     * leave markers behind. */
+    struct ra_stream stream = {};
+    int st = 0;
+
+    rw_lock_read(&inode->i_pages->truncate_lock);
+
+    while (start < end)
+    {
+        unsigned long nr = min(end - start, (unsigned long) RA_MAX_WINDOW);
+        st = filemap_do_readahead(inode, &filp->f_ra_state, &stream, start, nr, -1UL);
+        if (st < 0)
+            break;
+        start += nr;
+    }
+
+    rw_unlock_read(&inode->i_pages->truncate_lock);
+    return st;
+}
+
+static void filemap_drop_behind(struct inode *inode, unsigned long start, unsigned long end)
+{
+    /* We do not throw pages out of the page cache directly. Instead, demote clean pages to the head
+     * of the inactive list, where reclaim will find them first. */
+    for (unsigned long pgoff = start; pgoff < end; pgoff++)
+    {
+        struct page *page;
+        if (filemap_find_page(inode, pgoff,
+                              FIND_PAGE_NO_CREATE | FIND_PAGE_NO_READPAGE | FIND_PAGE_NO_RA, &page,
+                              NULL) < 0)
+            continue;
+        page_lru_demote_reclaim(page);
+        page_unref(page);
+    }
+}
+
+static bool file_can_readahead(struct file *filp)
+{
+    struct inode *inode = filp->f_ino;
+    return S_ISREG(inode->i_mode) && inode->i_pages && inode->i_fops->readpages;
+}
+
+int sys_fadvise64(int fd, off_t offset, off_t len, int advice)
+{
+    struct file *filp;
+    struct inode *inode;
+    unsigned long start, end, endpg;
+    int st = 0;
+
+    if (offset < 0 || len < 0)
+        return -EINVAL;
+
+    filp = get_file_description(fd);
+    if (!filp)
+        return -EBADF;
+
+    inode = filp->f_ino;
+    if (S_ISFIFO(inode->i_mode) || S_ISSOCK(inode->i_mode))
+    {
+        st = -ESPIPE;
+        goto out;
+    }
+
+    start = offset >> PAGE_SHIFT;
+    endpg = (inode->i_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    end = len == 0 || (unsigned long) (offset + len) < (unsigned long) offset
+              ? endpg
+              : (offset + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (end > endpg)
+        end = endpg;
 
-    if (window < RA_MAX_WINDOW)
-        WRITE_ONCE(ra_state->ra_window, window * 2);
-    return filemap_do_readahead(inode, ra_state, READ_ONCE(ra_state->ra_start) + window * 2);
+    switch (advice)
+    {
+        case POSIX_FADV_NORMAL:
+            __atomic_and_fetch(&filp->f_ra_state.ra_flags, ~(RA_FLAG_RANDOM | RA_FLAG_SEQUENTIAL),
+                               __ATOMIC_RELAXED);
+            break;
+        case POSIX_FADV_RANDOM:
+            __atomic_and_fetch(&filp->f_ra_state.ra_flags, ~RA_FLAG_SEQUENTIAL, __ATOMIC_RELAXED);
+            __atomic_or_fetch(&filp->f_ra_state.ra_flags, RA_FLAG_RANDOM, __ATOMIC_RELAXED);
+            break;
+        case POSIX_FADV_SEQUENTIAL:
+            __atomic_and_fetch(&filp->f_ra_state.ra_flags, ~RA_FLAG_RANDOM, __ATOMIC_RELAXED);
+            __atomic_or_fetch(&filp->f_ra_state.ra_flags, RA_FLAG_SEQUENTIAL, __ATOMIC_RELAXED);
+            break;
+        case POSIX_FADV_WILLNEED:
+            if (file_can_readahead(filp) && start < end)
+                st = filemap_force_readahead(filp, start, end);
+            break;
+        case POSIX_FADV_DONTNEED:
+            if (inode->i_pages && start < end)
+                filemap_drop_behind(inode, start, end);
+            break;
+        case POSIX_FADV_NOREUSE:
+            break;
+        default:
+            st = -EINVAL;
+            break;
+    }
+
+out:
+    fd_put(filp);
+    return st;
+}
+
+ssize_t sys_readahead(int fd, off_t offset, size_t count)
+{
+    struct file *filp;
+    unsigned long start, end, endpg;
+    int st = 0;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    filp = get_file_description(fd);
+    if (!filp)
+        return -EBADF;
+
+    if (!fd_may_access(filp, FILE_ACCESS_READ))
+    {
+        st = -EBADF;
+        goto out;
+    }
+
+    if (!file_can_readahead(filp))
+    {
+        st = -EINVAL;
+        goto out;
+    }
+
+    start = offset >> PAGE_SHIFT;
+    endpg = (filp->f_ino->i_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    end = (offset + count + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (end > endpg || end < start)
+        end = endpg;
+
+    if (start < end)
+        st = filemap_force_readahead(filp, start, end);
+out:
+    fd_put(filp);
+    return st;
+}
+
+ssize_t readahead_stats_read(void *buffer, size_t size, off_t off)
+{
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+                       "sync %lu\nasync %lu\nrandom %lu\nthrash %lu\npages %lu\n",
+                       READ_ONCE(ra_global_stats.nr_sync), READ_ONCE(ra_global_stats.nr_async),
+                       READ_ONCE(ra_global_stats.nr_random), READ_ONCE(ra_global_stats.nr_thrash),
+                       READ_ONCE(ra_global_stats.nr_pages));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+#define RA_FILES_BUFSIZE PAGE_SIZE
+
+/**
+ * @brief Read per-file readahead stats, for the current process' open files
+ * Files are listed by file descriptor, one per line.
+ */
+ssize_t readahead_files_read(void *buffer, size_t size, off_t off)
+{
+    struct process *current = get_current_process();
+    char *buf = kmalloc(RA_FILES_BUFSIZE, GFP_KERNEL);
+    size_t len;
+    ssize_t st;
+
+    if (!buf)
+        return -ENOMEM;
+
+    len = snprintf(buf, RA_FILES_BUFSIZE, "fd ino sync async random thrash pages\n");
+
+    /* struct files are RCU-freed, we can look at them without grabbing references */
+    rcu_read_lock();
+    struct fd_table *table = rcu_dereference(current->ctx.table);
+
+    for (unsigned int fd = 0; fd < table->file_desc_entries; fd++)
+    {
+        struct file *filp = rcu_dereference(table->file_desc[fd]);
+        if (!filp || !S_ISREG(filp->f_ino->i_mode))
+            continue;
+
+        struct ra_stats *stats = &filp->f_ra_state.ra_stats;
+        int written = snprintf(buf + len, RA_FILES_BUFSIZE - len, "%u %lu %lu %lu %lu %lu %lu\n",
+                               fd, filp->f_ino->i_inode, READ_ONCE(stats->nr_sync),
+                               READ_ONCE(stats->nr_async), READ_ONCE(stats->nr_random),
+                               READ_ONCE(stats->nr_thrash), READ_ONCE(stats->nr_pages));
+        if ((size_t) written >= RA_FILES_BUFSIZE - len)
+            break;
+        len += written;
+    }
+
+    rcu_read_unlock();
+
+    st = sysfs_copy_out(buffer, size, off, buf, len);
+    kfree(buf);
+    return st;
 }
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+#include <onyx/signal.h>
+#include <onyx/spinlock.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/signalfd.h>
+
+/* signalfd: read pending signals (in the fd's mask) as struct signalfd_siginfo, instead of having
+ * them delivered. Like on Linux, the signals are dequeued from the reading process, not the one
+ * that created the fd, and they should be blocked so they're not delivered normally first. */
+
+#define SFD_VALID_FLAGS (SFD_CLOEXEC | SFD_NONBLOCK)
+
+struct signalfd_ctx
+{
+    struct spinlock lock;
+    sigset_t mask;
+
+    signalfd_ctx(const sigset_t &mask) : mask(mask)
+    {
+        spinlock_init(&lock);
+    }
+
+    sigset_t get_mask()
+    {
+        scoped_lock g{lock};
+        return mask;
+    }
+};
+
+static void signalfd_fill_info(struct signalfd_siginfo *ssi, int signum, const siginfo_t *info)
+{
+    memset(ssi, 0, sizeof(*ssi));
+    ssi->ssi_signo = signum;
+    ssi->ssi_errno = info->si_errno;
+    ssi->ssi_code = info->si_code;
+
+    /* siginfo_t is a union, so only copy what's valid for the signal */
+    switch (signum)
+    {
+        case SIGCHLD:
+            ssi->ssi_pid = info->si_pid;
+            ssi->ssi_uid = info->si_uid;
+            ssi->ssi_status = info->si_status;
+            ssi->ssi_utime = info->si_utime;
+            ssi->ssi_stime = info->si_stime;
+            break;
+        case SIGSEGV:
+        case SIGBUS:
+        case SIGILL:
+        case SIGFPE:
+        case SIGTRAP:
+            ssi->ssi_addr = (unsigned long) info->si_addr;
+            ssi->ssi_addr_lsb = info->si_addr_lsb;
+            break;
+        case SIGPOLL:
+            ssi->ssi_band = info->si_band;
+            ssi->ssi_fd = info->si_fd;
+            break;
+        case SIGSYS:
+            ssi->ssi_call_addr = (unsigned long) info->si_call_addr;
+            ssi->ssi_syscall = info->si_syscall;
+            ssi->ssi_arch = info->si_arch;
+            break;
+        default:
+            /* kill, sigqueue and friends */
+            ssi->ssi_pid = info->si_pid;
+            ssi->ssi_uid = info->si_uid;
+            ssi->ssi_int = info->si_int;
+            ssi->ssi_ptr = (unsigned long) info->si_ptr;
+            break;
+    }
+}
+
+static long signalfd_wait(struct process *p, const sigset_t *mask)
+{
+    return wait_for_event_interruptible(&p->signalfd_wq, signal_set_is_pending(mask));
+}
+
+/**
+ * @brief Dequeue a signal in the signalfd's mask
+ *
+ * @param ctx signalfd
+ * @param ssi Pointer to where to store the signal's information
+ * @param nonblock If true, don't wait for a signal
+ * @return 0 on success, negative error code (-EAGAIN, -EINTR)
+ */
+static int signalfd_dequeue(struct signalfd_ctx *ctx, struct signalfd_siginfo *ssi, bool nonblock)
+{
+    struct process *p = get_current_process();
+    siginfo_t info;
+
+    for (;;)
+    {
+        sigset_t mask = ctx->get_mask();
+        int signum = signal_dequeue_set(&mask, &info);
+        if (signum)
+        {
+            signalfd_fill_info(ssi, signum, &info);
+            return 0;
+        }
+
+        if (nonblock)
+            return -EAGAIN;
+
+        if (signalfd_wait(p, &mask) == -EINTR)
+            return -EINTR;
+    }
+}
+
+static ssize_t signalfd_read_iter(struct file *filp, size_t off, struct iovec_iter *iter,
+                                  unsigned int flags)
+{
+    struct signalfd_ctx *ctx = (struct signalfd_ctx *) filp->private_data;
+    struct signalfd_siginfo ssi;
+    ssize_t ret = 0;
+
+    if (iter->bytes < sizeof(ssi))
+        return -EINVAL;
+
+    while (iter->bytes >= sizeof(ssi))
+    {
+        /* Only block for the first signal */
+        int st = signalfd_dequeue(ctx, &ssi, ret || filp->f_flags & O_NONBLOCK);
+        if (st < 0)
+            return ret ?: st;
+
+        ssize_t copied = copy_to_iter(iter, &ssi, sizeof(ssi));
+        if (copied < 0)
+            return ret ?: copied;
+        ret += copied;
+    }
+
+    return ret;
+}
+
+static short signalfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct signalfd_ctx *ctx = (struct signalfd_ctx *) filp->private_data;
+
+    poll_wait_helper(poll_file, &get_current_process()->signalfd_wq);
+
+    sigset_t mask = ctx->get_mask();
+    if (signal_set_is_pending(&mask))
+        return (POLLIN | POLLRDNORM) & events;
+    return 0;
+}
+
+static void signalfd_release(struct file *filp)
+{
+    delete (struct signalfd_ctx *) filp->private_data;
+}
+
+static struct file_ops signalfd_fops = {
+    .poll = signalfd_poll,
+    .release = signalfd_release,
+    .read_iter = signalfd_read_iter,
+};
+
+int sys_signalfd4(int fd, const sigset_t *umask, size_t sizemask, int flags)
+{
+    sigset_t mask;
+
+    if (flags & ~SFD_VALID_FLAGS)
+        return -EINVAL;
+
+    if (sizemask != sizeof(sigset_t))
+        return -EINVAL;
+
+    if (copy_from_user(&mask, umask, sizeof(mask)) < 0)
+        return -EFAULT;
+
+    /* These can't be caught, so silently ignore them */
+    sigdelset(&mask, SIGKILL);
+    sigdelset(&mask, SIGSTOP);
+
+    if (fd != -1)
+    {
+        auto_file f = get_file_description(fd);
+        if (!f)
+            return -EBADF;
+
+        if (f.get_file()->f_ino->i_fops != &signalfd_fops)
+            return -EINVAL;
+
+        struct signalfd_ctx *ctx = (struct signalfd_ctx *) f.get_file()->private_data;
+        {
+            scoped_lock g{ctx->lock};
+            ctx->mask = mask;
+        }
+
+        /* Waiters may now be interested in signals that are already pending */
+        wait_queue_wake_all(&get_current_process()->signalfd_wq);
+        return fd;
+    }
+
+    struct signalfd_ctx *ctx = new signalfd_ctx{mask};
+    if (!ctx)
+        return -ENOMEM;
+
+    struct file *filp = anon_inode_open(S_IFREG, &signalfd_fops, "[signalfd]");
+    if (!filp)
+    {
+        delete ctx;
+        return -ENOMEM;
+    }
+
+    filp->private_data = ctx;
+
+    int newfd = open_with_vnode(filp, O_RDWR | flags);
+    fd_put(filp);
+    return newfd;
+}
@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/file.h>
+#include <onyx/limits.h>
+#include <onyx/page.h>
+#include <onyx/page_iov.h>
+#include <onyx/pipe.h>
+#include <onyx/splice.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include <uapi/fcntl.h>
+
+/* splice and friends: data is moved around in pipes as page references. Files that have a page
+ * cache (see filemap_splice_read) lend their pages to the pipe, so file -> pipe does not copy.
+ * pipe -> pipe (splice, tee) does not copy either. pipe -> file copies once, straight from the
+ * pipe's pages, as the destination (the page cache, a socket's packetbufs) wants its own memory.
+ * sendfile and copy_file_range go file -> pipe -> file through an internal pipe.
+ */
+
+#define SPLICE_F_VALID (SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT)
+
+/* Maximum number of pages read by default_splice_read in one go */
+#define SPLICE_READ_MAX_PAGES 16
+
+ssize_t sys_readv(int fd, const struct iovec *vec, int veccnt);
+
+/**
+ * @brief Splice data into a pipe by reading it into new pages.
+ * Used for files that can't lend us their pages.
+ *
+ * @param filp File pointer
+ * @param off Offset
+ * @param pipe Pipe
+ * @param len Maximum length
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t default_splice_read(struct file *filp, size_t off, struct pipe *pipe, size_t len,
+                            unsigned int flags)
+{
+    struct page *pages[SPLICE_READ_MAX_PAGES];
+    struct iovec iov[SPLICE_READ_MAX_PAGES];
+    size_t nr_pages;
+    ssize_t st;
+
+    /* Don't read more than we can put in the pipe, or we'd lose data */
+    ssize_t space = pipe_splice_space(pipe, flags);
+    if (space < 0)
+        return space;
+
+    len = cul::min(len, cul::min((size_t) space, SPLICE_READ_MAX_PAGES * PAGE_SIZE));
+    nr_pages = vm_size_to_pages(len);
+
+    for (size_t i = 0; i < nr_pages; i++)
+    {
+        pages[i] = alloc_page(GFP_KERNEL | PAGE_ALLOC_NO_ZERO);
+        if (!pages[i])
+        {
+            nr_pages = i;
+            st = -ENOMEM;
+            goto out;
+        }
+
+        iov[i].iov_base = PAGE_TO_VIRT(pages[i]);
+        iov[i].iov_len = cul::min(len - (i << PAGE_SHIFT), PAGE_SIZE);
+    }
+
+    {
+        iovec_iter iter{{iov, nr_pages}, len, IOVEC_KERNEL};
+        auto_addr_limit l{VM_KERNEL_ADDR_LIMIT};
+        st = read_iter_vfs(filp, off, &iter, 0);
+    }
+
+    if (st > 0)
+    {
+        struct page_iov vec[SPLICE_READ_MAX_PAGES];
+        size_t nr_vec = vm_size_to_pages(st);
+
+        for (size_t i = 0; i < nr_vec; i++)
+        {
+            vec[i].page = pages[i];
+            vec[i].page_off = 0;
+            vec[i].length = cul::min((size_t) st - (i << PAGE_SHIFT), PAGE_SIZE);
+        }
+
+        /* We checked for space above, this only comes up short if someone else also wrote */
+        st = pipe_splice_pages(pipe, vec, nr_vec, flags | SPLICE_F_NONBLOCK);
+    }
+
+out:
+    /* The pipe took its own references */
+    for (size_t i = 0; i < nr_pages; i++)
+        page_unref(pages[i]);
+    return st;
+}
+
+static ssize_t splice_file_to_pipe(struct file *in, size_t off, struct pipe *pipe, size_t len,
+                                   unsigned int flags)
+{
+    if (in->f_ino->i_fops->splice_read)
+        return in->f_ino->i_fops->splice_read(in, off, pipe, len, flags);
+    return default_splice_read(in, off, pipe, len, flags);
+}
+
+struct splice_write_ctx
+{
+    struct file *filp;
+    size_t off;
+};
+
+static ssize_t splice_write_actor(const struct page_iov *vec, void *ctx_)
+{
+    struct splice_write_ctx *ctx = (struct splice_write_ctx *) ctx_;
+    struct iovec iov;
+    iov.iov_base = (u8 *) PAGE_TO_VIRT(vec->page) + vec->page_off;
+    iov.iov_len = vec->length;
+
+    iovec_iter iter{{&iov, 1}, vec->length, IOVEC_KERNEL};
+    auto_addr_limit l{VM_KERNEL_ADDR_LIMIT};
+
+    ssize_t st = write_iter_vfs(ctx->filp, ctx->off, &iter, 0);
+    if (st > 0)
+        ctx->off += st;
+    return st;
+}
+
+static ssize_t splice_pipe_to_file(struct pipe *pipe, struct file *out, size_t off, size_t len,
+                                   unsigned int flags)
+{
+    struct splice_write_ctx ctx;
+    ctx.filp = out;
+    ctx.off = off;
+    return pipe_splice_out(pipe, len, flags, splice_write_actor, &ctx);
+}
+
+/**
+ * @brief Splice from a file to another, through an internal pipe
+ *
+ * @param in File to read from
+ * @param off_in Offset to read from, updated with the number of bytes written
+ * @param out File to write to
+ * @param off_out Offset to write to, updated with the number of bytes written
+ * @param len Length
+ * @return Number of bytes written, or negative error code
+ */
+static ssize_t do_splice_direct(struct file *in, size_t *off_in, struct file *out,
+                                size_t *off_out, size_t len)
+{
+    ssize_t ret = 0;
+    struct pipe *pipe = pipe_alloc_internal();
+    if (!pipe)
+        return -ENOMEM;
+
+    while (len > 0)
+    {
+        ssize_t st = splice_file_to_pipe(in, *off_in, pipe, len, 0);
+        if (st <= 0)
+        {
+            if (!ret)
+                ret = st;
+            break;
+        }
+
+        ssize_t written = splice_pipe_to_file(pipe, out, *off_out, st, 0);
+        if (written <= 0)
+        {
+            if (!ret)
+                ret = written;
+            break;
+        }
+
+        *off_in += written;
+        *off_out += written;
+        len -= written;
+        ret += written;
+
+        /* A short write leaves data in the pipe, which we drop. Our caller only sees what we wrote,
+         * so nothing is lost. */
+        if (written < st || signal_is_pending())
+            break;
+    }
+
+    pipe_free_internal(pipe);
+    return ret;
+}
+
+/* A file position for splice: either the user's offset (that we read and write back), or the
+ * file's own position (that we lock) */
+struct splice_pos
+{
+    struct file *filp;
+    off_t *upos;
+    size_t pos;
+};
+
+static int splice_pos_get(struct splice_pos *p, struct file *filp, off_t *upos)
+{
+    p->filp = filp;
+    p->upos = upos;
+
+    if (upos)
+    {
+        off_t pos;
+        if (filp->f_ino->i_flags & INODE_FLAG_NO_SEEK)
+            return -ESPIPE;
+        if (copy_from_user(&pos, upos, sizeof(pos)) < 0)
+            return -EFAULT;
+        if (pos < 0)
+            return -EINVAL;
+        p->pos = pos;
+        return 0;
+    }
+
+    mutex_lock(&filp->f_seeklock);
+    p->pos = filp->f_seek;
+    return 0;
+}
+
+static ssize_t splice_pos_put(struct splice_pos *p, ssize_t ret)
+{
+    if (!p->upos)
+    {
+        p->filp->f_seek = p->pos;
+        mutex_unlock(&p->filp->f_seeklock);
+        return ret;
+    }
+
+    off_t pos = p->pos;
+    if (copy_to_user(p->upos, &pos, sizeof(pos)) < 0)
+        return -EFAULT;
+    return ret;
+}
+
+static unsigned int pipe_file_flags(struct file *filp, unsigned int flags)
+{
+    return filp->f_flags & O_NONBLOCK ? flags | SPLICE_F_NONBLOCK : flags;
+}
+
+ssize_t sys_splice(int fd_in, off_t *uoff_in, int fd_out, off_t *uoff_out, size_t len,
+                   unsigned int flags)
+{
+    struct splice_pos pos;
+    ssize_t st;
+
+    if (flags & ~SPLICE_F_VALID)
+        return -EINVAL;
+
+    auto_file in = get_file_description(fd_in);
+    if (!in)
+        return -EBADF;
+
+    auto_file out = get_file_description(fd_out);
+    if (!out)
+        return -EBADF;
+
+    if (!fd_may_access(in.get_file(), FILE_ACCESS_READ) ||
+        !fd_may_access(out.get_file(), FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (out.get_file()->f_flags & O_APPEND)
+        return -EINVAL;
+
+    struct pipe *ipipe = file_to_pipe(in.get_file());
+    struct pipe *opipe = file_to_pipe(out.get_file());
+
+    if (ipipe && opipe)
+    {
+        if (uoff_in || uoff_out)
+            return -ESPIPE;
+        if (ipipe == opipe)
+            return -EINVAL;
+        if (len == 0)
+            return 0;
+        return pipe_splice_pipe(ipipe, opipe, len, pipe_file_flags(in.get_file(), flags));
+    }
+
+    if (ipipe)
+    {
+        if (uoff_in)
+            return -ESPIPE;
+        if (len == 0)
+            return 0;
+
+        if (st = splice_pos_get(&pos, out.get_file(), uoff_out); st < 0)
+            return st;
+        st = splice_pipe_to_file(ipipe, out.get_file(), pos.pos, len,
+                                 pipe_file_flags(in.get_file(), flags));
+        if (st > 0)
+            pos.pos += st;
+        return splice_pos_put(&pos, st);
+    }
+
+    if (opipe)
+    {
+        if (uoff_out)
+            return -ESPIPE;
+        if (len == 0)
+            return 0;
+
+        if (st = splice_pos_get(&pos, in.get_file(), uoff_in); st < 0)
+            return st;
+        st = splice_file_to_pipe(in.get_file(), pos.pos, opipe, len,
+                                 pipe_file_flags(out.get_file(), flags));
+        if (st > 0)
+            pos.pos += st;
+        return splice_pos_put(&pos, st);
+    }
+
+    return -EINVAL;
+}
+
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+    if (flags & ~SPLICE_F_VALID)
+        return -EINVAL;
+
+    auto_file in = get_file_description(fd_in);
+    if (!in)
+        return -EBADF;
+
+    auto_file out = get_file_description(fd_out);
+    if (!out)
+        return -EBADF;
+
+    if (!fd_may_access(in.get_file(), FILE_ACCESS_READ) ||
+        !fd_may_access(out.get_file(), FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    struct pipe *ipipe = file_to_pipe(in.get_file());
+    struct pipe *opipe = file_to_pipe(out.get_file());
+
+    if (!ipipe || !opipe || ipipe == opipe)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+
+    return pipe_tee(ipipe, opipe, len, pipe_file_flags(in.get_file(), flags));
+}
+
+/**
+ * @brief Splice a single user buffer into a pipe, page by page
+ *
+ * @param pipe Pipe
+ * @param iov User buffer
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+static ssize_t vmsplice_iov(struct pipe *pipe, const struct iovec &iov, unsigned int flags)
+{
+    unsigned long addr = (unsigned long) iov.iov_base;
+    size_t len = iov.iov_len;
+    ssize_t ret = 0;
+
+    while (len > 0)
+    {
+        struct page *page;
+        struct page_iov v;
+
+        if (!(get_phys_pages((void *) (addr & -PAGE_SIZE), GPP_READ | GPP_USER, &page, 1) &
+              GPP_ACCESS_OK))
+            return ret ?: -EFAULT;
+
+        v.page = page;
+        v.page_off = addr & (PAGE_SIZE - 1);
+        v.length = cul::min(PAGE_SIZE - v.page_off, len);
+
+        ssize_t st = pipe_splice_pages(pipe, &v, 1, ret ? flags | SPLICE_F_NONBLOCK : flags);
+        page_unpin(page);
+
+        if (st <= 0)
+            return ret ?: st;
+
+        addr += st;
+        len -= st;
+        ret += st;
+
+        if ((size_t) st < v.length)
+            break;
+    }
+
+    return ret;
+}
+
+ssize_t sys_vmsplice(int fd, const struct iovec *uiov, unsigned long nr_segs, unsigned int flags)
+{
+    ssize_t ret = 0;
+
+    if (flags & ~SPLICE_F_VALID)
+        return -EINVAL;
+    if (nr_segs > IOV_MAX)
+        return -EINVAL;
+
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -EBADF;
+
+    struct pipe *pipe = file_to_pipe(f.get_file());
+    if (!pipe)
+        return -EBADF;
+
+    /* vmsplice on the read end copies the data out, like readv would */
+    if (!fd_may_access(f.get_file(), FILE_ACCESS_WRITE))
+        return sys_readv(fd, uiov, (int) nr_segs);
+
+    flags = pipe_file_flags(f.get_file(), flags);
+
+    /* The pipe references the user's pages, so later modifications to the memory may show up in
+     * the pipe (SPLICE_F_GIFT has no special meaning to us). */
+    for (unsigned long i = 0; i < nr_segs; i++)
+    {
+        struct iovec iov;
+        if (copy_from_user(&iov, uiov + i, sizeof(iov)) < 0)
+            return ret ?: -EFAULT;
+
+        if (iov.iov_len == 0)
+            continue;
+
+        ssize_t st = vmsplice_iov(pipe, iov, ret ? flags | SPLICE_F_NONBLOCK : flags);
+        if (st <= 0)
+            return ret ?: st;
+
+        ret += st;
+        if ((size_t) st < iov.iov_len)
+            break;
+    }
+
+    return ret;
+}
+
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *uoffset, size_t count)
+{
+    struct splice_pos in_pos, out_pos;
+    ssize_t st;
+
+    auto_file in = get_file_description(in_fd);
+    if (!in)
+        return -EBADF;
+
+    auto_file out = get_file_description(out_fd);
+    if (!out)
+        return -EBADF;
+
+    if (!fd_may_access(in.get_file(), FILE_ACCESS_READ) ||
+        !fd_may_access(out.get_file(), FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (out.get_file()->f_flags & O_APPEND)
+        return -EINVAL;
+
+    if (count == 0)
+        return 0;
+
+    /* Both positions would be the same mutex */
+    if (in.get_file() == out.get_file() && !uoffset)
+        return -EINVAL;
+
+    if (st = splice_pos_get(&in_pos, in.get_file(), uoffset); st < 0)
+        return st;
+
+    if (st = splice_pos_get(&out_pos, out.get_file(), nullptr); st < 0)
+        return splice_pos_put(&in_pos, st);
+
+    st = do_splice_direct(in.get_file(), &in_pos.pos, out.get_file(), &out_pos.pos, count);
+
+    splice_pos_put(&out_pos, st);
+    return splice_pos_put(&in_pos, st);
+}
+
+ssize_t sys_copy_file_range(int fd_in, off_t *uoff_in, int fd_out, off_t *uoff_out, size_t len,
+                            unsigned int flags)
+{
+    struct splice_pos in_pos, out_pos;
+    ssize_t st;
+
+    if (flags != 0)
+        return -EINVAL;
+
+    auto_file in = get_file_description(fd_in);
+    if (!in)
+        return -EBADF;
+
+    auto_file out = get_file_description(fd_out);
+    if (!out)
+        return -EBADF;
+
+    struct file *fin = in.get_file();
+    struct file *fout = out.get_file();
+
+    if (!fd_may_access(fin, FILE_ACCESS_READ) || !fd_may_access(fout, FILE_ACCESS_WRITE) ||
+        fout->f_flags & O_APPEND)
+        return -EBADF;
+
+    if (S_ISDIR(fin->f_ino->i_mode) || S_ISDIR(fout->f_ino->i_mode))
+        return -EISDIR;
+    if (!S_ISREG(fin->f_ino->i_mode) || !S_ISREG(fout->f_ino->i_mode))
+        return -EINVAL;
+
+    /* Both positions would be the same mutex, and the ranges would overlap anyway */
+    if (fin == fout && !uoff_in && !uoff_out)
+        return -EINVAL;
+
+    if (st = splice_pos_get(&in_pos, fin, uoff_in); st < 0)
+        return st;
+
+    if (st = splice_pos_get(&out_pos, fout, uoff_out); st < 0)
+        return splice_pos_put(&in_pos, st);
+
+    if (fin->f_ino == fout->f_ino && in_pos.pos + len > out_pos.pos &&
+        out_pos.pos + len > in_pos.pos)
+    {
+        st = -EINVAL;
+        goto out;
+    }
+
+    if (len == 0)
+    {
+        st = 0;
+        goto out;
+    }
+
+    /* Let the filesystem share the blocks, if it can */
+    st = -EOPNOTSUPP;
+    if (fin->f_ino->i_sb == fout->f_ino->i_sb && fin->f_ino->i_fops->copy_file_range)
+    {
+        st = fin->f_ino->i_fops->copy_file_range(fin, in_pos.pos, fout, out_pos.pos, len, 0);
+        if (st > 0)
+        {
+            in_pos.pos += st;
+            out_pos.pos += st;
+        }
+    }
+
+    if (st == -EOPNOTSUPP)
+        st = do_splice_direct(fin, &in_pos.pos, fout, &out_pos.pos, len);
+
+out:
+    splice_pos_put(&out_pos, st);
+    return splice_pos_put(&in_pos, st);
+}
@@ -107,7 +107,9 @@ size_t sysfs_read(size_t offset, size_t sizeofread, void *buffer, struct file *t
     struct sysfs_object *file = (struct sysfs_object *) this_->f_ino->i_inode;
     assert(file != nullptr);
 
-    if (file->read)
+    if (file->show)
+        return file->show(file, buffer, sizeofread, offset);
+    else if (file->read)
         return file->read(buffer, sizeofread, offset);
     else
         return -ENOSYS;
@@ -118,7 +120,9 @@ size_t sysfs_write(size_t offset, size_t sizeofwrite, void *buffer, struct file
     struct sysfs_object *file = (struct sysfs_object *) this_->f_ino->i_inode;
     assert(file != nullptr);
 
-    if (file->write)
+    if (file->store)
+        return file->store(file, buffer, sizeofwrite, offset);
+    else if (file->write)
         return file->write(buffer, sizeofwrite, offset);
     else
         return errno = ENOSYS, (size_t) -1;
@@ -289,3 +293,14 @@ int sysfs_init_and_add(const char *name, struct sysfs_object *obj, struct sysfs_
 
     return 0;
 }
+
+ssize_t sysfs_copy_out(void *buffer, size_t size, off_t off, const char *buf, size_t len)
+{
+    if ((size_t) off >= len)
+        return 0;
+    if (size > len - off)
+        size = len - off;
+    if (copy_to_user(buffer, buf + off, size) < 0)
+        return -EFAULT;
+    return size;
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/atomic.h>
+#include <onyx/clock.h>
+#include <onyx/file.h>
+#include <onyx/iovec_iter.h>
+#include <onyx/mutex.h>
+#include <onyx/poll.h>
+#include <onyx/timer.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/time.h>
+#include <uapi/timerfd.h>
+
+/* timerfd: a timer that's read through a file. Each read returns the number of expirations since
+ * the last read. The timer is a clockevent that runs in IRQ context and only bumps the expiration
+ * count and wakes up waiters, so it can't sleep or take the ctx mutex.
+ *
+ * CLOCK_BOOTTIME is the same as CLOCK_MONOTONIC (we don't count time spent suspended). Absolute
+ * CLOCK_REALTIME timers are converted to monotonic time when armed, so we don't notice the wall
+ * clock being set, and TFD_TIMER_CANCEL_ON_SET is accepted but never triggers.
+ */
+
+#define TFD_VALID_FLAGS         (TFD_CLOEXEC | TFD_NONBLOCK)
+#define TFD_SETTIME_VALID_FLAGS (TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET)
+
+struct timerfd_ctx
+{
+    /* Serializes settime and gettime */
+    struct mutex lock;
+    clockid_t clockid;
+    /* Expirations since the last read, updated from IRQ context */
+    u64 ticks;
+    hrtime_t interval;
+    bool armed;
+    struct clockevent ev;
+    struct wait_queue wq;
+
+    timerfd_ctx(clockid_t clockid) : clockid{clockid}, ticks{0}, interval{0}, armed{false}
+    {
+        mutex_init(&lock);
+        init_wait_queue_head(&wq);
+    }
+};
+
+static void timerfd_fire(struct clockevent *ev)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) ev->priv;
+    u64 expirations = 1;
+
+    if (ctx->interval)
+    {
+        /* Account for every interval we missed, and requeue ourselves (CLOCKEVENT_FLAG_PULSE) */
+        hrtime_t now = clocksource_get_time();
+        if (now > ev->deadline)
+            expirations += (now - ev->deadline) / ctx->interval;
+        ev->deadline += expirations * ctx->interval;
+    }
+    else
+        WRITE_ONCE(ctx->armed, false);
+
+    __atomic_add_fetch(&ctx->ticks, expirations, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ctx->wq);
+}
+
+static hrtime_t timerfd_ts_to_hrtime(const struct timespec *ts)
+{
+    hrtime_t sec, res;
+
+    if (__builtin_umull_overflow((unsigned long) ts->tv_sec, NS_PER_SEC, &sec))
+        return HRTIME_MAX;
+    if (__builtin_uaddl_overflow(sec, (unsigned long) ts->tv_nsec, &res))
+        return HRTIME_MAX;
+    return res;
+}
+
+static hrtime_t timerfd_add(hrtime_t a, hrtime_t b)
+{
+    hrtime_t res;
+    if (__builtin_uaddl_overflow(a, b, &res))
+        return HRTIME_MAX;
+    return res;
+}
+
+/**
+ * @brief Convert a timer value to a monotonic deadline
+ *
+ * @param ctx timerfd
+ * @param value Timer value (relative, or absolute in ctx->clockid)
+ * @param flags timerfd_settime flags
+ * @return Deadline, in clocksource_get_time() time
+ */
+static hrtime_t timerfd_deadline(struct timerfd_ctx *ctx, hrtime_t value, int flags)
+{
+    hrtime_t now = clocksource_get_time();
+
+    if (!(flags & TFD_TIMER_ABSTIME))
+        return timerfd_add(now, value);
+
+    if (ctx->clockid == CLOCK_REALTIME)
+    {
+        struct timespec ts;
+        clock_gettime_kernel(CLOCK_REALTIME, &ts);
+        hrtime_t rt_now = timespec_to_hrtime(&ts);
+        /* Already expired if it's in the past */
+        return value > rt_now ? timerfd_add(now, value - rt_now) : now;
+    }
+
+    return value;
+}
+
+static void timerfd_get(struct timerfd_ctx *ctx, struct itimerspec *its)
+{
+    MUST_HOLD_MUTEX(&ctx->lock);
+    hrtime_t remaining = 0, interval = 0;
+
+    if (READ_ONCE(ctx->armed))
+    {
+        hrtime_t now = clocksource_get_time();
+        hrtime_t deadline = READ_ONCE(ctx->ev.deadline);
+        interval = ctx->interval;
+        /* Don't report 0, as that means "disarmed" */
+        remaining = deadline > now ? deadline - now : 1;
+    }
+
+    hrtime_to_timespec(remaining, &its->it_value);
+    hrtime_to_timespec(interval, &its->it_interval);
+}
+
+static void timerfd_disarm(struct timerfd_ctx *ctx)
+{
+    MUST_HOLD_MUTEX(&ctx->lock);
+    /* Once this returns, the callback isn't running and won't run again */
+    timer_cancel_event(&ctx->ev);
+    ctx->armed = false;
+}
+
+static void timerfd_arm(struct timerfd_ctx *ctx, hrtime_t deadline, hrtime_t interval)
+{
+    MUST_HOLD_MUTEX(&ctx->lock);
+    ctx->interval = interval;
+    ctx->armed = true;
+    ctx->ev.callback = timerfd_fire;
+    ctx->ev.priv = ctx;
+    ctx->ev.flags = CLOCKEVENT_FLAG_ATOMIC | (interval ? CLOCKEVENT_FLAG_PULSE : 0);
+    ctx->ev.timer = nullptr;
+    ctx->ev.deadline = deadline;
+    timer_queue_clockevent(&ctx->ev);
+}
+
+static long timerfd_wait(struct timerfd_ctx *ctx)
+{
+    return wait_for_event_interruptible(&ctx->wq, READ_ONCE(ctx->ticks) != 0);
+}
+
+static ssize_t timerfd_read_iter(struct file *filp, size_t off, struct iovec_iter *iter,
+                                 unsigned int flags)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) filp->private_data;
+    u64 ticks;
+
+    if (iter->bytes < sizeof(ticks))
+        return -EINVAL;
+
+    /* settime may reset ticks between the wakeup and the exchange, so loop */
+    while (!(ticks = __atomic_exchange_n(&ctx->ticks, 0, __ATOMIC_ACQUIRE)))
+    {
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (timerfd_wait(ctx) == -EINTR)
+            return -EINTR;
+    }
+
+    return copy_to_iter(iter, &ticks, sizeof(ticks));
+}
+
+static short timerfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) filp->private_data;
+
+    poll_wait_helper(poll_file, &ctx->wq);
+
+    if (READ_ONCE(ctx->ticks) != 0)
+        return (POLLIN | POLLRDNORM) & events;
+    return 0;
+}
+
+static void timerfd_release(struct file *filp)
+{
+    struct timerfd_ctx *ctx = (struct timerfd_ctx *) filp->private_data;
+    timer_cancel_event(&ctx->ev);
+    delete ctx;
+}
+
+static struct file_ops timerfd_fops = {
+    .poll = timerfd_poll,
+    .release = timerfd_release,
+    .read_iter = timerfd_read_iter,
+};
+
+int sys_timerfd_create(int clockid, int flags)
+{
+    if (flags & ~TFD_VALID_FLAGS)
+        return -EINVAL;
+
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC && clockid != CLOCK_BOOTTIME)
+        return -EINVAL;
+
+    struct timerfd_ctx *ctx = new timerfd_ctx{clockid};
+    if (!ctx)
+        return -ENOMEM;
+
+    struct file *filp = anon_inode_open(S_IFREG, &timerfd_fops, "[timerfd]");
+    if (!filp)
+    {
+        delete ctx;
+        return -ENOMEM;
+    }
+
+    filp->private_data = ctx;
+
+    int fd = open_with_vnode(filp, O_RDWR | flags);
+    fd_put(filp);
+    return fd;
+}
+
+static struct timerfd_ctx *timerfd_from_file(struct file *filp)
+{
+    if (filp->f_ino->i_fops != &timerfd_fops)
+        return nullptr;
+    return (struct timerfd_ctx *) filp->private_data;
+}
+
+int sys_timerfd_settime(int fd, int flags, const struct itimerspec *unew_value,
+                        struct itimerspec *uold_value)
+{
+    struct itimerspec its, old;
+
+    if (flags & ~TFD_SETTIME_VALID_FLAGS)
+        return -EINVAL;
+
+    if (copy_from_user(&its, unew_value, sizeof(its)) < 0)
+        return -EFAULT;
+
+    if (!timespec_valid(&its.it_value, false) || !timespec_valid(&its.it_interval, false))
+        return -EINVAL;
+
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -EBADF;
+
+    struct timerfd_ctx *ctx = timerfd_from_file(f.get_file());
+    if (!ctx)
+        return -EINVAL;
+
+    hrtime_t value = timerfd_ts_to_hrtime(&its.it_value);
+    hrtime_t interval = timerfd_ts_to_hrtime(&its.it_interval);
+
+    {
+        scoped_mutex g{ctx->lock};
+
+        timerfd_get(ctx, &old);
+        timerfd_disarm(ctx);
+        __atomic_store_n(&ctx->ticks, 0, __ATOMIC_RELAXED);
+
+        if (value)
+            timerfd_arm(ctx, timerfd_deadline(ctx, value, flags), interval);
+    }
+
+    if (uold_value && copy_to_user(uold_value, &old, sizeof(old)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+int sys_timerfd_gettime(int fd, struct itimerspec *ucurr_value)
+{
+    struct itimerspec its;
+
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -EBADF;
+
+    struct timerfd_ctx *ctx = timerfd_from_file(f.get_file());
+    if (!ctx)
+        return -EINVAL;
+
+    {
+        scoped_mutex g{ctx->lock};
+        timerfd_get(ctx, &its);
+    }
+
+    if (copy_to_user(ucurr_value, &its, sizeof(its)) < 0)
+        return -EFAULT;
+    return 0;
+}
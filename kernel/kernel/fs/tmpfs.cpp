@@ -17,6 +17,7 @@
 #include <onyx/filemap.h>
 #include <onyx/fs_mount.h>
 #include <onyx/log.h>
+#include <onyx/mm/memfd.h>
 #include <onyx/mount.h>
 #include <onyx/mutex.h>
 #include <onyx/page.h>
@@ -222,6 +223,15 @@ off_t tmpfs_getdirent(struct dirent *buf, off_t off, struct file *file)
 
 int tmpfs_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len)
 {
+    unsigned int seals = READ_ONCE(((tmpfs_inode *) ino)->seals);
+
+    /* F_SEAL_WRITE can't be set while there are writable shared mappings, so this can only be a
+     * write(). Both are checked here as write() holds i_rwlock, which F_ADD_SEALS takes. */
+    if (seals & F_SEAL_WRITE)
+        return -EPERM;
+    if (seals & F_SEAL_GROW && page_off + offset + len > ino->i_size)
+        return -EPERM;
+
     // If PAGE_FLAG_FILESYSTEM1 is not set, we have not seen this page. Add to blocks and make sure
     // we dont count this in ino->i_blocks again.
     if (!(page->flags & PAGE_FLAG_FILESYSTEM1))
@@ -247,6 +257,13 @@ void tmpfs_close(inode *file)
 
 int tmpfs_ftruncate(size_t len, file *f)
 {
+    unsigned int seals = ((tmpfs_inode *) f->f_ino)->seals;
+
+    if (seals & F_SEAL_SHRINK && len < f->f_ino->i_size)
+        return -EPERM;
+    if (seals & F_SEAL_GROW && len > f->f_ino->i_size)
+        return -EPERM;
+
     int st = vmo_truncate(f->f_ino->i_pages, len, 0);
 
     if (st < 0)
@@ -255,6 +272,16 @@ int tmpfs_ftruncate(size_t len, file *f)
     return 0;
 }
 
+static ssize_t tmpfs_write_iter(struct file *filp, size_t off, struct iovec_iter *iter,
+                                unsigned int flags)
+{
+    /* F_SEAL_FUTURE_WRITE still lets existing writable mappings fault pages in (through
+     * prepare_write), so it's checked here instead */
+    if (READ_ONCE(((tmpfs_inode *) filp->f_ino)->seals) & F_SEAL_FUTURE_WRITE)
+        return -EPERM;
+    return filemap_write_iter(filp, off, iter, flags);
+}
+
 const struct file_ops tmpfs_fops = {
     .read = nullptr,
     .write = nullptr,
@@ -278,10 +305,12 @@ const struct file_ops tmpfs_fops = {
     .readpage = tmpfs_readpage,
     .writepage = tmpfs_writepage,
     .prepare_write = tmpfs_prepare_write,
+    .fcntl = memfd_fcntl,
     .read_iter = filemap_read_iter,
-    .write_iter = filemap_write_iter,
+    .write_iter = tmpfs_write_iter,
     .fsyncdata = filemap_writepages,
     .rename = tmpfs_rename,
+    .splice_read = filemap_splice_read,
 };
 
 static void tmpfs_free_page(struct vm_object *vmo, struct page *page)
@@ -316,6 +345,8 @@ tmpfs_inode *tmpfs_superblock::alloc_inode(mode_t mode, dev_t rdev)
     }
 
     ino->i_fops = (file_ops *) tmpfs_ops_;
+    /* Only memfd_create(MFD_ALLOW_SEALING) files can be sealed */
+    ino->seals = F_SEAL_SEAL;
 
     ino->i_nlink = 0;
     if (ino->i_pages)
@@ -158,12 +158,14 @@ void inode_update_atime(struct inode *ino)
 void inode_update_ctime(struct inode *ino)
 {
     ino->i_ctime = clock_get_posix_time();
+    __atomic_add_fetch(&ino->i_version, 1, __ATOMIC_RELEASE);
     inode_mark_dirty(ino);
 }
 
 void inode_update_mtime(struct inode *ino)
 {
     ino->i_mtime = clock_get_posix_time();
+    __atomic_add_fetch(&ino->i_version, 1, __ATOMIC_RELEASE);
     inode_mark_dirty(ino);
 }
 
@@ -748,6 +750,8 @@ struct file *inode_to_file(struct inode *ino)
     path_init(&f->f_path);
     f->f_flock = nullptr;
     ra_state_init(&f->f_ra_state);
+    INIT_LIST_HEAD(&f->f_ep);
+    spinlock_init(&f->f_ep_lock);
 
     return f;
 }
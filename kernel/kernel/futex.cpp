@@ -11,15 +11,21 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <onyx/cpu.h>
 #include <onyx/fnv.h>
 #include <onyx/futex.h>
+#include <onyx/init.h>
 #include <onyx/list.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm_address_space.h>
 #include <onyx/pagecache.h>
 #include <onyx/process.h>
+#include <onyx/rtmutex.h>
 #include <onyx/user.h>
 #include <onyx/wait_queue.h>
 
-#include <onyx/hashtable.hpp>
+#include <uapi/futex.h>
+
 #include <onyx/memory.hpp>
 #include <onyx/pair.hpp>
 
@@ -34,6 +40,8 @@
 #define FUTEX_OFFSET_SHARED  (1 << 0)
 #define FUTEX_OFFSET_PRIVATE (1 << 1)
 
+struct futex_bucket;
+
 namespace futex
 {
 
@@ -92,17 +100,52 @@ struct futex_key
     }
 };
 
+/* The kernel side of a contended PI futex. The futex word holds the owner's TID, and the rt_mutex
+ * is locked on the owner's behalf, so the waiters (queued on it) boost the owner. It only exists
+ * while there are waiters, which keep it alive and find it through the bucket.
+ */
+struct futex_pi_state
+{
+    struct rt_mutex lock;
+    futex_key key;
+    /* Referenced, protected by the bucket lock (and the owner's pi_lock, for list_node) */
+    struct thread *owner{nullptr};
+    /* Node in owner->pi_state_list */
+    struct list_head list_node;
+    unsigned long refcount{0};
+    /* The previous owner exited, the new owner needs to fix up the futex word */
+    bool owner_died{false};
+};
+
 class futex_queue
 {
 public:
     futex_key key;
     bool awaken;
-    wait_queue wq;
+    /* The wait queue we're woken up on. futex_waitv shares one between all of its queues */
+    wait_queue *wq;
+    wait_queue own_wq;
     list_head_cpp<futex_queue> list_node;
+    /* The bucket we're queued on, protected by the bucket's lock */
+    struct futex_bucket *bucket{nullptr};
+    /* PI futexes: the waiting thread, and the pi state of the PI futex we're (or were) queued on */
+    struct thread *thread{nullptr};
+    struct futex_pi_state *pi_state{nullptr};
+    struct rt_mutex_waiter pi_waiter{};
+    /* FUTEX_WAIT_REQUEUE_PI: the PI futex we can be requeued to */
+    const futex_key *requeue_pi_key{nullptr};
+    /* FUTEX_CMP_REQUEUE_PI took the PI futex on our behalf */
+    bool pi_owned{false};
+
+    futex_queue(futex_key key) : key(key), awaken(false), wq{&own_wq}, own_wq{}, list_node{this}
+    {
+        init_wait_queue_head(&own_wq);
+    }
 
-    futex_queue(futex_key key) : key(key), awaken(false), wq{}, list_node{this}
+    futex_queue(futex_key key, wait_queue *wq)
+        : key(key), awaken(false), wq{wq}, own_wq{}, list_node{this}
     {
-        init_wait_queue_head(&wq);
+        init_wait_queue_head(&own_wq);
     }
 
     ~futex_queue()
@@ -112,23 +155,23 @@ public:
     int wait(hrtime_t _timeout, struct spinlock *s)
     {
         MUST_HOLD_LOCK(s);
-        return wait_for_event_locked_timeout_interruptible(&wq, awaken, _timeout, s);
+        return wait_for_event_locked_timeout_interruptible(wq, awaken, _timeout, s);
     }
 
     int wait(struct spinlock *s)
     {
         MUST_HOLD_LOCK(s);
-        return wait_for_event_locked_interruptible(&wq, awaken, s);
+        return wait_for_event_locked_interruptible(wq, awaken, s);
     }
 
     void wake()
     {
         list_remove(&list_node);
-        awaken = true;
+        WRITE_ONCE(awaken, true);
 
         COMPILER_BARRIER();
 
-        wait_queue_wake_all(&wq);
+        wait_queue_wake_all(wq);
     }
 
     futex_key &get_key()
@@ -138,10 +181,35 @@ public:
 
     bool was_awaken() const
     {
-        return awaken;
+        return READ_ONCE(awaken);
+    }
+
+    bool is_pi() const
+    {
+        return pi_state || requeue_pi_key;
+    }
+
+    bool requeue_pi_done() const
+    {
+        /* Either woken up with the PI futex, or requeued and handed the rt_mutex */
+        if (was_awaken())
+            return true;
+        return READ_ONCE(pi_state) && __atomic_load_n(&pi_waiter.granted, __ATOMIC_ACQUIRE);
     }
 
-    void requeue(const futex_key &new_key, struct list_head *new_head);
+    int wait_requeue_pi(hrtime_t _timeout, struct spinlock *s)
+    {
+        MUST_HOLD_LOCK(s);
+        return wait_for_event_locked_timeout_interruptible(wq, requeue_pi_done(), _timeout, s);
+    }
+
+    int wait_requeue_pi(struct spinlock *s)
+    {
+        MUST_HOLD_LOCK(s);
+        return wait_for_event_locked_interruptible(wq, requeue_pi_done(), s);
+    }
+
+    void requeue(const futex_key &new_key, struct futex_bucket *new_bucket);
 };
 
 inline uint32_t __futex_hash(futex_key &key)
@@ -149,73 +217,184 @@ inline uint32_t __futex_hash(futex_key &key)
     return fnv_hash(&key.both, sizeof(key.both));
 }
 
-uint32_t futex_hash(futex_queue &queue)
+}; // namespace futex
+
+/* Futexes are hashed into buckets, each with its own lock and list of waiters. Shared futexes go
+ * into a system-wide table, and private futexes (keyed by address space) into a per-mm table that
+ * gets allocated on first use, so unrelated processes don't contend on the same buckets. Both are
+ * sized according to the number of CPUs.
+ */
+
+struct futex_bucket
+{
+    struct spinlock lock;
+    struct list_head waiters;
+} __align_cache;
+
+struct futex_hash
+{
+    unsigned int mask;
+    struct futex_bucket *buckets;
+};
+
+/* Buckets per CPU */
+#define FUTEX_GLOBAL_BUCKETS_PER_CPU  256U
+#define FUTEX_PRIVATE_BUCKETS_PER_CPU 4U
+#define FUTEX_PRIVATE_MIN_BUCKETS     16U
+
+static struct futex_hash *global_futex_hash;
+
+static unsigned int futex_roundup_pow2(unsigned int n)
+{
+    return n <= 1 ? 1 : 1U << (ilog2(n - 1) + 1);
+}
+
+static struct futex_hash *futex_hash_alloc(unsigned int nr_buckets)
 {
-    return __futex_hash(queue.get_key());
+    nr_buckets = futex_roundup_pow2(nr_buckets);
+
+    struct futex_hash *hash = (struct futex_hash *) kmalloc(sizeof(*hash), GFP_KERNEL);
+    if (!hash)
+        return nullptr;
+
+    hash->buckets =
+        (struct futex_bucket *) kcalloc(nr_buckets, sizeof(struct futex_bucket), GFP_KERNEL);
+    if (!hash->buckets)
+    {
+        kfree(hash);
+        return nullptr;
+    }
+
+    hash->mask = nr_buckets - 1;
+
+    for (unsigned int i = 0; i < nr_buckets; i++)
+    {
+        spinlock_init(&hash->buckets[i].lock);
+        INIT_LIST_HEAD(&hash->buckets[i].waiters);
+    }
+
+    return hash;
 }
 
-/* We're holding a system-wide hashtable for futexes. Each bucket has a separate
- * lock to encourage concurrency. Futexes are hashed by the fnv of the futex key, whose values
- * depend on the type of mapping.
+/**
+ * @brief Free a futex hash table
+ * Called when an address space is destroyed, at which point no one can be waiting on it.
+ *
+ * @param hash Hash table (may be NULL)
  */
+void futex_hash_free(struct futex_hash *hash)
+{
+    if (!hash)
+        return;
+    kfree(hash->buckets);
+    kfree(hash);
+}
 
-static constexpr size_t futex_hashtable_buckets = 1024;
-static cul::hashtable2<futex_queue, futex_hashtable_buckets, uint32_t, futex_hash> futex_hashtable;
-static struct spinlock futex_hashtable_locks[futex_hashtable_buckets];
-
-uint32_t get_hashtable(futex_key &key)
+static struct futex_hash *futex_private_hash(struct mm_address_space *as)
 {
-    auto hash = __futex_hash(key);
-    auto index = futex_hashtable.get_hashtable_index(hash);
+    struct futex_hash *hash = __atomic_load_n(&as->futex_hash, __ATOMIC_ACQUIRE);
+    if (likely(hash))
+        return hash;
+
+    hash = futex_hash_alloc(
+        cul::max(get_nr_cpus() * FUTEX_PRIVATE_BUCKETS_PER_CPU, FUTEX_PRIVATE_MIN_BUCKETS));
+    if (!hash)
+        return nullptr;
+
+    struct futex_hash *expected = nullptr;
+    if (!__atomic_compare_exchange_n(&as->futex_hash, &expected, hash, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+    {
+        /* Someone else beat us to it */
+        futex_hash_free(hash);
+        hash = expected;
+    }
 
-    spin_lock(&futex_hashtable_locks[index]);
+    return hash;
+}
 
-    return index;
+static void futex_init()
+{
+    global_futex_hash = futex_hash_alloc(get_nr_cpus() * FUTEX_GLOBAL_BUCKETS_PER_CPU);
+    if (!global_futex_hash)
+        panic("futex: Failed to allocate the futex hash table");
 }
 
-cul::pair<uint32_t, uint32_t> lock_two_hashes(futex_key &key1, futex_key &key2)
+INIT_LEVEL_CORE_KERNEL_ENTRY(futex_init);
+
+namespace futex
 {
-    const auto hash1 = __futex_hash(key1);
-    const auto hash2 = __futex_hash(key2);
 
-    auto index1 = futex_hashtable.get_hashtable_index(hash1);
-    auto index2 = futex_hashtable.get_hashtable_index(hash2);
+/**
+ * @brief Get the bucket a futex key hashes to
+ *
+ * @param key Futex key
+ * @param create If false, don't allocate the process' hash table if it doesn't exist yet
+ * @return The bucket, or NULL if the process' hash table doesn't exist (or failed to allocate)
+ */
+static struct futex_bucket *get_bucket(futex_key &key, bool create = true)
+{
+    struct futex_hash *hash = global_futex_hash;
+
+    if (key.both.offset & FUTEX_OFFSET_PRIVATE)
+    {
+        struct mm_address_space *as = key.private_mapping.as;
+        hash = create ? futex_private_hash(as) : __atomic_load_n(&as->futex_hash, __ATOMIC_ACQUIRE);
+        if (!hash)
+            return nullptr;
+    }
+
+    return &hash->buckets[__futex_hash(key) & hash->mask];
+}
 
-    if (index1 < index2)
+static void lock_two_buckets(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+    if (b1 < b2)
     {
-        spin_lock(&futex_hashtable_locks[index1]);
-        spin_lock(&futex_hashtable_locks[index2]);
+        spin_lock(&b1->lock);
+        spin_lock(&b2->lock);
     }
-    else if (index1 > index2)
+    else if (b1 > b2)
     {
-        spin_lock(&futex_hashtable_locks[index2]);
-        spin_lock(&futex_hashtable_locks[index1]);
+        spin_lock(&b2->lock);
+        spin_lock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_lock(&futex_hashtable_locks[index1]);
+        spin_lock(&b1->lock);
     }
-
-    return {index1, index2};
 }
 
-void unlock_two_hashes(uint32_t index1, uint32_t index2)
+static void unlock_two_buckets(struct futex_bucket *b1, struct futex_bucket *b2)
 {
-    if (index1 > index2)
+    if (b1 > b2)
     {
-        spin_unlock(&futex_hashtable_locks[index1]);
-        spin_unlock(&futex_hashtable_locks[index2]);
+        spin_unlock(&b1->lock);
+        spin_unlock(&b2->lock);
     }
-    else if (index1 < index2)
+    else if (b1 < b2)
     {
-        spin_unlock(&futex_hashtable_locks[index2]);
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_unlock(&b2->lock);
+        spin_unlock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_unlock(&b1->lock);
+    }
+}
+
+static struct futex_bucket *lock_queue_bucket(futex_queue *q)
+{
+    /* cmp_requeue may move us to another bucket while we're not holding its lock */
+    for (;;)
+    {
+        struct futex_bucket *b = READ_ONCE(q->bucket);
+        spin_lock(&b->lock);
+        if (b == q->bucket)
+            return b;
+        spin_unlock(&b->lock);
     }
 }
 
@@ -296,18 +475,17 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
 
     futex_queue queue{key};
 
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-	printk("wuaddr %p index %lu\n", uaddr, index);
-#endif
     /* After making a queue entry for this thread and this key,
      * we're going to atomically calculate a hash index and lock that hash index,
      * then check for the value(and if doesn't match, return -EAGAIN), and finally, sleep.
      */
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-    auto lock = &futex_hashtable_locks[hash_index];
+    struct futex_bucket *bucket = get_bucket(key);
+    if (!bucket)
+        return -ENOMEM;
+
+    auto list_head = &bucket->waiters;
+    auto lock = &bucket->lock;
+    spin_lock(lock);
 
     unsigned int curr_val = 0;
 
@@ -324,6 +502,7 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
     }
 
     list_add_tail(&queue.list_node, list_head);
+    queue.bucket = bucket;
 
     if (has_timeout)
         st = queue.wait(timeout, lock);
@@ -334,11 +513,19 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
 
     if (!queue.was_awaken())
     {
-        futex_hashtable.remove_element(queue);
+        /* We may have been requeued to a different bucket while sleeping */
+        if (READ_ONCE(queue.bucket) != bucket)
+        {
+            spin_unlock(lock);
+            lock = &lock_queue_bucket(&queue)->lock;
+        }
+
+        if (!queue.was_awaken())
+            list_remove(&queue.list_node);
     }
 
 out:
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    spin_unlock(lock);
     return st;
 }
 
@@ -353,17 +540,13 @@ int wake(int *uaddr, int flags, int to_wake)
     if ((st = calculate_key(uaddr, flags, key)) < 0)
         return st;
 
-        // printk("Shared: %s\n", key.both.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
-
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-
-	printk("uaddr %p index %lu\n", uaddr, index);
-#endif
+    /* No hash table means no one ever waited on a private futex here */
+    struct futex_bucket *bucket = get_bucket(key, false);
+    if (!bucket)
+        return 0;
 
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
+    auto list_head = &bucket->waiters;
+    spin_lock(&bucket->lock);
 
     int awaken = 0;
 
@@ -374,26 +557,34 @@ int wake(int *uaddr, int flags, int to_wake)
 
         futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
 
-        MUST_HOLD_LOCK(&futex_hashtable_locks[hash_index]);
+        MUST_HOLD_LOCK(&bucket->lock);
 
         if (f->get_key() == key)
         {
+            /* PI waiters can only be woken up by unlocking (or requeueing) */
+            if (f->is_pi())
+            {
+                st = -EINVAL;
+                break;
+            }
+
             f->wake();
             to_wake--;
             awaken++;
         }
     }
 
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    spin_unlock(&bucket->lock);
 
-    return awaken;
+    return st < 0 ? st : awaken;
 }
 
-void futex_queue::requeue(const futex_key &new_key, struct list_head *new_head)
+void futex_queue::requeue(const futex_key &new_key, struct futex_bucket *new_bucket)
 {
     key = new_key;
     list_remove(&list_node);
-    list_add(&list_node, new_head);
+    list_add(&list_node, &new_bucket->waiters);
+    WRITE_ONCE(bucket, new_bucket);
 }
 
 int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2, int val3,
@@ -416,10 +607,14 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
 
     // printk("Shared: %s\n", key.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
 
-    auto [hash_index1, hash_index2] = lock_two_hashes(key1, key2);
+    struct futex_bucket *bucket1 = get_bucket(key1);
+    struct futex_bucket *bucket2 = get_bucket(key2);
+    if (!bucket1 || !bucket2)
+        return -ENOMEM;
 
-    auto wake_list = futex_hashtable.get_hashtable(hash_index1);
-    auto requeue_list = futex_hashtable.get_hashtable(hash_index2);
+    lock_two_buckets(bucket1, bucket2);
+
+    auto wake_list = &bucket1->waiters;
 
     int awaken = 0, requeued = 0;
 
@@ -449,6 +644,12 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
 
         if (f->get_key() == key1)
         {
+            if (f->is_pi())
+            {
+                st = -EINVAL;
+                goto out;
+            }
+
             if (to_wake > 0)
             {
                 f->wake();
@@ -457,7 +658,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
             }
             else
             {
-                f->requeue(key2, requeue_list);
+                f->requeue(key2, bucket2);
                 to_requeue--;
                 requeued++;
             }
@@ -476,7 +677,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
         st = awaken;
 
 out:
-    unlock_two_hashes(hash_index1, hash_index2);
+    unlock_two_buckets(bucket1, bucket2);
     return st;
 }
 
@@ -485,6 +686,786 @@ int requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2)
     return cmp_requeue(uaddr, flags, to_wake, to_requeue, uaddr2, 0, false);
 }
 
+/* PI futexes: the futex word holds the owner's TID, with FUTEX_WAITERS set if unlocking needs to go
+ * through the kernel. Once there are waiters, the futex gets a futex_pi_state whose rt_mutex is
+ * locked on behalf of the owner, and the waiters sleep on the rt_mutex, boosting the owner.
+ * Unlocking writes the top waiter's TID to the word and hands the rt_mutex over to it, so there's
+ * no lock stealing. All of this is serialized by the futex's bucket lock.
+ */
+
+static void futex_pi_state_get(struct futex_pi_state *pi)
+{
+    __atomic_add_fetch(&pi->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static bool futex_pi_state_get_unless_zero(struct futex_pi_state *pi)
+{
+    unsigned long ref = __atomic_load_n(&pi->refcount, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (ref == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&pi->refcount, &ref, ref + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
+static void futex_pi_state_put(struct futex_pi_state *pi)
+{
+    if (__atomic_sub_fetch(&pi->refcount, 1, __ATOMIC_RELEASE) != 0)
+        return;
+
+    if (pi->owner)
+    {
+        spin_lock(&pi->owner->pi_lock);
+        list_remove(&pi->list_node);
+        spin_unlock(&pi->owner->pi_lock);
+        thread_put(pi->owner);
+    }
+
+    delete pi;
+}
+
+/**
+ * @brief Move a pi state to a new owner
+ *
+ * @param pi PI state
+ * @param new_owner New owner, or NULL
+ */
+static void futex_pi_state_set_owner(struct futex_pi_state *pi, struct thread *new_owner)
+{
+    struct thread *old = pi->owner;
+
+    if (old)
+    {
+        spin_lock(&old->pi_lock);
+        list_remove(&pi->list_node);
+        spin_unlock(&old->pi_lock);
+    }
+
+    if (new_owner)
+    {
+        thread_get(new_owner);
+        spin_lock(&new_owner->pi_lock);
+        list_add_tail(&pi->list_node, &new_owner->pi_state_list);
+        spin_unlock(&new_owner->pi_lock);
+    }
+
+    pi->owner = new_owner;
+
+    if (old)
+        thread_put(old);
+}
+
+static struct futex_pi_state *futex_find_pi_state(struct futex_bucket *bucket,
+                                                  const futex_key &key)
+{
+    MUST_HOLD_LOCK(&bucket->lock);
+
+    list_for_every (&bucket->waiters)
+    {
+        futex_queue *q = list_head_cpp<futex_queue>::self_from_list_head(l);
+        if (q->pi_state && q->get_key() == key)
+            return q->pi_state;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Set up the pi state of a futex, on behalf of its current owner
+ *
+ * @param key Futex key
+ * @param tid Owner's TID, as found in the futex word
+ * @param prealloc Preallocated pi state, consumed (set to NULL) on success
+ * @param ppi Where to store the (referenced) pi state
+ * @return 0 on success, -ESRCH if the owner doesn't exist (or exited)
+ */
+static int futex_pi_attach(const futex_key &key, pid_t tid, struct futex_pi_state **prealloc,
+                           struct futex_pi_state **ppi)
+{
+    struct futex_pi_state *pi = *prealloc;
+    struct thread *owner = thread_get_from_tid(tid);
+    if (!owner)
+        return -ESRCH;
+
+    pi->key = key;
+    pi->owner = owner;
+    pi->owner_died = false;
+    pi->refcount = 1;
+    rt_mutex_init_proxy_locked(&pi->lock, owner);
+
+    spin_lock(&owner->pi_lock);
+
+    /* An exiting owner has already handed over its PI futexes, it can't take new ones */
+    if (owner->flags & THREAD_PI_EXITED)
+    {
+        spin_unlock(&owner->pi_lock);
+        thread_put(owner);
+        return -ESRCH;
+    }
+
+    list_add_tail(&pi->list_node, &owner->pi_state_list);
+    spin_unlock(&owner->pi_lock);
+
+    *prealloc = nullptr;
+    *ppi = pi;
+    return 0;
+}
+
+/**
+ * @brief Try to take a PI futex on behalf of a thread, or get its pi state
+ *
+ * @param uaddr Futex word
+ * @param bucket Futex bucket (locked)
+ * @param key Futex key
+ * @param thread Thread that wants the futex
+ * @param set_waiters If true, set FUTEX_WAITERS when taking the futex
+ * @param prealloc Preallocated pi state, consumed (set to NULL) if used
+ * @param ppi Where to store the (referenced) pi state, if someone else owns the futex
+ * @return 1 if the thread got the futex, 0 if someone else owns it, negative error code
+ */
+static int futex_lock_pi_atomic(unsigned int *uaddr, struct futex_bucket *bucket,
+                                const futex_key &key, struct thread *thread, bool set_waiters,
+                                struct futex_pi_state **prealloc, struct futex_pi_state **ppi)
+{
+    MUST_HOLD_LOCK(&bucket->lock);
+    unsigned int val, curr;
+    pid_t tid = thread->id;
+
+    if (get_user32(uaddr, &val) < 0)
+        return -EFAULT;
+
+    for (;;)
+    {
+        if ((pid_t) (val & FUTEX_TID_MASK) == tid)
+            return -EDEADLK;
+
+        struct futex_pi_state *pi = futex_find_pi_state(bucket, key);
+
+        if (!(val & FUTEX_TID_MASK))
+        {
+            /* Unlocks hand the futex over to the top waiter, so a free futex has no pi state */
+            if (pi)
+                return -EINVAL;
+
+            unsigned int newval =
+                tid | (val & FUTEX_OWNER_DIED) | (set_waiters ? FUTEX_WAITERS : 0);
+            if (cmpxchg_user32(uaddr, val, newval, &curr) < 0)
+                return -EFAULT;
+            if (curr != val)
+            {
+                val = curr;
+                continue;
+            }
+
+            return 1;
+        }
+
+        if (!(val & FUTEX_WAITERS))
+        {
+            /* Make the owner go through the kernel when unlocking */
+            if (cmpxchg_user32(uaddr, val, val | FUTEX_WAITERS, &curr) < 0)
+                return -EFAULT;
+            if (curr != val)
+            {
+                val = curr;
+                continue;
+            }
+        }
+
+        if (pi)
+        {
+            /* If the owner died, the new owner fixes up the word when it wakes up */
+            if (!pi->owner_died && (pid_t) (val & FUTEX_TID_MASK) != pi->owner->id)
+                return -EINVAL;
+
+            futex_pi_state_get(pi);
+            *ppi = pi;
+            return 0;
+        }
+
+        return futex_pi_attach(key, val & FUTEX_TID_MASK, prealloc, ppi);
+    }
+}
+
+/**
+ * @brief Fix up the futex word after getting a PI futex whose previous owner died
+ *
+ * @param uaddr Futex word
+ * @param pi PI state
+ */
+static void futex_pi_fixup_owner(unsigned int *uaddr, struct futex_pi_state *pi)
+{
+    unsigned int val, curr;
+
+    if (!pi->owner_died)
+        return;
+
+    pi->owner_died = false;
+
+    if (get_user32(uaddr, &val) < 0)
+        return;
+
+    for (;;)
+    {
+        unsigned int newval = get_current_thread()->id | FUTEX_OWNER_DIED | FUTEX_WAITERS;
+        if (cmpxchg_user32(uaddr, val, newval, &curr) < 0 || curr == val)
+            return;
+        val = curr;
+    }
+}
+
+static int futex_fault_in_writeable(unsigned int *uaddr)
+{
+    struct page *page;
+
+    /* We're going to write to the word with the bucket lock held, where we can't fault it in */
+    if (!(get_phys_pages(uaddr, GPP_WRITE | GPP_USER, &page, 1) & GPP_ACCESS_OK))
+        return -EFAULT;
+
+    page_unpin(page);
+    return 0;
+}
+
+/**
+ * @brief Lock a PI futex
+ *
+ * @param uaddr Futex word
+ * @param flags Futex flags
+ * @param timeout Relative timeout, or 0 for none
+ * @param trylock If true, don't wait if someone else owns the futex
+ * @return 0 on success, negative error code
+ */
+int lock_pi(int *uaddr, int flags, hrtime_t timeout, bool trylock)
+{
+    struct thread *current = get_current_thread();
+    struct futex_pi_state *prealloc, *pi = nullptr;
+    struct futex_bucket *bucket;
+    futex_key key{};
+    int st;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    bucket = get_bucket(key);
+    if (!bucket)
+        return -ENOMEM;
+
+    prealloc = new futex_pi_state;
+    if (!prealloc)
+        return -ENOMEM;
+
+    futex_queue queue{key};
+
+    if ((st = futex_fault_in_writeable((unsigned int *) uaddr)) < 0)
+        goto out_free;
+
+    spin_lock(&bucket->lock);
+
+    st = futex_lock_pi_atomic((unsigned int *) uaddr, bucket, key, current, false, &prealloc, &pi);
+    if (st != 0)
+    {
+        spin_unlock(&bucket->lock);
+        st = st == 1 ? 0 : st;
+        goto out_free;
+    }
+
+    if (trylock)
+    {
+        st = -EWOULDBLOCK;
+        goto out_put;
+    }
+
+    queue.thread = current;
+    queue.pi_state = pi;
+    list_add_tail(&queue.list_node, &bucket->waiters);
+    queue.bucket = bucket;
+
+    /* The pi state's rt_mutex is always owned (by the futex's owner) */
+    st = rt_mutex_start_proxy_lock(&pi->lock, &queue.pi_waiter, current);
+    DCHECK(st != 1);
+    spin_unlock(&bucket->lock);
+
+    if (st == 0)
+        st = rt_mutex_wait_proxy_lock(&queue.pi_waiter, timeout);
+
+    /* PI waiters don't get requeued, so we're still on the same bucket */
+    spin_lock(&bucket->lock);
+
+    /* We may have been handed the lock after timing out or getting a signal */
+    if (st < 0 && st != -EDEADLK && rt_mutex_cleanup_proxy_lock(&pi->lock, &queue.pi_waiter))
+        st = 0;
+
+    if (st == 0)
+        futex_pi_fixup_owner((unsigned int *) uaddr, pi);
+
+    list_remove(&queue.list_node);
+
+out_put:
+    futex_pi_state_put(pi);
+    spin_unlock(&bucket->lock);
+out_free:
+    delete prealloc;
+    return st;
+}
+
+/**
+ * @brief Unlock a PI futex, handing it over to the top waiter
+ *
+ * @param uaddr Futex word
+ * @param flags Futex flags
+ * @return 0 on success, negative error code
+ */
+int unlock_pi(int *uaddr, int flags)
+{
+    struct thread *current = get_current_thread();
+    struct thread *new_owner = nullptr;
+    struct futex_pi_state *pi;
+    struct futex_bucket *bucket;
+    unsigned int val, curr, newval;
+    futex_key key{};
+    int st;
+
+    if (get_user32((unsigned int *) uaddr, &val) < 0)
+        return -EFAULT;
+
+    if ((pid_t) (val & FUTEX_TID_MASK) != current->id)
+        return -EPERM;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    bucket = get_bucket(key);
+    if (!bucket)
+        return -ENOMEM;
+
+    if ((st = futex_fault_in_writeable((unsigned int *) uaddr)) < 0)
+        return st;
+
+    spin_lock(&bucket->lock);
+
+    pi = futex_find_pi_state(bucket, key);
+    if (pi)
+    {
+        if (pi->owner != current)
+        {
+            st = -EINVAL;
+            goto out;
+        }
+
+        new_owner = rt_mutex_next_owner(&pi->lock);
+    }
+
+    /* Give the futex to the top waiter, or release it if there's no one waiting */
+    newval = new_owner ? new_owner->id | FUTEX_WAITERS : 0;
+
+    for (;;)
+    {
+        if (cmpxchg_user32((unsigned int *) uaddr, val, newval, &curr) < 0)
+        {
+            st = -EFAULT;
+            goto out;
+        }
+
+        if (curr == val)
+            break;
+
+        /* Only FUTEX_WAITERS can change under us */
+        if ((pid_t) (curr & FUTEX_TID_MASK) != current->id)
+        {
+            st = -EPERM;
+            goto out;
+        }
+
+        val = curr;
+    }
+
+    if (pi)
+    {
+        futex_pi_state_set_owner(pi, new_owner);
+        rt_mutex_handover(&pi->lock, new_owner);
+    }
+
+out:
+    spin_unlock(&bucket->lock);
+    return st;
+}
+
+/**
+ * @brief Wait on a futex, to be requeued to a PI futex by FUTEX_CMP_REQUEUE_PI
+ *
+ * @param uaddr Futex word
+ * @param val Expected value
+ * @param flags Futex flags
+ * @param timeout Relative timeout, or 0 for none
+ * @param uaddr2 PI futex
+ * @return 0 if we got the PI futex, negative error code
+ */
+int wait_requeue_pi(int *uaddr, int val, int flags, hrtime_t timeout, int *uaddr2)
+{
+    struct thread *current = get_current_thread();
+    struct futex_bucket *bucket;
+    futex_key key{}, key2{};
+    unsigned int curr_val;
+    int st;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    if ((st = calculate_key(uaddr2, flags, key2)) < 0)
+        return st;
+
+    if (key == key2)
+        return -EINVAL;
+
+    bucket = get_bucket(key);
+    if (!bucket)
+        return -ENOMEM;
+
+    futex_queue queue{key};
+    queue.thread = current;
+    queue.requeue_pi_key = &key2;
+
+    spin_lock(&bucket->lock);
+
+    if (get_user32((unsigned int *) uaddr, &curr_val) < 0)
+    {
+        st = -EFAULT;
+        goto out;
+    }
+
+    if (curr_val != (unsigned int) val)
+    {
+        st = -EAGAIN;
+        goto out;
+    }
+
+    list_add_tail(&queue.list_node, &bucket->waiters);
+    queue.bucket = bucket;
+
+    if (timeout)
+        st = queue.wait_requeue_pi(timeout, &bucket->lock);
+    else
+        st = queue.wait_requeue_pi(&bucket->lock);
+
+    /* We may have been requeued to uaddr2's bucket while sleeping */
+    if (READ_ONCE(queue.bucket) != bucket)
+    {
+        spin_unlock(&bucket->lock);
+        bucket = lock_queue_bucket(&queue);
+    }
+
+    if (queue.pi_owned)
+    {
+        /* FUTEX_CMP_REQUEUE_PI took the PI futex for us, and dequeued us */
+        st = 0;
+    }
+    else if (queue.pi_state)
+    {
+        struct futex_pi_state *pi = queue.pi_state;
+
+        /* We were requeued to the PI futex, and may have been handed its rt_mutex */
+        st = rt_mutex_cleanup_proxy_lock(&pi->lock, &queue.pi_waiter) ? 0 : st;
+        if (st == 0)
+            futex_pi_fixup_owner((unsigned int *) uaddr2, pi);
+
+        list_remove(&queue.list_node);
+        futex_pi_state_put(pi);
+    }
+    else
+    {
+        /* Timed out or got a signal before being requeued */
+        DCHECK(st < 0);
+        list_remove(&queue.list_node);
+    }
+
+out:
+    spin_unlock(&bucket->lock);
+    return st;
+}
+
+/**
+ * @brief Requeue FUTEX_WAIT_REQUEUE_PI waiters to a PI futex
+ * The top waiter gets the PI futex (and is woken up) if it's free, the rest start waiting on it.
+ *
+ * @param uaddr Futex word
+ * @param flags Futex flags
+ * @param to_wake Number of waiters to wake up, must be 1
+ * @param to_requeue Number of waiters to requeue
+ * @param uaddr2 PI futex
+ * @param val3 Expected value of uaddr
+ * @return Number of woken up + requeued waiters, or negative error code
+ */
+int cmp_requeue_pi(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2, int val3)
+{
+    struct futex_pi_state *prealloc, *pi = nullptr;
+    struct futex_bucket *bucket1, *bucket2;
+    futex_key key1{}, key2{};
+    unsigned int on_uaddr;
+    int st, awaken = 0, requeued = 0;
+
+    /* Only the top waiter can take the PI futex */
+    if (to_wake != 1 || to_requeue < 0)
+        return -EINVAL;
+
+    if ((st = calculate_key(uaddr, flags, key1)) < 0)
+        return st;
+
+    if ((st = calculate_key(uaddr2, flags, key2)) < 0)
+        return st;
+
+    if (key1 == key2)
+        return -EINVAL;
+
+    bucket1 = get_bucket(key1);
+    bucket2 = get_bucket(key2);
+    if (!bucket1 || !bucket2)
+        return -ENOMEM;
+
+    if ((st = futex_fault_in_writeable((unsigned int *) uaddr2)) < 0)
+        return st;
+
+    prealloc = new futex_pi_state;
+    if (!prealloc)
+        return -ENOMEM;
+
+    lock_two_buckets(bucket1, bucket2);
+
+    if (get_user32((unsigned int *) uaddr, &on_uaddr) < 0)
+    {
+        st = -EFAULT;
+        goto out;
+    }
+
+    if (on_uaddr != (unsigned int) val3)
+    {
+        st = -EAGAIN;
+        goto out;
+    }
+
+    list_for_every_safe (&bucket1->waiters)
+    {
+        futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
+
+        if (!(f->get_key() == key1))
+            continue;
+
+        /* Every waiter must be waiting to be requeued to this PI futex */
+        if (!f->requeue_pi_key || !(*f->requeue_pi_key == key2))
+        {
+            st = -EINVAL;
+            break;
+        }
+
+        if (!pi && !awaken)
+        {
+            /* Try to take the PI futex for the top waiter, else get the pi state */
+            st = futex_lock_pi_atomic((unsigned int *) uaddr2, bucket2, key2, f->thread, true,
+                                      &prealloc, &pi);
+            if (st < 0)
+                break;
+
+            if (st == 1)
+            {
+                f->pi_owned = true;
+                f->wake();
+                awaken++;
+                st = 0;
+                continue;
+            }
+        }
+
+        if (requeued == to_requeue)
+            break;
+
+        if (!pi)
+        {
+            /* The top waiter got the PI futex, the others are going to wait on it */
+            st = futex_lock_pi_atomic((unsigned int *) uaddr2, bucket2, key2, f->thread, true,
+                                      &prealloc, &pi);
+            if (st < 0)
+                break;
+            DCHECK(st == 0);
+        }
+
+        st = rt_mutex_start_proxy_lock(&pi->lock, &f->pi_waiter, f->thread);
+        if (st < 0)
+            break;
+        DCHECK(st == 0);
+
+        futex_pi_state_get(pi);
+        WRITE_ONCE(f->pi_state, pi);
+        f->requeue(key2, bucket2);
+        requeued++;
+    }
+
+    if (pi)
+        futex_pi_state_put(pi);
+
+    /* Report partial progress over errors, as the waiters we moved can't be moved back */
+    if (awaken + requeued)
+        st = awaken + requeued;
+
+out:
+    unlock_two_buckets(bucket1, bucket2);
+    delete prealloc;
+    return st;
+}
+
+/* futex_waitv: every futex_queue shares the same wait queue, so a wake() on any of them wakes us
+ * up. We can't hold all the bucket locks while sleeping, so the queues are added one at a time,
+ * and removed one at a time after we wake up. */
+
+#define FUTEX_WAITV_VALID_FLAGS (FUTEX_32 | FUTEX_PRIVATE_FLAG)
+
+/**
+ * @brief Dequeue the first nr queues of a futex_waitv
+ *
+ * @param queues Queues
+ * @param nr Number of queues to dequeue
+ * @return Index of the first queue that was woken up, or -1 if none was
+ */
+static int waitv_unqueue(futex_queue *queues, unsigned int nr)
+{
+    int woken = -1;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        /* Even if we were woken up, we need to lock the bucket to make sure wake() is done with
+         * our (stack allocated) wait queue */
+        struct futex_bucket *b = lock_queue_bucket(&queues[i]);
+        if (!queues[i].was_awaken())
+            list_remove(&queues[i].list_node);
+        else if (woken < 0)
+            woken = i;
+        spin_unlock(&b->lock);
+
+        queues[i].~futex_queue();
+    }
+
+    return woken;
+}
+
+static bool waitv_any_awaken(futex_queue *queues, unsigned int nr)
+{
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        if (queues[i].was_awaken())
+            return true;
+    }
+
+    return false;
+}
+
+static int waitv_sleep(struct wait_queue *wq, futex_queue *queues, unsigned int nr)
+{
+    return wait_for_event_interruptible(wq, waitv_any_awaken(queues, nr));
+}
+
+static int waitv_sleep_timeout(struct wait_queue *wq, futex_queue *queues, unsigned int nr,
+                               hrtime_t timeout)
+{
+    return wait_for_event_timeout_interruptible(wq, waitv_any_awaken(queues, nr), timeout);
+}
+
+/**
+ * @brief Queue one futex_waitv entry, if the futex still has the expected value
+ *
+ * @param q Queue (uninitialized)
+ * @param w futex_waitv entry
+ * @param wq Shared wait queue
+ * @return 0 on success, negative error code. On error, q is left uninitialized.
+ */
+static int waitv_queue(futex_queue *q, const struct futex_waitv &w, struct wait_queue *wq)
+{
+    futex_key key{};
+    unsigned int val;
+    int st;
+
+    if (w.flags & ~FUTEX_WAITV_VALID_FLAGS || !(w.flags & FUTEX_32) || w.__reserved)
+        return -EINVAL;
+    if (w.uaddr & (4 - 1) || w.val > UINT_MAX)
+        return -EINVAL;
+
+    int *uaddr = (int *) w.uaddr;
+
+    if ((st = calculate_key(uaddr, w.flags & FUTEX_PRIVATE_FLAG, key)) < 0)
+        return st;
+
+    struct futex_bucket *bucket = get_bucket(key);
+    if (!bucket)
+        return -ENOMEM;
+
+    spin_lock(&bucket->lock);
+
+    if (get_user32((unsigned int *) uaddr, &val) < 0)
+        st = -EFAULT;
+    else if (val != (unsigned int) w.val)
+        st = -EAGAIN;
+    else
+    {
+        new (q) futex_queue{key, wq};
+        list_add_tail(&q->list_node, &bucket->waiters);
+        q->bucket = bucket;
+    }
+
+    spin_unlock(&bucket->lock);
+    return st;
+}
+
+/**
+ * @brief Wait on multiple futexes
+ *
+ * @param uwaiters User array of futex_waitv
+ * @param nr Number of futexes
+ * @param timeout Relative timeout, if has_timeout
+ * @param has_timeout True if we have a timeout
+ * @return Index of the futex that woke us up, or negative error code
+ */
+int waitv(const struct futex_waitv *uwaiters, unsigned int nr, hrtime_t timeout, bool has_timeout)
+{
+    struct wait_queue wq;
+    unsigned int queued;
+    int st = 0, woken;
+
+    init_wait_queue_head(&wq);
+
+    /* Up to FUTEX_WAITV_MAX of these is too much for the stack */
+    futex_queue *queues = (futex_queue *) kcalloc(nr, sizeof(futex_queue), GFP_KERNEL);
+    if (!queues)
+        return -ENOMEM;
+
+    for (queued = 0; queued < nr; queued++)
+    {
+        struct futex_waitv w;
+        if (copy_from_user(&w, &uwaiters[queued], sizeof(w)) < 0)
+        {
+            st = -EFAULT;
+            break;
+        }
+
+        if ((st = waitv_queue(&queues[queued], w, &wq)) < 0)
+            break;
+    }
+
+    if (st == 0)
+    {
+        if (has_timeout)
+            st = waitv_sleep_timeout(&wq, queues, nr, timeout);
+        else
+            st = waitv_sleep(&wq, queues, nr);
+    }
+
+    /* A wakeup wins over an error */
+    woken = waitv_unqueue(queues, queued);
+    kfree(queues);
+
+    return woken >= 0 ? woken : st;
+}
+
 }; // namespace futex
 
 int futex_wake(int *uaddr, int nr_waiters)
@@ -495,28 +1476,130 @@ int futex_wake(int *uaddr, int nr_waiters)
     return futex::wake(uaddr, 0, nr_waiters);
 }
 
-/* TODO: Add FUTEX_CLOCK_REALTIME support */
-#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG)
+/**
+ * @brief Release an exiting thread's PI futexes
+ * Each futex (and its rt_mutex) gets handed over to its top waiter, which then marks the futex
+ * word with FUTEX_OWNER_DIED. Once this returns, the thread can't become the owner of new pi states.
+ *
+ * @param thread Exiting thread (the current thread)
+ */
+void futex_exit_pi(struct thread *thread)
+{
+    DCHECK(thread == get_current_thread());
+
+    for (;;)
+    {
+        struct futex::futex_pi_state *pi = nullptr;
+
+        spin_lock(&thread->pi_lock);
+
+        if (list_is_empty(&thread->pi_state_list))
+        {
+            thread_set_flag(thread, THREAD_PI_EXITED);
+            spin_unlock(&thread->pi_lock);
+            break;
+        }
+
+        list_for_every (&thread->pi_state_list)
+        {
+            auto p = container_of(l, struct futex::futex_pi_state, list_node);
+            if (futex::futex_pi_state_get_unless_zero(p))
+            {
+                pi = p;
+                break;
+            }
+        }
+
+        spin_unlock(&thread->pi_lock);
+
+        if (!pi)
+        {
+            /* Everything left is being freed, and will get removed from the list shortly */
+            cpu_relax();
+            continue;
+        }
+
+        /* The bucket can't go away, as it has waiters */
+        struct futex_bucket *bucket = futex::get_bucket(pi->key, false);
+        spin_lock(&bucket->lock);
+
+        if (pi->owner == thread)
+        {
+            struct thread *new_owner = rt_mutex_next_owner(&pi->lock);
+            pi->owner_died = true;
+            futex::futex_pi_state_set_owner(pi, new_owner);
+            rt_mutex_handover(&pi->lock, new_owner);
+        }
+
+        futex::futex_pi_state_put(pi);
+        spin_unlock(&bucket->lock);
+    }
+}
+
+/* FUTEX_CLOCK_REALTIME is only supported by FUTEX_WAIT_REQUEUE_PI, for now */
+#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
 static inline int get_val2(const struct timespec *t)
 {
     return (int) (long) t;
 }
 
+/**
+ * @brief Convert an absolute user timeout to a relative one
+ *
+ * @param uts User timespec
+ * @param clockid CLOCK_MONOTONIC or CLOCK_REALTIME
+ * @param timeout Where to store the relative timeout (never 0)
+ * @return 0 on success, negative error code
+ */
+static int futex_abs_timeout(const struct timespec *uts, clockid_t clockid, hrtime_t *timeout)
+{
+    struct timespec ts;
+    hrtime_t now;
+
+    if (copy_from_user(&ts, uts, sizeof(ts)) < 0)
+        return -EFAULT;
+
+    if (!timespec_valid(&ts, false))
+        return -EINVAL;
+
+    if (clockid == CLOCK_MONOTONIC)
+        now = clocksource_get_time();
+    else if (clockid == CLOCK_REALTIME)
+    {
+        struct timespec rt;
+        clock_gettime_kernel(CLOCK_REALTIME, &rt);
+        now = timespec_to_hrtime(&rt);
+    }
+    else
+        return -EINVAL;
+
+    hrtime_t deadline = timespec_to_hrtime(&ts);
+    /* 0 would mean "no timeout" to the wait primitives */
+    *timeout = deadline > now ? deadline - now : 1;
+    return 0;
+}
+
 int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout, int *uaddr2,
               int val3)
 {
     int flags = (futex_op & ~FUTEX_OP_MASK);
+    int op = futex_op & FUTEX_OP_MASK;
+    hrtime_t reltimeout = 0;
+    int st;
 
     /* Error out on bad flags */
     if (flags & ~FUTEX_KNOWN_FLAGS)
         return -EINVAL;
 
+    if (flags & FUTEX_CLOCK_REALTIME && op != FUTEX_WAIT_REQUEUE_PI)
+        return -ENOSYS;
+
     /* Bad pointer */
     if ((unsigned long) uaddr & (4 - 1))
         return -EINVAL;
 
-    switch (futex_op & FUTEX_OP_MASK)
+    switch (op)
     {
         case FUTEX_WAIT:
             return futex::wait(uaddr, val, flags, timeout);
@@ -527,7 +1610,47 @@ int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout,
         case FUTEX_REQUEUE:
             // printk("futex(%p, %d, %d)(op %d)\n", uaddr, futex_op, val, futex_op & FUTEX_OP_MASK);
             return futex::requeue(uaddr, flags, val, get_val2(timeout), uaddr2);
+        case FUTEX_LOCK_PI:
+            /* The timeout is absolute, and always measured against CLOCK_REALTIME */
+            if (timeout && (st = futex_abs_timeout(timeout, CLOCK_REALTIME, &reltimeout)) < 0)
+                return st;
+            return futex::lock_pi(uaddr, flags, reltimeout, false);
+        case FUTEX_TRYLOCK_PI:
+            return futex::lock_pi(uaddr, flags, 0, true);
+        case FUTEX_UNLOCK_PI:
+            return futex::unlock_pi(uaddr, flags);
+        case FUTEX_WAIT_REQUEUE_PI:
+            if ((unsigned long) uaddr2 & (4 - 1))
+                return -EINVAL;
+            if (timeout && (st = futex_abs_timeout(timeout,
+                                                   flags & FUTEX_CLOCK_REALTIME ? CLOCK_REALTIME
+                                                                                : CLOCK_MONOTONIC,
+                                                   &reltimeout)) < 0)
+                return st;
+            return futex::wait_requeue_pi(uaddr, val, flags, reltimeout, uaddr2);
+        case FUTEX_CMP_REQUEUE_PI:
+            if ((unsigned long) uaddr2 & (4 - 1))
+                return -EINVAL;
+            return futex::cmp_requeue_pi(uaddr, flags, val, get_val2(timeout), uaddr2, val3);
         default:
             return -ENOSYS;
     }
 }
+
+int sys_futex_waitv(const struct futex_waitv *waiters, unsigned int nr_futexes,
+                    unsigned int flags, const struct timespec *utimeout, clockid_t clockid)
+{
+    hrtime_t timeout = 0;
+    int st;
+
+    if (flags != 0)
+        return -EINVAL;
+
+    if (!waiters || nr_futexes == 0 || nr_futexes > FUTEX_WAITV_MAX)
+        return -EINVAL;
+
+    if (utimeout && (st = futex_abs_timeout(utimeout, clockid, &timeout)) < 0)
+        return st;
+
+    return futex::waitv(waiters, nr_futexes, timeout, utimeout != nullptr);
+}
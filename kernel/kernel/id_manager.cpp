@@ -74,6 +74,27 @@ uintmax_t idm_get_id(struct ids *ids)
     return id;
 }
 
+bool idm_reserve_id(struct ids *ids, uintmax_t id)
+{
+    assert(ids != NULL);
+    uintmax_t next = ids->id;
+
+    do
+    {
+        if (id < next || id >= ids->upper_limit)
+            return false;
+    } while (!ids->id.compare_exchange_weak(next, id + 1));
+
+    return true;
+}
+
+void idm_release_id(struct ids *ids, uintmax_t id)
+{
+    assert(ids != NULL);
+    uintmax_t next = id + 1;
+    ids->id.compare_exchange_strong(next, id);
+}
+
 uintmax_t idm_get_id_from_name(const char *name)
 {
     assert(name != NULL);
@@ -7,6 +7,7 @@
  */
 
 #include <onyx/dentry.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/mm/shmem.h>
 #include <onyx/rmap.h>
@@ -70,6 +71,11 @@ int vm_anon_fault(struct vm_pf_context *ctx)
         page = alloc_page((copy_old ? PAGE_ALLOC_NO_ZERO : 0) | GFP_KERNEL);
         if (!page)
             goto enomem;
+        if (mem_cgroup_charge(page, GFP_KERNEL) < 0)
+        {
+            page_unref(page);
+            goto enomem;
+        }
         page_set_anon(page);
         page->owner = (struct vm_object *) anon;
         page->pageoff = ctx->vpage;
@@ -106,25 +112,22 @@ __init void shmem_init()
 }
 
 /**
- * @brief Create a new shmem file
+ * @brief Create a new, unlinked shmem file
  *
- * @param len Length, in bytes
+ * @param name Name of the file's dentry, only used for display purposes
+ * @param size Initial size, in bytes
  * @return Opened struct file, or NULL
  */
-struct file *anon_get_shmem(size_t len)
+struct file *shmem_file_setup(const char *name, size_t size)
 {
     struct dentry *dentry;
     struct file *f;
     tmpfs_inode *ino = shmemfs_sb->alloc_inode(0777 | S_IFREG, 0);
     if (!ino)
         return nullptr;
-    ino->i_size = -1UL;
+    ino->i_size = size;
 
-    /* Note for future me: While this solution basically works, it does not properly work if we care
-     * about merging of MAP_SHARED or mremap. That will take some more annoying codepaths that e.g
-     * properly adjust the length of the inode.
-     */
-    dentry = dentry_create("[anon_shmem]", ino, nullptr);
+    dentry = dentry_create(name, ino, nullptr);
     if (!dentry)
         goto err;
     dget(dentry);
@@ -142,3 +145,18 @@ err:
         inode_unref(ino);
     return nullptr;
 }
+
+/**
+ * @brief Create a new shmem file
+ *
+ * @param len Length, in bytes
+ * @return Opened struct file, or NULL
+ */
+struct file *anon_get_shmem(size_t len)
+{
+    /* Note for future me: While this solution basically works, it does not properly work if we care
+     * about merging of MAP_SHARED or mremap. That will take some more annoying codepaths that e.g
+     * properly adjust the length of the inode.
+     */
+    return shmem_file_setup("[anon_shmem]", -1UL);
+}
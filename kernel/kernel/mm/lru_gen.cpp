@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+
+#include <onyx/clock.h>
+#include <onyx/mm/lru_gen.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/mm_address_space.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/paging.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+
+/**
+ * Aging for the multi-generational LRU (the generation lists themselves live in page_lru.c).
+ * Instead of asking the rmap about every single page on the inactive list, aging walks the page
+ * tables of every address space, test-and-clearing accessed bits in bulk. Page tables are dense
+ * in the places that matter (the working set), so this ends up being a lot cheaper per page. Young
+ * pages are only marked REFERENCED here; eviction does the actual moving.
+ */
+
+static struct list_head lru_gen_mm_list = LIST_HEAD_INIT(lru_gen_mm_list);
+static struct spinlock lru_gen_mm_lock;
+static DECLARE_MUTEX(lru_gen_age_lock);
+static bool lru_gen_walk_mm = true;
+
+static struct
+{
+    unsigned long nr_aging;
+    unsigned long nr_mm_walks;
+    unsigned long nr_young;
+} lru_gen_stats;
+
+void lru_gen_add_mm(struct mm_address_space *mm)
+{
+    spin_lock(&lru_gen_mm_lock);
+    list_add_tail(&mm->lru_gen_node, &lru_gen_mm_list);
+    spin_unlock(&lru_gen_mm_lock);
+}
+
+void lru_gen_del_mm(struct mm_address_space *mm)
+{
+    if (!mm->lru_gen_node.next)
+        return;
+    spin_lock(&lru_gen_mm_lock);
+    list_remove(&mm->lru_gen_node);
+    spin_unlock(&lru_gen_mm_lock);
+}
+
+void lru_gen_page_young(struct page *page)
+{
+    /* The PTE holds a mapcount on the page, and we hold the page table lock, so the page can't get
+     * freed under us. */
+    if (page_flag_set(page, PAGE_FLAG_LRU) && !page_flag_set(page, PAGE_FLAG_REFERENCED))
+        page_set_referenced(page);
+}
+
+static void lru_gen_walk_mms()
+{
+    struct mm_address_space *mm = nullptr;
+    struct mm_address_space *next;
+    struct list_head *l;
+
+    spin_lock(&lru_gen_mm_lock);
+    l = lru_gen_mm_list.next;
+
+    for (;;)
+    {
+        next = nullptr;
+        for (; l != &lru_gen_mm_list; l = l->next)
+        {
+            struct mm_address_space *cand =
+                container_of(l, struct mm_address_space, lru_gen_node);
+            /* Skip address spaces that are being torn down */
+            if (cand->try_ref())
+            {
+                next = cand;
+                break;
+            }
+        }
+
+        spin_unlock(&lru_gen_mm_lock);
+
+        /* The previous mm's reference kept our place in the list, drop it now */
+        if (mm)
+            mm->unref();
+        if (!next)
+            break;
+
+        unsigned long young = mmu_harvest_accessed(next, next->start, next->end,
+                                                   lru_gen_page_young);
+        __atomic_add_fetch(&lru_gen_stats.nr_young, young, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&lru_gen_stats.nr_mm_walks, 1, __ATOMIC_RELAXED);
+
+        mm = next;
+        spin_lock(&lru_gen_mm_lock);
+        l = mm->lru_gen_node.next;
+    }
+}
+
+static void lru_gen_inc_max_seq_locked(struct page_lru *lru)
+{
+    page_lru_lock(lru);
+    lru_gen_inc_max_seq(lru);
+    page_lru_unlock(lru);
+}
+
+void lru_gen_age(struct page_lru *lru, unsigned long max_seq)
+{
+    struct page_node *node = &main_node;
+    struct page_zone *zone;
+    struct mem_cgroup *memcg = nullptr;
+    scoped_mutex g{lru_gen_age_lock};
+
+    if (READ_ONCE(lru->lrugen.max_seq) != max_seq)
+        return;
+
+    if (READ_ONCE(lru_gen_walk_mm))
+        lru_gen_walk_mms();
+
+    /* The page table walk marked pages in every LRU, so every LRU gets a new generation */
+    for_zones_in_node(node, zone)
+        lru_gen_inc_max_seq_locked(&zone->zone_lru);
+
+    while ((memcg = mem_cgroup_iter(memcg)))
+    {
+        for_zones_in_node(node, zone)
+            lru_gen_inc_max_seq_locked(mem_cgroup_lru(memcg, zone));
+    }
+
+    __atomic_add_fetch(&lru_gen_stats.nr_aging, 1, __ATOMIC_RELAXED);
+}
+
+static ssize_t lru_gen_read_bool(void *buffer, size_t size, off_t off, bool val)
+{
+    char buf[4];
+    int len = snprintf(buf, sizeof(buf), "%d\n", val);
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+static int lru_gen_parse_bool(void *buffer, size_t size, bool *val)
+{
+    char buf[4];
+
+    if (size == 0 || size >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+    buf[size] = '\0';
+
+    if (buf[0] != '0' && buf[0] != '1')
+        return -EINVAL;
+    if (buf[1] != '\0' && buf[1] != '\n')
+        return -EINVAL;
+    *val = buf[0] == '1';
+    return 0;
+}
+
+ssize_t lru_gen_enabled_read(void *buffer, size_t size, off_t off)
+{
+    return lru_gen_read_bool(buffer, size, off, lru_gen_enabled());
+}
+
+ssize_t lru_gen_enabled_write(void *buffer, size_t size, off_t off)
+{
+    bool enabled;
+    int err = lru_gen_parse_bool(buffer, size, &enabled);
+    if (err < 0)
+        return err;
+
+    if (enabled != lru_gen_enabled())
+        lru_gen_set_enabled(enabled);
+    return size;
+}
+
+ssize_t lru_gen_walk_mm_read(void *buffer, size_t size, off_t off)
+{
+    return lru_gen_read_bool(buffer, size, off, READ_ONCE(lru_gen_walk_mm));
+}
+
+ssize_t lru_gen_walk_mm_write(void *buffer, size_t size, off_t off)
+{
+    bool walk;
+    int err = lru_gen_parse_bool(buffer, size, &walk);
+    if (err < 0)
+        return err;
+
+    WRITE_ONCE(lru_gen_walk_mm, walk);
+    return size;
+}
+
+ssize_t lru_gen_stats_read(void *buffer, size_t size, off_t off)
+{
+    struct page_node *node = &main_node;
+    struct page_zone *zone;
+    hrtime_t now = clocksource_get_time();
+    char buf[1024];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "enabled %d\nwalk_mm %d\naging %lu\nmm_walks %lu\nyoung %lu\n",
+                   lru_gen_enabled(), READ_ONCE(lru_gen_walk_mm),
+                   READ_ONCE(lru_gen_stats.nr_aging), READ_ONCE(lru_gen_stats.nr_mm_walks),
+                   READ_ONCE(lru_gen_stats.nr_young));
+
+    for_zones_in_node(node, zone)
+    {
+        struct lru_gen *lrugen = &zone->zone_lru.lrugen;
+
+        page_lru_lock(&zone->zone_lru);
+        unsigned long min_seq = min(lrugen->min_seq[LRU_GEN_FILE], lrugen->min_seq[LRU_GEN_ANON]);
+
+        if ((size_t) len < sizeof(buf))
+            len += snprintf(buf + len, sizeof(buf) - len, "zone %s\n", zone->name);
+
+        /* seq age_ms nr_file nr_anon. A type's count is 0 for seqs it has already retired. */
+        for (unsigned long seq = min_seq; seq <= lrugen->max_seq; seq++)
+        {
+            int gen = seq % MAX_NR_GENS;
+            hrtime_t birth = lrugen->birth[gen];
+
+            if ((size_t) len >= sizeof(buf))
+                break;
+            len += snprintf(buf + len, sizeof(buf) - len, "  %lu %lu %lu %lu\n", seq,
+                            birth ? (unsigned long) ((now - birth) / NS_PER_MS) : 0UL,
+                            seq >= lrugen->min_seq[LRU_GEN_FILE]
+                                ? lrugen->nr_pages[gen][LRU_GEN_FILE]
+                                : 0UL,
+                            seq >= lrugen->min_seq[LRU_GEN_ANON]
+                                ? lrugen->nr_pages[gen][LRU_GEN_ANON]
+                                : 0UL);
+        }
+
+        page_lru_unlock(&zone->zone_lru);
+    }
+
+    if ((size_t) len > sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
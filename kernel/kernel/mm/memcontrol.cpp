@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/cgroup.h>
+#include <onyx/err.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/mm/reclaim.h>
+#include <onyx/mm/slab.h>
+#include <onyx/page.h>
+#include <onyx/scheduler.h>
+#include <onyx/signal.h>
+#include <onyx/spinlock.h>
+
+#include <onyx/utility.hpp>
+
+/**
+ * Memory cgroup controller. Every page is charged to the memcg of the process that faulted it in
+ * (or read it into the page cache), and to all of its ancestors, up to (but not including) the
+ * root. Pages charged to a memcg live on the memcg's own per-zone LRUs, so reclaim can target a
+ * single memcg's subtree when it goes over its limits.
+ *
+ * Charges stick to the page until it's freed: a memcg that gets removed while it still has pages
+ * stays around (offline) until the last one goes away. Such memcgs are still on memcg_list, so
+ * global reclaim will find (and eventually free) their pages.
+ */
+
+/* Number of reclaim passes without progress before we give up and fail a charge */
+#define MEMCG_RECLAIM_RETRIES 5
+/* How much we try to reclaim at once when over a limit */
+#define MEMCG_RECLAIM_BATCH   32UL
+/* Cap on the throttling delay for chargers over memory.high */
+#define MEMCG_MAX_HIGH_DELAY_MS 200UL
+
+static struct list_head memcg_list = LIST_HEAD_INIT(memcg_list);
+static struct spinlock memcg_list_lock;
+
+static inline struct mem_cgroup *css_to_memcg(struct cgroup_subsys_state *css)
+{
+    return css ? container_of(css, struct mem_cgroup, css) : nullptr;
+}
+
+static inline struct mem_cgroup *cgroup_to_memcg(struct cgroup *cg)
+{
+    return css_to_memcg(cgroup_css(cg, CGROUP_MEMORY_SUBSYS));
+}
+
+static void mem_cgroup_get(struct mem_cgroup *memcg)
+{
+    __atomic_add_fetch(&memcg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static bool mem_cgroup_tryget(struct mem_cgroup *memcg)
+{
+    unsigned long refs = __atomic_load_n(&memcg->refcount, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (refs == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&memcg->refcount, &refs, refs + 1, false,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void mem_cgroup_put(struct mem_cgroup *memcg);
+
+static void mem_cgroup_free_rcu(struct rcu_head *head)
+{
+    struct mem_cgroup *memcg = container_of(head, struct mem_cgroup, rcu);
+
+    spin_lock(&memcg_list_lock);
+    list_remove(&memcg->list_node);
+    spin_unlock(&memcg_list_lock);
+
+    if (memcg->parent)
+        mem_cgroup_put(memcg->parent);
+    kfree(memcg);
+}
+
+static void mem_cgroup_put(struct mem_cgroup *memcg)
+{
+    /* Dead memcgs stay on the list until the grace period ends, but mem_cgroup_iter skips them */
+    if (__atomic_sub_fetch(&memcg->refcount, 1, __ATOMIC_RELEASE) == 0)
+        call_rcu(&memcg->rcu, mem_cgroup_free_rcu);
+}
+
+static struct cgroup_subsys_state *mem_cgroup_css_alloc(struct cgroup *cg)
+{
+    struct mem_cgroup *memcg;
+
+    /* The root's pages stay on the zones' LRUs, and aren't charged anywhere */
+    if (!cg->parent)
+        return nullptr;
+
+    memcg = (struct mem_cgroup *) kmalloc(sizeof(*memcg), GFP_KERNEL);
+    if (!memcg)
+        return (struct cgroup_subsys_state *) ERR_PTR(-ENOMEM);
+
+    memset(memcg, 0, sizeof(*memcg));
+    /* The cgroup's reference */
+    memcg->refcount = 1;
+    memcg->max = ULONG_MAX;
+    memcg->high = ULONG_MAX;
+    memcg->online = true;
+    memcg->parent = cgroup_to_memcg(cg->parent);
+    if (memcg->parent)
+        mem_cgroup_get(memcg->parent);
+
+    for (int i = 0; i < NR_ZONES; i++)
+        page_lru_init(&memcg->lrus[i]);
+
+    spin_lock(&memcg_list_lock);
+    list_add_tail(&memcg->list_node, &memcg_list);
+    spin_unlock(&memcg_list_lock);
+    return &memcg->css;
+}
+
+static void mem_cgroup_css_offline(struct cgroup_subsys_state *css)
+{
+    WRITE_ONCE(css_to_memcg(css)->online, false);
+}
+
+static void mem_cgroup_css_free(struct cgroup_subsys_state *css)
+{
+    mem_cgroup_put(css_to_memcg(css));
+}
+
+struct mem_cgroup *mem_cgroup_iter(struct mem_cgroup *prev)
+{
+    struct mem_cgroup *next = nullptr;
+    struct list_head *l;
+
+    spin_lock(&memcg_list_lock);
+
+    /* prev is pinned by our reference, so it's still on the list */
+    for (l = prev ? prev->list_node.next : memcg_list.next; l != &memcg_list; l = l->next)
+    {
+        struct mem_cgroup *memcg = container_of(l, struct mem_cgroup, list_node);
+        if (mem_cgroup_tryget(memcg))
+        {
+            next = memcg;
+            break;
+        }
+    }
+
+    spin_unlock(&memcg_list_lock);
+
+    if (prev)
+        mem_cgroup_put(prev);
+    return next;
+}
+
+void mem_cgroup_iter_break(struct mem_cgroup *memcg)
+{
+    if (memcg)
+        mem_cgroup_put(memcg);
+}
+
+bool mem_cgroup_is_descendant(struct mem_cgroup *memcg, struct mem_cgroup *root)
+{
+    for (; memcg; memcg = memcg->parent)
+    {
+        if (memcg == root)
+            return true;
+    }
+
+    return false;
+}
+
+struct page_lru *mem_cgroup_lru(struct mem_cgroup *memcg, struct page_zone *zone)
+{
+    return &memcg->lrus[zone - main_node.zones];
+}
+
+void mem_cgroup_get_stats(struct mem_cgroup *memcg, unsigned long stats[PAGE_STATS_MAX])
+{
+    for (int i = 0; i < PAGE_STATS_MAX; i++)
+    {
+        /* Stats are updated without any locking, and may be transiently negative */
+        long val = READ_ONCE(memcg->stat[i]);
+        stats[i] = val < 0 ? 0 : val;
+    }
+}
+
+static struct mem_cgroup *get_current_memcg()
+{
+    struct mem_cgroup *memcg;
+
+    rcu_read_lock();
+    /* The cgroup (and thus its reference to the memcg) can't go away under us */
+    memcg = cgroup_to_memcg(cgroup_current());
+    if (memcg)
+        mem_cgroup_get(memcg);
+    rcu_read_unlock();
+    return memcg;
+}
+
+static int mem_cgroup_try_charge(struct mem_cgroup *memcg, unsigned int gfp)
+{
+    int retries = MEMCG_RECLAIM_RETRIES;
+    struct mem_cgroup *over, *m;
+
+retry:
+    over = nullptr;
+    for (m = memcg; m; m = m->parent)
+    {
+        unsigned long usage = __atomic_add_fetch(&m->usage, 1, __ATOMIC_RELAXED);
+        if (usage > READ_ONCE(m->max))
+        {
+            over = m;
+            break;
+        }
+    }
+
+    if (!over)
+        return 0;
+
+    /* Undo the charge, up to (and including) the memcg that's over its limit */
+    for (m = memcg; m != over->parent; m = m->parent)
+        __atomic_sub_fetch(&m->usage, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&over->events[MEMCG_MAX], 1, __ATOMIC_RELAXED);
+
+    if (gfpflags_allow_blocking(gfp) && retries > 0)
+    {
+        if (!page_reclaim_memcg(over, MEMCG_RECLAIM_BATCH, gfp))
+            retries--;
+        if (!signal_is_pending())
+            goto retry;
+    }
+
+    __atomic_add_fetch(&over->events[MEMCG_OOM], 1, __ATOMIC_RELAXED);
+    return -ENOMEM;
+}
+
+/**
+ * @brief Note that we charged over memory.high
+ * Charges can happen with locks held (e.g mm->vm_lock in page faults), so we can't throttle here.
+ * Instead, the thread gets throttled on its way back to user space (mem_cgroup_handle_over_high).
+ *
+ * @param memcg Memcg that got charged
+ */
+static void mem_cgroup_note_high(struct mem_cgroup *memcg)
+{
+    struct thread *curr = get_current_thread();
+    bool over = false;
+
+    for (struct mem_cgroup *m = memcg; m; m = m->parent)
+    {
+        if (READ_ONCE(m->usage) <= READ_ONCE(m->high))
+            continue;
+
+        __atomic_add_fetch(&m->events[MEMCG_HIGH], 1, __ATOMIC_RELAXED);
+        over = true;
+    }
+
+    /* Kernel threads never go back to user space */
+    if (over && curr && !(curr->flags & THREAD_KERNEL))
+        curr->memcg_nr_pages_over_high++;
+}
+
+void mem_cgroup_handle_over_high(void)
+{
+    struct thread *curr = get_current_thread();
+    unsigned long nr_pages = curr->memcg_nr_pages_over_high;
+    unsigned long overage = 0;
+    struct mem_cgroup *memcg;
+
+    if (likely(!nr_pages))
+        return;
+
+    curr->memcg_nr_pages_over_high = 0;
+
+    memcg = get_current_memcg();
+    if (!memcg)
+        return;
+
+    for (struct mem_cgroup *m = memcg; m; m = m->parent)
+    {
+        unsigned long usage = READ_ONCE(m->usage);
+        unsigned long high = READ_ONCE(m->high);
+
+        if (usage <= high)
+            continue;
+
+        unsigned long target = cul::min(usage - high, cul::max(nr_pages, MEMCG_RECLAIM_BATCH));
+        page_reclaim_memcg(m, target, GFP_KERNEL);
+
+        /* Still over? Note how far over (in percent of high) we are */
+        usage = READ_ONCE(m->usage);
+        if (usage > high)
+        {
+            unsigned long pct = high ? (usage - high) * 100 / high : 100;
+            if (pct > overage)
+                overage = pct;
+        }
+    }
+
+    mem_cgroup_put(memcg);
+
+    /* Reclaim couldn't keep up with the charger. Slow it down, proportionally to the overage, so
+     * memory.high acts as a soft limit instead of the memcg running off to memory.max. */
+    if (overage)
+        sched_sleep_ms(min(overage + 1, MEMCG_MAX_HIGH_DELAY_MS));
+}
+
+int mem_cgroup_charge(struct page *page, unsigned int gfp)
+{
+    struct mem_cgroup *memcg;
+
+    DCHECK(page->memcg == nullptr);
+
+    memcg = get_current_memcg();
+    if (!memcg)
+        return 0;
+
+    if (mem_cgroup_try_charge(memcg, gfp) < 0)
+    {
+        mem_cgroup_put(memcg);
+        return -ENOMEM;
+    }
+
+    /* The page keeps our reference */
+    page->memcg = memcg;
+    mem_cgroup_note_high(memcg);
+    return 0;
+}
+
+void __mem_cgroup_uncharge(struct page *page)
+{
+    struct mem_cgroup *memcg = page->memcg;
+
+    for (struct mem_cgroup *m = memcg; m; m = m->parent)
+        __atomic_sub_fetch(&m->usage, 1, __ATOMIC_RELAXED);
+
+    page->memcg = nullptr;
+    mem_cgroup_put(memcg);
+}
+
+void mem_cgroup_migrate(struct page *page, struct page *newpage)
+{
+    struct mem_cgroup *memcg = page->memcg;
+
+    DCHECK(newpage->memcg == nullptr);
+    if (!memcg)
+        return;
+
+    /* Force the charge. The old page gets uncharged when it's freed, so we're only over the limit
+     * for a short while. */
+    for (struct mem_cgroup *m = memcg; m; m = m->parent)
+        __atomic_add_fetch(&m->usage, 1, __ATOMIC_RELAXED);
+
+    mem_cgroup_get(memcg);
+    newpage->memcg = memcg;
+}
+
+static int memory_parse_pages(const char *buf, unsigned long *pages)
+{
+    unsigned long bytes;
+    int err = cgroup_parse_size(buf, &bytes);
+    if (err < 0)
+        return err;
+
+    *pages = bytes == ULONG_MAX ? ULONG_MAX : bytes >> PAGE_SHIFT;
+    return 0;
+}
+
+static ssize_t memory_show_pages(char *buf, size_t len, unsigned long pages)
+{
+    int st;
+
+    if (pages == ULONG_MAX)
+        st = snprintf(buf, len, "max\n");
+    else
+        st = snprintf(buf, len, "%lu\n", pages << PAGE_SHIFT);
+    return (size_t) st >= len ? -E2BIG : st;
+}
+
+static ssize_t memory_current_show(struct cgroup *cg, char *buf, size_t len)
+{
+    return memory_show_pages(buf, len, READ_ONCE(cgroup_to_memcg(cg)->usage));
+}
+
+static ssize_t memory_max_show(struct cgroup *cg, char *buf, size_t len)
+{
+    return memory_show_pages(buf, len, READ_ONCE(cgroup_to_memcg(cg)->max));
+}
+
+static ssize_t memory_high_show(struct cgroup *cg, char *buf, size_t len)
+{
+    return memory_show_pages(buf, len, READ_ONCE(cgroup_to_memcg(cg)->high));
+}
+
+/**
+ * @brief Reclaim a memcg's subtree down to a limit
+ *
+ * @param memcg Memcg
+ * @param limit Limit, in pages
+ * @param retries Reclaim passes without progress we tolerate
+ */
+static void mem_cgroup_reclaim_to(struct mem_cgroup *memcg, unsigned long limit, int retries)
+{
+    while (retries > 0 && !signal_is_pending())
+    {
+        unsigned long usage = READ_ONCE(memcg->usage);
+        if (usage <= limit)
+            break;
+
+        if (!page_reclaim_memcg(memcg, usage - limit, GFP_KERNEL))
+            retries--;
+    }
+}
+
+static int memory_max_write(struct cgroup *cg, char *buf, size_t len)
+{
+    struct mem_cgroup *memcg = cgroup_to_memcg(cg);
+    unsigned long max;
+    int err;
+
+    err = memory_parse_pages(buf, &max);
+    if (err < 0)
+        return err;
+
+    /* New charges see the limit right away. Reclaim whatever's above it. */
+    WRITE_ONCE(memcg->max, max);
+    mem_cgroup_reclaim_to(memcg, max, MEMCG_RECLAIM_RETRIES);
+    return 0;
+}
+
+static int memory_high_write(struct cgroup *cg, char *buf, size_t len)
+{
+    struct mem_cgroup *memcg = cgroup_to_memcg(cg);
+    unsigned long high;
+    int err;
+
+    err = memory_parse_pages(buf, &high);
+    if (err < 0)
+        return err;
+
+    /* memory.high is best effort: a single pass, throttling takes care of the rest */
+    WRITE_ONCE(memcg->high, high);
+    mem_cgroup_reclaim_to(memcg, high, 1);
+    return 0;
+}
+
+struct memcg_stat_desc
+{
+    const char *name;
+    enum page_stat stat;
+};
+
+static const struct memcg_stat_desc memcg_stat_descs[] = {
+    {"anon", NR_ANON},
+    {"file", NR_FILE},
+    {"shmem", NR_SHARED},
+    {"file_dirty", NR_DIRTY},
+    {"file_writeback", NR_WRITEBACK},
+    {"inactive_anon", NR_INACTIVE_ANON},
+    {"active_anon", NR_ACTIVE_ANON},
+    {"inactive_file", NR_INACTIVE_FILE},
+    {"active_file", NR_ACTIVE_FILE},
+};
+
+static ssize_t memory_stat_show(struct cgroup *cg, char *buf, size_t len)
+{
+    struct mem_cgroup *memcg = cgroup_to_memcg(cg);
+    struct mem_cgroup *iter = nullptr;
+    unsigned long stats[PAGE_STATS_MAX] = {};
+    unsigned long pgsteal = 0;
+    size_t pos = 0;
+    int st;
+
+    /* Stats are kept per-memcg, sum up the subtree */
+    while ((iter = mem_cgroup_iter(iter)))
+    {
+        unsigned long local[PAGE_STATS_MAX];
+
+        if (!mem_cgroup_is_descendant(iter, memcg))
+            continue;
+
+        mem_cgroup_get_stats(iter, local);
+        for (int i = 0; i < PAGE_STATS_MAX; i++)
+            stats[i] += local[i];
+        pgsteal += READ_ONCE(iter->nr_reclaimed);
+    }
+
+    for (const auto &desc : memcg_stat_descs)
+    {
+        st = snprintf(buf + pos, len - pos, "%s %lu\n", desc.name, stats[desc.stat] << PAGE_SHIFT);
+        if (pos + st >= len)
+            return -E2BIG;
+        pos += st;
+    }
+
+    st = snprintf(buf + pos, len - pos, "pgsteal %lu\n", pgsteal);
+    if (pos + st >= len)
+        return -E2BIG;
+    return pos + st;
+}
+
+static ssize_t memory_events_show(struct cgroup *cg, char *buf, size_t len)
+{
+    struct mem_cgroup *memcg = cgroup_to_memcg(cg);
+    struct mem_cgroup *iter = nullptr;
+    unsigned long events[MEMCG_NR_EVENTS] = {};
+    int st;
+
+    while ((iter = mem_cgroup_iter(iter)))
+    {
+        if (!mem_cgroup_is_descendant(iter, memcg))
+            continue;
+        for (int i = 0; i < MEMCG_NR_EVENTS; i++)
+            events[i] += READ_ONCE(iter->events[i]);
+    }
+
+    st = snprintf(buf, len, "high %lu\nmax %lu\noom %lu\n", events[MEMCG_HIGH], events[MEMCG_MAX],
+                  events[MEMCG_OOM]);
+    return (size_t) st >= len ? -E2BIG : st;
+}
+
+static const struct cgroup_file memory_files[] = {
+    {
+        .name = "memory.current",
+        .mode = 0444,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = memory_current_show,
+        .write = nullptr,
+    },
+    {
+        .name = "memory.max",
+        .mode = 0644,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = memory_max_show,
+        .write = memory_max_write,
+    },
+    {
+        .name = "memory.high",
+        .mode = 0644,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = memory_high_show,
+        .write = memory_high_write,
+    },
+    {
+        .name = "memory.stat",
+        .mode = 0444,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = memory_stat_show,
+        .write = nullptr,
+    },
+    {
+        .name = "memory.events",
+        .mode = 0444,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = memory_events_show,
+        .write = nullptr,
+    },
+    {},
+};
+
+const struct cgroup_subsys memory_cgrp_subsys = {
+    .name = "memory",
+    .css_alloc = mem_cgroup_css_alloc,
+    .css_offline = mem_cgroup_css_offline,
+    .css_free = mem_cgroup_css_free,
+    .attach = nullptr,
+    .files = memory_files,
+};
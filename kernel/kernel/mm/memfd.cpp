@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/file.h>
+#include <onyx/interval_tree.h>
+#include <onyx/mm/memfd.h>
+#include <onyx/mm/shmem.h>
+#include <onyx/rwlock.h>
+#include <onyx/tmpfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+#include <uapi/fcntl.h>
+#include <uapi/memfd.h>
+
+/* memfd: anonymous shmem files, that can be sealed. Seals are only ever added, and let whoever
+ * receives a memfd trust its contents and size without making a defensive copy. Seals are
+ * protected by i_rwlock (held across write() and truncate) plus the vmo's mapping_lock, which
+ * serializes F_SEAL_WRITE against the creation of new writable shared mappings.
+ */
+
+/* We don't have hugetlbfs, so MFD_HUGETLB is rejected as invalid */
+#define MFD_VALID_FLAGS  (MFD_CLOEXEC | MFD_ALLOW_SEALING)
+#define MFD_NAME_PREFIX  "memfd:"
+/* Same as Linux, so the name (with the prefix) fits in NAME_MAX */
+#define MFD_NAME_MAX_LEN (NAME_MAX - (sizeof(MFD_NAME_PREFIX) - 1))
+
+#define F_ALL_SEALS (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_FUTURE_WRITE)
+
+static bool memfd_is_sealable(struct inode *ino)
+{
+    return ino->i_fops == &tmpfs_fops && S_ISREG(ino->i_mode);
+}
+
+bool memfd_write_sealed(struct inode *ino)
+{
+    if (!memfd_is_sealable(ino))
+        return false;
+    return READ_ONCE(((tmpfs_inode *) ino)->seals) & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE);
+}
+
+static bool memfd_has_writable_mappings(struct vm_object *vmo)
+{
+    MUST_HOLD_LOCK(&vmo->mapping_lock);
+    struct vm_area_struct *vma;
+
+    for_intervals_in_range(&vmo->mappings, vma, struct vm_area_struct, vm_objhead, 0, -1UL)
+    {
+        if (vma_shared(vma) && vma->vm_flags & VM_WRITE)
+            return true;
+    }
+
+    return false;
+}
+
+static int memfd_add_seals(struct file *filp, unsigned int seals)
+{
+    tmpfs_inode *ino = (tmpfs_inode *) filp->f_ino;
+
+    if (seals & ~F_ALL_SEALS)
+        return -EINVAL;
+
+    /* Sealing restricts everyone else, so it requires write access */
+    if (!fd_may_access(filp, FILE_ACCESS_WRITE))
+        return -EPERM;
+
+    scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
+
+    if (ino->seals & F_SEAL_SEAL)
+        return -EPERM;
+
+    scoped_lock g2{ino->i_pages->mapping_lock};
+
+    /* Existing writable mappings could keep on writing, so refuse to seal */
+    if (seals & F_SEAL_WRITE && !(ino->seals & F_SEAL_WRITE) &&
+        memfd_has_writable_mappings(ino->i_pages))
+        return -EBUSY;
+
+    WRITE_ONCE(ino->seals, ino->seals | seals);
+    return 0;
+}
+
+int memfd_fcntl(struct file *filp, int cmd, unsigned long arg)
+{
+    if (!memfd_is_sealable(filp->f_ino))
+        return -EINVAL;
+
+    switch (cmd)
+    {
+        case F_ADD_SEALS:
+            return memfd_add_seals(filp, (unsigned int) arg);
+        case F_GET_SEALS:
+            return READ_ONCE(((tmpfs_inode *) filp->f_ino)->seals);
+    }
+
+    return -EINVAL;
+}
+
+int sys_memfd_create(const char *uname, unsigned int flags)
+{
+    char name[sizeof(MFD_NAME_PREFIX) + MFD_NAME_MAX_LEN];
+    user_string ustr;
+
+    if (flags & ~MFD_VALID_FLAGS)
+        return -EINVAL;
+
+    if (auto ex = ustr.from_user(uname); ex.has_error())
+        return ex.error();
+
+    if (strlen(ustr.data()) > MFD_NAME_MAX_LEN)
+        return -EINVAL;
+
+    snprintf(name, sizeof(name), MFD_NAME_PREFIX "%s", ustr.data());
+
+    struct file *filp = shmem_file_setup(name, 0);
+    if (!filp)
+        return -ENOMEM;
+
+    if (flags & MFD_ALLOW_SEALING)
+        ((tmpfs_inode *) filp->f_ino)->seals = 0;
+
+    int fd = open_with_vnode(filp, O_RDWR | (flags & MFD_CLOEXEC ? O_CLOEXEC : 0));
+    fd_put(filp);
+    return fd;
+}
@@ -6,6 +6,8 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 #include <onyx/filemap.h>
+#include <onyx/mm/lru_gen.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/pgtable.h>
 #include <onyx/process.h>
@@ -225,6 +227,9 @@ static pte_t *pte_get_from_addr(struct mm_address_space *mm, unsigned long addr)
     return pte_offset(pmd, addr);
 }
 
+static unsigned long mmu_harvest_pte_range(pte_t *ptep, unsigned long addr, unsigned long end,
+                                           void (*cb)(struct page *page));
+
 unsigned int mmu_get_clear_referenced(struct mm_address_space *mm, void *addr, struct page *page)
 {
     int ret = 0;
@@ -250,11 +255,128 @@ unsigned int mmu_get_clear_referenced(struct mm_address_space *mm, void *addr, s
     /* Architectural note: We don't need to flush the TLB. Flushing the TLB is required by x86 if we
      * want the A bit to be set again, but we can just wait for an unrelated TLB flush (e.g context
      * switch) to do the job for us. A TLB shootdown is too much overhead for this purpose. */
+
+#ifdef CONFIG_LRU_GEN
+    if (lru_gen_enabled())
+    {
+        /* Look around: pages next to a young page were likely touched too, and harvesting their A
+         * bits now (while we have the page table in cache and locked) is a lot cheaper than
+         * going through the rmap for each one of them later. */
+        unsigned long start = (unsigned long) addr - LRU_GEN_LOOK_AROUND * PAGE_SIZE;
+        unsigned long end = (unsigned long) addr + (LRU_GEN_LOOK_AROUND + 1) * PAGE_SIZE;
+        unsigned long table_start = (unsigned long) addr & -PMD_SIZE;
+        unsigned long table_end = pmd_addr_end((unsigned long) addr);
+
+        start = max(start, table_start);
+        end = min(end, table_end);
+        ptep -= ((unsigned long) addr - start) >> PAGE_SHIFT;
+        mmu_harvest_pte_range(ptep, start, end, lru_gen_page_young);
+    }
+#endif
 out:
     spin_unlock(&mm->page_table_lock);
     return ret;
 }
 
+static bool pte_test_clear_accessed(pte_t *ptep, pte_t *oldp)
+{
+    pte_t old = *ptep;
+    pte_t new_pte;
+
+    do
+    {
+        if (!pte_present(old) || !pte_accessed(old) || pte_special(old))
+            return false;
+        new_pte = pte_mkyoung(old);
+    } while (!pte_cmpxchg(ptep, &old, new_pte));
+
+    *oldp = old;
+    return true;
+}
+
+static unsigned long mmu_harvest_pte_range(pte_t *ptep, unsigned long addr, unsigned long end,
+                                           void (*cb)(struct page *page))
+{
+    unsigned long nr = 0;
+    struct page *page;
+    pte_t old;
+
+    for (; addr < end; addr += PAGE_SIZE, ptep++)
+    {
+        if (!pte_test_clear_accessed(ptep, &old))
+            continue;
+        /* PFNMAP and friends may map pages we don't have a struct page for */
+        page = phys_to_page_mayfail(pte_addr(old));
+        if (!page)
+            continue;
+        cb(page);
+        nr++;
+    }
+
+    return nr;
+}
+
+/**
+ * @brief Harvest (test and clear) accessed bits in a range of an address space
+ * The page tables are walked one PTE table at a time, with the page table lock held. Like
+ * mmu_get_clear_referenced, we don't flush the TLB.
+ *
+ * @param mm Address space to walk
+ * @param start Start of the range
+ * @param end End of the range
+ * @param cb Callback, called for every page that was found accessed
+ * @return Number of accessed pages found
+ */
+unsigned long mmu_harvest_accessed(struct mm_address_space *mm, unsigned long start,
+                                   unsigned long end, void (*cb)(struct page *page))
+{
+    unsigned long addr = start;
+    unsigned long next;
+    unsigned long nr = 0;
+    pgd_t *pgd;
+    p4d_t *p4d;
+    pud_t *pud;
+    pmd_t *pmd;
+
+    while (addr < end)
+    {
+        spin_lock(&mm->page_table_lock);
+
+        pgd = pgd_offset(mm, addr);
+        if (pgd_none(*pgd))
+        {
+            next = pgd_addr_end(addr);
+            goto skip;
+        }
+
+        p4d = p4d_offset(pgd, addr);
+        if (p4d_none(*p4d))
+        {
+            next = p4d_addr_end(addr);
+            goto skip;
+        }
+
+        pud = pud_offset(p4d, addr);
+        if (pud_none(*pud) || pud_huge(*pud))
+        {
+            next = pud_addr_end(addr);
+            goto skip;
+        }
+
+        pmd = pmd_offset(pud, addr);
+        next = pmd_addr_end(addr);
+        if (pmd_none(*pmd) || pmd_huge(*pmd))
+            goto skip;
+
+        nr += mmu_harvest_pte_range(pte_offset(pmd, addr), addr, min(next, end), cb);
+    skip:
+        spin_unlock(&mm->page_table_lock);
+        addr = next;
+    }
+
+    return nr;
+}
+
 static unsigned long p4d_to_mapping_info(p4d_t p4d)
 {
     unsigned long ret = p4d_addr(p4d) | PAGE_PRESENT | PAGE_HUGE;
@@ -368,6 +490,8 @@ unsigned long __get_mapping_info(void *addr, struct mm_address_space *mm)
 
 struct tlbi_tracker
 {
+    /* Address space whose page tables we're changing */
+    struct mm_address_space *mm;
     /* Somewhat primitive, but will do for the time being... */
     unsigned long start, end;
     struct page *pending_pages[MAX_PENDING_PAGEN];
@@ -375,8 +499,9 @@ struct tlbi_tracker
     bool active;
 };
 
-static void tlbi_tracker_init(struct tlbi_tracker *tlbi)
+static void tlbi_tracker_init(struct tlbi_tracker *tlbi, struct mm_address_space *mm)
 {
+    tlbi->mm = mm;
     tlbi->start = tlbi->end = 0;
     tlbi->active = false;
     tlbi->used_pending_pages = 0;
@@ -403,7 +528,7 @@ enum unmap_result
 
 static void tlbi_end_batch(struct tlbi_tracker *tlbi)
 {
-    vm_invalidate_range(tlbi->start, (tlbi->end - tlbi->start) >> PAGE_SHIFT);
+    mmu_invalidate_range(tlbi->start, (tlbi->end - tlbi->start) >> PAGE_SHIFT, tlbi->mm);
     for (unsigned int i = 0; i < tlbi->used_pending_pages; i++)
         page_unref(tlbi->pending_pages[i]);
     tlbi->active = false;
@@ -749,7 +874,7 @@ int vm_mmu_unmap(struct mm_address_space *mm, void *addr, size_t pages, struct v
     unmap_info.kernel = mm == &kernel_address_space;
     unmap_info.full = 0;
     unmap_info.freepgtables = 1;
-    tlbi_tracker_init(&unmap_info.tlbi);
+    tlbi_tracker_init(&unmap_info.tlbi, mm);
 
     spin_lock(&mm->page_table_lock);
     pgd_unmap_range(&unmap_info, pgd_offset(mm, virt), virt, end);
@@ -875,7 +1000,7 @@ void vm_do_mmu_mprotect(struct mm_address_space *mm, void *address, size_t nr_pg
     unsigned long start = (unsigned long) address;
     unsigned long end = start + (nr_pgs << PAGE_SHIFT);
     struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
+    tlbi_tracker_init(&tlbi, mm);
 
     spin_lock(&mm->page_table_lock);
     pgd_protect_range(&tlbi, pgd_offset(mm, start), start, end, new_prots);
@@ -1039,7 +1164,7 @@ int mmu_fork_tables(struct vm_area_struct *old_vma, struct mm_address_space *mm)
     unsigned long end = old_vma->vm_end;
     int err;
     struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
+    tlbi_tracker_init(&tlbi, old_vma->vm_mm);
 
     /* Note: We can't take the page table spinlock here (hold time is too long, too many memory
      * allocations may happen). We'll rely on holding the mm lock exclusively. Page table lifetime
@@ -1058,7 +1183,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
     struct mm_address_space *mm = vma->vm_mm;
     pte_t *pte, oldpte;
     struct tlbi_tracker tlbi;
-    tlbi_tracker_init(&tlbi);
+    tlbi_tracker_init(&tlbi, mm);
 
     spin_lock(&mm->page_table_lock);
 
@@ -1106,6 +1231,88 @@ out:
     return 0;
 }
 
+int try_to_wrprotect_one(struct page *page, struct vm_area_struct *vma,
+                         unsigned long addr) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct mm_address_space *mm = vma->vm_mm;
+    pte_t *pte, oldpte;
+    bool dirty = false;
+    struct tlbi_tracker tlbi;
+    tlbi_tracker_init(&tlbi, mm);
+
+    spin_lock(&mm->page_table_lock);
+
+    pte = pte_get_from_addr(mm, addr);
+    if (!pte || !pte_present(*pte))
+        goto out;
+
+    oldpte = *pte;
+    if (pte_addr(oldpte) != (unsigned long) page_to_phys(page) || !pte_write(oldpte))
+        goto out;
+
+    DCHECK(!pte_special(oldpte));
+    dirty = pte_dirty(oldpte);
+    set_pte(pte, pte_wrprotect(oldpte));
+    tlbi_update_page_prots(&tlbi, addr, oldpte, *pte);
+
+out:
+    spin_unlock(&mm->page_table_lock);
+
+    if (tlbi_active(&tlbi))
+        tlbi_end_batch(&tlbi);
+
+    /* Anon pages are always dirty, but file pages need to get their dirtiness from the pte before
+     * the pte stops being written to. */
+    if (dirty && !page_flag_set(page, PAGE_FLAG_ANON))
+        filemap_mark_dirty(page, page->pageoff);
+    return 0;
+}
+
+int try_to_remap_one(struct page *page, struct page *newpage, struct vm_area_struct *vma,
+                     unsigned long addr) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct mm_address_space *mm = vma->vm_mm;
+    pte_t *pte, oldpte, newpte;
+    struct tlbi_tracker tlbi;
+    tlbi_tracker_init(&tlbi, mm);
+
+    spin_lock(&mm->page_table_lock);
+
+    pte = pte_get_from_addr(mm, addr);
+    if (!pte || (!pte_present(*pte) && !pte_protnone(*pte)))
+        goto out;
+
+    oldpte = *pte;
+    if (pte_addr(oldpte) != (unsigned long) page_to_phys(page))
+        goto out;
+
+    /* The page was write-protected before being copied, so this pte can't have been written to
+     * since. The caller holds a reference to the page, so the mapcount can't free it. */
+    DCHECK(!pte_write(oldpte));
+    newpte = pte_set_addr(oldpte, (u64) page_to_phys(newpage));
+
+    /* Give write access back to exclusively mapped anon pages in writable private mappings, like
+     * do_wp_page would on the next write. Shared (CoW) pages have to stay read-only. */
+    if (page_flag_set(page, PAGE_FLAG_ANON) && !pte_protnone(oldpte) &&
+        (vma->vm_flags & VM_WRITE) && vma_private(vma) && page_mapcount(page) == 1 &&
+        page_mapcount(newpage) == 0)
+        newpte = pte_mkwrite(newpte);
+
+    page_add_mapcount(newpage);
+    page_sub_mapcount(page);
+    set_pte(pte, newpte);
+    if (!pte_protnone(oldpte))
+        tlbi_update_page_prots(&tlbi, addr, oldpte, *pte);
+
+out:
+    spin_unlock(&mm->page_table_lock);
+
+    if (tlbi_active(&tlbi))
+        tlbi_end_batch(&tlbi);
+
+    return 0;
+}
+
 pte_t pte_get(struct mm_address_space *mm, unsigned long addr)
 {
     spin_lock(&mm->page_table_lock);
@@ -1235,6 +1442,12 @@ int do_wp_page(struct vm_pf_context *context)
     if (!new_page)
         return -ENOMEM;
 
+    if (mem_cgroup_charge(new_page, GFP_KERNEL) < 0)
+    {
+        page_unref(new_page);
+        return -ENOMEM;
+    }
+
     if (!was_zeropage)
         copy_page_to_page(page_to_phys(new_page), page_to_phys(oldp));
 
@@ -1244,7 +1457,7 @@ int do_wp_page(struct vm_pf_context *context)
     page_set_anon(new_page);
     page_add_lru(new_page);
 
-    tlbi_tracker_init(&tlbi);
+    tlbi_tracker_init(&tlbi, context->entry->vm_mm);
 
     spin_lock(lock);
     if (ptep->pte != context->oldpte.pte)
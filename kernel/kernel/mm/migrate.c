@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+
+#include <onyx/bug.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/migrate.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/page.h>
+#include <onyx/paging.h>
+#include <onyx/rmap.h>
+#include <onyx/utils.h>
+
+/**
+ * Commentary on page migration:
+ * We don't have migration entries, so pages get migrated while mapped. First, every pte mapping
+ * the page is write-protected (and the TLB flushed), after which the page's contents can't change
+ * under us: anon write faults CoW (the extra reference we hold stops the old page from being
+ * reused), and file write faults (and write()) need the page lock, which we hold. The contents are
+ * then copied over, the new page takes the old one's page cache slot (with the same marks), and
+ * the ptes are pointed at the new page, still read-only. Readers that got to the old page in the
+ * meanwhile still see the same data. Lockers of the old page notice it's no longer in the page
+ * cache (page->owner is cleared) and look up the new one.
+ */
+
+/* Number of times we walk the rmap pointing ptes at the new page, see migrate_page */
+#define MIGRATE_REMAP_RETRIES 3
+
+static int migrate_wrprotect_one(struct vm_area_struct *vma, struct page *page, unsigned long addr,
+                                 void *ctx)
+{
+    return try_to_wrprotect_one(page, vma, addr);
+}
+
+static int migrate_remap_one(struct vm_area_struct *vma, struct page *page, unsigned long addr,
+                             void *ctx)
+{
+    return try_to_remap_one(page, ctx, vma, addr);
+}
+
+static unsigned int migrate_expected_refs(struct page *page)
+{
+    /* The caller's reference, one for every mapping of the page, and one for the page cache */
+    unsigned int refs = 1 + (page_mapcount(page) > 0);
+    if (!page_flag_set(page, PAGE_FLAG_ANON))
+        refs++;
+    return refs;
+}
+
+static bool migrate_page_movable(struct page *page) REQUIRES(page)
+{
+    /* Pages under IO, in the swap cache, or with private data pointing at them stay put */
+    if (page->flags & (PAGE_FLAG_WRITEBACK | PAGE_FLAG_SWAP | PAGE_FLAG_BUFFER) || page->priv)
+        return false;
+    if (!page->owner)
+        return false;
+
+    /* An unmapped anon page (that is not in the swap cache) is about to be freed anyway */
+    if (page_flag_set(page, PAGE_FLAG_ANON))
+        return page_mapcount(page) > 0;
+
+    /* Objects with their own free_page don't get their pages from the page allocator */
+    if (page_vmobj(page)->ops->free_page)
+        return false;
+    return page_flag_set(page, PAGE_FLAG_UPTODATE);
+}
+
+int migrate_page(struct page *page, struct page *newpage) NO_THREAD_SAFETY_ANALYSIS
+{
+    bool anon = page_flag_set(page, PAGE_FLAG_ANON);
+    int retries = MIGRATE_REMAP_RETRIES;
+    int st = -EBUSY;
+
+    DCHECK_PAGE(!page_flag_set(page, PAGE_FLAG_LRU), page);
+    DCHECK_PAGE(newpage->ref == 1 && newpage->flags == 0, newpage);
+
+    if (!try_lock_page(page))
+        return -EAGAIN;
+
+    if (!migrate_page_movable(page))
+        goto out;
+    if (page->ref > migrate_expected_refs(page))
+        goto out;
+
+    /* Stop writes through the page tables. The contents are stable from here on. */
+    rmap_walk(&(struct rmap_walk_info){.walk_one = migrate_wrprotect_one}, page);
+    copy_page_to_page(page_to_phys(newpage), page_to_phys(page));
+
+    /* newpage is still ours, make it a locked copy of page before anyone can see it */
+    newpage->owner = page->owner;
+    newpage->pageoff = page->pageoff;
+    newpage->flags = PAGE_FLAG_LOCKED | (page->flags & (PAGE_FLAG_ANON | PAGE_FLAG_UPTODATE |
+                                                        PAGE_FLAG_DIRTY | PAGE_FLAG_REFERENCED));
+    mem_cgroup_migrate(page, newpage);
+
+    if (anon)
+    {
+        /* Nothing stops new references to an anon page (e.g from GUP), but references taken after
+         * the write-protect can't write to it without going through a CoW first. */
+        if (page->ref > migrate_expected_refs(page))
+            goto undo;
+    }
+    else
+    {
+        if (!vm_obj_replace_page(page_vmobj(page), page, newpage))
+            goto undo;
+
+        /* The page cache's reference moves over. We still hold a reference to the old page. */
+        page_ref(newpage);
+        page_unref(page);
+        dec_page_stat(page, NR_FILE);
+        inc_page_stat(newpage, NR_FILE);
+
+        if (page_test_clear_flag(page, PAGE_FLAG_DIRTY))
+        {
+            dec_page_stat(page, NR_DIRTY);
+            inc_page_stat(newpage, NR_DIRTY);
+        }
+    }
+
+    /* Point the ptes at the new page. fork() can copy a pte to a vma we've already walked, so look
+     * again if the old page is still mapped. */
+    do
+    {
+        rmap_walk(&(struct rmap_walk_info){.walk_one = migrate_remap_one, .context = newpage},
+                  page);
+    } while (page_mapcount(page) > 0 && --retries > 0);
+
+    st = 0;
+    if (anon)
+    {
+        inc_page_stat(newpage, NR_ANON);
+        if (page_mapcount(page) > 0)
+        {
+            /* We lost the race. Both pages are read-only copies of each other, so they can both
+             * stay around. The old one goes back to the LRU. */
+            st = MIGRATE_OLD_MAPPED;
+        }
+        else
+        {
+            dec_page_stat(page, NR_ANON);
+            __atomic_and_fetch(&page->flags, ~PAGE_FLAG_ANON, __ATOMIC_RELEASE);
+        }
+    }
+    else
+    {
+        /* File mappings are only established with the page locked */
+        WARN_ON(page_mapcount(page) > 0);
+        /* Tell lockers of the old page to look it up again */
+        WRITE_ONCE(page->owner, NULL);
+    }
+
+    unlock_page(newpage);
+    goto out;
+undo:
+    mem_cgroup_uncharge(newpage);
+    newpage->owner = NULL;
+    newpage->pageoff = 0;
+    newpage->flags = 0;
+out:
+    unlock_page(page);
+    return st;
+}
@@ -5,56 +5,355 @@
  *
  * SPDX-License-Identifier: GPL-2.0-only
  */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/mm/page_lru.h>
+#include <onyx/mm/page_node.h>
+#include <onyx/mutex.h>
 #include <onyx/page.h>
+#include <onyx/percpu.h>
+#include <onyx/rcupdate.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
 
 static inline int page_to_state(struct page *page)
 {
     return page_flag_set(page, PAGE_FLAG_ANON) ? LRU_ANON_OFF : 0;
 }
 
-void page_add_lru(struct page *page)
+#ifdef CONFIG_LRU_GEN
+
+/**
+ * Commentary on the multi-generational LRU:
+ * Instead of an active and an inactive list, pages are sorted into up to MAX_NR_GENS generations,
+ * identified by a sequence number. New generations are created by aging (see lru_gen.cpp), which
+ * walks page tables and marks every page it finds accessed as PAGE_FLAG_REFERENCED. Promotion is
+ * lazy: referenced pages are only moved to the youngest generation when eviction gets to them.
+ * Eviction takes pages from the oldest generation (min_seq), retiring it once it's empty.
+ *
+ * A page's flags hold the generation of the list it's physically on (PAGE_LRU_GEN_MASK), so we
+ * can always find it (and keep the per-generation counts right) under the lru lock.
+ */
+
+#ifdef CONFIG_LRU_GEN_ENABLED
+bool lru_gen_on = true;
+#else
+bool lru_gen_on = false;
+#endif
+
+static DECLARE_MUTEX(lru_gen_switch_lock);
+
+static inline int page_lru_type(struct page *page)
+{
+    return page_flag_set(page, PAGE_FLAG_ANON) ? LRU_GEN_ANON : LRU_GEN_FILE;
+}
+
+static inline int lru_gen_from_seq(unsigned long seq)
+{
+    return seq % MAX_NR_GENS;
+}
+
+static inline int page_lru_gen(struct page *page)
+{
+    return (int) ((READ_ONCE(page->flags) & PAGE_LRU_GEN_MASK) >> PAGE_LRU_GEN_SHIFT) - 1;
+}
+
+static inline void page_set_lru_gen(struct page *page, int gen)
+{
+    /* The generation bits are protected by the lru lock, but other flags can change under us */
+    __atomic_and_fetch(&page->flags, ~PAGE_LRU_GEN_MASK, __ATOMIC_RELAXED);
+    if (gen >= 0)
+        __atomic_or_fetch(&page->flags, (unsigned long) (gen + 1) << PAGE_LRU_GEN_SHIFT,
+                          __ATOMIC_RELAXED);
+}
+
+static void lru_gen_add_page(struct lru_gen *lrugen, struct page *page, unsigned long seq,
+                             bool head)
+{
+    int gen = lru_gen_from_seq(seq);
+    int type = page_lru_type(page);
+
+    if (head)
+        list_add(&page->lru_node, &lrugen->lists[gen][type]);
+    else
+        list_add_tail(&page->lru_node, &lrugen->lists[gen][type]);
+    lrugen->nr_pages[gen][type]++;
+    page_set_lru_gen(page, gen);
+}
+
+static void lru_gen_del_page(struct lru_gen *lrugen, struct page *page)
+{
+    int gen = page_lru_gen(page);
+    DCHECK(gen >= 0);
+    list_remove(&page->lru_node);
+    lrugen->nr_pages[gen][page_lru_type(page)]--;
+    page_set_lru_gen(page, -1);
+}
+
+static unsigned long lru_gen_new_page_seq(struct lru_gen *lrugen, struct page *page)
+{
+    /* Anon pages are (mostly) added on fault, so they start out young. File pages are added on
+     * read and readahead, and need to prove themselves: put them one generation over the oldest,
+     * so they get a single round before eviction. */
+    int type = page_lru_type(page);
+    unsigned long seq = lrugen->min_seq[type] + 1;
+
+    if (type == LRU_GEN_ANON || seq > lrugen->max_seq)
+        seq = lrugen->max_seq;
+    return seq;
+}
+
+#endif
+
+/**
+ * Commentary on LRU batching:
+ * Taking the zone's page_lru lock for every single page added or activated makes it the hottest
+ * lock in page cache heavy workloads. Instead, page_add_lru and page_promote_referenced queue the
+ * page in a small per-cpu batch, which gets drained into the LRU with a single lock round trip
+ * once it's full. A batched page holds a reference, and isn't PAGE_FLAG_LRU until it's drained, so
+ * reclaim can't see it (see page_lru_drain_all). Each batch has its own (uncontended) spinlock, so
+ * other CPUs can drain it from thread context.
+ */
+
+struct lru_batch
+{
+    struct spinlock lock;
+    unsigned int nr;
+    struct page *pages[PAGE_LRU_BATCH];
+};
+
+typedef void (*lru_batch_fn_t)(struct page_lru *lru, struct page *page);
+
+static PER_CPU_VAR(struct lru_batch lru_add_batch);
+static PER_CPU_VAR(struct lru_batch lru_activate_batch);
+
+/* Pages per batch, 0 disables batching */
+static unsigned int lru_batch_size = PAGE_LRU_BATCH;
+
+static struct
+{
+    unsigned long batched;
+    unsigned long drains;
+} lru_batch_stats;
+
+static void __page_add_lru(struct page_lru *lru, struct page *page)
 {
     DCHECK(!page_flag_set(page, PAGE_FLAG_LRU));
-    struct page_lru *lru = page_to_page_lru(page);
     inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
-    spin_lock(&lru->lock);
-    list_add_tail(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_BASE + page_to_state(page)]);
+#ifdef CONFIG_LRU_GEN
+    if (lru_gen_enabled())
+        lru_gen_add_page(&lru->lrugen, page, lru_gen_new_page_seq(&lru->lrugen, page), false);
+    else
+#endif
+        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_BASE + page_to_state(page)]);
     page_test_set_flag(page, PAGE_FLAG_LRU);
-    spin_unlock(&lru->lock);
 }
 
-void page_remove_lru(struct page *page)
+static void __page_activate(struct page_lru *lru, struct page *page)
 {
-    DCHECK(page_flag_set(page, PAGE_FLAG_LRU));
+    /* PAGE_FLAG_LRU is only set and cleared under the lru lock (except by demotion, which we can
+     * safely skip). If it's clear, the page is isolated or not on the LRU yet. */
+    if (!page_flag_set(page, PAGE_FLAG_LRU))
+        return;
+
+#ifdef CONFIG_LRU_GEN
+    if (page_lru_gen(page) >= 0)
+    {
+        /* Twice referenced, straight to the youngest generation */
+        lru_gen_del_page(&lru->lrugen, page);
+        lru_gen_add_page(&lru->lrugen, page, lru->lrugen.max_seq, false);
+        page_clear_referenced(page);
+        return;
+    }
+#endif
+
+    /* Setting ACTIVE is protected by the page_lru lock, so we shouldn't race here... */
+    if (!page_flag_set(page, PAGE_FLAG_ACTIVE))
+    {
+        list_remove(&page->lru_node);
+        page_set_flag(page, PAGE_FLAG_ACTIVE);
+        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+        inc_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
+        __atomic_and_fetch(&page->flags, ~PAGE_FLAG_REFERENCED, __ATOMIC_RELEASE);
+        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_ACTIVE_BASE + page_to_state(page)]);
+    }
+}
+
+static void lru_batch_apply(struct page **pages, unsigned int nr, lru_batch_fn_t fn)
+{
+    struct page_lru *locked = NULL;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        /* Pages in a batch are usually from the same zone, so this is a single lock round trip */
+        struct page_lru *lru = page_to_page_lru(pages[i]);
+        if (lru != locked)
+        {
+            if (locked)
+                page_lru_unlock(locked);
+            page_lru_lock(lru);
+            locked = lru;
+        }
+
+        fn(lru, pages[i]);
+    }
+
+    if (locked)
+        page_lru_unlock(locked);
+
+    /* Drop the batch's references outside the lock, as this may free the page (if it got
+     * truncated in the meanwhile) */
+    for (unsigned int i = 0; i < nr; i++)
+        page_unref(pages[i]);
+    __atomic_add_fetch(&lru_batch_stats.drains, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Add a page to the local cpu's batch, draining it if full
+ * Must be called with preemption disabled; re-enables it.
+ *
+ * @param batch Local cpu's batch
+ * @param page Page to add
+ * @param fn Function to apply to every page, under the lru lock
+ */
+static void lru_batch_add(struct lru_batch *batch, struct page *page, lru_batch_fn_t fn)
+{
+    struct page *pages[PAGE_LRU_BATCH];
+    unsigned int nr = 0;
+
+    page_ref(page);
+    spin_lock(&batch->lock);
+    batch->pages[batch->nr++] = page;
+    if (batch->nr >= READ_ONCE(lru_batch_size))
+    {
+        nr = batch->nr;
+        memcpy(pages, batch->pages, nr * sizeof(struct page *));
+        batch->nr = 0;
+    }
+
+    spin_unlock(&batch->lock);
+    sched_enable_preempt();
+    __atomic_add_fetch(&lru_batch_stats.batched, 1, __ATOMIC_RELAXED);
+
+    if (nr)
+        lru_batch_apply(pages, nr, fn);
+}
+
+static void lru_batch_drain(struct lru_batch *batch, lru_batch_fn_t fn)
+{
+    struct page *pages[PAGE_LRU_BATCH];
+    unsigned int nr;
+
+    if (!READ_ONCE(batch->nr))
+        return;
+
+    spin_lock(&batch->lock);
+    nr = batch->nr;
+    memcpy(pages, batch->pages, nr * sizeof(struct page *));
+    batch->nr = 0;
+    spin_unlock(&batch->lock);
+
+    if (nr)
+        lru_batch_apply(pages, nr, fn);
+}
+
+void page_lru_drain_all(void)
+{
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+    {
+        lru_batch_drain(other_cpu_get_ptr(lru_add_batch, cpu), __page_add_lru);
+        lru_batch_drain(other_cpu_get_ptr(lru_activate_batch, cpu), __page_activate);
+    }
+}
+
+void page_add_lru(struct page *page)
+{
+    DCHECK(!page_flag_set(page, PAGE_FLAG_LRU));
+
+    if (READ_ONCE(lru_batch_size))
+    {
+        sched_disable_preempt();
+        lru_batch_add(get_per_cpu_ptr(lru_add_batch), page, __page_add_lru);
+        return;
+    }
+
     struct page_lru *lru = page_to_page_lru(page);
-    spin_lock(&lru->lock);
-    list_remove(&page->lru_node);
+    page_lru_lock(lru);
+    __page_add_lru(lru, page);
+    page_lru_unlock(lru);
+}
+
+static void __page_remove_lru(struct page_lru *lru, struct page *page)
+{
+#ifdef CONFIG_LRU_GEN
+    /* Look at the page, not at lru_gen_enabled(). The LRU might've been switched after the page
+     * was added. */
+    if (page_lru_gen(page) >= 0)
+        lru_gen_del_page(&lru->lrugen, page);
+    else
+#endif
+        list_remove(&page->lru_node);
     if (page_flag_set(page, PAGE_FLAG_ACTIVE))
         dec_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
     else
         dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
     __atomic_and_fetch(&page->flags, ~PAGE_FLAG_LRU, __ATOMIC_RELEASE);
-    spin_unlock(&lru->lock);
 }
 
-static void page_activate(struct page *page)
+void page_remove_lru(struct page *page)
 {
+    DCHECK(page_flag_set(page, PAGE_FLAG_LRU));
     struct page_lru *lru = page_to_page_lru(page);
-    spin_lock(&lru->lock);
+    page_lru_lock(lru);
+    __page_remove_lru(lru, page);
+    page_lru_unlock(lru);
+}
 
-    /* Setting ACTIVE is protected by the page_lru lock, so we shouldn't race here... */
-    if (!page_flag_set(page, PAGE_FLAG_ACTIVE))
+bool page_lru_isolate(struct page *page, bool *active)
+{
+    struct page_lru *lru;
+    bool isolated = false;
+
+    /* We got to the page by pfn, so it might be getting freed or charged to a different memcg under
+     * us. RCU keeps the memcg (and its lrus) around, and under the lru lock we can check that the
+     * page is still on this lru. */
+    rcu_read_lock();
+    lru = page_to_page_lru(page);
+    page_lru_lock(lru);
+
+    if (!page_flag_set(page, PAGE_FLAG_LRU) || page_to_page_lru(page) != lru)
+        goto out;
+    /* A page on the LRU can be at refcount 0 while it's being freed, don't resurrect it */
+    if (!page_try_get(page))
+        goto out;
+
+    __page_remove_lru(lru, page);
+    /* page_lru_putback decides if the page goes back active, clear the flag so the stats match */
+    *active = page_test_clear_flag(page, PAGE_FLAG_ACTIVE);
+    isolated = true;
+out:
+    page_lru_unlock(lru);
+    rcu_read_unlock();
+    return isolated;
+}
+
+static void page_activate(struct page *page)
+{
+    if (READ_ONCE(lru_batch_size))
     {
-        list_remove(&page->lru_node);
-        page_set_flag(page, PAGE_FLAG_ACTIVE);
-        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
-        inc_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
-        __atomic_and_fetch(&page->flags, ~PAGE_FLAG_REFERENCED, __ATOMIC_RELEASE);
-        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_ACTIVE_BASE + +page_to_state(page)]);
+        sched_disable_preempt();
+        lru_batch_add(get_per_cpu_ptr(lru_activate_batch), page, __page_activate);
+        return;
     }
 
-    spin_unlock(&lru->lock);
+    struct page_lru *lru = page_to_page_lru(page);
+    page_lru_lock(lru);
+    __page_activate(lru, page);
+    page_lru_unlock(lru);
 }
 
 void page_promote_referenced(struct page *page)
@@ -68,7 +367,7 @@ void page_promote_referenced(struct page *page)
         /* go from unref'd, inactive to ref'd, inactive */
         page_set_flag(page, PAGE_FLAG_REFERENCED);
     }
-    else if (page_flag_set(page, PAGE_FLAG_LRU))
+    else if (page_flag_set(page, PAGE_FLAG_LRU) && !page_flag_set(page, PAGE_FLAG_ACTIVE))
     {
         /* Referenced, activate. Note that we only try to activate if the page is in the LRU system
          * yet. If not, ignore. Trying to activate a page that's not quite in LRU yet will lead to
@@ -87,10 +386,21 @@ void page_lru_demote_reclaim(struct page *page)
     if (!page_test_clear_lru(page))
         return;
 
-    spin_lock(&lru->lock);
+    page_lru_lock(lru);
 
     /* We _know_ we were in the lru. So remove ourselves and add ourselves to the head. Our page
      * reference makes sure the page wasn't reused. */
+#ifdef CONFIG_LRU_GEN
+    if (page_lru_gen(page) >= 0)
+    {
+        lru_gen_del_page(&lru->lrugen, page);
+        lru_gen_add_page(&lru->lrugen, page, lru->lrugen.min_seq[page_lru_type(page)], true);
+        page_set_lru(page);
+        page_lru_unlock(lru);
+        return;
+    }
+#endif
+
     list_remove(&page->lru_node);
     list_add(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_BASE + page_to_state(page)]);
     page_set_lru(page);
@@ -102,5 +412,284 @@ void page_lru_demote_reclaim(struct page *page)
     }
 
     page_clear_active(page);
-    spin_unlock(&lru->lock);
+    page_lru_unlock(lru);
+}
+
+void page_lru_putback(struct page_lru *lru, struct page *page, bool activate)
+{
+#ifdef CONFIG_LRU_GEN
+    if (lru_gen_enabled())
+    {
+        struct lru_gen *lrugen = &lru->lrugen;
+        unsigned long seq = lrugen->max_seq;
+
+        if (activate)
+            page_clear_referenced(page);
+        else
+        {
+            /* Rotated pages get another round, one generation over the oldest */
+            seq = lrugen->min_seq[page_lru_type(page)] + 1;
+            if (seq > lrugen->max_seq)
+                seq = lrugen->max_seq;
+        }
+
+        lru_gen_add_page(lrugen, page, seq, false);
+        inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+        page_set_lru(page);
+        return;
+    }
+#endif
+
+    if (activate)
+    {
+        page_set_flag(page, PAGE_FLAG_ACTIVE);
+        inc_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
+        page_clear_referenced(page);
+        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_ACTIVE_FILE + page_to_state(page)]);
+    }
+    else
+    {
+        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_FILE + page_to_state(page)]);
+        inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+    }
+
+    page_set_lru(page);
+}
+
+#ifdef CONFIG_LRU_GEN
+
+unsigned long lru_gen_isolate(struct page_lru *lru, int type, struct list_head *page_list,
+                              unsigned long nr_pages, unsigned long *nr_scanned)
+{
+    struct lru_gen *lrugen = &lru->lrugen;
+    int gen = lru_gen_from_seq(lrugen->min_seq[type]);
+    unsigned long isolated = 0;
+    unsigned long to_scan = nr_pages * LRU_GEN_SCAN_RATIO;
+
+    if (!nr_pages)
+        return 0;
+
+    list_for_every_safe (&lrugen->lists[gen][type])
+    {
+        if (to_scan-- == 0)
+            break;
+        (*nr_scanned)++;
+        struct page *page = container_of(l, struct page, lru_node);
+        if (page_flag_set(page, PAGE_FLAG_REFERENCED))
+        {
+            /* Accessed since we last looked at it (by aging or by read/write): this is where
+             * promotion actually happens. */
+            page_clear_referenced(page);
+            lru_gen_del_page(lrugen, page);
+            lru_gen_add_page(lrugen, page, lrugen->max_seq, false);
+            continue;
+        }
+
+        page_ref(page);
+        DCHECK(page->ref > 1);
+        page_clear_lru(page);
+        lru_gen_del_page(lrugen, page);
+        dec_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+        list_add_tail(&page->lru_node, page_list);
+        if (++isolated == nr_pages)
+            break;
+    }
+
+    return isolated;
+}
+
+bool lru_gen_try_inc_min_seq(struct page_lru *lru, int type)
+{
+    struct lru_gen *lrugen = &lru->lrugen;
+
+    if (lrugen->max_seq - lrugen->min_seq[type] + 1 <= MIN_NR_GENS)
+        return false;
+    if (!list_is_empty(&lrugen->lists[lru_gen_from_seq(lrugen->min_seq[type])][type]))
+        return false;
+    lrugen->min_seq[type]++;
+    return true;
+}
+
+void lru_gen_inc_max_seq(struct page_lru *lru)
+{
+    struct lru_gen *lrugen = &lru->lrugen;
+
+    for (int type = 0; type < NR_LRU_GEN_TYPES; type++)
+    {
+        if (lrugen->max_seq - lrugen->min_seq[type] + 1 < MAX_NR_GENS)
+            continue;
+
+        /* Out of generations. Fold the oldest one into the next, keeping it at the head. */
+        int old = lru_gen_from_seq(lrugen->min_seq[type]);
+        int next = lru_gen_from_seq(lrugen->min_seq[type] + 1);
+
+        list_for_every (&lrugen->lists[old][type])
+        {
+            struct page *page = container_of(l, struct page, lru_node);
+            page_set_lru_gen(page, next);
+        }
+
+        list_splice(&lrugen->lists[old][type], &lrugen->lists[next][type]);
+        INIT_LIST_HEAD(&lrugen->lists[old][type]);
+        lrugen->nr_pages[next][type] += lrugen->nr_pages[old][type];
+        lrugen->nr_pages[old][type] = 0;
+        lrugen->min_seq[type]++;
+    }
+
+    lrugen->max_seq++;
+    lrugen->birth[lru_gen_from_seq(lrugen->max_seq)] = clocksource_get_time();
+}
+
+static void lru_gen_enable_zone(struct page_lru *lru)
+{
+    struct lru_gen *lrugen = &lru->lrugen;
+
+    for (int type = 0; type < NR_LRU_GEN_TYPES; type++)
+    {
+        int state = type == LRU_GEN_ANON ? LRU_ANON_OFF : 0;
+
+        /* Inactive pages become the oldest generation, active pages the youngest */
+        list_for_every_safe (&lru->lru_lists[LRU_INACTIVE_BASE + state])
+        {
+            struct page *page = container_of(l, struct page, lru_node);
+            list_remove(&page->lru_node);
+            lru_gen_add_page(lrugen, page, lrugen->min_seq[type], false);
+        }
+
+        list_for_every_safe (&lru->lru_lists[LRU_ACTIVE_BASE + state])
+        {
+            struct page *page = container_of(l, struct page, lru_node);
+            list_remove(&page->lru_node);
+            page_clear_active(page);
+            dec_page_stat(page, NR_ACTIVE_FILE + state);
+            inc_page_stat(page, NR_INACTIVE_FILE + state);
+            lru_gen_add_page(lrugen, page, lrugen->max_seq, false);
+        }
+    }
+}
+
+static void lru_gen_disable_zone(struct page_lru *lru)
+{
+    struct lru_gen *lrugen = &lru->lrugen;
+
+    for (int type = 0; type < NR_LRU_GEN_TYPES; type++)
+    {
+        int state = type == LRU_GEN_ANON ? LRU_ANON_OFF : 0;
+
+        /* Oldest first, so the inactive list keeps the generation order. The youngest generation
+         * becomes the active list. */
+        for (unsigned long seq = lrugen->min_seq[type]; seq <= lrugen->max_seq; seq++)
+        {
+            int gen = lru_gen_from_seq(seq);
+            bool active = seq == lrugen->max_seq;
+
+            list_for_every_safe (&lrugen->lists[gen][type])
+            {
+                struct page *page = container_of(l, struct page, lru_node);
+                lru_gen_del_page(lrugen, page);
+                if (active)
+                {
+                    page_set_flag(page, PAGE_FLAG_ACTIVE);
+                    dec_page_stat(page, NR_INACTIVE_FILE + state);
+                    inc_page_stat(page, NR_ACTIVE_FILE + state);
+                }
+
+                list_add_tail(&page->lru_node,
+                              &lru->lru_lists[(active ? LRU_ACTIVE_BASE : LRU_INACTIVE_BASE) +
+                                              state]);
+            }
+        }
+    }
+}
+
+static void lru_gen_switch_lru(struct page_lru *lru, bool enabled)
+{
+    page_lru_lock(lru);
+    if (enabled)
+        lru_gen_enable_zone(lru);
+    else
+        lru_gen_disable_zone(lru);
+    page_lru_unlock(lru);
+}
+
+void lru_gen_set_enabled(bool enabled)
+{
+    struct page_node *node = &main_node;
+    struct page_zone *zone;
+    struct mem_cgroup *memcg = NULL;
+
+    mutex_lock(&lru_gen_switch_lock);
+
+    /* Flip the switch first. Pages added from now on go to the new lists, and page_remove_lru
+     * looks at the page's own generation bits, so we can convert zones one by one. */
+    WRITE_ONCE(lru_gen_on, enabled);
+
+    for_zones_in_node(node, zone)
+        lru_gen_switch_lru(&zone->zone_lru, enabled);
+
+    /* memcgs created from here on start out empty, so they're already on the right lists */
+    while ((memcg = mem_cgroup_iter(memcg)) != NULL)
+    {
+        for_zones_in_node(node, zone)
+            lru_gen_switch_lru(mem_cgroup_lru(memcg, zone), enabled);
+    }
+
+    mutex_unlock(&lru_gen_switch_lock);
+}
+
+#endif
+
+ssize_t page_lru_stats_read(void *buffer, size_t size, off_t off)
+{
+    struct page_node *node = &main_node;
+    struct page_zone *zone;
+    unsigned long acquired = 0, contended = 0;
+    char buf[256];
+
+    for_zones_in_node(node, zone)
+    {
+        acquired += READ_ONCE(zone->zone_lru.nr_lock_acquired);
+        contended += READ_ONCE(zone->zone_lru.nr_lock_contended);
+    }
+
+    int len = snprintf(buf, sizeof(buf),
+                       "lock_acquired %lu\nlock_contended %lu\nbatched %lu\nbatch_drains %lu\n",
+                       acquired, contended, READ_ONCE(lru_batch_stats.batched),
+                       READ_ONCE(lru_batch_stats.drains));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t page_lru_batch_read(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%u\n", READ_ONCE(lru_batch_size));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t page_lru_batch_write(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    unsigned int pages = 0;
+
+    if (size == 0 || size >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+    buf[size] = '\0';
+
+    for (size_t i = 0; i < size && buf[i] != '\n'; i++)
+    {
+        if (buf[i] < '0' || buf[i] > '9')
+            return -EINVAL;
+        pages = pages * 10 + (buf[i] - '0');
+    }
+
+    if (pages > PAGE_LRU_BATCH)
+        return -EINVAL;
+
+    /* 0 disables batching. Flush whatever's still batched, so we don't leave pages behind. */
+    WRITE_ONCE(lru_batch_size, pages);
+    if (!pages)
+        page_lru_drain_all();
+    return size;
 }
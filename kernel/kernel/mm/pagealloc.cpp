@@ -18,6 +18,9 @@
 
 #include <onyx/copy.h>
 #include <onyx/init.h>
+#include <onyx/mm/compaction.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/migrate.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/mm/page_node.h>
 #include <onyx/mm/page_zone.h>
@@ -28,6 +31,7 @@
 #include <onyx/panic.h>
 #include <onyx/spinlock.h>
 #include <onyx/stackdepot.h>
+#include <onyx/sysfs.h>
 #include <onyx/utils.h>
 #include <onyx/vm.h>
 #include <onyx/wait_queue.h>
@@ -100,6 +104,10 @@ static unsigned long wake_up_pagedaemon(int order, int attempt = -1)
 }
 
 static bool page_has_low_memory();
+#ifdef CONFIG_COMPACTION
+static void page_compact_proactive(unsigned int order);
+static bool page_compact_for_alloc(unsigned int order, int highest_zone);
+#endif
 
 #define PAGEDAEMON_THROTTLE_MS 5000
 
@@ -114,6 +122,9 @@ static void pagedaemon(void * /*arg*/)
         wait_for_event(&paged_data.paged_queue, paged_data.request_seq > paged_data.reclaim_seq);
 
         int i = 0;
+#ifdef CONFIG_COMPACTION
+        page_compact_proactive(READ_ONCE(paged_data.order));
+#endif
         if (!page_has_low_memory())
             goto wake;
         /* Attempt to do reclaim a handful of times */
@@ -191,6 +202,7 @@ static struct page *page_zone_alloc_core(page_zone *zone, unsigned int gfp_flags
             CHECK(pages->flags == PAGE_BUDDY);
             page_debuddy(pages);
             list_remove(&pages->page_allocator_node.list_node);
+            zone->nr_free[i]--;
             // No need to remove it later on, we've already done it
             no_remove = true;
             zone->splits++;
@@ -210,6 +222,7 @@ static struct page *page_zone_alloc_core(page_zone *zone, unsigned int gfp_flags
 
         struct page *p2 = pages + nr_pages;
         list_add_tail(&p2->page_allocator_node.list_node, &zone->pages[i]);
+        zone->nr_free[i]++;
         DCHECK(!page_is_buddy(p2));
         page_make_buddy(p2, i);
     }
@@ -218,7 +231,10 @@ out:
     DCHECK(!page_is_buddy(pages));
     pages->flags = 0;
     if (!no_remove)
+    {
         list_remove(&pages->page_allocator_node.list_node);
+        zone->nr_free[order]--;
+    }
     zone->used_pages += nr_pgs;
 
     if (gfp_flags & __GFP_WAKE_PAGEDAEMON &&
@@ -327,9 +343,12 @@ static void page_zone_add(unsigned long start, unsigned int order, struct page_z
     }
 
     zone->total_pages += nr_pages;
+    zone->start_pfn = cul::min(zone->start_pfn, start >> PAGE_SHIFT);
+    zone->end_pfn = cul::max(zone->end_pfn, (start >> PAGE_SHIFT) + nr_pages);
     struct page *headpage = phys_to_page(start);
     page_make_buddy(headpage, order);
     list_add_tail(&headpage->page_allocator_node.list_node, &zone->pages[order]);
+    zone->nr_free[order]++;
 }
 
 void page_zone_add_region(unsigned long start, unsigned long nrpgs, struct page_zone *zone)
@@ -404,6 +423,7 @@ static void page_zone_free_core(page_zone *zone, struct page *page, unsigned int
         // Great, it's free, let's merge. The head will be what we're trying to insert.
         page_debuddy(buddy);
         list_remove(&buddy->page_allocator_node.list_node);
+        zone->nr_free[order]--;
         struct page *to = buddy < page ? buddy : page;
         page = to;
         zone->merges++;
@@ -413,6 +433,7 @@ static void page_zone_free_core(page_zone *zone, struct page *page, unsigned int
     // is likely cache-hot.
     page_make_buddy(page, order);
     list_add(&page->page_allocator_node.list_node, &zone->pages[order]);
+    zone->nr_free[order]++;
 }
 
 static void page_zone_release_pcpu(page_zone *zone, page_pcpu_data *queue)
@@ -482,7 +503,12 @@ struct page_zone *page_node::pick_zone(unsigned long page)
 
 struct page_lru *page_to_page_lru(struct page *page)
 {
-    return &main_node.pick_zone((unsigned long) page_to_phys(page))->zone_lru;
+    struct page_zone *zone = main_node.pick_zone((unsigned long) page_to_phys(page));
+#ifdef CONFIG_MEMCG
+    if (page->memcg)
+        return mem_cgroup_lru(page->memcg, zone);
+#endif
+    return &zone->zone_lru;
 }
 
 void page_node::add_region(uintptr_t base, size_t size)
@@ -800,6 +826,9 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
 {
     struct page *page = nullptr;
     unsigned int attempt = 0;
+#ifdef CONFIG_COMPACTION
+    bool compacted = false;
+#endif
 
     if (flags & __GFP_MAY_RECLAIM && !(flags & (__GFP_NOWAIT | __GFP_ATOMIC)))
     {
@@ -814,22 +843,29 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
             goto failure;
         }
 
-        int zone = ZONE_NORMAL;
+        int highest_zone = ZONE_NORMAL;
 
         if (flags & PAGE_ALLOC_4GB_LIMIT)
-            zone = ZONE_DMA32;
+            highest_zone = ZONE_DMA32;
 
-        while (zone >= 0)
+        for (int zone = highest_zone; zone >= 0; zone--)
         {
             page = page_zone_alloc(&zones[zone], flags, order);
 
             if (page)
                 goto out;
-            zone--;
         }
 
-        if (likely(page))
-            break;
+#ifdef CONFIG_COMPACTION
+        /* Higher order allocations may fail because of fragmentation. Try to compact before
+         * reclaiming (once). */
+        if (order > 0 && flags & __GFP_DIRECT_RECLAIM && !compacted)
+        {
+            compacted = true;
+            if (page_compact_for_alloc(order, highest_zone))
+                continue;
+        }
+#endif
 
         if (flags & __GFP_DIRECT_RECLAIM)
             do_direct_reclaim(order, attempt, flags);
@@ -879,7 +915,7 @@ void __reclaim_page(struct page *new_page)
     node.add_region((unsigned long) page_to_phys(new_page), PAGE_SIZE);
 }
 
-void page_node::free_page(struct page *p)
+static void page_prepare_free(struct page *p)
 {
     CHECK_PAGE(
         !(p->flags & (PAGE_FLAG_WRITEBACK | PAGE_FLAG_LOCKED | PAGE_FLAG_SWAP | PAGE_FLAG_WAITERS)),
@@ -893,6 +929,8 @@ void page_node::free_page(struct page *p)
     if (page_flag_set(p, PAGE_FLAG_ANON))
         dec_page_stat(p, NR_ANON);
 
+    mem_cgroup_uncharge(p);
+
     /* Reset the page */
     p->flags = 0;
     p->owner = nullptr;
@@ -900,6 +938,11 @@ void page_node::free_page(struct page *p)
     p->next_un.next_allocation = nullptr;
     p->ref = 0;
     CHECK(page_mapcount(p) == 0);
+}
+
+void page_node::free_page(struct page *p)
+{
+    page_prepare_free(p);
 
     /* Add it at the beginning since it might be fresh in the cache */
     // list_add(&p->page_allocator_node.list_node, &page_list);
@@ -947,10 +990,461 @@ static void page_drain_pcpu_local()
  */
 void page_drain_pcpu()
 {
+    /* LRU batches hold page references, flush them first so truncated pages get freed */
+    page_lru_drain_all();
     smp::sync_call_with_local([](void *ctx) { page_drain_pcpu_local(); }, nullptr, cpumask::all(),
                               [](void *ctx) { page_drain_pcpu_local(); }, nullptr);
 }
 
+/* Allocations fail because of fragmentation (and not for lack of memory) above this index */
+#define FRAG_INDEX_THRESHOLD 500
+
+/**
+ * @brief Calculate a zone's fragmentation index for an order
+ * This is the same index Linux uses: it tends to 0 when an allocation of this order would fail
+ * for lack of memory, and to 1000 when it would fail because the free memory is fragmented.
+ * Must be called with the zone lock held.
+ *
+ * @param zone Zone
+ * @param order Order
+ * @return The index (in thousandths), or -1000 if an allocation of this order would succeed
+ */
+static int __page_zone_fragmentation_index(struct page_zone *zone, unsigned int order)
+{
+    unsigned long free_pages = 0, free_blocks = 0;
+
+    for (unsigned int i = 0; i < PAGEALLOC_NR_ORDERS; i++)
+    {
+        if (i >= order && zone->nr_free[i])
+            return -1000;
+        free_blocks += zone->nr_free[i];
+        free_pages += zone->nr_free[i] << i;
+    }
+
+    if (!free_blocks)
+        return 0;
+
+    return 1000 - (int) ((1000 + free_pages * 1000 / pow2(order)) / free_blocks);
+}
+
+static int page_zone_fragmentation_index(struct page_zone *zone, unsigned int order)
+{
+    scoped_lock<spinlock, true> g{zone->lock};
+    return __page_zone_fragmentation_index(zone, order);
+}
+
+ssize_t page_fragmentation_index_read(void *buffer, size_t size, off_t off)
+{
+    char buf[512];
+    size_t len = 0;
+    /* snprintf returns what it would've written. Clamp, so a truncated line doesn't make us
+     * write (or copy out) past the end of buf. */
+    auto advance = [&](int st) { len = cul::min(len + st, sizeof(buf) - 1); };
+
+    for_every_node([&](page_node &node) -> bool {
+        return node.for_every_zone([&](page_zone *zone) -> bool {
+            advance(snprintf(buf + len, sizeof(buf) - len, "%-8s", zone->name));
+            for (unsigned int order = 0; order < PAGEALLOC_NR_ORDERS; order++)
+            {
+                int index = page_zone_fragmentation_index(zone, order);
+                if (index < 0)
+                    advance(snprintf(buf + len, sizeof(buf) - len, " -1.000"));
+                else
+                    advance(snprintf(buf + len, sizeof(buf) - len, " %d.%03d", index / 1000,
+                                     index % 1000));
+            }
+
+            advance(snprintf(buf + len, sizeof(buf) - len, "\n"));
+            return true;
+        });
+    });
+
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+#ifdef CONFIG_COMPACTION
+
+/**
+ * Commentary on compaction:
+ * Compaction makes free blocks of a given order by moving movable pages (anon and page cache
+ * pages on the LRU) out of the way. The zone is split into naturally aligned blocks of that
+ * order. The migration scanner goes through them from the bottom of the zone, picking blocks that
+ * are made of free pages and movable pages only, and migrates those pages to free pages the free
+ * scanner takes from the top of the zone. Compaction stops when the scanners meet, or when a
+ * free block of the order shows up.
+ *
+ * Compaction runs directly from the allocator, for allocations that may block, and from
+ * pagedaemon, which compacts zones proactively when their fragmentation index gets too high.
+ */
+
+/* pagedaemon keeps allocations of this order from failing because of fragmentation */
+#define COMPACT_PROACTIVE_ORDER 4
+#define COMPACT_MAX_DEFER_SHIFT 6
+
+static DECLARE_MUTEX(compact_lock);
+
+static struct compact_stats
+{
+    unsigned long nr_runs;
+    unsigned long nr_success;
+    unsigned long nr_deferred;
+    unsigned long nr_migrated;
+    unsigned long nr_migrate_failed;
+    unsigned long nr_free_isolated;
+} compact_stats;
+
+struct compact_control
+{
+    struct page_zone *zone;
+    unsigned int order;
+    /* Keep going after a free block of the order shows up */
+    bool full;
+    /* Next block the migration scanner looks at, going up */
+    unsigned long migrate_pfn;
+    /* Last block the free scanner looked at, going down */
+    unsigned long free_pfn;
+    /* Free pages the free scanner took out of the buddy lists, our migration targets */
+    struct list_head freepages;
+    unsigned long nr_freepages;
+};
+
+static bool compaction_deferred(struct page_zone *zone)
+{
+    if (++zone->compact_considered >= pow2(zone->compact_defer_shift))
+        return false;
+    __atomic_add_fetch(&compact_stats.nr_deferred, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void compaction_defer(struct page_zone *zone)
+{
+    zone->compact_considered = 0;
+    if (zone->compact_defer_shift < COMPACT_MAX_DEFER_SHIFT)
+        zone->compact_defer_shift++;
+}
+
+static bool page_zone_has_free_order(struct page_zone *zone, unsigned int order)
+{
+    return page_zone_fragmentation_index(zone, order) < 0;
+}
+
+static void compact_isolate_freepages(struct compact_control *cc)
+{
+    const unsigned long block = pow2(cc->order);
+    struct page_zone *zone = cc->zone;
+
+    /* Stay above the block the migration scanner is working on */
+    while (cc->nr_freepages < block && cc->free_pfn >= cc->migrate_pfn + 2 * block)
+    {
+        cc->free_pfn -= block;
+        scoped_lock<spinlock, true> g{zone->lock};
+
+        for (unsigned long pfn = cc->free_pfn; pfn < cc->free_pfn + block;)
+        {
+            struct page *page = phys_to_page_mayfail(pfn << PAGE_SHIFT);
+            if (!page || !page_is_buddy(page))
+            {
+                pfn++;
+                continue;
+            }
+
+            unsigned int order = page->priv;
+            /* Don't break up blocks we'd be compacting for */
+            if (order >= cc->order)
+                break;
+
+            list_remove(&page->page_allocator_node.list_node);
+            zone->nr_free[order]--;
+            page_debuddy(page);
+            page->flags = 0;
+            zone->used_pages += pow2(order);
+
+            for (unsigned long i = 0; i < pow2(order); i++)
+                list_add_tail(&page[i].page_allocator_node.list_node, &cc->freepages);
+            cc->nr_freepages += pow2(order);
+            __atomic_add_fetch(&compact_stats.nr_free_isolated, pow2(order), __ATOMIC_RELAXED);
+            pfn += pow2(order);
+        }
+    }
+}
+
+static struct page *compact_get_freepage(struct compact_control *cc)
+{
+    if (list_is_empty(&cc->freepages))
+        compact_isolate_freepages(cc);
+    if (list_is_empty(&cc->freepages))
+        return nullptr;
+
+    struct page *page = container_of(list_first_element(&cc->freepages), struct page,
+                                     page_allocator_node.list_node);
+    list_remove(&page->page_allocator_node.list_node);
+    cc->nr_freepages--;
+    prepare_pages_after_alloc(page, 0, PAGE_ALLOC_NO_ZERO);
+    return page;
+}
+
+static void compact_return_freepage(struct compact_control *cc, struct page *page)
+{
+    /* migrate_page didn't touch it */
+    page->ref = 0;
+    list_add(&page->page_allocator_node.list_node, &cc->freepages);
+    cc->nr_freepages++;
+}
+
+static void compact_release_freepages(struct compact_control *cc)
+{
+    scoped_lock<spinlock, true> g{cc->zone->lock};
+    list_for_every_safe (&cc->freepages)
+    {
+        struct page *page = container_of(l, struct page, page_allocator_node.list_node);
+        list_remove(&page->page_allocator_node.list_node);
+        page_zone_free_core(cc->zone, page, 0);
+    }
+
+    cc->nr_freepages = 0;
+}
+
+static void compact_putback(struct page *page, bool active)
+{
+    struct page_lru *lru = page_to_page_lru(page);
+    page_lru_lock(lru);
+    page_lru_putback(lru, page, active);
+    page_lru_unlock(lru);
+    page_unref(page);
+}
+
+static void compact_release_page(struct page_zone *zone, struct page *page)
+{
+    /* Free migrated pages straight into the buddy lists (and not the pcpu lists), so they merge
+     * into the block we're making. */
+    if (__page_unref(page) != 0)
+        return;
+
+    page_prepare_free(page);
+    scoped_lock<spinlock, true> g{zone->lock};
+    page_zone_free_core(zone, page, 0);
+}
+
+/**
+ * @brief Check (locklessly) if a block is made of free and movable pages only
+ *
+ * @param start First pfn of the block
+ * @param block Size of the block, in pages
+ * @return True if it's worth migrating the block's pages
+ */
+static bool compact_block_suitable(unsigned long start, unsigned long block)
+{
+    bool has_movable = false;
+
+    for (unsigned long pfn = start; pfn < start + block;)
+    {
+        struct page *page = phys_to_page_mayfail(pfn << PAGE_SHIFT);
+        if (!page)
+            return false;
+        if (page_is_buddy(page))
+        {
+            /* Racy, but buddy blocks are aligned, so any sane order is safe to skip */
+            unsigned int order = READ_ONCE(page->priv);
+            pfn += order < PAGEALLOC_NR_ORDERS ? pow2(order) : 1;
+            continue;
+        }
+
+        if (!page_flag_set(page, PAGE_FLAG_LRU))
+            return false;
+        has_movable = true;
+        pfn++;
+    }
+
+    return has_movable;
+}
+
+/**
+ * @brief Migrate every movable page out of a block
+ *
+ * @param cc Compaction control
+ * @param start First pfn of the block
+ * @return 0 on success, -ENOMEM if we ran out of free pages, or a migration error
+ */
+static int compact_migrate_block(struct compact_control *cc, unsigned long start)
+{
+    const unsigned long block = pow2(cc->order);
+
+    for (unsigned long pfn = start; pfn < start + block;)
+    {
+        struct page *page = phys_to_page(pfn << PAGE_SHIFT);
+        struct page *newpage;
+        bool active;
+        int st;
+
+        if (page_is_buddy(page))
+        {
+            unsigned int order = READ_ONCE(page->priv);
+            pfn += order < PAGEALLOC_NR_ORDERS ? pow2(order) : 1;
+            continue;
+        }
+
+        if (!page_lru_isolate(page, &active))
+            return -EBUSY;
+
+        newpage = compact_get_freepage(cc);
+        if (!newpage)
+        {
+            compact_putback(page, active);
+            return -ENOMEM;
+        }
+
+        st = migrate_page(page, newpage);
+        if (st < 0)
+        {
+            __atomic_add_fetch(&compact_stats.nr_migrate_failed, 1, __ATOMIC_RELAXED);
+            compact_return_freepage(cc, newpage);
+            compact_putback(page, active);
+            return st;
+        }
+
+        __atomic_add_fetch(&compact_stats.nr_migrated, 1, __ATOMIC_RELAXED);
+        compact_putback(newpage, active);
+        if (st == MIGRATE_OLD_MAPPED)
+        {
+            compact_putback(page, active);
+            return -EBUSY;
+        }
+
+        compact_release_page(cc->zone, page);
+        pfn++;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Compact a zone
+ *
+ * @param zone Zone to compact
+ * @param order Order of the free blocks we want
+ * @param full If true, compact the whole zone instead of stopping at the first free block
+ * @return True if the zone has a free block of the order
+ */
+static bool compact_zone(struct page_zone *zone, unsigned int order, bool full)
+{
+    const unsigned long block = pow2(order);
+    struct compact_control cc;
+    bool success = false;
+
+    if (zone->total_pages == 0)
+        return false;
+
+    cc.zone = zone;
+    cc.order = order;
+    cc.full = full;
+    cc.migrate_pfn = ALIGN_TO(zone->start_pfn, block);
+    cc.free_pfn = zone->end_pfn & -block;
+    INIT_LIST_HEAD(&cc.freepages);
+    cc.nr_freepages = 0;
+
+    mutex_lock(&compact_lock);
+    __atomic_add_fetch(&compact_stats.nr_runs, 1, __ATOMIC_RELAXED);
+
+    /* Get free pages out of the pcpu lists and into the buddy lists, where we can see them */
+    page_drain_pcpu();
+
+    for (; cc.migrate_pfn + block <= cc.free_pfn; cc.migrate_pfn += block)
+    {
+        if (!cc.full && page_zone_has_free_order(zone, order))
+            break;
+        if (!compact_block_suitable(cc.migrate_pfn, block))
+            continue;
+        if (compact_migrate_block(&cc, cc.migrate_pfn) == -ENOMEM)
+            break;
+    }
+
+    compact_release_freepages(&cc);
+    success = page_zone_has_free_order(zone, order);
+    mutex_unlock(&compact_lock);
+
+    if (success)
+    {
+        __atomic_add_fetch(&compact_stats.nr_success, 1, __ATOMIC_RELAXED);
+        zone->compact_defer_shift = zone->compact_considered = 0;
+    }
+    else
+        compaction_defer(zone);
+
+    return success;
+}
+
+/**
+ * @brief Compact zones for a failed allocation
+ *
+ * @param order Order of the allocation
+ * @param highest_zone Highest zone the allocation can use
+ * @return True if we made a free block of the order somewhere
+ */
+static bool page_compact_for_alloc(unsigned int order, int highest_zone)
+{
+    for (int zone = highest_zone; zone >= 0; zone--)
+    {
+        struct page_zone *z = &main_node.zones[zone];
+        /* If the allocation failed for lack of memory, compaction won't help */
+        if (page_zone_fragmentation_index(z, order) <= FRAG_INDEX_THRESHOLD)
+            continue;
+        if (compaction_deferred(z))
+            continue;
+        if (compact_zone(z, order, false))
+            return true;
+    }
+
+    return false;
+}
+
+static void page_compact_proactive(unsigned int order)
+{
+    order = cul::max(order, (unsigned int) COMPACT_PROACTIVE_ORDER);
+
+    main_node.for_every_zone([order](page_zone *zone) -> bool {
+        if (page_zone_fragmentation_index(zone, order) > FRAG_INDEX_THRESHOLD &&
+            !compaction_deferred(zone))
+            compact_zone(zone, order, false);
+        return true;
+    });
+}
+
+ssize_t compact_memory_read(void *buffer, size_t size, off_t off)
+{
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+                       "compact_runs %lu\ncompact_success %lu\ncompact_deferred %lu\n"
+                       "compact_migrated %lu\ncompact_migrate_failed %lu\n"
+                       "compact_free_isolated %lu\n",
+                       READ_ONCE(compact_stats.nr_runs), READ_ONCE(compact_stats.nr_success),
+                       READ_ONCE(compact_stats.nr_deferred), READ_ONCE(compact_stats.nr_migrated),
+                       READ_ONCE(compact_stats.nr_migrate_failed),
+                       READ_ONCE(compact_stats.nr_free_isolated));
+
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t compact_memory_write(void *buffer, size_t size, off_t off)
+{
+    char c;
+
+    if (size == 0)
+        return -EINVAL;
+    if (copy_from_user(&c, buffer, 1) < 0)
+        return -EFAULT;
+    if (c != '1')
+        return -EINVAL;
+
+    main_node.for_every_zone([](page_zone *zone) -> bool {
+        compact_zone(zone, COMPACT_PROACTIVE_ORDER, true);
+        return true;
+    });
+
+    return size;
+}
+
+#endif
+
 static void setup_pagedaemon()
 {
     paged_data.paged_thread = sched_create_thread(pagedaemon, THREAD_KERNEL, nullptr);
@@ -972,6 +1466,7 @@ void inc_page_stat(struct page *page, enum page_stat stat)
     sched_disable_preempt();
     zone->pcpu[get_cpu_nr()].pagestats[stat]++;
     sched_enable_preempt();
+    mem_cgroup_mod_stat(page, stat, 1);
 }
 
 void dec_page_stat(struct page *page, enum page_stat stat)
@@ -980,6 +1475,7 @@ void dec_page_stat(struct page *page, enum page_stat stat)
     sched_disable_preempt();
     zone->pcpu[get_cpu_nr()].pagestats[stat]--;
     sched_enable_preempt();
+    mem_cgroup_mod_stat(page, stat, -1);
 }
 
 void page_accumulate_stats(unsigned long pages[PAGE_STATS_MAX])
@@ -7,8 +7,12 @@
  */
 #include <stdio.h>
 
+#include <onyx/block/blk_plug.h>
 #include <onyx/filemap.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/lru_gen.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/page_lru.h>
 #include <onyx/mm/page_node.h>
 #include <onyx/mm/reclaim.h>
 #include <onyx/mm/shrinker.h>
@@ -250,6 +254,9 @@ static enum lru_result shrink_page(struct reclaim_data *data,
     {
         /* Activate a referenced page with pte refs, or reference it if not referenced yet */
         unlock_page(page);
+        /* With generations, a single A bit found since the page's last round is enough */
+        if (lru_gen_enabled())
+            return LRU_ACTIVATE;
         if (page_test_referenced(page))
             return LRU_ACTIVATE;
         page_set_referenced(page);
@@ -367,15 +374,13 @@ static unsigned long inactive_anon_min(const unsigned long stats[PAGE_STATS_MAX]
     return (stats[NR_INACTIVE_ANON] + stats[NR_ACTIVE_ANON]) / 4;
 }
 
-static void shrink_active_list(struct page_node *node, enum lru_state lru_list,
-                               struct page_zone *zone,
+static void shrink_active_list(struct page_lru *lru, enum lru_state lru_list,
                                const unsigned long pagestats[PAGE_STATS_MAX],
                                unsigned long target_inactive)
 {
     /* Attempt to shrink the active list such that we hit target_inactive */
-    struct page_lru *lru = &zone->zone_lru;
     enum lru_state inactive = lru_list - 1;
-    spin_lock(&lru->lock);
+    page_lru_lock(lru);
     DCHECK(target_inactive > pagestats[NR_INACTIVE_FILE + inactive]);
     unsigned long to_move = target_inactive - pagestats[NR_INACTIVE_FILE + inactive];
     list_for_every_safe (&lru->lru_lists[lru_list])
@@ -399,7 +404,7 @@ static void shrink_active_list(struct page_node *node, enum lru_state lru_list,
         inc_page_stat(page, NR_INACTIVE_FILE + inactive);
     }
 
-    spin_unlock(&lru->lock);
+    page_lru_unlock(lru);
 }
 
 static inline int page_to_state(struct page *page)
@@ -443,6 +448,11 @@ static unsigned long shrink_page_list(struct reclaim_data *data, struct page_lru
     DEFINE_LIST(rotate_list);
     DEFINE_LIST(activate_list);
     unsigned long freedp = 0;
+    struct blk_plug plug;
+
+    /* Anon pages reclaimed together get contiguous swap slots, so plug their writes for them to
+     * get merged into large IOs */
+    blk_start_plug(&plug);
     list_for_every_safe (page_list)
     {
         struct page *page = container_of(l, struct page, lru_node);
@@ -462,17 +472,17 @@ static unsigned long shrink_page_list(struct reclaim_data *data, struct page_lru
         }
     }
 
+    blk_end_plug(&plug);
+
     if (list_is_empty(&rotate_list) && list_is_empty(&activate_list))
         goto out;
 
-    spin_lock(&lru->lock);
+    page_lru_lock(lru);
     list_for_every_safe (&rotate_list)
     {
         struct page *page = container_of(l, struct page, lru_node);
         list_remove(&page->lru_node);
-        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_INACTIVE_FILE + page_to_state(page)]);
-        page_set_lru(page);
-        inc_page_stat(page, NR_INACTIVE_FILE + page_to_state(page));
+        page_lru_putback(lru, page, false);
         page_unref(page);
     }
 
@@ -480,14 +490,11 @@ static unsigned long shrink_page_list(struct reclaim_data *data, struct page_lru
     {
         struct page *page = container_of(l, struct page, lru_node);
         list_remove(&page->lru_node);
-        page_set_flag(page, PAGE_FLAG_ACTIVE);
-        inc_page_stat(page, NR_ACTIVE_FILE + page_to_state(page));
-        page_clear_referenced(page);
-        list_add_tail(&page->lru_node, &lru->lru_lists[LRU_ACTIVE_FILE + page_to_state(page)]);
+        page_lru_putback(lru, page, true);
         page_unref(page);
     }
 
-    spin_unlock(&lru->lock);
+    page_lru_unlock(lru);
 
 out:
     return freedp;
@@ -500,9 +507,9 @@ static unsigned long isolate_and_shrink(struct reclaim_data *data, enum lru_stat
     if (!nr)
         return 0;
 
-    spin_lock(&lru->lock);
+    page_lru_lock(lru);
     isolate_pages(lru, lru_list, &isolate_list, nr);
-    spin_unlock(&lru->lock);
+    page_lru_unlock(lru);
 
     return shrink_page_list(data, lru, &isolate_list);
 }
@@ -520,21 +527,110 @@ static void calculate_scan(unsigned long stats[PAGE_STATS_MAX])
 
 #define SWAP_CLUSTER_MAX 64UL
 
-static void shrink_zone(struct reclaim_data *data, struct page_node *node, struct page_zone *zone,
-                        long target_freep)
+#ifdef CONFIG_LRU_GEN
+
+static long lru_gen_shrink_lru(struct reclaim_data *data, struct page_lru *lru,
+                               long target_freep)
+{
+    bool has_swap = swap_is_available();
+    unsigned int nr_aged = 0;
+
+    while (target_freep > 0)
+    {
+        DEFINE_LIST(isolate_list);
+        unsigned long isolated, freed, max_seq, scanned = 0;
+        bool progress;
+
+        page_lru_lock(lru);
+        /* Same 2:1 file to anon scan ratio as the classic LRU */
+        isolated = lru_gen_isolate(lru, LRU_GEN_FILE, &isolate_list, SWAP_CLUSTER_MAX, &scanned);
+        if (has_swap)
+            isolated += lru_gen_isolate(lru, LRU_GEN_ANON, &isolate_list, SWAP_CLUSTER_MAX / 2,
+                                        &scanned);
+
+        if (!isolated && scanned)
+        {
+            /* Only promoted referenced pages. Drop the lock and keep going. */
+            page_lru_unlock(lru);
+            continue;
+        }
+
+        if (!isolated)
+        {
+            /* Oldest generation is exhausted, move on to the next one. If we're down to the last
+             * two, make a new one. */
+            progress = lru_gen_try_inc_min_seq(lru, LRU_GEN_FILE);
+            if (has_swap && lru_gen_try_inc_min_seq(lru, LRU_GEN_ANON))
+                progress = true;
+            max_seq = lru->lrugen.max_seq;
+            page_lru_unlock(lru);
+
+            if (!progress)
+            {
+                /* Every page has been looked at MAX_NR_GENS times, give up */
+                if (nr_aged++ == MAX_NR_GENS)
+                    break;
+                lru_gen_age(lru, max_seq);
+            }
+
+            continue;
+        }
+
+        page_lru_unlock(lru);
+
+        freed = shrink_page_list(data, lru, &isolate_list);
+        data->nr_reclaimed += freed;
+        target_freep -= freed;
+    }
+
+    return target_freep;
+}
+
+#endif
+
+static void lru_get_stats(struct mem_cgroup *memcg, unsigned long stats[PAGE_STATS_MAX])
+{
+    /* The root LRUs go by the global stats, which is a good enough approximation */
+    if (memcg)
+        mem_cgroup_get_stats(memcg, stats);
+    else
+        page_accumulate_stats(stats);
+}
+
+/**
+ * @brief Shrink a single LRU
+ *
+ * @param data Data associated with this reclaim
+ * @param memcg Memcg the LRU belongs to, or NULL for a zone's LRU
+ * @param lru LRU to shrink
+ * @param target_freep Target of pages to free
+ * @return The remaining target
+ */
+static long shrink_lru(struct reclaim_data *data, struct mem_cgroup *memcg, struct page_lru *lru,
+                       long target_freep)
 {
     unsigned long stats[PAGE_STATS_MAX];
-    page_accumulate_stats(stats);
-    struct page_lru *lru = &zone->zone_lru;
+    unsigned long reclaimed = data->nr_reclaimed;
+
+#ifdef CONFIG_LRU_GEN
+    if (lru_gen_enabled())
+    {
+        target_freep = lru_gen_shrink_lru(data, lru, target_freep);
+        mem_cgroup_note_reclaimed(memcg, data->nr_reclaimed - reclaimed);
+        return target_freep;
+    }
+#endif
+
+    lru_get_stats(memcg, stats);
 
     unsigned long min_inactive = inactive_file_min(stats);
     unsigned long min_inactive_anon = inactive_anon_min(stats);
     if (stats[NR_INACTIVE_FILE] < min_inactive)
-        shrink_active_list(node, LRU_ACTIVE_FILE, zone, stats, min_inactive);
+        shrink_active_list(lru, LRU_ACTIVE_FILE, stats, min_inactive);
     if (stats[NR_INACTIVE_ANON] < min_inactive_anon)
-        shrink_active_list(node, LRU_ACTIVE_ANON, zone, stats, min_inactive_anon);
+        shrink_active_list(lru, LRU_ACTIVE_ANON, stats, min_inactive_anon);
 
-    page_accumulate_stats(stats);
+    lru_get_stats(memcg, stats);
     calculate_scan(stats);
 
     while (target_freep > 0)
@@ -556,15 +652,42 @@ static void shrink_zone(struct reclaim_data *data, struct page_node *node, struc
     }
 
 #ifdef DEBUG_SHRINK_ZONE
-    pr_warn("shrink_zone: Zone %s freed %lu pages (out of %lu)\n", zone->name, freed, target_freep);
-    pr_warn("shrink_zone: inactive %lu active %lu\n", stats[NR_INACTIVE_FILE],
+    pr_warn("shrink_lru: freed %lu pages (%ld left)\n", data->nr_reclaimed - reclaimed,
+            target_freep);
+    pr_warn("shrink_lru: inactive %lu active %lu\n", stats[NR_INACTIVE_FILE],
             stats[NR_ACTIVE_FILE]);
 #endif
+
+    mem_cgroup_note_reclaimed(memcg, data->nr_reclaimed - reclaimed);
+    return target_freep;
+}
+
+static void shrink_zone(struct reclaim_data *data, struct page_zone *zone, long target_freep)
+{
+    struct mem_cgroup *memcg = NULL;
+
+    target_freep = shrink_lru(data, NULL, &zone->zone_lru, target_freep);
+
+    /* Global reclaim also goes through every memcg's LRUs (including offline ones) */
+    while ((memcg = mem_cgroup_iter(memcg)) != NULL)
+    {
+        if (target_freep <= 0)
+        {
+            mem_cgroup_iter_break(memcg);
+            break;
+        }
+
+        target_freep = shrink_lru(data, memcg, mem_cgroup_lru(memcg, zone), target_freep);
+    }
 }
 
 static void shrink_page_zones(struct reclaim_data *data, struct page_node *node)
 {
     struct page_zone *zone;
+
+    /* Flush the per-cpu LRU batches, so reclaim sees (and can isolate) every page */
+    page_lru_drain_all();
+
     for_zones_in_node(node, zone)
     {
         unsigned long freep = zone->total_pages - zone->used_pages;
@@ -576,10 +699,49 @@ static void shrink_page_zones(struct reclaim_data *data, struct page_node *node)
         if (target == 0)
             continue;
 
-        shrink_zone(data, node, zone, target);
+        shrink_zone(data, zone, target);
     }
 }
 
+unsigned long page_reclaim_memcg(struct mem_cgroup *memcg, unsigned long nr_pages,
+                                 unsigned int gfp_flags)
+{
+    struct reclaim_data data = {
+        .failed_order = 0,
+        .attempt = 0,
+        .nr_reclaimed = 0,
+        .mode = RECLAIM_MODE_DIRECT,
+        .gfp_flags = gfp_flags,
+    };
+    struct page_node *node = &main_node;
+    struct page_zone *zone;
+    struct mem_cgroup *iter = NULL;
+    long target = nr_pages;
+
+    page_lru_drain_all();
+
+    while ((iter = mem_cgroup_iter(iter)) != NULL)
+    {
+        if (!mem_cgroup_is_descendant(iter, memcg))
+            continue;
+
+        for_zones_in_node(node, zone)
+        {
+            if (target <= 0)
+                break;
+            target = shrink_lru(&data, iter, mem_cgroup_lru(iter, zone), target);
+        }
+
+        if (target <= 0)
+        {
+            mem_cgroup_iter_break(iter);
+            break;
+        }
+    }
+
+    return data.nr_reclaimed;
+}
+
 /**
  * @brief Do (direct?) page reclamation. Called from direct reclaim or pagedaemon.
  *
@@ -102,13 +102,6 @@ void anon_vma_link(struct anon_vma *anon, struct vm_area_struct *vma)
     spin_unlock(&anon->lock);
 }
 
-struct rmap_walk_info
-{
-    int (*walk_one)(struct vm_area_struct *vma, struct page *page, unsigned long addr,
-                    void *context);
-    void *context;
-};
-
 static struct anon_vma *anon_vma_lock(struct page *page)
 {
     /* We use RCU read lock and TYPESAFE_BY_RCU to get by here. The idea goes like this: We check if
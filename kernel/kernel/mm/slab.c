@@ -17,6 +17,8 @@
 #include <onyx/rcupdate.h>
 #include <onyx/rwlock.h>
 #include <onyx/stackdepot.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
 #include <onyx/vm.h>
 
 static struct mutex cache_list_lock;
@@ -65,6 +67,8 @@ struct slab
     size_t active_objects;
     size_t nobjects;
     struct slab_cache *cache;
+    /* Set to the cache's defrag_seq when picked for defragmentation */
+    unsigned long defrag_seq;
 };
 
 #define SLAB_CANARY 0x00600DBAAE600DBA
@@ -94,6 +98,7 @@ struct kasan_slab_obj_info
  * @param slab Slab to free
  */
 static void kmem_cache_free_slab(struct slab *slab);
+static void kmem_free_to_slab(struct slab_cache *cache, struct slab *slab, void *ptr);
 
 /**
  * @brief Create a slab cache
@@ -171,7 +176,17 @@ struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align
     c->npartialslabs = c->nfreeslabs = c->nfullslabs = 0;
 
     for (int i = 0; i < CONFIG_SMP_NR_CPUS; i++)
+    {
         c->pcpu[i].size = 0;
+        memset(&c->pcpu[i].stats, 0, sizeof(struct slab_cache_stats));
+    }
+
+    for (int i = 0; i < SLAB_CACHE_DEPOT_SIZE; i++)
+        c->depot[i] = NULL;
+
+    c->defrag = NULL;
+    c->defrag_seq = 0;
+    c->nr_defrag_runs = c->nr_defrag_evicted = c->nr_defrag_freed_pages = 0;
 
     if (c->objsize > 256)
         c->mag_limit = 64;
@@ -558,6 +573,7 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
     slab->active_objects = 0;
     slab->nobjects = nr_objects;
     slab->object_list = first;
+    slab->defrag_seq = 0;
 
     if (pages)
         slab->pages = pages;
@@ -743,9 +759,119 @@ static int kmem_cache_refill_mag_noalloc(struct slab_cache *cache,
     return 0;
 }
 
+/**
+ * @brief Refill an empty magazine with a batch from the depot
+ * The depot is lockless: batches are taken with an atomic exchange, so there's no ABA to worry
+ * about. This lets objects freed on one CPU get reused by another CPU without ever touching the
+ * cache lock.
+ *
+ * @pre Preemption is disabled
+ * @param cache Slab cache
+ * @param pcpu Slab pcpu cache (with an empty magazine)
+ * @return True if we got a batch, else false
+ */
+static bool kmem_cache_refill_mag_depot(struct slab_cache *cache,
+                                        struct slab_cache_percpu_context *pcpu)
+{
+    DCHECK(pcpu->size == 0);
+    for (int i = 0; i < SLAB_CACHE_DEPOT_SIZE; i++)
+    {
+        if (!__atomic_load_n(&cache->depot[i], __ATOMIC_RELAXED))
+            continue;
+
+        void *obj = __atomic_exchange_n(&cache->depot[i], NULL, __ATOMIC_ACQUIRE);
+        /* Lost the race against someone else */
+        if (!obj)
+            continue;
+
+        while (obj)
+        {
+            DCHECK(pcpu->size < cache->mag_limit);
+            pcpu->magazine[pcpu->size++] = obj;
+            obj = kmem_bufctl_from_ptr(cache, obj)->next;
+        }
+
+        pcpu->stats.nr_refill_depot++;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Flush the bottom half of a full magazine to the depot
+ * The objects stay marked free, and get chained through their bufctls.
+ *
+ * @pre Preemption is disabled
+ * @param cache Slab cache
+ * @param pcpu Slab pcpu cache (with a full magazine)
+ * @return True if the batch was flushed, false if the depot is full
+ */
+static bool kmem_cache_flush_mag_depot(struct slab_cache *cache,
+                                       struct slab_cache_percpu_context *pcpu)
+{
+    const int batchsize = cache->mag_limit / 2;
+    bool chained = false;
+
+    for (int i = 0; i < SLAB_CACHE_DEPOT_SIZE; i++)
+    {
+        void *expected = NULL;
+        if (__atomic_load_n(&cache->depot[i], __ATOMIC_RELAXED))
+            continue;
+
+        if (!chained)
+        {
+            for (int j = 0; j < batchsize; j++)
+            {
+                kmem_bufctl_from_ptr(cache, pcpu->magazine[j])->next =
+                    j + 1 < batchsize ? pcpu->magazine[j + 1] : NULL;
+            }
+
+            chained = true;
+        }
+
+        if (__atomic_compare_exchange_n(&cache->depot[i], &expected, pcpu->magazine[0], false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            pcpu->size -= batchsize;
+            memmove(pcpu->magazine, &pcpu->magazine[batchsize], pcpu->size * sizeof(void *));
+            pcpu->stats.nr_flush_depot++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Return every batch in the depot to the slabs
+ *
+ * @pre cache is locked
+ * @param cache Slab cache
+ */
+static void kmem_cache_drain_depot(struct slab_cache *cache)
+{
+    for (int i = 0; i < SLAB_CACHE_DEPOT_SIZE; i++)
+    {
+        void *ptr = __atomic_exchange_n(&cache->depot[i], NULL, __ATOMIC_ACQUIRE);
+        while (ptr)
+        {
+            struct bufctl *buf = kmem_bufctl_from_ptr(cache, ptr);
+            struct slab *slab = kmem_pointer_to_slab(ptr);
+            void *next = buf->next;
+
+            if (unlikely(slab->cache != cache))
+                panic("slab: Pointer %p was returned to the wrong cache\n", ptr);
+            buf->flags = 0;
+            kmem_free_to_slab(cache, slab, ptr);
+            ptr = next;
+        }
+    }
+}
+
 /**
  * @brief Refill a magazine
- * Refill a magazine using partial+free slabs and/or allocated slabs.
+ * Refill a magazine using the depot, partial+free slabs and/or allocated slabs.
  * This function may drop preemption (if allocating). Callers must re-fetch pcpu.
  * Whatever pcpu is valid at the end of the function is guaranteed to have at least one object in
  * the mag.
@@ -766,6 +892,10 @@ static int kmem_cache_alloc_refill_mag(struct slab_cache *cache,
     int slabs_to_alloc;
     int nslabs;
 
+    if (kmem_cache_refill_mag_depot(cache, pcpu))
+        return 0;
+
+    pcpu->stats.nr_refill_slab++;
     spin_lock(&cache->lock);
     slabs_to_alloc = kmem_cache_refill_mag_noalloc(cache, pcpu);
     spin_unlock(&cache->lock);
@@ -926,6 +1056,7 @@ void *kmem_cache_alloc(struct slab_cache *cache, unsigned int flags)
     kmem_bufctl_from_ptr(cache, ret)->flags = 0;
 
     pcpu->active_objs++;
+    pcpu->stats.nr_alloc++;
     __atomic_store_n(&pcpu->touched, 0, __ATOMIC_RELEASE);
     sched_enable_preempt();
 
@@ -996,6 +1127,7 @@ size_t kmem_cache_alloc_bulk(struct slab_cache *cache, unsigned int gfp_flags, s
         /* Attempt to fill up our res array with whatever we can find in the pcpu data. */
         unsigned long to_take = min(nr, (unsigned long) pcpu->size);
         nr -= to_take;
+        pcpu->stats.nr_alloc += to_take;
         while (to_take--)
         {
             void *ptr = pcpu->magazine[--pcpu->size];
@@ -1090,6 +1222,13 @@ static void kfree_nopcpu(void *ptr)
 
 void kmem_cache_return_pcpu_batch(struct slab_cache *cache, struct slab_cache_percpu_context *pcpu)
 {
+    /* Try to hand the batch to the depot first, so some other CPU can pick it up without going
+     * through the slabs (and the cache lock). This is what keeps producer/consumer patterns
+     * (objects allocated on one CPU and freed on another) off the slow path. */
+    if (kmem_cache_flush_mag_depot(cache, pcpu))
+        return;
+
+    pcpu->stats.nr_flush_slab++;
     spin_lock(&cache->lock);
     int size = cache->mag_limit;
     int batchsize = size / 2;
@@ -1126,6 +1265,7 @@ __always_inline void kmem_cache_free_pcpu_single(struct slab_cache *cache,
     pcpu->magazine[pcpu->size++] = ptr;
     buf->flags = BUFCTL_PATTERN_FREE;
     pcpu->active_objs--;
+    pcpu->stats.nr_free++;
 }
 
 static void kmem_cache_free_pcpu(struct slab_cache *cache, void *ptr)
@@ -1400,6 +1540,7 @@ static void kmem_slab_freeze_wait(struct slab_rendezvous *rndvz)
  * @brief Shrink all pcpu caches for a given cache
  * Empty the pcpu caches for all online CPUs, for a given cache.
  * If any given pcpu cache is "touched" (aka that cpu has a reference to it), skip it.
+ * The depot is also drained back to the slabs.
  * Requires the cache lock and a slab freeze to be in place.
  * @param cache Slab cache
  */
@@ -1424,6 +1565,8 @@ static void kmem_cache_shrink_pcpu_all(struct slab_cache *cache)
 
         pcpu->size = 0;
     }
+
+    kmem_cache_drain_depot(cache);
 }
 
 /**
@@ -1799,6 +1942,234 @@ void slab_shrink_caches(unsigned long target_freep)
     mutex_unlock(&cache_list_lock);
 }
 
+/* Partial slabs with at most this percentage of objects in use get defragmented */
+#define KMEM_DEFRAG_MAX_USED_PCT 25
+/* Max number of caches that can opt in to defragmentation */
+#define KMEM_DEFRAG_MAX_CACHES   8
+
+static struct mutex defrag_lock;
+
+/**
+ * @brief Opt a cache into active defragmentation
+ * The defrag callback gets called (with no slab locks held) after the cache's sparse partial slabs
+ * have been marked. It should walk its own objects and evict (or migrate) every object it safely
+ * can for which kmem_defrag_candidate() returns true, and return how many it got rid of.
+ *
+ * @param cache Slab cache
+ * @param defrag Defrag callback
+ */
+void kmem_cache_set_defrag(struct slab_cache *cache, unsigned long (*defrag)(struct slab_cache *))
+{
+    spin_lock(&cache->lock);
+    cache->defrag = defrag;
+    spin_unlock(&cache->lock);
+}
+
+/**
+ * @brief Check if an object lives in a slab that's being defragmented
+ * Only meaningful from a defrag callback. The caller must guarantee the object is allocated.
+ *
+ * @param obj Object
+ * @return True if the object should be evicted
+ */
+bool kmem_defrag_candidate(void *obj)
+{
+    struct slab *slab = kmem_pointer_to_slab(obj);
+    unsigned long seq = __atomic_load_n(&slab->cache->defrag_seq, __ATOMIC_ACQUIRE);
+    return (seq & 1) && __atomic_load_n(&slab->defrag_seq, __ATOMIC_RELAXED) == seq;
+}
+
+/**
+ * @brief Defragment a cache
+ * Mark the cache's mostly-empty partial slabs, move them to the back of the partial list (so
+ * refills prefer the denser slabs) and ask the owner to evict the objects living in them. Any slab
+ * that ends up free gets released.
+ *
+ * @pre defrag_lock is held
+ * @param cache Slab cache
+ * @return Number of pages released
+ */
+static unsigned long kmem_cache_defrag(struct slab_cache *cache)
+{
+    DEFINE_LIST(sparse);
+    unsigned long nr_marked = 0, evicted, freed;
+    unsigned long seq = cache->defrag_seq + 1;
+
+    spin_lock(&cache->lock);
+    /* With a single partial slab there's nothing to compact */
+    if (cache->npartialslabs < 2)
+    {
+        spin_unlock(&cache->lock);
+        return 0;
+    }
+
+    list_for_every_safe (&cache->partial_slabs)
+    {
+        struct slab *slab = container_of(l, struct slab, slab_list_node);
+        if (slab->active_objects * 100 > slab->nobjects * KMEM_DEFRAG_MAX_USED_PCT)
+            continue;
+        slab->defrag_seq = seq;
+        list_remove(&slab->slab_list_node);
+        list_add_tail(&slab->slab_list_node, &sparse);
+        nr_marked++;
+    }
+
+    list_splice_tail(&sparse, &cache->partial_slabs);
+    if (nr_marked)
+        __atomic_store_n(&cache->defrag_seq, seq, __ATOMIC_RELEASE);
+    spin_unlock(&cache->lock);
+
+    if (!nr_marked)
+        return 0;
+
+    evicted = cache->defrag(cache);
+    __atomic_store_n(&cache->defrag_seq, seq + 1, __ATOMIC_RELEASE);
+
+    /* Evicted objects are commonly freed through RCU (e.g dentries). Wait for a grace period so
+     * (most of) them make it back to the cache before shrinking it. */
+    synchronize_rcu();
+    freed = kmem_cache_shrink(cache, ULONG_MAX);
+
+    spin_lock(&cache->lock);
+    cache->nr_defrag_runs++;
+    cache->nr_defrag_evicted += evicted;
+    cache->nr_defrag_freed_pages += freed;
+    spin_unlock(&cache->lock);
+    return freed;
+}
+
+/**
+ * @brief Defragment every cache that opted in
+ * Evicts objects out of mostly-empty slabs, and releases the slabs that end up free.
+ *
+ * @return Number of pages released
+ */
+unsigned long slab_defrag_caches(void)
+{
+    struct slab_cache *caches[KMEM_DEFRAG_MAX_CACHES];
+    unsigned int nr = 0;
+    unsigned long freed = 0;
+
+    /* Defrag callbacks can allocate memory (and enter reclaim), so cache_list_lock can't be held
+     * while calling them. Caches that opt in to defragmentation are never destroyed. */
+    mutex_lock(&cache_list_lock);
+    list_for_every (&cache_list)
+    {
+        struct slab_cache *cache = container_of(l, struct slab_cache, cache_list_node);
+        if (cache->defrag && nr < KMEM_DEFRAG_MAX_CACHES)
+            caches[nr++] = cache;
+    }
+    mutex_unlock(&cache_list_lock);
+
+    mutex_lock(&defrag_lock);
+    for (unsigned int i = 0; i < nr; i++)
+        freed += kmem_cache_defrag(caches[i]);
+    mutex_unlock(&defrag_lock);
+    return freed;
+}
+
+#define SLABINFO_LINE_LEN 320
+
+/**
+ * @brief Print a cache's fragmentation stats
+ * Objects in use (vs the capacity of all of its slabs), slab counts, a histogram of how full the
+ * partial slabs are (in quarters) and defrag stats.
+ *
+ * @pre cache is locked
+ */
+static int kmem_cache_slabinfo(struct slab_cache *cache, char *buf, size_t len)
+{
+    const unsigned long objs_per_slab = kmem_calc_slab_nr_objs(cache);
+    const unsigned long nslabs = cache->nfreeslabs + cache->npartialslabs + cache->nfullslabs;
+    unsigned long hist[4] = {};
+    unsigned long nactive = 0;
+
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+        nactive += cache->pcpu[i].active_objs;
+    /* pcpu active counts are per-cpu, and objects may be allocated on one cpu and freed on another,
+     * so the sum may transiently wrap. */
+    if ((long) nactive < 0)
+        nactive = 0;
+
+    list_for_every (&cache->partial_slabs)
+    {
+        struct slab *slab = container_of(l, struct slab, slab_list_node);
+        unsigned long quarter = (slab->active_objects * 4) / slab->nobjects;
+        hist[min(quarter, 3UL)]++;
+    }
+
+    return snprintf(buf, len, "%s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n",
+                    cache->name, cache->objsize, nactive, nslabs * objs_per_slab, nslabs,
+                    cache->nfullslabs, cache->npartialslabs, cache->nfreeslabs, hist[0], hist[1],
+                    hist[2], hist[3], cache->nr_defrag_runs, cache->nr_defrag_evicted,
+                    cache->nr_defrag_freed_pages);
+}
+
+ssize_t kmem_slabinfo_read(void *buffer, size_t size, off_t off)
+{
+    static const char header[] = "# name objsize active_objs total_objs slabs full partial free "
+                                 "partial<25% partial<50% partial<75% partial<100% defrag_runs "
+                                 "defrag_evicted defrag_freed_pages\n";
+    unsigned long nr_caches = 0;
+    size_t len, buflen;
+    ssize_t st;
+    char *buf;
+
+    /* Don't allocate with cache_list_lock held, since reclaim also grabs it. New caches created in
+     * the meanwhile get a bit of slack, and anything else gets truncated. */
+    mutex_lock(&cache_list_lock);
+    list_for_every (&cache_list)
+        nr_caches++;
+    mutex_unlock(&cache_list_lock);
+
+    buflen = sizeof(header) + (nr_caches + 4) * SLABINFO_LINE_LEN;
+    buf = kmalloc(buflen, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    len = sizeof(header) - 1;
+    memcpy(buf, header, len);
+
+    mutex_lock(&cache_list_lock);
+    list_for_every (&cache_list)
+    {
+        struct slab_cache *cache = container_of(l, struct slab_cache, cache_list_node);
+        if (len + SLABINFO_LINE_LEN > buflen)
+            break;
+        spin_lock(&cache->lock);
+        len += min(kmem_cache_slabinfo(cache, buf + len, SLABINFO_LINE_LEN),
+                   SLABINFO_LINE_LEN - 1);
+        spin_unlock(&cache->lock);
+    }
+    mutex_unlock(&cache_list_lock);
+
+    st = sysfs_copy_out(buffer, size, off, buf, len);
+    kfree(buf);
+    return st;
+}
+
+ssize_t kmem_defrag_write(void *buffer, size_t size, off_t off)
+{
+    char c;
+
+    if (size == 0)
+        return -EINVAL;
+    if (copy_from_user(&c, buffer, 1) < 0)
+        return -EFAULT;
+    if (c != '1')
+        return -EINVAL;
+
+    slab_defrag_caches();
+    return size;
+}
+
+static unsigned long kmem_fast_path_pct(unsigned long total, unsigned long missed)
+{
+    if (!total)
+        return 100;
+    return ((total - min(missed, total)) * 100) / total;
+}
+
 void kmem_print_stats()
 {
     mutex_lock(&cache_list_lock);
@@ -1809,12 +2180,35 @@ void kmem_print_stats()
         unsigned long total = (cache->nfreeslabs + cache->npartialslabs + cache->nfullslabs) *
                               kmem_calc_slab_size(cache);
         unsigned long nactive = 0;
+        struct slab_cache_stats stats = {};
         for (unsigned int i = 0; i < get_nr_cpus(); i++)
+        {
+            const struct slab_cache_stats *pstats = &cache->pcpu[i].stats;
             nactive += cache->pcpu[i].active_objs;
+            stats.nr_alloc += pstats->nr_alloc;
+            stats.nr_free += pstats->nr_free;
+            stats.nr_refill_depot += pstats->nr_refill_depot;
+            stats.nr_flush_depot += pstats->nr_flush_depot;
+            stats.nr_refill_slab += pstats->nr_refill_slab;
+            stats.nr_flush_slab += pstats->nr_flush_slab;
+        }
+
         pr_info("%s %lu size %lu full %lu free %lu partial %lu active objs %lu total obj size ~%lu "
                 "total slab size\n",
                 cache->name, cache->objsize, cache->nfullslabs, cache->nfreeslabs,
                 cache->npartialslabs, nactive, nactive * cache->objsize, total);
+        /* Every refill/flush is taken by a single alloc/free, everything else hit the magazine */
+        if (stats.nr_alloc || stats.nr_free)
+        {
+            pr_info("%s: alloc %lu (fast %lu%%, depot %lu, slow %lu) free %lu (fast %lu%%, depot "
+                    "%lu, slow %lu)\n",
+                    cache->name, stats.nr_alloc,
+                    kmem_fast_path_pct(stats.nr_alloc,
+                                       stats.nr_refill_depot + stats.nr_refill_slab),
+                    stats.nr_refill_depot, stats.nr_refill_slab, stats.nr_free,
+                    kmem_fast_path_pct(stats.nr_free, stats.nr_flush_depot + stats.nr_flush_slab),
+                    stats.nr_flush_depot, stats.nr_flush_slab);
+        }
         spin_unlock(&cache->lock);
     }
     mutex_unlock(&cache_list_lock);
@@ -9,17 +9,22 @@
 #include <stdio.h>
 
 #include <onyx/bio.h>
+#include <onyx/block/blk_plug.h>
 #include <onyx/buffer.h>
 #include <onyx/cpu.h>
 #include <onyx/err.h>
 #include <onyx/file.h>
 #include <onyx/filemap.h>
 #include <onyx/maple_tree.h>
+#include <onyx/mm/memcontrol.h>
 #include <onyx/mm/page_lru.h>
 #include <onyx/mm/slab.h>
+#include <onyx/mm/zswap.h>
 #include <onyx/namei.h>
 #include <onyx/pgtable.h>
 #include <onyx/rcupdate.h>
+#include <onyx/swap.h>
+#include <onyx/sysfs.h>
 #include <onyx/user.h>
 #include <onyx/vfs.h>
 #include <onyx/vm_fault.h>
@@ -76,8 +81,27 @@ struct swap_area
 
     u8 *swap_map;
     struct vm_object *swap_space;
+    /* Block group to start looking for free clusters in */
+    unsigned long cluster_next_bg;
 };
 
+/* Swap slots are handed out in clusters of SWAP_CLUSTER_SIZE contiguous slots, one cluster per
+ * CPU. Pages that get reclaimed together end up next to each other on disk, so their writes get
+ * merged into large IOs, and swap-in readahead reads them back with large IOs too. Clusters are
+ * just hints, and are not reserved: a slot in our cluster may still get taken by someone else. */
+#define SWAP_CLUSTER_SIZE 32
+
+struct swap_cluster
+{
+    struct spinlock lock;
+    unsigned int area;
+    /* Next slot to hand out, relative to the area's swap_off */
+    unsigned long next;
+    unsigned int nr_left;
+};
+
+static struct swap_cluster swap_clusters[CONFIG_SMP_NR_CPUS];
+
 static inline struct blockdev *blkdev_get_dev(struct file *f)
 {
     return (struct blockdev *) f->f_ino->i_helper;
@@ -139,8 +163,6 @@ bool swap_is_available(void)
     return READ_ONCE(swap_usage.counter) < total_swap;
 }
 
-#define MAX_SWAP_AREAS 16
-
 struct spinlock swap_areas_lock;
 static struct swap_area *swap_areas[MAX_SWAP_AREAS];
 struct vm_object *swap_spaces[MAX_SWAP_AREAS];
@@ -348,6 +370,8 @@ static int do_swapon(struct file *swapfile, int flags)
         goto out_err;
 
     pr_info("Installed swap area with %lukB, priority %d\n", nr_pages * PAGE_SIZE / 1024, prio);
+    if (zswap_swapon() < 0)
+        pr_warn("Failed to set up zswap, swapping straight to disk\n");
     return 0;
 out_err:
     swap_area_destroy_early(swp);
@@ -399,12 +423,25 @@ int sys_swapoff(const char *upath)
 #define SWAP_MAX_USAGE     0x7f
 #define SWAP_MAP_SWAPCACHE 0x80
 
+static void __swap_claim_slot(struct swap_area *sa, unsigned int area,
+                              struct swap_block_group *bg, u8 *map, struct page *page)
+{
+    unsigned long offset = (map - sa->swap_map) + sa->swap_off;
+
+    WARN_ON(bg->nr_free == 0);
+    *map = SWAP_MAP_SWAPCACHE;
+    page->priv = SWP_ENTRY((unsigned long) area, offset).swp;
+    WARN_ON(page_test_swap(page));
+    page_set_swap(page);
+    bg->nr_free--;
+    __swap_add_counter(1);
+}
+
 static int swap_alloc_from_block_group(struct swap_area *sa, int area, struct swap_block_group *bg,
-                                       unsigned long bgno, struct page *page)
+                                       struct page *page)
 {
     u8 *map;
     int err = -ENOSPC;
-    unsigned long offset;
     spin_lock(&bg->lock);
     /* Recheck bg->nr_free under the lock. We've checked it out of the lock using READ_ONCE before,
      * thus it's unlikely we're here unless we were reading stale data.
@@ -417,15 +454,8 @@ static int swap_alloc_from_block_group(struct swap_area *sa, int area, struct sw
     {
         if (!*map)
         {
-            WARN_ON(bg->nr_free == 0);
-            *map = SWAP_MAP_SWAPCACHE;
-            offset = (bgno * MAX_BLOCK_GROUP_SIZE) + map - bg->start + sa->swap_off;
-            page->priv = SWP_ENTRY((unsigned long) area, offset).swp;
-            WARN_ON(page_test_swap(page));
-            page_set_swap(page);
+            __swap_claim_slot(sa, area, bg, map, page);
             err = 0;
-            bg->nr_free--;
-            __swap_add_counter(1);
             break;
         }
 
@@ -445,7 +475,7 @@ static int swap_alloc_from_area(struct swap_area *swap, int area, struct page *p
         struct swap_block_group *bg = &swap->block_groups[i];
         if (!READ_ONCE(bg->nr_free))
             continue;
-        err = swap_alloc_from_block_group(swap, area, bg, i, page);
+        err = swap_alloc_from_block_group(swap, area, bg, page);
         if (!err)
             break;
     }
@@ -453,25 +483,145 @@ static int swap_alloc_from_area(struct swap_area *swap, int area, struct page *p
     return err;
 }
 
+static bool swap_cluster_free(const u8 *map)
+{
+    const u64 *words = (const u64 *) map;
+    for (unsigned int i = 0; i < SWAP_CLUSTER_SIZE / sizeof(u64); i++)
+    {
+        if (words[i])
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Find a new cluster for this CPU, and allocate its first slot
+ * Called with the cluster lock held.
+ *
+ * @param sa Swap area
+ * @param area Swap area's index
+ * @param cluster CPU's cluster
+ * @param page Page to allocate a slot for
+ * @return 0 on success, -ENOSPC if there are no free clusters left
+ */
+static int swap_alloc_new_cluster(struct swap_area *sa, unsigned int area,
+                                  struct swap_cluster *cluster, struct page *page)
+{
+    unsigned long start_bg = READ_ONCE(sa->cluster_next_bg) % sa->nr_block_groups;
+
+    for (unsigned long i = 0; i < sa->nr_block_groups; i++)
+    {
+        unsigned long bgno = (start_bg + i) % sa->nr_block_groups;
+        struct swap_block_group *bg = &sa->block_groups[bgno];
+        if (READ_ONCE(bg->nr_free) < SWAP_CLUSTER_SIZE)
+            continue;
+
+        spin_lock(&bg->lock);
+        for (u8 *map = bg->start; map + SWAP_CLUSTER_SIZE <= bg->end; map += SWAP_CLUSTER_SIZE)
+        {
+            if (!swap_cluster_free(map))
+                continue;
+            /* Claim the first slot under the lock, so the cluster doesn't look free to anyone
+             * else */
+            __swap_claim_slot(sa, area, bg, map, page);
+            spin_unlock(&bg->lock);
+
+            cluster->area = area;
+            cluster->next = map - sa->swap_map + 1;
+            cluster->nr_left = SWAP_CLUSTER_SIZE - 1;
+            WRITE_ONCE(sa->cluster_next_bg, bgno);
+            return 0;
+        }
+
+        spin_unlock(&bg->lock);
+    }
+
+    return -ENOSPC;
+}
+
+/**
+ * @brief Allocate a slot from this CPU's current cluster
+ * Called with the cluster lock held.
+ *
+ * @param cluster CPU's cluster
+ * @param page Page to allocate a slot for
+ * @return 0 on success, -ENOSPC if the cluster ran out
+ */
+static int swap_alloc_from_cluster(struct swap_cluster *cluster, struct page *page)
+{
+    struct swap_area *sa = swap_areas[cluster->area];
+
+    while (cluster->nr_left > 0)
+    {
+        unsigned long eff_off = cluster->next++;
+        struct swap_block_group *bg = &sa->block_groups[eff_off / MAX_BLOCK_GROUP_SIZE];
+        u8 *map = sa->swap_map + eff_off;
+        bool claimed = false;
+
+        cluster->nr_left--;
+        spin_lock(&bg->lock);
+        if (!*map)
+        {
+            __swap_claim_slot(sa, cluster->area, bg, map, page);
+            claimed = true;
+        }
+
+        spin_unlock(&bg->lock);
+        if (claimed)
+            return 0;
+    }
+
+    return -ENOSPC;
+}
+
 static int swap_allocate(struct page *page)
 {
     int err = -ENOSPC;
     struct swap_area *sa;
+    struct swap_cluster *cluster;
+
     rcu_read_lock();
-    for (unsigned int i = 0; i < MAX_SWAP_AREAS; i++)
+
+    /* Try this CPU's cluster first. We might get migrated away from this CPU after this, and it
+     * doesn't matter, the lock protects the cluster. */
+    cluster = &swap_clusters[get_cpu_nr()];
+    spin_lock(&cluster->lock);
+    err = swap_alloc_from_cluster(cluster, page);
+    for (unsigned int i = 0; err && i < MAX_SWAP_AREAS; i++)
     {
         sa = swap_areas[i];
-        if (!sa)
-            continue;
-        err = swap_alloc_from_area(sa, i, page);
-        if (!err)
-            break;
+        if (sa)
+            err = swap_alloc_new_cluster(sa, i, cluster, page);
     }
+
+    spin_unlock(&cluster->lock);
+
+    /* Swap is too fragmented for clusters, take any slot we can find */
+    for (unsigned int i = 0; err && i < MAX_SWAP_AREAS; i++)
+    {
+        sa = swap_areas[i];
+        if (sa)
+            err = swap_alloc_from_area(sa, i, page);
+    }
+
     rcu_read_unlock();
 
     return err;
 }
 
+/**
+ * @brief Free a swap slot whose map just dropped to 0
+ * Called with the block group's lock held.
+ *
+ * @param swp Swap entry
+ */
+static void __swap_slot_free(swp_entry_t swp)
+{
+    __swap_add_counter(-1);
+    zswap_invalidate(swp);
+}
+
 bool swap_put(swp_entry_t entry)
 {
     struct swap_area *sa = swap_areas[SWP_TYPE(entry)];
@@ -492,39 +642,79 @@ bool swap_put(swp_entry_t entry)
     {
         (*map)--;
         count--;
+        if (*map == 0)
+            __swap_slot_free(entry);
     }
 
     spin_unlock(&bg->lock);
     return count == 0;
 }
 
+/**
+ * @brief Pin a swap slot for zswap writeback
+ * Takes a reference on the slot if (and only if) entry is still zswap's copy of it, so the slot can't
+ * be freed and reused while we write it back. Drop the reference with swap_put.
+ *
+ * @param swp Swap entry
+ * @param entry zswap entry
+ * @return True if pinned, else false
+ */
+bool swap_zswap_pin(swp_entry_t swp, struct zswap_entry *entry)
+{
+    struct swap_area *sa = swap_areas[SWP_TYPE(swp)];
+    unsigned long eff_off = SWP_OFFSET(swp) - sa->swap_off;
+    struct swap_block_group *bg = &sa->block_groups[eff_off / MAX_BLOCK_GROUP_SIZE];
+    bool pinned = false;
+    u8 *map;
+
+    spin_lock(&bg->lock);
+    map = bg->start + (eff_off % MAX_BLOCK_GROUP_SIZE);
+    /* zswap entries get invalidated under this lock, when the slot is freed. As such, if the entry
+     * is still there, the slot is still allocated. */
+    if ((*map & SWAP_MAX_USAGE) != SWAP_MAX_USAGE && zswap_start_writeback(swp, entry))
+    {
+        *map = *map + 1;
+        pinned = true;
+    }
+
+    spin_unlock(&bg->lock);
+    return pinned;
+}
+
 static bool swap_put_page(struct page *page)
 {
     swp_entry_t entry = swpval_to_swp_entry(page->priv);
     return swap_put(entry);
 }
 
-static void swap_final_put(swp_entry_t swp)
+/**
+ * @brief Mark a swap slot as being in the swap cache
+ * Used when adding a page we're reading in to the swap cache. Fails if the slot has no users left
+ * (i.e the swap entry we got is stale).
+ *
+ * @param swp Swap entry
+ * @return 0 if we set the swap cache bit, 1 if it was already set, -ENOENT if the slot is unused
+ */
+static int swap_set_swapcache(swp_entry_t swp)
 {
     struct swap_area *sa = swap_areas[SWP_TYPE(swp)];
     unsigned long eff_off = SWP_OFFSET(swp) - sa->swap_off;
     struct swap_block_group *bg = &sa->block_groups[eff_off / MAX_BLOCK_GROUP_SIZE];
+    int ret = -ENOENT;
     u8 *map;
-    u8 count;
 
     spin_lock(&bg->lock);
-
     map = bg->start + (eff_off % MAX_BLOCK_GROUP_SIZE);
-    count = *map & ~SWAP_MAP_SWAPCACHE;
-    if (WARN_ON_ONCE(count > 0))
+    if (*map & SWAP_MAP_SWAPCACHE)
+        ret = 1;
+    else if (*map != 0)
     {
-        spin_unlock(&bg->lock);
-        return;
+        *map |= SWAP_MAP_SWAPCACHE;
+        ret = 0;
     }
 
-    __swap_add_counter(-1);
-    *map = 0;
     spin_unlock(&bg->lock);
+    return ret;
 }
 
 void swap_unset_swapcache(swp_entry_t swp)
@@ -538,10 +728,16 @@ void swap_unset_swapcache(swp_entry_t swp)
     spin_lock(&bg->lock);
 
     map = bg->start + (eff_off % MAX_BLOCK_GROUP_SIZE);
-    count = *map & ~SWAP_MAP_SWAPCACHE;
-    if (count == 0)
-        __swap_add_counter(-1);
-    *map = count;
+    /* Pages that never made it into the swap cache properly (see swap_read_from_storage) don't hold
+     * the bit. */
+    if (*map & SWAP_MAP_SWAPCACHE)
+    {
+        count = *map & ~SWAP_MAP_SWAPCACHE;
+        *map = count;
+        if (count == 0)
+            __swap_slot_free(swp);
+    }
+
     spin_unlock(&bg->lock);
 }
 
@@ -648,7 +844,17 @@ static ssize_t swap_writepage(struct vm_object *vm_obj, struct page *page, size_
 {
     int err;
     struct swap_area *sa = vm_obj->priv;
-    struct bio_req *bio = bio_alloc(GFP_NOIO, 1);
+    struct bio_req *bio;
+
+    /* Try to keep it compressed in memory first. This makes the page immediately reclaimable, and
+     * swapping it back in won't need IO. */
+    if (zswap_store(swpval_to_swp_entry(page->priv), page))
+    {
+        unlock_page(page);
+        return PAGE_SIZE;
+    }
+
+    bio = bio_alloc(GFP_NOIO, 1);
     if (!bio)
     {
         err = -ENOMEM;
@@ -679,12 +885,42 @@ err_unlock:
     return err;
 }
 
-static int swap_readpage(struct vm_object *obj, swp_entry_t swp, struct page *page) REQUIRES(page)
-    RELEASE(page)
+static void swap_readpage_end(struct bio_req *req) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct page *page = req->vec[0].page;
+    if (!(req->flags & (BIO_REQ_EIO | BIO_REQ_NOT_SUPP)))
+        page_set_uptodate(page);
+    unlock_page(page);
+}
+
+/**
+ * @brief Read a page in from swap
+ * Async reads unlock the page (and set it uptodate, if successful) when the IO completes.
+ *
+ * @param obj Swap space
+ * @param swp Swap entry
+ * @param page Page to read into (locked)
+ * @param sync True if we should wait for the IO
+ * @return 0 on success, negative error codes
+ */
+static int swap_readpage(struct vm_object *obj, swp_entry_t swp, struct page *page, bool sync)
+    REQUIRES(page) RELEASE(page)
 {
     int err;
     struct swap_area *sa = obj->priv;
-    struct bio_req *bio = bio_alloc(GFP_NOIO, 1);
+    struct bio_req *bio;
+
+    err = zswap_load(swp, page);
+    if (err != -ENOENT)
+    {
+        if (err < 0)
+            goto err_unlock;
+        page_set_uptodate(page);
+        unlock_page(page);
+        return 0;
+    }
+
+    bio = bio_alloc(GFP_NOIO, 1);
     if (!bio)
     {
         err = -ENOMEM;
@@ -695,6 +931,16 @@ static int swap_readpage(struct vm_object *obj, swp_entry_t swp, struct page *pa
     bio_push_pages(bio, page, 0, PAGE_SIZE);
     bio->flags = BIO_REQ_READ_OP;
 
+    if (!sync)
+    {
+        bio->b_end_io = swap_readpage_end;
+        err = bio_submit_request(sa->bdev, bio);
+        bio_put(bio);
+        if (err < 0)
+            goto err_unlock;
+        return 0;
+    }
+
     err = bio_submit_req_wait(sa->bdev, bio);
     bio_put(bio);
     if (err < 0)
@@ -708,6 +954,31 @@ err_unlock:
     return err;
 }
 
+/**
+ * @brief Write a page to its swap slot, synchronously
+ *
+ * @param swp Swap entry
+ * @param page Page to write
+ * @return 0 on success, negative error codes
+ */
+int swap_write_sync(swp_entry_t swp, struct page *page)
+{
+    struct swap_area *sa = swap_areas[SWP_TYPE(swp)];
+    struct bio_req *bio = bio_alloc(GFP_NOIO, 1);
+    int err;
+
+    if (!bio)
+        return -ENOMEM;
+
+    bio->sector_number = SWP_OFFSET(swp) * (PAGE_SIZE / bdev_sector_size(sa->bdev));
+    bio_push_pages(bio, page, 0, PAGE_SIZE);
+    bio->flags = BIO_REQ_WRITE_OP;
+
+    err = bio_submit_req_wait(sa->bdev, bio);
+    bio_put(bio);
+    return err;
+}
+
 static struct page *swap_cache_find(struct vm_object *obj, swp_entry_t swp)
 {
     struct page *p;
@@ -717,13 +988,27 @@ static struct page *swap_cache_find(struct vm_object *obj, swp_entry_t swp)
     return p;
 }
 
-static struct page *swap_read_from_storage(swp_entry_t swp, struct vm_object *obj, bool *created)
+/**
+ * @brief Allocate a page and add it to the swap cache, for reading swp in
+ *
+ * @param swp Swap entry
+ * @param obj Swap space
+ * @param created Set to true if the page was created (and needs to be read in)
+ * @return The new page (locked), the existing swap cache page (unlocked), or an ERR_PTR. -EAGAIN
+ * if the swap entry is stale.
+ */
+static struct page *swap_cache_alloc_page(swp_entry_t swp, struct vm_object *obj, bool *created)
 {
     struct page *page, *page2;
-    int err;
+    int cache_st;
     page = alloc_page(PAGE_ALLOC_NO_ZERO | GFP_KERNEL);
     if (!page)
         return ERR_PTR(-ENOMEM);
+    if (mem_cgroup_charge(page, GFP_KERNEL) < 0)
+    {
+        page_unref(page);
+        return ERR_PTR(-ENOMEM);
+    }
     /* Insert the page into the swap cache, _locked_. swap_cache_find callers should never observe
      * a locked, !UPTODATE page. Unless SIGBUS. */
     lock_page(page);
@@ -731,9 +1016,24 @@ static struct page *swap_read_from_storage(swp_entry_t swp, struct vm_object *ob
     page_set_swap(page);
     page->priv = swp.swp;
 
+    /* The swap cache holds the slot (through SWAP_MAP_SWAPCACHE), so it can't be freed and reused
+     * under the page, once the last pte drops its reference. If the slot is already unused, our
+     * swap entry is stale. */
+    cache_st = swap_set_swapcache(swp);
+    if (cache_st < 0)
+    {
+        unlock_page(page);
+        page_clear_swap(page);
+        page_unref(page);
+        page_unref(page);
+        return ERR_PTR(-EAGAIN);
+    }
+
     page2 = vmo_add_page_safe(SWP_OFFSET(swp) << PAGE_SHIFT, page, obj);
     if (page2 != page)
     {
+        if (!page2 && cache_st == 0)
+            swap_unset_swapcache(swp);
         unlock_page(page);
         page_clear_swap(page);
         if (!page2)
@@ -747,28 +1047,159 @@ static struct page *swap_read_from_storage(swp_entry_t swp, struct vm_object *ob
     *created = true;
     page_set_anon(page);
     page_add_lru(page);
+    return page;
+}
+
+static struct page *swap_read_from_storage(swp_entry_t swp, struct vm_object *obj, bool *created)
+{
+    struct page *page;
+    bool new_page = false;
+    int err;
+
+    page = swap_cache_alloc_page(swp, obj, &new_page);
+    if (IS_ERR(page) || !new_page)
+        return page;
 
+    *created = true;
     /* page locked. Read it in. */
-    err = swap_readpage(obj, swp, page);
+    err = swap_readpage(obj, swp, page, true);
     if (err < 0)
         return ERR_PTR(err);
     /* page unlocked */
     return page;
 }
 
+/* Swap-in readahead: when we fault on a swapped out page, we also read in the swapped out pages
+ * around it (in the same vma and page table). Swap clusters make it likely for these to be
+ * contiguous on disk, so it's mostly a matter of making the IO larger. Readahead pages are marked
+ * with PAGE_FLAG_READAHEAD until they get faulted on. */
+#define SWAP_RA_MAX_PAGES     32
+#define SWAP_RA_DEFAULT_PAGES 8
+
+static unsigned int swap_ra_pages = SWAP_RA_DEFAULT_PAGES;
+
+struct swap_ra_stats
+{
+    /* Pages read in by readahead */
+    unsigned long ra_pages;
+    /* Readahead pages we then faulted on */
+    unsigned long ra_hits;
+};
+
+static struct swap_ra_stats swap_ra_stats;
+
+static void swap_readahead_one(struct vm_area_struct *vma, unsigned long addr, swp_entry_t swp,
+                               bool fault_page) NO_THREAD_SAFETY_ANALYSIS
+{
+    struct vm_object *obj = swap_spaces[SWP_TYPE(swp)];
+    struct page *page;
+    bool created = false;
+
+    if (!obj)
+        return;
+
+    page = swap_cache_find(obj, swp);
+    if (page)
+    {
+        page_unref(page);
+        return;
+    }
+
+    page = swap_cache_alloc_page(swp, obj, &created);
+    if (IS_ERR(page))
+        return;
+    if (!created)
+    {
+        page_unref(page);
+        return;
+    }
+
+    /* Set up the rmap, so reclaim can deal with the page if we never end up mapping it */
+    page->pageoff = addr;
+    page->owner = (struct vm_object *) vma->anon_vma;
+    if (!fault_page)
+    {
+        page_set_flag(page, PAGE_FLAG_READAHEAD);
+        __atomic_add_fetch(&swap_ra_stats.ra_pages, 1, __ATOMIC_RELAXED);
+    }
+
+    /* The page gets unlocked when the IO completes. The swap cache holds a reference to it. */
+    swap_readpage(obj, swp, page, false);
+    page_unref(page);
+}
+
+/**
+ * @brief Start reading in the swapped out pages around a faulting address
+ *
+ * @param context Fault context
+ * @param fault_swp The faulting pte's swap entry
+ */
+static void swap_vma_readahead(struct vm_pf_context *context, swp_entry_t fault_swp)
+{
+    struct vm_area_struct *vma = context->entry;
+    unsigned long addr = context->vpage;
+    unsigned int nr = READ_ONCE(swap_ra_pages);
+    swp_entry_t entries[SWAP_RA_MAX_PAGES];
+    unsigned long start, end;
+    unsigned int nr_entries = 0;
+    struct spinlock *lock;
+    struct blk_plug plug;
+    pte_t *ptep;
+
+    if (nr <= 1 || !vma->anon_vma)
+        return;
+
+    /* Read in the naturally aligned window of nr pages around addr, bounded by the vma and the
+     * page table */
+    start = addr - ((addr >> PAGE_SHIFT) % nr) * PAGE_SIZE;
+    end = start + nr * PAGE_SIZE;
+    start = max(start, vma->vm_start);
+    start = max(start, addr & -PMD_SIZE);
+    end = min(end, vma->vm_end);
+    end = min(end, pmd_addr_end(addr));
+
+    ptep = ptep_get_locked(vma->vm_mm, addr, &lock);
+    if (!ptep)
+        return;
+
+    ptep -= (addr - start) >> PAGE_SHIFT;
+    for (unsigned long va = start; va < end; va += PAGE_SIZE, ptep++)
+    {
+        pte_t pte = *ptep;
+        if (pte_none(pte) || pte_present(pte) || pte_protnone(pte))
+            entries[nr_entries].swp = 0;
+        else
+            entries[nr_entries] = pte_to_swp_entry(pte);
+        nr_entries++;
+    }
+
+    spin_unlock(lock);
+
+    /* Plug, so the reads can get merged. Entries may have gone stale in the meanwhile, which the
+     * swap cache insertion checks for. */
+    blk_start_plug(&plug);
+    for (unsigned int i = 0; i < nr_entries; i++)
+    {
+        if (entries[i].swp)
+            swap_readahead_one(vma, start + i * PAGE_SIZE, entries[i],
+                               entries[i].swp == fault_swp.swp);
+    }
+
+    blk_end_plug(&plug);
+}
+
 static void swap_cache_remove(struct vm_object *obj, struct page *page)
 {
     DCHECK_PAGE(page_test_swap(page), page);
     DCHECK_PAGE(page_locked(page), page);
-    swp_entry_t entry = swpval_to_swp_entry(page->priv);
 
     /* We can only get here if refcount = 2 (ours and the swap cache's). As such would imply from
      * swap_map's ref == 0. If we fail to remove, someone holds a reference to it (probably
      * reclaim?). as such don't clear swap nor put final. */
     if (!vm_obj_remove_page(obj, page))
         return;
+    /* vm_obj_remove_page dropped the swap cache's hold on the slot, freeing it */
     page_clear_swap(page);
-    swap_final_put(entry);
 }
 
 static int do_protnone(swp_entry_t swp, struct vm_pf_context *context)
@@ -813,12 +1244,28 @@ int do_swap_page(struct vm_pf_context *context) NO_THREAD_SAFETY_ANALYSIS
     }
 
     page = swap_cache_find(obj, swp);
+    if (page)
+    {
+        if (page_test_clear_flag(page, PAGE_FLAG_READAHEAD))
+            __atomic_add_fetch(&swap_ra_stats.ra_hits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        /* Kick off readahead (which reads our page in as well, asynchronously), and wait for our
+         * page below. If that didn't work out, just read it in. */
+        swap_vma_readahead(context, swp);
+        page = swap_cache_find(obj, swp);
+    }
+
     if (!page)
     {
         page = swap_read_from_storage(swp, obj, &created_page);
         if (IS_ERR(page))
         {
             err = PTR_ERR(page);
+            /* Stale swap entry, the pte must have changed under us. Retry the fault. */
+            if (err == -EAGAIN)
+                return 0;
             goto err;
         }
     }
@@ -864,3 +1311,44 @@ err:
     context->info->signal = err == -EIO ? SIGBUS : SIGSEGV;
     return err;
 }
+
+ssize_t swap_ra_stats_read(void *buffer, size_t size, off_t off)
+{
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "window %u\nra_pages %lu\nra_hits %lu\n",
+                       READ_ONCE(swap_ra_pages), READ_ONCE(swap_ra_stats.ra_pages),
+                       READ_ONCE(swap_ra_stats.ra_hits));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t swap_ra_pages_read(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%u\n", READ_ONCE(swap_ra_pages));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t swap_ra_pages_write(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    unsigned int pages = 0;
+
+    if (size == 0 || size >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+    buf[size] = '\0';
+
+    for (size_t i = 0; i < size && buf[i] != '\n'; i++)
+    {
+        if (buf[i] < '0' || buf[i] > '9')
+            return -EINVAL;
+        pages = pages * 10 + (buf[i] - '0');
+        if (pages > SWAP_RA_MAX_PAGES)
+            return -EINVAL;
+    }
+
+    /* 0 and 1 disable readahead */
+    WRITE_ONCE(swap_ra_pages, pages);
+    return size;
+}
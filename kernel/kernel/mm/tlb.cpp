@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <onyx/cpu.h>
+#include <onyx/mm/tlb.h>
+#include <onyx/mm_address_space.h>
+#include <onyx/percpu.h>
+#include <onyx/scheduler.h>
+#include <onyx/vm.h>
+
+#include <onyx/utility.hpp>
+
+/**
+ * Commentary on TLB management:
+ * Every cpu keeps the TLB entries of its last TLB_NR_ASIDS address spaces around, tagged with
+ * their ASID (PCID on x86), so switching back to one of them doesn't flush the TLB. Since a cpu
+ * stops getting shootdowns for an address space once it switches away from it, every address space
+ * has a TLB generation (tlb_gen) that is incremented on every shootdown, and every cpu remembers
+ * the generation its TLB entries are up to date with. Switching back to an address space with a
+ * newer generation flushes its ASID.
+ *
+ * Kernel threads don't have user mappings, so they run on whatever address space was loaded
+ * before them (lazy TLB mode). The lazy cpu stays in the address space's active mask, and leaves
+ * it (by switching to kernel_address_space) on the first shootdown it gets, so it only gets one.
+ *
+ * Ordering: shootdowns change the page tables, increment tlb_gen and then look at the active
+ * mask. Switches set the cpu in the active mask and then look at tlb_gen. Either the shootdown
+ * sees us in the mask (and IPIs us), or we see its generation (and flush).
+ */
+
+struct tlb_asid
+{
+    u64 ctx_id;
+    u64 tlb_gen;
+};
+
+struct tlb_state
+{
+    struct mm_address_space *loaded_mm;
+    unsigned int loaded_asid;
+    unsigned int next_asid;
+    struct tlb_asid asids[TLB_NR_ASIDS];
+};
+
+static PER_CPU_VAR(struct tlb_state tlb_state);
+
+/* ctx_id 0 means no id was assigned yet */
+static u64 next_ctx_id = 1;
+
+static u64 tlb_mm_ctx_id(struct mm_address_space *mm)
+{
+    u64 id = READ_ONCE(mm->ctx_id);
+    if (id) [[likely]]
+        return id;
+
+    u64 expected = 0;
+    id = __atomic_fetch_add(&next_ctx_id, 1, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&mm->ctx_id, &expected, id, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+        id = expected;
+    return id;
+}
+
+/**
+ * @brief Pick an ASID for an address space
+ *
+ * @param state This cpu's TLB state
+ * @param mm Address space
+ * @param gen mm's current TLB generation
+ * @param flush Set to true if the ASID's TLB entries need flushing
+ * @return ASID slot
+ */
+static unsigned int tlb_choose_asid(struct tlb_state *state, struct mm_address_space *mm, u64 gen,
+                                    bool *flush)
+{
+    unsigned int nr_asids = cul::min(arch_nr_asids(), (unsigned int) TLB_NR_ASIDS);
+    u64 ctx_id = tlb_mm_ctx_id(mm);
+
+    for (unsigned int i = 0; i < nr_asids; i++)
+    {
+        if (state->asids[i].ctx_id != ctx_id)
+            continue;
+        *flush = state->asids[i].tlb_gen < gen;
+        state->asids[i].tlb_gen = gen;
+        return i;
+    }
+
+    /* Evict an ASID, round-robin */
+    unsigned int asid = state->next_asid++ % nr_asids;
+    state->asids[asid].ctx_id = ctx_id;
+    state->asids[asid].tlb_gen = gen;
+    *flush = true;
+    return asid;
+}
+
+void tlb_switch_mm(struct mm_address_space *next, unsigned int cpu)
+{
+    struct tlb_state *state = get_per_cpu_ptr(tlb_state);
+    struct mm_address_space *prev = state->loaded_mm;
+    bool flush;
+
+    /* Coming back from lazy TLB mode (or a kernel thread that switched to its own address space).
+     * We've been getting shootdowns all along. */
+    if (prev == next)
+        return;
+
+    next->active_mask.set_cpu_atomic(cpu);
+    /* Order the active mask store against the tlb_gen load, see the commentary at the top */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    u64 gen = READ_ONCE(next->tlb_gen);
+    unsigned int asid = tlb_choose_asid(state, next, gen, &flush);
+    arch_switch_mm(&next->arch_mmu, asid, flush);
+
+    state->loaded_mm = next;
+    state->loaded_asid = asid;
+
+    if (prev)
+        prev->active_mask.remove_cpu_atomic(cpu);
+}
+
+struct mm_address_space *tlb_loaded_mm(void)
+{
+    return get_per_cpu(tlb_state.loaded_mm);
+}
+
+u64 tlb_inc_gen(struct mm_address_space *mm)
+{
+    return __atomic_add_fetch(&mm->tlb_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool tlb_cpu_is_lazy(struct mm_address_space *mm)
+{
+    struct thread *curr = get_current_thread();
+    return !curr || curr->get_aspace() != mm;
+}
+
+void tlb_flush_mm_local(struct mm_address_space *mm, unsigned long addr, size_t pages, u64 gen)
+{
+    unsigned long flags = irq_save_and_disable();
+    struct tlb_state *state = get_per_cpu_ptr(tlb_state);
+
+    /* We switched away after the shootdown looked at the active mask. Whenever we switch back, the
+     * generation check takes care of it. */
+    if (state->loaded_mm != mm)
+        goto out;
+
+    if (mm != &kernel_address_space && tlb_cpu_is_lazy(mm))
+    {
+        /* We don't need these mappings. Leave the address space instead of flushing, so we stop
+         * getting shootdowns for it. */
+        tlb_switch_mm(&kernel_address_space, get_cpu_nr());
+        goto out;
+    }
+
+    {
+        struct tlb_asid *asid = &state->asids[state->loaded_asid];
+        u64 local_gen = asid->tlb_gen;
+        u64 mm_gen = READ_ONCE(mm->tlb_gen);
+
+        /* Already flushed by a later shootdown (or by the switch) */
+        if (gen <= local_gen)
+            goto out;
+
+        /* If we missed (or are yet to get) other shootdowns, we don't know their ranges. Flush it
+         * all and catch up to the latest generation. */
+        if (gen == local_gen + 1 && gen == mm_gen)
+            paging_invalidate((void *) addr, pages);
+        else
+        {
+            __native_tlb_invalidate_all();
+            gen = mm_gen;
+        }
+
+        asid->tlb_gen = gen;
+    }
+
+out:
+    irq_restore(flags);
+}
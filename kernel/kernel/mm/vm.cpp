@@ -22,12 +22,20 @@
 #include <onyx/err.h>
 #include <onyx/file.h>
 #include <onyx/filemap.h>
+#include <onyx/futex.h>
 #include <onyx/gen/trace_vm.h>
 #include <onyx/log.h>
+#include <onyx/mm/compaction.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/lru_gen.h>
+#include <onyx/mm/memcontrol.h>
+#include <onyx/mm/memfd.h>
+#include <onyx/mm/page_lru.h>
 #include <onyx/mm/shmem.h>
 #include <onyx/mm/slab.h>
+#include <onyx/mm/tlb.h>
 #include <onyx/mm/vm_object.h>
+#include <onyx/mm/zswap.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
 #include <onyx/paging.h>
@@ -36,6 +44,7 @@
 #include <onyx/pgtable.h>
 #include <onyx/process.h>
 #include <onyx/random.h>
+#include <onyx/readahead.h>
 #include <onyx/rmap.h>
 #include <onyx/spinlock.h>
 #include <onyx/swap.h>
@@ -901,6 +910,36 @@ out:
     return (void *) virt;
 }
 
+void vm_set_fault_around(void *addr)
+{
+    struct mm_address_space *mm = get_current_address_space();
+    scoped_mutex g{mm->vm_lock};
+
+    struct vm_area_struct *vma = vm_find_region(mm, addr);
+    if (vma && vma->vm_file)
+        vma->vm_flags |= VM_FAULTAROUND;
+}
+
+void vm_prefault(unsigned long start, unsigned long end, bool exec)
+{
+    for (unsigned long addr = start & -PAGE_SIZE; addr < end; addr += PAGE_SIZE)
+    {
+        /* Skip pages that were already mapped (e.g by fault-around) */
+        if (get_mapping_info((void *) addr) & PAGE_PRESENT)
+            continue;
+
+        struct fault_info info = {};
+        info.fault_address = addr;
+        info.ip = addr;
+        info.read = true;
+        info.exec = exec;
+        info.user = true;
+
+        if (vm_handle_page_fault(&info) < 0)
+            break;
+    }
+}
+
 void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t off)
 {
     int error = 0;
@@ -1165,7 +1204,7 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
             struct file *file = vma->vm_file;
             bool fd_has_write = fd_may_access(file, FILE_ACCESS_WRITE);
 
-            if (!fd_has_write)
+            if (!fd_has_write || memfd_write_sealed(file->f_ino))
             {
                 err = -EACCES;
                 goto out;
@@ -1441,13 +1480,7 @@ static int __vm_handle_pf(struct vm_area_struct *entry, struct fault_info *info)
     return 0;
 }
 
-/**
- * @brief Handles a page fault.
- *
- * @param info A pointer to a fault_info structure.
- * @return 0 on success or negative error codes.
- */
-int vm_handle_page_fault(struct fault_info *info)
+static int __vm_handle_page_fault(struct fault_info *info)
 {
     bool use_kernel_as = !info->user && is_higher_half((void *) info->fault_address);
     struct mm_address_space *as =
@@ -1514,6 +1547,23 @@ int vm_handle_page_fault(struct fault_info *info)
     return ret;
 }
 
+/**
+ * @brief Handles a page fault.
+ *
+ * @param info A pointer to a fault_info structure.
+ * @return 0 on success or negative error codes.
+ */
+int vm_handle_page_fault(struct fault_info *info)
+{
+    int ret = __vm_handle_page_fault(info);
+
+    /* We're about to go back to user space, and the vm_lock was dropped: throttle now if the fault
+     * charged pages over memory.high */
+    if (info->user)
+        mem_cgroup_handle_over_high();
+    return ret;
+}
+
 static void vm_destroy_area(vm_area_struct *region)
 {
     vm_mmu_unmap(region->vm_mm, (void *) region->vm_start, vma_pages(region), region);
@@ -1529,19 +1579,17 @@ static void vm_destroy_area(vm_area_struct *region)
 static void kick_mm_remote(void *ctx)
 {
     struct mm_address_space *mm = (struct mm_address_space *) ctx;
-    (void) mm;
-    struct mm_address_space *newmm = get_current_thread()->get_aspace();
-    if (!newmm)
-        newmm = &kernel_address_space;
-    /* TODO: We have no way of knowing if we're on a mm */
-    if (!get_current_thread()->owner)
-        vm_set_aspace(newmm);
+    /* Lazy cpus may still have the page tables loaded */
+    if (tlb_loaded_mm() == mm)
+        vm_load_aspace(&kernel_address_space, -1);
 }
 
 static void kick_mm(struct mm_address_space *mm)
 {
-    /* TODO: Ugh, broadcast */
-    smp::sync_call(kick_mm_remote, mm, cpumask::all_but_one(get_cpu_nr()));
+    /* Only cpus that have the address space loaded are in the active mask */
+    cpumask mask = mm->active_mask;
+    mask.remove_cpu(get_cpu_nr());
+    smp::sync_call_with_local(kick_mm_remote, mm, mask, kick_mm_remote, mm);
 }
 
 /**
@@ -1602,7 +1650,7 @@ void vm_switch_to_fallback_pgd()
 {
     assert(sched_is_preemption_disabled() == true);
 
-    vm_load_arch_mmu(&kernel_address_space.arch_mmu);
+    vm_load_aspace(&kernel_address_space, -1);
 }
 
 /**
@@ -1752,6 +1800,28 @@ static struct sysfs_object vm_obj;
 static struct sysfs_object aslr_control;
 static struct sysfs_object kmaps;
 static struct sysfs_object evict_obj;
+static struct sysfs_object readahead_obj;
+static struct sysfs_object readahead_files_obj;
+static struct sysfs_object swap_ra_obj;
+static struct sysfs_object swap_ra_pages_obj;
+#ifdef CONFIG_ZSWAP
+static struct sysfs_object zswap_obj;
+static struct sysfs_object zswap_max_pool_obj;
+#endif
+static struct sysfs_object lru_stats_obj;
+static struct sysfs_object lru_batch_obj;
+static struct sysfs_object slabinfo_obj;
+static struct sysfs_object slab_defrag_obj;
+static struct sysfs_object frag_index_obj;
+#ifdef CONFIG_COMPACTION
+static struct sysfs_object compact_memory_obj;
+#endif
+#ifdef CONFIG_LRU_GEN
+static struct sysfs_object lru_gen_obj;
+static struct sysfs_object lru_gen_enabled_obj;
+static struct sysfs_object lru_gen_walk_mm_obj;
+static struct sysfs_object lru_gen_stats_obj;
+#endif
 
 /**
  * @brief Initialises sysfs nodes for the vm subsystem.
@@ -1777,6 +1847,81 @@ void vm_sysfs_init(void)
     evict_obj.write = evict_write;
     evict_obj.perms = 0644 | S_IFREG;
 
+    assert(sysfs_init_and_add("readahead", &readahead_obj, &vm_obj) == 0);
+    readahead_obj.read = readahead_stats_read;
+    readahead_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("readahead_files", &readahead_files_obj, &vm_obj) == 0);
+    readahead_files_obj.read = readahead_files_read;
+    readahead_files_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("swap_readahead", &swap_ra_obj, &vm_obj) == 0);
+    swap_ra_obj.read = swap_ra_stats_read;
+    swap_ra_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("swap_readahead_pages", &swap_ra_pages_obj, &vm_obj) == 0);
+    swap_ra_pages_obj.read = swap_ra_pages_read;
+    swap_ra_pages_obj.write = swap_ra_pages_write;
+    swap_ra_pages_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("lru_stats", &lru_stats_obj, &vm_obj) == 0);
+    lru_stats_obj.read = page_lru_stats_read;
+    lru_stats_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("lru_batch_pages", &lru_batch_obj, &vm_obj) == 0);
+    lru_batch_obj.read = page_lru_batch_read;
+    lru_batch_obj.write = page_lru_batch_write;
+    lru_batch_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("slabinfo", &slabinfo_obj, &vm_obj) == 0);
+    slabinfo_obj.read = kmem_slabinfo_read;
+    slabinfo_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("slab_defrag", &slab_defrag_obj, &vm_obj) == 0);
+    slab_defrag_obj.write = kmem_defrag_write;
+    slab_defrag_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("fragmentation_index", &frag_index_obj, &vm_obj) == 0);
+    frag_index_obj.read = page_fragmentation_index_read;
+    frag_index_obj.perms = 0444 | S_IFREG;
+
+#ifdef CONFIG_COMPACTION
+    assert(sysfs_init_and_add("compact_memory", &compact_memory_obj, &vm_obj) == 0);
+    compact_memory_obj.read = compact_memory_read;
+    compact_memory_obj.write = compact_memory_write;
+    compact_memory_obj.perms = 0644 | S_IFREG;
+#endif
+
+#ifdef CONFIG_ZSWAP
+    assert(sysfs_init_and_add("zswap", &zswap_obj, &vm_obj) == 0);
+    zswap_obj.read = zswap_stats_read;
+    zswap_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("zswap_max_pool_percent", &zswap_max_pool_obj, &vm_obj) == 0);
+    zswap_max_pool_obj.read = zswap_max_pool_read;
+    zswap_max_pool_obj.write = zswap_max_pool_write;
+    zswap_max_pool_obj.perms = 0644 | S_IFREG;
+#endif
+
+#ifdef CONFIG_LRU_GEN
+    assert(sysfs_init_and_add("lru_gen", &lru_gen_obj, &vm_obj) == 0);
+    lru_gen_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("enabled", &lru_gen_enabled_obj, &lru_gen_obj) == 0);
+    lru_gen_enabled_obj.read = lru_gen_enabled_read;
+    lru_gen_enabled_obj.write = lru_gen_enabled_write;
+    lru_gen_enabled_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("walk_mm", &lru_gen_walk_mm_obj, &lru_gen_obj) == 0);
+    lru_gen_walk_mm_obj.read = lru_gen_walk_mm_read;
+    lru_gen_walk_mm_obj.write = lru_gen_walk_mm_write;
+    lru_gen_walk_mm_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("stats", &lru_gen_stats_obj, &lru_gen_obj) == 0);
+    lru_gen_stats_obj.read = lru_gen_stats_read;
+    lru_gen_stats_obj.perms = 0444 | S_IFREG;
+#endif
+
     sysfs_add(&vm_obj, nullptr);
 }
 
@@ -1804,6 +1949,40 @@ char *strcpy_from_user(const char *uptr)
     return buf;
 }
 
+int copy_struct_from_user(void *dst, size_t ksize, const void *src, size_t usize)
+{
+    size_t size = cul::min(ksize, usize);
+
+    if (usize < ksize)
+        memset((u8 *) dst + usize, 0, ksize - usize);
+    else if (usize > ksize)
+    {
+        /* Newer userspace, check that it's not using anything we don't know about */
+        const u8 *rest = (const u8 *) src + ksize;
+        u8 buf[64];
+
+        for (size_t left = usize - ksize; left > 0;)
+        {
+            size_t len = cul::min(left, sizeof(buf));
+            if (copy_from_user(buf, rest, len) < 0)
+                return -EFAULT;
+
+            for (size_t i = 0; i < len; i++)
+            {
+                if (buf[i] != 0)
+                    return -E2BIG;
+            }
+
+            rest += len;
+            left -= len;
+        }
+    }
+
+    if (copy_from_user(dst, src, size) < 0)
+        return -EFAULT;
+    return 0;
+}
+
 /**
  * @brief Updates the memory map's ranges.
  * Used in arch dependent early boot procedures when architectures
@@ -1922,7 +2101,18 @@ int vma_setup_backing(struct vm_area_struct *region, size_t pages, bool is_file_
 
     if (vmo)
     {
-        vmo_assign_mapping(vmo, region);
+        scoped_lock g{vmo->mapping_lock};
+
+        /* Sealed memfds can't get new writable shared mappings. This is checked under the
+         * mapping_lock, as F_SEAL_WRITE looks for writable mappings under it. */
+        if (is_shared && region->vm_flags & VM_WRITE && memfd_write_sealed(vmo->ino))
+        {
+            g.unlock();
+            vmo_unref(vmo);
+            return -EPERM;
+        }
+
+        vmo_assign_mapping_locked(vmo, region);
         assert(region->vm_obj == nullptr);
         region->vm_obj = vmo;
     }
@@ -2582,6 +2772,7 @@ expected<ref_guard<mm_address_space>, int> mm_address_space::create()
     int st = vm_clone_as(as.get());
     if (st < 0)
         return unexpected<int>{st};
+    lru_gen_add_mm(as.get());
     return as;
 }
 
@@ -2602,6 +2793,7 @@ expected<ref_guard<mm_address_space>, int> mm_address_space::fork()
     int st = vm_fork_address_space(as.get());
     if (st < 0)
         return unexpected<int>{st};
+    lru_gen_add_mm(as.get());
     return as;
 }
 
@@ -2613,10 +2805,11 @@ expected<ref_guard<mm_address_space>, int> mm_address_space::fork()
  */
 void vm_load_aspace(mm_address_space *aspace, unsigned int cpu)
 {
-    vm_load_arch_mmu(&aspace->arch_mmu);
+    unsigned long flags = irq_save_and_disable();
     if (cpu == -1U) [[unlikely]]
         cpu = get_cpu_nr();
-    aspace->active_mask.set_cpu_atomic(cpu);
+    tlb_switch_mm(aspace, cpu);
+    irq_restore(flags);
 }
 
 /**
@@ -2646,7 +2839,9 @@ mm_address_space *vm_set_aspace(mm_address_space *aspace)
  */
 mm_address_space::~mm_address_space()
 {
+    lru_gen_del_mm(this);
     vm_destroy_addr_space(this);
+    futex_hash_free(futex_hash);
 }
 
 unsigned long get_mapping_info(void *addr)
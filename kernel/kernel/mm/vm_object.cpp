@@ -284,7 +284,10 @@ static int vmo_purge_pages(unsigned long start, unsigned long end,
              * reference */
             page_unref(old_p);
             dec_page_stat(old_p, NR_FILE);
-            page_remove_lru(old_p);
+            /* The page might still be sitting in a per-cpu LRU batch (which holds a reference,
+             * and will free it when drained) */
+            if (page_flag_set(old_p, PAGE_FLAG_LRU))
+                page_remove_lru(old_p);
             if (!vmo->ops->free_page)
                 free_page(old_p);
             else
@@ -576,6 +579,26 @@ out:
     return ret;
 }
 
+bool vm_obj_replace_page(struct vm_object *obj, struct page *page, struct page *newpage)
+{
+    bool ret = false;
+    DCHECK_PAGE(page_locked(page), page);
+    DCHECK_PAGE(page_vmobj(page) == obj, page);
+
+    spin_lock(&obj->page_lock);
+    /* Same logic as vm_obj_remove_page: nobody else can be holding a reference to the page. The
+     * marks are per-index, so they stay with the new page. */
+    unsigned int expected_refs = 2 + (page_mapcount(page) > 0);
+    if (__atomic_load_n(&page->ref, __ATOMIC_RELAXED) > expected_refs)
+        goto out;
+
+    obj->vm_pages.store(page_pgoff(page), (unsigned long) newpage);
+    ret = true;
+out:
+    spin_unlock(&obj->page_lock);
+    return ret;
+}
+
 long vm_obj_get_page_references(struct vm_object *obj, struct page *page, unsigned int *vm_flags)
 {
     scoped_lock g{obj->mapping_lock};
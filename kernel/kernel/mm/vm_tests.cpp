@@ -6,7 +6,11 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <onyx/cpu.h>
 #include <onyx/kunit.h>
+#include <onyx/mm/page_lru.h>
+#include <onyx/page.h>
+#include <onyx/scheduler.h>
 #include <onyx/vm.h>
 
 // Internal vm.cpp interfaces
@@ -76,3 +80,91 @@ TEST(mmap, test_48_57_bit)
 
 #endif
 #endif
+
+static bool page_on_lru(struct page *page)
+{
+    return page_flag_set(page, PAGE_FLAG_LRU);
+}
+
+static void page_lru_test_remove(struct page *page)
+{
+    bool active;
+    /* Reclaim may have the page isolated for a bit (it's locked, so it rotates it back) */
+    while (!page_lru_isolate(page, &active))
+        cpu_relax();
+    page_unref(page);
+}
+
+TEST(page_lru, batch_drains_when_full)
+{
+    struct page *pages[PAGE_LRU_BATCH];
+    unsigned int on_lru_early = 0;
+    bool all_on_lru = true;
+
+    for (auto &page : pages)
+    {
+        page = alloc_page(GFP_KERNEL);
+        ASSERT_NONNULL(page);
+        /* Keep reclaim's hands off the page once it's on the LRU */
+        lock_page(page);
+    }
+
+    /* Stay on this cpu, so every page goes into the same batch. Start with an empty one. */
+    sched_disable_preempt();
+    page_lru_drain_all();
+
+    for (unsigned int i = 0; i < PAGE_LRU_BATCH - 1; i++)
+        page_add_lru(pages[i]);
+
+    for (unsigned int i = 0; i < PAGE_LRU_BATCH - 1; i++)
+    {
+        if (page_on_lru(pages[i]))
+            on_lru_early++;
+    }
+
+    /* The last one fills the batch, which adds every page to the LRU */
+    page_add_lru(pages[PAGE_LRU_BATCH - 1]);
+    sched_enable_preempt();
+
+    for (auto page : pages)
+    {
+        if (!page_on_lru(page))
+            all_on_lru = false;
+    }
+
+    EXPECT_EQ(on_lru_early, 0U);
+    EXPECT_TRUE(all_on_lru);
+
+    for (auto page : pages)
+    {
+        page_lru_test_remove(page);
+        /* The batch's reference must have been dropped */
+        EXPECT_EQ(page->ref, 1U);
+        unlock_page(page);
+        free_page(page);
+    }
+}
+
+TEST(page_lru, drain_all_flushes_pcpu_batches)
+{
+    struct page *page = alloc_page(GFP_KERNEL);
+    ASSERT_NONNULL(page);
+    lock_page(page);
+
+    sched_disable_preempt();
+    page_lru_drain_all();
+    page_add_lru(page);
+    bool batched = !page_on_lru(page) && page->ref == 2;
+    sched_enable_preempt();
+
+    /* We may have migrated to a different cpu by now, drain_all must still find it */
+    page_lru_drain_all();
+
+    EXPECT_TRUE(batched);
+    EXPECT_TRUE(page_on_lru(page));
+
+    page_lru_test_remove(page);
+    EXPECT_EQ(page->ref, 1U);
+    unlock_page(page);
+    free_page(page);
+}
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+
+#include <onyx/list.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/zsmalloc.h>
+#include <onyx/page.h>
+#include <onyx/spinlock.h>
+#include <onyx/vm.h>
+
+/**
+ * Commentary on the allocator's design:
+ * zsmalloc packs (compressed) objects of arbitrary size tightly into memory. Objects are grouped
+ * into size classes, ZS_CLASS_DELTA bytes apart. Each class carves zspages (1 to
+ * 2^ZS_MAX_ZSPAGE_ORDER physically contiguous pages) into equally sized slots. Every class picks
+ * the zspage order that wastes the least memory for its size, so a 1200 byte object takes up
+ * ~1200 bytes, instead of a whole page. Objects may straddle page boundaries inside a zspage.
+ *
+ * zspages always live in the direct map, so handles are simply pointers to the object, and mapping
+ * an object is free. struct page's priv points back to the zspage for every page in it.
+ *
+ * Unlike the slab allocator, zspages get freed as soon as they become empty. Compressed data tends
+ * to come and go in big waves (swap in, swap out), and we'd rather give memory back to the system.
+ */
+
+#define ZS_MIN_ALLOC_SIZE   32
+#define ZS_CLASS_DELTA      32
+#define ZS_NR_CLASSES       ((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / ZS_CLASS_DELTA + 1)
+#define ZS_MAX_ZSPAGE_ORDER 2
+
+#define ZS_FREELIST_END (~0U)
+
+struct zs_size_class
+{
+    struct spinlock lock;
+    unsigned int size;
+    unsigned int order;
+    /* zspages with at least one free slot */
+    struct list_head partial;
+    struct list_head full;
+    unsigned long nr_zspages;
+    unsigned long objs_inuse;
+};
+
+struct zs_pool
+{
+    const char *name;
+    unsigned long nr_pages;
+    struct zs_size_class classes[ZS_NR_CLASSES];
+};
+
+struct zspage
+{
+    struct list_head list;
+    struct zs_size_class *class;
+    struct page *pages;
+    unsigned int order;
+    unsigned int nr_objs;
+    unsigned int inuse;
+    /* Index of the first free slot. Free slots store the index of the next one. */
+    unsigned int freelist;
+};
+
+static unsigned int zs_size_to_class(size_t size)
+{
+    if (size <= ZS_MIN_ALLOC_SIZE)
+        return 0;
+    return (size - ZS_MIN_ALLOC_SIZE + ZS_CLASS_DELTA - 1) / ZS_CLASS_DELTA;
+}
+
+/**
+ * @brief Pick the zspage order for a size class
+ * We pick the order with the best usage, preferring smaller orders on ties.
+ *
+ * @param size Object size
+ * @return zspage order
+ */
+static unsigned int zs_pick_order(unsigned int size)
+{
+    unsigned int best = 0;
+    unsigned long best_usage = 0;
+
+    for (unsigned int order = 0; order <= ZS_MAX_ZSPAGE_ORDER; order++)
+    {
+        unsigned long bytes = PAGE_SIZE << order;
+        unsigned long usage = ((bytes / size) * size * 100) / bytes;
+        if (usage > best_usage)
+        {
+            best = order;
+            best_usage = usage;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Create a zsmalloc pool
+ *
+ * @param name Name of the pool
+ * @return The new pool, or NULL
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+    struct zs_pool *pool = kmalloc(sizeof(struct zs_pool), GFP_KERNEL);
+    if (!pool)
+        return NULL;
+
+    pool->name = name;
+    pool->nr_pages = 0;
+
+    for (unsigned int i = 0; i < ZS_NR_CLASSES; i++)
+    {
+        struct zs_size_class *class = &pool->classes[i];
+        spinlock_init(&class->lock);
+        class->size = ZS_MIN_ALLOC_SIZE + i * ZS_CLASS_DELTA;
+        class->order = zs_pick_order(class->size);
+        INIT_LIST_HEAD(&class->partial);
+        INIT_LIST_HEAD(&class->full);
+        class->nr_zspages = 0;
+        class->objs_inuse = 0;
+    }
+
+    return pool;
+}
+
+/**
+ * @brief Destroy a zsmalloc pool
+ * Every object must have been freed before this.
+ *
+ * @param pool Pool to destroy
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+    for (unsigned int i = 0; i < ZS_NR_CLASSES; i++)
+    {
+        if (WARN_ON(pool->classes[i].nr_zspages))
+        {
+            pr_err("zsmalloc: pool %s destroyed with live objects, leaking it\n", pool->name);
+            return;
+        }
+    }
+
+    kfree(pool);
+}
+
+static void *zspage_base(struct zspage *zspage)
+{
+    return PAGE_TO_VIRT(zspage->pages);
+}
+
+static struct zspage *zs_create_zspage(struct zs_pool *pool, struct zs_size_class *class,
+                                       unsigned int gfp)
+{
+    struct zspage *zspage = kmalloc(sizeof(struct zspage), gfp);
+    unsigned int order = class->order;
+    struct page *pages;
+
+    if (!zspage)
+        return NULL;
+
+    pages = alloc_pages(order, gfp | PAGE_ALLOC_NO_ZERO | PAGE_ALLOC_CONTIGUOUS);
+    if (!pages && order > 0)
+    {
+        /* Memory is probably tight and fragmented. Settle for a single page. */
+        order = 0;
+        pages = alloc_pages(0, gfp | PAGE_ALLOC_NO_ZERO);
+    }
+
+    if (!pages)
+    {
+        kfree(zspage);
+        return NULL;
+    }
+
+    zspage->class = class;
+    zspage->pages = pages;
+    zspage->order = order;
+    zspage->nr_objs = (PAGE_SIZE << order) / class->size;
+    zspage->inuse = 0;
+    zspage->freelist = 0;
+
+    for (unsigned long i = 0; i < (1UL << order); i++)
+        pages[i].priv = (unsigned long) zspage;
+
+    char *base = zspage_base(zspage);
+    for (unsigned int i = 0; i < zspage->nr_objs; i++)
+    {
+        unsigned int *slot = (unsigned int *) (base + i * class->size);
+        *slot = i + 1 == zspage->nr_objs ? ZS_FREELIST_END : i + 1;
+    }
+
+    __atomic_add_fetch(&pool->nr_pages, 1UL << order, __ATOMIC_RELAXED);
+    return zspage;
+}
+
+static void zs_free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+    unsigned long nr_pages = 1UL << zspage->order;
+
+    for (unsigned long i = 0; i < nr_pages; i++)
+        zspage->pages[i].priv = 0;
+    free_pages(zspage->pages);
+    kfree(zspage);
+    __atomic_sub_fetch(&pool->nr_pages, nr_pages, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Allocate an object from a pool
+ *
+ * @param pool Pool to allocate from
+ * @param size Size of the object, up to ZS_MAX_ALLOC_SIZE
+ * @param gfp GFP flags, for when the pool needs to grow
+ * @return Handle to the object, or 0
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, unsigned int gfp)
+{
+    struct zs_size_class *class;
+    struct zspage *zspage;
+    unsigned int index;
+
+    if (size == 0 || size > ZS_MAX_ALLOC_SIZE)
+        return 0;
+
+    class = &pool->classes[zs_size_to_class(size)];
+    spin_lock(&class->lock);
+
+    if (list_is_empty(&class->partial))
+    {
+        /* Allocate a new zspage without the lock held, this might sleep */
+        spin_unlock(&class->lock);
+        zspage = zs_create_zspage(pool, class, gfp);
+        if (!zspage)
+            return 0;
+        spin_lock(&class->lock);
+        list_add(&zspage->list, &class->partial);
+        class->nr_zspages++;
+    }
+
+    zspage = list_first_entry(&class->partial, struct zspage, list);
+    DCHECK(zspage->freelist != ZS_FREELIST_END);
+
+    index = zspage->freelist;
+    char *obj = (char *) zspage_base(zspage) + index * class->size;
+    zspage->freelist = *(unsigned int *) obj;
+
+    if (++zspage->inuse == zspage->nr_objs)
+    {
+        list_remove(&zspage->list);
+        list_add_tail(&zspage->list, &class->full);
+    }
+
+    class->objs_inuse++;
+    spin_unlock(&class->lock);
+    return (unsigned long) obj;
+}
+
+static struct zspage *zs_handle_to_zspage(unsigned long handle)
+{
+    struct page *page = phys_to_page(handle - PHYS_BASE);
+    struct zspage *zspage = (struct zspage *) page->priv;
+    CHECK_PAGE(zspage != NULL, page);
+    return zspage;
+}
+
+/**
+ * @brief Free an object
+ *
+ * @param pool Pool the object belongs to
+ * @param handle Handle to the object, as returned by zs_malloc
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+    struct zspage *zspage = zs_handle_to_zspage(handle);
+    struct zs_size_class *class = zspage->class;
+    char *base = zspage_base(zspage);
+    unsigned int index = (handle - (unsigned long) base) / class->size;
+    bool free_zspage = false;
+
+    DCHECK((handle - (unsigned long) base) % class->size == 0);
+
+    spin_lock(&class->lock);
+    *(unsigned int *) handle = zspage->freelist;
+    zspage->freelist = index;
+
+    if (zspage->inuse-- == zspage->nr_objs)
+    {
+        /* Was full, now partial */
+        list_remove(&zspage->list);
+        list_add(&zspage->list, &class->partial);
+    }
+
+    if (zspage->inuse == 0)
+    {
+        list_remove(&zspage->list);
+        class->nr_zspages--;
+        free_zspage = true;
+    }
+
+    class->objs_inuse--;
+    spin_unlock(&class->lock);
+
+    if (free_zspage)
+        zs_free_zspage(pool, zspage);
+}
+
+/**
+ * @brief Get a pointer to an object
+ * The pointer stays valid until the object is freed.
+ *
+ * @param pool Pool the object belongs to
+ * @param handle Handle to the object
+ * @return Pointer to the object's memory
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle)
+{
+    /* zspages are always mapped (and contiguous) in the direct map */
+    return (void *) handle;
+}
+
+/**
+ * @brief Get a pool's usage statistics
+ *
+ * @param pool Pool
+ * @param stats Stats to fill
+ */
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+    stats->pages = READ_ONCE(pool->nr_pages);
+    stats->objects = 0;
+    stats->bytes = 0;
+
+    for (unsigned int i = 0; i < ZS_NR_CLASSES; i++)
+    {
+        struct zs_size_class *class = &pool->classes[i];
+        unsigned long inuse = READ_ONCE(class->objs_inuse);
+        stats->objects += inuse;
+        stats->bytes += inuse * class->size;
+    }
+}
+
+/**
+ * @brief Get the number of pages backing a pool
+ *
+ * @param pool Pool
+ * @return Number of pages
+ */
+unsigned long zs_get_total_pages(struct zs_pool *pool)
+{
+    return READ_ONCE(pool->nr_pages);
+}
@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#define pr_fmt(fmt) "zswap: " fmt
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/compression.h>
+#include <onyx/cpu.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mm/zsmalloc.h>
+#include <onyx/mm/zswap.h>
+#include <onyx/mutex.h>
+#include <onyx/radix.h>
+#include <onyx/scheduler.h>
+#include <onyx/swap.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/wait.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/memstat.h>
+
+/* zswap: a compressed, in-memory cache in front of the swap areas. Pages that get swapped out are
+ * compressed (zstd) into a zsmalloc pool instead of being written to disk. Swap-ins that hit zswap
+ * get decompressed, which is a whole lot faster than a disk read.
+ *
+ * The pool is capped at zswap_max_pool_percent of memory. Once it fills up, stores get rejected
+ * (and go to disk) while zswapd writes back the oldest entries to the swap area, until the pool is
+ * under ZSWAP_ACCEPT_PERCENT of the cap.
+ *
+ * Entries are indexed by swap offset, in a radix tree per swap area. They are refcounted: the tree
+ * holds a reference, and so does anyone loading from or writing back the entry. Entries are dropped
+ * when their swap slot gets freed (under the swap map lock), or when a new version of the page is
+ * stored. Lock ordering is swap map lock -> tree lock -> lru lock.
+ */
+
+#define ZSWAP_COMPRESSION_LEVEL        1
+#define ZSWAP_DEFAULT_MAX_POOL_PERCENT 20
+/* Once full, start accepting pages again when the pool is under this (percentage of the max) */
+#define ZSWAP_ACCEPT_PERCENT           90
+#define ZSWAP_WB_MAX_FAILURES          16
+
+struct zswap_entry
+{
+    swp_entry_t swp;
+    unsigned long refs;
+    /* zsmalloc handle, or 0 if the page is same-filled */
+    unsigned long handle;
+    unsigned long value;
+    unsigned int length;
+    u32 writeback;
+    bool on_lru;
+    struct list_head lru_node;
+};
+
+struct zswap_tree
+{
+    struct spinlock lock;
+    radix_tree entries;
+};
+
+struct zswap_pcpu
+{
+    struct mutex lock;
+    compression::context *ctx;
+    u8 *buffer;
+};
+
+static struct zswap_stats
+{
+    unsigned long stored_pages;
+    unsigned long same_filled_pages;
+    unsigned long compressed_bytes;
+    unsigned long stores;
+    unsigned long loads;
+    unsigned long written_back;
+    unsigned long reject_pool_full;
+    unsigned long reject_poor_compression;
+    unsigned long reject_alloc_fail;
+} zswap_stats;
+
+#define zswap_stat_add(stat, val) __atomic_add_fetch(&zswap_stats.stat, (val), __ATOMIC_RELAXED)
+#define zswap_stat_inc(stat)      zswap_stat_add(stat, 1)
+#define zswap_stat_dec(stat)      __atomic_sub_fetch(&zswap_stats.stat, 1, __ATOMIC_RELAXED)
+
+static bool zswap_enabled;
+static bool zswap_pool_full;
+static unsigned int zswap_max_pool_percent = ZSWAP_DEFAULT_MAX_POOL_PERCENT;
+static unsigned long zswap_total_pages;
+
+static struct zs_pool *zswap_pool;
+static struct slab_cache *zswap_entry_cache;
+static struct zswap_tree zswap_trees[MAX_SWAP_AREAS];
+static struct zswap_pcpu zswap_pcpu[CONFIG_SMP_NR_CPUS];
+static DECLARE_MUTEX(zswap_init_lock);
+
+static struct spinlock zswap_lru_lock;
+static struct list_head zswap_lru = LIST_HEAD_INIT(zswap_lru);
+
+static struct wait_queue zswap_wb_wq;
+static bool zswap_wb_pending;
+
+static unsigned long zswap_max_pages()
+{
+    return READ_ONCE(zswap_total_pages) * READ_ONCE(zswap_max_pool_percent) / 100;
+}
+
+static unsigned long zswap_accept_pages()
+{
+    return zswap_max_pages() * ZSWAP_ACCEPT_PERCENT / 100;
+}
+
+static void zswap_kick_writeback()
+{
+    if (READ_ONCE(zswap_wb_pending))
+        return;
+    WRITE_ONCE(zswap_wb_pending, true);
+    wait_queue_wake_all(&zswap_wb_wq);
+}
+
+static bool zswap_is_full()
+{
+    unsigned long pages = zs_get_total_pages(zswap_pool);
+
+    if (READ_ONCE(zswap_pool_full))
+    {
+        /* Hysteresis: don't go back and forth between full and not full on every store */
+        if (pages > zswap_accept_pages())
+        {
+            zswap_kick_writeback();
+            return true;
+        }
+
+        WRITE_ONCE(zswap_pool_full, false);
+        return false;
+    }
+
+    if (pages >= zswap_max_pages())
+    {
+        WRITE_ONCE(zswap_pool_full, true);
+        zswap_kick_writeback();
+        return true;
+    }
+
+    return false;
+}
+
+static struct zswap_tree *zswap_tree_for(swp_entry_t swp)
+{
+    return &zswap_trees[SWP_TYPE(swp)];
+}
+
+static struct zswap_entry *__zswap_lookup(struct zswap_tree *tree, swp_entry_t swp)
+    REQUIRES(tree->lock)
+{
+    auto ex = tree->entries.get(SWP_OFFSET(swp));
+    if (ex.has_error())
+        return nullptr;
+    return (struct zswap_entry *) ex.value();
+}
+
+static void zswap_entry_get(struct zswap_entry *entry)
+{
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_ACQUIRE);
+}
+
+static void zswap_entry_put(struct zswap_entry *entry)
+{
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_RELEASE) != 0)
+        return;
+
+    DCHECK(!entry->on_lru);
+    if (entry->handle)
+    {
+        zs_free(zswap_pool, entry->handle);
+        __atomic_sub_fetch(&zswap_stats.compressed_bytes, entry->length, __ATOMIC_RELAXED);
+    }
+    else
+        zswap_stat_dec(same_filled_pages);
+
+    zswap_stat_dec(stored_pages);
+    kmem_cache_free(zswap_entry_cache, entry);
+}
+
+/**
+ * @brief Remove an entry from the tree and the LRU
+ * The caller inherits the tree's reference.
+ */
+static void __zswap_erase(struct zswap_tree *tree, struct zswap_entry *entry)
+    REQUIRES(tree->lock)
+{
+    tree->entries.store(SWP_OFFSET(entry->swp), 0);
+
+    spin_lock(&zswap_lru_lock);
+    if (entry->on_lru)
+    {
+        list_remove(&entry->lru_node);
+        entry->on_lru = false;
+    }
+
+    spin_unlock(&zswap_lru_lock);
+}
+
+static bool zswap_page_same_filled(const unsigned long *data, unsigned long *value)
+{
+    unsigned long val = data[0];
+
+    for (unsigned int i = 1; i < PAGE_SIZE / sizeof(unsigned long); i++)
+    {
+        if (data[i] != val)
+            return false;
+    }
+
+    *value = val;
+    return true;
+}
+
+static void zswap_fill_page(unsigned long *data, unsigned long value)
+{
+    for (unsigned int i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++)
+        data[i] = value;
+}
+
+static int zswap_compress(void *src, struct zswap_entry *entry)
+{
+    struct zswap_pcpu *pcpu = &zswap_pcpu[get_cpu_nr()];
+    int err = 0;
+
+    /* We might get migrated to another CPU, but it doesn't matter, the lock protects the context */
+    mutex_lock(&pcpu->lock);
+    if (!pcpu->ctx)
+    {
+        /* CPU came up after swapon */
+        err = -ENODEV;
+        goto out;
+    }
+
+    {
+        auto ex = pcpu->ctx->compress(pcpu->buffer, PAGE_SIZE,
+                                      cul::slice<unsigned char>{(unsigned char *) src, PAGE_SIZE});
+        if (ex.has_error() || ex.value() >= PAGE_SIZE)
+        {
+            zswap_stat_inc(reject_poor_compression);
+            err = -E2BIG;
+            goto out;
+        }
+
+        entry->length = ex.value();
+    }
+
+    entry->handle = zs_malloc(zswap_pool, entry->length, GFP_NOWAIT);
+    if (!entry->handle)
+    {
+        zswap_stat_inc(reject_alloc_fail);
+        err = -ENOMEM;
+        goto out;
+    }
+
+    memcpy(zs_map_object(zswap_pool, entry->handle), pcpu->buffer, entry->length);
+out:
+    mutex_unlock(&pcpu->lock);
+    return err;
+}
+
+static int zswap_decompress(struct zswap_entry *entry, struct page *page)
+{
+    void *dst = PAGE_TO_VIRT(page);
+    struct zswap_pcpu *pcpu;
+
+    if (!entry->handle)
+    {
+        zswap_fill_page((unsigned long *) dst, entry->value);
+        return 0;
+    }
+
+    cul::slice<unsigned char> src{(unsigned char *) zs_map_object(zswap_pool, entry->handle),
+                                  entry->length};
+    expected<size_t, int> ex;
+
+    pcpu = &zswap_pcpu[get_cpu_nr()];
+    mutex_lock(&pcpu->lock);
+    if (pcpu->ctx)
+        ex = pcpu->ctx->decompress(dst, PAGE_SIZE, src);
+    else
+        ex = compression::decompress(dst, PAGE_SIZE, src);
+    mutex_unlock(&pcpu->lock);
+
+    if (ex.has_error() || ex.value() != PAGE_SIZE)
+    {
+        pr_err("Failed to decompress entry %016lx\n", entry->swp.swp);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drop a stale compressed copy of swp, before storing a new one
+ * If we then fail to store the new copy, a later load must not see the old data. If the old copy is
+ * being written back, wait for it, so the writeback's IO doesn't race with ours.
+ */
+static void zswap_invalidate_stale(struct zswap_tree *tree, swp_entry_t swp)
+{
+    struct zswap_entry *entry;
+
+    for (;;)
+    {
+        spin_lock(&tree->lock);
+        entry = __zswap_lookup(tree, swp);
+        if (!entry)
+        {
+            spin_unlock(&tree->lock);
+            return;
+        }
+
+        if (!READ_ONCE(entry->writeback))
+        {
+            __zswap_erase(tree, entry);
+            spin_unlock(&tree->lock);
+            zswap_entry_put(entry);
+            return;
+        }
+
+        zswap_entry_get(entry);
+        spin_unlock(&tree->lock);
+
+        wait_for(
+            &entry->writeback,
+            [](void *ptr) -> bool { return __atomic_load_n((u32 *) ptr, __ATOMIC_ACQUIRE) == 0; },
+            WAIT_FOR_FOREVER, 0);
+        zswap_entry_put(entry);
+    }
+}
+
+/**
+ * @brief Compress a page into zswap
+ *
+ * @param swp Swap entry the page is being written to
+ * @param page Page to store (locked)
+ * @return True if stored (and no IO is needed), else false
+ */
+bool zswap_store(swp_entry_t swp, struct page *page)
+{
+    struct zswap_tree *tree = zswap_tree_for(swp);
+    void *src = PAGE_TO_VIRT(page);
+    struct zswap_entry *entry;
+
+    if (!READ_ONCE(zswap_enabled))
+        return false;
+
+    zswap_invalidate_stale(tree, swp);
+
+    if (zswap_is_full())
+    {
+        zswap_stat_inc(reject_pool_full);
+        return false;
+    }
+
+    entry = (struct zswap_entry *) kmem_cache_alloc(zswap_entry_cache, GFP_NOWAIT);
+    if (!entry)
+    {
+        zswap_stat_inc(reject_alloc_fail);
+        return false;
+    }
+
+    entry->swp = swp;
+    entry->refs = 1;
+    entry->handle = 0;
+    entry->value = 0;
+    entry->length = 0;
+    entry->writeback = 0;
+    entry->on_lru = false;
+
+    if (zswap_page_same_filled((const unsigned long *) src, &entry->value))
+        zswap_stat_inc(same_filled_pages);
+    else if (zswap_compress(src, entry) < 0)
+    {
+        kmem_cache_free(zswap_entry_cache, entry);
+        return false;
+    }
+    else
+        zswap_stat_add(compressed_bytes, entry->length);
+
+    zswap_stat_inc(stored_pages);
+
+    spin_lock(&tree->lock);
+    /* We hold the page lock, and we just dropped whatever was here. */
+    WARN_ON(__zswap_lookup(tree, swp) != nullptr);
+    if (tree->entries.store(SWP_OFFSET(swp), (rt_entry_t) entry) < 0)
+    {
+        spin_unlock(&tree->lock);
+        zswap_stat_inc(reject_alloc_fail);
+        zswap_entry_put(entry);
+        return false;
+    }
+
+    spin_lock(&zswap_lru_lock);
+    list_add_tail(&entry->lru_node, &zswap_lru);
+    entry->on_lru = true;
+    spin_unlock(&zswap_lru_lock);
+    spin_unlock(&tree->lock);
+
+    zswap_stat_inc(stores);
+    return true;
+}
+
+/**
+ * @brief Load a page from zswap
+ *
+ * @param swp Swap entry
+ * @param page Page to decompress into (locked)
+ * @return 0 on success, -ENOENT if not in zswap, negative error codes
+ */
+int zswap_load(swp_entry_t swp, struct page *page)
+{
+    struct zswap_tree *tree = zswap_tree_for(swp);
+    struct zswap_entry *entry;
+    int err;
+
+    spin_lock(&tree->lock);
+    entry = __zswap_lookup(tree, swp);
+    if (!entry)
+    {
+        spin_unlock(&tree->lock);
+        return -ENOENT;
+    }
+
+    zswap_entry_get(entry);
+    spin_unlock(&tree->lock);
+
+    /* Keep the entry around. The page might be dropped from the swap cache without being dirtied
+     * again, and the swap slot would still be referenced. It goes away with the slot. */
+    err = zswap_decompress(entry, page);
+    zswap_entry_put(entry);
+    if (!err)
+        zswap_stat_inc(loads);
+    return err;
+}
+
+/**
+ * @brief Drop a swap entry's compressed copy
+ * Called (under the swap map lock) when a swap slot is freed.
+ *
+ * @param swp Swap entry
+ */
+void zswap_invalidate(swp_entry_t swp)
+{
+    struct zswap_tree *tree = zswap_tree_for(swp);
+    struct zswap_entry *entry;
+
+    spin_lock(&tree->lock);
+    entry = __zswap_lookup(tree, swp);
+    if (entry)
+        __zswap_erase(tree, entry);
+    spin_unlock(&tree->lock);
+
+    if (entry)
+        zswap_entry_put(entry);
+}
+
+/**
+ * @brief Mark an entry as under writeback, if it's still current
+ * Called by swap_zswap_pin, under the swap map lock.
+ *
+ * @param swp Swap entry
+ * @param entry zswap entry we're about to write back
+ * @return True if entry is still swp's compressed copy, else false
+ */
+bool zswap_start_writeback(swp_entry_t swp, struct zswap_entry *entry)
+{
+    struct zswap_tree *tree = zswap_tree_for(swp);
+    bool is_current;
+
+    spin_lock(&tree->lock);
+    is_current = __zswap_lookup(tree, swp) == entry;
+    if (is_current)
+        __atomic_store_n(&entry->writeback, 1, __ATOMIC_RELAXED);
+    spin_unlock(&tree->lock);
+    return is_current;
+}
+
+static void zswap_end_writeback(struct zswap_entry *entry, bool written)
+{
+    struct zswap_tree *tree = zswap_tree_for(entry->swp);
+    bool is_current;
+
+    spin_lock(&tree->lock);
+    is_current = __zswap_lookup(tree, entry->swp) == entry;
+    if (is_current)
+    {
+        if (written)
+            __zswap_erase(tree, entry);
+        else
+        {
+            /* Give it another go later */
+            spin_lock(&zswap_lru_lock);
+            list_add_tail(&entry->lru_node, &zswap_lru);
+            entry->on_lru = true;
+            spin_unlock(&zswap_lru_lock);
+        }
+    }
+
+    __atomic_store_n(&entry->writeback, 0, __ATOMIC_RELEASE);
+    spin_unlock(&tree->lock);
+    wake_address(&entry->writeback);
+
+    if (is_current && written)
+    {
+        zswap_stat_inc(written_back);
+        zswap_entry_put(entry);
+    }
+}
+
+/**
+ * @brief Write back the oldest entry to its swap area
+ *
+ * @return 0 on success, -ENOENT if zswap is empty, negative error codes
+ */
+static int zswap_writeback_one()
+{
+    struct zswap_entry *entry;
+    struct page *page;
+    swp_entry_t swp;
+    int err;
+
+    spin_lock(&zswap_lru_lock);
+    if (list_is_empty(&zswap_lru))
+    {
+        spin_unlock(&zswap_lru_lock);
+        return -ENOENT;
+    }
+
+    /* Entries on the LRU are in the tree, and the tree's reference can only be dropped after taking
+     * them off the LRU. As such, we can grab a reference here. */
+    entry = list_first_entry(&zswap_lru, struct zswap_entry, lru_node);
+    list_remove(&entry->lru_node);
+    entry->on_lru = false;
+    zswap_entry_get(entry);
+    swp = entry->swp;
+    spin_unlock(&zswap_lru_lock);
+
+    /* Pin the slot, so it doesn't get freed (and reused by someone else) under our IO */
+    if (!swap_zswap_pin(swp, entry))
+    {
+        zswap_entry_put(entry);
+        return -EAGAIN;
+    }
+
+    page = alloc_page(GFP_KERNEL | PAGE_ALLOC_NO_ZERO);
+    if (!page)
+        err = -ENOMEM;
+    else
+    {
+        err = zswap_decompress(entry, page);
+        if (!err)
+            err = swap_write_sync(swp, page);
+        free_page(page);
+    }
+
+    zswap_end_writeback(entry, err == 0);
+    swap_put(swp);
+    zswap_entry_put(entry);
+    return err;
+}
+
+static void zswapd(void *arg)
+{
+    for (;;)
+    {
+        wait_for_event(&zswap_wb_wq, READ_ONCE(zswap_wb_pending));
+
+        unsigned int failures = 0;
+        while (zs_get_total_pages(zswap_pool) > zswap_accept_pages() &&
+               failures < ZSWAP_WB_MAX_FAILURES)
+        {
+            int err = zswap_writeback_one();
+            if (err == -ENOENT)
+                break;
+            if (err < 0)
+                failures++;
+        }
+
+        WRITE_ONCE(zswap_wb_pending, false);
+    }
+}
+
+static int zswap_init_pcpu(unsigned int cpu)
+{
+    struct zswap_pcpu *pcpu = &zswap_pcpu[cpu];
+    u8 *buffer;
+
+    if (pcpu->ctx)
+        return 0;
+
+    buffer = (u8 *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buffer)
+        return -ENOMEM;
+
+    auto ex = compression::create_context("zstd", ZSWAP_COMPRESSION_LEVEL);
+    if (ex.has_error())
+    {
+        kfree(buffer);
+        return ex.error();
+    }
+
+    /* zswap might be enabled already (by a previous swapon), so publish it under the lock */
+    scoped_mutex g{pcpu->lock};
+    pcpu->buffer = buffer;
+    pcpu->ctx = ex.value().release();
+    return 0;
+}
+
+static int zswap_init()
+{
+    struct memstat ms;
+    struct thread *thread;
+
+    zswap_pool = zs_create_pool("zswap");
+    if (!zswap_pool)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < CONFIG_SMP_NR_CPUS; i++)
+        mutex_init(&zswap_pcpu[i].lock);
+
+    zswap_entry_cache = kmem_cache_create("zswap_entry", sizeof(struct zswap_entry),
+                                          alignof(struct zswap_entry), 0, nullptr);
+    if (!zswap_entry_cache)
+        goto err;
+
+    thread = sched_create_thread(zswapd, THREAD_KERNEL, nullptr);
+    if (!thread)
+        goto err;
+
+    page_get_stats(&ms);
+    zswap_total_pages = ms.total_pages;
+    sched_start_thread(thread);
+    return 0;
+err:
+    if (zswap_entry_cache)
+        kmem_cache_destroy(zswap_entry_cache);
+    zs_destroy_pool(zswap_pool);
+    zswap_entry_cache = nullptr;
+    zswap_pool = nullptr;
+    return -ENOMEM;
+}
+
+/**
+ * @brief Set up zswap for a new swap area
+ * Called on swapon. Allocates the compression contexts on first use.
+ *
+ * @return 0 on success, negative error codes (zswap stays disabled)
+ */
+int zswap_swapon()
+{
+    int err = 0;
+
+    scoped_mutex g{zswap_init_lock};
+    if (!zswap_pool)
+    {
+        if (err = zswap_init(); err < 0)
+            return err;
+    }
+
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        if (err = zswap_init_pcpu(i); err < 0)
+            return err;
+    }
+
+    WRITE_ONCE(zswap_enabled, true);
+    return 0;
+}
+
+ssize_t zswap_stats_read(void *buffer, size_t size, off_t off)
+{
+    struct zs_pool_stats pool_stats = {};
+    char buf[512];
+
+    if (zswap_pool)
+        zs_pool_stats(zswap_pool, &pool_stats);
+
+    int len = snprintf(
+        buf, sizeof(buf),
+        "enabled %d\npool_pages %lu\nmax_pool_pages %lu\nstored_pages %lu\nsame_filled_pages "
+        "%lu\ncompressed_bytes %lu\nstores %lu\nloads %lu\nwritten_back %lu\nreject_pool_full "
+        "%lu\nreject_poor_compression %lu\nreject_alloc_fail %lu\n",
+        READ_ONCE(zswap_enabled), pool_stats.pages, zswap_max_pages(),
+        READ_ONCE(zswap_stats.stored_pages), READ_ONCE(zswap_stats.same_filled_pages),
+        READ_ONCE(zswap_stats.compressed_bytes), READ_ONCE(zswap_stats.stores),
+        READ_ONCE(zswap_stats.loads), READ_ONCE(zswap_stats.written_back),
+        READ_ONCE(zswap_stats.reject_pool_full), READ_ONCE(zswap_stats.reject_poor_compression),
+        READ_ONCE(zswap_stats.reject_alloc_fail));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t zswap_max_pool_read(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%u\n", READ_ONCE(zswap_max_pool_percent));
+    return sysfs_copy_out(buffer, size, off, buf, len);
+}
+
+ssize_t zswap_max_pool_write(void *buffer, size_t size, off_t off)
+{
+    char buf[16];
+    unsigned int percent = 0;
+
+    if (size == 0 || size >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+    buf[size] = '\0';
+
+    for (size_t i = 0; i < size && buf[i] != '\n'; i++)
+    {
+        if (buf[i] < '0' || buf[i] > '9')
+            return -EINVAL;
+        percent = percent * 10 + (buf[i] - '0');
+    }
+
+    if (percent > 100)
+        return -EINVAL;
+
+    /* 0 rejects every store, and lets zswapd drain the pool */
+    WRITE_ONCE(zswap_max_pool_percent, percent);
+    if (zswap_pool && zs_get_total_pages(zswap_pool) > zswap_accept_pages())
+        zswap_kick_writeback();
+    return size;
+}
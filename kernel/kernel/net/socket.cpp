@@ -384,13 +384,18 @@ struct file_ops socket_ops = {
     .poll = socket_poll,
 };
 
+bool file_is_socket(struct file *f)
+{
+    return f->f_ino->i_fops->write == socket_write;
+}
+
 auto_file get_socket_fd(int fd)
 {
     struct file *desc = get_file_description(fd);
     if (!desc)
         return errno = EBADF, nullptr;
 
-    if (desc->f_ino->i_fops->write != socket_write)
+    if (!file_is_socket(desc))
     {
         fd_put(desc);
         return errno = ENOTSOCK, nullptr;
@@ -461,16 +466,23 @@ out2:
     return ret;
 }
 
-ssize_t sys_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr,
-                     socklen_t *paddrlen)
+/**
+ * @brief recvfrom(2) on a socket file
+ *
+ * @param f Socket file
+ * @param buf User buffer
+ * @param len Length of the buffer
+ * @param flags MSG_* flags
+ * @param src_addr User pointer to the source address, or nullptr
+ * @param paddrlen User pointer to the source address' length
+ * @return Bytes received, or negative error code
+ */
+ssize_t socket_recvfrom(struct file *f, void *buf, size_t len, int flags, struct sockaddr *src_addr,
+                        socklen_t *paddrlen)
 {
-    auto_file desc = get_socket_fd(sockfd);
-    if (!desc)
-        return -errno;
+    socket *s = file_to_socket(f);
 
-    socket *s = file_to_socket(desc.get_file());
-
-    flags |= fd_flags_to_msg_flags(desc.get_file());
+    flags |= fd_flags_to_msg_flags(f);
     socklen_t addrlen = 0;
 
     sockaddr_storage sa;
@@ -518,6 +530,16 @@ ssize_t sys_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockad
     return ret;
 }
 
+ssize_t sys_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr,
+                     socklen_t *paddrlen)
+{
+    auto_file desc = get_socket_fd(sockfd);
+    if (!desc)
+        return -errno;
+
+    return socket_recvfrom(desc.get_file(), buf, len, flags, src_addr, paddrlen);
+}
+
 #define BACKLOG_FOR_LISTEN_0 16
 const int backlog_limit = 4096;
 
@@ -843,17 +865,23 @@ int copy_sockaddr(const sockaddr *kaddr, socklen_t kaddrlen, sockaddr *uaddr, so
     return 0;
 }
 
-int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *slen, int flags)
+/**
+ * @brief accept4(2), optionally without blocking regardless of the file's O_NONBLOCK
+ *
+ * @param f Listening socket file
+ * @param addr User pointer to the peer address, or nullptr
+ * @param slen User pointer to the peer address' length
+ * @param flags accept4 flags
+ * @param nonblock If true, return -EAGAIN instead of waiting for a connection
+ * @return New fd, or negative error code
+ */
+int socket_accept4(struct file *f, struct sockaddr *addr, socklen_t *slen, int flags, bool nonblock)
 {
     int st = 0;
     if (flags & ~ACCEPT4_VALID_FLAGS)
         return -EINVAL;
 
-    auto f = get_socket_fd(sockfd);
-    if (!f)
-        return -errno;
-
-    socket *sock = file_to_socket(f.get_file());
+    socket *sock = file_to_socket(f);
     socket *new_socket = nullptr;
     inode *inode = nullptr;
     file *newf = nullptr;
@@ -871,7 +899,8 @@ int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *slen, int flags)
         goto out;
     }
 
-    new_socket = sock->sock_ops->accept(sock, f.get_file()->f_flags);
+    new_socket =
+        sock->sock_ops->accept(sock, f->f_flags | (nonblock ? O_NONBLOCK : 0));
 
     if (!new_socket)
     {
@@ -932,6 +961,15 @@ out:
     return st;
 }
 
+int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *slen, int flags)
+{
+    auto f = get_socket_fd(sockfd);
+    if (!f)
+        return -errno;
+
+    return socket_accept4(f.get_file(), addr, slen, flags, false);
+}
+
 int sys_accept(int sockfd, struct sockaddr *addr, socklen_t *slen)
 {
     return sys_accept4(sockfd, addr, slen, 0);
@@ -1190,13 +1228,20 @@ ssize_t socket_sendmsg(socket *sock, msghdr *umsg, int flags)
     return sock->sock_ops->sendmsg(sock, &msg, flags);
 }
 
-ssize_t sys_sendto(int sockfd, const void *buf, size_t len, int flags, struct sockaddr *addr,
-                   socklen_t addrlen)
+/**
+ * @brief sendto(2) on a socket file
+ *
+ * @param f Socket file
+ * @param buf User buffer
+ * @param len Length of the buffer
+ * @param flags MSG_* flags
+ * @param addr User pointer to the destination address, or nullptr
+ * @param addrlen Length of the destination address
+ * @return Bytes sent, or negative error code
+ */
+ssize_t socket_sendto(struct file *f, const void *buf, size_t len, int flags, struct sockaddr *addr,
+                      socklen_t addrlen)
 {
-    auto desc = get_socket_fd(sockfd);
-    if (!desc)
-        return -errno;
-
     /* Ugh, this uses a big part of the stack... I don't like this
      * and we're going to get rid of this anyway when we add sendmsg
      */
@@ -1225,12 +1270,22 @@ ssize_t sys_sendto(int sockfd, const void *buf, size_t len, int flags, struct so
     msg.msg_name = addr ? &sa : nullptr;
     msg.msg_namelen = addr ? addrlen : 0;
 
-    socket *s = file_to_socket(desc);
+    socket *s = file_to_socket(f);
     ssize_t ret = s->sock_ops->sendmsg(s, &msg, flags);
 
     return ret;
 }
 
+ssize_t sys_sendto(int sockfd, const void *buf, size_t len, int flags, struct sockaddr *addr,
+                   socklen_t addrlen)
+{
+    auto desc = get_socket_fd(sockfd);
+    if (!desc)
+        return -errno;
+
+    return socket_sendto(desc.get_file(), buf, len, flags, addr, addrlen);
+}
+
 ssize_t sys_sendmsg(int sockfd, struct msghdr *msg, int flags)
 {
     auto_file f = get_socket_fd(sockfd);
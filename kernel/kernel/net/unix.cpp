@@ -16,8 +16,10 @@
 #include <onyx/net/socket.h>
 #include <onyx/net/socket_table.h>
 #include <onyx/packetbuf.h>
+#include <onyx/page.h>
 #include <onyx/poll.h>
 #include <onyx/process.h>
+#include <onyx/vm.h>
 
 #include <onyx/utility.hpp>
 
@@ -202,6 +204,28 @@ extern const struct socket_ops un_ops;
 #define UN_CLOSED    0
 #define UN_LISTENING 1
 #define UN_CONNECTED 2
+
+// Autobound addresses are 5 hex digits, as in Linux
+#define UN_AUTOBIND_MAX 0xfffffU
+
+/* Large stream reads that find no data hand their (pinned) buffer over to the writer, which then
+ * copies straight into it, instead of going through a packetbuf. This saves a copy and the
+ * packetbuf allocation, for every large transfer between two unix sockets.
+ */
+#define UN_DIRECT_MAX_PAGES 16
+#define UN_DIRECT_MIN_LEN   (4 * PAGE_SIZE)
+
+struct un_direct_rx
+{
+    struct page *pages[UN_DIRECT_MAX_PAGES];
+    unsigned int nr_pages;
+    // Offset into the first page
+    unsigned int offset;
+    size_t len;
+    // Bytes copied by the writer, 0 if it has not touched us yet
+    size_t copied;
+};
+
 /**
  * @brief Represents a UNIX domain socket
  *
@@ -238,17 +262,20 @@ class un_socket : public socket
     int state{UN_CLOSED};
 
     list_head connection_queue;
-    wait_queue connection_wq;
     wait_queue accept_wq;
 
     list_head inbuf_list;
     wait_queue inbuf_wq;
+    // Reader waiting for data to be copied directly into its buffer, protected by the socket lock
+    un_direct_rx *direct_rx_{nullptr};
 
     struct connection_req
     {
         un_socket *peer;
         un_socket *server_sock{nullptr}; // To be filled by accept()
         bool dead{false};                // Set if the socket got closed and we're still queued
+        // Only the connecting thread waits here, so accept() wakes exactly who it has to
+        wait_queue wq;
 
         bool was_woken_up() const
         {
@@ -278,6 +305,29 @@ class un_socket : public socket
      */
     expected<un_socket *, int> create_accept_socket(un_socket *peer);
 
+    /**
+     * @brief Refuse every pending connection. Called when closing a listening socket.
+     *
+     */
+    void abort_connections();
+
+    /**
+     * @brief Wait for a writer to copy data directly into the reader's buffer
+     *
+     * @param iter iovec iterator, advanced by the number of bytes received
+     * @return Bytes received, 0 if the caller should take the regular path, or negative error
+     * codes
+     */
+    ssize_t recv_direct(iovec_iter &iter);
+
+    /**
+     * @brief Copy data directly into a waiting reader's buffer
+     *
+     * @param iter iovec iterator
+     * @return Bytes copied, or negative error codes
+     */
+    ssize_t queue_direct(iovec_iter &iter);
+
     ref_guard<un_socket> get_peer_locked()
     {
         scoped_hybrid_lock g{socket_lock, this};
@@ -338,7 +388,6 @@ public:
         this->type = type;
         this->proto = protocol;
         this->domain = AF_UNIX;
-        init_wait_queue_head(&connection_wq);
         init_wait_queue_head(&accept_wq);
         init_wait_queue_head(&inbuf_wq);
         INIT_LIST_HEAD(&inbuf_list);
@@ -588,18 +637,26 @@ int un_socket::do_autobind()
     // not explicitly bound to an address, then the socket is autobound
     // to an abstract address.  The address consists of a null byte
     // followed by 5 bytes in the character set [0-9a-f].
-    char anon_path[5];
-    uint32_t autobind_addr = 0;
-    uint32_t max_addr = 0xfffff;
+    static uint32_t autobind_next;
+    char anon_path[6];
 
-    // TODO: This is slow.
+    // Every autobind starts where the last one left off, so we usually find a free address on
+    // the first try, instead of walking the whole namespace from the start.
+    uint32_t start = __atomic_fetch_add(&autobind_next, 1, __ATOMIC_RELAXED) & UN_AUTOBIND_MAX;
+    uint32_t autobind_addr = start;
 
-    for (; autobind_addr <= max_addr; autobind_addr++)
+    do
     {
-        snprintf(anon_path, 5, "%x", autobind_addr);
-        if (do_anon_bind(cul::string{anon_path}) == 0)
-            return 0;
-    }
+        snprintf(anon_path, sizeof(anon_path), "%05x", autobind_addr);
+        cul::string s{anon_path};
+        if (!s)
+            return -ENOMEM;
+
+        if (int st = do_anon_bind(cul::move(s)); st != -EADDRINUSE)
+            return st;
+
+        autobind_addr = (autobind_addr + 1) & UN_AUTOBIND_MAX;
+    } while (autobind_addr != start);
 
     return -EADDRINUSE;
 }
@@ -757,9 +814,10 @@ expected<un_socket *, int> un_socket::connect_to(un_socket *client)
     connection_req r{client};
 
     list_add_tail(&r.list_node, &connection_queue);
-    wait_queue_wake_all(&accept_wq);
+    // Only one accept() can take us, so don't wake every other acceptor up
+    wait_queue_wake_exclusive(&accept_wq);
 
-    int st = wait_for_event_socklocked_interruptible(&connection_wq, r.was_woken_up());
+    int st = wait_for_event_socklocked_interruptible(&r.wq, r.was_woken_up());
     if (st < 0)
     {
         list_remove(&r.list_node);
@@ -848,7 +906,7 @@ socket *un_socket::accept(int flags)
     if (type != SOCK_STREAM || state != UN_LISTENING)
         return errno = EINVAL, nullptr;
 
-    int st = wait_for_event_socklocked_interruptible(
+    int st = wait_for_event_socklocked_interruptible_exclusive(
         &accept_wq, !list_is_empty(&connection_queue) || flags & SOCK_NONBLOCK);
 
     if (st < 0)
@@ -871,13 +929,35 @@ socket *un_socket::accept(int flags)
     auto acceptsock = ex.value();
 
     connreq->server_sock = acceptsock;
-    // TODO: THUNDER!ing herd
-    wait_queue_wake_all(&connection_wq);
     list_remove(&connreq->list_node);
+    wait_queue_wake_all(&connreq->wq);
+
+    // There may be more connections queued up, that the next exclusive acceptor can take
+    if (!list_is_empty(&connection_queue))
+        wait_queue_wake_exclusive(&accept_wq);
 
     return acceptsock;
 }
 
+/**
+ * @brief Refuse every pending connection. Called when closing a listening socket.
+ *
+ */
+void un_socket::abort_connections()
+{
+    scoped_hybrid_lock hlock{socket_lock, this};
+
+    list_for_every_safe (&connection_queue)
+    {
+        auto connreq = container_of(l, connection_req, list_node);
+        connreq->dead = true;
+        list_remove(&connreq->list_node);
+        wait_queue_wake_all(&connreq->wq);
+    }
+
+    state = UN_CLOSED;
+}
+
 /**
  * @brief Disconnect/discard our peer. Called from close().
  *
@@ -898,6 +978,9 @@ void un_socket::close()
         unbind();
     }
 
+    if (state == UN_LISTENING)
+        abort_connections();
+
     shutdown(SHUTDOWN_RDWR);
     disconnect_peer();
     this->unref();
@@ -955,6 +1038,48 @@ static ssize_t fill_pbuf(packetbuf *pbuf, iovec_iter &iter)
     return written;
 }
 
+/**
+ * @brief Copy data directly into a waiting reader's buffer
+ *
+ * @param iter iovec iterator
+ * @return Bytes copied, or negative error codes
+ */
+ssize_t un_socket::queue_direct(iovec_iter &iter)
+{
+    un_direct_rx *rx = direct_rx_;
+    size_t off = rx->offset;
+    size_t to_copy = cul::min(rx->len, iter.bytes);
+    ssize_t copied = 0;
+
+    while (to_copy > 0)
+    {
+        struct page *page = rx->pages[off >> PAGE_SHIFT];
+        size_t page_off = off & (PAGE_SIZE - 1);
+        size_t len = cul::min(PAGE_SIZE - page_off, to_copy);
+
+        ssize_t st = copy_from_iter(&iter, (u8 *) PAGE_TO_VIRT(page) + page_off, len);
+        if (st <= 0)
+        {
+            if (copied == 0)
+                return st;
+            break;
+        }
+
+        copied += st;
+        off += st;
+        to_copy -= st;
+
+        if ((size_t) st < len)
+            break;
+    }
+
+    // Hand the buffer back to the reader. It's only used once.
+    rx->copied = copied;
+    direct_rx_ = nullptr;
+    wait_queue_wake_all(&inbuf_wq);
+    return copied;
+}
+
 /**
  * @brief Queue incoming data
  *
@@ -981,6 +1106,16 @@ ssize_t un_socket::queue_data(const struct msghdr *msg)
 
     iovec_iter iter{{msg->msg_iov, static_cast<size_t>(msg->msg_iovlen)}, static_cast<size_t>(len)};
 
+    // A reader is waiting on an empty socket, copy straight into its buffer. Anything that
+    // doesn't fit gets queued after it, as usual.
+    if (direct_rx_ && list_is_empty(&inbuf_list) && !iter.empty())
+    {
+        DCHECK(type == SOCK_STREAM);
+        if (auto st = queue_direct(iter); st < 0)
+            return st;
+        looked_at_tail = true;
+    }
+
     while (!iter.empty())
     {
         ref_guard<packetbuf> pbuf;
@@ -1097,6 +1232,64 @@ ssize_t un_socket::sendmsg(const struct msghdr *msg, int flags)
     return sendmsg_dgram(msg, flags);
 }
 
+/**
+ * @brief Wait for a writer to copy data directly into the reader's buffer
+ *
+ * @param iter iovec iterator, advanced by the number of bytes received
+ * @return Bytes received, 0 if the caller should take the regular path, or negative error
+ * codes
+ */
+ssize_t un_socket::recv_direct(iovec_iter &iter)
+{
+    un_direct_rx rx;
+    iovec iov = iter.curiovec();
+    unsigned long addr = (unsigned long) iov.iov_base;
+
+    rx.offset = addr & (PAGE_SIZE - 1);
+    rx.len = cul::min(iov.iov_len, ((size_t) UN_DIRECT_MAX_PAGES << PAGE_SHIFT) - rx.offset);
+    rx.copied = 0;
+    rx.nr_pages = 0;
+
+    if (rx.len < UN_DIRECT_MIN_LEN)
+        return 0;
+
+    const unsigned int nr_pages = vm_size_to_pages(rx.offset + rx.len);
+
+    // Pin the pages one by one. If we fail halfway through, just use what we've got.
+    for (; rx.nr_pages < nr_pages; rx.nr_pages++)
+    {
+        void *page_addr = (void *) ((addr & -PAGE_SIZE) + (rx.nr_pages << PAGE_SHIFT));
+        if (!(get_phys_pages(page_addr, GPP_WRITE | GPP_USER, &rx.pages[rx.nr_pages], 1) &
+              GPP_ACCESS_OK))
+            break;
+    }
+
+    if (rx.nr_pages != nr_pages)
+        rx.len = cul::min(rx.len, ((size_t) rx.nr_pages << PAGE_SHIFT) - rx.offset);
+
+    ssize_t st = 0;
+
+    if (rx.nr_pages > 0 && rx.len >= UN_DIRECT_MIN_LEN)
+    {
+        direct_rx_ = &rx;
+        st = wait_for_event_socklocked_interruptible(&inbuf_wq, rx.copied || has_data());
+        // The writer clears direct_rx_ when it's done with it
+        if (direct_rx_ == &rx)
+            direct_rx_ = nullptr;
+    }
+
+    for (unsigned int i = 0; i < rx.nr_pages; i++)
+        page_unpin(rx.pages[i]);
+
+    if (rx.copied)
+    {
+        iter.advance(rx.copied);
+        return rx.copied;
+    }
+
+    return st;
+}
+
 ssize_t un_socket::recvmsg_stream(struct msghdr *msg, int flags)
 {
     auto iovlen = iovec_count_length(msg->msg_iov, msg->msg_iovlen);
@@ -1112,6 +1305,17 @@ ssize_t un_socket::recvmsg_stream(struct msghdr *msg, int flags)
 
     size_t bytes_read = 0;
 
+    if (!has_data() && !(flags & (MSG_PEEK | MSG_DONTWAIT)) && !direct_rx_ &&
+        iter.bytes >= UN_DIRECT_MIN_LEN)
+    {
+        ssize_t st = recv_direct(iter);
+        if (st != 0)
+        {
+            msg->msg_controllen = 0;
+            return st;
+        }
+    }
+
     auto ex = get_data(flags);
 
     if (ex.has_error())
@@ -1490,4 +1694,44 @@ TEST(uipc, recv_stream_works)
     ASSERT_EQ(-EWOULDBLOCK, read(sock0.get(), cul::slice<u8>{(u8 *) "", 0}, MSG_DONTWAIT));
 }
 
+TEST(uipc, stream_direct_rx_works)
+{
+    // Make sure writes go straight into a waiting reader's buffer, and the rest gets queued
+    auto [sock0, sock1] = create_socketpair(SOCK_STREAM).unwrap();
+    struct page *page = alloc_page(GFP_KERNEL);
+    ASSERT_NONNULL(page);
+
+    un_direct_rx rx;
+    rx.pages[0] = page;
+    rx.nr_pages = 1;
+    rx.offset = 0;
+    rx.len = 2;
+    rx.copied = 0;
+    sock0->direct_rx_ = &rx;
+
+    ASSERT_EQ(4L, write(sock1.get(), cul::slice<u8>{(u8 *) "hiho", 4}));
+
+    ASSERT_EQ(2UL, rx.copied);
+    ASSERT_NULL(sock0->direct_rx_);
+    ASSERT_EQ(0, memcmp(PAGE_TO_VIRT(page), "hi", 2));
+    ASSERT_EQ(2L, read(sock0.get(), cul::slice<u8>{(u8 *) "ho", 2}));
+    ASSERT_EQ(-EWOULDBLOCK, read(sock0.get(), cul::slice<u8>{(u8 *) "", 0}, MSG_DONTWAIT));
+    free_page(page);
+}
+
+TEST(uipc, autobind_works)
+{
+    // Autobind must give out distinct addresses with 5 hex digits
+    auto [sock0, sock1] = create_socketpair(SOCK_DGRAM).unwrap();
+
+    ASSERT_EQ(0, sock0->do_autobind());
+    ASSERT_EQ(0, sock1->do_autobind());
+    ASSERT_FALSE(sock0->src_addr().is_fs_sock_);
+    ASSERT_EQ(5UL, sock0->src_addr().anon_path_.length());
+    ASSERT_EQ(5UL, sock1->src_addr().anon_path_.length());
+    ASSERT_FALSE(sock0->src_addr().anon_path_ == sock1->src_addr().anon_path_);
+    sock0->unbind();
+    sock1->unbind();
+}
+
 #endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/anon_inode.h>
+#include <onyx/file.h>
+#include <onyx/pidfd.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+
+#include <uapi/fcntl.h>
+#include <uapi/pidfd.h>
+
+/* pidfd: a file descriptor that refers to a process. Unlike a pid, it can't get recycled and
+ * end up referring to some other process. The file holds a reference to the process. pidfds poll
+ * readable once the process exits, so supervisors can wait for exits using poll/epoll. */
+
+static void pidfd_release(struct file *filp)
+{
+    process_put((struct process *) filp->private_data);
+}
+
+static short pidfd_poll(void *poll_file, short events, struct file *filp)
+{
+    struct process *proc = (struct process *) filp->private_data;
+
+    poll_wait_helper(poll_file, &proc->pidfd_wq);
+
+    if (READ_ONCE(proc->signal_group_flags) & SIGNAL_GROUP_EXIT)
+        return (POLLIN | POLLRDNORM) & events;
+    return 0;
+}
+
+static struct file_ops pidfd_fops = {
+    .poll = pidfd_poll,
+    .release = pidfd_release,
+};
+
+struct process *pidfd_to_process(struct file *filp)
+{
+    if (filp->f_ino->i_fops != &pidfd_fops)
+        return nullptr;
+    return (struct process *) filp->private_data;
+}
+
+int pidfd_create(struct process *proc, unsigned int flags)
+{
+    struct file *filp = anon_inode_open(S_IFREG, &pidfd_fops, "[pidfd]");
+    if (!filp)
+        return -ENOMEM;
+
+    process_get(proc);
+    filp->private_data = proc;
+
+    int fd = open_with_vnode(filp, O_RDWR | (flags & (O_CLOEXEC | O_NONBLOCK)));
+    fd_put(filp);
+    return fd;
+}
+
+int sys_pidfd_open(pid_t pid, unsigned int flags)
+{
+    if (flags & ~PIDFD_NONBLOCK)
+        return -EINVAL;
+
+    if (pid <= 0)
+        return -EINVAL;
+
+    struct process *proc = get_process_from_pid(pid);
+    if (!proc)
+        return -ESRCH;
+
+    /* pidfds are always O_CLOEXEC, like in Linux */
+    int fd = pidfd_create(proc, O_CLOEXEC | flags);
+    process_put(proc);
+    return fd;
+}
@@ -15,6 +15,7 @@
 #include <onyx/dentry.h>
 #include <onyx/file.h>
 #include <onyx/mutex.h>
+#include <onyx/poll.h>
 #include <onyx/proc_event.h>
 #include <onyx/process.h>
 #include <onyx/scheduler.h>
@@ -22,9 +23,16 @@
 
 #include <uapi/fcntl.h>
 
+/* Ring subscriptions don't stop the process, so they don't count towards nr_subs (and acks) */
+static bool proc_event_sub_is_sync(struct proc_event_sub *s)
+{
+    return !(s->flags & PROC_EVENT_RING);
+}
+
 static void __append_to_list(struct proc_event_sub *s, struct process *p)
 {
-    __atomic_add_fetch(&p->nr_subs, 1, __ATOMIC_ACQUIRE);
+    if (proc_event_sub_is_sync(s))
+        __atomic_add_fetch(&p->nr_subs, 1, __ATOMIC_ACQUIRE);
 
     spin_lock(&p->sub_queue_lock);
 
@@ -43,23 +51,113 @@ static void __remove_from_list(struct process *p, struct proc_event_sub *s)
 {
     spin_lock(&p->sub_queue_lock);
     if (p->sub_queue == s)
-    {
         p->sub_queue = s->next;
-        spin_unlock(&p->sub_queue_lock);
-        return;
+    else
+    {
+        for (struct proc_event_sub *i = p->sub_queue; i; i = i->next)
+        {
+            if (i->next == s)
+            {
+                i->next = s->next;
+                break;
+            }
+        }
     }
 
-    for (struct proc_event_sub *i = p->sub_queue; i; i = i->next)
+    if (proc_event_sub_is_sync(s))
+        __atomic_sub_fetch(&p->nr_subs, 1, __ATOMIC_RELEASE);
+    spin_unlock(&p->sub_queue_lock);
+}
+
+static void proc_event_ring_push(struct proc_event_ring *ring, const struct proc_event *ev)
+{
     {
-        if (i->next == s)
+        scoped_lock g{ring->lock};
+
+        if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == PROC_EVENT_RING_SIZE)
         {
-            i->next = s->next;
+            /* Full, the reader finds out about it with a PROC_EVENT_LOST */
+            ring->nr_lost++;
+            return;
+        }
+
+        memcpy(&ring->events[ring->head & (PROC_EVENT_RING_SIZE - 1)], ev, sizeof(*ev));
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+
+    wait_queue_wake_all(&ring->wq);
+}
+
+static bool proc_event_ring_has_events(struct proc_event_ring *ring)
+{
+    return READ_ONCE(ring->head) != READ_ONCE(ring->tail) || READ_ONCE(ring->nr_lost);
+}
+
+static ssize_t proc_event_ring_read(struct proc_event_sub *sub, void *buffer, size_t len,
+                                    bool nonblock)
+{
+    struct proc_event_ring *ring = sub->ring;
+    struct proc_event *ubuf = (struct proc_event *) buffer;
+    size_t nr = len / sizeof(struct proc_event);
+    size_t done = 0;
+
+    if (nr == 0)
+        return -EINVAL;
+
+    scoped_mutex g{ring->read_lock};
+
+    if (!nonblock)
+    {
+        int st = wait_for_event_interruptible(
+            &ring->wq, proc_event_ring_has_events(ring) || !READ_ONCE(sub->valid_sub));
+        if (st < 0)
+            return st;
+    }
+
+    /* Report lost events first, so the reader knows there's a gap */
+    spin_lock(&ring->lock);
+    unsigned long lost = ring->nr_lost;
+    ring->nr_lost = 0;
+    spin_unlock(&ring->lock);
+
+    if (lost)
+    {
+        struct proc_event ev = {};
+        ev.type = PROC_EVENT_LOST;
+        ev.pid = sub->target_process->get_pid();
+        ev.e_un.lost.nr_lost = lost;
+        if (copy_to_user(ubuf, &ev, sizeof(ev)) < 0)
+        {
+            /* Give the count back, nr_lost is protected by ring->lock */
+            spin_lock(&ring->lock);
+            ring->nr_lost += lost;
+            spin_unlock(&ring->lock);
+            return -EFAULT;
+        }
+
+        done++;
+    }
+
+    /* We're the only consumer, so the events between tail and head are stable */
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = ring->tail;
+
+    for (; done < nr && tail != head; done++, tail++)
+    {
+        if (copy_to_user(&ubuf[done], &ring->events[tail & (PROC_EVENT_RING_SIZE - 1)],
+                         sizeof(struct proc_event)) < 0)
+        {
+            if (done == 0)
+                return -EFAULT;
             break;
         }
     }
 
-    __atomic_sub_fetch(&p->nr_subs, 1, __ATOMIC_RELEASE);
-    spin_unlock(&p->sub_queue_lock);
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    if (done == 0)
+        return READ_ONCE(sub->valid_sub) ? -EAGAIN : 0;
+    return done * sizeof(struct proc_event);
 }
 
 size_t proc_event_read(size_t offset, size_t sizeofread, void *buffer, struct file *file)
@@ -67,11 +165,12 @@ size_t proc_event_read(size_t offset, size_t sizeofread, void *buffer, struct fi
     struct inode *ino = file->f_ino;
     struct proc_event_sub *sub = (proc_event_sub *) ino->i_helper;
 
+    if (sub->ring)
+        return proc_event_ring_read(sub, buffer, sizeofread, file->f_flags & O_NONBLOCK);
+
+    /* The sub is freed on close */
     if (sub->valid_sub == false)
-    {
-        free(sub);
         return errno = ESRCH, (size_t) -1;
-    }
 
     if (!sub->has_new_event && file->f_flags & O_NONBLOCK)
         return 0;
@@ -93,13 +192,33 @@ void proc_event_close(struct inode *ino)
 {
     struct proc_event_sub *sub = (proc_event_sub *) ino->i_helper;
 
-    if (sub->valid_sub == false)
-    {
-        free(sub);
-        return;
-    }
+    if (sub->valid_sub)
+        __remove_from_list(sub->target_process, sub);
 
-    __remove_from_list(sub->target_process, sub);
+    free(sub->ring);
+    free(sub);
+}
+
+short default_poll(void *poll_table, short events, struct file *node);
+
+short proc_event_poll(void *poll_file, short events, struct file *file)
+{
+    struct proc_event_sub *sub = (proc_event_sub *) file->f_ino->i_helper;
+    struct proc_event_ring *ring = sub->ring;
+    short revents = 0;
+
+    /* Synchronous subscriptions wait on a semaphore, and can't be polled */
+    if (!ring)
+        return default_poll(poll_file, events, file);
+
+    poll_wait_helper(poll_file, &ring->wq);
+
+    if (proc_event_ring_has_events(ring))
+        revents |= POLLIN | POLLRDNORM;
+    if (!READ_ONCE(sub->valid_sub))
+        revents |= POLLHUP;
+
+    return revents & (events | POLLHUP);
 }
 
 void proc_event_do_ack(struct process *process);
@@ -124,16 +243,49 @@ unsigned int proc_event_ioctl(int request, void *argp, struct file *file)
     }
 }
 
-struct file_ops proc_event_ops = {
-    .read = proc_event_read, .close = proc_event_close, .ioctl = proc_event_ioctl};
+struct file_ops proc_event_ops = {.read = proc_event_read,
+                                  .close = proc_event_close,
+                                  .ioctl = proc_event_ioctl,
+                                  .poll = proc_event_poll};
+
+#define PROC_EVENT_VALID_FLAGS (PROC_EVENT_LISTEN_SYSCALLS | PROC_EVENT_RING | PROC_EVENT_LISTEN_EXIT)
+
+static struct proc_event_ring *proc_event_ring_alloc()
+{
+    struct proc_event_ring *ring = (struct proc_event_ring *) zalloc(sizeof(*ring));
+    if (!ring)
+        return nullptr;
+
+    spinlock_init(&ring->lock);
+    mutex_init(&ring->read_lock);
+    init_wait_queue_head(&ring->wq);
+    return ring;
+}
 
 int sys_proc_event_attach(pid_t pid, unsigned long flags)
 {
+    if (flags & ~PROC_EVENT_VALID_FLAGS)
+        return -EINVAL;
+
+    /* Exit events are only delivered asynchronously */
+    if (flags & PROC_EVENT_LISTEN_EXIT && !(flags & PROC_EVENT_RING))
+        return -EINVAL;
+
     struct proc_event_sub *new_sub = (proc_event_sub *) zalloc(sizeof(*new_sub));
 
     if (!new_sub)
         return -ENOMEM;
 
+    if (flags & PROC_EVENT_RING)
+    {
+        new_sub->ring = proc_event_ring_alloc();
+        if (!new_sub->ring)
+        {
+            free(new_sub);
+            return -ENOMEM;
+        }
+    }
+
     new_sub->waiting_thread = get_current_thread();
     new_sub->flags = flags;
     new_sub->next = NULL;
@@ -143,6 +295,7 @@ int sys_proc_event_attach(pid_t pid, unsigned long flags)
     struct inode *ino = inode_create(false);
     if (!ino)
     {
+        free(new_sub->ring);
         free(new_sub);
         return -ENOMEM;
     }
@@ -155,6 +308,7 @@ int sys_proc_event_attach(pid_t pid, unsigned long flags)
     if (!p)
     {
         free(ino);
+        free(new_sub->ring);
         free(new_sub);
         return -ESRCH;
     }
@@ -186,6 +340,7 @@ int sys_proc_event_attach(pid_t pid, unsigned long flags)
         process_put(p);
         free(ino);
         dput(d);
+        free(new_sub->ring);
         free(new_sub);
         return -errno;
     }
@@ -210,43 +365,63 @@ void proc_event_do_ack(struct process *process)
 #if __x86_64__
 #include <onyx/x86/msr.h>
 #endif
-void proc_event_enter_syscall(struct syscall_frame *regs, uintptr_t rax)
+static void proc_event_fill_syscall_enter(struct proc_event *ev, struct syscall_frame *regs,
+                                          uintptr_t rax)
 {
     struct process *current = get_current_process();
 
-    for (struct proc_event_sub *s = current->sub_queue; s; s = s->next)
-    {
+    ev->type = PROC_EVENT_SYSCALL_ENTER;
+    ev->pid = current->get_pid();
+    ev->thread = get_current_thread()->id;
 #if __x86_64__
-        s->event_buf.type = PROC_EVENT_SYSCALL_ENTER;
-        s->event_buf.pid = current->get_pid();
-        s->event_buf.thread = get_current_thread()->id;
-        s->event_buf.e_un.syscall.cs = USER_CS;
-        s->event_buf.e_un.syscall.ds = regs->ds;
-        s->event_buf.e_un.syscall.eflags = regs->rflags;
-        s->event_buf.e_un.syscall.es = regs->ds;
-        s->event_buf.e_un.syscall.fs = regs->ds;
-        s->event_buf.e_un.syscall.fs_base = (unsigned long) get_current_thread()->fs;
-        s->event_buf.e_un.syscall.gs = regs->ds;
-        s->event_buf.e_un.syscall.gs_base = (unsigned long) get_current_thread()->gs;
-        s->event_buf.e_un.syscall.orig_rax = rax;
-        s->event_buf.e_un.syscall.ss = regs->ds;
-        s->event_buf.e_un.syscall.r10 = regs->r10;
-        s->event_buf.e_un.syscall.r11 = 0;
-        s->event_buf.e_un.syscall.r12 = regs->r12;
-        s->event_buf.e_un.syscall.r13 = regs->r13;
-        s->event_buf.e_un.syscall.r14 = regs->r14;
-        s->event_buf.e_un.syscall.r15 = regs->r15;
-        s->event_buf.e_un.syscall.rax = rax;
-        s->event_buf.e_un.syscall.r8 = regs->r8;
-        s->event_buf.e_un.syscall.r9 = regs->r9;
-        s->event_buf.e_un.syscall.rsp = (unsigned long) regs->user_sp;
-        s->event_buf.e_un.syscall.rbx = regs->rbx;
-        s->event_buf.e_un.syscall.rbp = regs->rbp;
-        s->event_buf.e_un.syscall.rcx = regs->r10;
-        s->event_buf.e_un.syscall.rdx = regs->rdx;
-        s->event_buf.e_un.syscall.rdi = regs->rdi;
-        s->event_buf.e_un.syscall.rip = regs->rip;
+    ev->e_un.syscall.cs = USER_CS;
+    ev->e_un.syscall.ds = regs->ds;
+    ev->e_un.syscall.eflags = regs->rflags;
+    ev->e_un.syscall.es = regs->ds;
+    ev->e_un.syscall.fs = regs->ds;
+    ev->e_un.syscall.fs_base = (unsigned long) get_current_thread()->fs;
+    ev->e_un.syscall.gs = regs->ds;
+    ev->e_un.syscall.gs_base = (unsigned long) get_current_thread()->gs;
+    ev->e_un.syscall.orig_rax = rax;
+    ev->e_un.syscall.ss = regs->ds;
+    ev->e_un.syscall.r10 = regs->r10;
+    ev->e_un.syscall.r11 = 0;
+    ev->e_un.syscall.r12 = regs->r12;
+    ev->e_un.syscall.r13 = regs->r13;
+    ev->e_un.syscall.r14 = regs->r14;
+    ev->e_un.syscall.r15 = regs->r15;
+    ev->e_un.syscall.rax = rax;
+    ev->e_un.syscall.r8 = regs->r8;
+    ev->e_un.syscall.r9 = regs->r9;
+    ev->e_un.syscall.rsp = (unsigned long) regs->user_sp;
+    ev->e_un.syscall.rbx = regs->rbx;
+    ev->e_un.syscall.rbp = regs->rbp;
+    ev->e_un.syscall.rcx = regs->r10;
+    ev->e_un.syscall.rdx = regs->rdx;
+    ev->e_un.syscall.rdi = regs->rdi;
+    ev->e_un.syscall.rip = regs->rip;
 #endif
+}
+
+/**
+ * @brief Deliver a syscall event to every subscriber, and wait for the synchronous ones to ack
+ *
+ * @param ev Event
+ */
+static void proc_event_deliver_syscall(const struct proc_event *ev)
+{
+    struct process *current = get_current_process();
+
+    for (struct proc_event_sub *s = current->sub_queue; s; s = s->next)
+    {
+        if (s->ring)
+        {
+            if (s->flags & PROC_EVENT_LISTEN_SYSCALLS)
+                proc_event_ring_push(s->ring, ev);
+            continue;
+        }
+
+        memcpy(&s->event_buf, ev, sizeof(*ev));
         s->has_new_event = true;
 
         sem_signal(&s->event_semaphore);
@@ -262,30 +437,53 @@ void proc_event_enter_syscall(struct syscall_frame *regs, uintptr_t rax)
     mutex_unlock(&current->condvar_mutex);
 }
 
-void proc_event_exit_syscall(long retval, long syscall_nr)
+void proc_event_enter_syscall(struct syscall_frame *regs, uintptr_t rax)
 {
     struct process *current = get_current_process();
+    struct proc_event ev;
 
-    for (struct proc_event_sub *s = current->sub_queue; s; s = s->next)
-    {
-#if __x86_64__
-        s->event_buf.type = PROC_EVENT_SYSCALL_EXIT;
-        s->event_buf.pid = current->get_pid();
-        s->event_buf.e_un.syscall_exit.retval = retval;
-        s->event_buf.e_un.syscall_exit.syscall_nr = syscall_nr;
-        s->event_buf.thread = get_current_thread()->id;
-#endif
-        s->has_new_event = true;
+    if (!current->sub_queue)
+        return;
 
-        sem_signal(&s->event_semaphore);
-    }
+    proc_event_fill_syscall_enter(&ev, regs, rax);
+    proc_event_deliver_syscall(&ev);
+}
 
-    if (current->nr_subs == 0)
+void proc_event_exit_syscall(long retval, long syscall_nr)
+{
+    struct process *current = get_current_process();
+    struct proc_event ev;
+
+    if (!current->sub_queue)
         return;
 
-    mutex_lock(&current->condvar_mutex);
-    condvar_wait(&current->syscall_cond, &current->condvar_mutex);
+    ev.type = PROC_EVENT_SYSCALL_EXIT;
+    ev.pid = current->get_pid();
+    ev.thread = get_current_thread()->id;
+    ev.e_un.syscall_exit.retval = retval;
+    ev.e_un.syscall_exit.syscall_nr = syscall_nr;
+    proc_event_deliver_syscall(&ev);
+}
 
-    current->nr_acks = 0;
-    mutex_unlock(&current->condvar_mutex);
+void proc_event_exit(unsigned int exit_code)
+{
+    struct process *current = get_current_process();
+    struct proc_event ev = {};
+
+    ev.type = PROC_EVENT_EXIT;
+    ev.pid = current->get_pid();
+    ev.thread = get_current_thread()->id;
+    ev.e_un.exit.wstatus = exit_code;
+
+    for (struct proc_event_sub *s = current->sub_queue; s; s = s->next)
+    {
+        if (s->ring && s->flags & PROC_EVENT_LISTEN_EXIT)
+            proc_event_ring_push(s->ring, &ev);
+
+        WRITE_ONCE(s->valid_sub, false);
+
+        /* Wake up readers and pollers, so they see the sub is gone */
+        if (s->ring)
+            wait_queue_wake_all(&s->ring->wq);
+    }
 }
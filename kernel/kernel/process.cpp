@@ -15,6 +15,7 @@
 #include <sys/wait.h>
 
 #include <onyx/binfmt.h>
+#include <onyx/cgroup.h>
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
 #include <onyx/dentry.h>
@@ -28,6 +29,7 @@
 #include <onyx/page.h>
 #include <onyx/panic.h>
 #include <onyx/pid.h>
+#include <onyx/pidfd.h>
 #include <onyx/proc_event.h>
 #include <onyx/process.h>
 #include <onyx/random.h>
@@ -43,6 +45,9 @@
 #include <onyx/vfork_completion.h>
 #include <onyx/worker.h>
 
+#include <uapi/fcntl.h>
+#include <uapi/sched.h>
+
 ids *process_ids = nullptr;
 
 process *first_process = nullptr;
@@ -102,6 +107,8 @@ pid_t process_get_active_processes()
 process::process() : pgrp_node{this}, session_node{this}
 {
     init_wait_queue_head(&this->wait_child_event);
+    init_wait_queue_head(&this->signalfd_wq);
+    init_wait_queue_head(&this->pidfd_wq);
     mutex_init(&condvar_mutex);
     spinlock_init(&ctx.fdlock);
     active_processes++;
@@ -118,6 +125,7 @@ process::process() : pgrp_node{this}, session_node{this}
     exit_code = 0;
     personality = 0;
     parent = nullptr;
+    cgroup = nullptr;
     user_time = system_time = children_stime = children_utime = 0;
     spinlock_init(&sub_queue_lock);
     sub_queue = nullptr;
@@ -132,6 +140,8 @@ process::~process()
         process_group->remove_process(this, PIDTYPE_PGRP);
     if (session) [[likely]]
         session->remove_process(this, PIDTYPE_SID);
+    if (cgroup)
+        cgroup_put(cgroup);
     active_processes--;
 }
 
@@ -163,7 +173,7 @@ bool process::set_cmdline(const std::string_view &path)
     return true;
 }
 
-process *process_create(const std::string_view &cmd_line, ioctx *ctx, process *parent)
+process *process_create(const std::string_view &cmd_line, ioctx *ctx, process *parent, pid_t pid)
 {
     /* FIXME: Failure here kinda sucks and is probably super leaky */
     if (unlikely(!process_ids))
@@ -180,8 +190,10 @@ process *process_create(const std::string_view &cmd_line, ioctx *ctx, process *p
 
     /* TODO: idm_get_id doesn't wrap? POSIX COMPLIANCE */
     proc->refcount = 1;
-    proc->pid_ = idm_get_id(process_ids);
+    /* Specific pids were already reserved by the caller */
+    proc->pid_ = pid ?: idm_get_id(process_ids);
     assert(proc->pid_ != (pid_t) -1);
+    proc->exit_signal = SIGCHLD;
 
     if (!proc->set_cmdline(cmd_line))
         return errno = ENOMEM, nullptr;
@@ -263,6 +275,8 @@ process *process_create(const std::string_view &cmd_line, ioctx *ctx, process *p
         proc->address_space = ex.value();
     }
 
+    cgroup_fork(proc, parent);
+
     process_append_to_global_list(proc);
 
     INIT_LIST_HEAD(&proc->thread_list);
@@ -349,12 +363,13 @@ struct wait_info
     int wstatus;
     rusage usage;
     pid_t pid;
+    uid_t uid;
     int status;
     unsigned int flags;
     unsigned int options;
 
     wait_info(pid_t pid, unsigned int options)
-        : wstatus{}, usage{}, pid{pid}, status{-ECHILD}, flags{}, options{options}
+        : wstatus{}, usage{}, pid{pid}, uid{}, status{-ECHILD}, flags{}, options{options}
     {
         /* pid = -1: matches any process;
          * pid < 0: matches processes with pgid = -pid;
@@ -378,9 +393,6 @@ struct wait_info
 
             flags |= WAIT_INFO_MATCH_PGID;
         }
-
-        /* WEXITED is always implied for wait4 */
-        this->options |= WEXITED;
     }
 
     bool reap_wait() const
@@ -472,6 +484,7 @@ bool process_wait_exit(process *child, wait_info &winfo)
     do_getrusage(RUSAGE_BOTH, &winfo.usage, child);
 
     winfo.pid = child->get_pid();
+    winfo.uid = child->cred.ruid;
     winfo.wstatus = child->exit_code;
 
     if (winfo.reap_wait())
@@ -510,6 +523,7 @@ bool process_wait_stop(process *child, wait_info &winfo)
     do_getrusage(RUSAGE_BOTH, &winfo.usage, child);
 
     winfo.pid = child->get_pid();
+    winfo.uid = child->cred.ruid;
 
     winfo.wstatus = child->exit_code;
 
@@ -540,6 +554,7 @@ bool process_wait_cont(process *child, wait_info &winfo)
     do_getrusage(RUSAGE_BOTH, &winfo.usage, child);
 
     winfo.pid = child->get_pid();
+    winfo.uid = child->cred.ruid;
 
     winfo.wstatus = child->exit_code;
 
@@ -587,15 +602,16 @@ bool wait_handle_processes(process *proc, wait_info &winfo)
 
 #define VALID_WAIT4_OPTIONS (WNOHANG | WUNTRACED | WSTOPPED | WEXITED | WCONTINUED | WNOWAIT)
 
-pid_t sys_wait4(pid_t pid, int *wstatus, int options, rusage *usage)
+/**
+ * @brief Wait for a child process, as described by \p w
+ *
+ * @param w Wait info
+ * @return 1 if a child was waited for, 0 if WNOHANG and no child was ready, or negative error code
+ */
+static int do_wait(wait_info &w)
 {
     auto current = get_current_process();
 
-    if (options & ~VALID_WAIT4_OPTIONS)
-        return -EINVAL;
-
-    wait_info w{pid, (unsigned int) options};
-
     int st =
         wait_for_event_interruptible(&current->wait_child_event, wait_handle_processes(current, w));
 
@@ -608,6 +624,19 @@ pid_t sys_wait4(pid_t pid, int *wstatus, int options, rusage *usage)
 
     if (w.status != WINFO_STATUS_OK)
         return w.status == WINFO_STATUS_NOHANG ? 0 : w.status;
+    return 1;
+}
+
+pid_t sys_wait4(pid_t pid, int *wstatus, int options, rusage *usage)
+{
+    if (options & ~VALID_WAIT4_OPTIONS)
+        return -EINVAL;
+
+    /* WEXITED is always implied for wait4 */
+    wait_info w{pid, (unsigned int) options | WEXITED};
+
+    if (int st = do_wait(w); st <= 0)
+        return st;
 
 #if 0
 	printk("w.wstatus: %d\n", w.wstatus);
@@ -622,38 +651,213 @@ pid_t sys_wait4(pid_t pid, int *wstatus, int options, rusage *usage)
     return w.pid;
 }
 
+#define VALID_WAITID_OPTIONS (WNOHANG | WSTOPPED | WEXITED | WCONTINUED | WNOWAIT)
+
+/**
+ * @brief Fill the siginfo for waitid, from the wait status
+ *
+ * @param w Wait info, after waiting
+ * @param info siginfo to fill
+ */
+static void waitid_fill_siginfo(const wait_info &w, siginfo_t *info)
+{
+    info->si_signo = SIGCHLD;
+    info->si_pid = w.pid;
+    info->si_uid = w.uid;
+
+    if (WIFCONTINUED(w.wstatus))
+    {
+        info->si_code = CLD_CONTINUED;
+        info->si_status = SIGCONT;
+    }
+    else if (WIFSTOPPED(w.wstatus))
+    {
+        info->si_code = CLD_STOPPED;
+        info->si_status = WSTOPSIG(w.wstatus);
+    }
+    else if (WIFSIGNALED(w.wstatus))
+    {
+        info->si_code = WCOREDUMP(w.wstatus) ? CLD_DUMPED : CLD_KILLED;
+        info->si_status = WTERMSIG(w.wstatus);
+    }
+    else
+    {
+        info->si_code = CLD_EXITED;
+        info->si_status = WEXITSTATUS(w.wstatus);
+    }
+}
+
+int sys_waitid(int idtype, id_t id, siginfo_t *uinfo, int options, rusage *usage)
+{
+    pid_t pid;
+
+    if (options & ~VALID_WAITID_OPTIONS)
+        return -EINVAL;
+
+    /* waitid needs to be told what to wait for */
+    if (!(options & (WEXITED | WSTOPPED | WCONTINUED)))
+        return -EINVAL;
+
+    switch (idtype)
+    {
+        case P_ALL:
+            pid = -1;
+            break;
+        case P_PID:
+            if ((pid_t) id <= 0)
+                return -EINVAL;
+            pid = id;
+            break;
+        case P_PGID:
+            /* pgid = 0 means our own pgid, like in wait4 */
+            if ((pid_t) id < 0)
+                return -EINVAL;
+            pid = -(pid_t) id;
+            break;
+        case P_PIDFD: {
+            auto_file f = get_file_description(id);
+            if (!f)
+                return -EBADF;
+            struct process *p = pidfd_to_process(f.get_file());
+            if (!p)
+                return -EINVAL;
+            pid = p->get_pid();
+            break;
+        }
+        default:
+            return -EINVAL;
+    }
+
+    wait_info w{pid, (unsigned int) options};
+    siginfo_t info = {};
+
+    int st = do_wait(w);
+    if (st < 0)
+        return st;
+
+    /* If WNOHANG and there was no child to report, the siginfo is zeroed */
+    if (st > 0)
+        waitid_fill_siginfo(w, &info);
+
+    if ((uinfo && copy_to_user(uinfo, &info, sizeof(siginfo_t)) < 0) ||
+        (usage && copy_to_user(usage, &w.usage, sizeof(rusage)) < 0))
+        return -EFAULT;
+
+    return 0;
+}
+
 void process_copy_current_sigmask(thread *dest)
 {
     memcpy(&dest->sinfo.sigmask, &get_current_thread()->sinfo.sigmask, sizeof(sigset_t));
 }
 
-#define FORK_SHARE_MM (1 << 0)
-#define FORK_VFORK    (1 << 1)
+/* Arguments for process_clone, as given to fork/vfork/clone3 */
+struct kernel_clone_args
+{
+    /* CLONE_* */
+    u64 flags;
+    int exit_signal;
+    /* Specific PID for the child, or 0 */
+    pid_t set_tid;
+    int *pidfd;
+    pid_t *child_tid;
+    pid_t *parent_tid;
+    struct fork_thread_args thread;
+    /* cgroup to start the child in (CLONE_INTO_CGROUP), or NULL */
+    struct cgroup *cgroup;
+};
+
+/**
+ * @brief Write the child's TID to its address space (CLONE_CHILD_SETTID)
+ *
+ * @param child Child process
+ * @param utid Pointer to the TID, in the child's address space
+ * @param tid TID to write
+ * @return 0 on success, -EFAULT on error
+ */
+static int process_put_child_tid(process *child, pid_t *utid, pid_t tid)
+{
+    /* The child's address space is a copy of ours (unless CLONE_VM), so switch to it */
+    mm_address_space *old = vm_set_aspace(child->address_space.get());
+    int st = copy_to_user(utid, &tid, sizeof(pid_t));
+    vm_set_aspace(old);
+    return st < 0 ? -EFAULT : 0;
+}
 
-pid_t sys_fork_internal(syscall_frame *ctx, unsigned int flags)
+/**
+ * @brief Reset the child's signal handlers to the default (CLONE_CLEAR_SIGHAND)
+ *
+ * @param child Child process
+ */
+static void process_clear_sighand(process *child)
+{
+    scoped_lock g{child->signal_lock};
+
+    for (auto &sa : child->sigtable)
+    {
+        if (sa.sa_handler != SIG_IGN)
+            sa.sa_handler = NULL;
+    }
+}
+
+/**
+ * @brief Get rid of a child that never got to run. Used when clone fails halfway through.
+ *
+ * @param child Child process
+ * @param thread The child's thread, not started yet
+ */
+static void process_abort_child(process *child, thread *thread)
+{
+    pid_t pid = child->get_pid();
+
+    /* The thread dies as soon as it tries to get to user space. Reap it after it does. */
+    kernel_raise_signal(SIGKILL, child, SIGNAL_FORCE, nullptr);
+    sched_start_thread(thread);
+    sys_wait4(pid, nullptr, 0, nullptr);
+}
+
+/**
+ * @brief Create a child process, starting from the current thread's state
+ *
+ * @param ctx Syscall frame of the current thread
+ * @param args Clone arguments
+ * @return The child's PID, or negative error code
+ */
+static pid_t process_clone(syscall_frame *ctx, const struct kernel_clone_args &args)
 {
     process *proc;
     process *child;
     thread_t *to_be_forked;
+    int pidfd = -1;
+    int st = 0;
 
     proc = (process *) get_current_process();
     to_be_forked = get_current_thread();
+
+    if (args.set_tid && !idm_reserve_id(process_ids, args.set_tid))
+        return -EEXIST;
+
     /* Create a new process */
 
     {
         // We need to lock here to protect against concurrent changes
         scoped_mutex g{proc->name_lock};
 
-        child = process_create(proc->cmd_line, &proc->ctx, proc);
+        child = process_create(proc->cmd_line, &proc->ctx, proc, args.set_tid);
 
         if (!child)
+        {
+            if (args.set_tid)
+                idm_release_id(process_ids, args.set_tid);
             return -ENOMEM;
+        }
     }
 
     child->flags |= PROCESS_FORKED;
+    child->exit_signal = args.exit_signal;
 
     /* Fork the vmm data and the address space */
-    if (flags & FORK_SHARE_MM)
+    if (args.flags & CLONE_VM)
     {
         child->address_space = proc->address_space;
         trace_vm_share_mm();
@@ -666,10 +870,13 @@ pid_t sys_fork_internal(syscall_frame *ctx, unsigned int flags)
         child->address_space = ex.value();
     }
 
+    if (args.flags & CLONE_CLEAR_SIGHAND)
+        process_clear_sighand(child);
+
     process_get(child);
 
     /* Fork and create the new thread */
-    thread *new_thread = process_fork_thread(to_be_forked, child, ctx);
+    thread *new_thread = process_fork_thread(to_be_forked, child, ctx, &args.thread);
 
     if (!new_thread)
     {
@@ -678,15 +885,49 @@ pid_t sys_fork_internal(syscall_frame *ctx, unsigned int flags)
 
     process_copy_current_sigmask(new_thread);
 
+    auto pid = child->get_pid();
+
+    if (args.flags & CLONE_CHILD_CLEARTID)
+        new_thread->ctid = args.child_tid;
+
+    if (args.cgroup)
+        st = cgroup_attach_process(args.cgroup, child);
+
+    if (st == 0 && args.flags & CLONE_CHILD_SETTID)
+        st = process_put_child_tid(child, args.child_tid, new_thread->id);
+
+    if (st == 0 && args.flags & CLONE_PARENT_SETTID)
+    {
+        if (copy_to_user(args.parent_tid, &new_thread->id, sizeof(pid_t)) < 0)
+            st = -EFAULT;
+    }
+
+    if (st == 0 && args.flags & CLONE_PIDFD)
+    {
+        /* pidfds are always O_CLOEXEC, like in Linux */
+        st = pidfd = pidfd_create(child, O_CLOEXEC);
+        if (pidfd >= 0 && copy_to_user(args.pidfd, &pidfd, sizeof(int)) < 0)
+            st = -EFAULT;
+    }
+
+    if (st < 0)
+    {
+        if (pidfd >= 0)
+            file_close(pidfd);
+        process_abort_child(child, new_thread);
+        process_put(child);
+        return st;
+    }
+
     vfork_completion vfork_cmpl;
-    if (flags & FORK_VFORK)
+    if (args.flags & CLONE_VFORK)
     {
         child->vfork_compl = &vfork_cmpl;
     }
 
     sched_start_thread(new_thread);
 
-    if (flags & FORK_VFORK)
+    if (args.flags & CLONE_VFORK)
     {
         // We wait for the vforked child to do its thing, and then we wait until its safe to exit
         // i.e the child has finished waking up waiters.
@@ -696,19 +937,96 @@ pid_t sys_fork_internal(syscall_frame *ctx, unsigned int flags)
     }
 
     // Return the pid to the caller
-    auto pid = child->get_pid();
     process_put(child);
     return pid;
 }
 
 pid_t sys_fork(syscall_frame *ctx)
 {
-    return sys_fork_internal(ctx, 0);
+    struct kernel_clone_args args = {};
+    args.exit_signal = SIGCHLD;
+    return process_clone(ctx, args);
 }
 
 pid_t sys_vfork(syscall_frame *ctx)
 {
-    return sys_fork_internal(ctx, FORK_SHARE_MM | FORK_VFORK);
+    struct kernel_clone_args args = {};
+    args.flags = CLONE_VM | CLONE_VFORK;
+    args.exit_signal = SIGCHLD;
+    return process_clone(ctx, args);
+}
+
+/* Threads are created with clone() */
+#define CLONE3_VALID_FLAGS                                                                    \
+    (CLONE_VM | CLONE_VFORK | CLONE_PIDFD | CLONE_SETTLS | CLONE_PARENT_SETTID |              \
+     CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID | CLONE_CLEAR_SIGHAND | CLONE_INTO_CGROUP)
+
+pid_t sys_clone3(struct clone_args *uargs, size_t size, syscall_frame *ctx)
+{
+    struct clone_args args;
+    struct kernel_clone_args kargs = {};
+
+    if (size < CLONE_ARGS_SIZE_VER0)
+        return -EINVAL;
+    if (size > PAGE_SIZE)
+        return -E2BIG;
+
+    if (int st = copy_struct_from_user(&args, sizeof(args), uargs, size); st < 0)
+        return st;
+
+    if (args.flags & ~CLONE3_VALID_FLAGS)
+        return -EINVAL;
+
+    if (args.exit_signal >= _NSIG)
+        return -EINVAL;
+
+    /* The stack is given as (base, size), both or neither must be set */
+    if (!args.stack != !args.stack_size)
+        return -EINVAL;
+
+    /* We don't have PID namespaces, so there's a single level of PIDs to set */
+    if (args.set_tid_size > 1 || (!args.set_tid_size && args.set_tid))
+        return -EINVAL;
+
+    if (args.set_tid_size)
+    {
+        if (!is_root_user())
+            return -EPERM;
+
+        if (copy_from_user(&kargs.set_tid, (const void *) args.set_tid, sizeof(pid_t)) < 0)
+            return -EFAULT;
+
+        if (kargs.set_tid <= 0)
+            return -EINVAL;
+    }
+
+    kargs.flags = args.flags;
+    kargs.exit_signal = (int) args.exit_signal;
+    kargs.pidfd = (int *) args.pidfd;
+    kargs.child_tid = (pid_t *) args.child_tid;
+    kargs.parent_tid = (pid_t *) args.parent_tid;
+    kargs.thread.stack = args.stack ? args.stack + args.stack_size : 0;
+    kargs.thread.tls = args.tls;
+    kargs.thread.set_tls = args.flags & CLONE_SETTLS;
+
+    if (args.flags & CLONE_INTO_CGROUP)
+    {
+        if (size < CLONE_ARGS_SIZE_VER2 || args.cgroup > INT_MAX)
+            return -EINVAL;
+
+        auto_file f = get_file_description((int) args.cgroup);
+        if (!f.get_file())
+            return -EBADF;
+
+        kargs.cgroup = cgroupfs_file_to_cgroup(f.get_file());
+        if (!kargs.cgroup)
+            return -EINVAL;
+    }
+
+    pid_t pid = process_clone(ctx, kargs);
+    if (kargs.cgroup)
+        cgroup_put(kargs.cgroup);
+    return pid;
 }
 
 #define W_STOPPING         0x7f
@@ -869,7 +1187,11 @@ void process_reparent_children(process *proc)
     }
 
     for (process *c = proc->children; c != nullptr; c = c->next_sibbling)
+    {
         c->parent = new_parent;
+        /* init only wants to hear about SIGCHLD */
+        c->exit_signal = SIGCHLD;
+    }
 
     process_append_children(new_parent, proc->children);
 }
@@ -924,12 +1246,16 @@ void process_kill_other_threads(void)
 
     process_kill_other_threads();
 
+    futex_exit_pi(get_current_thread());
+
     process_destroy_file_descriptors(current);
 
     /* We destroy the address space after fds because some close() routines may require address
      * space access */
     process_destroy_aspace();
 
+    cgroup_exit(current);
+
     if (current->vfork_compl)
     {
         current->vfork_compl->wake();
@@ -938,17 +1264,14 @@ void process_kill_other_threads(void)
 
     process_reparent_children(current);
 
-    for (proc_event_sub *s = current->sub_queue; s; s = s->next)
-    {
-        s->valid_sub = false;
-    }
+    proc_event_exit(exit_code);
 
     /* TODO: This is broken, we need a ref... */
     struct process *parent = READ_ONCE(current->parent);
 
     siginfo_t info = {};
 
-    info.si_signo = SIGCHLD;
+    info.si_signo = current->exit_signal;
     info.si_pid = current->get_pid();
     info.si_uid = current->cred.ruid;
     info.si_stime = current->system_time / NS_PER_MS;
@@ -976,7 +1299,10 @@ void process_kill_other_threads(void)
         current->signal_group_flags |= SIGNAL_GROUP_EXIT;
     }
 
-    kernel_raise_signal(SIGCHLD, parent, 0, &info);
+    wait_queue_wake_all(&current->pidfd_wq);
+
+    if (info.si_signo)
+        kernel_raise_signal(info.si_signo, parent, 0, &info);
 
     /* Set this in this order exactly */
     current_thread->flags = THREAD_IS_DYING;
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/atomic.h>
+#include <onyx/cgroup.h>
+#include <onyx/cpu.h>
+#include <onyx/cpu_cgroup.h>
+#include <onyx/err.h>
+#include <onyx/mutex.h>
+#include <onyx/process.h>
+#include <onyx/scheduler.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/spinlock.h>
+#include <onyx/thread.h>
+#include <onyx/timer.h>
+
+/**
+ * CPU cgroup controller. Priorities still come first: the scheduler looks at the highest priority
+ * queue with runnable threads, and we only get to pick which thread out of that queue runs.
+ *
+ * Weights: every cgroup keeps, per CPU, a virtual runtime (the CPU time it got on that CPU, scaled
+ * by 100 / cpu.weight). The threads that live directly in a cgroup compete with its children as a
+ * single entity of default weight (self_vruntime). Two threads are compared by walking up to their
+ * common ancestor, and looking at the entities right under it: the one with the lowest vruntime
+ * goes first. This makes shares hierarchical, and makes a group's share independent of the number
+ * of threads it has. Entities that haven't run in a while are clamped to a bit below the vruntime
+ * of the last entity that ran (min_vruntime), so sleeping doesn't build up credit.
+ *
+ * Bandwidth: a cgroup with a cpu.max quota gets quota ns of runtime every period, shared by every
+ * CPU. Ticks take runtime out of the cgroup and all of its ancestors; once it runs out, the cgroup
+ * gets throttled and its threads are skipped by the pick path until the period timer refills it.
+ */
+
+#ifndef CONFIG_SMP_NR_CPUS
+#define CONFIG_SMP_NR_CPUS 64
+#endif
+
+#define CPU_WEIGHT_DFL 100U
+#define CPU_WEIGHT_MIN 1U
+#define CPU_WEIGHT_MAX 10000U
+
+#define CPU_QUOTA_MAX  ((hrtime_t) -1)
+#define CPU_QUOTA_MIN  NS_PER_MS
+#define CPU_PERIOD_DFL (100 * NS_PER_MS)
+#define CPU_PERIOD_MIN NS_PER_MS
+#define CPU_PERIOD_MAX NS_PER_SEC
+/* How far behind min_vruntime an entity is allowed to be (in default weight ns) */
+#define CPU_VRUNTIME_SLACK (20 * NS_PER_MS)
+
+struct cpu_cgroup_pcpu
+{
+    /* Virtual runtime of this cgroup, as an entity of its parent */
+    u64 vruntime;
+    /* Virtual runtime of the threads directly in this cgroup */
+    u64 self_vruntime;
+    /* Vruntime of the last child entity that ran, the floor for the others */
+    u64 min_vruntime;
+};
+
+struct cpu_cgroup
+{
+    struct cgroup_subsys_state css{};
+    struct cpu_cgroup *parent{nullptr};
+    unsigned int depth{0};
+    unsigned int weight{CPU_WEIGHT_DFL};
+
+    /* Bandwidth control. lock protects the config and the throttling state. */
+    struct spinlock lock;
+    hrtime_t quota{CPU_QUOTA_MAX};
+    hrtime_t period{CPU_PERIOD_DFL};
+    /* Runtime left in this period. Goes negative if we overrun, the debt is paid off next period. */
+    long runtime{0};
+    bool throttled{false};
+    hrtime_t throttled_since{0};
+    struct clockevent period_timer;
+
+    /* Stats, in ns. Usage is hierarchical. */
+    unsigned long usage{0};
+    unsigned long user_usage{0};
+    unsigned long system_usage{0};
+    unsigned long nr_periods{0};
+    unsigned long nr_throttled{0};
+    unsigned long throttled_time{0};
+
+    struct cpu_cgroup_pcpu pcpu[CONFIG_SMP_NR_CPUS]{};
+
+    cpu_cgroup()
+    {
+        spinlock_init(&lock);
+    }
+};
+
+static struct cpu_cgroup cpu_cgroup_root;
+/* Number of cgroups besides the root. While 0, the pick path doesn't need to do anything. */
+static unsigned long cpu_cgroup_nr_groups;
+/* Serializes cpu.max writes */
+static DECLARE_MUTEX(cpu_cgroup_config_lock);
+
+static inline struct cpu_cgroup *css_to_cpucg(struct cgroup_subsys_state *css)
+{
+    return container_of(css, struct cpu_cgroup, css);
+}
+
+static inline struct cpu_cgroup *cgroup_to_cpucg(struct cgroup *cg)
+{
+    return css_to_cpucg(cgroup_css(cg, CGROUP_CPU_SUBSYS));
+}
+
+static struct cpu_cgroup *thread_cpu_cgroup(struct thread *t)
+{
+    /* Threads can't be freed while on a run queue, nor can their cgroup while we're atomic */
+    struct cgroup *cg = t->owner ? READ_ONCE(t->owner->cgroup) : nullptr;
+    return cgroup_to_cpucg(cg ?: &cgroup_root);
+}
+
+static bool cpu_cgroup_is_throttled(struct cpu_cgroup *cg)
+{
+    for (; cg; cg = cg->parent)
+    {
+        if (READ_ONCE(cg->throttled))
+            return true;
+    }
+
+    return false;
+}
+
+static u64 cpu_cgroup_vruntime_floor(struct cpu_cgroup_pcpu *parent)
+{
+    return parent->min_vruntime > CPU_VRUNTIME_SLACK ? parent->min_vruntime - CPU_VRUNTIME_SLACK
+                                                     : 0;
+}
+
+/**
+ * @brief Check if a thread in a should run before a thread in b
+ *
+ * @param a cgroup of the first thread
+ * @param b cgroup of the second thread
+ * @param cpu CPU we're picking for
+ * @return True if a's entity has the lowest vruntime
+ */
+static bool cpu_cgroup_before(struct cpu_cgroup *a, struct cpu_cgroup *b, unsigned int cpu)
+{
+    struct cpu_cgroup *child_a = nullptr, *child_b = nullptr;
+    struct cpu_cgroup *lca_a = a, *lca_b = b;
+
+    if (a == b)
+        return false;
+
+    /* Walk up to the common ancestor, remembering the entities right under it */
+    while (lca_a->depth > lca_b->depth)
+    {
+        child_a = lca_a;
+        lca_a = lca_a->parent;
+    }
+
+    while (lca_b->depth > lca_a->depth)
+    {
+        child_b = lca_b;
+        lca_b = lca_b->parent;
+    }
+
+    while (lca_a != lca_b)
+    {
+        child_a = lca_a;
+        lca_a = lca_a->parent;
+        child_b = lca_b;
+        lca_b = lca_b->parent;
+    }
+
+    struct cpu_cgroup_pcpu *parent = &lca_a->pcpu[cpu];
+    u64 floor = cpu_cgroup_vruntime_floor(parent);
+    u64 vr_a = child_a ? child_a->pcpu[cpu].vruntime : parent->self_vruntime;
+    u64 vr_b = child_b ? child_b->pcpu[cpu].vruntime : parent->self_vruntime;
+
+    return (vr_a < floor ? floor : vr_a) < (vr_b < floor ? floor : vr_b);
+}
+
+struct thread *cpu_cgroup_pick(struct thread *queue, unsigned int cpu)
+{
+    struct thread *best = nullptr;
+    struct cpu_cgroup *best_cg = nullptr;
+
+    if (!READ_ONCE(cpu_cgroup_nr_groups))
+        return queue;
+
+    /* Run queues are short, a linear scan is fine. On ties, the first thread in the queue wins,
+     * which keeps round-robin behavior inside a cgroup. */
+    for (struct thread *t = queue; t; t = t->next_prio)
+    {
+        struct cpu_cgroup *cg = thread_cpu_cgroup(t);
+
+        if (cpu_cgroup_is_throttled(cg))
+            continue;
+
+        if (!best || cpu_cgroup_before(cg, best_cg, cpu))
+        {
+            best = t;
+            best_cg = cg;
+        }
+    }
+
+    return best;
+}
+
+static void cpu_cgroup_charge_vruntime(u64 *vruntime, struct cpu_cgroup_pcpu *parent,
+                                       hrtime_t delta, unsigned int weight)
+{
+    u64 floor = cpu_cgroup_vruntime_floor(parent);
+    u64 vr = *vruntime < floor ? floor : *vruntime;
+
+    if (vr > parent->min_vruntime)
+        parent->min_vruntime = vr;
+    *vruntime = vr + delta * CPU_WEIGHT_DFL / weight;
+}
+
+static void cpu_cgroup_throttle(struct cpu_cgroup *cg)
+{
+    scoped_lock<spinlock, true> g{cg->lock};
+
+    /* Recheck under the lock, the period timer or a cpu.max write may have refilled us */
+    if (cg->throttled || cg->quota == CPU_QUOTA_MAX || READ_ONCE(cg->runtime) > 0)
+        return;
+
+    WRITE_ONCE(cg->throttled, true);
+    cg->throttled_since = clocksource_get_time();
+    cg->nr_throttled++;
+}
+
+void cpu_cgroup_account(struct thread *curr, hrtime_t delta, bool system)
+{
+    unsigned int cpu = get_cpu_nr();
+    struct cpu_cgroup *cg = thread_cpu_cgroup(curr);
+    bool throttled = false;
+
+    /* Always charge self_vruntime, root threads compete with the root's children */
+    cpu_cgroup_charge_vruntime(&cg->pcpu[cpu].self_vruntime, &cg->pcpu[cpu], delta,
+                               CPU_WEIGHT_DFL);
+
+    /* The root's usage would just be the whole system's, so it's not accounted */
+    for (; cg->parent; cg = cg->parent)
+    {
+        __atomic_add_fetch(&cg->usage, delta, __ATOMIC_RELAXED);
+        __atomic_add_fetch(system ? &cg->system_usage : &cg->user_usage, delta, __ATOMIC_RELAXED);
+
+        cpu_cgroup_charge_vruntime(&cg->pcpu[cpu].vruntime, &cg->parent->pcpu[cpu], delta,
+                                   READ_ONCE(cg->weight));
+
+        if (READ_ONCE(cg->quota) == CPU_QUOTA_MAX)
+            continue;
+
+        if (__atomic_sub_fetch(&cg->runtime, (long) delta, __ATOMIC_RELAXED) <= 0)
+        {
+            cpu_cgroup_throttle(cg);
+            throttled = true;
+        }
+    }
+
+    if (throttled)
+        atomic_or_relaxed(curr->flags, THREAD_NEEDS_RESCHED);
+}
+
+static void cpu_cgroup_kick_cpus()
+{
+    unsigned int this_cpu = get_cpu_nr();
+
+    /* Threads that were throttled may now be the best choice anywhere */
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+    {
+        if (cpu == this_cpu)
+            sched_should_resched();
+        else
+            cpu_send_resched(cpu);
+    }
+}
+
+/* Called with cg->lock held */
+static bool cpu_cgroup_unthrottle(struct cpu_cgroup *cg, hrtime_t now)
+{
+    if (!cg->throttled)
+        return false;
+
+    WRITE_ONCE(cg->throttled, false);
+    cg->throttled_time += now - cg->throttled_since;
+    return true;
+}
+
+static void cpu_cgroup_period_timer(struct clockevent *ev)
+{
+    struct cpu_cgroup *cg = (struct cpu_cgroup *) ev->priv;
+    hrtime_t now = clocksource_get_time();
+    bool kick = false;
+
+    {
+        scoped_lock<spinlock, true> g{cg->lock};
+        long quota = (long) cg->quota;
+
+        /* Refill, paying off whatever we overran last period. Unused runtime doesn't carry over. */
+        long runtime = __atomic_add_fetch(&cg->runtime, quota, __ATOMIC_RELAXED);
+        if (runtime > quota)
+            __atomic_store_n(&cg->runtime, quota, __ATOMIC_RELAXED);
+
+        cg->nr_periods++;
+        if (runtime > 0)
+            kick = cpu_cgroup_unthrottle(cg, now);
+
+        ev->deadline += cg->period;
+        if (ev->deadline <= now)
+            ev->deadline = now + cg->period;
+    }
+
+    if (kick)
+        cpu_cgroup_kick_cpus();
+}
+
+static struct cgroup_subsys_state *cpu_cgroup_css_alloc(struct cgroup *cg)
+{
+    struct cpu_cgroup *cpucg;
+
+    /* The root never gets throttled, and has the default weight */
+    if (!cg->parent)
+        return &cpu_cgroup_root.css;
+
+    cpucg = new cpu_cgroup;
+    if (!cpucg)
+        return (struct cgroup_subsys_state *) ERR_PTR(-ENOMEM);
+
+    cpucg->parent = cgroup_to_cpucg(cg->parent);
+    cpucg->depth = cpucg->parent->depth + 1;
+    cpucg->period_timer.callback = cpu_cgroup_period_timer;
+    cpucg->period_timer.priv = cpucg;
+    cpucg->period_timer.flags = CLOCKEVENT_FLAG_ATOMIC | CLOCKEVENT_FLAG_PULSE;
+
+    /* Start out level with the siblings that are running */
+    for (unsigned int i = 0; i < CONFIG_SMP_NR_CPUS; i++)
+        cpucg->pcpu[i].vruntime = cpucg->parent->pcpu[i].min_vruntime;
+
+    __atomic_add_fetch(&cpu_cgroup_nr_groups, 1, __ATOMIC_RELAXED);
+    return &cpucg->css;
+}
+
+static void cpu_cgroup_css_free(struct cgroup_subsys_state *css)
+{
+    struct cpu_cgroup *cg = css_to_cpucg(css);
+
+    /* The clockevent's destructor cancels the period timer */
+    __atomic_sub_fetch(&cpu_cgroup_nr_groups, 1, __ATOMIC_RELAXED);
+    delete cg;
+}
+
+static ssize_t cpu_weight_show(struct cgroup *cg, char *buf, size_t len)
+{
+    int st = snprintf(buf, len, "%u\n", READ_ONCE(cgroup_to_cpucg(cg)->weight));
+    return (size_t) st >= len ? -E2BIG : st;
+}
+
+static int cpu_weight_write(struct cgroup *cg, char *buf, size_t len)
+{
+    char *end;
+    unsigned long weight = strtoul(buf, &end, 10);
+
+    if (end == buf || *end != '\0' || weight < CPU_WEIGHT_MIN || weight > CPU_WEIGHT_MAX)
+        return -EINVAL;
+
+    WRITE_ONCE(cgroup_to_cpucg(cg)->weight, (unsigned int) weight);
+    return 0;
+}
+
+static ssize_t cpu_max_show(struct cgroup *cg, char *buf, size_t len)
+{
+    struct cpu_cgroup *cpucg = cgroup_to_cpucg(cg);
+    hrtime_t quota, period;
+    int st;
+
+    {
+        scoped_lock<spinlock, true> g{cpucg->lock};
+        quota = cpucg->quota;
+        period = cpucg->period;
+    }
+
+    if (quota == CPU_QUOTA_MAX)
+        st = snprintf(buf, len, "max %lu\n", period / NS_PER_US);
+    else
+        st = snprintf(buf, len, "%lu %lu\n", quota / NS_PER_US, period / NS_PER_US);
+    return (size_t) st >= len ? -E2BIG : st;
+}
+
+/**
+ * @brief Parse a cpu.max string ("$QUOTA $PERIOD", with QUOTA possibly "max", both in us, and
+ * the period optional)
+ *
+ * @param buf String
+ * @param quota Parsed quota, in ns, or CPU_QUOTA_MAX
+ * @param period Parsed period, in ns (untouched if not given)
+ * @return 0 on success, -EINVAL
+ */
+static int cpu_max_parse(char *buf, hrtime_t *quota, hrtime_t *period)
+{
+    char *end;
+    unsigned long val;
+
+    if (!strncmp(buf, "max", 3))
+    {
+        *quota = CPU_QUOTA_MAX;
+        end = buf + 3;
+    }
+    else
+    {
+        val = strtoul(buf, &end, 10);
+        if (end == buf || val > LONG_MAX / NS_PER_US)
+            return -EINVAL;
+        *quota = val * NS_PER_US;
+        if (*quota < CPU_QUOTA_MIN)
+            return -EINVAL;
+    }
+
+    if (*end == '\0')
+        return 0;
+    if (*end != ' ')
+        return -EINVAL;
+
+    buf = end + 1;
+    val = strtoul(buf, &end, 10);
+    if (end == buf || *end != '\0' || val > CPU_PERIOD_MAX / NS_PER_US)
+        return -EINVAL;
+
+    *period = val * NS_PER_US;
+    if (*period < CPU_PERIOD_MIN)
+        return -EINVAL;
+    return 0;
+}
+
+static int cpu_max_write(struct cgroup *cg, char *buf, size_t len)
+{
+    struct cpu_cgroup *cpucg = cgroup_to_cpucg(cg);
+    hrtime_t quota, period;
+    bool kick;
+    int err;
+
+    scoped_mutex g{cpu_cgroup_config_lock};
+
+    /* Only cpu.max writes change the period, and we're serialized against them */
+    period = cpucg->period;
+    err = cpu_max_parse(buf, &quota, &period);
+    if (err < 0)
+        return err;
+
+    /* The timer callback takes cg->lock under the timer's own lock, so stop it before grabbing
+     * ours. It's restarted below if we still have a quota. */
+    timer_cancel_event(&cpucg->period_timer);
+
+    {
+        scoped_lock<spinlock, true> g2{cpucg->lock};
+        WRITE_ONCE(cpucg->quota, quota);
+        cpucg->period = period;
+        __atomic_store_n(&cpucg->runtime, quota == CPU_QUOTA_MAX ? 0 : (long) quota,
+                         __ATOMIC_RELAXED);
+        kick = cpu_cgroup_unthrottle(cpucg, clocksource_get_time());
+    }
+
+    if (quota != CPU_QUOTA_MAX)
+    {
+        cpucg->period_timer.deadline = clocksource_get_time() + period;
+        timer_queue_clockevent(&cpucg->period_timer);
+    }
+
+    if (kick)
+        cpu_cgroup_kick_cpus();
+    return 0;
+}
+
+static ssize_t cpu_stat_show(struct cgroup *cg, char *buf, size_t len)
+{
+    struct cpu_cgroup *cpucg = cgroup_to_cpucg(cg);
+    unsigned long nr_periods, nr_throttled, throttled_time;
+    int st;
+
+    {
+        scoped_lock<spinlock, true> g{cpucg->lock};
+        nr_periods = cpucg->nr_periods;
+        nr_throttled = cpucg->nr_throttled;
+        throttled_time = cpucg->throttled_time;
+        /* Include the current throttling period, if any */
+        if (cpucg->throttled)
+            throttled_time += clocksource_get_time() - cpucg->throttled_since;
+    }
+
+    st = snprintf(buf, len,
+                  "usage_usec %lu\nuser_usec %lu\nsystem_usec %lu\nnr_periods %lu\n"
+                  "nr_throttled %lu\nthrottled_usec %lu\n",
+                  READ_ONCE(cpucg->usage) / NS_PER_US, READ_ONCE(cpucg->user_usage) / NS_PER_US,
+                  READ_ONCE(cpucg->system_usage) / NS_PER_US, nr_periods, nr_throttled,
+                  throttled_time / NS_PER_US);
+    return (size_t) st >= len ? -E2BIG : st;
+}
+
+static const struct cgroup_file cpu_files[] = {
+    {
+        .name = "cpu.weight",
+        .mode = 0644,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = cpu_weight_show,
+        .write = cpu_weight_write,
+    },
+    {
+        .name = "cpu.max",
+        .mode = 0644,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = cpu_max_show,
+        .write = cpu_max_write,
+    },
+    {
+        .name = "cpu.stat",
+        .mode = 0444,
+        .flags = CGROUP_FILE_NOT_ON_ROOT,
+        .show = cpu_stat_show,
+        .write = nullptr,
+    },
+    {},
+};
+
+const struct cgroup_subsys cpu_cgrp_subsys = {
+    .name = "cpu",
+    .css_alloc = cpu_cgroup_css_alloc,
+    .css_offline = nullptr,
+    .css_free = cpu_cgroup_css_free,
+    .attach = nullptr,
+    .files = cpu_files,
+};
@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+
+#include <onyx/compiler.h>
+#include <onyx/cpu.h>
+#include <onyx/kunit.h>
+#include <onyx/panic.h>
+#include <onyx/rtmutex.h>
+#include <onyx/scheduler.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/signal.h>
+#include <onyx/task_switching.h>
+
+/* Locking rules:
+ * lock->wait_lock protects the lock's waiter list and the waiters' prio. thread->pi_lock protects
+ * thread->pi_waiters and thread->pi_blocked_on (which is also stable under the wait_lock of the
+ * lock it points to). The lock order is wait_lock -> pi_lock -> scheduler locks, so the chain walk,
+ * which goes from a thread to the lock it's blocked on, can only trylock the wait_lock.
+ */
+
+#define RT_MUTEX_MAX_CHAIN_DEPTH 1024
+
+static struct thread *rt_mutex_word_to_thread(unsigned long word)
+{
+    return (struct thread *) (word & ~RT_MUTEX_HAS_WAITERS);
+}
+
+struct thread *rt_mutex_owner(struct rt_mutex *lock)
+{
+    return rt_mutex_word_to_thread(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED));
+}
+
+bool rt_mutex_holds_lock(struct rt_mutex *lock)
+{
+    return rt_mutex_owner(lock) == get_current_thread();
+}
+
+static struct rt_mutex_waiter *rt_mutex_top_waiter(struct rt_mutex *lock)
+{
+    MUST_HOLD_LOCK(&lock->wait_lock);
+    struct list_head *l = list_first_element(&lock->waiters);
+    return l ? container_of(l, struct rt_mutex_waiter, list_node) : nullptr;
+}
+
+static void rt_mutex_enqueue(struct rt_mutex *lock, struct rt_mutex_waiter *waiter)
+{
+    MUST_HOLD_LOCK(&lock->wait_lock);
+
+    list_for_every (&lock->waiters)
+    {
+        struct rt_mutex_waiter *w = container_of(l, struct rt_mutex_waiter, list_node);
+        if (w->prio < waiter->prio)
+        {
+            /* Go in front of the first lower priority waiter */
+            list_add_tail(&waiter->list_node, &w->list_node);
+            return;
+        }
+    }
+
+    list_add_tail(&waiter->list_node, &lock->waiters);
+}
+
+/**
+ * @brief Calculate a thread's effective priority
+ *
+ * @param thread Thread
+ * @return The max of its normal priority and the priority of the top waiters of its locks
+ */
+static int rt_mutex_effective_prio(struct thread *thread)
+{
+    MUST_HOLD_LOCK(&thread->pi_lock);
+    int prio = thread->normal_prio;
+
+    list_for_every (&thread->pi_waiters)
+    {
+        struct rt_mutex_waiter *w = container_of(l, struct rt_mutex_waiter, pi_node);
+        int wprio = READ_ONCE(w->prio);
+        if (wprio > prio)
+            prio = wprio;
+    }
+
+    return prio;
+}
+
+/**
+ * @brief Propagate priority changes through a chain of lock owners
+ * Only one link of the chain is locked at a time, so the chain may change under us. That's
+ * fine, as whoever changes it walks it again. Consumes a reference to @a task.
+ *
+ * @param task Thread whose effective priority may need to change
+ */
+static void rt_mutex_adjust_chain(struct thread *task)
+{
+    unsigned int depth = 0;
+
+    while (depth < RT_MUTEX_MAX_CHAIN_DEPTH)
+    {
+        spin_lock(&task->pi_lock);
+
+        int prio = rt_mutex_effective_prio(task);
+        if (prio != READ_ONCE(task->priority))
+            sched_set_effective_priority(task, prio);
+
+        struct rt_mutex_waiter *waiter = task->pi_blocked_on;
+        if (!waiter || READ_ONCE(waiter->prio) == prio)
+        {
+            /* The rest of the chain already reflects our priority */
+            spin_unlock(&task->pi_lock);
+            break;
+        }
+
+        struct rt_mutex *lock = waiter->lock;
+        if (spin_try_lock(&lock->wait_lock))
+        {
+            spin_unlock(&task->pi_lock);
+            cpu_relax();
+            continue;
+        }
+
+        /* Requeue the waiter according to its new priority */
+        struct rt_mutex_waiter *prev_top = rt_mutex_top_waiter(lock);
+        list_remove(&waiter->list_node);
+        WRITE_ONCE(waiter->prio, prio);
+        rt_mutex_enqueue(lock, waiter);
+        spin_unlock(&task->pi_lock);
+
+        struct rt_mutex_waiter *top = rt_mutex_top_waiter(lock);
+        struct thread *owner = rt_mutex_owner(lock);
+        DCHECK(owner != nullptr);
+
+        spin_lock(&owner->pi_lock);
+        if (top != prev_top)
+        {
+            list_remove(&prev_top->pi_node);
+            list_add_tail(&top->pi_node, &owner->pi_waiters);
+        }
+        spin_unlock(&owner->pi_lock);
+
+        thread_get(owner);
+        spin_unlock(&lock->wait_lock);
+
+        thread_put(task);
+        task = owner;
+        depth++;
+    }
+
+    thread_put(task);
+}
+
+/**
+ * @brief Try to take the lock, or queue a waiter
+ *
+ * @param lock Lock
+ * @param waiter Waiter
+ * @param thread Thread that's going to wait
+ * @param walk If set on return, a referenced thread whose chain needs to be walked
+ * @return 1 if acquired, 0 if queued, -EDEADLK if the thread already owns the lock
+ */
+static int __rt_mutex_start_lock(struct rt_mutex *lock, struct rt_mutex_waiter *waiter,
+                                 struct thread *thread, struct thread **walk)
+{
+    MUST_HOLD_LOCK(&lock->wait_lock);
+    *walk = nullptr;
+
+    /* Force the owner into the slow unlock path, so it has to take the wait_lock */
+    unsigned long word = __atomic_or_fetch(&lock->owner, RT_MUTEX_HAS_WAITERS, __ATOMIC_ACQUIRE);
+    struct thread *owner = rt_mutex_word_to_thread(word);
+
+    if (!owner)
+    {
+        /* Unlocks hand the lock over to the top waiter, so a free lock has no waiters */
+        DCHECK(list_is_empty(&lock->waiters));
+        __atomic_store_n(&lock->owner, (unsigned long) thread, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    if (owner == thread)
+    {
+        if (list_is_empty(&lock->waiters))
+            __atomic_and_fetch(&lock->owner, ~RT_MUTEX_HAS_WAITERS, __ATOMIC_RELAXED);
+        return -EDEADLK;
+    }
+
+    struct rt_mutex_waiter *prev_top = rt_mutex_top_waiter(lock);
+
+    waiter->thread = thread;
+    waiter->lock = lock;
+    waiter->granted = false;
+
+    spin_lock(&thread->pi_lock);
+    waiter->prio = thread->priority;
+    rt_mutex_enqueue(lock, waiter);
+    thread->pi_blocked_on = waiter;
+    spin_unlock(&thread->pi_lock);
+
+    if (rt_mutex_top_waiter(lock) == waiter)
+    {
+        /* We're the new top waiter, the owner now inherits our priority */
+        spin_lock(&owner->pi_lock);
+        if (prev_top)
+            list_remove(&prev_top->pi_node);
+        list_add_tail(&waiter->pi_node, &owner->pi_waiters);
+        spin_unlock(&owner->pi_lock);
+
+        thread_get(owner);
+        *walk = owner;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Hand the lock over to a waiter
+ *
+ * @param lock Lock
+ * @param waiter Waiter that gets the lock
+ * @return The new owner, referenced, that needs to be woken up
+ */
+static struct thread *__rt_mutex_handover(struct rt_mutex *lock, struct rt_mutex_waiter *waiter)
+{
+    MUST_HOLD_LOCK(&lock->wait_lock);
+    struct thread *owner = rt_mutex_owner(lock);
+    struct thread *new_owner = waiter->thread;
+    struct rt_mutex_waiter *top = rt_mutex_top_waiter(lock);
+
+    /* The old owner stops inheriting from this lock's waiters */
+    spin_lock(&owner->pi_lock);
+    list_remove(&top->pi_node);
+    sched_set_effective_priority(owner, rt_mutex_effective_prio(owner));
+    spin_unlock(&owner->pi_lock);
+
+    /* And the new one starts to */
+    spin_lock(&new_owner->pi_lock);
+    list_remove(&waiter->list_node);
+    new_owner->pi_blocked_on = nullptr;
+    top = rt_mutex_top_waiter(lock);
+    if (top)
+        list_add_tail(&top->pi_node, &new_owner->pi_waiters);
+    sched_set_effective_priority(new_owner, rt_mutex_effective_prio(new_owner));
+    spin_unlock(&new_owner->pi_lock);
+
+    __atomic_store_n(&lock->owner, (unsigned long) new_owner | (top ? RT_MUTEX_HAS_WAITERS : 0),
+                     __ATOMIC_RELEASE);
+
+    thread_get(new_owner);
+    /* The waiter may go away as soon as it sees this */
+    __atomic_store_n(&waiter->granted, true, __ATOMIC_RELEASE);
+    return new_owner;
+}
+
+/**
+ * @brief Unlock, handing the lock over to a waiter (if any)
+ *
+ * @param lock Lock
+ * @param waiter Waiter that gets the lock, or NULL if there are no waiters
+ */
+static void __rt_mutex_unlock(struct rt_mutex *lock, struct rt_mutex_waiter *waiter)
+    RELEASE(lock) NO_THREAD_SAFETY_ANALYSIS
+{
+    MUST_HOLD_LOCK(&lock->wait_lock);
+
+    if (!waiter)
+    {
+        __atomic_store_n(&lock->owner, 0, __ATOMIC_RELEASE);
+        spin_unlock(&lock->wait_lock);
+        return;
+    }
+
+    struct thread *new_owner = __rt_mutex_handover(lock, waiter);
+    spin_unlock(&lock->wait_lock);
+
+    thread_wake_up(new_owner);
+    thread_put(new_owner);
+}
+
+static int rt_mutex_wait(struct rt_mutex_waiter *waiter, int state, hrtime_t timeout)
+{
+    int ret = 0;
+
+    for (;;)
+    {
+        set_current_state(state);
+        /* Either we see granted, or __rt_mutex_unlock sees our new state and wakes us up */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&waiter->granted, __ATOMIC_ACQUIRE))
+            break;
+
+        if (state == THREAD_INTERRUPTIBLE && signal_is_pending())
+        {
+            ret = -EINTR;
+            break;
+        }
+
+        if (timeout)
+        {
+            timeout = sched_sleep(timeout);
+            if (timeout == 0)
+            {
+                ret = -ETIMEDOUT;
+                break;
+            }
+        }
+        else
+            sched_yield();
+    }
+
+    set_current_state(THREAD_RUNNABLE);
+    return ret;
+}
+
+void rt_mutex_init_proxy_locked(struct rt_mutex *lock, struct thread *owner)
+{
+    rt_mutex_init(lock);
+    lock->owner = (unsigned long) owner;
+}
+
+int rt_mutex_start_proxy_lock(struct rt_mutex *lock, struct rt_mutex_waiter *waiter,
+                              struct thread *thread)
+{
+    struct thread *walk;
+
+    spin_lock(&lock->wait_lock);
+    int st = __rt_mutex_start_lock(lock, waiter, thread, &walk);
+    spin_unlock(&lock->wait_lock);
+
+    if (walk)
+        rt_mutex_adjust_chain(walk);
+    return st;
+}
+
+int rt_mutex_wait_proxy_lock(struct rt_mutex_waiter *waiter, hrtime_t timeout)
+{
+    return rt_mutex_wait(waiter, THREAD_INTERRUPTIBLE, timeout);
+}
+
+bool rt_mutex_cleanup_proxy_lock(struct rt_mutex *lock, struct rt_mutex_waiter *waiter)
+{
+    struct thread *thread = waiter->thread;
+    struct thread *walk = nullptr;
+
+    spin_lock(&lock->wait_lock);
+
+    if (waiter->granted)
+    {
+        spin_unlock(&lock->wait_lock);
+        return true;
+    }
+
+    struct thread *owner = rt_mutex_owner(lock);
+    struct rt_mutex_waiter *prev_top = rt_mutex_top_waiter(lock);
+
+    spin_lock(&thread->pi_lock);
+    list_remove(&waiter->list_node);
+    thread->pi_blocked_on = nullptr;
+    spin_unlock(&thread->pi_lock);
+
+    if (prev_top == waiter)
+    {
+        /* The owner may have been inheriting our priority */
+        struct rt_mutex_waiter *top = rt_mutex_top_waiter(lock);
+        spin_lock(&owner->pi_lock);
+        list_remove(&waiter->pi_node);
+        if (top)
+            list_add_tail(&top->pi_node, &owner->pi_waiters);
+        spin_unlock(&owner->pi_lock);
+
+        thread_get(owner);
+        walk = owner;
+    }
+
+    if (list_is_empty(&lock->waiters))
+        __atomic_and_fetch(&lock->owner, ~RT_MUTEX_HAS_WAITERS, __ATOMIC_RELAXED);
+
+    spin_unlock(&lock->wait_lock);
+
+    if (walk)
+        rt_mutex_adjust_chain(walk);
+    return false;
+}
+
+struct thread *rt_mutex_next_owner(struct rt_mutex *lock)
+{
+    scoped_lock g{lock->wait_lock};
+    struct rt_mutex_waiter *top = rt_mutex_top_waiter(lock);
+    return top ? top->thread : nullptr;
+}
+
+void rt_mutex_handover(struct rt_mutex *lock, struct thread *new_owner)
+{
+    DCHECK(rt_mutex_holds_lock(lock));
+    spin_lock(&lock->wait_lock);
+
+    struct rt_mutex_waiter *waiter = nullptr;
+    if (new_owner)
+    {
+        /* Stable, as it only changes under our wait_lock while it's blocked on us */
+        waiter = new_owner->pi_blocked_on;
+        DCHECK(waiter && waiter->lock == lock);
+    }
+
+    __rt_mutex_unlock(lock, waiter);
+}
+
+static int rt_mutex_lock_slow_path(struct rt_mutex *lock, int state)
+{
+    struct rt_mutex_waiter waiter;
+
+    int st = rt_mutex_start_proxy_lock(lock, &waiter, get_current_thread());
+    if (st == 1)
+        return 0;
+
+    if (st == -EDEADLK)
+        panic("rt_mutex: Recursive locking of %p\n", lock);
+
+    st = rt_mutex_wait(&waiter, state, 0);
+
+    /* We may have gotten the lock right after giving up */
+    if (st < 0 && rt_mutex_cleanup_proxy_lock(lock, &waiter))
+        st = 0;
+    return st;
+}
+
+bool rt_mutex_trylock(struct rt_mutex *lock)
+{
+    unsigned long expected = 0;
+    return __atomic_compare_exchange_n(&lock->owner, &expected,
+                                       (unsigned long) get_current_thread(), false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void rt_mutex_lock(struct rt_mutex *lock) NO_THREAD_SAFETY_ANALYSIS
+{
+    MAY_SLEEP();
+    if (!rt_mutex_trylock(lock)) [[unlikely]]
+        rt_mutex_lock_slow_path(lock, THREAD_UNINTERRUPTIBLE);
+}
+
+int rt_mutex_lock_interruptible(struct rt_mutex *lock) NO_THREAD_SAFETY_ANALYSIS
+{
+    MAY_SLEEP();
+    if (rt_mutex_trylock(lock)) [[likely]]
+        return 0;
+    return rt_mutex_lock_slow_path(lock, THREAD_INTERRUPTIBLE);
+}
+
+void rt_mutex_unlock(struct rt_mutex *lock) NO_THREAD_SAFETY_ANALYSIS
+{
+    unsigned long expected = (unsigned long) get_current_thread();
+    if (__atomic_compare_exchange_n(&lock->owner, &expected, 0, false, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED)) [[likely]]
+        return;
+
+    DCHECK(rt_mutex_holds_lock(lock));
+    spin_lock(&lock->wait_lock);
+    __rt_mutex_unlock(lock, rt_mutex_top_waiter(lock));
+}
+
+#ifdef CONFIG_KUNIT
+
+/* These use fake, never-started threads as waiters, so nothing actually sleeps */
+
+static void rt_mutex_test_thread(struct thread *t, int prio)
+{
+    t->refcount = 1;
+    t->priority = t->normal_prio = prio;
+    t->cpu = get_cpu_nr();
+}
+
+TEST(rtmutex, lock_unlock)
+{
+    rt_mutex lock;
+
+    ASSERT_TRUE(rt_mutex_trylock(&lock));
+    EXPECT_TRUE(rt_mutex_holds_lock(&lock));
+    EXPECT_FALSE(rt_mutex_trylock(&lock));
+    rt_mutex_unlock(&lock);
+    EXPECT_EQ(rt_mutex_owner(&lock), nullptr);
+
+    rt_mutex_lock(&lock);
+    EXPECT_TRUE(rt_mutex_holds_lock(&lock));
+    rt_mutex_unlock(&lock);
+    EXPECT_EQ(lock.owner, 0UL);
+}
+
+TEST(rtmutex, owner_inherits_priority)
+{
+    struct thread *current = get_current_thread();
+    int prio = current->normal_prio;
+    rt_mutex lock;
+    thread waiter_thread;
+    rt_mutex_waiter waiter;
+
+    rt_mutex_test_thread(&waiter_thread, SCHED_PRIO_VERY_HIGH);
+    rt_mutex_lock(&lock);
+
+    ASSERT_EQ(rt_mutex_start_proxy_lock(&lock, &waiter, &waiter_thread), 0);
+    EXPECT_EQ(current->priority, SCHED_PRIO_VERY_HIGH);
+    EXPECT_EQ(rt_mutex_next_owner(&lock), &waiter_thread);
+
+    /* Giving up on the lock deboosts the owner */
+    EXPECT_FALSE(rt_mutex_cleanup_proxy_lock(&lock, &waiter));
+    EXPECT_EQ(current->priority, prio);
+    EXPECT_EQ(waiter_thread.pi_blocked_on, nullptr);
+
+    rt_mutex_unlock(&lock);
+    EXPECT_EQ(rt_mutex_owner(&lock), nullptr);
+}
+
+TEST(rtmutex, boost_walks_the_chain)
+{
+    struct thread *current = get_current_thread();
+    int prio = current->normal_prio;
+    rt_mutex a, b;
+    thread t1, t2;
+    rt_mutex_waiter w1, w2;
+
+    /* current owns a, t1 owns b and waits on a, t2 waits on b */
+    rt_mutex_test_thread(&t1, SCHED_PRIO_VERY_LOW);
+    rt_mutex_test_thread(&t2, SCHED_PRIO_VERY_HIGH);
+    rt_mutex_lock(&a);
+    rt_mutex_init_proxy_locked(&b, &t1);
+
+    ASSERT_EQ(rt_mutex_start_proxy_lock(&a, &w1, &t1), 0);
+    EXPECT_EQ(current->priority, prio);
+
+    ASSERT_EQ(rt_mutex_start_proxy_lock(&b, &w2, &t2), 0);
+    EXPECT_EQ(t1.priority, SCHED_PRIO_VERY_HIGH);
+    EXPECT_EQ(w1.prio, SCHED_PRIO_VERY_HIGH);
+    EXPECT_EQ(current->priority, SCHED_PRIO_VERY_HIGH);
+
+    EXPECT_FALSE(rt_mutex_cleanup_proxy_lock(&b, &w2));
+    EXPECT_EQ(t1.priority, SCHED_PRIO_VERY_LOW);
+    EXPECT_EQ(current->priority, prio);
+
+    EXPECT_FALSE(rt_mutex_cleanup_proxy_lock(&a, &w1));
+    rt_mutex_unlock(&a);
+    EXPECT_EQ(a.owner, 0UL);
+}
+
+TEST(rtmutex, waiters_are_sorted_by_priority)
+{
+    rt_mutex lock;
+    thread low, high;
+    rt_mutex_waiter wlow, whigh;
+
+    rt_mutex_test_thread(&low, SCHED_PRIO_LOW);
+    rt_mutex_test_thread(&high, SCHED_PRIO_HIGH);
+    rt_mutex_lock(&lock);
+
+    ASSERT_EQ(rt_mutex_start_proxy_lock(&lock, &wlow, &low), 0);
+    ASSERT_EQ(rt_mutex_start_proxy_lock(&lock, &whigh, &high), 0);
+    EXPECT_EQ(rt_mutex_next_owner(&lock), &high);
+
+    EXPECT_FALSE(rt_mutex_cleanup_proxy_lock(&lock, &whigh));
+    EXPECT_EQ(rt_mutex_next_owner(&lock), &low);
+    EXPECT_FALSE(rt_mutex_cleanup_proxy_lock(&lock, &wlow));
+    EXPECT_EQ(rt_mutex_next_owner(&lock), nullptr);
+
+    rt_mutex_unlock(&lock);
+}
+
+#endif
@@ -21,9 +21,11 @@
 #include <onyx/clock.h>
 #include <onyx/condvar.h>
 #include <onyx/cpu.h>
+#include <onyx/cpu_cgroup.h>
 #include <onyx/dpc.h>
 #include <onyx/elf.h>
 #include <onyx/fpu.h>
+#include <onyx/futex.h>
 #include <onyx/gen/trace_sched.h>
 #include <onyx/irq.h>
 #include <onyx/kcov.h>
@@ -77,6 +79,7 @@ void sched_append_to_queue(int priority, unsigned int cpu, thread_t *thread);
 void sched_block(thread *thread);
 static void __sched_append_to_queue(int priority, unsigned int cpu, thread_t *thread);
 static void ___sched_append_to_queue(int priority, unsigned int cpu, struct thread *thread);
+int __sched_remove_thread_from_execution(thread_t *thread, unsigned int cpu);
 
 int sched_rbtree_cmp(const void *t1, const void *t2);
 static rb_tree glbl_thread_list = {.cmp_func = sched_rbtree_cmp};
@@ -247,15 +250,24 @@ thread_t *__sched_find_next(unsigned int cpu)
     /* Go through the different queues, from the highest to lowest */
     for (int i = NUM_PRIO - 1; i >= 0; i--)
     {
-        /* If this queue has a thread, we found a runnable thread! */
+        /* If this queue has a thread, we may have found a runnable thread! */
         if (thread_queues[i])
         {
-            thread_t *ret = thread_queues[i];
+            /* cpu cgroups get to pick the thread (and skip throttled ones) */
+            thread_t *ret = cpu_cgroup_pick(thread_queues[i], cpu);
+            if (!ret)
+                continue;
+
+            if (ret != thread_queues[i])
+            {
+                __sched_remove_thread_from_execution(ret, cpu);
+                return ret;
+            }
 
             /* Advance the queue by one */
             thread_queues[i] = ret->next_prio;
             if (thread_queues[i])
-                ret->prev_prio = nullptr;
+                thread_queues[i]->prev_prio = nullptr;
             ret->next_prio = nullptr;
 
             return ret;
@@ -331,6 +343,8 @@ void sched_decrease_quantum(clockevent *ev)
     struct thread *current = get_current_thread();
     if (current)
     {
+        cpu_cgroup_account(current, NS_PER_MS, in_kernel_space_regs(current->regs));
+
         if (in_kernel_space_regs(current->regs))
         {
             current->cputime_info.system_time += NS_PER_MS;
@@ -461,11 +475,8 @@ extern "C" void *sched_schedule(void *last_stack)
 
     if (source_thread != curr_thread)
     {
-        if (source_thread->owner)
-        {
-            source_thread->get_aspace()->active_mask.remove_cpu_atomic(get_cpu_nr());
-        }
-
+        /* Note: We don't leave the address space's active mask here. The cpu keeps the page tables
+         * loaded until it switches to another address space (see kernel/mm/tlb.cpp). */
         trace_sched_slice_end();
         trace_sched_slice_begin(curr_thread->id, curr_thread->owner ? curr_thread->owner->pid_ : 0,
                                 curr_thread->owner ? curr_thread->owner->comm : NULL);
@@ -576,6 +587,8 @@ void thread_add(thread_t *thread, unsigned int cpu_num)
         cpu_num = sched_allocate_processor();
 
     thread->cpu = cpu_num;
+    /* Threads get their priority set before being started */
+    thread->normal_prio = thread->priority;
     trace_sched_cpu_assign(thread->id, thread->owner ? thread->owner->pid_ : 0,
                            thread->owner ? thread->owner->comm : NULL, thread->cpu);
     /* Append the thread to the queue */
@@ -588,7 +601,7 @@ void sched_init_cpu(unsigned int cpu)
 
     assert(t != nullptr);
 
-    t->priority = SCHED_PRIO_VERY_LOW;
+    t->priority = t->normal_prio = SCHED_PRIO_VERY_LOW;
     t->cpu = cpu;
 
     write_per_cpu_any(current_thread, t, cpu);
@@ -626,7 +639,7 @@ int sched_init(void)
 
     assert(t != NULL);
 
-    t->priority = SCHED_PRIO_NORMAL;
+    t->priority = t->normal_prio = SCHED_PRIO_NORMAL;
     // sched_start_thread_for_cpu(t, get_cpu_nr());
 
     write_per_cpu(sched_quantum, SCHED_QUANTUM);
@@ -853,6 +866,8 @@ void thread_exit()
     thread *current = get_current_thread();
 
     kcov_free_thread(current);
+    /* Hand over our PI futexes while the address space (and its futex buckets) is still around */
+    futex_exit_pi(current);
     sched_disable_preempt();
 
     /* We need to switch to the fallback page directory while we can, because
@@ -988,6 +1003,40 @@ void thread_wake_up(thread_t *thread)
     sched_unlock(thread, f);
 }
 
+void sched_set_effective_priority(struct thread *thread, int prio)
+{
+    DCHECK(prio >= 0 && prio < NUM_PRIO);
+    unsigned long f = sched_lock(thread);
+    unsigned int cpu = thread->cpu;
+
+    if (thread->priority == prio)
+    {
+        sched_unlock(thread, f);
+        return;
+    }
+
+    /* The running thread isn't in the queues, so only requeue the thread if we find it there */
+    bool queued = __sched_remove_thread_from_execution(thread, cpu) == 0;
+    bool lowered = prio < thread->priority;
+    thread->priority = prio;
+
+    if (queued)
+        ___sched_append_to_queue(prio, cpu, thread);
+
+    sched_unlock(thread, f);
+
+    if (queued)
+        sched_try_to_resched(thread);
+    else if (lowered)
+    {
+        /* Someone else may deserve the CPU more than it does now */
+        if (thread == get_current_thread())
+            sched_should_resched();
+        else if (get_thread_for_cpu(cpu) == thread)
+            cpu_send_resched(cpu);
+    }
+}
+
 void sched_block_self(thread *thread, unsigned long fl)
 {
     MUST_HOLD_LOCK(get_per_cpu_ptr_any(scheduler_lock, thread->cpu));
@@ -1223,7 +1272,7 @@ pid_t sys_gettid()
 void sched_transition_to_idle()
 {
     thread *curr = get_current_thread();
-    curr->priority = SCHED_PRIO_VERY_LOW;
+    curr->priority = curr->normal_prio = SCHED_PRIO_VERY_LOW;
     curr->entry(nullptr);
 }
 
@@ -8,8 +8,10 @@
 
 #include <onyx/clock.h>
 #include <onyx/cpu.h>
+#include <onyx/file.h>
 #include <onyx/panic.h>
 #include <onyx/pid.h>
+#include <onyx/pidfd.h>
 #include <onyx/process.h>
 #include <onyx/signal.h>
 #include <onyx/task_switching.h>
@@ -644,6 +646,8 @@ int kernel_tkill(int signal, struct thread *thread, unsigned int flags, siginfo_
 
     sigaddset(&thread->sinfo.pending_set, signal);
 
+    wait_queue_wake_all(&process->signalfd_wq);
+
     if (!sigismember(&thread->sinfo.sigmask, signal))
     {
         thread->sinfo.signal_pending = true;
@@ -1064,6 +1068,59 @@ out:
     return st;
 }
 
+int sys_pidfd_send_signal(int pidfd, int sig, siginfo_t *uinfo, unsigned int flags)
+{
+    siginfo_t info = {};
+
+    if (flags != 0)
+        return -EINVAL;
+
+    auto_file f = get_file_description(pidfd);
+    if (!f)
+        return -EBADF;
+
+    struct process *p = pidfd_to_process(f.get_file());
+    if (!p)
+        return -EBADF;
+
+    /* Unlike kill(), a pidfd knows the process is gone */
+    if (READ_ONCE(p->signal_group_flags) & SIGNAL_GROUP_EXIT)
+        return -ESRCH;
+
+    if (sig != 0 && !is_valid_signal(sig))
+        return -EINVAL;
+
+    if (uinfo)
+    {
+        if (copy_from_user(&info, uinfo, sizeof(info)) < 0)
+            return -EFAULT;
+
+        if (info.si_signo != sig)
+            return -EINVAL;
+
+        if (sanitize_rt_sigqueueinfo(&info, p->get_pid()) < 0)
+            return -EPERM;
+    }
+    else
+    {
+        struct creds *c = creds_get();
+        info.si_signo = sig;
+        info.si_code = SI_USER;
+        info.si_uid = c->euid;
+        info.si_pid = get_current_process()->get_pid();
+        creds_put(c);
+    }
+
+    /* sig == 0 is a permission check, so do it before bailing out */
+    if (may_kill(sig, p, &info) < 0)
+        return -EPERM;
+
+    if (sig == 0)
+        return 0;
+
+    return kernel_raise_signal(sig, p, 0, &info);
+}
+
 int sys_rt_tgsigqueueinfo(pid_t pid, pid_t tid, int sig, siginfo_t *uinfo)
 {
     siginfo_t info;
@@ -1207,6 +1264,88 @@ out:
     return st;
 }
 
+static int signal_dequeue_thread(struct thread *thread, const sigset_t *set, siginfo_t *info)
+{
+    MUST_HOLD_LOCK(&thread->sinfo.lock);
+
+    for (int i = 1; i < NSIG; i++)
+    {
+        if (!sigismember(set, i) || !sigismember(&thread->sinfo.pending_set, i))
+            continue;
+
+        struct sigpending *pending = signal_query_pending(i, SIGNAL_QUERY_POP, &thread->sinfo);
+        signal_unqueue(i, thread);
+        if (!pending)
+            continue;
+
+        memcpy(info, pending->info, sizeof(siginfo_t));
+        delete pending;
+        return i;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Dequeue a pending signal that's in a set
+ * Looks at the current thread first, then at the rest of the process' threads, since we don't have
+ * process-wide pending signals. Used by signalfd.
+ *
+ * @param set Set of signals to look for
+ * @param info Pointer to where to store the siginfo
+ * @return Signal number, or 0 if none was pending
+ */
+int signal_dequeue_set(const sigset_t *set, siginfo_t *info)
+{
+    struct process *process = get_current_process();
+    struct thread *current = get_current_thread();
+    int signum;
+
+    scoped_lock g{process->signal_lock};
+
+    {
+        scoped_lock g2{current->sinfo.lock};
+        signum = signal_dequeue_thread(current, set, info);
+    }
+
+    if (signum)
+        return signum;
+
+    process_for_every_thread(process, [&](struct thread *t) -> bool {
+        if (t == current)
+            return true;
+        scoped_lock g2{t->sinfo.lock};
+        signum = signal_dequeue_thread(t, set, info);
+        return signum == 0;
+    });
+
+    return signum;
+}
+
+/**
+ * @brief Check if any signal in a set is pending in the current process
+ *
+ * @param set Set of signals to look for
+ * @return True if so, else false
+ */
+bool signal_set_is_pending(const sigset_t *set)
+{
+    struct process *process = get_current_process();
+    bool pending = false;
+
+    scoped_lock g{process->signal_lock};
+
+    process_for_every_thread(process, [&](struct thread *t) -> bool {
+        scoped_lock g2{t->sinfo.lock};
+        sigset_t s;
+        sigandset(&s, &t->sinfo.pending_set, (sigset_t *) set);
+        pending = !sigisemptyset(&s);
+        return !pending;
+    });
+
+    return pending;
+}
+
 int sys_rt_sigpending(sigset_t *uset, size_t sigsetlen)
 {
     struct thread *current = get_current_thread();
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the GPLv2 License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/cred.h>
+#include <onyx/file.h>
+#include <onyx/pidfd.h>
+#include <onyx/process.h>
+#include <onyx/scheduler.h>
+#include <onyx/user.h>
+#include <onyx/vfork_completion.h>
+#include <onyx/vm.h>
+
+#include <uapi/fcntl.h>
+#include <uapi/spawn.h>
+
+/* spawn(2): posix_spawn, done in the kernel. The child is created with a kernel thread that
+ * borrows the parent's address space (like vfork), sets itself up, and then execs straight away.
+ * This means we never copy (or COW-protect) the parent's address space, and never run user code
+ * on a shared address space. The parent sleeps until the child has exec'd (or failed to).
+ */
+
+#define SPAWN_VALID_FLAGS                                                                \
+    (SPAWN_RESETIDS | SPAWN_SETPGROUP | SPAWN_SETSIGDEF | SPAWN_SETSIGMASK | SPAWN_SETSID | \
+     SPAWN_PIDFD)
+
+/* Arbitrary, but posix_spawn users don't come anywhere close to this */
+#define SPAWN_MAX_FILE_ACTIONS 1024
+
+struct spawn_ctx
+{
+    struct spawn_args args;
+    struct spawn_file_action *actions;
+    const char *path;
+    const char **argv;
+    const char **envp;
+    /* Set by the child if it failed before exec'ing */
+    int error;
+    /* Set by the parent if it failed to set up the child, which must exit right away */
+    bool abort;
+};
+
+pid_t sys_setsid();
+int sys_setpgid(pid_t pid, pid_t pgid);
+int sys_close(int fd);
+int sys_dup2(int oldfd, int newfd);
+int sys_openat(int dirfd, const char *upath, int flags, mode_t mode);
+int sys_chdir(const char *upath);
+int sys_fchdir(int fildes);
+int sys_execve(const char *p, const char **argv, const char **envp);
+void sys_exit(int status);
+pid_t sys_wait4(pid_t pid, int *wstatus, int options, struct rusage *usage);
+
+static int spawn_do_file_action(const struct spawn_file_action *fa)
+{
+    int st = 0;
+
+    switch (fa->type)
+    {
+        case SPAWN_FA_CLOSE:
+            st = sys_close(fa->fd);
+            break;
+        case SPAWN_FA_DUP2:
+            st = sys_dup2(fa->srcfd, fa->fd);
+            break;
+        case SPAWN_FA_OPEN: {
+            int fd = sys_openat(AT_FDCWD, (const char *) fa->path, fa->oflag, fa->mode);
+            if (fd < 0)
+                return fd;
+
+            if (fd != fa->fd)
+            {
+                st = sys_dup2(fd, fa->fd);
+                sys_close(fd);
+            }
+
+            break;
+        }
+        case SPAWN_FA_CHDIR:
+            st = sys_chdir((const char *) fa->path);
+            break;
+        case SPAWN_FA_FCHDIR:
+            st = sys_fchdir(fa->fd);
+            break;
+    }
+
+    return st < 0 ? st : 0;
+}
+
+static int spawn_setup_child(struct spawn_ctx *ctx)
+{
+    const struct spawn_args &args = ctx->args;
+    struct process *current = get_current_process();
+    int st;
+
+    if (args.flags & SPAWN_RESETIDS)
+    {
+        creds_guard<CGType::Write> g;
+        auto c = g.get();
+        c->euid = c->ruid;
+        c->egid = c->rgid;
+    }
+
+    if (args.flags & SPAWN_SETSID)
+    {
+        if (st = sys_setsid(); st < 0)
+            return st;
+    }
+
+    if (args.flags & SPAWN_SETPGROUP)
+    {
+        if (st = sys_setpgid(0, (pid_t) args.pgroup); st < 0)
+            return st;
+    }
+
+    if (args.flags & SPAWN_SETSIGDEF)
+    {
+        scoped_lock g{current->signal_lock};
+
+        for (int i = 1; i < _NSIG; i++)
+        {
+            if (args.sigdefault & (1UL << (i - 1)))
+                current->sigtable[i].sa_handler = NULL;
+        }
+    }
+
+    if (args.flags & SPAWN_SETSIGMASK)
+    {
+        sigset_t set;
+        memcpy(&set, &args.sigmask, sizeof(set));
+        get_current_thread()->sinfo.set_blocked(&set);
+    }
+
+    for (size_t i = 0; i < args.nr_file_actions; i++)
+    {
+        if (st = spawn_do_file_action(&ctx->actions[i]); st < 0)
+            return st;
+    }
+
+    return 0;
+}
+
+static void spawn_child(void *arg)
+{
+    struct spawn_ctx *ctx = (struct spawn_ctx *) arg;
+
+    /* spawn_create_child couldn't create our process. ctx may be gone already. */
+    if (!get_current_process())
+        thread_exit();
+
+    if (ctx->abort)
+        sys_exit(127);
+
+    /* Every pointer we've been given is a user pointer, in the parent's address space (which
+     * we're using until exec) */
+    thread_change_addr_limit(VM_USER_ADDR_LIMIT);
+
+    int st = spawn_setup_child(ctx);
+    if (st == 0)
+        st = sys_execve(ctx->path, ctx->argv, ctx->envp);
+
+    /* Exec failed, tell the parent (process_exit wakes it up). If the failure was past the point
+     * of no return, the parent was already woken up and ctx is gone. */
+    if (get_current_process()->vfork_compl)
+        ctx->error = st;
+    sys_exit(127);
+}
+
+static int spawn_copy_file_actions(struct spawn_ctx *ctx)
+{
+    size_t nr = ctx->args.nr_file_actions;
+
+    if (!nr)
+        return 0;
+
+    if (nr > SPAWN_MAX_FILE_ACTIONS)
+        return -E2BIG;
+
+    ctx->actions = (struct spawn_file_action *) calloc(nr, sizeof(struct spawn_file_action));
+    if (!ctx->actions)
+        return -ENOMEM;
+
+    if (copy_from_user(ctx->actions, (const void *) ctx->args.file_actions,
+                       nr * sizeof(struct spawn_file_action)) < 0)
+        return -EFAULT;
+
+    for (size_t i = 0; i < nr; i++)
+    {
+        if (ctx->actions[i].type > SPAWN_FA_FCHDIR)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create the child process and its (kernel) thread
+ *
+ * @param ctx Spawn context, given to the child thread
+ * @return The new thread, or NULL
+ */
+static struct thread *spawn_create_child(struct spawn_ctx *ctx)
+{
+    struct process *current = get_current_process();
+    struct process *child;
+
+    /* Create the thread first. A process can't be torn down without one, once it's linked in.
+     * If we fail to create the process, the thread exits as soon as it starts. */
+    struct thread *thread = sched_create_thread(spawn_child, THREAD_KERNEL, ctx);
+    if (!thread)
+        return nullptr;
+
+    {
+        scoped_mutex g{current->name_lock};
+        child = process_create(current->cmd_line, &current->ctx, current);
+    }
+
+    if (!child)
+    {
+        sched_start_thread(thread);
+        return nullptr;
+    }
+
+    /* Borrow the address space, exec replaces it. */
+    child->flags |= PROCESS_FORKED;
+    child->address_space = current->address_space;
+
+    thread->owner = child;
+    process_add_thread(child, thread);
+    process_copy_current_sigmask(thread);
+
+    if (sched_transition_to_user_thread(thread) < 0)
+    {
+        /* Like process_abort_child: the child exits before exec'ing anything, and we reap it */
+        pid_t pid = child->get_pid();
+        ctx->abort = true;
+        sched_start_thread(thread);
+        sys_wait4(pid, nullptr, 0, nullptr);
+        return nullptr;
+    }
+
+    return thread;
+}
+
+pid_t sys_spawn(const struct spawn_args *uargs, size_t size, const char *path, const char **argv,
+                const char **envp)
+{
+    struct spawn_ctx ctx = {};
+    vfork_completion vfork_cmpl;
+    struct process *child;
+    struct thread *thread;
+    pid_t pid;
+    int st;
+
+    if (size < SPAWN_ARGS_SIZE_VER0)
+        return -EINVAL;
+    if (size > PAGE_SIZE)
+        return -E2BIG;
+
+    if (st = copy_struct_from_user(&ctx.args, sizeof(ctx.args), uargs, size); st < 0)
+        return st;
+
+    if (ctx.args.flags & ~SPAWN_VALID_FLAGS)
+        return -EINVAL;
+
+    if (st = spawn_copy_file_actions(&ctx); st < 0)
+        goto out;
+
+    ctx.path = path;
+    ctx.argv = argv;
+    ctx.envp = envp;
+
+    thread = spawn_create_child(&ctx);
+    if (!thread)
+    {
+        st = -ENOMEM;
+        goto out;
+    }
+
+    child = thread->owner;
+    process_get(child);
+    pid = child->get_pid();
+    child->vfork_compl = &vfork_cmpl;
+    sched_start_thread(thread);
+
+    /* Wait for the exec. The child uses ctx and our address space until then. */
+    vfork_cmpl.wait();
+    vfork_cmpl.wait_to_exit();
+
+    if (ctx.error)
+    {
+        /* Reap the child, it already exited */
+        sys_wait4(pid, nullptr, 0, nullptr);
+        st = ctx.error;
+        goto out_put;
+    }
+
+    st = pid;
+
+    if (ctx.args.flags & SPAWN_PIDFD)
+    {
+        /* The child is running, so report the pid even if we fail to give out a pidfd */
+        int fd = pidfd_create(child, O_CLOEXEC);
+        if (fd >= 0 && copy_to_user((int *) ctx.args.pidfd, &fd, sizeof(int)) < 0)
+        {
+            file_close(fd);
+            fd = -EFAULT;
+        }
+
+        if (fd < 0)
+        {
+            fd = -1;
+            copy_to_user((int *) ctx.args.pidfd, &fd, sizeof(int));
+        }
+    }
+
+out_put:
+    process_put(child);
+out:
+    free(ctx.actions);
+    return st;
+}
@@ -29,6 +29,24 @@ void wait_queue_wait(struct wait_queue *queue)
     sched_yield();
 }
 
+/**
+ * @brief Notify a WQ_TOKEN_PERSISTENT token
+ *
+ * @param token Token
+ * @param exclusive_done Set once an exclusive persistent token has been notified
+ */
+static void wait_queue_notify_persistent(struct wait_queue_token *token, bool *exclusive_done)
+{
+    if (token->flags & WQ_TOKEN_EXCLUSIVE)
+    {
+        if (*exclusive_done)
+            return;
+        *exclusive_done = true;
+    }
+
+    token->callback(token->context, token);
+}
+
 struct wait_queue_token *wait_queue_wake_unlocked(struct wait_queue *queue)
 {
     MUST_HOLD_LOCK(&queue->lock);
@@ -51,31 +69,88 @@ struct wait_queue_token *wait_queue_wake_unlocked(struct wait_queue *queue)
 
 void wait_queue_wake(struct wait_queue *queue)
 {
+    bool exclusive_done = false;
     unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
 
-    if (list_is_empty(&queue->token_list))
+    list_for_every_safe (&queue->token_list)
     {
-        spin_unlock_irqrestore(&queue->lock, cpu_flags);
-        return;
-    }
+        struct wait_queue_token *t = container_of(l, struct wait_queue_token, token_node);
 
-    struct wait_queue_token *t = wait_queue_wake_unlocked(queue);
+        if (t->flags & WQ_TOKEN_PERSISTENT)
+        {
+            wait_queue_notify_persistent(t, &exclusive_done);
+            continue;
+        }
 
-    if (t->callback)
-        t->callback(t->context, t);
+        list_remove(&t->token_node);
+        t->signaled = true;
 
-    thread_wake_up(t->thread);
+        if (t->callback)
+            t->callback(t->context, t);
+
+        thread_wake_up(t->thread);
+        break;
+    }
 
     spin_unlock_irqrestore(&queue->lock, cpu_flags);
 }
 
 void wait_queue_wake_all(struct wait_queue *queue)
 {
+    bool exclusive_done = false;
     unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
 
-    while (!list_is_empty(&queue->token_list))
+    list_for_every_safe (&queue->token_list)
     {
-        struct wait_queue_token *t = wait_queue_wake_unlocked(queue);
+        struct wait_queue_token *t = container_of(l, struct wait_queue_token, token_node);
+
+        if (t->flags & WQ_TOKEN_PERSISTENT)
+        {
+            wait_queue_notify_persistent(t, &exclusive_done);
+            continue;
+        }
+
+        list_remove(&t->token_node);
+        t->signaled = true;
+
+        if (t->callback)
+            t->callback(t->context, t);
+        thread_wake_up(t->thread);
+    }
+
+    spin_unlock_irqrestore(&queue->lock, cpu_flags);
+}
+
+/**
+ * @brief Wake up every non-exclusive waiter, and a single exclusive one
+ *
+ * @param queue Queue to wake up
+ */
+void wait_queue_wake_exclusive(struct wait_queue *queue)
+{
+    bool exclusive_done = false;
+    bool woke_exclusive = false;
+    unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
+
+    list_for_every_safe (&queue->token_list)
+    {
+        struct wait_queue_token *t = container_of(l, struct wait_queue_token, token_node);
+
+        if (t->flags & WQ_TOKEN_PERSISTENT)
+        {
+            wait_queue_notify_persistent(t, &exclusive_done);
+            continue;
+        }
+
+        if (t->flags & WQ_TOKEN_EXCLUSIVE)
+        {
+            if (woke_exclusive)
+                continue;
+            woke_exclusive = true;
+        }
+
+        list_remove(&t->token_node);
+        t->signaled = true;
 
         if (t->callback)
             t->callback(t->context, t);
@@ -159,11 +234,18 @@ unsigned long __wait_queue_wake(struct wait_queue *queue, unsigned int flags, vo
                                 unsigned long nr_exclusive)
 {
     unsigned long woken = 0;
+    bool exclusive_done = false;
     list_for_every_safe (&queue->token_list)
     {
         bool stop_afterwards = false;
         struct wait_queue_token *token = container_of(l, struct wait_queue_token, token_node);
 
+        if (token->flags & WQ_TOKEN_PERSISTENT)
+        {
+            wait_queue_notify_persistent(token, &exclusive_done);
+            continue;
+        }
+
         // The waiter may have some logic built in to check if we indeed must wake it.
         if (token->wake)
         {
@@ -62,6 +62,66 @@ public:
     }
 };
 
+class zstd_context : public compression::context
+{
+    ZSTD_CCtx* cctx{nullptr};
+    ZSTD_DCtx* dctx{nullptr};
+    int level;
+
+public:
+    zstd_context(int level) : level{level}
+    {
+    }
+
+    ~zstd_context() override
+    {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+
+    bool init()
+    {
+        cctx = ZSTD_createCCtx();
+        dctx = ZSTD_createDCtx();
+        if (!cctx || !dctx)
+            return false;
+        /* Callers know how big their buffers are. Don't waste bytes on the checksum. */
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 0);
+        return true;
+    }
+
+    expected<size_t, int> compress(void* dst, size_t dst_capacity,
+                                   cul::slice<unsigned char> src) final
+    {
+        auto size = ZSTD_compress2(cctx, dst, dst_capacity, src.data(), src.size_bytes());
+        if (ZSTD_isError(size))
+        {
+            if (ZSTD_getErrorCode(size) == ZSTD_error_dstSize_tooSmall)
+                return unexpected<int>{-ENOSPC};
+            printk("zstd: Error compressing buffer: %s\n", ZSTD_getErrorName(size));
+            return unexpected<int>(-EINVAL);
+        }
+
+        return size;
+    }
+
+    expected<size_t, int> decompress(void* dst, size_t dst_capacity,
+                                     cul::slice<unsigned char> src) final
+    {
+        auto size = ZSTD_decompressDCtx(dctx, dst, dst_capacity, src.data(), src.size_bytes());
+        if (ZSTD_isError(size))
+        {
+            if (ZSTD_getErrorCode(size) == ZSTD_error_dstSize_tooSmall)
+                return unexpected<int>{-ENOSPC};
+            printk("zstd: Error decompressing buffer: %s\n", ZSTD_getErrorName(size));
+            return unexpected<int>(-EINVAL);
+        }
+
+        return size;
+    }
+};
+
 class zstd_module : public compression::module
 {
 public:
@@ -114,6 +174,16 @@ public:
             return unexpected<int>{-ENOMEM};
         return str.cast<compression::decompression_stream>();
     }
+
+    expected<unique_ptr<compression::context>, int> create_context(int level) override
+    {
+        auto ctx = make_unique<zstd_context>(level);
+        if (!ctx)
+            return unexpected<int>{-ENOMEM};
+        if (!ctx->init())
+            return unexpected<int>{-ENOMEM};
+        return ctx.cast<compression::context>();
+    }
 };
 
 zstd_module zstd{};
@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -27,17 +29,33 @@ static int direct_io;
 static int do_fsync;
 static int do_fsync_dir;
 static int sync_io;
+static int read_io;
+static int hipri;
+
+#ifndef RWF_HIPRI
+#define RWF_HIPRI 0x00000001
+#endif
+
+/* pread/pwrite with RWF_HIPRI, so the kernel polls for the completion instead of sleeping */
+static ssize_t do_rw_hipri(int fd, void *buf, size_t len, off_t off)
+{
+    struct iovec iov = {buf, len};
+    return syscall(read_io ? SYS_preadv2 : SYS_pwritev2, fd, &iov, 1, off, 0, RWF_HIPRI);
+}
 
 static int prepare_file(const char *filename, size_t size)
 {
     int oflags = O_RDWR | O_TRUNC | O_CREAT | O_CLOEXEC;
+
+    if (read_io)
+        oflags = O_RDONLY | O_CLOEXEC;
     bool notrunc = false;
     struct stat buf;
 
     if (stat(filename, &buf) < 0 && errno != ENOENT)
         err(1, "prepare_file: stat");
 
-    if (S_ISBLK(buf.st_mode))
+    if (!read_io && S_ISBLK(buf.st_mode))
     {
         oflags &= ~(O_CREAT | O_TRUNC);
         notrunc = true;
@@ -71,7 +89,7 @@ static int prepare_file(const char *filename, size_t size)
         close(fd2);
     }
 
-    if (!notrunc)
+    if (!notrunc && !read_io)
     {
         if (ftruncate(fd, size) < 0)
         {
@@ -82,18 +100,31 @@ static int prepare_file(const char *filename, size_t size)
     return fd;
 }
 
+enum io_pattern
+{
+    PATTERN_RANDOM = 0,
+    PATTERN_SEQUENTIAL,
+    PATTERN_STRIDED
+};
+
 struct stress_options
 {
-    // if sequential IO, else random
-    bool sequential;
+    // Access pattern
+    enum io_pattern pattern;
     // IO chunk size
     int io_chunk_size;
+    // Distance between the start of two consecutive IOs, for strided IO
+    size_t stride;
+    // Number of interleaved sequential streams
+    int streams;
     // File size
     size_t file_size;
     // Time to run
     int time_secs;
     // file descriptor
     int fd;
+    // Bytes transferred
+    unsigned long bytes;
 };
 
 static volatile sig_atomic_t test_done = 0;
@@ -104,6 +135,33 @@ static void test_alrm(int sig)
     test_done = 1;
 }
 
+static off_t next_offset(struct stress_options *opts, off_t *stream_offs, unsigned long iter)
+{
+    size_t nr_blocks = opts->file_size / opts->io_chunk_size;
+    off_t off;
+
+    switch (opts->pattern)
+    {
+        case PATTERN_SEQUENTIAL: {
+            /* Streams are spread out evenly over the file, and we round-robin between them */
+            int stream = iter % opts->streams;
+            off = stream_offs[stream];
+            stream_offs[stream] += opts->io_chunk_size;
+            if ((size_t) stream_offs[stream] + opts->io_chunk_size > opts->file_size)
+                stream_offs[stream] = 0;
+            return off;
+        }
+        case PATTERN_STRIDED:
+            off = stream_offs[0];
+            stream_offs[0] += opts->stride;
+            if ((size_t) stream_offs[0] + opts->io_chunk_size > opts->file_size)
+                stream_offs[0] = (stream_offs[0] + opts->io_chunk_size) % opts->stride;
+            return off;
+        default:
+            return (rand() % nr_blocks) * opts->io_chunk_size;
+    }
+}
+
 static void stress(int fd, struct stress_options *opts)
 {
     void *block = aligned_alloc(opts->io_chunk_size, opts->io_chunk_size);
@@ -113,47 +171,92 @@ static void stress(int fd, struct stress_options *opts)
 
     struct stat buf0;
     off_t off = 0;
+    off_t stream_offs[opts->streams];
+    unsigned long iter = 0;
 
     if (fstat(fd, &buf0) < 0)
         err(1, "fstat");
 
+    for (int i = 0; i < opts->streams; i++)
+    {
+        stream_offs[i] = (opts->file_size / opts->streams) * i;
+        stream_offs[i] -= stream_offs[i] % opts->io_chunk_size;
+    }
+
     signal(SIGALRM, test_alrm);
     alarm(opts->time_secs);
 
     while (!test_done)
     {
         ssize_t st;
-        if (opts->sequential)
+        if (opts->pattern == PATTERN_SEQUENTIAL && opts->streams == 1 && !read_io && !hipri)
             st = write(fd, block, opts->io_chunk_size);
         else
         {
-            /* Calculate the number of blocks */
-            size_t nr_blocks = opts->file_size / opts->io_chunk_size;
-            off = (rand() % nr_blocks) * opts->io_chunk_size;
-            st = pwrite(fd, block, opts->io_chunk_size, off);
+            off = next_offset(opts, stream_offs, iter++);
+            if (hipri)
+                st = do_rw_hipri(fd, block, opts->io_chunk_size, off);
+            else if (read_io)
+                st = pread(fd, block, opts->io_chunk_size, off);
+            else
+                st = pwrite(fd, block, opts->io_chunk_size, off);
         }
 
         if (st < 0)
-            err(1, "write");
+            err(1, read_io ? "read" : "write");
 
         if (st != opts->io_chunk_size)
         {
-            fprintf(stderr, "stress: partial write (supposedly, offset %ld size %d, written %zd)\n",
-                    off, opts->io_chunk_size, st);
+            fprintf(stderr, "stress: partial %s (supposedly, offset %ld size %d, done %zd)\n",
+                    read_io ? "read" : "write", off, opts->io_chunk_size, st);
             exit(1);
         }
 
         off += opts->io_chunk_size;
+        __atomic_add_fetch(&opts->bytes, st, __ATOMIC_RELAXED);
+    }
+}
+
+static void print_ra_stats(int fd)
+{
+    char line[256];
+    FILE *file = fopen("/sys/vm/readahead_files", "r");
+    if (!file)
+        return;
+
+    /* Skip the header */
+    if (!fgets(line, sizeof(line), file))
+        goto out;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned long sync, async, random, thrash, pages, ino;
+        int lfd;
+        if (sscanf(line, "%d %lu %lu %lu %lu %lu %lu", &lfd, &ino, &sync, &async, &random, &thrash,
+                   &pages) != 7)
+            continue;
+        if (lfd != fd)
+            continue;
+        printf("readahead: %lu sync, %lu async, %lu random, %lu thrash, %lu pages read ahead\n",
+               sync, async, random, thrash, pages);
     }
+
+out:
+    fclose(file);
 }
 
 static int sequential = 0;
 
+static int strided = 0;
+
 enum options
 {
     OPT_FILESIZE = 1,
     OPT_TIME,
-    OPT_IO_BLOCK_SIZE
+    OPT_IO_BLOCK_SIZE,
+    OPT_STRIDE,
+    OPT_STREAMS,
+    OPT_FADVISE
 };
 
 const static struct option options[] = {
@@ -168,12 +271,21 @@ const static struct option options[] = {
     {"fsync", no_argument, &do_fsync, 1},
     {"fsync-dir", no_argument, &do_fsync_dir, 1},
     {"sync", no_argument, &sync_io, 1},
+    {"read", no_argument, &read_io, 1},
+    {"strided", no_argument, &strided, 1},
+    {"stride", required_argument, NULL, OPT_STRIDE},
+    {"streams", required_argument, NULL, OPT_STREAMS},
+    {"fadvise", required_argument, NULL, OPT_FADVISE},
+    {"hipri", no_argument, &hipri, 1},
     {}};
 
 static int threads = 1;
 static unsigned long file_size = 0x400000;
 static int timeout = 10;
 static int io_block_size = 4096;
+static unsigned long stride = 0;
+static int streams = 1;
+static int fadvise = -1;
 
 static void *stress_thread_start(void *arg)
 {
@@ -199,7 +311,17 @@ void usage(void)
            "    --direct                Use O_DIRECT to do direct I/O and bypass the page cache\n"
            "    --sync                  Use O_SYNC to wait for IO to complete\n"
            "    --fsync                 Do fsync() after writing the file\n"
-           "    --fsync-dir             Do fsync() on the directory after creating the file\n\n"
+           "    --fsync-dir             Do fsync() on the directory after creating the file\n"
+           "    --read                  Read from an existing file instead of writing to it\n"
+           "    --strided               Do strided IO on the file\n"
+           "    --stride STRIDE         Set the distance between strided IOs (default = 4 blocks)\n"
+           "    --streams STREAMS       Interleave STREAMS sequential streams on the file (implies "
+           "--sequential)\n"
+           "    --fadvise ADVICE        posix_fadvise() the file with ADVICE (normal, random, "
+           "sequential)\n"
+           "    --hipri                 Use RWF_HIPRI to poll for IO completion (with --direct)\n\n"
+           "For read tests, use a file larger than memory (or a freshly mounted filesystem), so\n"
+           "reads actually hit the disk.\n"
            "If anything went wrong, exits with exit status 1.\n"
            "If everything looks to completed successfully, exits with 0.\n");
 }
@@ -258,6 +380,41 @@ int main(int argc, char **argv)
                     return 1;
                 }
 
+                break;
+            case OPT_STRIDE:
+                errno = 0;
+                stride = strtoul(optarg, NULL, 0);
+                if (errno == ERANGE || stride == 0)
+                {
+                    printf("iostress: Stride out of range [1, ULONG_MAX]\n");
+                    return 1;
+                }
+
+                break;
+            case OPT_STREAMS:
+                errno = 0;
+                streams = strtoul(optarg, NULL, 0);
+                if (errno == ERANGE || streams <= 0)
+                {
+                    printf("iostress: Streams out of range [1, INT_MAX]\n");
+                    return 1;
+                }
+
+                sequential = 1;
+                break;
+            case OPT_FADVISE:
+                if (!strcmp(optarg, "normal"))
+                    fadvise = POSIX_FADV_NORMAL;
+                else if (!strcmp(optarg, "random"))
+                    fadvise = POSIX_FADV_RANDOM;
+                else if (!strcmp(optarg, "sequential"))
+                    fadvise = POSIX_FADV_SEQUENTIAL;
+                else
+                {
+                    printf("iostress: Bad fadvise advice %s\n", optarg);
+                    return 1;
+                }
+
                 break;
             case OPT_IO_BLOCK_SIZE:
                 errno = 0;
@@ -298,12 +455,36 @@ int main(int argc, char **argv)
 
     int fd = prepare_file(filename, file_size);
 
+    if (read_io)
+    {
+        struct stat buf;
+        if (fstat(fd, &buf) < 0)
+            err(1, "fstat");
+        if (S_ISREG(buf.st_mode))
+            file_size = buf.st_size;
+        if ((unsigned long) io_block_size > file_size)
+            errx(1, "error: file %s is smaller than the io block size", filename);
+    }
+
+    if (fadvise >= 0)
+    {
+        int st = posix_fadvise(fd, 0, 0, fadvise);
+        if (st)
+        {
+            errno = st;
+            err(1, "posix_fadvise");
+        }
+    }
+
     struct stress_options opts;
     opts.file_size = file_size;
-    opts.sequential = sequential;
+    opts.pattern = sequential ? PATTERN_SEQUENTIAL : strided ? PATTERN_STRIDED : PATTERN_RANDOM;
     opts.io_chunk_size = io_block_size;
+    opts.stride = stride ?: (unsigned long) io_block_size * 4;
+    opts.streams = streams;
     opts.time_secs = timeout;
     opts.fd = fd;
+    opts.bytes = 0;
 
     pthread_t ids[threads - 1];
 
@@ -329,4 +510,9 @@ int main(int argc, char **argv)
         if (fsync(fd) < 0)
             err(1, "fsync");
     }
+
+    printf("iostress: %s %lu bytes in %d seconds (%lu KiB/s)\n", read_io ? "read" : "wrote",
+           opts.bytes, timeout, opts.bytes / 1024 / timeout);
+    if (read_io)
+        print_ra_stats(fd);
 }
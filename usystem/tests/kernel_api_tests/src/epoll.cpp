@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <libonyx/unique_fd.h>
+
+static int epoll_add(int epfd, int fd)
+{
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+TEST(epoll, nested_works)
+{
+    onx::unique_fd ep = epoll_create1(EPOLL_CLOEXEC);
+    onx::unique_fd ep2 = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_TRUE(ep.valid());
+    ASSERT_TRUE(ep2.valid());
+
+    ASSERT_EQ(epoll_add(ep.get(), ep2.get()), 0);
+}
+
+TEST(epoll, loop_fails)
+{
+    onx::unique_fd ep = epoll_create1(EPOLL_CLOEXEC);
+    onx::unique_fd ep2 = epoll_create1(EPOLL_CLOEXEC);
+    onx::unique_fd ep3 = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_TRUE(ep.valid());
+    ASSERT_TRUE(ep2.valid());
+    ASSERT_TRUE(ep3.valid());
+
+    /* Two epoll instances watching each other */
+    ASSERT_EQ(epoll_add(ep.get(), ep2.get()), 0);
+    ASSERT_EQ(epoll_add(ep2.get(), ep.get()), -1);
+    EXPECT_EQ(errno, ELOOP);
+
+    /* And a longer loop */
+    ASSERT_EQ(epoll_add(ep2.get(), ep3.get()), 0);
+    ASSERT_EQ(epoll_add(ep3.get(), ep.get()), -1);
+    EXPECT_EQ(errno, ELOOP);
+}
+
+TEST(epoll, too_deep_fails)
+{
+    /* EP_MAX_NESTS is 4, so a chain may have 5 epoll instances */
+    onx::unique_fd eps[6];
+
+    for (auto &ep : eps)
+    {
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        ASSERT_TRUE(ep.valid());
+    }
+
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQ(epoll_add(eps[i].get(), eps[i + 1].get()), 0);
+
+    ASSERT_EQ(epoll_add(eps[4].get(), eps[5].get()), -1);
+    EXPECT_EQ(errno, ELOOP);
+
+    /* Closing the middle of the chain makes room again */
+    eps[2].reset(-1);
+    ASSERT_EQ(epoll_add(eps[4].get(), eps[5].get()), 0);
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include <libonyx/unique_fd.h>
+
+class memcg : public ::testing::Test
+{
+protected:
+    std::string mnt;
+    std::string cg;
+
+    void SetUp() override
+    {
+        char tmpl[] = "/tmp/memcg_test.XXXXXX";
+        ASSERT_NE(mkdtemp(tmpl), nullptr);
+        mnt = tmpl;
+
+        if (mount("cgroup2", mnt.c_str(), "cgroup2", 0, nullptr) < 0)
+        {
+            rmdir(mnt.c_str());
+            mnt.clear();
+            GTEST_SKIP() << "could not mount cgroup2: " << strerror(errno);
+        }
+
+        cg = mnt + "/test";
+        ASSERT_EQ(mkdir(cg.c_str(), 0755), 0);
+    }
+
+    void TearDown() override
+    {
+        if (mnt.empty())
+            return;
+        rmdir(cg.c_str());
+        umount(mnt.c_str());
+        rmdir(mnt.c_str());
+    }
+
+    std::string read_file(const char *name)
+    {
+        char buf[512];
+        onx::unique_fd fd = open((cg + "/" + name).c_str(), O_RDONLY);
+        if (!fd.valid())
+            return "";
+        ssize_t st = read(fd.get(), buf, sizeof(buf) - 1);
+        if (st < 0)
+            return "";
+        buf[st] = '\0';
+        return buf;
+    }
+
+    int write_file(const char *name, const char *val)
+    {
+        onx::unique_fd fd = open((cg + "/" + name).c_str(), O_WRONLY);
+        if (!fd.valid())
+            return -1;
+        return write(fd.get(), val, strlen(val)) < 0 ? -1 : 0;
+    }
+
+    unsigned long read_event(const char *event)
+    {
+        std::string events = read_file("memory.events");
+        std::string key = std::string(event) + " ";
+        size_t pos = events.find(key);
+        if (pos == std::string::npos)
+            return 0;
+        return strtoul(events.c_str() + pos + key.size(), nullptr, 10);
+    }
+
+    /* Run a child in the cgroup that touches size bytes of anon memory */
+    int run_child(size_t size)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            if (write_file("cgroup.procs", "0") < 0)
+                _exit(1);
+            char *p = (char *) mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                _exit(2);
+            for (size_t i = 0; i < size; i += 4096)
+                p[i] = 1;
+            _exit(0);
+        }
+
+        int wstatus;
+        if (pid < 0 || waitpid(pid, &wstatus, 0) < 0)
+            return -1;
+        return wstatus;
+    }
+};
+
+TEST_F(memcg, files_work)
+{
+    EXPECT_NE(read_file("cgroup.controllers").find("memory"), std::string::npos);
+    EXPECT_EQ(read_file("memory.max"), "max\n");
+    EXPECT_EQ(read_file("memory.high"), "max\n");
+    EXPECT_EQ(read_file("memory.current"), "0\n");
+    EXPECT_NE(read_file("memory.stat").find("anon "), std::string::npos);
+    EXPECT_EQ(read_event("high"), 0UL);
+
+    ASSERT_EQ(write_file("memory.max", "1M\n"), 0);
+    EXPECT_EQ(read_file("memory.max"), "1048576\n");
+    ASSERT_EQ(write_file("memory.high", "512k"), 0);
+    EXPECT_EQ(read_file("memory.high"), "524288\n");
+
+    EXPECT_EQ(write_file("memory.max", "bogus"), -1);
+    EXPECT_EQ(errno, EINVAL);
+    EXPECT_EQ(read_file("memory.max"), "1048576\n");
+
+    ASSERT_EQ(write_file("memory.max", "max"), 0);
+    EXPECT_EQ(read_file("memory.max"), "max\n");
+}
+
+TEST_F(memcg, high_throttles)
+{
+    ASSERT_EQ(write_file("memory.high", "1M"), 0);
+
+    // Going over memory.high slows the child down, but never fails it
+    int wstatus = run_child(8 * 1024 * 1024);
+    ASSERT_TRUE(WIFEXITED(wstatus));
+    EXPECT_EQ(WEXITSTATUS(wstatus), 0);
+    EXPECT_GT(read_event("high"), 0UL);
+    EXPECT_EQ(read_event("oom"), 0UL);
+}
+
+TEST_F(memcg, max_limits_usage)
+{
+    ASSERT_EQ(write_file("memory.max", "2M"), 0);
+
+    // The child either gets swapped out or dies, but it never gets over memory.max
+    run_child(32 * 1024 * 1024);
+    EXPECT_GT(read_event("max"), 0UL);
+    EXPECT_LE(strtoul(read_file("memory.current").c_str(), nullptr, 10), 2UL * 1024 * 1024);
+}
@@ -2,17 +2,28 @@
 #include <err.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+static void touch_hot_set(unsigned char *hot, size_t pages, int pagesz)
+{
+    for (size_t i = 0; i < pages; i++)
+    {
+        volatile unsigned char *p = hot + i * pagesz;
+        *p = *p + 1;
+    }
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("Usage: lru-scan [path to file]\n");
+        printf("Usage: lru-scan [path to file] [anon hot set size in MiB]\n");
         return 1;
     }
 
@@ -31,6 +42,22 @@ int main(int argc, char **argv)
             err(1, "ioctl BLKGETSIZE64");
     }
 
+    /* Optionally, keep an anonymous hot set around while scanning. A scan-resistant LRU should
+     * evict the (used-once) file pages and keep the hot set resident. */
+    size_t hot_pages = argc == 3 ? (strtoul(argv[2], NULL, 0) << 20) / pagesz : 0;
+    unsigned char *hot = NULL;
+    if (hot_pages)
+    {
+        hot = mmap(NULL, hot_pages * pagesz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+        if (hot == MAP_FAILED)
+            err(1, "mmap");
+        touch_hot_set(hot, hot_pages, pagesz);
+    }
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+
     /* Scan the whole file linearly, in an mmap. This tests if reclamation works properly for mapped
      * pages. */
     void *ptr = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
@@ -40,5 +67,17 @@ int main(int argc, char **argv)
     {
         volatile uint8_t *ptr8 = ptr + (i * pagesz);
         *ptr8;
+
+        /* Touch the hot set every 64MiB of scanning */
+        if (hot_pages && i % ((64 << 20) / pagesz) == 0)
+            touch_hot_set(hot, hot_pages, pagesz);
+    }
+
+    if (hot_pages)
+    {
+        struct rusage after;
+        getrusage(RUSAGE_SELF, &after);
+        printf("lru-scan: %ld major faults while scanning (hot set: %zu pages)\n",
+               after.ru_majflt - before.ru_majflt, hot_pages);
     }
 }
@@ -6,6 +6,9 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <spawn.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -55,3 +58,98 @@ static void vfork_bench(benchmark::State& state)
 }
 
 BENCHMARK(vfork_bench)->ThreadRange(1, 16);
+
+#define EXEC_BENCH_PROGRAM "/bin/true"
+
+/* Touch `size` bytes of anonymous memory, to simulate a parent with a large RSS */
+struct rss_ballast
+{
+    void* ptr;
+    size_t size;
+
+    explicit rss_ballast(size_t size) : ptr{nullptr}, size{size}
+    {
+        if (!size)
+            return;
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            throw std::runtime_error("mmap failed");
+        memset(ptr, 0xff, size);
+    }
+
+    ~rss_ballast()
+    {
+        if (ptr)
+            munmap(ptr, size);
+    }
+};
+
+static void wait_for_child(pid_t pid)
+{
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+        throw std::runtime_error("Child failed");
+}
+
+/* fork + exec + wait. Measures exec-to-exit latency, and the cost of copying the parent's address
+ * space. */
+static void fork_exec_bench(benchmark::State& state)
+{
+    rss_ballast ballast{(size_t) state.range(0) << 20};
+    char* const argv[] = {(char*) EXEC_BENCH_PROGRAM, nullptr};
+
+    for (auto _ : state)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::runtime_error("Failed to fork");
+        else if (pid == 0)
+        {
+            execv(EXEC_BENCH_PROGRAM, argv);
+            _exit(127);
+        }
+
+        wait_for_child(pid);
+    }
+}
+
+BENCHMARK(fork_exec_bench)->Arg(0)->Arg(64)->Arg(512)->UseRealTime();
+
+static void vfork_exec_bench(benchmark::State& state)
+{
+    rss_ballast ballast{(size_t) state.range(0) << 20};
+    char* const argv[] = {(char*) EXEC_BENCH_PROGRAM, nullptr};
+
+    for (auto _ : state)
+    {
+        pid_t pid = vfork();
+        if (pid < 0)
+            throw std::runtime_error("Failed to vfork");
+        else if (pid == 0)
+        {
+            execv(EXEC_BENCH_PROGRAM, argv);
+            _exit(127);
+        }
+
+        wait_for_child(pid);
+    }
+}
+
+BENCHMARK(vfork_exec_bench)->Arg(0)->Arg(64)->Arg(512)->UseRealTime();
+
+static void posix_spawn_bench(benchmark::State& state)
+{
+    rss_ballast ballast{(size_t) state.range(0) << 20};
+    char* const argv[] = {(char*) EXEC_BENCH_PROGRAM, nullptr};
+
+    for (auto _ : state)
+    {
+        pid_t pid;
+        if (posix_spawn(&pid, EXEC_BENCH_PROGRAM, nullptr, nullptr, argv, environ) != 0)
+            throw std::runtime_error("posix_spawn failed");
+
+        wait_for_child(pid);
+    }
+}
+
+BENCHMARK(posix_spawn_bench)->Arg(0)->Arg(64)->Arg(512)->UseRealTime();
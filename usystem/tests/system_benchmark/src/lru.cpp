@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+/* Mixed page cache + anon workload: stream through a file as large as RAM while keeping an
+ * anonymous working set (1/4 of RAM) hot. A good LRU keeps the working set resident and evicts the
+ * streamed file pages instead. We report the working set's major faults per iteration. The file
+ * lives in $LRU_BENCH_DIR (default /var/tmp), which should be on a disk-backed filesystem. */
+
+static unsigned char* lru_hot;
+static size_t lru_hot_pages;
+static size_t lru_file_pages;
+static long page_size;
+static int lru_fd = -1;
+
+static void lru_setup()
+{
+    if (lru_fd >= 0)
+        return;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    lru_hot_pages = sysconf(_SC_PHYS_PAGES) / 4;
+    lru_file_pages = sysconf(_SC_PHYS_PAGES);
+
+    lru_hot = (unsigned char*) mmap(nullptr, lru_hot_pages * page_size, PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(lru_hot != MAP_FAILED);
+    for (size_t i = 0; i < lru_hot_pages; i++)
+        lru_hot[i * page_size] = (unsigned char) random();
+
+    const char* dir = getenv("LRU_BENCH_DIR");
+    char path[256];
+    strcpy(path, dir ? dir : "/var/tmp");
+    strcat(path, "/lru_bench.XXXXXX");
+    lru_fd = mkstemp(path);
+    assert(lru_fd >= 0);
+    unlink(path);
+
+    unsigned char* buf = (unsigned char*) malloc(page_size);
+    assert(buf != nullptr);
+    memset(buf, 0xaa, page_size);
+    for (size_t i = 0; i < lru_file_pages; i++)
+    {
+        ssize_t st = write(lru_fd, buf, page_size);
+        assert(st == page_size);
+        (void) st;
+    }
+    free(buf);
+}
+
+static void lru_touch_hot()
+{
+    for (size_t i = 0; i < lru_hot_pages; i++)
+    {
+        volatile unsigned char* p = lru_hot + i * page_size;
+        benchmark::DoNotOptimize(*p);
+    }
+}
+
+static void lru_mixed_stream(benchmark::State& state)
+{
+    lru_setup();
+    unsigned char* buf = (unsigned char*) malloc(page_size);
+    assert(buf != nullptr);
+    long majflt = 0;
+
+    for (auto _ : state)
+    {
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+
+        for (size_t i = 0; i < lru_file_pages; i++)
+        {
+            ssize_t st = pread(lru_fd, buf, page_size, i * page_size);
+            assert(st == page_size);
+            (void) st;
+            /* Interleave the working set every 1/16th of the file */
+            if (i % (lru_file_pages / 16) == 0)
+                lru_touch_hot();
+        }
+
+        getrusage(RUSAGE_SELF, &after);
+        majflt += after.ru_majflt - before.ru_majflt;
+    }
+
+    free(buf);
+    state.counters["hot_majflt"] =
+        benchmark::Counter(majflt, benchmark::Counter::kAvgIterations);
+    state.SetBytesProcessed(state.iterations() * lru_file_pages * page_size);
+}
+
+BENCHMARK(lru_mixed_stream)->Iterations(3)->Unit(benchmark::kMillisecond);
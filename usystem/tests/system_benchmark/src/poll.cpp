@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+/* Wait on N pipes, of which only the last one is readable. poll(2) pays for every fd on every
+ * call, epoll_wait should not. */
+
+struct pipe_set
+{
+    std::vector<int> read_fds;
+    std::vector<int> write_fds;
+
+    explicit pipe_set(int nr)
+    {
+        struct rlimit rlim;
+        if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+            throw std::runtime_error("getrlimit failed");
+
+        rlim_t needed = (rlim_t) nr * 2 + 16;
+        if (rlim.rlim_cur < needed)
+        {
+            rlim.rlim_cur = needed;
+            if (rlim.rlim_max < needed)
+                rlim.rlim_max = needed;
+            if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+                throw std::runtime_error("Failed to raise RLIMIT_NOFILE");
+        }
+
+        for (int i = 0; i < nr; i++)
+        {
+            int fds[2];
+            if (pipe(fds) < 0)
+                throw std::runtime_error("Failed to create pipe");
+            read_fds.push_back(fds[0]);
+            write_fds.push_back(fds[1]);
+        }
+
+        if (write(write_fds.back(), "x", 1) != 1)
+            throw std::runtime_error("Failed to write to pipe");
+    }
+
+    ~pipe_set()
+    {
+        for (int fd : read_fds)
+            close(fd);
+        for (int fd : write_fds)
+            close(fd);
+    }
+};
+
+static void poll_bench(benchmark::State& state)
+{
+    pipe_set pipes{(int) state.range(0)};
+    std::vector<struct pollfd> pfds;
+
+    for (int fd : pipes.read_fds)
+        pfds.push_back({fd, POLLIN, 0});
+
+    while (state.KeepRunning())
+    {
+        if (ppoll(pfds.data(), pfds.size(), nullptr, nullptr) != 1)
+            throw std::runtime_error("ppoll failed");
+    }
+}
+
+BENCHMARK(poll_bench)->Arg(10)->Arg(1000)->Arg(50000);
+
+static void epoll_bench(benchmark::State& state)
+{
+    pipe_set pipes{(int) state.range(0)};
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        throw std::runtime_error("Failed to create epoll fd");
+
+    for (int fd : pipes.read_fds)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            throw std::runtime_error("epoll_ctl failed");
+    }
+
+    while (state.KeepRunning())
+    {
+        struct epoll_event ev;
+        if (epoll_wait(epfd, &ev, 1, -1) != 1)
+            throw std::runtime_error("epoll_wait failed");
+    }
+
+    close(epfd);
+}
+
+BENCHMARK(epoll_bench)->Arg(10)->Arg(1000)->Arg(50000);
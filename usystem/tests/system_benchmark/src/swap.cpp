@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+/* Touch an anonymous array twice the size of RAM, such that most of it lives in swap at any given
+ * time. Needs swap to be enabled (and large enough), else we'll OOM. */
+
+static unsigned char* swap_array;
+static size_t swap_array_pages;
+static long page_size;
+
+static void swap_array_setup()
+{
+    if (swap_array)
+        return;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    swap_array_pages = sysconf(_SC_PHYS_PAGES) * 2;
+    swap_array = (unsigned char*) mmap(nullptr, swap_array_pages * page_size,
+                                       PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(swap_array != MAP_FAILED);
+
+    /* Fill every page with something that doesn't compress to nothing */
+    for (size_t i = 0; i < swap_array_pages; i++)
+    {
+        unsigned char* page = swap_array + i * page_size;
+        for (long j = 0; j < page_size; j += 64)
+            page[j] = (unsigned char) random();
+    }
+}
+
+static void swap_touch_sequential(benchmark::State& state)
+{
+    swap_array_setup();
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < swap_array_pages; i++)
+        {
+            volatile unsigned char* p = swap_array + i * page_size;
+            benchmark::DoNotOptimize(*p);
+        }
+
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * swap_array_pages * page_size);
+}
+
+BENCHMARK(swap_touch_sequential)->Iterations(3)->Unit(benchmark::kMillisecond);
+
+static void swap_touch_random(benchmark::State& state)
+{
+    swap_array_setup();
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < swap_array_pages; i++)
+        {
+            volatile unsigned char* p = swap_array + (random() % swap_array_pages) * page_size;
+            benchmark::DoNotOptimize(*p);
+        }
+
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * swap_array_pages * page_size);
+}
+
+BENCHMARK(swap_touch_random)->Iterations(3)->Unit(benchmark::kMillisecond);
@@ -3,9 +3,16 @@
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
 #include <iostream>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include <benchmark/benchmark.h>
 
@@ -26,3 +33,117 @@ static void thread_spawning_bench(benchmark::State& state)
 
 BENCHMARK(thread_spawning_bench)->RangeMultiplier(2)->Range(8, 8 << 10);
 ;
+
+#ifndef FUTEX_WAIT_PRIVATE
+#define FUTEX_WAIT_PRIVATE (0 | 128)
+#define FUTEX_WAKE_PRIVATE (1 | 128)
+#endif
+
+static long futex(std::atomic<uint32_t>* word, int op, uint32_t val)
+{
+    return syscall(SYS_futex, (uint32_t*) word, op, val, nullptr, nullptr, 0);
+}
+
+/* Two threads pass a token back and forth through a futex word, sleeping in the kernel every
+ * time. This measures the futex wait/wake round trip (and the hash bucket contention in it). */
+static void futex_pingpong_bench(benchmark::State& state)
+{
+    std::atomic<uint32_t> turn{0};
+    std::atomic<bool> done{false};
+
+    std::thread peer{[&]() {
+        while (true)
+        {
+            while (turn.load() != 1)
+            {
+                if (done.load())
+                    return;
+                futex(&turn, FUTEX_WAIT_PRIVATE, 0);
+            }
+
+            turn.store(0);
+            futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+        }
+    }};
+
+    for (auto _ : state)
+    {
+        turn.store(1);
+        futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+
+        while (turn.load() != 0)
+            futex(&turn, FUTEX_WAIT_PRIVATE, 1);
+    }
+
+    done.store(true);
+    turn.store(2);
+    futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+    peer.join();
+}
+
+BENCHMARK(futex_pingpong_bench)->UseRealTime();
+
+#ifdef SYS_futex_waitv
+
+struct futex_waitv_entry
+{
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+/* Same as above, but the peer waits on N futexes with futex_waitv, of which only the last one is
+ * ever woken up */
+static void futex_waitv_pingpong_bench(benchmark::State& state)
+{
+    const unsigned int nr = state.range(0);
+    std::vector<std::atomic<uint32_t>> words(nr);
+    std::atomic<uint32_t>& turn = words[nr - 1];
+    std::atomic<bool> done{false};
+
+    std::thread peer{[&]() {
+        std::vector<futex_waitv_entry> waiters(nr);
+
+        for (unsigned int i = 0; i < nr; i++)
+        {
+            waiters[i].uaddr = (uint64_t) (uintptr_t) &words[i];
+            /* FUTEX_32 | FUTEX_PRIVATE_FLAG */
+            waiters[i].flags = 2 | 128;
+            waiters[i].reserved = 0;
+        }
+
+        while (true)
+        {
+            while (turn.load() != 1)
+            {
+                if (done.load())
+                    return;
+                for (unsigned int i = 0; i < nr; i++)
+                    waiters[i].val = words[i].load();
+                syscall(SYS_futex_waitv, waiters.data(), nr, 0, nullptr, CLOCK_MONOTONIC);
+            }
+
+            turn.store(0);
+            futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+        }
+    }};
+
+    for (auto _ : state)
+    {
+        turn.store(1);
+        futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+
+        while (turn.load() != 0)
+            futex(&turn, FUTEX_WAIT_PRIVATE, 1);
+    }
+
+    done.store(true);
+    turn.store(2);
+    futex(&turn, FUTEX_WAKE_PRIVATE, 1);
+    peer.join();
+}
+
+BENCHMARK(futex_waitv_pingpong_bench)->Arg(1)->Arg(16)->Arg(128)->UseRealTime();
+
+#endif
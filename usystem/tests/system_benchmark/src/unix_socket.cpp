@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+struct unix_socketpair
+{
+    int fds[2];
+
+    explicit unix_socketpair(int type)
+    {
+        if (socketpair(AF_UNIX, type, 0, fds) < 0)
+            throw std::runtime_error("socketpair failed");
+    }
+
+    ~unix_socketpair()
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+};
+
+/* Stream throughput between two threads. Large transfers should go straight from the writer's
+ * buffer into the (waiting) reader's buffer. */
+static void unix_stream_throughput(benchmark::State& state)
+{
+    unix_socketpair sp{SOCK_STREAM};
+    const size_t size = state.range(0);
+    std::vector<char> wbuf(size, 'a');
+
+    std::thread reader{[&]() {
+        std::vector<char> rbuf(size);
+        while (read(sp.fds[1], rbuf.data(), size) > 0)
+            ;
+    }};
+
+    for (auto _ : state)
+    {
+        size_t written = 0;
+        while (written < size)
+        {
+            ssize_t st = write(sp.fds[0], wbuf.data() + written, size - written);
+            if (st < 0)
+                throw std::runtime_error("write failed");
+            written += st;
+        }
+    }
+
+    shutdown(sp.fds[0], SHUT_WR);
+    reader.join();
+    state.SetBytesProcessed(state.iterations() * size);
+}
+
+BENCHMARK(unix_stream_throughput)->RangeMultiplier(4)->Range(64, 1 << 20)->UseRealTime();
+
+/* One byte ping-pong between two threads, measures the wakeup latency */
+static void unix_pingpong(benchmark::State& state)
+{
+    unix_socketpair sp{(int) state.range(0)};
+
+    std::thread peer{[&]() {
+        char c;
+        while (read(sp.fds[1], &c, 1) == 1 && c != 'q')
+        {
+            if (write(sp.fds[1], &c, 1) != 1)
+                break;
+        }
+    }};
+
+    for (auto _ : state)
+    {
+        char c = 'x';
+        if (write(sp.fds[0], &c, 1) != 1)
+            throw std::runtime_error("write failed");
+        if (read(sp.fds[0], &c, 1) != 1)
+            throw std::runtime_error("read failed");
+    }
+
+    // Tell the peer to stop
+    if (write(sp.fds[0], "q", 1) != 1)
+        throw std::runtime_error("write failed");
+    peer.join();
+}
+
+BENCHMARK(unix_pingpong)->Arg(SOCK_STREAM)->Arg(SOCK_DGRAM)->UseRealTime();
+
+/* Autobind (bind with just the address family) a bunch of sockets. Every autobind should take
+ * about the same time, regardless of how many addresses are taken already. */
+static void unix_autobind(benchmark::State& state)
+{
+    std::vector<int> fds;
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+
+    for (int i = 0; i < state.range(0); i++)
+    {
+        int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd < 0 || bind(fd, (const sockaddr*) &addr, sizeof(sa_family_t)) < 0)
+            throw std::runtime_error("Failed to autobind socket");
+        fds.push_back(fd);
+    }
+
+    for (auto _ : state)
+    {
+        int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd < 0)
+            throw std::runtime_error("socket failed");
+        if (bind(fd, (const sockaddr*) &addr, sizeof(sa_family_t)) < 0)
+            throw std::runtime_error("bind failed");
+        close(fd);
+    }
+
+    for (int fd : fds)
+        close(fd);
+}
+
+BENCHMARK(unix_autobind)->Arg(0)->Arg(1000)->Arg(10000);
@@ -40,3 +40,43 @@ static void write_fault_bench(benchmark::State& state)
 }
 
 BENCHMARK(write_fault_bench);
+
+/* Every thread shares the address space, so each munmap/mprotect has to shoot down the TLBs of the
+ * cpus running the other threads. */
+static void munmap_shootdown_bench(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        void* ptr = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+        assert(ptr != MAP_FAILED);
+        *(volatile int*) ptr = 10;
+        benchmark::ClobberMemory();
+        munmap(ptr, 4096);
+    }
+}
+
+BENCHMARK(munmap_shootdown_bench)->ThreadRange(1, 32)->UseRealTime();
+
+static void mprotect_shootdown_bench(benchmark::State& state)
+{
+    const size_t len = 16 * 4096;
+    void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+    assert(ptr != MAP_FAILED);
+    volatile char* p = (volatile char*) ptr;
+
+    for (size_t i = 0; i < len; i += 4096)
+        p[i] = 1;
+
+    for (auto _ : state)
+    {
+        mprotect(ptr, len, PROT_READ);
+        benchmark::DoNotOptimize(p[0]);
+        mprotect(ptr, len, PROT_READ | PROT_WRITE);
+        p[0] = 2;
+        benchmark::ClobberMemory();
+    }
+
+    munmap(ptr, len);
+}
+
+BENCHMARK(mprotect_shootdown_bench)->ThreadRange(1, 32)->UseRealTime();